@@ -1,100 +1,1967 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2018,2019 IBM Corp.
 
+#define _GNU_SOURCE
 #include "ahb.h"
+#include "arb.h"
+#include "array.h"
+#include "bridge/plan.h"
+#include "bufpool.h"
+#include "checkpoint.h"
+#include "compress.h"
+#include "fill.h"
 #include "log.h"
+#include "progress.h"
+#include "ring.h"
+#include "sink.h"
+#include "span.h"
+#include "tune.h"
+#include "uring.h"
 
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #define AHB_CHUNK (1 << 20)
 
-ssize_t ahb_siphon_out(struct ahb *ctx, uint32_t phys, ssize_t len, int outfd)
+/* Bounds on the chunk size siphons tune towards, AHB_CHUNK to start with */
+#define AHB_TUNE_MIN (64 << 10)
+#define AHB_TUNE_MAX (4 << 20)
+
+/* Granularity of resumption for checkpointed dumps */
+#define AHB_CHECKPOINT_EXTENT (1 << 20)
+
+/* O_DIRECT writes are aligned for any disk's logical block size */
+#define AHB_DIRECT_ALIGN 4096
+
+/* Chunks in flight to the disk, plus the one being read from the bridge */
+#define AHB_URING_DEPTH 4
+
+struct ahb_siphon {
+    struct ring ring;
+    ssize_t len;
+    int fd;
+    bool sparse;
+    size_t blksize;
+    struct compress *compress;
+};
+
+static void ahb_tune_init(struct ahb *ctx, struct tune *tune, size_t max)
+{
+    size_t burst = ctx->drv->caps.burst;
+
+    tune_init(tune, ctx->drv->name, ahb_chunk_size(ctx, AHB_CHUNK),
+              ahb_chunk_size(ctx, AHB_TUNE_MIN), ahb_chunk_size(ctx, max),
+              burst ? burst : AHB_DIRECT_ALIGN);
+}
+
+/* For bridges with a window, group the regions so each mapping is set up once */
+static size_t *ahb_plan(struct ahb *ctx, const struct ahb_iov *iov,
+                        size_t iovcnt, bool write)
+{
+    size_t *order;
+
+    if (!ctx->drv->caps.window || iovcnt < 2)
+        return NULL;
+
+    /* Without memory for a plan, issue the regions as given */
+    if (!(order = malloc(iovcnt * sizeof(*order))))
+        return NULL;
+
+    plan_order(iov, iovcnt, ctx->drv->caps.window, write, order);
+
+    return order;
+}
+
+/*
+ * Reading these has no side effects, so bridges may read more than asked and
+ * adjacent registers can be fetched together. They sit at the same addresses
+ * across the AST2400, AST2500 and AST2600.
+ */
+static const struct ahb_range ahb_prefetch[] = {
+    { .name = "sdmc", .start = 0x1e6e0000, .len = 0x1000 },
+    { .name = "scu", .start = 0x1e6e2000, .len = 0x1000 },
+};
+
+bool ahb_prefetchable(uint32_t phys, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(ahb_prefetch); i++) {
+        if (phys >= ahb_prefetch[i].start &&
+                (uint64_t)phys + len <= ahb_prefetch[i].start + ahb_prefetch[i].len)
+            return true;
+    }
+
+    return false;
+}
+
+bool ahb_prefetch_overlaps(uint32_t phys, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(ahb_prefetch); i++) {
+        if ((uint64_t)phys + len > ahb_prefetch[i].start &&
+                phys < ahb_prefetch[i].start + ahb_prefetch[i].len)
+            return true;
+    }
+
+    return false;
+}
+
+/* A vectored access with its runs of adjacent words merged */
+struct ahb_merged {
+    struct ahb_iov *iov;
+    size_t iovcnt;
+    uint8_t *buf;
+    size_t len;
+};
+
+/* The length of the run of words to merge at the head of @iov, if any */
+static size_t ahb_coalesce_run(const struct ahb_iov *iov, size_t iovcnt)
+{
+    size_t run = plan_word_run(iov, iovcnt);
+
+    return run > 1 && ahb_prefetchable(iov[0].phys, run * 4) ? run : 0;
+}
+
+/*
+ * Returns true with @merged set up if @iov has anything to merge. Falling
+ * short of memory just means the access goes out as it was given.
+ */
+static bool ahb_coalesce(struct ahb *ctx, const struct ahb_iov *iov,
+                         size_t iovcnt, bool write, struct ahb_merged *merged)
+{
+    const struct bridge_caps *caps = &ctx->drv->caps;
+    size_t words = 0, runs = 0;
+    size_t i, j, n, run;
+    uint32_t val;
+    uint8_t *pos;
+
+    /* A bulk access only wins if there's a cost per operation to save */
+    if (!caps->op_ns || (write && !caps->word_writes) || iovcnt < 2)
+        return false;
+
+    for (i = 0; i < iovcnt; i += run ? run : 1) {
+        if ((run = ahb_coalesce_run(&iov[i], iovcnt - i))) {
+            words += run;
+            runs++;
+        }
+    }
+
+    if (!runs)
+        return false;
+
+    merged->len = words * 4;
+    merged->iovcnt = iovcnt - words + runs;
+    merged->iov = malloc(merged->iovcnt * sizeof(*merged->iov));
+    merged->buf = malloc(merged->len);
+    if (!merged->iov || !merged->buf) {
+        free(merged->iov);
+        free(merged->buf);
+        return false;
+    }
+
+    pos = merged->buf;
+    for (i = 0, n = 0; i < iovcnt; i += run ? run : 1, n++) {
+        if (!(run = ahb_coalesce_run(&iov[i], iovcnt - i))) {
+            merged->iov[n] = iov[i];
+            continue;
+        }
+
+        merged->iov[n].phys = iov[i].phys;
+        merged->iov[n].base = pos;
+        merged->iov[n].len = run * 4;
+
+        for (j = 0; j < run; j++, pos += 4) {
+            if (!write)
+                continue;
+
+            memcpy(&val, iov[i + j].base, sizeof(val));
+            val = htole32(val);
+            memcpy(pos, &val, sizeof(val));
+        }
+    }
+
+    logt("%s: merged %zu words into %zu bulk accesses\n", __func__, words, runs);
+
+    return true;
+}
+
+/* Hands the words of the merged runs back to their own regions */
+static void ahb_scatter(const struct ahb_iov *iov, const struct ahb_merged *merged)
+{
+    const struct ahb_iov *m;
+    const uint8_t *pos;
+    size_t i, j, k;
+    uint32_t val;
+
+    for (i = 0, k = 0; k < merged->iovcnt; k++) {
+        m = &merged->iov[k];
+        pos = m->base;
+
+        if (pos < merged->buf || pos >= merged->buf + merged->len) {
+            i++;
+            continue;
+        }
+
+        for (j = 0; j < m->len / 4; j++, i++, pos += 4) {
+            memcpy(&val, pos, sizeof(val));
+            val = le32toh(val);
+            memcpy(iov[i].base, &val, sizeof(val));
+        }
+    }
+}
+
+static void ahb_merged_free(struct ahb_merged *merged)
+{
+    free(merged->iov);
+    free(merged->buf);
+}
+
+/* Charges a vectored op the bridge takes in one go */
+static void ahb_throttle_iov(struct ahb *ctx, const struct ahb_iov *iov,
+                             size_t iovcnt)
+{
+    unsigned int words = 0;
+    size_t bytes = 0;
+    size_t i;
+
+    if (!ctx->throttle)
+        return;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (ahb_iov_is_word(&iov[i]))
+            words++;
+        else
+            bytes += iov[i].len;
+    }
+
+    ahb_throttle_wait(ctx, bytes, words);
+}
+
+static ssize_t ahb_do_readv(struct ahb *ctx, const struct ahb_iov *iov,
+                           size_t iovcnt)
+{
+    ssize_t total = 0;
+    size_t *order;
+    size_t i, k;
+    ssize_t rc;
+
+    if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+        return rc;
+
+    if (ctx->ops->readv) {
+        struct timespec start;
+
+        ahb_throttle_iov(ctx, iov, iovcnt);
+
+        ahb_stats_start(ctx, &start);
+        rc = ctx->ops->readv(ctx, iov, iovcnt);
+        ahb_stats_record(ctx, ahb_op_readv, &start, rc);
+        ahb_record(ctx, ahb_op_readv, iovcnt ? iov[0].phys : 0, NULL,
+                   rc > 0 ? rc : 0, iovcnt, &start, rc);
+
+        return rc;
+    }
+
+    order = ahb_plan(ctx, iov, iovcnt, false);
+
+    for (k = 0; k < iovcnt; k++) {
+        i = order ? order[k] : k;
+
+        if (ahb_iov_is_word(&iov[i])) {
+            uint32_t val;
+
+            if ((rc = ahb_readl(ctx, iov[i].phys, &val)) < 0)
+                goto done;
+            memcpy(iov[i].base, &val, sizeof(val));
+            rc = 4;
+        } else {
+            if ((rc = ahb_read(ctx, iov[i].phys, iov[i].base, iov[i].len)) < 0)
+                goto done;
+        }
+
+        total += rc;
+    }
+
+    rc = total;
+
+done:
+    free(order);
+
+    return rc;
+}
+
+ssize_t ahb_readv(struct ahb *ctx, const struct ahb_iov *iov, size_t iovcnt)
+{
+    struct ahb_merged merged;
+    ssize_t rc;
+
+    ahb_access_begin(ctx);
+
+    if (ahb_coalesce(ctx, iov, iovcnt, false, &merged)) {
+        if ((rc = ahb_do_readv(ctx, merged.iov, merged.iovcnt)) >= 0)
+            ahb_scatter(iov, &merged);
+        ahb_merged_free(&merged);
+    } else {
+        rc = ahb_do_readv(ctx, iov, iovcnt);
+    }
+
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+static ssize_t ahb_do_writev(struct ahb *ctx, const struct ahb_iov *iov,
+                            size_t iovcnt, bool reorder)
+{
+    ssize_t total = 0;
+    size_t *order;
+    size_t i, k;
+    ssize_t rc;
+
+    if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+        return rc;
+
+    if (ctx->ops->writev) {
+        struct timespec start;
+
+        ahb_throttle_iov(ctx, iov, iovcnt);
+
+        ahb_stats_start(ctx, &start);
+        rc = ctx->ops->writev(ctx, iov, iovcnt);
+        ahb_stats_record(ctx, ahb_op_writev, &start, rc);
+        ahb_record(ctx, ahb_op_writev, iovcnt ? iov[0].phys : 0, NULL,
+                   rc > 0 ? rc : 0, iovcnt, &start, rc);
+
+        for (i = 0; i < iovcnt; i++) {
+            mirror_written(iov[i].phys, rc < 0 ? NULL : iov[i].base,
+                           iov[i].len);
+            ahb_count_write(ctx, iov[i].phys, iov[i].len);
+        }
+
+        return rc;
+    }
+
+    order = reorder ? ahb_plan(ctx, iov, iovcnt, true) : NULL;
+
+    for (k = 0; k < iovcnt; k++) {
+        struct timespec start;
+
+        i = order ? order[k] : k;
+
+        ahb_throttle_iov(ctx, &iov[i], 1);
+
+        ahb_stats_start(ctx, &start);
+        if (ahb_iov_is_word(&iov[i])) {
+            uint32_t val;
+
+            /* Use the op directly, ahb_writel() would queue inside a txn */
+            memcpy(&val, iov[i].base, sizeof(val));
+            rc = ahb_ops_call(ctx, writel, iov[i].phys, val);
+            ahb_stats_record(ctx, ahb_op_writel, &start, rc ? rc : 4);
+            ahb_record(ctx, ahb_op_writel, iov[i].phys, NULL, 4, val, &start,
+                       rc ? rc : 4);
+            if (rc < 0)
+                goto done;
+            logt("%s: 0x%08"PRIx32": 0x%08"PRIx32"\n", __func__, iov[i].phys, val);
+            rc = 4;
+        } else {
+            rc = ahb_ops_call(ctx, write, iov[i].phys, iov[i].base,
+                              iov[i].len);
+            ahb_stats_record(ctx, ahb_op_write, &start, rc);
+            ahb_record(ctx, ahb_op_write, iov[i].phys, iov[i].base, iov[i].len,
+                       0, &start, rc);
+            if (rc < 0)
+                goto done;
+        }
+
+        total += rc;
+    }
+
+    rc = total;
+
+done:
+    free(order);
+
+    return rc;
+}
+
+ssize_t ahb_writev(struct ahb *ctx, const struct ahb_iov *iov, size_t iovcnt)
+{
+    struct ahb_merged merged;
+    ssize_t rc;
+
+    ahb_access_begin(ctx);
+
+    /* The merged runs are registers, so they keep their order */
+    if (ahb_coalesce(ctx, iov, iovcnt, true, &merged)) {
+        rc = ahb_do_writev(ctx, merged.iov, merged.iovcnt, false);
+        ahb_merged_free(&merged);
+    } else {
+        rc = ahb_do_writev(ctx, iov, iovcnt, true);
+    }
+
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+int ahb_txn_flush(struct ahb *ctx)
+{
+    struct ahb_txn *txn = &ctx->txn;
+    ssize_t rc;
+    size_t count;
+
+    if (!txn->count)
+        return 0;
+
+    /* Clear the queue first so ahb_writev() doesn't recurse into the flush */
+    count = txn->count;
+    txn->count = 0;
+
+    logt("%s: flushing %zu posted writes\n", __func__, count);
+
+    rc = ahb_writev(ctx, txn->iov, count);
+    if (rc < 0)
+        return rc;
+
+    return rc == (ssize_t)(count * sizeof(uint32_t)) ? 0 : -EIO;
+}
+
+int ahb_txn_queue(struct ahb *ctx, uint32_t phys, uint32_t val)
+{
+    struct ahb_txn *txn = &ctx->txn;
+    int rc;
+
+    if (txn->count == AHB_TXN_MAX && (rc = ahb_txn_flush(ctx)) < 0)
+        return rc;
+
+    txn->val[txn->count] = val;
+    txn->iov[txn->count].phys = phys;
+    txn->iov[txn->count].base = &txn->val[txn->count];
+    txn->iov[txn->count].len = sizeof(txn->val[txn->count]);
+    txn->count++;
+
+    logt("%s: 0x%08"PRIx32": 0x%08"PRIx32"\n", __func__, phys, val);
+
+    return 0;
+}
+
+/* While shared, the lock taken here is dropped by the matching commit */
+void ahb_txn_begin(struct ahb *ctx)
+{
+    ahb_access_begin(ctx);
+    ctx->txn.depth++;
+}
+
+int ahb_txn_commit(struct ahb *ctx)
+{
+    int rc = 0;
+
+    assert(ctx->txn.depth);
+
+    if (!--ctx->txn.depth)
+        rc = ahb_txn_flush(ctx);
+
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+int ahb_session_begin(struct ahb *ctx)
+{
+    int rc = 0;
+
+    ahb_access_begin(ctx);
+
+    if (ctx->session++ || !ctx->ops->session)
+        goto done;
+
+    if ((rc = ctx->ops->session(ctx, true)) < 0)
+        ctx->session--;
+
+done:
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+int ahb_session_end(struct ahb *ctx)
+{
+    int rc = 0;
+
+    ahb_access_begin(ctx);
+
+    assert(ctx->session);
+
+    if (!--ctx->session && ctx->ops->session)
+        rc = ctx->ops->session(ctx, false);
+
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+void ahb_lock_init(struct ahb *ctx)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&ctx->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    ctx->held = 0;
+}
+
+void ahb_share(struct ahb *ctx, bool shared)
+{
+    ctx->shared = shared;
+}
+
+void ahb_lock(struct ahb *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->held++;
+}
+
+void ahb_unlock(struct ahb *ctx)
+{
+    assert(ctx->held);
+
+    ctx->held--;
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void ahb_usleep(struct ahb *ctx, unsigned int us)
+{
+    unsigned int held, i;
+
+    if (!ctx->shared) {
+        if (ctx->arb)
+            ahb_arb_leave(ctx, true);
+        usleep(us);
+        return;
+    }
+
+    /* Taking it once more makes @held ours to read, held or not before */
+    ahb_lock(ctx);
+    if (ctx->arb)
+        ahb_arb_leave(ctx, true);
+    held = ctx->held;
+    ctx->held = 0;
+
+    for (i = 0; i < held; i++)
+        pthread_mutex_unlock(&ctx->lock);
+
+    usleep(us);
+
+    for (i = 0; i < held; i++)
+        pthread_mutex_lock(&ctx->lock);
+
+    ctx->held = held;
+    ahb_unlock(ctx);
+}
+
+void ahb_throttle_wait(struct ahb *ctx, size_t bulk, unsigned int reg)
+{
+    uint64_t wait;
+
+    if (!(wait = throttle_reserve(ctx->throttle, bulk, reg) / 1000))
+        return;
+
+    /* Handing over mid-transaction would let other threads' writes queue */
+    if (ctx->txn.depth)
+        usleep(wait);
+    else
+        ahb_usleep(ctx, wait);
+}
+
+ssize_t ahb_read_throttled(struct ahb *ctx, uint32_t phys, void *buf,
+                           size_t len)
+{
+    size_t quantum = ctx->throttle->quantum;
+    size_t done = 0, piece;
+    ssize_t rc;
+
+    do {
+        piece = len - done > quantum ? quantum : len - done;
+
+        ahb_access_begin(ctx);
+        ahb_throttle_wait(ctx, piece, 0);
+        rc = ahb_read_once(ctx, phys + done, (char *)buf + done, piece);
+        ahb_access_end(ctx);
+
+        if (rc < 0)
+            return rc;
+
+        done += rc;
+    } while (done < len && (size_t)rc == piece);
+
+    return done;
+}
+
+ssize_t ahb_write_throttled(struct ahb *ctx, uint32_t phys, const void *buf,
+                            size_t len)
+{
+    size_t quantum = ctx->throttle->quantum;
+    size_t done = 0, piece;
+    ssize_t rc;
+
+    do {
+        piece = len - done > quantum ? quantum : len - done;
+
+        ahb_access_begin(ctx);
+        ahb_throttle_wait(ctx, piece, 0);
+        rc = ahb_write_once(ctx, phys + done, (const char *)buf + done,
+                            piece);
+        ahb_access_end(ctx);
+
+        if (rc < 0)
+            return rc;
+
+        done += rc;
+    } while (done < len && (size_t)rc == piece);
+
+    return done;
+}
+
+static uint64_t ahb_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/* How long a contended resource is kept before it's handed over */
+#define AHB_ARB_QUANTUM_US 10000
+
+struct ahb_arb {
+    struct arb arb;
+    char resource[64];
+    uint64_t check_us;
+    /* The driver's release() or reinit() is running, don't recurse */
+    bool busy;
+};
+
+int ahb_arbitrate(struct ahb *ctx, const char *resource)
+{
+    struct ahb_arb *arb;
+    int rc;
+
+    if (!(arb = malloc(sizeof(*arb))))
+        return -ENOMEM;
+
+    if ((rc = arb_open(&arb->arb, resource)) < 0) {
+        if (rc != -ENOTSUP)
+            logd("Not arbitrating %s: %d\n", resource, rc);
+        free(arb);
+        return rc;
+    }
+
+    snprintf(arb->resource, sizeof(arb->resource), "%s", resource);
+    arb->check_us = 0;
+    arb->busy = false;
+    ctx->arb = arb;
+
+    return 0;
+}
+
+struct ahb_arb *ahb_arbitrate_detach(struct ahb *ctx)
+{
+    struct ahb_arb *arb = ctx->arb;
+
+    if (arb) {
+        ahb_arb_enter(ctx);
+        ctx->arb = NULL;
+    }
+
+    return arb;
+}
+
+void ahb_arbitrate_end(struct ahb_arb *arb)
+{
+    if (!arb)
+        return;
+
+    arb_close(&arb->arb);
+    free(arb);
+}
+
+void ahb_arb_enter(struct ahb *ctx)
+{
+    struct ahb_arb *arb = ctx->arb;
+    int rc;
+
+    if (arb->arb.held || arb->busy)
+        return;
+
+    if ((rc = arb_acquire(&arb->arb)) < 0) {
+        logd("Failed to acquire %s, continuing without it: %d\n",
+             arb->resource, rc);
+        return;
+    }
+
+    arb->check_us = ahb_now_us() + AHB_ARB_QUANTUM_US;
+
+    /* Another process had the hardware, the driver's view of it is stale */
+    if (!rc || !ctx->drv->reinit)
+        return;
+
+    arb->busy = true;
+    if ((rc = ctx->drv->reinit(ctx)) < 0)
+        loge("Failed to resume %s after another process: %d\n",
+             arb->resource, rc);
+    arb->busy = false;
+}
+
+void ahb_arb_leave(struct ahb *ctx, bool idle)
+{
+    struct ahb_arb *arb = ctx->arb;
+    uint64_t now;
+    int rc;
+
+    if (!arb->arb.held || arb->busy || ctx->txn.depth ||
+            ctx->held > (ctx->shared ? 1 : 0))
+        return;
+
+    /* Sleeping, it's handed over whenever it's wanted */
+    if (!idle) {
+        if ((now = ahb_now_us()) < arb->check_us)
+            return;
+
+        arb->check_us = now + AHB_ARB_QUANTUM_US;
+    }
+
+    if (!arb_contended(&arb->arb))
+        return;
+
+    arb->busy = true;
+    if (ctx->drv->release && (rc = ctx->drv->release(ctx)) < 0)
+        loge("Failed to release %s for another process: %d\n",
+             arb->resource, rc);
+    arb->busy = false;
+
+    arb_release(&arb->arb);
+}
+
+void ahb_poller_start(struct ahb *ctx, struct ahb_poller *poller,
+                      const struct ahb_poll_policy *policy,
+                      uint64_t timeout_us)
+{
+    static const struct ahb_poll_policy ahb_poll_spin = { 0 };
+
+    poller->policy = policy ? policy : &ahb_poll_spin;
+    poller->deadline = ahb_now_us() + timeout_us;
+    poller->interval = poller->policy->interval_us;
+
+    if (poller->policy->holdoff_us)
+        ahb_usleep(ctx, poller->policy->holdoff_us);
+}
+
+bool ahb_poller_next(struct ahb *ctx, struct ahb_poller *poller)
+{
+    uint64_t now = ahb_now_us();
+    unsigned int delay;
+
+    if (now >= poller->deadline)
+        return false;
+
+    if (!poller->interval)
+        return true;
+
+    /* Always read once more after the last sleep */
+    delay = poller->interval;
+    if (delay > poller->deadline - now)
+        delay = poller->deadline - now;
+    ahb_usleep(ctx, delay);
+
+    if (poller->interval < poller->policy->max_us)
+        poller->interval = poller->interval * 2 < poller->policy->max_us ?
+                           poller->interval * 2 : poller->policy->max_us;
+
+    return true;
+}
+
+uint64_t ahb_poller_remaining(const struct ahb_poller *poller)
+{
+    uint64_t now = ahb_now_us();
+
+    return now < poller->deadline ? poller->deadline - now : 0;
+}
+
+int ahb_poll(struct ahb *ctx, uint32_t phys, uint32_t mask, uint32_t value,
+             uint64_t timeout_us, const struct ahb_poll_policy *policy,
+             uint32_t *val)
+{
+    struct ahb_poller poller;
+    struct timespec start;
+    uint32_t last = 0;
+    int rc;
+
+    if (!val)
+        val = &last;
+
+    /*
+     * A recording has to hold every read for a replay to see the same
+     * sequence, and a shared bridge is handed over between the reads.
+     */
+    if (ctx->ops->poll && ctx->record < 0 && !ctx->shared) {
+        if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+            return rc;
+
+        ahb_throttle(ctx, 0, 1);
+
+        ahb_stats_start(ctx, &start);
+        rc = ctx->ops->poll(ctx, phys, mask, value, timeout_us, policy, val);
+        if (rc != -ENOTSUP) {
+            ahb_stats_record(ctx, ahb_op_poll, &start,
+                             rc ? rc : (int)sizeof(*val));
+            if (!rc)
+                logt("%s: 0x%08"PRIx32": 0x%08"PRIx32"\n", __func__, phys, *val);
+            return rc;
+        }
+    }
+
+    ahb_poller_start(ctx, &poller, policy, timeout_us);
+    do {
+        if ((rc = ahb_readl(ctx, phys, val)) < 0)
+            return rc;
+
+        if ((*val & mask) == value)
+            return 0;
+    } while (ahb_poller_next(ctx, &poller));
+
+    return -ETIMEDOUT;
+}
+
+int ahb_modifyl(struct ahb *ctx, uint32_t phys, uint32_t clear, uint32_t set)
+{
+    struct timespec start;
+    uint32_t val;
+    int rc;
+
+    /* No other thread's write may land between the read and the write */
+    ahb_access_begin(ctx);
+
+    /* A replay has to see the read and the write the recording made */
+    if (ctx->ops->modifyl && ctx->record < 0) {
+        if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+            goto done;
+
+        ahb_throttle(ctx, 0, 2);
+
+        ahb_stats_start(ctx, &start);
+        rc = ctx->ops->modifyl(ctx, phys, clear, set);
+        if (rc != -ENOTSUP) {
+            mirror_written(phys, NULL, sizeof(val));
+            ahb_count_write(ctx, phys, sizeof(val));
+            ahb_stats_record(ctx, ahb_op_modifyl, &start,
+                             rc ? rc : (int)sizeof(val));
+            if (!rc)
+                logt("%s: 0x%08"PRIx32": ~0x%08"PRIx32" 0x%08"PRIx32"\n",
+                     __func__, phys, clear, set);
+            goto done;
+        }
+    }
+
+    if ((rc = ahb_readl(ctx, phys, &val)) < 0)
+        goto done;
+
+    rc = ahb_writel(ctx, phys, (val & ~clear) | set);
+
+done:
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+static int ahb_siphon_write(int fd, const void *buf, size_t len)
+{
+    ssize_t egress;
+
+    while (len) {
+        egress = write(fd, buf, len);
+        if (egress == -1)
+            return -errno;
+
+        buf += egress;
+        len -= egress;
+    }
+
+    return 0;
+}
+
+/* Seeks over each zero block of @buf rather than writing it out */
+static int ahb_siphon_write_sparse(struct ahb_siphon *siphon, const void *buf,
+                                   size_t len, bool *hole)
+{
+    size_t egress;
+    int rc;
+
+    while (len) {
+        egress = len > siphon->blksize ? siphon->blksize : len;
+
+        if (fill_is_zero(buf, egress)) {
+            if (lseek(siphon->fd, egress, SEEK_CUR) < 0)
+                return -errno;
+            *hole = true;
+        } else {
+            if ((rc = ahb_siphon_write(siphon->fd, buf, egress)) < 0)
+                return rc;
+            *hole = false;
+        }
+
+        buf += egress;
+        len -= egress;
+    }
+
+    return 0;
+}
+
+static void *ahb_siphon_drain(void *arg)
+{
+    struct ahb_siphon *siphon = arg;
+    struct ring_slot *slot;
+    bool hole = false;
+    off_t end;
+    int rc;
+
+    span_thread_name("siphon-drain");
+
+    while ((slot = ring_get_full(&siphon->ring))) {
+        if (siphon->compress)
+            rc = compress_write(siphon->compress, siphon->fd, slot->buf,
+                                slot->len);
+        else if (siphon->sparse)
+            rc = ahb_siphon_write_sparse(siphon, slot->buf, slot->len, &hole);
+        else
+            rc = ahb_siphon_write(siphon->fd, slot->buf, slot->len);
+
+        if (rc < 0) {
+            ring_abort(&siphon->ring, rc);
+            return NULL;
+        }
+
+        ring_put_empty(&siphon->ring);
+    }
+
+    if (siphon->compress && !ring_status(&siphon->ring)) {
+        if ((rc = compress_finish(siphon->compress, siphon->fd)) < 0)
+            ring_abort(&siphon->ring, rc);
+    }
+
+    /* A trailing hole doesn't extend the file until something is written */
+    if (hole && !ring_status(&siphon->ring)) {
+        if ((end = lseek(siphon->fd, 0, SEEK_CUR)) < 0 ||
+            ftruncate(siphon->fd, end))
+            ring_abort(&siphon->ring, -errno);
+    }
+
+    return NULL;
+}
+
+/*
+ * Punches out the whole blocks of zeros in @buf, which holds the file's data
+ * at @offset. Returns false if the filesystem can't punch holes.
+ */
+static bool ahb_siphon_punch(int fd, off_t offset, const uint8_t *buf,
+                             size_t len, size_t blksize)
+{
+    off_t cursor, end, hole;
+
+    cursor = (offset + blksize - 1) & ~(off_t)(blksize - 1);
+    end = offset + len;
+    hole = -1;
+
+    for (; cursor + (off_t)blksize <= end; cursor += blksize) {
+        if (fill_is_zero(buf + (cursor - offset), blksize)) {
+            if (hole < 0)
+                hole = cursor;
+            continue;
+        }
+
+        if (hole >= 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                                   hole, cursor - hole))
+            return false;
+        hole = -1;
+    }
+
+    if (hole >= 0 && fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                               hole, cursor - hole))
+        return false;
+
+    return true;
+}
+
+/* Returns a descriptor for @fd that can be mapped for writing, or -1 */
+static int ahb_siphon_map_fd(int fd)
+{
+    char path[sizeof("/proc/self/fd/") + 11];
+    int flags;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0)
+        return -1;
+
+    if ((flags & O_ACCMODE) == O_RDWR)
+        return dup(fd);
+
+    /* Shell redirections are write-only, reopen the file read-write */
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    return open(path, O_RDWR);
+}
+
+/*
+ * Read straight into the page cache of a regular output file, avoiding the
+ * bounce through a chunk buffer and write(2). Writeback of each chunk is
+ * started as soon as it's filled, and the pages of the chunk before it are
+ * dropped, so the page cache doesn't grow with the size of the dump.
+ *
+ * Returns -ENOTSUP before touching the output if the file can't be mapped.
+ */
+static ssize_t ahb_siphon_out_mapped(struct ahb *ctx, uint32_t phys, ssize_t len,
+                                     int outfd, bool sparse,
+                                     struct digest *digest,
+                                     struct progress *progress)
+{
+    off_t start, offset, aligned, prev;
+    ssize_t chunk_len, ingress;
+    struct stat statbuf;
+    struct tune tune;
+    uint64_t begin;
+    size_t map_len;
+    size_t blksize;
+    long pgsize;
+    size_t delta;
+    void *map;
+    int mapfd;
+    int rc;
+
+    if (len < 0 || fstat(outfd, &statbuf) || !S_ISREG(statbuf.st_mode))
+        return -ENOTSUP;
+
+    if ((start = lseek(outfd, 0, SEEK_CUR)) < 0)
+        return -ENOTSUP;
+
+    if ((mapfd = ahb_siphon_map_fd(outfd)) < 0)
+        return -ENOTSUP;
+
+    if (statbuf.st_size < start + len && ftruncate(mapfd, start + len)) {
+        rc = -ENOTSUP;
+        goto cleanup_mapfd;
+    }
+
+    pgsize = sysconf(_SC_PAGE_SIZE);
+    blksize = statbuf.st_blksize ? (size_t)statbuf.st_blksize : (size_t)pgsize;
+    ahb_tune_init(ctx, &tune, AHB_TUNE_MAX);
+    offset = start;
+    prev = -1;
+    rc = 0;
+
+    while (len) {
+        begin = tune_now();
+        chunk_len = tune_size(&tune);
+        ingress = len > chunk_len ? chunk_len : len;
+
+        aligned = offset & ~(off_t)(pgsize - 1);
+        delta = offset - aligned;
+
+        map_len = ingress + delta;
+        map = mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_SHARED, mapfd,
+                   aligned);
+        if (map == MAP_FAILED) {
+            rc = (offset == start) ? -ENOTSUP : -errno;
+            break;
+        }
+
+        ingress = ahb_read(ctx, phys, map + delta, ingress);
+        if (ingress > 0 && sparse)
+            sparse = ahb_siphon_punch(mapfd, offset, map + delta, ingress,
+                                      blksize);
+        if (ingress > 0 && digest)
+            rc = digest_feed(digest, map + delta, ingress);
+        munmap(map, map_len);
+        if (ingress < 0) {
+            rc = -EIO;
+            break;
+        }
+
+        if (rc < 0)
+            break;
+
+        sync_file_range(mapfd, offset, ingress, SYNC_FILE_RANGE_WRITE);
+        if (prev >= 0) {
+            sync_file_range(mapfd, prev, offset - prev,
+                            SYNC_FILE_RANGE_WAIT_BEFORE |
+                            SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER);
+            posix_fadvise(mapfd, prev, offset - prev, POSIX_FADV_DONTNEED);
+        }
+
+        prev = offset;
+        offset += ingress;
+        phys += ingress;
+        len -= ingress;
+
+        progress_update(progress, ingress);
+        tune_sample(&tune, ingress, tune_now() - begin);
+    }
+
+    if (rc != -ENOTSUP)
+        lseek(outfd, offset, SEEK_SET);
+
+cleanup_mapfd:
+    close(mapfd);
+
+    return rc;
+}
+
+/*
+ * Seeking over zero blocks is only safe if there's no existing data beyond the
+ * cursor that would show through, and only useful if the file can hold holes.
+ */
+static bool ahb_siphon_can_seek(int fd, size_t *blksize)
+{
+    struct stat statbuf;
+    off_t cursor;
+    int flags;
+
+    if (fstat(fd, &statbuf) || !S_ISREG(statbuf.st_mode))
+        return false;
+
+    if ((flags = fcntl(fd, F_GETFL)) < 0 || (flags & O_APPEND))
+        return false;
+
+    if ((cursor = lseek(fd, 0, SEEK_CUR)) < 0 || statbuf.st_size > cursor)
+        return false;
+
+    *blksize = statbuf.st_blksize ? (size_t)statbuf.st_blksize : 4096;
+
+    return true;
+}
+
+/*
+ * The bridge is only ever accessed from the calling thread, the file
+ * descriptor is serviced by a worker so the two sides of the copy overlap.
+ */
+static ssize_t ahb_siphon_out_ring(struct ahb *ctx, uint32_t phys, ssize_t len,
+                                   int outfd, bool sparse,
+                                   struct compress *compress,
+                                   struct digest *digest,
+                                   struct progress *progress)
 {
-    ssize_t ingress, egress;
-    void *chunk, *cursor;
-    int rc = 0;
+    struct ahb_siphon _siphon, *siphon = &_siphon;
+    struct ring_slot *slot;
+    ssize_t chunk_len;
+    ssize_t ingress;
+    struct tune tune;
+    pthread_t worker;
+    uint64_t begin;
+    int rc;
 
-    if (!len)
-        return 0;
+    /* Slots are sized for the largest chunk the tuner may settle on */
+    ahb_tune_init(ctx, &tune, AHB_TUNE_MAX);
+    if ((rc = ring_init(&siphon->ring, tune.max)) < 0)
+        return rc;
 
-    chunk = malloc(AHB_CHUNK);
-    if (!chunk)
-        return -errno;
+    siphon->fd = outfd;
+    siphon->compress = compress;
+    siphon->sparse = sparse && ahb_siphon_can_seek(outfd, &siphon->blksize);
+
+    if (sparse && !siphon->sparse)
+        logd("Output can't hold holes, writing zero blocks out in full\n");
+
+    if ((rc = -pthread_create(&worker, NULL, ahb_siphon_drain, siphon)))
+        goto cleanup_ring;
 
     do {
-        ingress = (len > AHB_CHUNK || len == -1) ? AHB_CHUNK : len;
+        /* Time spent waiting on the writer counts against the chunk size */
+        begin = tune_now();
+        if (!(slot = ring_get_empty(&siphon->ring)))
+            break;
+
+        chunk_len = tune_size(&tune);
+        ingress = (len > chunk_len || len == -1) ? chunk_len : len;
+
+        ingress = ahb_read(ctx, phys, slot->buf, ingress);
+        if (ingress < 0) {
+            ring_abort(&siphon->ring, -EIO);
+            break;
+        }
+
+        if (digest && (rc = digest_feed(digest, slot->buf, ingress)) < 0) {
+            ring_abort(&siphon->ring, rc);
+            break;
+        }
 
-        ingress = ahb_read(ctx, phys, chunk, ingress);
-        if (ingress < 0) { rc = -EIO; goto done; }
+        slot->len = ingress;
+        ring_put_full(&siphon->ring);
 
         phys += ingress;
         if (len > 0) {
             len -= ingress;
         }
 
-        cursor = chunk;
-        while (ingress) {
-            egress = write(outfd, cursor, ingress);
-            if (egress == -1) { rc = -errno; goto done; }
+        progress_update(progress, ingress);
+        tune_sample(&tune, ingress, tune_now() - begin);
+    } while (!!len);
+
+    ring_finish(&siphon->ring);
+    pthread_join(worker, NULL);
+
+    rc = ring_status(&siphon->ring);
+
+cleanup_ring:
+    ring_destroy(&siphon->ring);
+
+    return rc;
+}
+
+/* Returns a descriptor for @fd that writes around the page cache, or -1 */
+static int ahb_siphon_direct_fd(int fd)
+{
+    char path[sizeof("/proc/self/fd/") + 11];
+
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", fd);
+
+    return open(path, O_WRONLY | O_DIRECT);
+}
+
+/*
+ * Keep several chunk writes in flight to a regular output file through
+ * io_uring, around the page cache, so the disk's queue stays deep while the
+ * calling thread gets on with reading the bridge. The reader only waits on
+ * the disk once every buffer is in flight.
+ *
+ * O_DIRECT needs aligned offsets and lengths, so the dump must start at an
+ * aligned offset, and the ragged end of the last chunk goes through the page
+ * cache once the rest has been written.
+ *
+ * Returns -ENOTSUP before touching the output if the file can't be opened
+ * for O_DIRECT or io_uring isn't available.
+ */
+static ssize_t ahb_siphon_out_uring(struct ahb *ctx, uint32_t phys, ssize_t len,
+                                    int outfd, struct digest *digest,
+                                    struct progress *progress)
+{
+    struct iovec bufs[AHB_URING_DEPTH];
+    unsigned int idle[AHB_URING_DEPTH];
+    size_t lens[AHB_URING_DEPTH];
+    size_t chunk_len, aligned;
+    size_t tail_len = 0;
+    off_t start, offset;
+    off_t tail_off = 0;
+    void *tail = NULL;
+    struct stat statbuf;
+    struct uring uring;
+    unsigned int nidle;
+    unsigned int i;
+    ssize_t ingress;
+    bool registered;
+    uint64_t tag;
+    int directfd;
+    int written;
+    int flags;
+    void *pool;
+    int res;
+    int rc;
+
+    if (len < 0 || fstat(outfd, &statbuf) || !S_ISREG(statbuf.st_mode))
+        return -ENOTSUP;
+
+    if ((flags = fcntl(outfd, F_GETFL)) < 0 || (flags & O_APPEND))
+        return -ENOTSUP;
+
+    if ((start = lseek(outfd, 0, SEEK_CUR)) < 0 ||
+        (start & (AHB_DIRECT_ALIGN - 1))) {
+        logd("Output offset isn't aligned for O_DIRECT\n");
+        return -ENOTSUP;
+    }
+
+    if ((directfd = ahb_siphon_direct_fd(outfd)) < 0) {
+        logd("Failed to open output for O_DIRECT: %d\n", -errno);
+        return -ENOTSUP;
+    }
+
+    chunk_len = ahb_chunk_size(ctx, AHB_CHUNK);
+    chunk_len &= ~(size_t)(AHB_DIRECT_ALIGN - 1);
+    if (!chunk_len)
+        chunk_len = AHB_DIRECT_ALIGN;
+
+    /* Pages are aligned as O_DIRECT needs */
+    if (!(pool = bufpool_get(AHB_URING_DEPTH * chunk_len))) {
+        rc = -ENOMEM;
+        goto cleanup_directfd;
+    }
+
+    if ((rc = uring_init(&uring, AHB_URING_DEPTH)) < 0)
+        goto cleanup_pool;
+
+    for (i = 0; i < AHB_URING_DEPTH; i++) {
+        bufs[i].iov_base = (char *)pool + i * chunk_len;
+        bufs[i].iov_len = chunk_len;
+        idle[i] = i;
+    }
+
+    /* Saves pinning the pages for each write, within RLIMIT_MEMLOCK */
+    registered = !uring_register_buffers(&uring, bufs, AHB_URING_DEPTH);
+    if (!registered)
+        logd("Failed to register write buffers, continuing without\n");
+
+    nidle = AHB_URING_DEPTH;
+    offset = start;
+    rc = 0;
+
+    while ((len && !rc) || nidle < AHB_URING_DEPTH) {
+        if (len && !rc && nidle) {
+            i = idle[--nidle];
+
+            ingress = len > (ssize_t)chunk_len ? (ssize_t)chunk_len : len;
+            if (ahb_read(ctx, phys, bufs[i].iov_base, ingress) != ingress) {
+                idle[nidle++] = i;
+                rc = -EIO;
+                continue;
+            }
+
+            if (digest &&
+                (rc = digest_feed(digest, bufs[i].iov_base, ingress)) < 0) {
+                idle[nidle++] = i;
+                continue;
+            }
+
+            /* Only the last chunk can be ragged */
+            aligned = ingress & ~(size_t)(AHB_DIRECT_ALIGN - 1);
+            if (aligned < (size_t)ingress) {
+                tail = (char *)bufs[i].iov_base + aligned;
+                tail_len = ingress - aligned;
+                tail_off = offset + aligned;
+            }
+
+            if (aligned) {
+                lens[i] = aligned;
+                rc = uring_write(&uring, directfd, registered ? (int)i : -1,
+                                 bufs[i].iov_base, aligned, offset, i);
+            }
+
+            if (!aligned || rc < 0)
+                idle[nidle++] = i;
+
+            offset += ingress;
+            phys += ingress;
+            len -= ingress;
+
+            progress_update(progress, ingress);
+            continue;
+        }
+
+        if ((res = uring_wait(&uring, &tag, &written)) < 0) {
+            rc = res;
+            break;
+        }
+
+        if (!rc && written < 0)
+            rc = written;
+        else if (!rc && (size_t)written != lens[tag])
+            rc = -EIO;
+
+        idle[nidle++] = tag;
+    }
+
+    if (!rc && tail_len &&
+        pwrite(outfd, tail, tail_len, tail_off) != (ssize_t)tail_len)
+        rc = -EIO;
+
+    lseek(outfd, offset, SEEK_SET);
+
+    uring_destroy(&uring);
+
+cleanup_pool:
+    bufpool_put(pool, AHB_URING_DEPTH * chunk_len);
+
+cleanup_directfd:
+    close(directfd);
+
+    return rc;
+}
+
+static ssize_t ahb_siphon_out_range(struct ahb *ctx, uint32_t phys,
+                                    ssize_t len, int outfd, bool sparse,
+                                    bool direct, struct digest *digest,
+                                    struct progress *progress)
+{
+    ssize_t rc;
+
+    if (direct) {
+        rc = ahb_siphon_out_uring(ctx, phys, len, outfd, digest, progress);
+        if (rc != -ENOTSUP)
+            return rc;
+
+        logd("Can't write output directly, going through the page cache\n");
+    }
+
+    rc = ahb_siphon_out_mapped(ctx, phys, len, outfd, sparse, digest,
+                               progress);
+    if (rc != -ENOTSUP)
+        return rc;
+
+    return ahb_siphon_out_ring(ctx, phys, len, outfd, sparse, NULL, digest,
+                               progress);
+}
+
+/*
+ * Compression happens on the worker that drains the ring, so it overlaps with
+ * the bridge reads rather than adding to them.
+ */
+static ssize_t ahb_siphon_out_compressed(struct ahb *ctx, uint32_t phys,
+                                         ssize_t len, int outfd,
+                                         const struct ahb_siphon_opts *opts,
+                                         struct digest *digest)
+{
+    struct compress compress;
+    struct progress progress;
+    ssize_t rc;
+
+    if (opts->checkpoint || opts->sparse || opts->direct) {
+        loge("Compressed dumps can't be sparse, checkpointed or direct\n");
+        return -EINVAL;
+    }
+
+    if ((rc = compress_init(&compress, opts->compress_level)) < 0)
+        return rc;
+
+    progress_init(&progress, "read", len > 0 ? len : 0);
+    progress_set_base(&progress, phys);
+    rc = ahb_siphon_out_ring(ctx, phys, len, outfd, false, &compress, digest,
+                             &progress);
+    progress_end(&progress);
+
+    if (!rc && compress.ingress)
+        logi("Compressed %" PRIu64 " bytes to %" PRIu64 " (%.1f%%)\n",
+             compress.ingress, compress.egress,
+             compress.egress * 100.0 / compress.ingress);
+
+    compress_destroy(&compress);
+
+    return rc;
+}
+
+/*
+ * Reads straight into the sink set's slots, which each sink's worker drains
+ * to its own destination.
+ */
+static ssize_t ahb_siphon_out_sinks(struct ahb *ctx, uint32_t phys,
+                                    ssize_t len,
+                                    const struct ahb_siphon_opts *opts,
+                                    struct digest *digest)
+{
+    struct sink_set sinks;
+    struct progress progress;
+    struct sink_slot *slot;
+    ssize_t chunk_len;
+    ssize_t ingress;
+    struct tune tune;
+    uint64_t begin;
+    ssize_t rc;
+
+    /* @compress only sets the level of any zstd: sinks */
+    if (opts->checkpoint || opts->sparse || opts->direct) {
+        loge("Dumps to sinks can't be sparse, checkpointed or direct\n");
+        return -EINVAL;
+    }
+
+    ahb_tune_init(ctx, &tune, AHB_TUNE_MAX);
+    rc = sink_set_init(&sinks, opts->sinks, opts->nr_sinks, tune.max,
+                       opts->compress_level);
+    if (rc < 0)
+        return rc;
+
+    progress_init(&progress, "read", len > 0 ? len : 0);
+    progress_set_base(&progress, phys);
+    do {
+        /* The slowest sink holds up the next slot, and so the tuner */
+        begin = tune_now();
+        slot = sink_set_get(&sinks);
+
+        chunk_len = tune_size(&tune);
+        ingress = (len > chunk_len || len == -1) ? chunk_len : len;
+
+        if ((ingress = ahb_read(ctx, phys, slot->buf, ingress)) < 0) {
+            rc = -EIO;
+            break;
+        }
+
+        if (digest && (rc = digest_feed(digest, slot->buf, ingress)) < 0)
+            break;
 
-            cursor += egress;
-            ingress -= egress;
+        sink_set_put(&sinks, ingress);
+
+        phys += ingress;
+        if (len > 0) {
+            len -= ingress;
         }
 
-        fprintf(stderr, ".");
+        progress_update(&progress, ingress);
+        tune_sample(&tune, ingress, tune_now() - begin);
     } while (!!len);
+    progress_end(&progress);
 
-done:
-    fprintf(stderr, "\n");
-    free(chunk);
+    /* A failed read takes precedence, then whichever sink failed first */
+    ingress = sink_set_finish(&sinks);
+    if (!rc)
+        rc = ingress;
+
+    sink_set_destroy(&sinks);
 
     return rc;
 }
 
-ssize_t ahb_siphon_in(struct ahb *ctx, uint32_t phys, ssize_t len, int infd)
+/* Hashes the part of the output a resumed dump won't read again */
+static int ahb_siphon_digest_back(struct digest *digest, int datafd,
+                                  off_t offset, size_t len)
 {
-    ssize_t ingress, egress;
-    void *chunk;
+    ssize_t ingress;
+    void *buf;
     int rc = 0;
 
-    chunk = malloc(AHB_CHUNK);
-    if (!chunk)
-        return -1;
+    if (!len)
+        return 0;
 
-    while ((ingress = read(infd, chunk, (len > AHB_CHUNK || len == -1) ? AHB_CHUNK : len))) {
-        if (ingress < 0) { rc = -errno; goto done; }
+    if (!(buf = bufpool_get(AHB_CHUNK)))
+        return -ENOMEM;
 
-        egress = ahb_write(ctx, phys, chunk, ingress);
-        if (egress < 0) { rc = -EIO; goto done; }
+    while (len) {
+        ingress = pread(datafd, buf, len > AHB_CHUNK ? AHB_CHUNK : len, offset);
+        if (ingress <= 0) {
+            rc = ingress < 0 ? -errno : -ENODATA;
+            break;
+        }
+
+        if ((rc = digest_feed(digest, buf, ingress)) < 0)
+            break;
+
+        offset += ingress;
+        len -= ingress;
+    }
+
+    bufpool_put(buf, AHB_CHUNK);
+
+    return rc;
+}
+
+/*
+ * Dumps the region an extent at a time, recording each in the checkpoint once
+ * it's on disk. Extents left by a previous run are verified against the
+ * output and skipped.
+ */
+static ssize_t ahb_siphon_out_checkpoint(struct ahb *ctx, uint32_t phys,
+                                         ssize_t len, int outfd,
+                                         const struct ahb_siphon_opts *opts,
+                                         struct digest *digest)
+{
+    struct checkpoint checkpoint;
+    struct progress progress;
+    struct stat statbuf;
+    size_t done, extent;
+    off_t start;
+    int datafd;
+    int flags;
+    int rc;
+
+    if (len < 0) {
+        loge("Checkpointed dumps must have a known length\n");
+        return -EINVAL;
+    }
+
+    if (fstat(outfd, &statbuf) || !S_ISREG(statbuf.st_mode) ||
+        (flags = fcntl(outfd, F_GETFL)) < 0 || (flags & O_APPEND)) {
+        loge("Checkpointed dumps must be written to a regular file, without O_APPEND\n");
+        return -EINVAL;
+    }
+
+    if ((start = lseek(outfd, 0, SEEK_CUR)) < 0)
+        return -errno;
+
+    /* The checkpoint reads back the output to verify it */
+    if ((datafd = ahb_siphon_map_fd(outfd)) < 0)
+        return -errno;
+
+    rc = checkpoint_open(&checkpoint, opts->checkpoint, datafd, start, phys,
+                         len, AHB_CHECKPOINT_EXTENT);
+    if (rc < 0) {
+        loge("Failed to open checkpoint '%s': %d\n", opts->checkpoint, rc);
+        goto cleanup_datafd;
+    }
+
+    if (digest && (rc = ahb_siphon_digest_back(digest, datafd, start,
+                                    checkpoint_done_bytes(&checkpoint))) < 0)
+        goto cleanup_checkpoint;
+
+    progress_init(&progress, "read", len - checkpoint_done_bytes(&checkpoint));
+    progress_set_base(&progress, phys + checkpoint_done_bytes(&checkpoint));
+
+    while ((extent = checkpoint_extent_len(&checkpoint, checkpoint.done))) {
+        done = checkpoint_done_bytes(&checkpoint);
+
+        if (lseek(outfd, start + done, SEEK_SET) < 0) {
+            rc = -errno;
+            break;
+        }
+
+        rc = ahb_siphon_out_range(ctx, phys + done, extent, outfd, opts->sparse,
+                                  opts->direct, digest, &progress);
+        if (rc < 0)
+            break;
+
+        if ((rc = checkpoint_record(&checkpoint)) < 0)
+            break;
+    }
+
+    progress_end(&progress);
+
+cleanup_checkpoint:
+    checkpoint_close(&checkpoint);
+
+cleanup_datafd:
+    close(datafd);
+
+    return rc;
+}
+
+ssize_t ahb_siphon_out(struct ahb *ctx, uint32_t phys, ssize_t len, int outfd)
+{
+    return ahb_siphon_out_opts(ctx, phys, len, outfd, NULL);
+}
+
+static ssize_t ahb_siphon_out_digest(struct ahb *ctx, uint32_t phys,
+                                     ssize_t len, int outfd,
+                                     const struct ahb_siphon_opts *opts,
+                                     struct digest *digest)
+{
+    struct progress progress;
+    ssize_t rc;
+
+    if (opts && opts->nr_sinks)
+        return ahb_siphon_out_sinks(ctx, phys, len, opts, digest);
+
+    if (opts && opts->compress)
+        return ahb_siphon_out_compressed(ctx, phys, len, outfd, opts, digest);
+
+    if (opts && opts->direct && opts->sparse) {
+        loge("Direct dumps can't be sparse\n");
+        return -EINVAL;
+    }
+
+    if (opts && opts->checkpoint)
+        return ahb_siphon_out_checkpoint(ctx, phys, len, outfd, opts, digest);
+
+    progress_init(&progress, "read", len > 0 ? len : 0);
+    progress_set_base(&progress, phys);
+    rc = ahb_siphon_out_range(ctx, phys, len, outfd, opts && opts->sparse,
+                              opts && opts->direct, digest, &progress);
+    progress_end(&progress);
+
+    return rc;
+}
+
+ssize_t ahb_siphon_out_opts(struct ahb *ctx, uint32_t phys, ssize_t len,
+                            int outfd, const struct ahb_siphon_opts *opts)
+{
+    struct digest digest;
+    ssize_t rc;
+
+    if (!len)
+        return 0;
+
+    if (!(opts && opts->digest))
+        return ahb_siphon_out_digest(ctx, phys, len, outfd, opts, NULL);
+
+    rc = digest_init(&digest, opts->digest_algo,
+                     opts->digest_block ?: DIGEST_DEFAULT_BLOCK,
+                     opts->digest_file);
+    if (rc < 0)
+        return rc;
+
+    rc = ahb_siphon_out_digest(ctx, phys, len, outfd, opts, &digest);
+    if (!rc)
+        rc = digest_finish(&digest);
+
+    digest_destroy(&digest);
+
+    return rc;
+}
+
+static void *ahb_siphon_fill(void *arg)
+{
+    struct ahb_siphon *siphon = arg;
+    struct ring_slot *slot;
+    ssize_t len = siphon->len;
+    ssize_t ingress;
+
+    span_thread_name("siphon-fill");
+
+    while ((slot = ring_get_empty(&siphon->ring))) {
+        ingress = (len > (ssize_t)siphon->ring.size || len == -1)
+                    ? (ssize_t)siphon->ring.size : len;
+
+        ingress = read(siphon->fd, slot->buf, ingress);
+        if (ingress < 0) {
+            ring_abort(&siphon->ring, -errno);
+            return NULL;
+        }
+
+        if (!ingress)
+            break;
+
+        slot->len = ingress;
+        ring_put_full(&siphon->ring);
 
-        phys += ingress;
         if (len > 0) {
             len -= ingress;
         }
+    }
+
+    ring_finish(&siphon->ring);
+
+    return NULL;
+}
+
+ssize_t ahb_siphon_in(struct ahb *ctx, uint32_t phys, ssize_t len, int infd)
+{
+    struct ahb_siphon _siphon, *siphon = &_siphon;
+    struct progress progress;
+    struct ring_slot *slot;
+    ssize_t egress;
+    pthread_t worker;
+    int rc;
+
+    if ((rc = ring_init(&siphon->ring, ahb_chunk_size(ctx, AHB_CHUNK))) < 0)
+        return rc;
 
-        fprintf(stderr, ".");
+    siphon->fd = infd;
+    siphon->len = len;
+
+    if ((rc = -pthread_create(&worker, NULL, ahb_siphon_fill, siphon)))
+        goto cleanup_ring;
+
+    progress_init(&progress, "write", len > 0 ? len : 0);
+    progress_set_base(&progress, phys);
+
+    while ((slot = ring_get_full(&siphon->ring))) {
+        egress = ahb_write(ctx, phys, slot->buf, slot->len);
+        if (egress < 0) {
+            ring_abort(&siphon->ring, -EIO);
+            break;
+        }
+
+        phys += slot->len;
+        progress_update(&progress, slot->len);
+        ring_put_empty(&siphon->ring);
     }
 
-done:
-    fprintf(stderr, "\n");
-    free(chunk);
+    pthread_join(worker, NULL);
+
+    rc = ring_status(&siphon->ring);
+
+    progress_end(&progress);
+
+cleanup_ring:
+    ring_destroy(&siphon->ring);
 
     return rc;
 }
 
+static const char *ahb_op_names[ahb_op_max] = {
+    [ahb_op_read] = "read",
+    [ahb_op_write] = "write",
+    [ahb_op_readl] = "readl",
+    [ahb_op_writel] = "writel",
+    [ahb_op_readv] = "readv",
+    [ahb_op_writev] = "writev",
+    [ahb_op_poll] = "poll",
+    [ahb_op_modifyl] = "modifyl",
+};
+
+void ahb_span(struct ahb *ctx, enum ahb_op op, uint32_t phys, size_t len,
+              const struct timespec *start)
+{
+    span_end(ctx->drv->name, ahb_op_names[op], span_ts(start), phys, len);
+}
+
+void ahb_span_remap(struct ahb *ctx, uint64_t start)
+{
+    span_end(ctx->drv->name, "remap", start, 0, 0);
+}
+
+int ahb_stats_init(struct ahb *ctx)
+{
+    if (ctx->stats)
+        return 0;
+
+    ctx->stats = calloc(1, sizeof(*ctx->stats));
+
+    return ctx->stats ? 0 : -ENOMEM;
+}
+
+void ahb_stats_destroy(struct ahb *ctx)
+{
+    free(ctx->stats);
+    ctx->stats = NULL;
+}
+
+void ahb_stats_record(struct ahb *ctx, enum ahb_op op,
+                      const struct timespec *start, ssize_t rc)
+{
+    struct ahb_op_stats *stats;
+    struct timespec end;
+    unsigned int bucket;
+    uint64_t ns, us;
+
+    if (!ctx->stats)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - start->tv_sec) * 1000000000ULL +
+         end.tv_nsec - start->tv_nsec;
+
+    stats = &ctx->stats->ops[op];
+    stats->calls++;
+    stats->ns += ns;
+    if (rc < 0)
+        stats->errors++;
+    else
+        stats->bytes += rc;
+
+    us = ns / 1000;
+    bucket = us ? 64 - __builtin_clzll(us) : 0;
+    if (bucket >= AHB_STATS_BUCKETS)
+        bucket = AHB_STATS_BUCKETS - 1;
+    stats->hist[bucket]++;
+}
+
+/* Upper bound of the bucket holding the requested percentile, in microseconds */
+static uint64_t ahb_stats_percentile(const struct ahb_op_stats *stats, int pct)
+{
+    uint64_t want = (stats->calls * pct + 99) / 100;
+    uint64_t seen = 0;
+    unsigned int i;
+
+    for (i = 0; i < AHB_STATS_BUCKETS; i++) {
+        seen += stats->hist[i];
+        if (seen >= want)
+            return 1ULL << i;
+    }
+
+    return 1ULL << (AHB_STATS_BUCKETS - 1);
+}
+
+void ahb_stats_dump(struct ahb *ctx, FILE *stream)
+{
+    const struct ahb_op_stats *stats;
+    unsigned int i, j;
+
+    if (!ctx->stats)
+        return;
+
+    fprintf(stream, "Statistics for the %s bridge:\n", ctx->drv->name);
+    fprintf(stream, "  %-7s %10s %8s %12s %10s %10s %10s\n", "op", "calls",
+            "errors", "bytes", "avg (us)", "p50 (us)", "p99 (us)");
+
+    for (i = 0; i < ahb_op_max; i++) {
+        stats = &ctx->stats->ops[i];
+        if (!stats->calls)
+            continue;
+
+        fprintf(stream, "  %-7s %10" PRIu64 " %8" PRIu64 " %12" PRIu64
+                " %10.1f %10" PRIu64 " %10" PRIu64 "\n",
+                ahb_op_names[i], stats->calls, stats->errors, stats->bytes,
+                stats->ns / 1000.0 / stats->calls,
+                ahb_stats_percentile(stats, 50),
+                ahb_stats_percentile(stats, 99));
+    }
+
+    for (i = 0; i < ahb_op_max; i++) {
+        stats = &ctx->stats->ops[i];
+        if (!stats->calls)
+            continue;
+
+        fprintf(stream, "  %s latency histogram:\n", ahb_op_names[i]);
+        for (j = 0; j < AHB_STATS_BUCKETS; j++) {
+            if (!stats->hist[j])
+                continue;
+
+            fprintf(stream, "    < %8" PRIu64 "us: %" PRIu64 "\n",
+                    (uint64_t)1 << j, stats->hist[j]);
+        }
+    }
+
+    fprintf(stream, "  window remaps: %" PRIu64 "\n", ctx->stats->remaps);
+
+    if (ctx->throttle)
+        fprintf(stream, "  throttled: %.1f ms\n",
+                ctx->throttle->waited_ns / 1000000.0);
+}
+
+const struct bridge_caps *ahb_bridge_caps(struct ahb *ctx)
+{
+    return &ctx->drv->caps;
+}
+
+/*
+ * Round @hint down to a whole number of bridge bursts. A hint smaller than a
+ * burst gets one whole burst rather than nothing.
+ */
+size_t ahb_chunk_size(struct ahb *ctx, size_t hint)
+{
+    size_t burst = ctx->drv->caps.burst;
+
+    if (!burst)
+        return hint;
+
+    if (burst >= hint)
+        return burst;
+
+    return hint - (hint % burst);
+}
+
 int ahb_release_bridge(struct ahb *ctx)
 {
-    return ctx->drv->release ? ctx->drv->release(ctx) : 0;
+    int rc;
+
+    ahb_access_begin(ctx);
+
+    if ((rc = ahb_txn_flush(ctx)) < 0)
+        goto done;
+
+    rc = ctx->drv->release ? ctx->drv->release(ctx) : 0;
+
+done:
+    ahb_access_end(ctx);
+
+    return rc;
 }
 
 int ahb_reinit_bridge(struct ahb *ctx)
 {
-    return ctx->drv->reinit ? ctx->drv->reinit(ctx) : 0;
+    int rc;
+
+    ahb_access_begin(ctx);
+    rc = ctx->drv->reinit ? ctx->drv->reinit(ctx) : 0;
+    ahb_access_end(ctx);
+
+    return rc;
 }
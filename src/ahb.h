@@ -6,12 +6,21 @@
 
 #include "log.h"
 #include "bridge.h"
+#include "digest.h"
+#include "mirror.h"
+#include "record.h"
+#include "span.h"
+#include "throttle.h"
 
+#include <errno.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <stddef.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
+#include <time.h>
 
 struct ahb_range {
     const char *name;
@@ -20,6 +29,32 @@ struct ahb_range {
     bool rw;
 };
 
+/*
+ * Describes one region of a vectored access. Regions of exactly 4 bytes at a
+ * word-aligned address are treated as register accesses.
+ */
+struct ahb_iov {
+    uint32_t phys;
+    void *base;
+    size_t len;
+};
+
+static inline bool ahb_iov_is_word(const struct ahb_iov *iov)
+{
+    return iov->len == 4 && !(iov->phys & 3);
+}
+
+/*
+ * How ahb_poll() paces its reads. It sleeps @holdoff_us before the first,
+ * then @interval_us between reads, doubling after each miss up to @max_us. A
+ * zero @interval_us reads back to back, as fast as the bridge answers.
+ */
+struct ahb_poll_policy {
+    unsigned int holdoff_us;
+    unsigned int interval_us;
+    unsigned int max_us;
+};
+
 struct ahb;
 
 struct ahb_ops {
@@ -27,54 +62,506 @@ struct ahb_ops {
     ssize_t (*write)(struct ahb *ctx, uint32_t phys, const void *buf, size_t len);
     int (*readl)(struct ahb *ctx, uint32_t phys, uint32_t *val);
     int (*writel)(struct ahb *ctx, uint32_t phys, uint32_t val);
+    /* Optional, ahb_readv() and ahb_writev() fall back to the ops above */
+    ssize_t (*readv)(struct ahb *ctx, const struct ahb_iov *iov, size_t iovcnt);
+    ssize_t (*writev)(struct ahb *ctx, const struct ahb_iov *iov, size_t iovcnt);
+    /* Optional, tells a bridge with a direct view of VRAM where it lives */
+    int (*aperture)(struct ahb *ctx, uint32_t phys, size_t len);
+    /* Optional, called as the outermost session opens and closes */
+    int (*session)(struct ahb *ctx, bool open);
+    /*
+     * Optional, waits on a register without a round trip per read. Returns
+     * -ENOTSUP to have ahb_poll() read through readl() after all.
+     */
+    int (*poll)(struct ahb *ctx, uint32_t phys, uint32_t mask, uint32_t value,
+                uint64_t timeout_us, const struct ahb_poll_policy *policy,
+                uint32_t *val);
+    /*
+     * Optional, clears then sets bits of a register in one exchange. Returns
+     * -ENOTSUP to have ahb_modifyl() go through readl() and writel().
+     */
+    int (*modifyl)(struct ahb *ctx, uint32_t phys, uint32_t clear,
+                   uint32_t set);
+};
+
+enum ahb_op {
+    ahb_op_read,
+    ahb_op_write,
+    ahb_op_readl,
+    ahb_op_writel,
+    ahb_op_readv,
+    ahb_op_writev,
+    ahb_op_poll,
+    ahb_op_modifyl,
+    ahb_op_max,
+};
+
+/* Bucket n counts operations taking [2^(n-1), 2^n) microseconds */
+#define AHB_STATS_BUCKETS 24
+
+struct ahb_op_stats {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t ns;
+    uint64_t hist[AHB_STATS_BUCKETS];
+};
+
+struct ahb_stats {
+    struct ahb_op_stats ops[ahb_op_max];
+    /* Bridge window reconfigurations, counted by the bridge drivers */
+    uint64_t remaps;
+};
+
+#define AHB_TXN_MAX 32
+
+/*
+ * Posted register writes queued between ahb_txn_begin() and ahb_txn_commit().
+ * Any other access through the bridge flushes the queue first, so ordering
+ * with respect to reads is preserved.
+ */
+struct ahb_txn {
+    unsigned int depth;
+    size_t count;
+    struct ahb_iov iov[AHB_TXN_MAX];
+    uint32_t val[AHB_TXN_MAX];
 };
 
 struct ahb {
     const struct bridge_driver *drv;
     const struct ahb_ops *ops;
+    struct ahb_txn txn;
+    /* Nesting depth of ahb_session_begin() */
+    unsigned int session;
+    /* NULL unless statistics were requested */
+    struct ahb_stats *stats;
+    /* The bridge's id in the recording, negative when not recording */
+    int record;
+    /* NULL unless the bridge's traffic is rate limited */
+    struct throttle *throttle;
+    /* NULL unless the bridge's hardware is arbitrated, see ahb_arbitrate() */
+    struct ahb_arb *arb;
+    /* Serialises threads while the bridge is shared, see ahb_share() */
+    pthread_mutex_t lock;
+    /* How many times the thread holding @lock has taken it */
+    unsigned int held;
+    bool shared;
+    /* Writes made to the registers ahb_prefetchable() covers */
+    unsigned long reg_writes;
 };
 
+void ahb_lock_init(struct ahb *ctx);
+
 static inline void ahb_init_ops(struct ahb *ctx, const struct bridge_driver *drv,
                                 const struct ahb_ops *ops)
 {
     ctx->drv = drv;
     ctx->ops = ops;
+    ctx->txn.depth = 0;
+    ctx->txn.count = 0;
+    ctx->session = 0;
+    ctx->stats = NULL;
+    ctx->record = -1;
+    ctx->throttle = NULL;
+    ctx->arb = NULL;
+    ahb_lock_init(ctx);
+    ctx->shared = false;
+    ctx->reg_writes = 0;
+}
+
+int ahb_stats_init(struct ahb *ctx);
+void ahb_stats_destroy(struct ahb *ctx);
+void ahb_stats_dump(struct ahb *ctx, FILE *stream);
+void ahb_stats_record(struct ahb *ctx, enum ahb_op op,
+                      const struct timespec *start, ssize_t rc);
+void ahb_span(struct ahb *ctx, enum ahb_op op, uint32_t phys, size_t len,
+              const struct timespec *start);
+void ahb_span_remap(struct ahb *ctx, uint64_t start);
+
+static inline void ahb_stats_start(struct ahb *ctx, struct timespec *start)
+{
+    if (ctx->stats || ctx->record >= 0 || span_enabled)
+        clock_gettime(CLOCK_MONOTONIC, start);
+}
+
+/* Whether [@phys, @phys + @len) touches registers ahb_prefetchable() covers */
+bool ahb_prefetch_overlaps(uint32_t phys, size_t len);
+
+/* Counted so SoC state read from those registers can tell it's been written */
+static inline void ahb_count_write(struct ahb *ctx, uint32_t phys, size_t len)
+{
+    if (ahb_prefetch_overlaps(phys, len))
+        ctx->reg_writes++;
+}
+
+/* @buf is the data of bulk transfers, @val is recorded for everything else */
+static inline void ahb_record(struct ahb *ctx, enum ahb_op op, uint32_t phys,
+                              const void *buf, size_t len, uint32_t val,
+                              const struct timespec *start, ssize_t rc)
+{
+    if (ctx->record >= 0)
+        record_op(ctx->record, op, phys, buf, len, val, start, rc);
+
+    /* What a failed or short write left behind isn't known */
+    if (op == ahb_op_write || op == ahb_op_writel) {
+        mirror_written(phys, rc == (ssize_t)len ? (buf ? buf : &val) : NULL,
+                       len);
+        ahb_count_write(ctx, phys, len);
+    }
+
+    if (span_enabled)
+        ahb_span(ctx, op, phys, len, start);
+}
+
+/* @start is from span_begin() before the bridge began moving its window */
+static inline void ahb_stats_remap(struct ahb *ctx, uint64_t start)
+{
+    if (ctx->stats)
+        ctx->stats->remaps++;
+
+    if (start)
+        ahb_span_remap(ctx, start);
+}
+
+/*
+ * An unshared bridge belongs to one thread at a time and nothing is locked.
+ * Threads use a bridge together once it's marked with ahb_share(), which
+ * must happen before they start and be undone after they've finished:
+ *
+ * - Each access, and each ahb_modifyl() as a whole, is made under the lock,
+ *   so the bridge's own state, such as its window or its UART stream, and
+ *   the statistics and recording here stay coherent.
+ * - A transaction holds the lock from ahb_txn_begin() to ahb_txn_commit(),
+ *   so no other thread's writes join its queue. Don't sleep inside one.
+ * - Sequences that must not be interleaved, such as driving a device through
+ *   the soc layer, which isn't itself locked, hold the bridge with
+ *   ahb_lock(). The lock nests, and ahb_usleep() hands the bridge to the
+ *   other threads for the sleep however deeply it's held.
+ *
+ * Unshared, ahb_usleep() is a plain sleep.
+ */
+void ahb_share(struct ahb *ctx, bool shared);
+void ahb_lock(struct ahb *ctx);
+void ahb_unlock(struct ahb *ctx);
+
+/*
+ * Other culvert processes on the host are kept off the bridge's hardware
+ * with ahb_arbitrate(), which the driver calls once it's probed @resource.
+ * The process holds the resource from its first access until another asks
+ * for it, and then hands it over between accesses at most once a quantum,
+ * with the driver's release() before and reinit() once it's back if anyone
+ * else had it in between. It isn't handed over inside a transaction or while
+ * the bridge is held with ahb_lock(), which is also how sequences that drive
+ * a device over several accesses keep it.
+ */
+struct ahb_arb;
+
+int ahb_arbitrate(struct ahb *ctx, const char *resource);
+/* Holds the resource for the driver's teardown until ahb_arbitrate_end() */
+struct ahb_arb *ahb_arbitrate_detach(struct ahb *ctx);
+void ahb_arbitrate_end(struct ahb_arb *arb);
+void ahb_arb_enter(struct ahb *ctx);
+void ahb_arb_leave(struct ahb *ctx, bool idle);
+
+static inline void ahb_access_begin(struct ahb *ctx)
+{
+    if (ctx->shared)
+        ahb_lock(ctx);
+
+    if (__builtin_expect(!!ctx->arb, 0))
+        ahb_arb_enter(ctx);
+}
+
+static inline void ahb_access_end(struct ahb *ctx)
+{
+    if (__builtin_expect(!!ctx->arb, 0))
+        ahb_arb_leave(ctx, false);
+
+    if (ctx->shared)
+        ahb_unlock(ctx);
+}
+
+int ahb_txn_flush(struct ahb *ctx);
+int ahb_txn_queue(struct ahb *ctx, uint32_t phys, uint32_t val);
+
+/*
+ * Waits until the bridge's limits let @bulk bytes and @reg register accesses
+ * through, handing a shared bridge to the other threads meanwhile. Called
+ * with the bridge held, just before the driver's op.
+ */
+void ahb_throttle_wait(struct ahb *ctx, size_t bulk, unsigned int reg);
+
+static inline void ahb_throttle(struct ahb *ctx, size_t bulk, unsigned int reg)
+{
+    if (__builtin_expect(!!ctx->throttle, 0))
+        ahb_throttle_wait(ctx, bulk, reg);
+}
+
+/* Bulk transfers through a throttled bridge go a quantum at a time */
+ssize_t ahb_read_throttled(struct ahb *ctx, uint32_t phys, void *buf,
+                           size_t len);
+ssize_t ahb_write_throttled(struct ahb *ctx, uint32_t phys, const void *buf,
+                            size_t len);
+
+/*
+ * A build for a single bridge calls its accessors directly, so they can be
+ * inlined into the register loops. Other bridges, such as striping or
+ * snapshots, all still go through their ops.
+ */
+#if AHB_ONLY_DEVMEM
+#define AHB_ONLY devmem
+#elif AHB_ONLY_P2A
+#define AHB_ONLY p2ab
+#endif
+
+#ifdef AHB_ONLY
+#define AHB_ONLY_OPS__(prefix) prefix##_ahb_ops
+#define AHB_ONLY_OPS_(prefix) AHB_ONLY_OPS__(prefix)
+#define AHB_ONLY_OP__(prefix, op) prefix##_##op
+#define AHB_ONLY_OP_(prefix, op) AHB_ONLY_OP__(prefix, op)
+
+extern const struct ahb_ops AHB_ONLY_OPS_(AHB_ONLY);
+ssize_t AHB_ONLY_OP_(AHB_ONLY, read)(struct ahb *ahb, uint32_t phys, void *buf,
+                                     size_t len);
+ssize_t AHB_ONLY_OP_(AHB_ONLY, write)(struct ahb *ahb, uint32_t phys,
+                                      const void *buf, size_t len);
+int AHB_ONLY_OP_(AHB_ONLY, readl)(struct ahb *ahb, uint32_t phys,
+                                  uint32_t *val);
+int AHB_ONLY_OP_(AHB_ONLY, writel)(struct ahb *ahb, uint32_t phys,
+                                   uint32_t val);
+
+#define ahb_ops_call(ctx, op, ...)                                          \
+    (__builtin_expect((ctx)->ops == &AHB_ONLY_OPS_(AHB_ONLY), 1) ?          \
+     AHB_ONLY_OP_(AHB_ONLY, op)((ctx), __VA_ARGS__) :                       \
+     (ctx)->ops->op((ctx), __VA_ARGS__))
+#else
+#define ahb_ops_call(ctx, op, ...) ((ctx)->ops->op((ctx), __VA_ARGS__))
+#endif
+
+/* Moves @len bytes in one op, whatever the bridge's limits */
+static inline ssize_t ahb_read_once(struct ahb *ctx, uint32_t phys, void *buf,
+                                    size_t len)
+{
+    struct timespec start;
+    ssize_t rc;
+
+    ahb_access_begin(ctx);
+
+    if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+        goto done;
+
+    ahb_stats_start(ctx, &start);
+    rc = ahb_ops_call(ctx, read, phys, buf, len);
+    ahb_stats_record(ctx, ahb_op_read, &start, rc);
+    ahb_record(ctx, ahb_op_read, phys, buf, len, 0, &start, rc);
+
+done:
+    ahb_access_end(ctx);
+
+    return rc;
+}
+
+static inline ssize_t ahb_write_once(struct ahb *ctx, uint32_t phys,
+                                     const void *buf, size_t len)
+{
+    struct timespec start;
+    ssize_t rc;
+
+    ahb_access_begin(ctx);
+
+    if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+        goto done;
+
+    ahb_stats_start(ctx, &start);
+    rc = ahb_ops_call(ctx, write, phys, buf, len);
+    ahb_stats_record(ctx, ahb_op_write, &start, rc);
+    ahb_record(ctx, ahb_op_write, phys, buf, len, 0, &start, rc);
+
+done:
+    ahb_access_end(ctx);
+
+    return rc;
 }
 
 static inline ssize_t ahb_read(struct ahb *ctx, uint32_t phys, void *buf, size_t len)
 {
-    return ctx->ops->read(ctx, phys, buf, len);
+    if (__builtin_expect(!!ctx->throttle, 0))
+        return ahb_read_throttled(ctx, phys, buf, len);
+
+    return ahb_read_once(ctx, phys, buf, len);
 }
 
 static inline ssize_t ahb_write(struct ahb *ctx, uint32_t phys, const void *buf, size_t len)
 {
-    return ctx->ops->write(ctx, phys, buf, len);
+    if (__builtin_expect(!!ctx->throttle, 0))
+        return ahb_write_throttled(ctx, phys, buf, len);
+
+    return ahb_write_once(ctx, phys, buf, len);
 }
 
 static inline int ahb_readl(struct ahb *ctx, uint32_t phys, uint32_t *val)
 {
-    int rc = ctx->ops->readl(ctx, phys, val);
+    struct timespec start;
+    int rc;
+
+    ahb_access_begin(ctx);
+
+    if (ctx->txn.count && (rc = ahb_txn_flush(ctx)) < 0)
+        goto done;
+
+    ahb_throttle(ctx, 0, 1);
+
+    ahb_stats_start(ctx, &start);
+    rc = ahb_ops_call(ctx, readl, phys, val);
+    ahb_stats_record(ctx, ahb_op_readl, &start, rc ? rc : (int)sizeof(*val));
+    ahb_record(ctx, ahb_op_readl, phys, NULL, sizeof(*val), rc ? 0 : *val,
+               &start, rc ? rc : (int)sizeof(*val));
     if (!rc) {
         logt("%s: 0x%08"PRIx32": 0x%08"PRIx32"\n", __func__, phys, *val);
     }
 
+done:
+    ahb_access_end(ctx);
+
     return rc;
 }
 
 static inline int ahb_writel(struct ahb *ctx, uint32_t phys, uint32_t val)
 {
-    int rc = ctx->ops->writel(ctx, phys, val);
+    struct timespec start;
+    int rc;
+
+    ahb_access_begin(ctx);
+
+    if (ctx->txn.depth) {
+        rc = ahb_txn_queue(ctx, phys, val);
+        goto done;
+    }
+
+    ahb_throttle(ctx, 0, 1);
+
+    ahb_stats_start(ctx, &start);
+    rc = ahb_ops_call(ctx, writel, phys, val);
+    ahb_stats_record(ctx, ahb_op_writel, &start, rc ? rc : (int)sizeof(val));
+    ahb_record(ctx, ahb_op_writel, phys, NULL, sizeof(val), val, &start,
+               rc ? rc : (int)sizeof(val));
     if (!rc) {
         logt("%s: 0x%08"PRIx32": 0x%08"PRIx32"\n", __func__, phys, val);
     }
 
+done:
+    ahb_access_end(ctx);
+
     return rc;
 }
 
+/*
+ * Writes issued through ahb_writel() inside a transaction are posted: they are
+ * pushed to the bridge as a batch and any failure is reported by the flush,
+ * which happens at the latest in the outermost ahb_txn_commit().
+ */
+void ahb_txn_begin(struct ahb *ctx);
+int ahb_txn_commit(struct ahb *ctx);
+
+/*
+ * A session brackets a batch of accesses so bridges with costly per-access
+ * setup can do it once, e.g. iLPC keeps the SuperIO unlocked throughout.
+ * Sessions nest, and releasing the bridge ends the bridge's side of it early.
+ */
+int ahb_session_begin(struct ahb *ctx);
+int ahb_session_end(struct ahb *ctx);
+
+static inline bool ahb_has_aperture(struct ahb *ctx)
+{
+    return ctx->ops->aperture;
+}
+
+static inline int ahb_set_aperture(struct ahb *ctx, uint32_t phys, size_t len)
+{
+    return ctx->ops->aperture ? ctx->ops->aperture(ctx, phys, len) : -ENOTSUP;
+}
+
+void ahb_usleep(struct ahb *ctx, unsigned int us);
+
+/*
+ * Runs of register accesses to adjacent words in prefetchable regions go out
+ * as one bulk access where the bridge's per-operation cost makes that cheaper.
+ * Writes are merged only on bridges whose bulk writes keep to word writes, and
+ * are then issued in the order given.
+ */
+ssize_t ahb_readv(struct ahb *ctx, const struct ahb_iov *iov, size_t iovcnt);
+ssize_t ahb_writev(struct ahb *ctx, const struct ahb_iov *iov, size_t iovcnt);
+
+/* Whether reading [@phys, @phys + @len) has no side effects */
+bool ahb_prefetchable(uint32_t phys, size_t len);
+
+/*
+ * Reads the register at @phys until its bits under @mask equal @value, for up
+ * to @timeout_us, paced by @policy or back to back if it's NULL. Returns
+ * -ETIMEDOUT if the condition didn't come to hold. @val, if not NULL, is left
+ * with the last value read.
+ */
+int ahb_poll(struct ahb *ctx, uint32_t phys, uint32_t mask, uint32_t value,
+             uint64_t timeout_us, const struct ahb_poll_policy *policy,
+             uint32_t *val);
+
+/*
+ * Writes the register at @phys with the bits in @clear cleared and those in
+ * @set set. Inside a transaction the read flushes what's queued and the write
+ * is queued in turn, unless the bridge does both in one exchange.
+ */
+int ahb_modifyl(struct ahb *ctx, uint32_t phys, uint32_t clear, uint32_t set);
+
+/* Paces a poll loop by a policy, for bridges running ahb_poll() themselves */
+struct ahb_poller {
+    const struct ahb_poll_policy *policy;
+    uint64_t deadline;
+    unsigned int interval;
+};
+
+/* Sleeps through the policy's holdoff */
+void ahb_poller_start(struct ahb *ctx, struct ahb_poller *poller,
+                      const struct ahb_poll_policy *policy,
+                      uint64_t timeout_us);
+/* Sleeps until the next read is due, or returns false if the time is up */
+bool ahb_poller_next(struct ahb *ctx, struct ahb_poller *poller);
+uint64_t ahb_poller_remaining(const struct ahb_poller *poller);
+
+/*
+ * Options for dumping a region to a file descriptor. With @sparse set, blocks
+ * of zeros are left as holes in the output when it's a regular file. If
+ * @checkpoint names a file, completed extents are recorded there and a dump
+ * interrupted part way is resumed from the last extent that verifies. With
+ * @compress set the output is a zstd stream at @compress_level. With @digest
+ * set, a tree hash of the data is computed as it's dumped, in blocks of
+ * @digest_block bytes or DIGEST_DEFAULT_BLOCK, with the leaves written to
+ * @digest_file if it's set. If @nr_sinks is set the data goes to each of
+ * @sinks rather than the descriptor, in one pass, as described in sink.h,
+ * with @compress_level applying to zstd sinks.
+ */
+struct ahb_siphon_opts {
+    bool sparse;
+    const char *checkpoint;
+    bool compress;
+    int compress_level;
+    /* Bypass the page cache, keeping several writes in flight to the disk */
+    bool direct;
+    bool digest;
+    enum digest_algo digest_algo;
+    size_t digest_block;
+    const char *digest_file;
+    const char *const *sinks;
+    size_t nr_sinks;
+};
 
 ssize_t ahb_siphon_out(struct ahb *ctx, uint32_t phys, ssize_t len, int outfd);
+ssize_t ahb_siphon_out_opts(struct ahb *ctx, uint32_t phys, ssize_t len,
+                            int outfd, const struct ahb_siphon_opts *opts);
 ssize_t ahb_siphon_in(struct ahb *ctx, uint32_t phys, ssize_t len, int infd);
 
+const struct bridge_caps *ahb_bridge_caps(struct ahb *ctx);
+size_t ahb_chunk_size(struct ahb *ctx, size_t hint);
+
 int ahb_release_bridge(struct ahb *ctx);
 int ahb_reinit_bridge(struct ahb *ctx);
 
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+
+#include "arb.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ARB_DIR_DEFAULT "/run/lock"
+
+static const char *arb_dir = ARB_DIR_DEFAULT;
+
+int arb_set_dir(const char *dir)
+{
+    if (!*dir)
+        return -EINVAL;
+
+    arb_dir = strcmp(dir, "none") ? dir : NULL;
+
+    return 0;
+}
+
+/* Open file description locks, so each bridge's fd is its own holder */
+static int arb_lock(struct arb *ctx, short type, off_t start, int cmd)
+{
+    struct flock fl = {
+        .l_type = type,
+        .l_whence = SEEK_SET,
+        .l_start = start,
+        .l_len = 1,
+    };
+
+    while (fcntl(ctx->fd, cmd, &fl) < 0) {
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return 0;
+}
+
+static uint64_t arb_read_gen(struct arb *ctx)
+{
+    uint64_t gen = 0;
+
+    if (pread(ctx->fd, &gen, sizeof(gen), 0) != sizeof(gen))
+        return 0;
+
+    return gen;
+}
+
+int arb_open(struct arb *ctx, const char *resource)
+{
+    char path[PATH_MAX];
+    int rc;
+
+    ctx->fd = -1;
+    ctx->held = false;
+    ctx->gen = 0;
+
+    if (!arb_dir)
+        return -ENOTSUP;
+
+    rc = snprintf(path, sizeof(path), "%s/culvert-%s.lock", arb_dir, resource);
+    if (rc < 0 || (size_t)rc >= sizeof(path))
+        return -ENAMETOOLONG;
+
+    if ((ctx->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) < 0)
+        return -errno;
+
+    ctx->gen = arb_read_gen(ctx);
+
+    logd("Arbitrating %s through %s\n", resource, path);
+
+    return 0;
+}
+
+void arb_close(struct arb *ctx)
+{
+    if (ctx->fd < 0)
+        return;
+
+    arb_release(ctx);
+    close(ctx->fd);
+    ctx->fd = -1;
+}
+
+int arb_acquire(struct arb *ctx)
+{
+    uint64_t gen;
+    int rc;
+
+    if (ctx->held)
+        return 0;
+
+    /* Uncontended, skip telling the holder we're waiting */
+    if (arb_lock(ctx, F_WRLCK, 0, F_OFD_SETLK) < 0) {
+        if ((rc = arb_lock(ctx, F_RDLCK, 1, F_OFD_SETLK)) < 0)
+            return rc;
+
+        rc = arb_lock(ctx, F_WRLCK, 0, F_OFD_SETLKW);
+        arb_lock(ctx, F_UNLCK, 1, F_OFD_SETLK);
+        if (rc < 0)
+            return rc;
+    }
+
+    ctx->held = true;
+
+    gen = arb_read_gen(ctx);
+    rc = gen != ctx->gen;
+
+    ctx->gen = gen + 1;
+    if (pwrite(ctx->fd, &ctx->gen, sizeof(ctx->gen), 0) != sizeof(ctx->gen))
+        logd("Failed to record the bridge hand-over: %d\n", -errno);
+
+    return rc;
+}
+
+void arb_release(struct arb *ctx)
+{
+    if (!ctx->held)
+        return;
+
+    arb_lock(ctx, F_UNLCK, 0, F_OFD_SETLK);
+    ctx->held = false;
+}
+
+bool arb_contended(struct arb *ctx)
+{
+    struct flock fl = {
+        .l_type = F_WRLCK,
+        .l_whence = SEEK_SET,
+        .l_start = 1,
+        .l_len = 1,
+    };
+
+    if (fcntl(ctx->fd, F_OFD_GETLK, &fl) < 0)
+        return false;
+
+    return fl.l_type != F_UNLCK;
+}
@@ -0,0 +1,44 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _ARB_H
+#define _ARB_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Arbitrates a bridge's hardware, such as P2A's window or the SuperIO's
+ * unlock and select state, between processes on the host. It's an advisory
+ * lock on a file named for the resource, so tools that don't take it aren't
+ * kept out.
+ *
+ * Byte 0 of the file is the resource itself. A process waiting for it takes
+ * a shared lock on byte 1 first, which is how the holder learns to yield.
+ * The file's contents count the hand-overs, so a holder can tell whether
+ * another process has had the hardware since it last held it.
+ */
+struct arb {
+    int fd;
+    bool held;
+    /* The hand-over count as of our last hold */
+    uint64_t gen;
+};
+
+/* Where the lock files live, or "none" to not arbitrate at all */
+int arb_set_dir(const char *dir);
+
+/* Returns a negative error code if the resource's lock can't be set up */
+int arb_open(struct arb *ctx, const char *resource);
+void arb_close(struct arb *ctx);
+
+/*
+ * Waits for the resource. Returns 1 if another process held it since we
+ * last did, 0 if not, or a negative error code.
+ */
+int arb_acquire(struct arb *ctx);
+void arb_release(struct arb *ctx);
+
+/* Whether another process is waiting for the resource */
+bool arb_contended(struct arb *ctx);
+
+#endif
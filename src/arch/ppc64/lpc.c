@@ -5,6 +5,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/limits.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -14,6 +15,25 @@
 
 #define SYSFS_PREFIX "/sys/kernel/debug/powerpc/lpc"
 
+/* Accesses are paced by the kernel driver, there's nothing to settle */
+static enum lpc_settle lpc_settle = lpc_settle_port80;
+
+void lpc_set_settle(enum lpc_settle settle)
+{
+    lpc_settle = settle;
+}
+
+enum lpc_settle lpc_get_settle(void)
+{
+    return lpc_settle;
+}
+
+/* debugfs exposes the firmware space directly */
+int lpc_set_fw_window(uint64_t phys __unused, size_t len __unused)
+{
+    return -ENOTSUP;
+}
+
 int lpc_init(struct lpc *ctx, const char *space)
 {
     char pathbuf[PATH_MAX];
@@ -30,6 +50,10 @@ int lpc_init(struct lpc *ctx, const char *space)
     if (ctx->fd == -1)
         return -errno;
 
+    ctx->space = space;
+    ctx->map = NULL;
+    ctx->size = SIZE_MAX;
+
     return 0;
 }
 
@@ -46,16 +70,12 @@ int lpc_destroy(struct lpc *ctx)
     return 0;
 }
 
+/* The debugfs file takes the LPC address as its offset */
 int lpc_read(struct lpc *ctx, size_t addr, void *val, size_t size)
 {
-    off_t seek_rc;
     ssize_t rc;
 
-    seek_rc = lseek(ctx->fd, addr, SEEK_SET);
-    if (seek_rc == (off_t) -1)
-        return -errno;
-
-    rc = read(ctx->fd, val, size);
+    rc = pread(ctx->fd, val, size, addr);
     if (rc == -1)
         return -errno;
 
@@ -64,20 +84,59 @@ int lpc_read(struct lpc *ctx, size_t addr, void *val, size_t size)
 
 int lpc_write(struct lpc *ctx, size_t addr, const void *val, size_t size)
 {
-    off_t seek_rc;
     ssize_t rc;
 
-    seek_rc = lseek(ctx->fd, addr, SEEK_SET);
-    if (seek_rc == (off_t) -1)
-        return -errno;
-
-    rc = write(ctx->fd, val, size);
+    rc = pwrite(ctx->fd, val, size, addr);
     if (rc == -1)
         return -errno;
 
     return rc;
 }
 
+/*
+ * debugfs has no vectored interface, but without the seeks each access is
+ * down to a single syscall.
+ */
+int lpc_rw_batch(struct lpc *ctx, const struct lpc_rw *rw, size_t count)
+{
+    ssize_t rc;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        if (rw[i].write)
+            rc = pwrite(ctx->fd, &rw[i].data, 1, rw[i].addr);
+        else
+            rc = pread(ctx->fd, rw[i].val, 1, rw[i].addr);
+
+        if (rc == -1)
+            return -errno;
+
+        if (rc != 1)
+            return -EIO;
+    }
+
+    return 0;
+}
+
+int lpc_writesb(struct lpc *ctx, size_t addr, const void *buf, size_t count)
+{
+    const uint8_t *data = buf;
+    ssize_t rc;
+    size_t i;
+
+    /* A longer pwrite() would walk the ports rather than repeat the one */
+    for (i = 0; i < count; i++) {
+        rc = pwrite(ctx->fd, &data[i], 1, addr);
+        if (rc == -1)
+            return -errno;
+
+        if (rc != 1)
+            return -EIO;
+    }
+
+    return 0;
+}
+
 int lpc_readb(struct lpc *ctx, size_t addr, uint8_t *val)
 {
     int rc;
@@ -2,134 +2,422 @@
 /* Copyright 2014-2016 IBM Corp. */
 
 #include "compiler.h"
+#include "log.h"
 #include "lpc.h"
+#include "mmio.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/io.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
 
 #if !defined(__GLIBC__)
 static __inline unsigned char
-inb_p (unsigned short int __port)
+inb (unsigned short int __port)
 {
     unsigned char _v;
 
-    __asm__ __volatile__ ("inb %w1,%0\noutb %%al,$0x80":"=a" (_v):"Nd" (__port));
+    __asm__ __volatile__ ("inb %w1,%0":"=a" (_v):"Nd" (__port));
     return _v;
 }
 
 static __inline unsigned short int
-inw_p (unsigned short int __port)
+inw (unsigned short int __port)
 {
   unsigned short int _v;
 
-  __asm__ __volatile__ ("inw %w1,%0\noutb %%al,$0x80":"=a" (_v):"Nd" (__port));
+  __asm__ __volatile__ ("inw %w1,%0":"=a" (_v):"Nd" (__port));
   return _v;
 }
 
 static __inline unsigned int
-inl_p (unsigned short int __port)
+inl (unsigned short int __port)
 {
   unsigned int _v;
-  __asm__ __volatile__ ("inl %w1,%0\noutb %%al,$0x80":"=a" (_v):"Nd" (__port));
+  __asm__ __volatile__ ("inl %w1,%0":"=a" (_v):"Nd" (__port));
   return _v;
 }
 
 static __inline void
-outb_p (unsigned char __value, unsigned short int __port)
+outb (unsigned char __value, unsigned short int __port)
 {
-     __asm__ __volatile__ ("outb %b0,%w1\noutb %%al,$0x80": :"a" (__value),
-                           "Nd" (__port));
+     __asm__ __volatile__ ("outb %b0,%w1": :"a" (__value), "Nd" (__port));
 }
 
 static __inline void
-outw_p (unsigned short int __value, unsigned short int __port)
+outw (unsigned short int __value, unsigned short int __port)
 {
-     __asm__ __volatile__ ("outw %w0,%w1\noutb %%al,$0x80": :"a" (__value),
-                           "Nd" (__port));
+     __asm__ __volatile__ ("outw %w0,%w1": :"a" (__value), "Nd" (__port));
 }
 
 static __inline void
-outl_p (unsigned int __value, unsigned short int __port)
+outl (unsigned int __value, unsigned short int __port)
 {
-     __asm__ __volatile__ ("outl %0,%w1\noutb %%al,$0x80": :"a" (__value),
-                           "Nd" (__port));
+     __asm__ __volatile__ ("outl %0,%w1": :"a" (__value), "Nd" (__port));
+}
+
+static __inline void
+outsb (unsigned short int __port, const void *__addr,
+       unsigned long int __count)
+{
+  __asm__ __volatile__ ("cld ; rep ; outsb":"=S" (__addr), "=c" (__count)
+			:"d" (__port), "0" (__addr), "1" (__count));
 }
 #endif
 
-int lpc_init(struct lpc *ctx __unused, const char *space)
+/* The POST code port, traditionally written to give the bus time to settle */
+#define LPC_SETTLE_PORT     0x80
+#define LPC_CALIBRATE_ITERS 64
+
+static enum lpc_settle lpc_settle = lpc_settle_port80;
+static uint64_t lpc_settle_ns;
+
+void lpc_set_settle(enum lpc_settle settle)
+{
+    lpc_settle = settle;
+}
+
+enum lpc_settle lpc_get_settle(void)
+{
+    return lpc_settle;
+}
+
+/*
+ * Where iopl() is refused, as in containers and on hosts locked down against
+ * it, port I/O goes through /dev/port instead. Each access is then a syscall
+ * the kernel issues the cycle for, and the device node can be handed to a
+ * container on its own.
+ */
+static inline bool lpc_is_devport(struct lpc *ctx)
+{
+    return ctx->fd != -1 && !ctx->map;
+}
+
+static inline int lpc_port_inb(struct lpc *ctx, size_t addr, uint8_t *val)
+{
+    if (!lpc_is_devport(ctx)) {
+        *val = inb(addr);
+        return 0;
+    }
+
+    if (pread(ctx->fd, val, 1, addr) != 1)
+        return -errno;
+
+    return 0;
+}
+
+static inline int lpc_port_outb(struct lpc *ctx, size_t addr, uint8_t val)
+{
+    if (!lpc_is_devport(ctx)) {
+        outb(val, addr);
+        return 0;
+    }
+
+    if (pwrite(ctx->fd, &val, 1, addr) != 1)
+        return -errno;
+
+    return 0;
+}
+
+static uint64_t lpc_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * Time the port 0x80 writes the delay replaces, so it waits as long without
+ * putting extra cycles on the bus.
+ */
+static void lpc_calibrate_settle(struct lpc *ctx)
+{
+    uint64_t start;
+    int i;
+
+    start = lpc_now();
+    for (i = 0; i < LPC_CALIBRATE_ITERS; i++)
+        lpc_port_outb(ctx, LPC_SETTLE_PORT, 0);
+    lpc_settle_ns = (lpc_now() - start) / LPC_CALIBRATE_ITERS;
+
+    logd("Calibrated I/O settle delay to %" PRIu64 "ns\n", lpc_settle_ns);
+}
+
+static inline void lpc_settle_wait(struct lpc *ctx)
+{
+    uint64_t start;
+
+    switch (lpc_settle) {
+        case lpc_settle_port80:
+            /* The syscall round trip through /dev/port already outlasts it */
+            if (!lpc_is_devport(ctx))
+                outb(0, LPC_SETTLE_PORT);
+            break;
+        case lpc_settle_delay:
+            start = lpc_now();
+            while (lpc_now() - start < lpc_settle_ns)
+                ;
+            break;
+        case lpc_settle_none:
+            break;
+    }
+}
+
+/* Page-aligned by lpc_set_fw_window(), zero length if none was given */
+static uint64_t lpc_fw_phys;
+static size_t lpc_fw_len;
+
+int lpc_set_fw_window(uint64_t phys, size_t len)
 {
+    long pgsize = sysconf(_SC_PAGE_SIZE);
+
+    if (!len || (phys & (pgsize - 1)) || (len & (pgsize - 1)))
+        return -EINVAL;
+
+    lpc_fw_phys = phys;
+    lpc_fw_len = len;
+
+    return 0;
+}
+
+static int lpc_init_fw(struct lpc *ctx)
+{
+    void *map;
     int rc;
 
+    if (!lpc_fw_len)
+        return -ENOTSUP;
+
+    ctx->fd = open("/dev/mem", O_RDWR | O_SYNC | O_CLOEXEC);
+    if (ctx->fd == -1)
+        return -errno;
+
+    map = mmap(NULL, lpc_fw_len, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd,
+               lpc_fw_phys);
+    if (map == MAP_FAILED) {
+        rc = -errno;
+        close(ctx->fd);
+        return rc;
+    }
+
+    ctx->map = map;
+    ctx->size = lpc_fw_len;
+
+    logd("Mapped LPC firmware space at 0x%" PRIx64 " (%zu bytes)\n",
+         lpc_fw_phys, lpc_fw_len);
+
+    return 0;
+}
+
+int lpc_init(struct lpc *ctx, const char *space)
+{
+    int rc;
+
+    ctx->space = space;
+    ctx->map = NULL;
+    ctx->size = SIZE_MAX;
+    ctx->fd = -1;
+
+    if (!strcmp(space, "fw"))
+        return lpc_init_fw(ctx);
+
     if (strcmp(space, "io"))
         return -ENOTSUP;
 
     /* YOLO */
     rc = iopl(3);
-    if (rc < 0) {
+    if (rc < 0 && errno == EPERM) {
+        ctx->fd = open("/dev/port", O_RDWR | O_CLOEXEC);
+        if (ctx->fd == -1) {
+            rc = -errno;
+            loge("Failed to raise the I/O privilege level or open /dev/port: %d\n",
+                 rc);
+            return rc;
+        }
+
+        logd("I/O privilege refused, using /dev/port for port I/O\n");
+    } else if (rc < 0) {
         perror("iopl");
         return rc;
     }
 
+    if (lpc_settle == lpc_settle_delay && !lpc_settle_ns)
+        lpc_calibrate_settle(ctx);
+
     return 0;
 }
 
-int lpc_destroy(struct lpc *ctx __unused)
+int lpc_destroy(struct lpc *ctx)
 {
-    return 0;
+    int rc = 0;
+
+    if (ctx->map) {
+        if (munmap((void *)ctx->map, ctx->size) == -1)
+            rc = -errno;
+        ctx->map = NULL;
+    }
+
+    if (ctx->fd != -1 && close(ctx->fd) == -1 && !rc)
+        rc = -errno;
+
+    ctx->fd = -1;
+
+    return rc;
 }
 
-int lpc_readb(struct lpc *ctx __unused, size_t addr, uint8_t *val)
+int lpc_readb(struct lpc *ctx, size_t addr, uint8_t *val)
 {
-    *val = inb_p(addr);
+    int rc;
+
+    if ((rc = lpc_port_inb(ctx, addr, val)))
+        return rc;
+    lpc_settle_wait(ctx);
 
     return 0;
 }
 
-int lpc_writeb(struct lpc *ctx __unused, size_t addr, uint8_t val)
+int lpc_writeb(struct lpc *ctx, size_t addr, uint8_t val)
 {
-    outb_p(val, addr);
+    int rc;
+
+    if ((rc = lpc_port_outb(ctx, addr, val)))
+        return rc;
+    lpc_settle_wait(ctx);
 
     return 0;
 }
 
-int lpc_readw(struct lpc *ctx __unused, size_t addr, uint16_t *val)
+/* /dev/port only issues byte cycles, wider reads would walk the ports */
+int lpc_readw(struct lpc *ctx, size_t addr, uint16_t *val)
 {
-    *val = inw_p(addr);
+    if (lpc_is_devport(ctx))
+        return -ENOTSUP;
+
+    *val = inw(addr);
+    lpc_settle_wait(ctx);
 
     return 0;
 }
 
-int lpc_writew(struct lpc *ctx __unused, size_t addr, uint16_t val)
+int lpc_writew(struct lpc *ctx, size_t addr, uint16_t val)
 {
-    outw_p(val, addr);
+    if (lpc_is_devport(ctx))
+        return -ENOTSUP;
+
+    outw(val, addr);
+    lpc_settle_wait(ctx);
 
     return 0;
 }
 
-int lpc_readl(struct lpc *ctx __unused, size_t addr, uint32_t *val)
+int lpc_readl(struct lpc *ctx, size_t addr, uint32_t *val)
 {
-    *val = inl_p(addr);
+    if (lpc_is_devport(ctx))
+        return -ENOTSUP;
+
+    *val = inl(addr);
+    lpc_settle_wait(ctx);
 
     return 0;
 }
 
-int lpc_writel(struct lpc *ctx __unused, size_t addr, uint32_t val)
+int lpc_writel(struct lpc *ctx, size_t addr, uint32_t val)
 {
-    outl_p(val, addr);
+    if (lpc_is_devport(ctx))
+        return -ENOTSUP;
+
+    outl(val, addr);
+    lpc_settle_wait(ctx);
 
     return 0;
 }
 
-int lpc_read(struct lpc *ctx __unused, size_t addr __unused, void *val __unused,
-             size_t size __unused)
+/* Firmware cycles only, I/O space is reached through the accessors above */
+int lpc_read(struct lpc *ctx, size_t addr, void *val, size_t size)
 {
-    return -ENOTSUP;
+    if (!ctx->map)
+        return -ENOTSUP;
+
+    if (addr >= ctx->size)
+        return -EFAULT;
+
+    if (size > ctx->size - addr)
+        size = ctx->size - addr;
+
+    mmio_read(val, ctx->map + addr, size, 4);
+
+    return size;
 }
 
-int lpc_write(struct lpc *ctx __unused, size_t addr __unused,
-              const void *val __unused, size_t size __unused)
+int lpc_write(struct lpc *ctx, size_t addr, const void *val, size_t size)
 {
-    return -ENOTSUP;
+    if (!ctx->map)
+        return -ENOTSUP;
+
+    if (addr >= ctx->size)
+        return -EFAULT;
+
+    if (size > ctx->size - addr)
+        size = ctx->size - addr;
+
+    mmio_write(ctx->map + addr, val, size, 4);
+
+    return size;
+}
+
+int lpc_rw_batch(struct lpc *ctx, const struct lpc_rw *rw, size_t count)
+{
+    size_t i;
+    int rc;
+
+    for (i = 0; i < count; i++) {
+        if (rw[i].write)
+            rc = lpc_port_outb(ctx, rw[i].addr, rw[i].data);
+        else
+            rc = lpc_port_inb(ctx, rw[i].addr, rw[i].val);
+        if (rc)
+            return rc;
+
+        lpc_settle_wait(ctx);
+    }
+
+    return 0;
+}
+
+/*
+ * A FIFO takes each byte as the bus cycle completes, so skip the settling
+ * between them and let rep outsb issue the lot
+ */
+int lpc_writesb(struct lpc *ctx, size_t addr, const void *buf,
+                size_t count)
+{
+    const uint8_t *p = buf;
+    size_t i;
+    int rc;
+
+    if (!count)
+        return 0;
+
+    if (lpc_is_devport(ctx)) {
+        /* A longer write would advance the port with each byte */
+        for (i = 0; i < count; i++) {
+            if ((rc = lpc_port_outb(ctx, addr, p[i])))
+                return rc;
+        }
+    } else {
+        outsb(addr, buf, count);
+    }
+
+    lpc_settle_wait(ctx);
+
+    return 0;
 }
@@ -0,0 +1,108 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "arena.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Enough for a whole SoC's devices and driver contexts in one block */
+#define ARENA_BLOCK_SIZE    (32 << 10)
+
+/* Whatever a driver's context may hold, as malloc() would align it */
+union arena_align {
+    long double ld;
+    long long ll;
+    void *ptr;
+};
+
+#define ARENA_ALIGN         __alignof__(union arena_align)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size;
+    unsigned char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+void arena_init(struct arena *arena)
+{
+    arena->blocks = NULL;
+    arena->used = 0;
+}
+
+static struct arena_block *arena_block_new(size_t size)
+{
+    struct arena_block *block;
+
+    if (!(block = malloc(sizeof(*block) + size)))
+        return NULL;
+
+    block->next = NULL;
+    block->size = size;
+
+    return block;
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+    struct arena_block *block = arena->blocks;
+    void *ptr;
+
+    if (size > SIZE_MAX - ARENA_ALIGN)
+        return NULL;
+
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    if (block && block->size - arena->used >= size) {
+        ptr = block->data + arena->used;
+        arena->used += size;
+    } else if (block && size > ARENA_BLOCK_SIZE / 4) {
+        struct arena_block *own;
+
+        /* Large allocations get a block of their own behind the current one */
+        if (!(own = arena_block_new(size)))
+            return NULL;
+
+        own->next = block->next;
+        block->next = own;
+        ptr = own->data;
+    } else {
+        if (!(block = arena_block_new(size > ARENA_BLOCK_SIZE ? size :
+                                      ARENA_BLOCK_SIZE)))
+            return NULL;
+
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->used = size;
+        ptr = block->data;
+    }
+
+    return memset(ptr, 0, size);
+}
+
+void arena_reset(struct arena *arena)
+{
+    struct arena_block *keep = NULL;
+    struct arena_block *block, *next;
+
+    for (block = arena->blocks; block; block = next) {
+        next = block->next;
+        if (!keep && block->size == ARENA_BLOCK_SIZE) {
+            keep = block;
+            keep->next = NULL;
+        } else {
+            free(block);
+        }
+    }
+
+    arena->blocks = keep;
+    arena->used = 0;
+}
+
+void arena_destroy(struct arena *arena)
+{
+    arena_reset(arena);
+    free(arena->blocks);
+    arena_init(arena);
+}
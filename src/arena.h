@@ -0,0 +1,25 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+/*
+ * A bump allocator for objects that live and die together. Allocations are
+ * zeroed and aren't freed one by one: arena_reset() releases them all but
+ * keeps a block for the next round, arena_destroy() gives everything back.
+ */
+struct arena_block;
+
+struct arena {
+    struct arena_block *blocks;
+    size_t used;
+};
+
+void arena_init(struct arena *arena);
+void *arena_alloc(struct arena *arena, size_t size);
+void arena_reset(struct arena *arena);
+void arena_destroy(struct arena *arena);
+
+#endif
@@ -0,0 +1,257 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "async.h"
+#include "log.h"
+#include "span.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Requests issued to the bridge as one vectored access */
+#define AHB_ASYNC_BATCH 64
+
+static bool ahb_req_is_write(const struct ahb_req *req)
+{
+    return req->op == ahb_req_write || req->op == ahb_req_writel;
+}
+
+static ssize_t ahb_req_run(struct ahb *ahb, struct ahb_req *req)
+{
+    int rc;
+
+    switch (req->op) {
+        case ahb_req_read:
+            return ahb_read(ahb, req->phys, req->buf, req->len);
+        case ahb_req_write:
+            return ahb_write(ahb, req->phys, req->buf, req->len);
+        case ahb_req_readl:
+            rc = ahb_readl(ahb, req->phys, &req->val);
+            return rc < 0 ? rc : (ssize_t)sizeof(req->val);
+        case ahb_req_writel:
+            rc = ahb_writel(ahb, req->phys, req->val);
+            return rc < 0 ? rc : (ssize_t)sizeof(req->val);
+        default:
+            return -EINVAL;
+    }
+}
+
+static void ahb_async_run(struct ahb_async *ctx, struct ahb_req *batch,
+                          size_t count, bool writes)
+{
+    struct ahb_iov iov[AHB_ASYNC_BATCH];
+    struct ahb_req *req;
+    size_t total = 0;
+    size_t i;
+    ssize_t rc;
+
+    if (count == 1) {
+        batch->rc = ahb_req_run(ctx->ahb, batch);
+        return;
+    }
+
+    for (req = batch, i = 0; req; req = req->next, i++) {
+        iov[i].phys = req->phys;
+        if (req->op == ahb_req_readl || req->op == ahb_req_writel) {
+            iov[i].base = &req->val;
+            iov[i].len = sizeof(req->val);
+        } else {
+            iov[i].base = req->buf;
+            iov[i].len = req->len;
+        }
+        total += iov[i].len;
+    }
+
+    if (writes)
+        rc = ahb_writev(ctx->ahb, iov, count);
+    else
+        rc = ahb_readv(ctx->ahb, iov, count);
+
+    if (rc >= 0 && (size_t)rc != total)
+        rc = -EIO;
+
+    /* Retry reads singly to find the failure, repeating writes may be unsafe */
+    if (rc < 0 && !writes) {
+        for (req = batch; req; req = req->next)
+            req->rc = ahb_req_run(ctx->ahb, req);
+        return;
+    }
+
+    for (req = batch, i = 0; req; req = req->next, i++)
+        req->rc = rc < 0 ? rc : (ssize_t)iov[i].len;
+}
+
+static void *ahb_async_worker(void *arg)
+{
+    struct ahb_async *ctx = arg;
+    struct ahb_req *batch, *last;
+    uint64_t one = 1;
+    size_t count;
+    bool writes;
+
+    span_thread_name("async");
+
+    pthread_mutex_lock(&ctx->lock);
+    while (1) {
+        while (!ctx->pending && !ctx->stopping)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+
+        if (!ctx->pending)
+            break;
+
+        /* Take the longest run of requests in one direction */
+        batch = last = ctx->pending;
+        writes = ahb_req_is_write(batch);
+        for (count = 1; count < AHB_ASYNC_BATCH && last->next &&
+                        ahb_req_is_write(last->next) == writes; count++)
+            last = last->next;
+
+        ctx->pending = last->next;
+        if (!ctx->pending)
+            ctx->pending_tail = &ctx->pending;
+        last->next = NULL;
+
+        pthread_mutex_unlock(&ctx->lock);
+        ahb_async_run(ctx, batch, count, writes);
+        pthread_mutex_lock(&ctx->lock);
+
+        *ctx->done_tail = batch;
+        ctx->done_tail = &last->next;
+
+        if (write(ctx->efd, &one, sizeof(one)) < 0)
+            logd("Failed to signal completions: %d\n", -errno);
+        pthread_cond_broadcast(&ctx->cond);
+    }
+    pthread_mutex_unlock(&ctx->lock);
+
+    return NULL;
+}
+
+int ahb_async_init(struct ahb_async *ctx, struct ahb *ahb, unsigned int depth)
+{
+    pthread_condattr_t attr;
+    int rc;
+
+    if (!depth)
+        return -EINVAL;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->ahb = ahb;
+    ctx->depth = depth;
+    ctx->pending_tail = &ctx->pending;
+    ctx->done_tail = &ctx->done;
+
+    if ((ctx->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+        return -errno;
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&ctx->cond, &attr);
+    pthread_condattr_destroy(&attr);
+
+    ctx->was_shared = ahb->shared;
+    ahb_share(ahb, true);
+
+    if ((rc = -pthread_create(&ctx->worker, NULL, ahb_async_worker, ctx))) {
+        ahb_share(ahb, ctx->was_shared);
+        pthread_cond_destroy(&ctx->cond);
+        pthread_mutex_destroy(&ctx->lock);
+        close(ctx->efd);
+        return rc;
+    }
+
+    return 0;
+}
+
+void ahb_async_destroy(struct ahb_async *ctx)
+{
+    ahb_async_drain(ctx);
+
+    pthread_mutex_lock(&ctx->lock);
+    ctx->stopping = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    pthread_join(ctx->worker, NULL);
+
+    ahb_share(ctx->ahb, ctx->was_shared);
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+    close(ctx->efd);
+}
+
+int ahb_async_submit(struct ahb_async *ctx, struct ahb_req *req)
+{
+    if (ctx->inflight == ctx->depth)
+        return -EAGAIN;
+
+    req->next = NULL;
+    req->rc = 0;
+
+    pthread_mutex_lock(&ctx->lock);
+    *ctx->pending_tail = req;
+    ctx->pending_tail = &req->next;
+    ctx->inflight++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+
+    return 0;
+}
+
+int ahb_async_complete(struct ahb_async *ctx, int timeout_ms)
+{
+    struct ahb_req *done, *next;
+    struct timespec deadline;
+    int completed = 0;
+    uint64_t events;
+
+    if (timeout_ms > 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+    }
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->done && ctx->inflight && timeout_ms) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&ctx->cond, &ctx->lock);
+        else if (pthread_cond_timedwait(&ctx->cond, &ctx->lock, &deadline))
+            break;
+    }
+
+    done = ctx->done;
+    ctx->done = NULL;
+    ctx->done_tail = &ctx->done;
+
+    /* Under the lock, so a completion signalled after this isn't lost */
+    if (done && read(ctx->efd, &events, sizeof(events)) < 0 && errno != EAGAIN)
+        logd("Failed to collect completion events: %d\n", -errno);
+
+    for (next = done; next; next = next->next)
+        ctx->inflight--;
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* The completion may submit the request again */
+    for (; done; done = next) {
+        next = done->next;
+        if (done->complete)
+            done->complete(done);
+        completed++;
+    }
+
+    return completed;
+}
+
+void ahb_async_drain(struct ahb_async *ctx)
+{
+    while (ctx->inflight)
+        ahb_async_complete(ctx, -1);
+}
@@ -0,0 +1,95 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _ASYNC_H
+#define _ASYNC_H
+
+#include "ahb.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+enum ahb_req_op {
+    ahb_req_read,
+    ahb_req_write,
+    ahb_req_readl,
+    ahb_req_writel,
+};
+
+/*
+ * A request made through ahb_async_submit(). The submitter owns it again once
+ * @complete has been called, from within ahb_async_complete() on the
+ * thread calling that. @rc is then a byte count or a negative errno, and a
+ * readl's word is in @val.
+ */
+struct ahb_req {
+    enum ahb_req_op op;
+    uint32_t phys;
+    /* For read and write */
+    void *buf;
+    size_t len;
+    /* For readl and writel */
+    uint32_t val;
+    ssize_t rc;
+    void (*complete)(struct ahb_req *req);
+    void *priv;
+    /* Private to the queue */
+    struct ahb_req *next;
+};
+
+/*
+ * Runs requests against a bridge from a worker thread, in the order they were
+ * submitted, so the submitter can get on with other work while they're in
+ * flight. Consecutive reads, or consecutive writes, go to the bridge as one
+ * vectored access, which the pipelining bridges keep several of in flight at
+ * once. A failed vectored write fails every request in it, while the reads
+ * of a failed vectored read are retried one at a time.
+ *
+ * The bridge is shared for as long as the queue exists, see ahb_share(), so
+ * the submitting thread can still use it directly. The submitting side isn't
+ * itself thread-safe: one thread submits and completes.
+ */
+struct ahb_async {
+    struct ahb *ahb;
+    pthread_t worker;
+    pthread_mutex_t lock;
+    /* Signalled for submissions, completions and shutdown */
+    pthread_cond_t cond;
+    struct ahb_req *pending;
+    struct ahb_req **pending_tail;
+    struct ahb_req *done;
+    struct ahb_req **done_tail;
+    /* Submitted and not yet completed, bounded by @depth */
+    unsigned int inflight;
+    unsigned int depth;
+    bool stopping;
+    bool was_shared;
+    /* Readable while completed requests wait for ahb_async_complete() */
+    int efd;
+};
+
+int ahb_async_init(struct ahb_async *ctx, struct ahb *ahb, unsigned int depth);
+/* Completes anything still in flight first */
+void ahb_async_destroy(struct ahb_async *ctx);
+
+/* Returns -EAGAIN with @depth requests in flight, complete some first */
+int ahb_async_submit(struct ahb_async *ctx, struct ahb_req *req);
+
+/* For poll(), POLLIN while completions are waiting */
+static inline int ahb_async_fd(struct ahb_async *ctx)
+{
+    return ctx->efd;
+}
+
+/*
+ * Calls the completion of each finished request. With none finished, waits
+ * up to @timeout_ms for one, -1 for as long as it takes, unless nothing is
+ * in flight. Returns the number completed.
+ */
+int ahb_async_complete(struct ahb_async *ctx, int timeout_ms);
+/* Completes everything in flight */
+void ahb_async_drain(struct ahb_async *ctx);
+
+#endif
@@ -5,11 +5,49 @@
 #define _BRIDGE_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #include "ahb.h"
 
 #include "ccan/autodata/autodata.h"
 
+/*
+ * Characteristics of a bridge used to size transfers and pick strategies. The
+ * costs are rough estimates, they only need to be right relative to each other.
+ */
+struct bridge_caps {
+	/* Size of the bridge's native window onto the AHB, 0 if unwindowed */
+	uint32_t window;
+
+	/* Preferred length of a single bulk access */
+	size_t burst;
+
+	/* Whether byte and halfword accesses are native to the bridge */
+	bool subword;
+
+	/*
+	 * Whether bulk writes of aligned words reach the bus as word writes, so
+	 * runs of register writes can go out as one, see ahb_writev()
+	 */
+	bool word_writes;
+
+	/*
+	 * Whether bulk reads reach the bus as ascending accesses covering exactly
+	 * the bytes asked for, as windows that advance on each access need
+	 */
+	bool exact_reads;
+
+	/* Widest access the bridge's MMIO window tolerates, 0 if not MMIO */
+	unsigned int mmio_width;
+
+	/* Estimated fixed cost of each operation, in nanoseconds */
+	uint32_t op_ns;
+
+	/* Estimated cost of each byte transferred, in picoseconds */
+	uint32_t byte_ps;
+};
+
 struct bridge_driver {
 	const char *name;
 	struct ahb *(*probe)(int argc, char *argv[]);
@@ -25,6 +63,27 @@ struct bridge_driver {
 
 	/* Set if this driver has been explicitly disabled */
 	bool disabled;
+
+	/*
+	 * The host interface the bridge drives. Bridges on different buses can
+	 * be used concurrently, bridges sharing a bus can't.
+	 */
+	const char *bus;
+
+	/*
+	 * Set if the bridge's access rights are per-thread (e.g. x86 iopl()),
+	 * so it must be probed on the thread that goes on to use it.
+	 */
+	bool thread_bound;
+
+	/*
+	 * Breaks ties between bridges of equal estimated cost, lower first.
+	 * Equal priorities fall back to the name, so probe order doesn't
+	 * depend on link order.
+	 */
+	int priority;
+
+	struct bridge_caps caps;
 };
 
 AUTODATA_TYPE(bridge_drivers, struct bridge_driver);
@@ -8,22 +8,65 @@
 #include "debug.h"
 #include "log.h"
 #include "prompt.h"
+#include "rev.h"
 #include "ts16.h"
 #include "tty.h"
+#include "tune.h"
 
 #include "ccan/container_of/container_of.h"
 
 #include <assert.h>
+#include <endian.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #define to_debug(ahb) container_of(ahb, struct debug, ahb)
 
+/* Writes @val as %x would, returning the number of digits */
+static size_t debug_format_hex(char *out, uint64_t val)
+{
+    static const char digits[] = "0123456789abcdef";
+    size_t n, i;
+
+    n = val ? (64 - __builtin_clzll(val) + 3) / 4 : 1;
+    for (i = n; i; i--, val >>= 4)
+        out[i - 1] = digits[val & 0xf];
+
+    return n;
+}
+
+/*
+ * Formats "@op ADDRESS[ VALUE]" and the end of line into the context's command
+ * buffer, returning its length. Commands go out at thousands a second on a
+ * pipelined line, so this stays out of stdio.
+ */
+static size_t debug_format(struct debug *ctx, char op, uint32_t addr,
+                           bool has_val, uint64_t val)
+{
+    const char *eol = ctx->prompt.eol;
+    char *cursor = ctx->cmd;
+
+    *cursor++ = op;
+    *cursor++ = ' ';
+    cursor += debug_format_hex(cursor, addr);
+    if (has_val) {
+        *cursor++ = ' ';
+        cursor += debug_format_hex(cursor, val);
+    }
+
+    /* The longest end of line is "\r\n", which DEBUG_CMD_MAX allows for */
+    while (*eol)
+        *cursor++ = *eol++;
+
+    return cursor - ctx->cmd;
+}
+
 /*
  * Aspeed have self-published the debug UART password. Given that it's no-longer
  * secret, embed it directly in culvert rather than require the user to specify
@@ -40,6 +83,203 @@ static inline int streq(const char *a, const char *b)
     return !strcmp(a, b);
 }
 
+/*
+ * The UARTs of the AST2400 and AST2500 are clocked from 24MHz/13 unless
+ * SCU2C[12] is cleared, and at 115200 baud the divided clock leaves the debug
+ * UART's divisor at 1. Removing the /13 therefore takes the UART straight to
+ * 1.5Mbaud without touching the divisor latch, which we can't do from the
+ * debug monitor as its own replies would land in DLL while DLAB is set.
+ */
+#define AST_SCU                     0x1e6e2000
+#define   SCU_PROT_KEY              0x000
+#define     SCU_PASSWORD            0x1688a8a8
+#define   SCU_MISC                  0x02c
+#define     SCU_MISC_UART_DIV13     (1 << 12)
+#define   SCU_SILICON_REVISION      0x07c
+
+#define DEBUG_BAUD_BASE             115200
+#define DEBUG_BAUD_FAST             1500000
+#define DEBUG_SYNC_TIMEOUT_MS       1000
+#define DEBUG_SYNC_ATTEMPTS         3
+/* Output that may follow leaving the monitor */
+#define DEBUG_EXIT_QUIET_MS         100
+#define DEBUG_EXIT_MAX_LEN          256
+
+/*
+ * Escalation is opt-in: a culvert killed while escalated leaves the BMC's
+ * console UARTs on the undivided clock until something restores SCU2C.
+ */
+static int debug_baud = DEBUG_BAUD_BASE;
+
+int debug_set_baud(int baud)
+{
+    if (baud != DEBUG_BAUD_BASE && baud != DEBUG_BAUD_FAST)
+        return -EINVAL;
+
+    debug_baud = baud;
+
+    return 0;
+}
+
+/*
+ * Prod the monitor until it shows its prompt, which is the sign that the
+ * line is usable after a change of rate. The first attempts may be lost while
+ * the other end settles.
+ */
+static int debug_await_prompt(struct debug *ctx)
+{
+    int attempt;
+    int rc = 0;
+
+    prompt_set_timeout(&ctx->prompt, DEBUG_SYNC_TIMEOUT_MS);
+
+    for (attempt = 0; attempt < DEBUG_SYNC_ATTEMPTS; attempt++) {
+        if ((rc = prompt_run(&ctx->prompt, "")) < 0)
+            break;
+
+        if ((rc = prompt_expect(&ctx->prompt, "$ ")) != -ETIMEDOUT)
+            break;
+    }
+
+    prompt_set_timeout(&ctx->prompt, -1);
+
+    return rc < 0 ? rc : 0;
+}
+
+static int debug_sync(struct debug *ctx)
+{
+    /* Make sure the reply to the retiming write has drained */
+    usleep(100 * 1000);
+
+    return debug_await_prompt(ctx);
+}
+
+/* Discard what the console says after the monitor exits, until it's quiet */
+static void debug_await_quiet(struct debug *ctx)
+{
+    size_t len;
+    char c;
+
+    prompt_set_timeout(&ctx->prompt, DEBUG_EXIT_QUIET_MS);
+
+    for (len = 0; len < DEBUG_EXIT_MAX_LEN; len++) {
+        if (prompt_read(&ctx->prompt, &c, 1) < 0)
+            break;
+    }
+
+    prompt_set_timeout(&ctx->prompt, -1);
+}
+
+/*
+ * The reply to the write arrives at the new rate, so rather than wait for it
+ * switch the host side and resynchronise with the monitor.
+ */
+static int debug_retime(struct debug *ctx, uint32_t misc, int baud)
+{
+    uint32_t prot;
+    int cleanup;
+    size_t len;
+    int rc;
+
+    if ((rc = debug_readl(debug_as_ahb(ctx), AST_SCU | SCU_PROT_KEY, &prot)) < 0)
+        return rc;
+
+    if (!prot) {
+        rc = debug_writel(debug_as_ahb(ctx), AST_SCU | SCU_PROT_KEY,
+                          SCU_PASSWORD);
+        if (rc < 0)
+            return rc;
+    }
+
+    len = debug_format(ctx, 'w', AST_SCU | SCU_MISC, true, misc);
+    if ((rc = prompt_run_line(&ctx->prompt, ctx->cmd, len)) < 0)
+        goto relock;
+
+    if ((rc = console_set_baud(ctx->console, baud)) < 0)
+        goto relock;
+
+    rc = debug_sync(ctx);
+
+relock:
+    if (!prot) {
+        cleanup = debug_writel(debug_as_ahb(ctx), AST_SCU | SCU_PROT_KEY,
+                               ~SCU_PASSWORD);
+        if (cleanup < 0 && !rc)
+            rc = cleanup;
+    }
+
+    return rc;
+}
+
+int debug_escalate(struct debug *ctx)
+{
+    struct ahb *ahb = debug_as_ahb(ctx);
+    uint32_t rev, misc, check;
+    int rc;
+
+    if (ctx->escalated || debug_baud == DEBUG_BAUD_BASE)
+        return 0;
+
+    if ((rc = debug_readl(ahb, AST_SCU | SCU_SILICON_REVISION, &rev)) < 0)
+        return rc;
+
+    if (!rev_is_supported(rev) || rev_is_generation(rev, ast_g6)) {
+        logd("Not escalating debug UART rate on unsupported SoC (0x%08" PRIx32 ")\n",
+             rev);
+        return 0;
+    }
+
+    if ((rc = debug_readl(ahb, AST_SCU | SCU_MISC, &misc)) < 0)
+        return rc;
+
+    /* Without the /13 the UART's divisor is already scaled up */
+    if (!(misc & SCU_MISC_UART_DIV13)) {
+        logd("Debug UART clock is undivided, not escalating rate\n");
+        return 0;
+    }
+
+    logi("Escalating debug UART to %d baud\n", debug_baud);
+
+    rc = debug_retime(ctx, misc & ~SCU_MISC_UART_DIV13, debug_baud);
+    if (!rc)
+        rc = debug_readl(ahb, AST_SCU | SCU_SILICON_REVISION, &check);
+
+    if (!rc && check == rev) {
+        ctx->misc = misc;
+        ctx->escalated = true;
+        return 0;
+    }
+
+    logi("Failed to verify debug UART at %d baud (%d), stepping down\n",
+         debug_baud, rc);
+
+    if ((rc = debug_retime(ctx, misc, DEBUG_BAUD_BASE)) < 0) {
+        loge("Failed to recover debug UART at %d baud: %d\n",
+             DEBUG_BAUD_BASE, rc);
+        return rc;
+    }
+
+    return 0;
+}
+
+static int debug_deescalate(struct debug *ctx)
+{
+    int rc;
+
+    if (!ctx->escalated)
+        return 0;
+
+    if ((rc = debug_retime(ctx, ctx->misc, DEBUG_BAUD_BASE)) < 0) {
+        loge("Failed to restore debug UART to %d baud: %d\n",
+             DEBUG_BAUD_BASE, rc);
+        return rc;
+    }
+
+    ctx->escalated = false;
+
+    return 0;
+}
+
 int debug_enter(struct debug *ctx)
 {
     int rc;
@@ -60,7 +300,7 @@ int debug_enter(struct debug *ctx)
 
     rc = console_set_baud(ctx->console, 115200);
     if (!rc)
-        sleep(1);
+        rc = debug_await_prompt(ctx);
 
     return rc;
 
@@ -76,12 +316,19 @@ int debug_exit(struct debug *ctx)
 {
     int rc;
 
+    /* There's no monitor behind the stub's protocol */
+    if (ctx->stub)
+        return 0;
+
+    if ((rc = debug_deescalate(ctx)) < 0)
+        return rc;
+
     logi("Exiting debug mode\n");
     rc = prompt_run(&ctx->prompt, "q");
     if (rc < 0)
         return rc;
 
-    sleep(1);
+    debug_await_quiet(ctx);
 
     prompt_run(&ctx->prompt, "");
 
@@ -101,69 +348,172 @@ int debug_probe(struct debug *ctx)
     return debug_exit(ctx);
 }
 
-static ssize_t debug_parse_d(char *line, char *buf)
+/* Bytes of @x for which m < byte < n, valid while every byte is below 0x80 */
+#define DEBUG_SWAR_ONES             0x0101010101010101ULL
+#define DEBUG_SWAR_BETWEEN(x, m, n) \
+    (((DEBUG_SWAR_ONES * (127 + (n)) - ((x) & DEBUG_SWAR_ONES * 127)) & ~(x) & \
+      (((x) & DEBUG_SWAR_ONES * 127) + DEBUG_SWAR_ONES * (127 - (m)))) & \
+     DEBUG_SWAR_ONES * 128)
+
+/* Decode the eight hex digits at @hex together in a 64-bit register */
+static int debug_decode_word(const char *hex, uint32_t *word)
 {
-    char *eoa, *words, *token, *stream;
-    char *saveptr;
-    char *cursor;
-    ssize_t rc;
+    uint64_t x, digit, alpha, n;
 
-    /* Strip leading address */
-    eoa = strchr(line, ':');
-    if (!eoa)
+    memcpy(&x, hex, sizeof(x));
+    x = le64toh(x);
+
+    if (x & DEBUG_SWAR_ONES * 128)
         return -EBADE;
 
-    /* Extract 4-byte values */
-    words = eoa + 1;
-    cursor = buf;
-    stream = strdup(words);
-    while ((token = strtok_r(words, " ", &saveptr))) {
-        rc = sscanf(token, "%02hhx%02hhx%02hhx%02hhx",
-                    &cursor[3], &cursor[2], &cursor[1], &cursor[0]);
-        if (rc < 0) {
-            rc = -errno;
-            goto done;
-        }
+    digit = DEBUG_SWAR_BETWEEN(x, '0' - 1, '9' + 1);
+    alpha = DEBUG_SWAR_BETWEEN(x | DEBUG_SWAR_ONES * 0x20, 'a' - 1, 'f' + 1);
+    if ((digit | alpha) != DEBUG_SWAR_ONES * 128)
+        return -EBADE;
 
-        if (rc < 4) {
-            loge("Wanted 4 but extracted %zd bytes from token '%s' in words '%s' from line '%s'\n",
-                 rc, token, words, line);
-            rc = -EBADE;
-            goto done;
-        }
+    /* The low nibble, plus 9 for letters which all have bit 6 set */
+    n = (x & DEBUG_SWAR_ONES * 0x0f) + ((x >> 6) & DEBUG_SWAR_ONES) * 9;
+
+    /* Pair up the nibbles, then gather the even bytes */
+    n = ((n << 4) | (n >> 8)) & 0x00ff00ff00ff00ffULL;
+    n = (n | (n >> 8)) & 0x0000ffff0000ffffULL;
+    n = (n | (n >> 16)) & 0x00000000ffffffffULL;
+
+    /* The first digits printed landed in the least-significant byte */
+    *word = __builtin_bswap32(n);
+
+    return 0;
+}
 
-        cursor += rc;
-        words = NULL;
+static int debug_decode_addr(const char *hex, size_t len, uint32_t *addr)
+{
+    uint32_t val = 0;
+    size_t i;
+
+    if (!len || len > 8)
+        return -EBADE;
+
+    for (i = 0; i < len; i++) {
+        char c = hex[i];
+
+        if (c >= '0' && c <= '9')
+            val = (val << 4) | (c - '0');
+        else if ((c | 0x20) >= 'a' && (c | 0x20) <= 'f')
+            val = (val << 4) | ((c | 0x20) - 'a' + 10);
+        else
+            return -EBADE;
     }
 
-    rc = cursor - buf;
+    *addr = val;
 
-done:
-    free(stream);
-    return rc;
+    return 0;
 }
 
-static int debug_read_fixed(struct debug *ctx, char mode, uint32_t phys,
-                            uint32_t *val)
+/*
+ * Decode a line of 'd' output, "AAAAAAAA:WWWWWWWW WWWWWWWW ...", directly
+ * into @buf. The line must start at @phys, and at most @len bytes are stored.
+ *
+ * @return The number of bytes stored, or a negative error code.
+ */
+ssize_t debug_parse_d(const char *line, uint32_t phys, uint8_t *buf,
+                      size_t len)
 {
-    char buf[100], *response, *prompt;
-    char *command;
-    unsigned long parsed;
+    const char *cursor, *end, *eoa;
+    uint32_t addr, word;
+    size_t stored = 0;
     int rc;
 
-    if (!(mode == 'i' || mode == 'r'))
-        return -EINVAL;
+    end = line + strlen(line);
+    while (end > line && (end[-1] == '\n' || end[-1] == '\r'))
+        end--;
 
-    rc = asprintf(&command, "%c %x", mode, phys);
-    if (rc < 0)
-        return -errno;
+    /* Check the leading address */
+    eoa = memchr(line, ':', end - line);
+    if (!eoa)
+        return -EBADE;
 
-    prompt = &buf[0];
-    rc = prompt_run_expect(&ctx->prompt, command, "$ ", &prompt, sizeof(buf));
-    free(command);
-    if (rc < 0)
+    if ((rc = debug_decode_addr(line, eoa - line, &addr)) < 0)
         return rc;
 
+    if (addr != phys) {
+        loge("Expected line for 0x%08"PRIx32" but found 0x%08"PRIx32"\n",
+             phys, addr);
+        return -EBADE;
+    }
+
+    /* Extract 4-byte values, the least-significant byte is at the lowest address */
+    cursor = eoa + 1;
+    while (cursor < end) {
+        size_t i, n;
+
+        if (*cursor == ' ') {
+            cursor++;
+            continue;
+        }
+
+        if (end - cursor < 8 || (end - cursor > 8 && cursor[8] != ' '))
+            return -EBADE;
+
+        if ((rc = debug_decode_word(cursor, &word)) < 0)
+            return rc;
+
+        if (stored == len)
+            return -EBADE;
+
+        n = len - stored < 4 ? len - stored : 4;
+        for (i = 0; i < n; i++)
+            buf[stored++] = word >> (8 * i);
+
+        cursor += 8;
+    }
+
+    return stored;
+}
+
+/*
+ * Commands are written ahead of their responses for as long as the bytes in
+ * flight fit the credit window, and responses are matched to them oldest
+ * first. The window bounds what must be buffered between us and the debug
+ * monitor: the UART FIFO and whatever the console server holds.
+ */
+#define DEBUG_PIPE_MAX          32
+#define DEBUG_CREDITS_DEFAULT   (8 * sizeof("w 1e6e2000 ffffffff\r"))
+
+static size_t debug_credits = DEBUG_CREDITS_DEFAULT;
+
+void debug_set_credits(size_t credits)
+{
+    debug_credits = credits;
+}
+
+struct debug_pipe {
+    struct debug *ctx;
+    struct {
+        size_t len;
+        /* Where to store the value read, NULL if the response is the prompt */
+        void *dst;
+        size_t width;
+    } slot[DEBUG_PIPE_MAX];
+    unsigned int head;
+    unsigned int count;
+    size_t inflight;
+};
+
+static void debug_pipe_init(struct debug_pipe *pipe, struct debug *ctx)
+{
+    pipe->ctx = ctx;
+    pipe->head = 0;
+    pipe->count = 0;
+    pipe->inflight = 0;
+}
+
+/* The response is the echoed command, the value, then the prompt */
+static int debug_parse_fixed(struct debug *ctx, char *buf, char *prompt,
+                             uint32_t *val)
+{
+    char *response;
+    size_t len;
+
     /* Terminate the string by overwriting the prompt */
     *prompt = '\0';
 
@@ -173,25 +523,119 @@ static int debug_read_fixed(struct debug *ctx, char mode, uint32_t phys,
         return -EIO;
 
     /* Extract the data */
-    errno = 0;
-    parsed = strtoul(response, NULL, 16);
-    if (errno == ERANGE && (parsed == ULONG_MAX))
-        return -errno;
+    response += strspn(response, " \t\r\n");
+    len = strspn(response, "0123456789abcdefABCDEF");
+    if (len > 8)
+        return -ERANGE;
+
+    return debug_decode_addr(response, len, val);
+}
 
-    *val = parsed;
+/* Match the oldest outstanding command with its response */
+static int debug_pipe_collect(struct debug_pipe *pipe)
+{
+    struct debug *ctx = pipe->ctx;
+    unsigned int i = pipe->head;
+    char buf[100], *prompt;
+    uint32_t val;
+    int rc;
+
+    pipe->head = (pipe->head + 1) % DEBUG_PIPE_MAX;
+    pipe->count--;
+    pipe->inflight -= pipe->slot[i].len;
+
+    if (!pipe->slot[i].dst) {
+        rc = prompt_expect(&ctx->prompt, "$ ");
+        return rc < 0 ? rc : (rc ? 0 : -EIO);
+    }
+
+    prompt = &buf[0];
+    rc = prompt_expect_into(&ctx->prompt, "$ ", buf, sizeof(buf), &prompt);
+    if (rc < 0)
+        return rc;
+    if (!rc)
+        return -EIO;
+
+    if ((rc = debug_parse_fixed(ctx, buf, prompt, &val)) < 0)
+        return rc;
+
+    if (pipe->slot[i].width == 1)
+        *(uint8_t *)pipe->slot[i].dst = val & 0xff;
+    else
+        memcpy(pipe->slot[i].dst, &val, sizeof(val));
+
+    return 0;
+}
+
+/* Collect every outstanding response, even past a failure, to stay in sync */
+static int debug_pipe_drain(struct debug_pipe *pipe)
+{
+    int rc, failed = 0;
+
+    while (pipe->count) {
+        if ((rc = debug_pipe_collect(pipe)) < 0 && !failed)
+            failed = rc;
+    }
+
+    return failed;
+}
+
+/*
+ * Queue a command, first collecting responses until it fits the window. The
+ * response to a command with @dst set carries a value of @width bytes.
+ */
+static int debug_pipe_submit(struct debug_pipe *pipe, void *dst, size_t width,
+                             char op, uint32_t addr, bool has_val, uint32_t val)
+{
+    struct debug *ctx = pipe->ctx;
+    unsigned int i;
+    size_t len;
+    int rc;
+
+    /* Collecting responses leaves the command buffer alone */
+    len = debug_format(ctx, op, addr, has_val, val);
+
+    while (pipe->count == DEBUG_PIPE_MAX ||
+           (pipe->count && pipe->inflight + len > debug_credits)) {
+        if ((rc = debug_pipe_collect(pipe)) < 0)
+            return rc;
+    }
+
+    if ((rc = prompt_write(&ctx->prompt, ctx->cmd, len)) < 0)
+        return rc;
+
+    i = (pipe->head + pipe->count) % DEBUG_PIPE_MAX;
+    pipe->slot[i].len = len;
+    pipe->slot[i].dst = dst;
+    pipe->slot[i].width = width;
+    pipe->count++;
+    pipe->inflight += len;
 
     return 0;
 }
 
+/* Drain the pipe, returning the first of @rc and any failure it reports */
+static int debug_pipe_finish(struct debug_pipe *pipe, ssize_t rc)
+{
+    int drained = debug_pipe_drain(pipe);
+
+    return rc < 0 ? (int)rc : drained;
+}
+
 #define DEBUG_D_MAX_LEN (128 * 1024)
+/* An integral number of 16-byte lines, so retries stay line-aligned */
+#define DEBUG_D_MIN_LEN 256
+/* Consecutive failed attempts at the same address before giving up */
+#define DEBUG_D_RETRIES 8
 
 ssize_t debug_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
 {
     char line[2 * sizeof("20002ba0:31e01002 20433002 30813003 e1a06002\r\n")];
     struct debug *ctx = to_debug(ahb);
     size_t remaining = len;
+    unsigned int failures = 0;
     size_t ingress;
-    char *command;
+    uint64_t begin;
     char *cursor;
     ssize_t rc;
 
@@ -199,20 +643,41 @@ ssize_t debug_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
         return -1;
     }
 
+    /*
+     * Where reading the rest of the words underneath a short read has no side
+     * effects, issue an 'r' for each of the one or two rather than an 'i' per
+     * byte. Elsewhere only the bytes asked for are read.
+     */
     if (len < 4) {
-        uint32_t val = 0;
+        uint32_t base = phys & ~3, words[2];
+        bool split = ((phys + len - 1) & ~3) != base;
+        struct debug_pipe pipe;
+        size_t i, off;
 
+        debug_pipe_init(&pipe, ctx);
         cursor = buf;
-        while (remaining) {
-            rc = debug_read_fixed(ctx, 'i', phys, &val);
-            if (rc < 0)
-                return -1;
 
-            *cursor++ = val & 0xff;
-            remaining--;
-            phys++;
+        if (!ahb_prefetchable(base, split ? 8 : 4)) {
+            rc = 0;
+            for (i = 0; i < len && rc >= 0; i++)
+                rc = debug_pipe_submit(&pipe, &cursor[i], 1, 'i', phys + i,
+                                       false, 0);
+
+            return debug_pipe_finish(&pipe, rc) < 0 ? -1 : (ssize_t)len;
         }
 
+        rc = debug_pipe_submit(&pipe, &words[0], sizeof(words[0]), 'r',
+                               base, false, 0);
+        if (rc >= 0 && split)
+            rc = debug_pipe_submit(&pipe, &words[1], sizeof(words[1]), 'r',
+                                   base + 4, false, 0);
+
+        if (debug_pipe_finish(&pipe, rc) < 0)
+            return -1;
+
+        for (i = 0, off = phys - base; i < len; i++, off++)
+            cursor[i] = words[off >> 2] >> (8 * (off & 3));
+
         return len;
     }
 
@@ -221,15 +686,13 @@ ssize_t debug_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
         size_t consumed;
         int found;
 
-retry:
-        ingress = remaining > DEBUG_D_MAX_LEN ? DEBUG_D_MAX_LEN : remaining;
+        begin = tune_now();
+        ingress = tune_size(&ctx->d_tune);
+        if (ingress > remaining)
+            ingress = remaining;
 
-        rc = asprintf(&command, "d %x %zx", phys, ingress);
-        if (rc < 0)
-            return -1;
-
-        rc = prompt_run(&ctx->prompt, command);
-        free(command);
+        rc = prompt_run_line(&ctx->prompt, ctx->cmd,
+                             debug_format(ctx, 'd', phys, true, ingress));
         if (rc < 0)
             return -1;
 
@@ -246,96 +709,200 @@ retry:
             if (found < 0)
                 return -1;
 
-            rc = debug_parse_d(line, cursor);
-            if (rc < 0) {
-                rc = prompt_run(&ctx->prompt, "");
-                if (rc < 0)
-                    return -1;
-                rc = prompt_expect(&ctx->prompt, "$ ");
-                if (rc < 0)
-                    return -1;
-                loge("Failed to parse line '%s'\n", line);
-                loge("Retrying from address 0x%"PRIx32"\n", phys);
-                goto retry;
-            }
+            rc = debug_parse_d(line, phys + consumed, (uint8_t *)cursor,
+                               ingress - consumed);
+            if (rc <= 0)
+                break;
 
             cursor += rc;
             consumed += rc;
         } while (consumed < ingress);
 
-        /*
-         * Normally we would prompt_expect() here, but prompt_gets() has likely
-         * swallowed the prompt, so we'll YOLO and just assume it's done.
-         */
+        /* Keep the lines that parsed, whatever happened after them */
+        phys += consumed;
+        remaining -= consumed;
+
+        if (consumed < ingress) {
+            rc = prompt_run(&ctx->prompt, "");
+            if (rc < 0)
+                return -1;
+            rc = prompt_expect(&ctx->prompt, "$ ");
+            if (rc < 0)
+                return -1;
+
+            loge("Failed to parse line '%s'\n", line);
+
+            failures = consumed ? 1 : failures + 1;
+            if (failures > DEBUG_D_RETRIES) {
+                loge("Giving up at address 0x%"PRIx32"\n", phys);
+                return -1;
+            }
+
+            /* Smaller chunks bound what the next corrupt line costs */
+            tune_error(&ctx->d_tune);
+
+            loge("Retrying from address 0x%"PRIx32"\n", phys);
+            continue;
+        }
 
-        phys += ingress;
-        remaining -= ingress;
+        /* The prompt follows the last line, leave nothing for the next command */
+        rc = prompt_expect(&ctx->prompt, "$ ");
+        if (rc <= 0)
+            return -1;
+
+        failures = 0;
+        /* Short tails carry the command's overhead on too few lines to judge */
+        if (ingress == tune_size(&ctx->d_tune))
+            tune_sample(&ctx->d_tune, ingress, tune_now() - begin);
     } while(remaining);
 
     return len;
 }
 
-#define DEBUG_CMD_U_MAX 128
+/*
+ * Lines are only fetched where ahb_prefetchable() says reads have no side
+ * effects. Status bits still change under us, and the BMC's own CPU may
+ * reconfigure things, so a line is only trusted for DEBUG_CACHE_TTL_US. Any
+ * write through the bridge drops every line, as writes elsewhere can move what
+ * these registers read back, e.g. resets.
+ */
+
+/* A sweep's worth at 'r' round trip rates, short of anything a human sees */
+#define DEBUG_CACHE_TTL_US 20000
+
+static bool debug_cache;
+
+void debug_enable_cache(void)
+{
+    debug_cache = true;
+}
+
+static uint64_t debug_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static void debug_cache_invalidate(struct debug *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < DEBUG_CACHE_LINES; i++)
+        ctx->cache[i].valid = false;
+}
+
+/*
+ * The cached value of the aligned word at @phys, fetching its line with a 'd'
+ * if @fill is set. Returns false if the caller has to read it itself.
+ */
+static bool debug_cache_lookup(struct debug *ctx, uint32_t phys, bool fill,
+                               uint32_t *val)
+{
+    uint32_t base = phys & ~(DEBUG_LINE_LEN - 1);
+    struct debug_line *line;
+    const uint8_t *bytes;
+    uint64_t now;
+
+    if (!debug_cache || (phys & 3) || !ahb_prefetchable(base, DEBUG_LINE_LEN))
+        return false;
+
+    line = &ctx->cache[(base / DEBUG_LINE_LEN) % DEBUG_CACHE_LINES];
+    now = debug_now_us();
+
+    if (!line->valid || line->phys != base || now >= line->expires_us) {
+        if (!fill)
+            return false;
+
+        line->valid = false;
+        if (debug_read(&ctx->ahb, base, line->data, DEBUG_LINE_LEN) < 0)
+            return false;
+
+        line->valid = true;
+        line->phys = base;
+        line->expires_us = now + DEBUG_CACHE_TTL_US;
+    }
+
+    bytes = &line->data[phys - base];
+    *val = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+           ((uint32_t)bytes[3] << 24);
+
+    return true;
+}
+
+/* The monitor is known to take 128-byte uploads, larger ones are opt-in */
+#define DEBUG_CMD_U_DEFAULT 128
+#define DEBUG_CMD_U_MAX     (64 * 1024)
+
+static size_t debug_upload = DEBUG_CMD_U_DEFAULT;
+
+int debug_set_upload(size_t len)
+{
+    if (!len || len > DEBUG_CMD_U_MAX)
+        return -EINVAL;
+
+    debug_upload = len;
+
+    return 0;
+}
 
 ssize_t debug_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
 {
     struct debug *ctx = to_debug(ahb);
+    struct iovec iov[2];
     const void *cursor;
     size_t remaining;
     size_t egress;
-    char *command;
-    char mode;
     int rc;
 
     if (len > SSIZE_MAX) {
         return -1;
     }
 
-    if (len <= 4) {
-        size_t remaining;
+    if (!len)
+        return 0;
 
-        remaining = len;
-        cursor = buf;
-        while (remaining) {
-            rc = asprintf(&command, "o %x %hhx", phys, *(const uint8_t *)cursor);
-            if (rc < 0)
-                return -1;
+    debug_cache_invalidate(ctx);
 
-            rc = prompt_run(&ctx->prompt, command);
-            if (rc < 0)
-                return -1;
+    if (len == 1) {
+        rc = prompt_run_line(&ctx->prompt, ctx->cmd,
+                             debug_format(ctx, 'o', phys, true,
+                                          *(const uint8_t *)buf));
+        if (rc < 0)
+            return -1;
 
-            rc = prompt_expect(&ctx->prompt, "$ ");
-            if (rc < 0)
-                return rc;
-            if (rc == 0)
-                return -1;
+        return prompt_expect(&ctx->prompt, "$ ") < 0 ? -1 : 1;
+    }
 
-            cursor++;
-            phys++;
-            remaining--;
-        }
+    /*
+     * Widening the access to a read-modify-write of the whole word would change
+     * what registers see, so an aligned word goes out as a 'w' and anything
+     * else shorter than a chunk as a single 'u', which keeps to byte writes.
+     */
+    if (len == 4 && !(phys & 3)) {
+        const uint8_t *bytes = buf;
+        uint32_t val;
 
-        return len;
-    }
+        val = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) |
+              ((uint32_t)bytes[3] << 24);
 
-    mode = 'u';
+        return debug_writel(ahb, phys, val) < 0 ? -1 : 4;
+    }
 
     remaining = len;
     cursor = buf;
     do {
-        egress = remaining > DEBUG_CMD_U_MAX ? DEBUG_CMD_U_MAX : remaining;
+        egress = remaining > debug_upload ? debug_upload : remaining;
 
-        rc = asprintf(&command, "%c %x %zx", mode, phys, egress);
-        if (rc < 0)
-            return -1;
-
-        rc = prompt_run(&ctx->prompt, command);
-        free(command);
-        if (rc < 0)
-            return -1;
+        /* The command and its payload go out together */
+        iov[0].iov_base = ctx->cmd;
+        iov[0].iov_len = debug_format(ctx, 'u', phys, true, egress);
+        iov[1].iov_base = (void *)cursor;
+        iov[1].iov_len = egress;
 
-        rc = prompt_write(&ctx->prompt, (const char *)cursor, egress);
+        rc = prompt_writev(&ctx->prompt, iov, 2);
         if (rc < 0)
             return -1;
 
@@ -354,37 +921,131 @@ ssize_t debug_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
 int debug_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
 {
     struct debug *ctx = to_debug(ahb);
-    return debug_read_fixed(ctx, 'r', phys, val);
+    struct debug_pipe pipe;
+    int rc;
+
+    if (debug_cache_lookup(ctx, phys, true, val))
+        return 0;
+
+    debug_pipe_init(&pipe, ctx);
+    rc = debug_pipe_submit(&pipe, val, sizeof(*val), 'r', phys, false, 0);
+
+    return debug_pipe_finish(&pipe, rc);
+}
+
+/* XXX: This kludge is super annoying */
+static bool debug_writel_has_prompt(uint32_t phys, uint32_t val)
+{
+#define AST_G5_WDT	0x1e785000
+#define   WDT_RELOAD	0x04
+    return !((phys & ~0x20) == (AST_G5_WDT | WDT_RELOAD) && val == 0);
+#undef AST_G5_WDT
+#undef    WDT_RELOAD
 }
 
 int debug_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
 {
     struct debug *ctx = to_debug(ahb);
-    char *command;
+    struct debug_pipe pipe;
     int rc;
 
-    rc = asprintf(&command, "w %x %x", phys, val);
-    if (rc < 0)
-        return -errno;
+    debug_cache_invalidate(ctx);
 
-    rc = prompt_run(&ctx->prompt, command);
-    if (rc < 0)
-        return rc;
+    if (!debug_writel_has_prompt(phys, val)) {
+        rc = prompt_run_line(&ctx->prompt, ctx->cmd,
+                             debug_format(ctx, 'w', phys, true, val));
+        return rc < 0 ? rc : 0;
+    }
 
-    /* XXX: This kludge is super annoying */
-#define AST_G5_WDT	0x1e785000
-#define   WDT_RELOAD	0x04
-    if (!((phys & ~0x20) == (AST_G5_WDT | WDT_RELOAD) && val == 0)) {
-#undef AST_G5_WDT
-#undef    WDT_RELOAD
-        rc = prompt_expect(&ctx->prompt, "$ ");
-        if (rc < 0)
-            return rc;
-        if (rc == 0)
-            return -EINVAL;
+    debug_pipe_init(&pipe, ctx);
+    rc = debug_pipe_submit(&pipe, NULL, 0, 'w', phys, true, val);
+
+    return debug_pipe_finish(&pipe, rc);
+}
+
+ssize_t debug_readv(struct ahb *ahb, const struct ahb_iov *iov, size_t iovcnt)
+{
+    struct debug *ctx = to_debug(ahb);
+    struct debug_pipe pipe;
+    ssize_t total = 0;
+    ssize_t rc = 0;
+    size_t i;
+
+    debug_pipe_init(&pipe, ctx);
+
+    for (i = 0; i < iovcnt && rc >= 0; i++) {
+        if (ahb_iov_is_word(&iov[i])) {
+            uint32_t val;
+
+            /* Fetching a line here would stall the pipe, so only hits count */
+            if (debug_cache_lookup(ctx, iov[i].phys, false, &val)) {
+                memcpy(iov[i].base, &val, sizeof(val));
+                total += 4;
+                continue;
+            }
+
+            rc = debug_pipe_submit(&pipe, iov[i].base, 4, 'r', iov[i].phys,
+                                   false, 0);
+            total += 4;
+            continue;
+        }
+
+        /* Bulk reads own the link while they run */
+        if ((rc = debug_pipe_drain(&pipe)) < 0)
+            break;
+
+        if ((rc = debug_read(ahb, iov[i].phys, iov[i].base, iov[i].len)) < 0)
+            break;
+
+        total += rc;
     }
 
-    return 0;
+    return debug_pipe_finish(&pipe, rc) < 0 ? -1 : total;
+}
+
+ssize_t debug_writev(struct ahb *ahb, const struct ahb_iov *iov, size_t iovcnt)
+{
+    struct debug *ctx = to_debug(ahb);
+    struct debug_pipe pipe;
+    ssize_t total = 0;
+    ssize_t rc = 0;
+    uint32_t val;
+    size_t i;
+
+    debug_cache_invalidate(ctx);
+    debug_pipe_init(&pipe, ctx);
+
+    for (i = 0; i < iovcnt && rc >= 0; i++) {
+        bool word = ahb_iov_is_word(&iov[i]);
+
+        if (word) {
+            memcpy(&val, iov[i].base, sizeof(val));
+
+            if (debug_writel_has_prompt(iov[i].phys, val)) {
+                rc = debug_pipe_submit(&pipe, NULL, 0, 'w', iov[i].phys,
+                                       true, val);
+                total += sizeof(val);
+                continue;
+            }
+        }
+
+        /* Everything else goes out on its own once the pipe is empty */
+        if ((rc = debug_pipe_drain(&pipe)) < 0)
+            break;
+
+        if (word) {
+            if ((rc = debug_writel(ahb, iov[i].phys, val)) < 0)
+                break;
+            rc = sizeof(val);
+        } else {
+            if ((rc = debug_write(ahb, iov[i].phys, iov[i].base, iov[i].len)) < 0)
+                break;
+        }
+
+        total += rc;
+    }
+
+    return debug_pipe_finish(&pipe, rc) < 0 ? -1 : total;
 }
 
 static int ts16_console_init(struct debug *ctx, va_list args)
@@ -454,7 +1115,9 @@ static const struct ahb_ops debug_ahb_ops = {
     .read = debug_read,
     .write = debug_write,
     .readl = debug_readl,
-    .writel = debug_writel
+    .writel = debug_writel,
+    .readv = debug_readv,
+    .writev = debug_writev,
 };
 
 static struct ahb *debug_driver_probe(int argc, char *argv[]);
@@ -468,6 +1131,14 @@ static struct bridge_driver debug_driver = {
     .destroy = debug_driver_destroy,
     .release = debug_driver_release,
     .reinit = debug_driver_reinit,
+    .bus = "uart",
+    .priority = 60,
+    .caps = {
+        .burst = DEBUG_D_MAX_LEN,
+        .subword = true,
+        .op_ns = 5000000,
+        .byte_ps = 200000000,
+    },
 };
 REGISTER_BRIDGE_DRIVER(debug_driver);
 
@@ -496,6 +1167,11 @@ int debug_init_v(struct debug *ctx, va_list args)
     if (rc < 0) { goto cleanup_ts16; }
 
     ahb_init_ops(&ctx->ahb, &debug_driver, &debug_ahb_ops);
+    ctx->escalated = false;
+    ctx->stub = false;
+    tune_init(&ctx->d_tune, "debug 'd'", DEBUG_D_MAX_LEN, DEBUG_D_MIN_LEN,
+              DEBUG_D_MAX_LEN, DEBUG_D_MIN_LEN);
+    debug_cache_invalidate(ctx);
 
     return 0;
 
@@ -550,6 +1226,11 @@ static struct ahb *debug_driver_probe(int argc, char *argv[])
         goto destroy_ctx;
     }
 
+    if ((rc = debug_escalate(ctx)) < 0) {
+        loge("Failed to escalate debug UART rate: %d\n", rc);
+        goto destroy_ctx;
+    }
+
     return debug_as_ahb(ctx);
 
 destroy_ctx:
@@ -581,12 +1262,22 @@ static int debug_driver_release(struct ahb *ahb)
 {
     struct debug *ctx = to_debug(ahb);
 
+    /* Whatever happens on the BMC meanwhile goes unseen */
+    debug_cache_invalidate(ctx);
+
     return debug_exit(ctx);
 }
 
 static int debug_driver_reinit(struct ahb *ahb)
 {
     struct debug *ctx = to_debug(ahb);
+    int rc;
+
+    if (ctx->stub)
+        return 0;
+
+    if ((rc = debug_enter(ctx)) < 0)
+        return rc;
 
-    return debug_enter(ctx);
+    return debug_escalate(ctx);
 }
@@ -7,17 +7,43 @@
 #include "ahb.h"
 #include "console.h"
 #include "prompt.h"
+#include "tune.h"
 
 #include <errno.h>
 #include <stdarg.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <sys/types.h>
 
+/* A 'd' line's worth of registers, see debug_enable_cache() */
+#define DEBUG_LINE_LEN      16
+#define DEBUG_CACHE_LINES   64
+
+/* The longest command sent, "u ADDRESS LENGTH" and the end of line */
+#define DEBUG_CMD_MAX       sizeof("u ffffffff ffffffffffffffff\r\n")
+
+struct debug_line {
+    bool valid;
+    uint32_t phys;
+    uint64_t expires_us;
+    uint8_t data[DEBUG_LINE_LEN];
+};
+
 struct debug {
     struct ahb ahb;
     struct console *console;
     struct prompt prompt;
     int port;
+    /* SCU2C as found, restored when leaving the escalated rate */
+    uint32_t misc;
+    bool escalated;
+    /* Talking to `serve --stub` over a VUART rather than the monitor */
+    bool stub;
+    /* Sizes 'd' dumps, shrinking them as lines are lost to noise */
+    struct tune d_tune;
+    struct debug_line cache[DEBUG_CACHE_LINES];
+    /* Where each command is formatted, see debug_format() */
+    char cmd[DEBUG_CMD_MAX];
 };
 
 int debug_init(struct debug *ctx, ...);
@@ -28,6 +54,9 @@ int debug_enter(struct debug *ctx);
 int debug_exit(struct debug *ctx);
 int debug_probe(struct debug *ctx);
 
+/* Raise the line rate after debug_enter(), debug_exit() restores it */
+int debug_escalate(struct debug *ctx);
+
 static inline struct ahb *debug_as_ahb(struct debug *ctx)
 {
     return &ctx->ahb;
@@ -37,5 +66,29 @@ ssize_t debug_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len);
 ssize_t debug_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len);
 int debug_readl(struct ahb *ahb, uint32_t phys, uint32_t *val);
 int debug_writel(struct ahb *ahb, uint32_t phys, uint32_t val);
+ssize_t debug_readv(struct ahb *ahb, const struct ahb_iov *iov, size_t iovcnt);
+ssize_t debug_writev(struct ahb *ahb, const struct ahb_iov *iov, size_t iovcnt);
+
+/* Decode a line of 'd' output for @phys into at most @len bytes of @buf */
+ssize_t debug_parse_d(const char *line, uint32_t phys, uint8_t *buf,
+                      size_t len);
+
+/* Bytes of commands to have in flight ahead of their responses */
+void debug_set_credits(size_t credits);
+
+/* Bytes per 'u' upload, beyond 128 only if the monitor is known to cope */
+int debug_set_upload(size_t len);
+
+/* Line rate debug_escalate() aims for, the default of 115200 disables it */
+int debug_set_baud(int baud);
+
+/*
+ * Serve word reads of registers known to be safe to read ahead from 'd'
+ * lines, rather than a round trip for each
+ */
+void debug_enable_cache(void);
+
+/* Switches @ctx to the stub's binary protocol if `serve --stub` answers */
+int debug_stub_attach(struct debug *ctx);
 
 #endif
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * A compact binary transport to the BMC, in place of the debug monitor's ASCII
+ * hex protocol. It runs over a VUART, see vuart.c, where `culvert serve --stub`
+ * on the BMC itself answers the requests. Frames in both directions are an
+ * 8-byte header, @len bytes of payload, and the CRC32 of header and payload as
+ * computed by crc32_update(), all little-endian:
+ *
+ *   request:   0xc5  op  len[2]  addr[4]    payload (write)  crc[4]
+ *   response:  0x5c  op  len[2]  status[4]  payload (read)   crc[4]
+ *
+ * @status is zero or a negative errno, and a failed request carries no
+ * payload. The server accesses memory 32 bits at a time where @addr and @len
+ * are aligned, a byte at a time otherwise, and silently drops requests that
+ * fail their CRC. Requests are idempotent, so on a corrupt or missing response
+ * the host discards the line and asks again.
+ *
+ * Version 2 adds a poll request: its payload is the mask, the value and a
+ * budget in microseconds, and the server reads the word at @addr until its
+ * masked bits equal the value, answering with the word once they do or with
+ * -EAGAIN once the budget is spent. A wait on a register then costs one
+ * exchange per budget rather than one per read.
+ *
+ * Version 3 adds a modify request: its payload is a mask of bits to clear and
+ * a mask of bits to set in the word at @addr, which the server reads and
+ * writes back in one exchange. Applying it twice leaves the word as applying
+ * it once does, so it's retried like the others.
+ */
+
+#include "ahb.h"
+#include "crc32.h"
+#include "debug.h"
+#include "debugstub.h"
+#include "log.h"
+#include "prompt.h"
+
+#include "ccan/container_of/container_of.h"
+
+#include <errno.h>
+#include <stdint.h>
+
+#define to_debug(ahb) container_of(ahb, struct debug, ahb)
+
+#define DEBUGSTUB_TIMEOUT_MS    1000
+/* Well inside the response timeout */
+#define DEBUGSTUB_POLL_US       500000
+#define DEBUGSTUB_FLUSH_MS      50
+#define DEBUGSTUB_ATTEMPTS      3
+
+/* Throw away the remains of a broken exchange */
+static void debugstub_flush(struct debug *ctx)
+{
+    char c;
+
+    prompt_set_timeout(&ctx->prompt, DEBUGSTUB_FLUSH_MS);
+    while (prompt_read(&ctx->prompt, &c, 1) == 1);
+    prompt_set_timeout(&ctx->prompt, -1);
+}
+
+static int debugstub_send(struct debug *ctx, uint8_t op, uint32_t addr,
+                          const void *payload, uint16_t len, uint16_t count)
+{
+    uint8_t hdr[DEBUGSTUB_HDR_LEN], crc[DEBUGSTUB_CRC_LEN];
+    ssize_t rc;
+
+    hdr[0] = DEBUGSTUB_SYNC_REQ;
+    hdr[1] = op;
+    debugstub_put_le16(&hdr[2], count);
+    debugstub_put_le32(&hdr[4], addr);
+
+    debugstub_put_le32(crc, crc32_update(crc32_update(0, hdr, sizeof(hdr)),
+                                         payload, len));
+
+    if ((rc = prompt_write(&ctx->prompt, (char *)hdr, sizeof(hdr))) < 0)
+        return rc;
+
+    if (len && (rc = prompt_write(&ctx->prompt, payload, len)) < 0)
+        return rc;
+
+    rc = prompt_write(&ctx->prompt, (char *)crc, sizeof(crc));
+
+    return rc < 0 ? rc : 0;
+}
+
+/* -EBADMSG and -ETIMEDOUT are worth a retry, anything else isn't */
+static int debugstub_recv(struct debug *ctx, uint8_t op, void *payload,
+                          uint16_t len)
+{
+    uint8_t hdr[DEBUGSTUB_HDR_LEN], crc[DEBUGSTUB_CRC_LEN];
+    uint32_t sum;
+    int32_t status;
+    ssize_t rc;
+
+    prompt_set_timeout(&ctx->prompt, DEBUGSTUB_TIMEOUT_MS);
+
+    /* Skip over whatever the line picked up between frames */
+    do {
+        if ((rc = prompt_read(&ctx->prompt, (char *)hdr, 1)) < 0)
+            goto done;
+    } while (hdr[0] != DEBUGSTUB_SYNC_RSP);
+
+    rc = prompt_read(&ctx->prompt, (char *)&hdr[1], sizeof(hdr) - 1);
+    if (rc < 0)
+        goto done;
+
+    status = debugstub_get_le32(&hdr[4]);
+    if (hdr[1] != op || debugstub_get_le16(&hdr[2]) != (status ? 0 : len)) {
+        rc = -EBADMSG;
+        goto done;
+    }
+
+    if (!status && len && (rc = prompt_read(&ctx->prompt, payload, len)) < 0)
+        goto done;
+
+    if ((rc = prompt_read(&ctx->prompt, (char *)crc, sizeof(crc))) < 0)
+        goto done;
+
+    sum = crc32_update(0, hdr, sizeof(hdr));
+    if (!status)
+        sum = crc32_update(sum, payload, len);
+
+    if (debugstub_get_le32(crc) != sum)
+        rc = -EBADMSG;
+    else
+        rc = status;
+
+done:
+    prompt_set_timeout(&ctx->prompt, -1);
+
+    return rc < 0 ? rc : 0;
+}
+
+/* One of @out and @in is NULL, @len is the payload of whichever isn't */
+static int debugstub_xfer(struct debug *ctx, uint8_t op, uint32_t addr,
+                          const void *out, void *in, uint16_t len,
+                          int attempts)
+{
+    int rc = -EINVAL;
+
+    while (attempts--) {
+        rc = debugstub_send(ctx, op, addr, out, out ? len : 0, len);
+        if (rc < 0)
+            return rc;
+
+        rc = debugstub_recv(ctx, op, in, in ? len : 0);
+        if (rc != -EBADMSG && rc != -ETIMEDOUT)
+            return rc;
+
+        logd("Debug stub request %u at 0x%08x failed: %d\n", op, addr, rc);
+        debugstub_flush(ctx);
+    }
+
+    return rc;
+}
+
+static ssize_t debugstub_read(struct ahb *ahb, uint32_t phys, void *buf,
+                              size_t len)
+{
+    struct debug *ctx = to_debug(ahb);
+    size_t remaining = len;
+    uint8_t *cursor = buf;
+    int rc;
+
+    while (remaining) {
+        uint16_t chunk = remaining > DEBUGSTUB_MAX ? DEBUGSTUB_MAX : remaining;
+
+        rc = debugstub_xfer(ctx, debugstub_op_read, phys, NULL, cursor, chunk,
+                            DEBUGSTUB_ATTEMPTS);
+        if (rc < 0)
+            return rc;
+
+        phys += chunk;
+        cursor += chunk;
+        remaining -= chunk;
+    }
+
+    return len;
+}
+
+static ssize_t debugstub_write(struct ahb *ahb, uint32_t phys, const void *buf,
+                               size_t len)
+{
+    struct debug *ctx = to_debug(ahb);
+    const uint8_t *cursor = buf;
+    size_t remaining = len;
+    int rc;
+
+    while (remaining) {
+        uint16_t chunk = remaining > DEBUGSTUB_MAX ? DEBUGSTUB_MAX : remaining;
+
+        rc = debugstub_xfer(ctx, debugstub_op_write, phys, cursor, NULL, chunk,
+                            DEBUGSTUB_ATTEMPTS);
+        if (rc < 0)
+            return rc;
+
+        phys += chunk;
+        cursor += chunk;
+        remaining -= chunk;
+    }
+
+    return len;
+}
+
+static int debugstub_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    uint8_t buf[4];
+    int rc;
+
+    rc = debugstub_xfer(to_debug(ahb), debugstub_op_read, phys, NULL, buf,
+                        sizeof(buf), DEBUGSTUB_ATTEMPTS);
+    if (rc < 0)
+        return rc;
+
+    *val = debugstub_get_le32(buf);
+
+    return 0;
+}
+
+static int debugstub_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    uint8_t buf[4];
+
+    debugstub_put_le32(buf, val);
+
+    return debugstub_xfer(to_debug(ahb), debugstub_op_write, phys, buf, NULL,
+                          sizeof(buf), DEBUGSTUB_ATTEMPTS);
+}
+
+/*
+ * The server spins without pause between its reads, and long waits are split
+ * into budgets the response timeout allows.
+ */
+static int debugstub_poll(struct ahb *ahb, uint32_t phys, uint32_t mask,
+                          uint32_t value, uint64_t timeout_us,
+                          const struct ahb_poll_policy *policy, uint32_t *val)
+{
+    struct debug *ctx = to_debug(ahb);
+    uint8_t args[12], buf[4];
+    struct ahb_poller poller;
+    int attempts;
+    int rc;
+
+    debugstub_put_le32(&args[0], mask);
+    debugstub_put_le32(&args[4], value);
+
+    ahb_poller_start(ahb, &poller, policy, timeout_us);
+    do {
+        uint64_t budget = ahb_poller_remaining(&poller);
+
+        if (budget > DEBUGSTUB_POLL_US)
+            budget = DEBUGSTUB_POLL_US;
+
+        debugstub_put_le32(&args[8], budget);
+
+        for (attempts = DEBUGSTUB_ATTEMPTS; attempts; attempts--) {
+            rc = debugstub_send(ctx, debugstub_op_poll, phys, args,
+                                sizeof(args), sizeof(args));
+            if (rc < 0)
+                return rc;
+
+            rc = debugstub_recv(ctx, debugstub_op_poll, buf, sizeof(buf));
+            if (rc != -EBADMSG && rc != -ETIMEDOUT)
+                break;
+
+            logd("Debug stub poll at 0x%08x failed: %d\n", phys, rc);
+            debugstub_flush(ctx);
+        }
+
+        if (!rc) {
+            *val = debugstub_get_le32(buf);
+            return 0;
+        }
+
+        if (rc != -EAGAIN)
+            return rc;
+    } while (ahb_poller_next(ahb, &poller));
+
+    /* Leave the caller with the word as it stands */
+    if ((rc = debugstub_readl(ahb, phys, val)) < 0)
+        return rc;
+
+    return -ETIMEDOUT;
+}
+
+static int debugstub_modifyl(struct ahb *ahb, uint32_t phys, uint32_t clear,
+                             uint32_t set)
+{
+    uint8_t args[8];
+
+    debugstub_put_le32(&args[0], clear);
+    debugstub_put_le32(&args[4], set);
+
+    return debugstub_xfer(to_debug(ahb), debugstub_op_modify, phys, args, NULL,
+                          sizeof(args), DEBUGSTUB_ATTEMPTS);
+}
+
+static const struct ahb_ops debugstub_ahb_ops = {
+    .read = debugstub_read,
+    .write = debugstub_write,
+    .readl = debugstub_readl,
+    .writel = debugstub_writel,
+};
+
+static const struct ahb_ops debugstub_v2_ahb_ops = {
+    .read = debugstub_read,
+    .write = debugstub_write,
+    .readl = debugstub_readl,
+    .writel = debugstub_writel,
+    .poll = debugstub_poll,
+};
+
+static const struct ahb_ops debugstub_v3_ahb_ops = {
+    .read = debugstub_read,
+    .write = debugstub_write,
+    .readl = debugstub_readl,
+    .writel = debugstub_writel,
+    .poll = debugstub_poll,
+    .modifyl = debugstub_modifyl,
+};
+
+int debug_stub_attach(struct debug *ctx)
+{
+    uint8_t version[4];
+    int rc;
+
+    debugstub_flush(ctx);
+
+    /* A single attempt, there's usually nothing there to answer */
+    rc = debugstub_xfer(ctx, debugstub_op_ping, 0, NULL, version,
+                        sizeof(version), 1);
+    if (rc < 0) {
+        logd("No debug stub answered: %d\n", rc);
+        return rc;
+    }
+
+    if (!debugstub_get_le32(version) ||
+        debugstub_get_le32(version) > DEBUGSTUB_VERSION) {
+        loge("Unsupported debug stub protocol version %u\n",
+             debugstub_get_le32(version));
+        return -EPROTO;
+    }
+
+    logi("Using the debug stub\n");
+
+    switch (debugstub_get_le32(version)) {
+        case 1:
+            ctx->ahb.ops = &debugstub_ahb_ops;
+            break;
+        case 2:
+            ctx->ahb.ops = &debugstub_v2_ahb_ops;
+            break;
+        default:
+            ctx->ahb.ops = &debugstub_v3_ahb_ops;
+            break;
+    }
+    ctx->stub = true;
+
+    return 0;
+}
@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _DEBUGSTUB_H
+#define _DEBUGSTUB_H
+
+#include <stdint.h>
+
+/* The framing described in debugstub.c, shared with `culvert serve --stub` */
+#define DEBUGSTUB_SYNC_REQ      0xc5
+#define DEBUGSTUB_SYNC_RSP      0x5c
+#define DEBUGSTUB_HDR_LEN       8
+#define DEBUGSTUB_CRC_LEN       4
+
+#define DEBUGSTUB_VERSION       3
+
+/* Payload bound per frame, also what a retry costs */
+#define DEBUGSTUB_MAX           4096
+
+enum debugstub_op {
+    debugstub_op_ping = 0,
+    debugstub_op_read,
+    debugstub_op_write,
+    debugstub_op_poll,
+    debugstub_op_modify,
+};
+
+static inline void debugstub_put_le16(uint8_t *p, uint16_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+}
+
+static inline void debugstub_put_le32(uint8_t *p, uint32_t val)
+{
+    debugstub_put_le16(p, val);
+    debugstub_put_le16(p + 2, val >> 16);
+}
+
+static inline uint16_t debugstub_get_le16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static inline uint32_t debugstub_get_le32(const uint8_t *p)
+{
+    return debugstub_get_le16(p) | ((uint32_t)debugstub_get_le16(p + 2) << 16);
+}
+
+#endif
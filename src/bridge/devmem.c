@@ -1,7 +1,6 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2018,2019 IBM Corp.
 
-#include <assert.h>
 #include <endian.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -28,6 +27,9 @@
 #define AST_SOC_IO	0x1e600000
 #define AST_SOC_IO_LEN	0x00200000
 
+/* Granularity of the cached windows outside the SoC IO space */
+#define DEVMEM_BLOCK	(1 << 20)
+
 #define to_devmem(ahb) container_of(ahb, struct devmem, ahb)
 
 int devmem_probe(struct devmem *ctx)
@@ -45,54 +47,105 @@ int devmem_probe(struct devmem *ctx)
     return rc < 0 ? rc : 1;
 }
 
-static int64_t devmem_setup_win(struct devmem *ctx, uint32_t phys, size_t len)
+static int devmem_unmap_win(struct devmem_win *win)
 {
-    uint32_t aligned = phys & ~(ctx->pgsize - 1);
-    uint32_t offset = phys & (ctx->pgsize - 1);
-    int rc;
+    int rc = 0;
 
-    if (ctx->win && !(ctx->phys == aligned && ctx->len >= offset + len)) {
-        rc = munmap(ctx->win, ctx->len);
-        if (rc < 0)
-            goto cleanup;
+    if (win->used && munmap(win->base, win->len) < 0)
+        rc = -errno;
 
-        ctx->win = NULL;
-    }
+    win->base = NULL;
+    win->phys = 0;
+    win->len = 0;
+    win->used = 0;
+
+    return rc;
+}
+
+static int devmem_map_win(struct devmem *ctx, struct devmem_win *win,
+                          off_t phys, size_t len)
+{
+    uint64_t span = span_begin();
+    void *base;
+
+    /*
+     * The page tables are set up before the first access rather than on it.
+     * /dev/mem already does that itself, the flag covers kernels that don't.
+     */
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                ctx->fd, phys);
+    if (base == MAP_FAILED)
+        return -errno;
 
-    if (!ctx->win) {
-        ctx->win = mmap(NULL, offset + len, PROT_READ | PROT_WRITE, MAP_SHARED,
-                        ctx->fd, aligned);
-        if (ctx->win == MAP_FAILED)
-            goto cleanup;
+    win->base = base;
+    win->phys = phys;
+    win->len = len;
+    ahb_stats_remap(&ctx->ahb, span);
 
-        ctx->phys = aligned;
-        ctx->len = offset + len;
+    return 0;
+}
+
+/*
+ * Accesses tend to alternate between a controller's registers and the memory
+ * it fronts, so keep a few mappings and evict the least recently used. Each
+ * covers whole blocks so sequential transfers stay put.
+ */
+static int devmem_setup_win(struct devmem *ctx, uint32_t phys, size_t len,
+                            void **ptr)
+{
+    struct devmem_win *win, *victim = &ctx->wins[0];
+    uint64_t start = phys, end = start + len;
+    uint64_t limit;
+    off_t aligned;
+    int i, rc;
+
+    for (i = 0; i < DEVMEM_WINS; i++) {
+        win = &ctx->wins[i];
+
+        if (win->used && (uint64_t)win->phys <= start &&
+                end <= (uint64_t)win->phys + win->len)
+            goto found;
+
+        if (win->used < victim->used)
+            victim = win;
     }
 
-    return offset;
+    win = victim;
+    if ((rc = devmem_unmap_win(win)) < 0)
+        return rc;
+
+    aligned = start & ~(uint64_t)(DEVMEM_BLOCK - 1);
+    limit = (end + DEVMEM_BLOCK - 1) & ~(uint64_t)(DEVMEM_BLOCK - 1);
+
+    rc = devmem_map_win(ctx, win, aligned, limit - aligned);
+    if (rc < 0) {
+        /* The kernel may refuse some of the block, fall back to just the pages */
+        aligned = start & ~(uint64_t)(ctx->pgsize - 1);
+        rc = devmem_map_win(ctx, win, aligned, end - aligned);
+        if (rc < 0)
+            return rc;
+    }
 
-cleanup:
-    ctx->win = NULL;
-    ctx->phys = 0;
-    ctx->len = 0;
+found:
+    win->used = ++ctx->clock;
+    *ptr = (char *)win->base + (start - win->phys);
 
-    return -errno;
+    return 0;
 }
 
 ssize_t devmem_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
 {
     struct devmem *ctx = to_devmem(ahb);
-    int64_t woff;
+    void *win;
 
     if (len > SSIZE_MAX) {
         return -1;
     }
 
-    woff = devmem_setup_win(ctx, phys, len);
-    if (woff < 0)
+    if (devmem_setup_win(ctx, phys, len, &win) < 0)
         return -1;
 
-    mmio_memcpy(buf, ctx->win + woff, len);
+    mmio_read(buf, win, len, ahb->drv->caps.mmio_width);
 
     return len;
 }
@@ -100,17 +153,16 @@ ssize_t devmem_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
 ssize_t devmem_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
 {
     struct devmem *ctx = to_devmem(ahb);
-    int64_t woff;
+    void *win;
 
     if (len > SSIZE_MAX) {
         return -1;
     }
 
-    woff = devmem_setup_win(ctx, phys, len);
-    if (woff < 0)
+    if (devmem_setup_win(ctx, phys, len, &win) < 0)
         return -1;
 
-    mmio_memcpy(ctx->win + woff, buf, len);
+    mmio_write(win, buf, len, ahb->drv->caps.mmio_width);
 
     return len;
 }
@@ -127,13 +179,13 @@ int devmem_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
         off_t offset = phys - AST_SOC_IO;
         container = *((volatile uint32_t *)(((char *)ctx->io) + offset));
     } else {
-        int64_t woff;
+        void *win;
+        int rc;
 
-        woff = devmem_setup_win(ctx, phys, sizeof(*val));
-        if (woff < 0)
-            return woff;
+        if ((rc = devmem_setup_win(ctx, phys, sizeof(*val), &win)) < 0)
+            return rc;
 
-        container = *((volatile uint32_t *)(((char *)ctx->win) + woff));
+        container = *(volatile uint32_t *)win;
     }
 
     *val = le32toh(container);
@@ -154,13 +206,13 @@ int devmem_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
         off_t offset = phys - AST_SOC_IO;
         *(volatile uint32_t *)(((char *)ctx->io) + offset) = val;
     } else {
-        int64_t woff;
+        void *win;
+        int rc;
 
-        woff = devmem_setup_win(ctx, phys, sizeof(val));
-        if (woff < 0)
-            return woff;
+        if ((rc = devmem_setup_win(ctx, phys, sizeof(val), &win)) < 0)
+            return rc;
 
-        *(volatile uint32_t *)(((char *)ctx->win) + woff) = val;
+        *(volatile uint32_t *)win = val;
     }
 
     iob();
@@ -168,11 +220,46 @@ int devmem_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
     return 0;
 }
 
-static const struct ahb_ops devmem_ahb_ops = {
+/* Spins on the mapping itself, with no system call per read */
+static int devmem_poll(struct ahb *ahb, uint32_t phys, uint32_t mask,
+                       uint32_t value, uint64_t timeout_us,
+                       const struct ahb_poll_policy *policy, uint32_t *val)
+{
+    struct devmem *ctx = to_devmem(ahb);
+    struct ahb_poller poller;
+    volatile uint32_t *reg;
+
+    if (phys & 0x3)
+        return -EINVAL;
+
+    if (phys >= AST_SOC_IO && phys < (AST_SOC_IO + AST_SOC_IO_LEN)) {
+        reg = (volatile uint32_t *)(((char *)ctx->io) + (phys - AST_SOC_IO));
+    } else {
+        void *win;
+        int rc;
+
+        if ((rc = devmem_setup_win(ctx, phys, sizeof(*val), &win)) < 0)
+            return rc;
+
+        reg = win;
+    }
+
+    ahb_poller_start(ahb, &poller, policy, timeout_us);
+    do {
+        *val = le32toh(*reg);
+        if ((*val & mask) == value)
+            return 0;
+    } while (ahb_poller_next(ahb, &poller));
+
+    return -ETIMEDOUT;
+}
+
+const struct ahb_ops devmem_ahb_ops = {
     .read = devmem_read,
     .write = devmem_write,
     .readl = devmem_readl,
-    .writel = devmem_writel
+    .writel = devmem_writel,
+    .poll = devmem_poll,
 };
 
 static struct ahb *devmem_driver_probe(int argc, char *argv[]);
@@ -183,6 +270,16 @@ static struct bridge_driver devmem_driver = {
     .probe = devmem_driver_probe,
     .destroy = devmem_driver_destroy,
     .local = true,
+    .bus = "local",
+    .priority = 0,
+    .caps = {
+        .burst = (1 << 20),
+        .subword = true,
+        .exact_reads = true,
+        .mmio_width = 8,
+        .op_ns = 100,
+        .byte_ps = 1000,
+    },
 };
 REGISTER_BRIDGE_DRIVER(devmem_driver);
 
@@ -201,7 +298,8 @@ int devmem_init(struct devmem *ctx)
                    ctx->fd, AST_SOC_IO);
     if (ctx->io == MAP_FAILED) { rc = -errno; goto cleanup_fd; }
 
-    ctx->win = NULL;
+    memset(ctx->wins, 0, sizeof(ctx->wins));
+    ctx->clock = 0;
 
     ahb_init_ops(&ctx->ahb, &devmem_driver, &devmem_ahb_ops);
 
@@ -216,13 +314,17 @@ cleanup_fd:
 
 int devmem_destroy(struct devmem *ctx)
 {
-    int rc;
+    int i, rc;
 
-    assert(!ctx->win);
+    for (i = 0; i < DEVMEM_WINS; i++) {
+        if ((rc = devmem_unmap_win(&ctx->wins[i])) < 0)
+            loge("Failed to unmap devmem window: %d\n", rc);
+    }
 
     rc = munmap(ctx->io, AST_SOC_IO_LEN);
     if (rc < 0) { perror("munmap"); }
 
+
     rc = close(ctx->fd);
     if (rc < 0) { perror("close"); }
 
@@ -9,13 +9,22 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#define DEVMEM_WINS 4
+
+struct devmem_win {
+    void *base;
+    off_t phys;
+    size_t len;
+    /* Value of the devmem clock at the last access, 0 if unmapped */
+    uint64_t used;
+};
+
 struct devmem {
     struct ahb ahb;
     int fd;
     void *io;
-    void *win;
-    off_t phys;
-    size_t len;
+    struct devmem_win wins[DEVMEM_WINS];
+    uint64_t clock;
     off_t pgsize;
 };
 
@@ -35,4 +44,7 @@ ssize_t devmem_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len
 int devmem_readl(struct ahb *ahb, uint32_t phys, uint32_t *val);
 int devmem_writel(struct ahb *ahb, uint32_t phys, uint32_t val);
 
+/* For builds specialised to the bridge, see ahb_ops_call() */
+extern const struct ahb_ops devmem_ahb_ops;
+
 #endif
@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "array.h"
+#include "bridge.h"
+#include "failover.h"
+#include "log.h"
+#include "rev.h"
+
+#include "ccan/container_of/container_of.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * The silicon ID, readable without side-effects and constant for the life of
+ * the BMC. It's SCU07C on the AST2400 and AST2500, where SCU004 is the reset
+ * control register, and SCU004 and SCU014 on the AST2600.
+ */
+static const uint32_t failover_health_g4[] = { 0x1e6e207c };
+static const uint32_t failover_health_g6[] = { 0x1e6e2004, 0x1e6e2014 };
+
+#define to_failover(ahb) container_of(ahb, struct failover, ahb)
+
+static inline struct ahb *failover_current(struct failover *ctx)
+{
+    return ctx->members[ctx->current];
+}
+
+/*
+ * A bridge is healthy if it can still read the silicon ID, and what it reads
+ * is what was read when the failover was set up. A locked P2A can return junk
+ * rather than failing. Without a reference, it's enough to identify the SoC.
+ */
+static bool failover_healthy(struct failover *ctx, struct ahb *ahb)
+{
+    uint32_t val;
+    size_t i;
+
+    if (!ctx->referenced)
+        return rev_probe(ahb) >= 0;
+
+    for (i = 0; i < ctx->nr_health; i++) {
+        if (ahb_readl(ahb, ctx->health[i], &val) < 0)
+            return false;
+
+        if (val != ctx->reference[i])
+            return false;
+    }
+
+    return true;
+}
+
+/*
+ * Whether an access to [@phys, @phys + @len) can be repeated after a failure
+ * left it unknown how much of it landed. DRAM can, as can the registers with
+ * no side-effects on read, though only for reads.
+ */
+static bool failover_repeatable(struct failover *ctx, uint32_t phys,
+                                size_t len, bool write)
+{
+    if (!write && ahb_prefetchable(phys, len))
+        return true;
+
+    return ctx->referenced && phys >= ctx->dram_start &&
+           (uint64_t)phys + len <= ctx->dram_end;
+}
+
+static bool failover_repeatablev(struct failover *ctx,
+                                 const struct ahb_iov *iov, size_t iovcnt,
+                                 bool write)
+{
+    size_t i;
+
+    for (i = 0; i < iovcnt; i++) {
+        if (!failover_repeatable(ctx, iov[i].phys, iov[i].len, write))
+            return false;
+    }
+
+    return true;
+}
+
+static void failover_update(struct failover *ctx)
+{
+    ctx->driver.caps = *ahb_bridge_caps(failover_current(ctx));
+}
+
+/*
+ * Called with the error from an access on the current bridge. Returns true
+ * once it has moved to a later bridge that passes the health check, for the
+ * access to be retried there if it's repeatable.
+ */
+static bool failover_next(struct failover *ctx, int err)
+{
+    struct ahb *failed = failover_current(ctx);
+
+    /* Errors in the request itself would follow it to the next bridge */
+    if (err == -EINVAL || err == -ENOTSUP || err == -ENOMEM || err == -EINTR)
+        return false;
+
+    if (failover_healthy(ctx, failed)) {
+        logd("%s failed with %d but is still healthy, not failing over\n",
+             failed->drv->name, err);
+        return false;
+    }
+
+    while (ctx->current + 1 < ctx->nr_members) {
+        struct ahb *next = ctx->members[++ctx->current];
+
+        if (failover_healthy(ctx, next)) {
+            logi("%s failed with %d, failing over to %s\n", failed->drv->name,
+                 err, next->drv->name);
+            ctx->switches++;
+            failover_update(ctx);
+            return true;
+        }
+
+        logi("%s is unavailable too\n", next->drv->name);
+    }
+
+    loge("%s failed with %d and there's no bridge left to fail over to\n",
+         failed->drv->name, err);
+
+    return false;
+}
+
+static ssize_t failover_read(struct ahb *ahb, uint32_t phys, void *buf,
+                             size_t len)
+{
+    struct failover *ctx = to_failover(ahb);
+    ssize_t rc;
+
+    while ((rc = ahb_read(failover_current(ctx), phys, buf, len)) < 0 &&
+           failover_next(ctx, rc) &&
+           failover_repeatable(ctx, phys, len, false))
+        ;
+
+    return rc;
+}
+
+static ssize_t failover_write(struct ahb *ahb, uint32_t phys, const void *buf,
+                              size_t len)
+{
+    struct failover *ctx = to_failover(ahb);
+    ssize_t rc;
+
+    while ((rc = ahb_write(failover_current(ctx), phys, buf, len)) < 0 &&
+           failover_next(ctx, rc) &&
+           failover_repeatable(ctx, phys, len, true))
+        ;
+
+    return rc;
+}
+
+static int failover_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    struct failover *ctx = to_failover(ahb);
+    int rc;
+
+    while ((rc = ahb_readl(failover_current(ctx), phys, val)) < 0 &&
+           failover_next(ctx, rc) && failover_repeatable(ctx, phys, 4, false))
+        ;
+
+    return rc;
+}
+
+static int failover_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    struct failover *ctx = to_failover(ahb);
+    int rc;
+
+    while ((rc = ahb_writel(failover_current(ctx), phys, val)) < 0 &&
+           failover_next(ctx, rc) && failover_repeatable(ctx, phys, 4, true))
+        ;
+
+    return rc;
+}
+
+static ssize_t failover_readv(struct ahb *ahb, const struct ahb_iov *iov,
+                              size_t iovcnt)
+{
+    struct failover *ctx = to_failover(ahb);
+    ssize_t rc;
+
+    while ((rc = ahb_readv(failover_current(ctx), iov, iovcnt)) < 0 &&
+           failover_next(ctx, rc) &&
+           failover_repeatablev(ctx, iov, iovcnt, false))
+        ;
+
+    return rc;
+}
+
+static ssize_t failover_writev(struct ahb *ahb, const struct ahb_iov *iov,
+                               size_t iovcnt)
+{
+    struct failover *ctx = to_failover(ahb);
+    ssize_t rc;
+
+    while ((rc = ahb_writev(failover_current(ctx), iov, iovcnt)) < 0 &&
+           failover_next(ctx, rc) &&
+           failover_repeatablev(ctx, iov, iovcnt, true))
+        ;
+
+    return rc;
+}
+
+/* A timeout is the register not changing, not the bridge failing */
+static int failover_poll(struct ahb *ahb, uint32_t phys, uint32_t mask,
+                         uint32_t value, uint64_t timeout_us,
+                         const struct ahb_poll_policy *policy, uint32_t *val)
+{
+    struct failover *ctx = to_failover(ahb);
+    int rc;
+
+    while ((rc = ahb_poll(failover_current(ctx), phys, mask, value,
+                          timeout_us, policy, val)) < 0 &&
+           rc != -ETIMEDOUT && failover_next(ctx, rc) &&
+           failover_repeatable(ctx, phys, 4, false))
+        ;
+
+    return rc;
+}
+
+static int failover_modifyl(struct ahb *ahb, uint32_t phys, uint32_t clear,
+                            uint32_t set)
+{
+    struct failover *ctx = to_failover(ahb);
+    int rc;
+
+    while ((rc = ahb_modifyl(failover_current(ctx), phys, clear, set)) < 0 &&
+           failover_next(ctx, rc) && failover_repeatable(ctx, phys, 4, true))
+        ;
+
+    return rc;
+}
+
+static int failover_aperture(struct ahb *ahb, uint32_t phys, size_t len)
+{
+    struct failover *ctx = to_failover(ahb);
+    int rc, found = -ENOTSUP;
+    size_t i;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if (!ahb_has_aperture(ctx->members[i]))
+            continue;
+
+        if ((rc = ahb_set_aperture(ctx->members[i], phys, len)) < 0)
+            return rc;
+
+        found = 0;
+    }
+
+    return found;
+}
+
+/* Only the current bridge holds a session, the others open one on takeover */
+static int failover_session(struct ahb *ahb, bool open)
+{
+    struct failover *ctx = to_failover(ahb);
+
+    return open ? ahb_session_begin(failover_current(ctx)) :
+                  ahb_session_end(failover_current(ctx));
+}
+
+static const struct ahb_ops failover_ops = {
+    .read = failover_read,
+    .write = failover_write,
+    .readl = failover_readl,
+    .writel = failover_writel,
+    .readv = failover_readv,
+    .writev = failover_writev,
+    .aperture = failover_aperture,
+    .session = failover_session,
+    .poll = failover_poll,
+    .modifyl = failover_modifyl,
+};
+
+static int failover_release(struct ahb *ahb)
+{
+    struct failover *ctx = to_failover(ahb);
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if ((rc = ahb_release_bridge(ctx->members[i])) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int failover_reinit(struct ahb *ahb)
+{
+    struct failover *ctx = to_failover(ahb);
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if ((rc = ahb_reinit_bridge(ctx->members[i])) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+void failover_init(struct failover *ctx)
+{
+    memset(&ctx->driver, 0, sizeof(ctx->driver));
+    ctx->driver.name = "failover";
+    ctx->driver.release = failover_release;
+    ctx->driver.reinit = failover_reinit;
+
+    ctx->nr_members = 0;
+    ctx->current = 0;
+    ctx->referenced = false;
+    ctx->switches = 0;
+
+    ahb_init_ops(&ctx->ahb, &ctx->driver, &failover_ops);
+}
+
+int failover_add(struct failover *ctx, struct ahb *ahb)
+{
+    int64_t rev;
+    size_t i;
+
+    if (ctx->nr_members == FAILOVER_MAX_MEMBERS)
+        return -ENOSPC;
+
+    /* The first bridge to identify the SoC sets what healthy looks like */
+    if (!ctx->referenced && (rev = rev_probe(ahb)) >= 0) {
+        switch (rev_generation(rev)) {
+            case ast_g4:
+                ctx->health = failover_health_g4;
+                ctx->nr_health = ARRAY_SIZE(failover_health_g4);
+                ctx->dram_start = 0x40000000;
+                ctx->dram_end = 0x60000000;
+                break;
+            case ast_g5:
+                ctx->health = failover_health_g4;
+                ctx->nr_health = ARRAY_SIZE(failover_health_g4);
+                ctx->dram_start = 0x80000000;
+                ctx->dram_end = 0xc0000000;
+                break;
+            case ast_g6:
+            default:
+                ctx->health = failover_health_g6;
+                ctx->nr_health = ARRAY_SIZE(failover_health_g6);
+                ctx->dram_start = 0x80000000;
+                ctx->dram_end = 0x100000000ULL;
+                break;
+        }
+
+        for (i = 0; i < ctx->nr_health; i++) {
+            if (ahb_readl(ahb, ctx->health[i], &ctx->reference[i]) < 0)
+                break;
+        }
+
+        ctx->referenced = (i == ctx->nr_health);
+    }
+
+    ctx->members[ctx->nr_members++] = ahb;
+
+    if (ctx->nr_members == 1)
+        failover_update(ctx);
+
+    return 0;
+}
+
+void failover_destroy(struct failover *ctx)
+{
+    if (ctx->switches)
+        logi("Failed over %u times, finishing on %s\n", ctx->switches,
+             failover_current(ctx)->drv->name);
+
+    ctx->nr_members = 0;
+    ctx->current = 0;
+}
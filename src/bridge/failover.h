@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _FAILOVER_H
+#define _FAILOVER_H
+
+#include "ahb.h"
+#include "bridge.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define FAILOVER_MAX_MEMBERS 8
+
+/*
+ * Sends every access through one bridge, moving on to the next in order of
+ * preference when an access fails and a health check finds the bridge gone,
+ * as when the BMC locks P2A or the debug UART drops. The failed access is
+ * retried on the new bridge only where repeating it can't have side effects,
+ * that is DRAM and the registers ahb_prefetchable() covers, so a DRAM transfer
+ * carries on from the chunk it was on. Anything else fails up to the caller,
+ * with later accesses going to the new bridge.
+ */
+struct failover {
+    struct ahb ahb;
+    struct bridge_driver driver;
+    struct ahb *members[FAILOVER_MAX_MEMBERS];
+    size_t nr_members;
+    size_t current;
+    /* The SCU's silicon ID registers for the generation, and as first read */
+    const uint32_t *health;
+    size_t nr_health;
+    uint32_t reference[2];
+    bool referenced;
+    /* The generation's DRAM window, where accesses are safe to repeat */
+    uint32_t dram_start;
+    uint64_t dram_end;
+    unsigned int switches;
+};
+
+void failover_init(struct failover *ctx);
+/* Members are tried in the order they're added */
+int failover_add(struct failover *ctx, struct ahb *ahb);
+void failover_destroy(struct failover *ctx);
+
+static inline struct ahb *failover_as_ahb(struct failover *ctx)
+{
+    return &ctx->ahb;
+}
+
+#endif
@@ -11,10 +11,12 @@
 #include "ccan/container_of/container_of.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #define LPC_HICRB_ILPCB_RO (1 << 6)
 
@@ -34,6 +36,15 @@ int ilpcb_probe(struct ilpcb *ctx)
     return rc < 0 ? rc : 1;
 }
 
+int ilpcb_arbitrate(struct ilpcb *ctx, struct ahb *ahb)
+{
+    char resource[sizeof("sio-ffff")];
+
+    snprintf(resource, sizeof(resource), "sio-%" PRIx16, ctx->sio.base);
+
+    return ahb_arbitrate(ahb, resource);
+}
+
 int ilpcb_mode(struct ilpcb *ctx)
 {
     uint32_t hicrb = 0;
@@ -46,68 +57,153 @@ int ilpcb_mode(struct ilpcb *ctx)
     return !!(hicrb & LPC_HICRB_ILPCB_RO); /* Maps to enum ilpcb_mode */
 }
 
-ssize_t ilpcb_read(struct ahb *ahb, uint32_t addr, void *buf, size_t len)
+/* Access widths as encoded in register 0xf8 */
+#define ILPCB_WIDTH_BYTE    0
+#define ILPCB_WIDTH_WORD    2
+
+static int ilpcb_lock(struct ilpcb *ctx)
+{
+    int rc;
+
+    if (!ctx->unlocked)
+        return 0;
+
+    ctx->unlocked = false;
+    ctx->addr_valid = false;
+
+    if ((rc = sio_lock(&ctx->sio))) {
+        errno = -rc;
+        perror("Failed to lock SuperIO device");
+    }
+
+    return rc;
+}
+
+/*
+ * Unlock the SuperIO and point it at iLPC2AHB, skipping whatever is still in
+ * place from a previous access in the same session.
+ */
+static int ilpcb_enter(struct ilpcb *ctx, int width)
 {
-    struct ilpcb *ctx = to_ilpcb(ahb);
     struct sio *sio = &ctx->sio;
-    size_t remaining;
-    uint8_t data;
-    int locked;
     int rc;
 
-    if (len > SSIZE_MAX)
-        return -1;
+    if (!ctx->unlocked) {
+        rc = sio_unlock(sio);
+        if (rc)
+            return rc;
 
-    rc = sio_unlock(sio);
-    if (rc)
-        goto done;
+        ctx->unlocked = true;
+        ctx->width = -1;
 
-    /* Select iLPC2AHB */
-    rc = sio_select(sio, sio_ilpc);
-    if (rc)
-        goto done;
+        /* Select iLPC2AHB */
+        rc = sio_select(sio, sio_ilpc);
+        if (rc)
+            return rc;
 
-    /* Enable iLPC2AHB */
-    rc = sio_writeb(sio, 0x30, 0x01);
-    if (rc)
-        goto done;
+        /* Enable iLPC2AHB */
+        rc = sio_writeb(sio, 0x30, 0x01);
+        if (rc)
+            return rc;
+    }
 
-    /* 1-byte access */
-    rc = sio_writeb(sio, 0xf8, 0);
-    if (rc)
-        goto done;
+    if (ctx->width != width) {
+        rc = sio_writeb(sio, 0xf8, width);
+        if (rc)
+            return rc;
+
+        ctx->width = width;
+    }
+
+    return 0;
+}
+
+static int ilpcb_leave(struct ilpcb *ctx, int rc)
+{
+    /* Start from scratch after a failure, the SuperIO state is unknown */
+    if (rc || !ctx->held)
+        ilpcb_lock(ctx);
+
+    return rc;
+}
+
+/* Address, data and trigger accesses for a single iLPC2AHB cycle */
+#define ILPCB_RW_MAX        9
+
+/*
+ * Queue writes to the address registers, skipping the bytes that match the
+ * previous access. Sequential accesses mostly touch just 0xf3.
+ */
+static size_t ilpcb_address(struct ilpcb *ctx, uint32_t addr, struct sio_rw *rw)
+{
+    size_t n = 0;
+    unsigned int i;
+
+    for (i = 0; i < 4; i++) {
+        unsigned int shift = 24 - 8 * i;
+
+        if (ctx->addr_valid && !(((ctx->addr ^ addr) >> shift) & 0xff))
+            continue;
+
+        rw[n++] = (struct sio_rw){
+            .reg = 0xf0 + i, .write = true, .data = addr >> shift,
+        };
+    }
+
+    /* Invalidated by ilpcb_leave() if the batch fails */
+    ctx->addr = addr;
+    ctx->addr_valid = true;
+
+    return n;
+}
+
+/* Word accesses for aligned runs, byte accesses for the head and tail */
+static inline size_t ilpcb_step(uint32_t addr, size_t remaining)
+{
+    return (!(addr & 3) && remaining >= 4) ? 4 : 1;
+}
+
+/* The data registers hold the value MSB first, so bytes land in reverse */
+ssize_t ilpcb_read(struct ahb *ahb, uint32_t addr, void *buf, size_t len)
+{
+    struct ilpcb *ctx = to_ilpcb(ahb);
+    struct sio_rw rw[ILPCB_RW_MAX];
+    uint8_t *dst = buf;
+    size_t remaining;
+    uint8_t data;
+    int rc = 0;
+
+    if (len > SSIZE_MAX)
+        return -1;
 
-    /* XXX: Think about optimising this */
     remaining = len;
     while (remaining) {
-        /* Address */
-        rc |= sio_writeb(sio, 0xf0, addr >> 24);
-        rc |= sio_writeb(sio, 0xf1, addr >> 16);
-        rc |= sio_writeb(sio, 0xf2, addr >>  8);
-        rc |= sio_writeb(sio, 0xf3, addr      );
+        size_t step = ilpcb_step(addr, remaining);
+        size_t i, n;
+
+        rc = ilpcb_enter(ctx, step == 4 ? ILPCB_WIDTH_WORD : ILPCB_WIDTH_BYTE);
         if (rc)
             goto done;
 
+        n = ilpcb_address(ctx, addr, rw);
+
         /* Trigger */
-        rc = sio_readb(sio, 0xfe, &data);
-        if (rc)
-            goto done;
+        rw[n++] = (struct sio_rw){ .reg = 0xfe, .val = &data };
+
+        for (i = 0; i < step; i++)
+            rw[n++] = (struct sio_rw){ .reg = 0xf7 - i, .val = &dst[i] };
 
-        rc = sio_readb(sio, 0xf7, (uint8_t *)buf);
+        rc = sio_rw_batch(&ctx->sio, rw, n);
         if (rc)
             goto done;
 
-        buf++;
-        addr++;
-        remaining--;
+        dst += step;
+        addr += step;
+        remaining -= step;
     }
 
 done:
-    locked = sio_lock(sio);
-    if (locked) {
-        errno = -locked;
-        perror("sio_lock");
-    }
+    rc = ilpcb_leave(ctx, rc);
 
     return rc ? -1 : (ssize_t)len;
 }
@@ -115,63 +211,45 @@ done:
 ssize_t ilpcb_write(struct ahb *ahb, uint32_t addr, const void *buf, size_t len)
 {
     struct ilpcb *ctx = to_ilpcb(ahb);
-    struct sio *sio = &ctx->sio;
+    struct sio_rw rw[ILPCB_RW_MAX];
+    const uint8_t *src = buf;
     size_t remaining;
-    int locked;
-    int rc;
+    int rc = 0;
 
     if (len > SSIZE_MAX)
         return -1;
 
-    rc = sio_unlock(sio);
-    if (rc)
-        goto done;
-
-    /* Select iLPC2AHB */
-    rc = sio_select(sio, sio_ilpc);
-    if (rc)
-        goto done;
-
-    /* Enable iLPC2AHB */
-    rc = sio_writeb(sio, 0x30, 0x01);
-    if (rc)
-        goto done;
-
-    /* 1-byte access */
-    rc = sio_writeb(sio, 0xf8, 0);
-    if (rc)
-        goto done;
-
-    /* XXX: Think about optimising this */
     remaining = len;
     while (remaining) {
-        /* Address */
-        rc |= sio_writeb(sio, 0xf0, addr >> 24);
-        rc |= sio_writeb(sio, 0xf1, addr >> 16);
-        rc |= sio_writeb(sio, 0xf2, addr >>  8);
-        rc |= sio_writeb(sio, 0xf3, addr      );
-        if (rc)
-            goto done;
+        size_t step = ilpcb_step(addr, remaining);
+        size_t i, n;
 
-        rc = sio_writeb(sio, 0xf7, *(uint8_t *)buf);
+        rc = ilpcb_enter(ctx, step == 4 ? ILPCB_WIDTH_WORD : ILPCB_WIDTH_BYTE);
         if (rc)
             goto done;
 
+        n = ilpcb_address(ctx, addr, rw);
+
+        for (i = step; i-- > 0; ) {
+            rw[n++] = (struct sio_rw){
+                .reg = 0xf7 - i, .write = true, .data = src[i],
+            };
+        }
+
         /* Trigger */
-        rc = sio_writeb(sio, 0xfe, 0xcf);
+        rw[n++] = (struct sio_rw){ .reg = 0xfe, .write = true, .data = 0xcf };
+
+        rc = sio_rw_batch(&ctx->sio, rw, n);
         if (rc)
             goto done;
 
-        buf++;
-        remaining--;
+        src += step;
+        addr += step;
+        remaining -= step;
     }
 
 done:
-    locked = sio_lock(sio);
-    if (locked) {
-        errno = -locked;
-        perror("sio_lock");
-    }
+    rc = ilpcb_leave(ctx, rc);
 
     return rc ? -1 : (ssize_t)len;
 }
@@ -180,141 +258,110 @@ done:
 int ilpcb_readl(struct ahb *ahb, uint32_t addr, uint32_t *val)
 {
     struct ilpcb *ctx = to_ilpcb(ahb);
-    struct sio *sio = &ctx->sio;
-    uint32_t extracted;
-    uint8_t data;
-    int locked;
+    struct sio_rw rw[ILPCB_RW_MAX];
+    uint8_t data[4];
+    size_t n;
     int rc;
 
-    rc = sio_unlock(sio);
-    if (rc)
-        goto done;
-
-    /* Select iLPC2AHB */
-    rc = sio_select(sio, sio_ilpc);
-    if (rc)
-        goto done;
-
-    /* Enable iLPC2AHB */
-    rc = sio_writeb(sio, 0x30, 0x01);
-    if (rc)
-        goto done;
-
     /* 4-byte access */
-    rc = sio_writeb(sio, 0xf8, 2);
+    rc = ilpcb_enter(ctx, ILPCB_WIDTH_WORD);
     if (rc)
         goto done;
 
-    /* Address */
-    rc |= sio_writeb(sio, 0xf0, addr >> 24);
-    rc |= sio_writeb(sio, 0xf1, addr >> 16);
-    rc |= sio_writeb(sio, 0xf2, addr >>  8);
-    rc |= sio_writeb(sio, 0xf3, addr      );
-    if (rc)
-        goto done;
+    n = ilpcb_address(ctx, addr, rw);
 
     /* Trigger */
-    rc = sio_readb(sio, 0xfe, &data);
-    if (rc)
-        goto done;
+    rw[n++] = (struct sio_rw){ .reg = 0xfe, .val = &data[0] };
 
     /* Value */
-    extracted = 0;
-    rc |= sio_readb(sio, 0xf4, &data);
-    extracted = (extracted << 8) | data;
-    rc |= sio_readb(sio, 0xf5, &data);
-    extracted = (extracted << 8) | data;
-    rc |= sio_readb(sio, 0xf6, &data);
-    extracted = (extracted << 8) | data;
-    rc |= sio_readb(sio, 0xf7, &data);
-    extracted = (extracted << 8) | data;
+    rw[n++] = (struct sio_rw){ .reg = 0xf4, .val = &data[0] };
+    rw[n++] = (struct sio_rw){ .reg = 0xf5, .val = &data[1] };
+    rw[n++] = (struct sio_rw){ .reg = 0xf6, .val = &data[2] };
+    rw[n++] = (struct sio_rw){ .reg = 0xf7, .val = &data[3] };
+
+    rc = sio_rw_batch(&ctx->sio, rw, n);
     if (rc)
         goto done;
 
-    *val = extracted;
+    *val = ((uint32_t)data[0] << 24) | ((uint32_t)data[1] << 16) |
+           ((uint32_t)data[2] << 8) | data[3];
 
 done:
-    locked = sio_lock(sio);
-    if (locked) {
-        errno = -locked;
-        perror("sio_lock");
-    }
-
-    return rc;
+    return ilpcb_leave(ctx, rc);
 }
 
 /* Little-endian */
 int ilpcb_writel(struct ahb *ahb, uint32_t addr, uint32_t val)
 {
     struct ilpcb *ctx = to_ilpcb(ahb);
-    struct sio *sio = &ctx->sio;
-    int locked;
+    struct sio_rw rw[ILPCB_RW_MAX];
+    size_t n;
     int rc;
 
-    rc = sio_unlock(sio);
-    if (rc)
-        goto done;
-
-    /* Select iLPC2AHB */
-    rc = sio_select(sio, sio_ilpc);
-    if (rc)
-        goto done;
-
-    /* Enable iLPC2AHB */
-    rc = sio_writeb(sio, 0x30, 0x01);
-    if (rc)
-        goto done;
-
     /* 4-byte access */
-    rc = sio_writeb(sio, 0xf8, 2);
+    rc = ilpcb_enter(ctx, ILPCB_WIDTH_WORD);
     if (rc)
         goto done;
 
-    /* Address */
-    rc |= sio_writeb(sio, 0xf0, addr >> 24);
-    rc |= sio_writeb(sio, 0xf1, addr >> 16);
-    rc |= sio_writeb(sio, 0xf2, addr >>  8);
-    rc |= sio_writeb(sio, 0xf3, addr >>  0);
-    if (rc)
-        goto done;
+    n = ilpcb_address(ctx, addr, rw);
 
     /* Value */
-    rc |= sio_writeb(sio, 0xf4, val >> 24);
-    rc |= sio_writeb(sio, 0xf5, val >> 16);
-    rc |= sio_writeb(sio, 0xf6, val >>  8);
-    rc |= sio_writeb(sio, 0xf7, val >>  0);
-    if (rc)
-        goto done;
+    rw[n++] = (struct sio_rw){ .reg = 0xf4, .write = true, .data = val >> 24 };
+    rw[n++] = (struct sio_rw){ .reg = 0xf5, .write = true, .data = val >> 16 };
+    rw[n++] = (struct sio_rw){ .reg = 0xf6, .write = true, .data = val >>  8 };
+    rw[n++] = (struct sio_rw){ .reg = 0xf7, .write = true, .data = val >>  0 };
 
     /* Trigger */
-    rc = sio_writeb(sio, 0xfe, 0xcf);
-    if (rc)
-        goto done;
+    rw[n++] = (struct sio_rw){ .reg = 0xfe, .write = true, .data = 0xcf };
+
+    rc = sio_rw_batch(&ctx->sio, rw, n);
 
 done:
-    locked = sio_lock(sio);
-    if (locked) {
-        errno = -locked;
-        perror("Failed to lock SuperIO device");
-    }
+    return ilpcb_leave(ctx, rc);
+}
 
-    return rc;
+int ilpcb_session(struct ahb *ahb, bool open)
+{
+    struct ilpcb *ctx = to_ilpcb(ahb);
+
+    ctx->held = open;
+
+    return open ? 0 : ilpcb_lock(ctx);
+}
+
+int ilpcb_release(struct ilpcb *ctx)
+{
+    /* Leave the SuperIO as we found it, the session resumes on next access */
+    return ilpcb_lock(ctx);
 }
 
 static const struct ahb_ops ilpcb_ops = {
     .read = ilpcb_read,
     .write = ilpcb_write,
     .readl = ilpcb_readl,
-    .writel = ilpcb_writel
+    .writel = ilpcb_writel,
+    .session = ilpcb_session,
 };
 
 static struct ahb *ilpcb_driver_probe(int argc, char *argv[]);
 static void ilpcb_driver_destroy(struct ahb *ahb);
+static int ilpcb_driver_release(struct ahb *ahb);
 
 static struct bridge_driver ilpcb_driver = {
     .name = "ilpc",
     .probe = ilpcb_driver_probe,
     .destroy = ilpcb_driver_destroy,
+    .release = ilpcb_driver_release,
+    .bus = "lpc",
+    .priority = 50,
+    .thread_bound = true,
+    .caps = {
+        .burst = 4,
+        .subword = true,
+        .word_writes = true,
+        .op_ns = 20000,
+        .byte_ps = 2500000,
+    },
 };
 REGISTER_BRIDGE_DRIVER(ilpcb_driver);
 
@@ -322,23 +369,40 @@ int ilpcb_init(struct ilpcb *ctx)
 {
     ahb_init_ops(&ctx->ahb, &ilpcb_driver, &ilpcb_ops);
 
+    ctx->held = false;
+    ctx->unlocked = false;
+    ctx->width = -1;
+    ctx->addr_valid = false;
+
     return sio_init(&ctx->sio);
 }
 
 int ilpcb_destroy(struct ilpcb *ctx)
 {
+    ilpcb_lock(ctx);
+
     return sio_destroy(&ctx->sio);
 }
 
 static struct ahb *
-ilpcb_driver_probe(int argc, char *argv[] __unused)
+ilpcb_driver_probe(int argc, char *argv[])
 {
+    unsigned long base = 0;
     struct ilpcb *ctx;
+    char *endp;
     int rc;
 
-    // This driver doesn't require args, so if there are any we're not trying to probe it
-    if (argc > 0) {
+    /* Without arguments, the SuperIO at either base. Otherwise, `ilpc [BASE]` */
+    if (argc > 0 && (argc > 2 || strcmp(argv[0], "ilpc")))
         return NULL;
+
+    if (argc == 2) {
+        errno = 0;
+        base = strtoul(argv[1], &endp, 0);
+        if (errno || *endp || !base || base >= UINT16_MAX) {
+            loge("Invalid SuperIO base '%s'\n", argv[1]);
+            return NULL;
+        }
     }
 
     ctx = malloc(sizeof(*ctx));
@@ -351,11 +415,16 @@ ilpcb_driver_probe(int argc, char *argv[] __unused)
         goto cleanup_ctx;
     }
 
+    if (base)
+        sio_set_base(&ctx->sio, base);
+
     if ((rc = ilpcb_probe(ctx)) < 0) {
         logd("Failed iLPC probe: %d\n", rc);
         goto destroy_ctx;
     }
 
+    ilpcb_arbitrate(ctx, ilpcb_as_ahb(ctx));
+
     return ilpcb_as_ahb(ctx);
 
 destroy_ctx:
@@ -378,3 +447,8 @@ static void ilpcb_driver_destroy(struct ahb *ahb)
 
     free(ctx);
 }
+
+static int ilpcb_driver_release(struct ahb *ahb)
+{
+    return ilpcb_release(to_ilpcb(ahb));
+}
@@ -7,6 +7,7 @@
 #include "ahb.h"
 #include "sio.h"
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
@@ -15,22 +16,34 @@ struct ilpcb
 {
     struct ahb ahb;
     struct sio sio;
+    /* Keep the SuperIO unlocked between accesses, see ahb_session_begin() */
+    bool held;
+    bool unlocked;
+    int width;
+    /* Contents of the address registers, if known */
+    bool addr_valid;
+    uint32_t addr;
 };
 
 int ilpcb_init(struct ilpcb *ctx);
 int ilpcb_destroy(struct ilpcb *ctx);
 int ilpcb_probe(struct ilpcb *ctx);
+int ilpcb_release(struct ilpcb *ctx);
+/* Arbitrate @ahb, the iLPC bridge or one built on it, on the SuperIO */
+int ilpcb_arbitrate(struct ilpcb *ctx, struct ahb *ahb);
 
 static inline struct ahb *ilpcb_as_ahb(struct ilpcb *ctx)
 {
     return &ctx->ahb;
 }
 
-/* These are going to be *amazingly* slow. Use the l2ab */
+/* Still slow, around three SuperIO accesses per byte at best. Use the l2ab */
 ssize_t ilpcb_read(struct ahb *ahb, uint32_t addr, void *buf, size_t len);
 ssize_t ilpcb_write(struct ahb *ahb, uint32_t addr, const void *buf, size_t len);
 
 int ilpcb_readl(struct ahb *ahb, uint32_t addr, uint32_t *val);
 int ilpcb_writel(struct ahb *ahb, uint32_t addr, uint32_t val);
 
+int ilpcb_session(struct ahb *ahb, bool open);
+
 #endif
@@ -5,6 +5,7 @@
 #include "compiler.h"
 #include "l2a.h"
 #include "log.h"
+#include "plan.h"
 
 #include "ccan/container_of/container_of.h"
 
@@ -17,41 +18,62 @@
 #define LPC_HICR7               0x1e789088
 #define LPC_HICR8               0x1e78908c
 #define L2AB_WINDOW_SIZE        (1 << 27)
+#define L2AB_WINDOW_MIN         (1 << 16)
 
 #define to_l2ab(ahb) container_of(ahb, struct l2ab, ahb)
 
+/*
+ * HICR8 masks the upper bits of the address, so the window must be a power of
+ * two of at least 2^16 bytes aligned to its size, and no larger than the host
+ * can reach. Find the smallest that covers [@phys, @phys + @len).
+ */
+static uint64_t l2ab_window_len(struct l2ab *ctx, uint32_t phys, size_t len)
+{
+    uint64_t size = L2AB_WINDOW_MIN;
+
+    while (size < ctx->window &&
+           (phys & ~(size - 1)) + size < (uint64_t)phys + len)
+        size <<= 1;
+
+    return size;
+}
+
 /* @return The LPC FW offset mapped to phys */
 int64_t l2ab_map(struct l2ab *ctx, uint32_t phys, size_t len)
 {
     struct ilpcb *ilpcb = &ctx->ilpcb;
-    uint32_t aligned = phys & ~0xffff;
     uint32_t hicr7, hicr8;
+    uint64_t size, span;
     int rc;
 
     /* Check if the requested phys/len fit inside the current mapping */
-    if (phys >= ctx->phys && (phys + len) <= (ctx->phys + ctx->len))
+    if (phys >= ctx->phys && ((uint64_t)phys + len) <= ((uint64_t)ctx->phys + ctx->len))
         return phys - ctx->phys;
 
-    /* Check if we'd intersect hiomapd/skiboot territory */
-    if (len > L2AB_WINDOW_SIZE)
-        return -EINVAL;
-
-    /* Expand length to account for alignment */
-    if (len < (phys + len - aligned))
-        len = phys + len - aligned;
+    size = l2ab_window_len(ctx, phys, len);
 
     /*
-     * Open a window sized to the nearest power of 2 greater than len that is
-     * at least 2^16 bytes, due to the structure of HICR8.
+     * Carrying on from where the last access left off, so expect more of the
+     * same and open a window twice the size of the one we ran off the end of.
      */
-    if (len < (1 << 16))
-        len = (1 << 16);
+    if (ctx->len && phys == ctx->next) {
+        uint64_t ahead = ctx->len << 1;
+
+        if (ahead > ctx->window)
+            ahead = ctx->window;
+
+        if (ahead > size)
+            size = ahead;
+    }
 
-    if (__builtin_popcount(len) != 1)
-        len = 1 << (31 - __builtin_clz(len));
+    /* Check if we'd intersect hiomapd/skiboot territory */
+    if ((phys & ~(size - 1)) + size < (uint64_t)phys + len)
+        return -EINVAL;
 
-    hicr7 = (phys & ~(0xffff));
-    hicr8 = (~(len - 1)) | ((len - 1) >> 16);
+    hicr7 = phys & ~(size - 1);
+    hicr8 = (~(size - 1)) | ((size - 1) >> 16);
+
+    span = span_begin();
 
     rc = ilpcb_writel(ilpcb_as_ahb(ilpcb), LPC_HICR7, hicr7);
     if (rc)
@@ -62,9 +84,19 @@ int64_t l2ab_map(struct l2ab *ctx, uint32_t phys, size_t len)
         return rc;
 
     ctx->phys = hicr7; /* This is correct as we're mapping to 0 in LPC FW */
-    ctx->len = len;
+    ctx->len = size;
+    ahb_stats_remap(&ctx->ahb, span);
+
+    return phys - hicr7;
+}
+
+/* Split requests where they cross a window, reusing the current one if it fits */
+static size_t l2ab_plan(struct l2ab *ctx, uint32_t phys, size_t len)
+{
+    if (phys >= ctx->phys && ((uint64_t)phys + len) <= ((uint64_t)ctx->phys + ctx->len))
+        return len;
 
-    return phys & 0xffff;
+    return plan_span(phys, len, ctx->window);
 }
 
 ssize_t l2ab_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
@@ -79,7 +111,7 @@ ssize_t l2ab_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
     }
 
     do {
-        ingress = remaining > L2AB_WINDOW_SIZE ? L2AB_WINDOW_SIZE : remaining;
+        ingress = l2ab_plan(ctx, phys, remaining);
 
         offset = l2ab_map(ctx, phys, ingress);
         if (offset < 0)
@@ -89,6 +121,8 @@ ssize_t l2ab_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
         if (ingress < 0)
             return -1;
 
+        ctx->next = phys + ingress;
+
         phys += ingress;
         buf += ingress;
         remaining -= ingress;
@@ -109,7 +143,7 @@ ssize_t l2ab_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
     }
 
     do {
-        egress = remaining > L2AB_WINDOW_SIZE ? L2AB_WINDOW_SIZE : remaining;
+        egress = l2ab_plan(ctx, phys, remaining);
 
         offset = l2ab_map(ctx, phys, egress);
         if (offset < 0)
@@ -119,6 +153,8 @@ ssize_t l2ab_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
         if (egress < 0)
             return -1;
 
+        ctx->next = phys + egress;
+
         phys += egress;
         buf += egress;
         remaining -= egress;
@@ -139,11 +175,19 @@ int l2ab_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
     return ilpcb_writel(ilpcb_as_ahb(&ctx->ilpcb), phys, val);
 }
 
+/* Only the register accesses go through iLPC, so that's all there is to hold */
+static int l2ab_session(struct ahb *ahb, bool open)
+{
+    struct l2ab *ctx = to_l2ab(ahb);
+    return ilpcb_session(ilpcb_as_ahb(&ctx->ilpcb), open);
+}
+
 static const struct ahb_ops l2ab_ahb_ops = {
     .read = l2ab_read,
     .write = l2ab_write,
     .readl = l2ab_readl,
     .writel = l2ab_writel,
+    .session = l2ab_session,
 };
 
 static int l2ab_save_hicr78(struct l2ab *ctx)
@@ -181,6 +225,17 @@ static struct bridge_driver l2ab_driver = {
     .destroy = l2ab_driver_destroy,
     .reinit = l2ab_driver_reinit,
     .release = l2ab_driver_release,
+    .bus = "lpc",
+    .priority = 40,
+    .thread_bound = true,
+    .caps = {
+        /* Sized by HICR8 on each remap, up to L2AB_WINDOW_SIZE */
+        .window = L2AB_WINDOW_SIZE,
+        .burst = (1 << 16),
+        .subword = true,
+        .op_ns = 40000,
+        .byte_ps = 1000000,
+    },
 };
 REGISTER_BRIDGE_DRIVER(l2ab_driver);
 
@@ -193,9 +248,19 @@ int l2ab_init(struct l2ab *ctx)
     if (rc)
         return rc;
 
+    /* Windows map to offset 0, so they can't outgrow the host's view of FW */
+    ctx->window = L2AB_WINDOW_SIZE;
+    while (ctx->window > ctx->fw.size)
+        ctx->window >>= 1;
+
+    if (ctx->window < L2AB_WINDOW_MIN) {
+        rc = -EINVAL;
+        goto cleanup_fw;
+    }
+
     rc = ilpcb_init(ilpcb);
     if (rc)
-        return rc;
+        goto cleanup_fw;
 
     rc = ilpcb_probe(ilpcb);
     if (rc)
@@ -205,12 +270,18 @@ int l2ab_init(struct l2ab *ctx)
     if (rc)
         goto cleanup;
 
+    ctx->phys = 0;
+    ctx->len = 0;
+    ctx->next = 0;
+
     ahb_init_ops(&ctx->ahb, &l2ab_driver, &l2ab_ahb_ops);
 
     return 0;
 
 cleanup:
     ilpcb_destroy(ilpcb);
+
+cleanup_fw:
     lpc_destroy(&ctx->fw);
 
     return rc;
@@ -252,6 +323,8 @@ l2ab_driver_probe(int argc, char *argv[] __unused)
         goto cleanup_ctx;
     }
 
+    ilpcb_arbitrate(&ctx->ilpcb, l2ab_as_ahb(ctx));
+
     return l2ab_as_ahb(ctx);
 
 cleanup_ctx:
@@ -274,7 +347,18 @@ static void l2ab_driver_destroy(struct ahb *ahb)
 
 static int l2ab_driver_release(struct ahb *ahb)
 {
-    return l2ab_restore_hicr78(to_l2ab(ahb));
+    struct l2ab *ctx = to_l2ab(ahb);
+    int rc;
+
+    rc = l2ab_restore_hicr78(ctx);
+    if (rc)
+        return rc;
+
+    /* The window is gone with the restored HICR7/8 */
+    ctx->phys = 0;
+    ctx->len = 0;
+
+    return ilpcb_release(&ctx->ilpcb);
 }
 
 static int l2ab_driver_reinit(struct ahb *ahb)
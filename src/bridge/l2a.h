@@ -17,6 +17,10 @@ struct l2ab {
     struct ilpcb ilpcb;
     uint32_t phys;
     size_t len;
+    /* One past the end of the last transfer, to spot sequential access */
+    uint32_t next;
+    /* Largest window the FW space can hold */
+    uint64_t window;
     uint32_t restore7;
     uint32_t restore8;
 };
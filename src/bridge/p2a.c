@@ -10,6 +10,7 @@
 #include "mmio.h"
 #include "p2a.h"
 #include "pci.h"
+#include "plan.h"
 #include "rev.h"
 
 #include "ccan/container_of/container_of.h"
@@ -19,11 +20,13 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <unistd.h>
 
+#define AST_VRAM_BAR            0
 #define AST_MMIO_BAR            1
 #define AST_MMIO_LEN            (128 * 1024)
 #define P2AB_PKR                0xf000
@@ -34,6 +37,15 @@
 
 #define to_p2ab(ahb) container_of(ahb, struct p2ab, ahb)
 
+static bool p2ab_wc;
+/* Open bridges, which share the RBAR of their device */
+static LIST_HEAD(p2ab_bridges);
+
+void p2ab_enable_write_combining(void)
+{
+    p2ab_wc = true;
+}
+
 static int __p2ab_readl(struct p2ab *ctx, size_t addr, uint32_t *val)
 {
     assert(addr < (AST_MMIO_LEN - sizeof(val) + 1));
@@ -89,10 +101,32 @@ int p2ab_probe(struct p2ab *ctx)
     return rc < 0 ? rc : 1;
 }
 
+int p2ab_arbitrate(struct p2ab *ctx, struct ahb *ahb)
+{
+    char resource[sizeof("p2a-") + PCI_BDF_LEN];
+
+    snprintf(resource, sizeof(resource), "p2a-%s", ctx->bdf);
+
+    return ahb_arbitrate(ahb, resource);
+}
+
+static void p2ab_set_rbar(struct p2ab *ctx, uint32_t rbar)
+{
+    struct p2ab *other;
+
+    ctx->rbar = rbar;
+
+    list_for_each(&p2ab_bridges, other, entry) {
+        if (!strcmp(other->bdf, ctx->bdf))
+            other->rbar = rbar;
+    }
+}
+
 int64_t p2ab_map(struct p2ab *ctx, uint32_t phys, size_t len __unused)
 {
     uint32_t rbar;
     uint32_t offset;
+    uint64_t span;
     int64_t rc;
 
     rbar = phys & P2AB_RBAR_REMAP_MASK;
@@ -101,35 +135,88 @@ int64_t p2ab_map(struct p2ab *ctx, uint32_t phys, size_t len __unused)
     if (ctx->rbar == rbar)
         return offset;
 
+    /*
+     * Stores through the write-combining window may still be buffered, and
+     * aren't ordered against the uncached RBAR write. Drain them before the
+     * window moves underneath them.
+     */
+    span = span_begin();
+
+    if (ctx->wc_window)
+        iob();
+
     rc = __p2ab_writel(ctx, P2AB_RBAR, rbar);
 
     if (rc < 0)
         return rc;
 
-    ctx->rbar = rbar;
+    p2ab_set_rbar(ctx, rbar);
+    ahb_stats_remap(&ctx->ahb, span);
 
     return offset;
 }
 
+/*
+ * The length of the leading part of [@phys, @phys + @len) that is either all
+ * inside the VRAM aperture or all outside it, as reported through @in.
+ */
+static size_t p2ab_vram_span(struct p2ab *ctx, uint32_t phys, size_t len,
+                             bool *in)
+{
+    uint64_t start = ctx->vram_phys;
+    uint64_t end = start + ctx->vram_len;
+
+    *in = false;
+
+    if (!ctx->vram || (uint64_t)phys + len <= start || phys >= end)
+        return len;
+
+    if (phys < start)
+        return start - phys;
+
+    *in = true;
+
+    return (end - phys) < len ? (size_t)(end - phys) : len;
+}
+
+static inline volatile uint32_t *p2ab_vram_word(struct p2ab *ctx, uint32_t phys)
+{
+    bool in;
+
+    if (p2ab_vram_span(ctx, phys, sizeof(uint32_t), &in) < sizeof(uint32_t) || !in)
+        return NULL;
+
+    return (volatile uint32_t *)(ctx->vram + (phys - ctx->vram_phys));
+}
+
 ssize_t p2ab_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
 {
     struct p2ab *ctx = to_p2ab(ahb);
     size_t remaining = len;
     size_t ingress;
     int64_t rc;
+    bool vram;
 
     if (len > SSIZE_MAX) {
         return -1;
     }
 
     do {
-        ingress = remaining > P2AB_WINDOW_LEN ? P2AB_WINDOW_LEN : remaining;
+        ingress = p2ab_vram_span(ctx, phys, remaining, &vram);
 
-        rc = p2ab_map(ctx, phys, ingress);
-        if (rc < 0)
-            return -1;
+        if (vram) {
+            mmio_read(buf, ctx->vram + (phys - ctx->vram_phys), ingress,
+                      ahb->drv->caps.mmio_width);
+        } else {
+            ingress = plan_span(phys, ingress, P2AB_WINDOW_LEN);
 
-        mmio_memcpy(buf, (ctx->mmio + P2AB_WINDOW_BASE + rc), ingress);
+            rc = p2ab_map(ctx, phys, ingress);
+            if (rc < 0)
+                return -1;
+
+            mmio_read(buf, (ctx->mmio + P2AB_WINDOW_BASE + rc), ingress,
+                      ahb->drv->caps.mmio_width);
+        }
         phys += ingress;
         buf += ingress;
         remaining -= ingress;
@@ -144,19 +231,32 @@ ssize_t p2ab_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
     size_t remaining = len;
     size_t egress;
     int64_t rc;
+    bool vram;
 
     if (len > SSIZE_MAX) {
         return -1;
     }
 
     do {
-        egress = remaining > P2AB_WINDOW_LEN ? P2AB_WINDOW_LEN : remaining;
-
-        rc = p2ab_map(ctx, phys, egress);
-        if (rc < 0)
-            return -1;
-
-        mmio_memcpy((ctx->mmio + P2AB_WINDOW_BASE + rc), buf, egress);
+        egress = p2ab_vram_span(ctx, phys, remaining, &vram);
+
+        if (vram) {
+            mmio_write(ctx->vram + (phys - ctx->vram_phys), buf, egress,
+                       ahb->drv->caps.mmio_width);
+        } else {
+            egress = plan_span(phys, egress, P2AB_WINDOW_LEN);
+
+            rc = p2ab_map(ctx, phys, egress);
+            if (rc < 0)
+                return -1;
+
+            if (ctx->wc_window)
+                mmio_write(ctx->wc_window + rc, buf, egress,
+                           ahb->drv->caps.mmio_width);
+            else
+                mmio_write((ctx->mmio + P2AB_WINDOW_BASE + rc), buf, egress,
+                           ahb->drv->caps.mmio_width);
+        }
         phys += egress;
         buf += egress;
         remaining -= egress;
@@ -168,12 +268,17 @@ ssize_t p2ab_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len)
 int p2ab_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
 {
     struct p2ab *ctx = to_p2ab(ahb);
+    volatile uint32_t *word;
     uint32_t le;
     ssize_t rc;
 
     if (phys & 0x3)
         return -EINVAL;
 
+    if ((word = p2ab_vram_word(ctx, phys))) {
+        *val = le32toh(*word);
+        return 0;
+    }
     rc = p2ab_map(ctx, phys, sizeof(*val));
     if (rc < 0)
         return rc;
@@ -188,10 +293,17 @@ int p2ab_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
 int p2ab_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
 {
     struct p2ab *ctx = to_p2ab(ahb);
+    volatile uint32_t *word;
     int rc;
 
     val = htole32(val);
 
+    if ((word = p2ab_vram_word(ctx, phys))) {
+        *word = val;
+        iob();
+        return 0;
+    }
+
     rc = p2ab_map(ctx, phys, sizeof(val));
     if (rc < 0)
         return rc;
@@ -201,11 +313,85 @@ int p2ab_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
     return 0;
 }
 
-static const struct ahb_ops p2ab_ahb_ops = {
+static void p2ab_unmap_vram(struct p2ab *ctx)
+{
+    if (ctx->vram) {
+        iob();
+        munmap(ctx->vram, ctx->vram_len);
+        ctx->vram = NULL;
+    }
+
+    if (ctx->vram_res >= 0) {
+        pci_close(ctx->vram_res);
+        ctx->vram_res = -1;
+    }
+}
+
+/*
+ * BAR0 maps VRAM, the top of the BMC's DRAM, in one piece. Serving that range
+ * from it avoids RBAR remaps and makes multi-megabyte transfers one copy.
+ */
+static int p2ab_aperture(struct ahb *ahb, uint32_t phys, size_t len)
+{
+    struct p2ab *ctx = to_p2ab(ahb);
+    ssize_t size;
+    int rc;
+
+    if (ctx->vram && ctx->vram_phys == phys)
+        return 0;
+
+    p2ab_unmap_vram(ctx);
+
+    rc = -ENOENT;
+    if (p2ab_wc)
+        rc = pci_open_wc(ctx->bdf, ctx->vid, ctx->did, AST_VRAM_BAR);
+    if (rc < 0)
+        rc = pci_open(ctx->bdf, ctx->vid, ctx->did, AST_VRAM_BAR);
+    if (rc < 0)
+        return rc;
+
+    ctx->vram_res = rc;
+
+    if ((size = pci_bar_len(ctx->vram_res)) < 0) {
+        rc = size;
+        goto cleanup_res;
+    }
+
+    if ((size_t)size < len)
+        len = size;
+
+    if (!len) {
+        rc = -ENOSPC;
+        goto cleanup_res;
+    }
+
+    ctx->vram = pci_mmap(ctx->vram_res, len, 0);
+    if (ctx->vram == MAP_FAILED) {
+        rc = -errno;
+        ctx->vram = NULL;
+        goto cleanup_res;
+    }
+
+    ctx->vram_phys = phys;
+    ctx->vram_len = len;
+
+    logd("Serving 0x%08" PRIx32 "-0x%08" PRIx32 " through the VRAM aperture\n",
+         phys, (uint32_t)(phys + len - 1));
+
+    return 0;
+
+cleanup_res:
+    p2ab_unmap_vram(ctx);
+
+    return rc;
+}
+
+const struct ahb_ops p2ab_ahb_ops = {
     .read = p2ab_read,
     .write = p2ab_write,
     .readl = p2ab_readl,
     .writel = p2ab_writel,
+    .aperture = p2ab_aperture,
 };
 
 static struct ahb *p2ab_driver_probe(int argc, char *argv[]);
@@ -217,25 +403,91 @@ static struct bridge_driver p2ab_driver = {
     .probe = p2ab_driver_probe,
     .reinit = p2ab_driver_reinit,
     .destroy = p2ab_driver_destroy,
+    .bus = "pcie",
+    .priority = 20,
+    .caps = {
+        .window = P2AB_WINDOW_LEN,
+        .burst = P2AB_WINDOW_LEN,
+        .subword = true,
+        .exact_reads = true,
+        .mmio_width = 8,
+        .op_ns = 1000,
+        .byte_ps = 250000,
+    },
 };
 REGISTER_BRIDGE_DRIVER(p2ab_driver);
 
-int p2ab_init(struct p2ab *ctx, uint16_t vid, uint16_t did)
+/*
+ * Only bulk writes go through the write-combining window. Reads and the
+ * control registers stay on the uncached mapping, as reads through a WC
+ * mapping may be speculated.
+ */
+static void p2ab_init_wc(struct p2ab *ctx)
 {
     int rc;
 
-    rc = pci_open(vid, did, AST_MMIO_BAR);
+    ctx->wc_res = -1;
+    ctx->wc_window = NULL;
+
+    if (!p2ab_wc)
+        return;
+
+    if ((rc = pci_open_wc(ctx->bdf, ctx->vid, ctx->did, AST_MMIO_BAR)) < 0) {
+        logd("No write-combining mapping for BAR%d, using uncached writes: %d\n",
+             AST_MMIO_BAR, rc);
+        return;
+    }
+
+    ctx->wc_res = rc;
+    ctx->wc_window = pci_mmap(ctx->wc_res, P2AB_WINDOW_LEN, P2AB_WINDOW_BASE);
+    if (ctx->wc_window == MAP_FAILED) {
+        logd("Failed to map write-combining window: %d\n", -errno);
+        ctx->wc_window = NULL;
+        pci_close(ctx->wc_res);
+        ctx->wc_res = -1;
+        return;
+    }
+
+    logd("Mapped the P2A data window write-combining\n");
+}
+
+static void p2ab_destroy_wc(struct p2ab *ctx)
+{
+    if (!ctx->wc_window)
+        return;
+
+    iob();
+    munmap(ctx->wc_window, P2AB_WINDOW_LEN);
+    pci_close(ctx->wc_res);
+    ctx->wc_window = NULL;
+    ctx->wc_res = -1;
+}
+
+int p2ab_init(struct p2ab *ctx, const char *bdf, uint16_t vid, uint16_t did)
+{
+    int rc;
+
+    /* Bridges on the same device share its window, see p2ab_set_rbar() */
+    if ((rc = pci_lookup(bdf, vid, did, ctx->bdf)) < 0)
+        return rc;
+
+    rc = pci_open(ctx->bdf, vid, did, AST_MMIO_BAR);
     if (rc < 0)
         return rc;
 
     ctx->res = rc;
-    ctx->mmio = mmap(0, AST_MMIO_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
-                     ctx->res, 0);
+    ctx->vid = vid;
+    ctx->did = did;
+    ctx->vram_res = -1;
+    ctx->vram = NULL;
+    ctx->mmio = pci_mmap(ctx->res, AST_MMIO_LEN, 0);
     if (ctx->mmio == MAP_FAILED) {
         rc = -errno;
         goto cleanup_pci;
     }
 
+    p2ab_init_wc(ctx);
+
     /* ensure the HW and SW rbar values are in sync */
     ctx->rbar = 0;
     __p2ab_writel(ctx, P2AB_RBAR, ctx->rbar);
@@ -243,11 +495,15 @@ int p2ab_init(struct p2ab *ctx, uint16_t vid, uint16_t did)
     if ((rc = p2ab_unlock(ctx)) < 0)
         goto cleanup_mmap;
 
+    p2ab_set_rbar(ctx, ctx->rbar);
+    list_add(&p2ab_bridges, &ctx->entry);
+
     ahb_init_ops(&ctx->ahb, &p2ab_driver, &p2ab_ahb_ops);
 
     return 0;
 
 cleanup_mmap:
+    p2ab_destroy_wc(ctx);
     munmap(ctx->mmio, AST_MMIO_LEN);
 
 cleanup_pci:
@@ -260,10 +516,15 @@ int p2ab_destroy(struct p2ab *ctx)
 {
     int rc;
 
+    list_del(&ctx->entry);
+
     rc = p2ab_lock(ctx);
     if (rc < 0)
         return rc;
 
+    p2ab_destroy_wc(ctx);
+    p2ab_unmap_vram(ctx);
+
     rc = munmap(ctx->mmio, AST_MMIO_LEN);
     if (rc == -1)
         return -errno;
@@ -272,13 +533,18 @@ int p2ab_destroy(struct p2ab *ctx)
 }
 
 static struct ahb *
-p2ab_driver_probe(int argc, char *argv[] __unused)
+p2ab_driver_probe(int argc, char *argv[])
 {
+    char bdf[PCI_BDF_LEN] = "";
     struct p2ab *ctx;
     int rc;
 
-    // This driver doesn't require args, so if there are any we're not trying to probe it
-    if (argc > 0) {
+    /* Without arguments, the first AST VGA device. Otherwise, `p2a [BDF]` */
+    if (argc > 0 && (argc > 2 || strcmp(argv[0], "p2a")))
+        return NULL;
+
+    if (argc == 2 && pci_parse_bdf(argv[1], bdf) < 0) {
+        loge("Invalid PCI device address '%s'\n", argv[1]);
         return NULL;
     }
 
@@ -287,7 +553,7 @@ p2ab_driver_probe(int argc, char *argv[] __unused)
         return NULL;
     }
 
-    if ((rc = p2ab_init(ctx, AST_PCI_VID, AST_PCI_DID_VGA)) < 0) {
+    if ((rc = p2ab_init(ctx, bdf, AST_PCI_VID, AST_PCI_DID_VGA)) < 0) {
         logd("Failed to initialise P2A bridge: %d\n", rc);
         goto cleanup_ctx;
     }
@@ -297,6 +563,8 @@ p2ab_driver_probe(int argc, char *argv[] __unused)
         goto destroy_ctx;
     }
 
+    p2ab_arbitrate(ctx, p2ab_as_ahb(ctx));
+
     return p2ab_as_ahb(ctx);
 
 destroy_ctx:
@@ -311,9 +579,16 @@ cleanup_ctx:
 static int p2ab_driver_reinit(struct ahb *ahb)
 {
     struct p2ab *ctx = to_p2ab(ahb);
+    uint32_t rbar;
+    int rc;
 
     /* Update the software cache with the hardware state */
-    return __p2ab_readl(ctx, P2AB_RBAR, &ctx->rbar);
+    if ((rc = __p2ab_readl(ctx, P2AB_RBAR, &rbar)) < 0)
+        return rc;
+
+    p2ab_set_rbar(ctx, rbar);
+
+    return 0;
 }
 
 static void p2ab_driver_destroy(struct ahb *ahb)
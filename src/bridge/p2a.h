@@ -5,24 +5,47 @@
 #define _P2A_H
 
 #include "ahb.h"
+#include "pci.h"
 
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "ccan/list/list.h"
+
 #define AST_PCI_VID     0x1a03
 #define AST_PCI_DID_VGA 0x2000
 #define AST_PCI_DID_BMC 0x2402
 
 struct p2ab {
     struct ahb ahb;
+    /* The device's PCI address, as sysfs names it */
+    char bdf[PCI_BDF_LEN];
     int res;
     void *mmio;
+    /* Kept in step across bridges open on the same device */
     uint32_t rbar;
+    struct list_node entry;
+    /* Write-combining mapping of the data window, or NULL */
+    int wc_res;
+    void *wc_window;
+    /* BAR0's direct view of VRAM, once the SoC has said where it is */
+    uint16_t vid;
+    uint16_t did;
+    int vram_res;
+    void *vram;
+    uint32_t vram_phys;
+    size_t vram_len;
 };
 
-int p2ab_init(struct p2ab *p2ab, uint16_t vid, uint16_t did);
+/* Map the data window write-combining for bulk writes where possible */
+void p2ab_enable_write_combining(void);
+
+/* With a NULL or empty @bdf, the first @vid:@did device found */
+int p2ab_init(struct p2ab *p2ab, const char *bdf, uint16_t vid, uint16_t did);
 int p2ab_destroy(struct p2ab *p2ab);
 int p2ab_probe(struct p2ab *p2ab);
+/* Arbitrate @ahb, the P2A bridge or one built on it, on the device's window */
+int p2ab_arbitrate(struct p2ab *p2ab, struct ahb *ahb);
 
 int64_t p2ab_map(struct p2ab *p2ab, uint32_t phys, size_t len);
 
@@ -37,4 +60,7 @@ ssize_t p2ab_write(struct ahb *ahb, uint32_t phys, const void *buf, size_t len);
 int p2ab_readl(struct ahb *ahb, uint32_t phys, uint32_t *val);
 int p2ab_writel(struct ahb *ahb, uint32_t phys, uint32_t val);
 
+/* For builds specialised to the bridge, see ahb_ops_call() */
+extern const struct ahb_ops p2ab_ahb_ops;
+
 #endif
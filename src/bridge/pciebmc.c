@@ -0,0 +1,206 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ahb.h"
+#include "array.h"
+#include "bridge.h"
+#include "compiler.h"
+#include "log.h"
+#include "p2a.h"
+
+#include "ccan/container_of/container_of.h"
+
+/*
+ * The BMC PCIe device carries its own P2A-style MMIO function, with a remap
+ * register independent of the VGA device's. Each enabled device gives a
+ * window onto the AHB, and accesses are steered to the window that already
+ * maps them or else to the least recently used one. Register accesses then
+ * keep their window while bulk transfers move another, rather than both
+ * fighting over a single RBAR.
+ */
+#define PCIEBMC_WINDOW_LEN      0x10000
+#define PCIEBMC_WINDOW_MASK     (~(uint32_t)(PCIEBMC_WINDOW_LEN - 1))
+
+#define to_pciebmc(ahb) container_of(ahb, struct pciebmc, ahb)
+
+struct pciebmc_window {
+    struct p2ab p2ab;
+    uint64_t used;
+};
+
+struct pciebmc {
+    struct ahb ahb;
+    struct pciebmc_window windows[2];
+    size_t nr_windows;
+    uint64_t clock;
+};
+
+static struct ahb *pciebmc_window(struct pciebmc *ctx, uint32_t phys)
+{
+    struct pciebmc_window *window, *lru = NULL;
+    size_t i;
+
+    for (i = 0; i < ctx->nr_windows; i++) {
+        window = &ctx->windows[i];
+
+        if (window->p2ab.rbar == (phys & PCIEBMC_WINDOW_MASK))
+            break;
+
+        if (!lru || window->used < lru->used)
+            lru = window;
+    }
+
+    if (i == ctx->nr_windows)
+        window = lru;
+
+    window->used = ++ctx->clock;
+
+    return p2ab_as_ahb(&window->p2ab);
+}
+
+static ssize_t pciebmc_read(struct ahb *ahb, uint32_t phys, void *buf,
+                            size_t len)
+{
+    return p2ab_read(pciebmc_window(to_pciebmc(ahb), phys), phys, buf, len);
+}
+
+static ssize_t pciebmc_write(struct ahb *ahb, uint32_t phys, const void *buf,
+                             size_t len)
+{
+    return p2ab_write(pciebmc_window(to_pciebmc(ahb), phys), phys, buf, len);
+}
+
+static int pciebmc_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    return p2ab_readl(pciebmc_window(to_pciebmc(ahb), phys), phys, val);
+}
+
+static int pciebmc_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    return p2ab_writel(pciebmc_window(to_pciebmc(ahb), phys), phys, val);
+}
+
+static const struct ahb_ops pciebmc_ahb_ops = {
+    .read = pciebmc_read,
+    .write = pciebmc_write,
+    .readl = pciebmc_readl,
+    .writel = pciebmc_writel,
+};
+
+static struct ahb *pciebmc_driver_probe(int argc, char *argv[]);
+static void pciebmc_driver_destroy(struct ahb *ahb);
+static int pciebmc_driver_reinit(struct ahb *ahb);
+
+static struct bridge_driver pciebmc_driver = {
+    .name = "pcie-bmc",
+    .probe = pciebmc_driver_probe,
+    .destroy = pciebmc_driver_destroy,
+    .reinit = pciebmc_driver_reinit,
+    .bus = "pcie",
+    .priority = 30,
+    .caps = {
+        .window = PCIEBMC_WINDOW_LEN,
+        .burst = PCIEBMC_WINDOW_LEN,
+        .subword = true,
+        .exact_reads = true,
+        .mmio_width = 8,
+        .op_ns = 1000,
+        .byte_ps = 250000,
+    },
+};
+REGISTER_BRIDGE_DRIVER(pciebmc_driver);
+
+static void pciebmc_destroy(struct pciebmc *ctx)
+{
+    int rc;
+
+    while (ctx->nr_windows--) {
+        rc = p2ab_destroy(&ctx->windows[ctx->nr_windows].p2ab);
+        if (rc < 0)
+            loge("Failed to destroy P2A window: %d\n", rc);
+    }
+}
+
+/* The BMC device is required, the VGA device adds a second window if enabled */
+static struct ahb *pciebmc_driver_probe(int argc, char *argv[] __unused)
+{
+    static const uint16_t dids[] = { AST_PCI_DID_BMC, AST_PCI_DID_VGA };
+    struct pciebmc_window *window;
+    struct pciebmc *ctx;
+    size_t i;
+    int rc;
+
+    if (argc > 0)
+        return NULL;
+
+    if (!(ctx = malloc(sizeof(*ctx))))
+        return NULL;
+
+    ctx->nr_windows = 0;
+    ctx->clock = 0;
+
+    for (i = 0; i < ARRAY_SIZE(dids); i++) {
+        window = &ctx->windows[ctx->nr_windows];
+
+        if ((rc = p2ab_init(&window->p2ab, NULL, AST_PCI_VID, dids[i])) < 0) {
+            logd("Failed to initialise P2A window on device %04x: %d\n",
+                 dids[i], rc);
+            if (!i)
+                goto cleanup_ctx;
+            continue;
+        }
+
+        ctx->nr_windows++;
+
+        if ((rc = p2ab_probe(&window->p2ab)) < 0) {
+            logd("Failed P2A probe on device %04x: %d\n", dids[i], rc);
+            if (!i)
+                goto cleanup_windows;
+            p2ab_destroy(&window->p2ab);
+            ctx->nr_windows--;
+            continue;
+        }
+
+        window->used = 0;
+    }
+
+    logd("Steering accesses over %zu P2A windows\n", ctx->nr_windows);
+
+    ahb_init_ops(&ctx->ahb, &pciebmc_driver, &pciebmc_ahb_ops);
+    p2ab_arbitrate(&ctx->windows[0].p2ab, &ctx->ahb);
+
+    return &ctx->ahb;
+
+cleanup_windows:
+    pciebmc_destroy(ctx);
+
+cleanup_ctx:
+    free(ctx);
+
+    return NULL;
+}
+
+static void pciebmc_driver_destroy(struct ahb *ahb)
+{
+    struct pciebmc *ctx = to_pciebmc(ahb);
+
+    pciebmc_destroy(ctx);
+    free(ctx);
+}
+
+static int pciebmc_driver_reinit(struct ahb *ahb)
+{
+    struct pciebmc *ctx = to_pciebmc(ahb);
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ctx->nr_windows; i++) {
+        if ((rc = ahb_reinit_bridge(p2ab_as_ahb(&ctx->windows[i].p2ab))) < 0)
+            return rc;
+    }
+
+    return 0;
+}
@@ -0,0 +1,81 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bridge/plan.h"
+
+static bool plan_overlaps(const struct ahb_iov *a, const struct ahb_iov *b)
+{
+    return (uint64_t)a->phys < (uint64_t)b->phys + b->len &&
+           (uint64_t)b->phys < (uint64_t)a->phys + a->len;
+}
+
+/* Stable, so regions within a window keep the caller's order */
+static void plan_sort(const struct ahb_iov *iov, uint32_t window,
+                      size_t *order, size_t count)
+{
+    size_t i, j, cur;
+
+    for (i = 1; i < count; i++) {
+        cur = order[i];
+
+        for (j = i; j && iov[order[j - 1]].phys / window > iov[cur].phys / window; j--)
+            order[j] = order[j - 1];
+
+        order[j] = cur;
+    }
+}
+
+static bool plan_disjoint(const struct ahb_iov *iov, const size_t *order,
+                          size_t count)
+{
+    size_t i, j;
+
+    for (i = 0; i < count; i++) {
+        for (j = i + 1; j < count; j++) {
+            if (plan_overlaps(&iov[order[i]], &iov[order[j]]))
+                return false;
+        }
+    }
+
+    return true;
+}
+
+void plan_order(const struct ahb_iov *iov, size_t iovcnt, uint32_t window,
+                bool write, size_t *order)
+{
+    size_t i, start;
+
+    for (i = 0; i < iovcnt; i++)
+        order[i] = i;
+
+    if (!window)
+        return;
+
+    for (start = 0; start < iovcnt; start = i + 1) {
+        for (i = start; i < iovcnt && !ahb_iov_is_word(&iov[i]); i++)
+            ;
+
+        if (i - start < 2)
+            continue;
+
+        if (write && !plan_disjoint(iov, &order[start], i - start))
+            continue;
+
+        plan_sort(iov, window, &order[start], i - start);
+    }
+}
+
+size_t plan_word_run(const struct ahb_iov *iov, size_t iovcnt)
+{
+    size_t i;
+
+    if (!iovcnt || !ahb_iov_is_word(&iov[0]))
+        return 0;
+
+    for (i = 1; i < iovcnt; i++) {
+        if (!ahb_iov_is_word(&iov[i]) ||
+                (uint64_t)iov[i].phys != (uint64_t)iov[i - 1].phys + 4)
+            break;
+    }
+
+    return i;
+}
@@ -0,0 +1,35 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _PLAN_H
+#define _PLAN_H
+
+#include "ahb.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* The leading part of [@phys, @phys + @len) inside one @window-aligned window */
+static inline size_t plan_span(uint32_t phys, size_t len, uint64_t window)
+{
+    uint64_t end = (phys & ~(window - 1)) + window;
+
+    return (end - phys) < len ? (size_t)(end - phys) : len;
+}
+
+/*
+ * Fill @order with an issue order for @iov that groups regions by @window, so
+ * a windowed bridge remaps once per window rather than once per region.
+ * Register accesses keep their place and order nothing across them. Writes
+ * are only reordered between regions that don't overlap.
+ */
+void plan_order(const struct ahb_iov *iov, size_t iovcnt, uint32_t window,
+                bool write, size_t *order);
+
+/*
+ * How many of the leading regions of @iov are register accesses to ascending,
+ * adjacent words, 0 if the first isn't a register access
+ */
+size_t plan_word_run(const struct ahb_iov *iov, size_t iovcnt);
+
+#endif
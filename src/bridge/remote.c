@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include <endian.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "ahb.h"
+#include "bridge.h"
+#include "compiler.h"
+#include "log.h"
+#include "remote.h"
+
+#include "ccan/container_of/container_of.h"
+
+/*
+ * Forwards the AHB operations to 'culvert serve --listen' on another machine.
+ * Bulk transfers are split into chunks that are kept in flight together, so
+ * the round trip is paid once per transfer rather than once per chunk.
+ */
+#define REMOTE_CHUNK            (1 << 20)
+#define REMOTE_DEPTH            4
+
+#define to_remote(ahb) container_of(ahb, struct remote, ahb)
+
+struct remote {
+    struct ahb ahb;
+    /* Advertises the serving bridge's window and subword support */
+    struct bridge_driver drv;
+    int fd;
+    bool zstd;
+    /* Whether the server runs polls and read-modify-writes itself */
+    bool poll;
+    bool modify;
+    uint32_t tag;
+    void *wire;
+    size_t wire_len;
+    /* Set once the stream is out of step, after which every op fails */
+    int broken;
+};
+
+static int remote_fail(struct remote *ctx, int rc)
+{
+    loge("Lost the remote bridge connection: %d\n", rc);
+    ctx->broken = rc;
+
+    return rc;
+}
+
+/* Compresses a bulk payload where that's negotiated and worthwhile */
+static int remote_submit(struct remote *ctx, struct remote_req *req,
+                         const void *payload, size_t len)
+{
+    size_t packed = 0;
+    int rc;
+
+    req->tag = htole32(ctx->tag++);
+
+    if (ctx->zstd)
+        packed = remote_pack(ctx->wire, ctx->wire_len, payload, len);
+    if (packed) {
+        req->flags |= REMOTE_M_ZSTD;
+        payload = ctx->wire;
+        len = packed;
+    }
+
+    req->payload = htole32(len);
+
+    if ((rc = remote_send_msg(ctx->fd, req, sizeof(*req), payload, len)) < 0)
+        return remote_fail(ctx, rc);
+
+    return 0;
+}
+
+/*
+ * Collects the response to the request tagged @tag, its data landing in @buf
+ * when it carries the @len bytes asked for. Returns the operation's result.
+ */
+static ssize_t remote_complete(struct remote *ctx, uint32_t tag, void *buf,
+                               size_t len, uint32_t *value)
+{
+    struct remote_rsp rsp;
+    size_t payload;
+    int32_t result;
+    int rc;
+
+    if ((rc = remote_recv(ctx->fd, &rsp, sizeof(rsp))) < 0)
+        return remote_fail(ctx, rc);
+
+    if (le32toh(rsp.tag) != tag)
+        return remote_fail(ctx, -EPROTO);
+
+    result = le32toh(rsp.rc);
+    payload = le32toh(rsp.payload);
+
+    if (!payload) {
+        if (result > 0 && len)
+            return remote_fail(ctx, -EPROTO);
+    } else if (result != (ssize_t)len) {
+        return remote_fail(ctx, -EPROTO);
+    } else if (rsp.flags & REMOTE_M_ZSTD) {
+        if (payload > ctx->wire_len)
+            return remote_fail(ctx, -EMSGSIZE);
+        if ((rc = remote_recv(ctx->fd, ctx->wire, payload)) < 0 ||
+                (rc = remote_unpack(buf, len, ctx->wire, payload)) < 0)
+            return remote_fail(ctx, rc);
+    } else {
+        if (payload != len)
+            return remote_fail(ctx, -EPROTO);
+        if ((rc = remote_recv(ctx->fd, buf, len)) < 0)
+            return remote_fail(ctx, rc);
+    }
+
+    if (value)
+        *value = le32toh(rsp.value);
+
+    return result;
+}
+
+static ssize_t remote_transact(struct remote *ctx, struct remote_req *req,
+                               const void *payload, size_t len, void *buf,
+                               size_t out, uint32_t *value)
+{
+    uint32_t tag = ctx->tag;
+    int rc;
+
+    if (ctx->broken)
+        return ctx->broken;
+
+    if ((rc = remote_submit(ctx, req, payload, len)) < 0)
+        return rc;
+
+    return remote_complete(ctx, tag, buf, out, value);
+}
+
+/*
+ * Keeps up to REMOTE_DEPTH chunks in flight. The first failure is reported
+ * once the responses to everything sent before it have been collected.
+ */
+static ssize_t remote_bulk(struct remote *ctx, enum remote_op op, uint32_t phys,
+                           uint8_t *buf, size_t len)
+{
+    struct {
+        uint32_t tag;
+        size_t off;
+        size_t len;
+    } inflight[REMOTE_DEPTH];
+    size_t head = 0, tail = 0, sent = 0;
+    struct remote_req req;
+    ssize_t result = 0;
+    ssize_t rc;
+
+    if (ctx->broken)
+        return ctx->broken;
+
+    while (head != tail || (sent < len && !result)) {
+        if (sent < len && !result && head - tail < REMOTE_DEPTH) {
+            size_t chunk = len - sent < REMOTE_CHUNK ? len - sent : REMOTE_CHUNK;
+
+            memset(&req, 0, sizeof(req));
+            req.op = op;
+            req.phys = htole32(phys + sent);
+            req.len = htole32(chunk);
+
+            inflight[head % REMOTE_DEPTH].tag = ctx->tag;
+            inflight[head % REMOTE_DEPTH].off = sent;
+            inflight[head % REMOTE_DEPTH].len = chunk;
+
+            rc = remote_submit(ctx, &req, op == remote_op_write ? buf + sent : NULL,
+                               op == remote_op_write ? chunk : 0);
+            if (rc < 0)
+                return rc;
+
+            head++;
+            sent += chunk;
+            continue;
+        }
+
+        rc = remote_complete(ctx, inflight[tail % REMOTE_DEPTH].tag,
+                             op == remote_op_read ?
+                                 buf + inflight[tail % REMOTE_DEPTH].off : NULL,
+                             op == remote_op_read ?
+                                 inflight[tail % REMOTE_DEPTH].len : 0,
+                             NULL);
+        if (ctx->broken)
+            return ctx->broken;
+
+        if (!result && rc != (ssize_t)inflight[tail % REMOTE_DEPTH].len)
+            result = rc < 0 ? rc : -EIO;
+
+        tail++;
+    }
+
+    return result ?: (ssize_t)len;
+}
+
+static ssize_t remote_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
+{
+    return remote_bulk(to_remote(ahb), remote_op_read, phys, buf, len);
+}
+
+static ssize_t remote_write(struct ahb *ahb, uint32_t phys, const void *buf,
+                            size_t len)
+{
+    return remote_bulk(to_remote(ahb), remote_op_write, phys, (uint8_t *)buf,
+                       len);
+}
+
+static int remote_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    struct remote_req req = { .op = remote_op_readl, .phys = htole32(phys) };
+    ssize_t rc;
+
+    rc = remote_transact(to_remote(ahb), &req, NULL, 0, NULL, 0, val);
+
+    return rc < 0 ? rc : 0;
+}
+
+static int remote_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    struct remote_req req = {
+        .op = remote_op_writel,
+        .phys = htole32(phys),
+        .value = htole32(val),
+    };
+    ssize_t rc;
+
+    rc = remote_transact(to_remote(ahb), &req, NULL, 0, NULL, 0, NULL);
+
+    return rc < 0 ? rc : 0;
+}
+
+/*
+ * The regions' descriptors, and for writev their data, are gathered into one
+ * payload. Region data read back arrives in one piece and is scattered here.
+ */
+static ssize_t remote_vector(struct ahb *ahb, enum remote_op op,
+                             const struct ahb_iov *iov, size_t iovcnt)
+{
+    struct remote *ctx = to_remote(ahb);
+    struct remote_req req = { .op = op };
+    struct remote_iov *desc;
+    size_t total = 0, len;
+    uint8_t *payload, *cursor;
+    ssize_t rc;
+    size_t i;
+
+    if (iovcnt > REMOTE_MAX_IOV)
+        return -E2BIG;
+
+    for (i = 0; i < iovcnt; i++)
+        total += iov[i].len;
+
+    if (total > REMOTE_MAX_LEN)
+        return -E2BIG;
+
+    len = iovcnt * sizeof(*desc) + (op == remote_op_writev ? total : 0);
+    if (!(payload = malloc(len + (op == remote_op_readv ? total : 0))))
+        return -ENOMEM;
+
+    desc = (struct remote_iov *)payload;
+    cursor = payload + iovcnt * sizeof(*desc);
+    for (i = 0; i < iovcnt; i++) {
+        desc[i].phys = htole32(iov[i].phys);
+        desc[i].len = htole32(iov[i].len);
+        if (op == remote_op_writev) {
+            memcpy(cursor, iov[i].base, iov[i].len);
+            cursor += iov[i].len;
+        }
+    }
+
+    req.count = htole16(iovcnt);
+    req.len = htole32(total);
+
+    rc = remote_transact(ctx, &req, payload, len,
+                         op == remote_op_readv ? cursor : NULL,
+                         op == remote_op_readv ? total : 0, NULL);
+
+    if (rc > 0 && op == remote_op_readv) {
+        for (i = 0; i < iovcnt; i++) {
+            memcpy(iov[i].base, cursor, iov[i].len);
+            cursor += iov[i].len;
+        }
+    }
+
+    free(payload);
+
+    return rc;
+}
+
+static ssize_t remote_readv(struct ahb *ahb, const struct ahb_iov *iov,
+                            size_t iovcnt)
+{
+    return remote_vector(ahb, remote_op_readv, iov, iovcnt);
+}
+
+static ssize_t remote_writev(struct ahb *ahb, const struct ahb_iov *iov,
+                             size_t iovcnt)
+{
+    return remote_vector(ahb, remote_op_writev, iov, iovcnt);
+}
+
+static int remote_poll(struct ahb *ahb, uint32_t phys, uint32_t mask,
+                       uint32_t value, uint64_t timeout_us,
+                       const struct ahb_poll_policy *policy, uint32_t *val)
+{
+    struct remote_req req = { .op = remote_op_poll, .phys = htole32(phys) };
+    struct remote *ctx = to_remote(ahb);
+    struct remote_poll args = {
+        .mask = htole32(mask),
+        .value = htole32(value),
+        .timeout_us = htole64(timeout_us),
+    };
+    ssize_t rc;
+
+    if (!ctx->poll)
+        return -ENOTSUP;
+
+    if (policy) {
+        args.holdoff_us = htole32(policy->holdoff_us);
+        args.interval_us = htole32(policy->interval_us);
+        args.max_us = htole32(policy->max_us);
+    }
+
+    rc = remote_transact(ctx, &req, &args, sizeof(args), NULL, 0, val);
+
+    return rc < 0 ? rc : 0;
+}
+
+static int remote_modifyl(struct ahb *ahb, uint32_t phys, uint32_t clear,
+                          uint32_t set)
+{
+    struct remote_req req = { .op = remote_op_modifyl, .phys = htole32(phys) };
+    struct remote *ctx = to_remote(ahb);
+    struct remote_modify args = {
+        .clear = htole32(clear),
+        .set = htole32(set),
+    };
+    ssize_t rc;
+
+    if (!ctx->modify)
+        return -ENOTSUP;
+
+    rc = remote_transact(ctx, &req, &args, sizeof(args), NULL, 0, NULL);
+
+    return rc < 0 ? rc : 0;
+}
+
+static const struct ahb_ops remote_ahb_ops = {
+    .read = remote_read,
+    .write = remote_write,
+    .readl = remote_readl,
+    .writel = remote_writel,
+    .readv = remote_readv,
+    .writev = remote_writev,
+    .poll = remote_poll,
+    .modifyl = remote_modifyl,
+};
+
+static struct ahb *remote_driver_probe(int argc, char *argv[]);
+static void remote_driver_destroy(struct ahb *ahb);
+
+static struct bridge_driver remote_driver = {
+    .name = "remote",
+    .probe = remote_driver_probe,
+    .destroy = remote_driver_destroy,
+    .bus = "network",
+    .priority = 70,
+    .caps = {
+        .burst = REMOTE_CHUNK * REMOTE_DEPTH,
+        .op_ns = 200000,
+        .byte_ps = 10000,
+    },
+};
+REGISTER_BRIDGE_DRIVER(remote_driver);
+
+static int remote_hello(struct remote *ctx)
+{
+    struct remote_hello hello = { 0 };
+    uint32_t flags;
+    int rc;
+
+    memcpy(hello.magic, REMOTE_MAGIC, sizeof(hello.magic));
+    hello.version = htole32(REMOTE_VERSION);
+    hello.flags = htole32((remote_have_zstd() ? REMOTE_F_ZSTD : 0) |
+                          REMOTE_F_POLL | REMOTE_F_MODIFY);
+
+    if ((rc = remote_send(ctx->fd, &hello, sizeof(hello))) < 0 ||
+            (rc = remote_recv(ctx->fd, &hello, sizeof(hello))) < 0)
+        return rc;
+
+    if (memcmp(hello.magic, REMOTE_MAGIC, sizeof(hello.magic)) ||
+            le32toh(hello.version) != REMOTE_VERSION)
+        return -EPROTO;
+
+    flags = le32toh(hello.flags);
+    ctx->zstd = remote_have_zstd() && (flags & REMOTE_F_ZSTD);
+    ctx->poll = flags & REMOTE_F_POLL;
+    ctx->modify = flags & REMOTE_F_MODIFY;
+
+    ctx->drv = remote_driver;
+    ctx->drv.caps.window = le32toh(hello.window);
+    ctx->drv.caps.subword = le32toh(hello.subword);
+
+    hello.bridge[sizeof(hello.bridge) - 1] = '\0';
+    logd("Remote culvert is serving the BMC over %s%s\n", hello.bridge,
+         ctx->zstd ? ", compressing bulk data" : "");
+
+    return 0;
+}
+
+/* Takes "remote [HOST:]PORT" as the interface */
+static struct ahb *remote_driver_probe(int argc, char *argv[])
+{
+    struct remote *ctx;
+    int rc;
+
+    if (argc != 2 || strcmp(argv[0], "remote"))
+        return NULL;
+
+    if (!(ctx = calloc(1, sizeof(*ctx))))
+        return NULL;
+
+    ctx->wire_len = remote_pack_bound(REMOTE_MAX_LEN +
+                                      REMOTE_MAX_IOV * sizeof(struct remote_iov));
+    if (!(ctx->wire = malloc(ctx->wire_len)))
+        goto cleanup_ctx;
+
+    if ((ctx->fd = remote_connect(argv[1])) < 0) {
+        loge("Failed to connect to remote culvert at %s: %d\n", argv[1],
+             ctx->fd);
+        goto cleanup_wire;
+    }
+
+    if ((rc = remote_hello(ctx)) < 0) {
+        loge("Failed to greet remote culvert at %s: %d\n", argv[1], rc);
+        goto cleanup_fd;
+    }
+
+    ahb_init_ops(&ctx->ahb, &ctx->drv, &remote_ahb_ops);
+
+    return &ctx->ahb;
+
+cleanup_fd:
+    close(ctx->fd);
+
+cleanup_wire:
+    free(ctx->wire);
+
+cleanup_ctx:
+    free(ctx);
+
+    return NULL;
+}
+
+static void remote_driver_destroy(struct ahb *ahb)
+{
+    struct remote *ctx = to_remote(ahb);
+
+    close(ctx->fd);
+    free(ctx->wire);
+    free(ctx);
+}
@@ -0,0 +1,1326 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <elf.h>
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahb.h"
+#include "array.h"
+#include "bridge.h"
+#include "compiler.h"
+#include "container.h"
+#include "elfcore.h"
+#include "host.h"
+#include "log.h"
+#include "record.h"
+#include "rev.h"
+
+#include "ccan/container_of/container_of.h"
+
+/* As written by the snapshot command */
+#define SNAPSHOT_REGS_MAGIC     "CVSNAP\0\0"
+#define SNAPSHOT_REGS_VERSION   1
+#define SNAPSHOT_REGS_HDR_LEN   24
+#define SNAPSHOT_REGS_ENTRY_LEN 16
+
+/* Shorter modelled delays are spun out, sleeping would overshoot them */
+#define SNAPSHOT_SPIN_NS        50000
+
+#define AST_SCU_SILICON_G6      0x1e6e2004
+#define AST_SCU_SILICON_G6_A2   0x1e6e2014
+#define AST_SCU_SILICON         0x1e6e207c
+
+/*
+ * Memory from a PT_LOAD segment of a core or a run of a container's blocks,
+ * mapped privately so writes stay in memory, or a register block copied out of
+ * a register snapshot.
+ */
+struct snapshot_seg {
+    uint32_t phys;
+    uint32_t len;
+    uint8_t *base;
+    bool mapped;
+    /* For a container, which of its blocks from @first are still packed */
+    struct snapshot_archive *archive;
+    size_t first;
+    size_t nblocks;
+    bool *packed;
+};
+
+struct snapshot_archive {
+    struct container container;
+    struct container_cache cache;
+};
+
+/*
+ * A modelled register reads back the last value written to it, after first
+ * giving up any values read from it in a replayed recording, in order.
+ */
+struct snapshot_reg {
+    uint32_t phys;
+    uint32_t val;
+    uint32_t *replay;
+    size_t nreplay;
+    size_t next;
+};
+
+/* The data of a recorded bulk read, handed out once to a read of the same range */
+struct snapshot_extent {
+    uint32_t phys;
+    uint32_t len;
+    const uint8_t *data;
+    bool used;
+};
+
+struct snapshot_file {
+    void *base;
+    size_t len;
+};
+
+/*
+ * Emulated costs of an access: a fixed cost per operation, a cost per byte and
+ * the cost of moving the window when an access falls outside it.
+ */
+struct snapshot_model {
+    uint32_t op_ns;
+    uint32_t byte_ps;
+    uint32_t window;
+    uint32_t remap_ns;
+};
+
+/* Window remaps take extra register writes beyond the access itself */
+static const struct {
+    const char *name;
+    uint32_t remap_ns;
+} snapshot_remap_costs[] = {
+    /* An RBAR write through the BMC's MMIO BAR */
+    { "p2a", 1000 },
+    /* HICR7 and HICR8 written through the SuperIO */
+    { "l2a", 160000 },
+};
+
+struct snapshot {
+    struct ahb ahb;
+    struct snapshot_seg *segs;
+    size_t nsegs;
+    /* Sorted by address */
+    struct snapshot_reg *regs;
+    size_t nregs;
+    struct snapshot_extent *extents;
+    size_t nextents;
+    /* Recordings stay mapped while their extents are in use */
+    struct snapshot_file *files;
+    size_t nfiles;
+    /* Containers stay open while their segments have blocks packed */
+    struct snapshot_archive **archives;
+    size_t narchives;
+    /* With a model, a copy of the driver advertising the modelled caps */
+    struct bridge_driver drv;
+    struct snapshot_model model;
+    bool modelled;
+    uint32_t window;
+    bool mapped;
+};
+
+#define to_snapshot(ahb) container_of(ahb, struct snapshot, ahb)
+
+static int snapshot_map_file(const char *path, struct snapshot_file *file)
+{
+    struct stat st;
+    void *base;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    if (!st.st_size) {
+        rc = -EINVAL;
+        goto cleanup_fd;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    file->base = base;
+    file->len = st.st_size;
+    rc = 0;
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+static struct snapshot_reg *snapshot_find_reg(struct snapshot *ctx, uint32_t phys)
+{
+    size_t lo = 0, hi = ctx->nregs;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (ctx->regs[mid].phys == phys)
+            return &ctx->regs[mid];
+
+        if (ctx->regs[mid].phys < phys)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return NULL;
+}
+
+static struct snapshot_reg *snapshot_add_reg(struct snapshot *ctx, uint32_t phys)
+{
+    struct snapshot_reg *regs, *reg;
+    size_t i;
+
+    if ((reg = snapshot_find_reg(ctx, phys)))
+        return reg;
+
+    regs = realloc(ctx->regs, (ctx->nregs + 1) * sizeof(*regs));
+    if (!regs)
+        return NULL;
+    ctx->regs = regs;
+
+    for (i = ctx->nregs; i && regs[i - 1].phys > phys; i--)
+        ;
+
+    memmove(&regs[i + 1], &regs[i], (ctx->nregs - i) * sizeof(*regs));
+    memset(&regs[i], 0, sizeof(*regs));
+    regs[i].phys = phys;
+    ctx->nregs++;
+
+    return &regs[i];
+}
+
+static int snapshot_set_reg(struct snapshot *ctx, uint32_t phys, uint32_t val)
+{
+    struct snapshot_reg *reg;
+
+    if (!(reg = snapshot_add_reg(ctx, phys)))
+        return -ENOMEM;
+
+    reg->val = val;
+
+    return 0;
+}
+
+static int snapshot_replay_reg(struct snapshot *ctx, uint32_t phys, uint32_t val)
+{
+    struct snapshot_reg *reg;
+    uint32_t *replay;
+
+    if (!(reg = snapshot_add_reg(ctx, phys)))
+        return -ENOMEM;
+
+    replay = realloc(reg->replay, (reg->nreplay + 1) * sizeof(*replay));
+    if (!replay)
+        return -ENOMEM;
+
+    replay[reg->nreplay++] = val;
+    reg->replay = replay;
+
+    return 0;
+}
+
+static struct snapshot_seg *snapshot_find_seg(struct snapshot *ctx,
+                                              uint32_t phys, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nsegs; i++) {
+        struct snapshot_seg *seg = &ctx->segs[i];
+
+        if (phys >= seg->phys &&
+                (uint64_t)phys + len <= (uint64_t)seg->phys + seg->len)
+            return seg;
+    }
+
+    return NULL;
+}
+
+static struct snapshot_seg *snapshot_add_seg(struct snapshot *ctx,
+                                             uint32_t phys, uint32_t len)
+{
+    struct snapshot_seg *segs;
+
+    segs = realloc(ctx->segs, (ctx->nsegs + 1) * sizeof(*segs));
+    if (!segs)
+        return NULL;
+
+    ctx->segs = segs;
+    segs[ctx->nsegs].phys = phys;
+    segs[ctx->nsegs].len = len;
+    segs[ctx->nsegs].base = NULL;
+    segs[ctx->nsegs].mapped = false;
+    segs[ctx->nsegs].archive = NULL;
+    segs[ctx->nsegs].packed = NULL;
+
+    return &segs[ctx->nsegs++];
+}
+
+/* Without the SCU the SoC can't be probed, so model its revision registers */
+static int snapshot_model_rev(struct snapshot *ctx, uint32_t rev)
+{
+    int rc;
+
+    if (!rev_is_supported(rev)) {
+        loge("Snapshot is of an unsupported SoC revision 0x%08" PRIx32 "\n", rev);
+        return -ENOTSUP;
+    }
+
+    logd("Snapshot is of an %s\n", rev_name(rev));
+
+    if (rev_is_generation(rev, ast_g6)) {
+        if ((rc = snapshot_set_reg(ctx, AST_SCU_SILICON_G6, rev)) < 0)
+            return rc;
+        if ((rc = snapshot_set_reg(ctx, AST_SCU_SILICON_G6_A2, rev)) < 0)
+            return rc;
+        return snapshot_set_reg(ctx, AST_SCU_SILICON, 0);
+    }
+
+    return snapshot_set_reg(ctx, AST_SCU_SILICON, rev);
+}
+
+/*
+ * A SoC with nothing captured: its revision is modelled and DRAM reads as
+ * zeros, mapped lazily over the largest each generation supports.
+ */
+static int snapshot_synthesise(struct snapshot *ctx, const char *spec)
+{
+    struct snapshot_seg *seg;
+    unsigned long rev;
+    uint32_t phys, len;
+    void *base;
+    char *end;
+    int rc;
+
+    errno = 0;
+    rev = strtoul(spec, &end, 0);
+    if (errno || end == spec || *end || rev > UINT32_MAX)
+        return -EINVAL;
+
+    if ((rc = snapshot_model_rev(ctx, rev)) < 0)
+        return rc;
+
+    switch (rev_generation(rev)) {
+        case ast_g4:
+            phys = 0x40000000;
+            len = 512 << 20;
+            break;
+        case ast_g5:
+            phys = 0x80000000;
+            len = 1024 << 20;
+            break;
+        case ast_g6:
+        default:
+            phys = 0x80000000;
+            len = 2048U << 20;
+            break;
+    }
+
+    base = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return -errno;
+
+    if (!(seg = snapshot_add_seg(ctx, phys, len))) {
+        munmap(base, len);
+        return -ENOMEM;
+    }
+
+    seg->base = base;
+    seg->mapped = true;
+
+    return 0;
+}
+
+static int snapshot_load_note(struct snapshot *ctx, const uint8_t *desc,
+                              size_t len)
+{
+    struct elfcore_soc soc;
+
+    if (len < sizeof(soc))
+        return -EINVAL;
+
+    memcpy(&soc, desc, sizeof(soc));
+
+    return snapshot_model_rev(ctx, le32toh(soc.rev));
+}
+
+static int snapshot_load_core(struct snapshot *ctx,
+                              const struct snapshot_file *file,
+                              const char *path)
+{
+    const Elf32_Ehdr *ehdr = file->base;
+    long pgsize;
+    size_t i;
+    int rc;
+    int fd;
+
+    if (file->len < sizeof(*ehdr) ||
+            ehdr->e_ident[EI_CLASS] != ELFCLASS32 ||
+            ehdr->e_ident[EI_DATA] != ELFDATA2LSB ||
+            le16toh(ehdr->e_type) != ET_CORE ||
+            le32toh(ehdr->e_phoff) + (uint64_t)le16toh(ehdr->e_phnum) *
+                sizeof(Elf32_Phdr) > file->len) {
+        loge("%s is not a core written by 'read --elf'\n", path);
+        return -EINVAL;
+    }
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -errno;
+
+    pgsize = sysconf(_SC_PAGE_SIZE);
+    rc = 0;
+
+    for (i = 0; i < le16toh(ehdr->e_phnum) && !rc; i++) {
+        const Elf32_Phdr *phdr = (const void *)((const uint8_t *)file->base +
+                                                le32toh(ehdr->e_phoff) +
+                                                i * sizeof(*phdr));
+        uint32_t offset = le32toh(phdr->p_offset);
+        uint32_t filesz = le32toh(phdr->p_filesz);
+        struct snapshot_seg *seg;
+        void *base;
+
+        if ((uint64_t)offset + filesz > file->len) {
+            loge("Segment %zu of %s is truncated\n", i, path);
+            rc = -EINVAL;
+            break;
+        }
+
+        if (le32toh(phdr->p_type) == PT_NOTE) {
+            const Elf32_Nhdr *nhdr = (const void *)((const uint8_t *)file->base + offset);
+            size_t namesz = (le32toh(nhdr->n_namesz) + 3) & ~3;
+
+            if (namesz == 8 && filesz >= sizeof(*nhdr) + namesz &&
+                    !memcmp(nhdr + 1, "CULVERT", 8))
+                rc = snapshot_load_note(ctx, (const uint8_t *)(nhdr + 1) + namesz,
+                                        filesz - sizeof(*nhdr) - namesz);
+            continue;
+        }
+
+        if (le32toh(phdr->p_type) != PT_LOAD || !filesz)
+            continue;
+
+        if (offset & (pgsize - 1)) {
+            loge("Can't map segment %zu of %s\n", i, path);
+            rc = -ENOTSUP;
+            break;
+        }
+
+        base = mmap(NULL, filesz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd,
+                    offset);
+        if (base == MAP_FAILED) {
+            rc = -errno;
+            break;
+        }
+
+        if (!(seg = snapshot_add_seg(ctx, le32toh(phdr->p_paddr), filesz))) {
+            munmap(base, filesz);
+            rc = -ENOMEM;
+            break;
+        }
+
+        seg->base = base;
+        seg->mapped = true;
+
+        logd("Mapped snapshot of 0x%08" PRIx32 "-0x%08" PRIx32 "\n", seg->phys,
+             (uint32_t)(seg->phys + seg->len - 1));
+    }
+
+    close(fd);
+
+    return rc;
+}
+
+static uint32_t snapshot_get_le32(const uint8_t *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+
+    return le32toh(val);
+}
+
+/* Each region of a register snapshot is copied so it can be written */
+static int snapshot_load_regs(struct snapshot *ctx,
+                              const struct snapshot_file *file,
+                              const char *path)
+{
+    const uint8_t *buf = file->base;
+    uint32_t nregions, i;
+    int rc;
+
+    if (file->len < SNAPSHOT_REGS_HDR_LEN ||
+            snapshot_get_le32(&buf[8]) != SNAPSHOT_REGS_VERSION) {
+        loge("%s is not a supported register snapshot\n", path);
+        return -EINVAL;
+    }
+
+    nregions = snapshot_get_le32(&buf[16]);
+    if ((file->len - SNAPSHOT_REGS_HDR_LEN) / SNAPSHOT_REGS_ENTRY_LEN < nregions) {
+        loge("%s has a truncated index\n", path);
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nregions; i++) {
+        const uint8_t *entry = &buf[SNAPSHOT_REGS_HDR_LEN +
+                                    i * SNAPSHOT_REGS_ENTRY_LEN];
+        uint32_t phys = snapshot_get_le32(&entry[0]);
+        uint32_t len = snapshot_get_le32(&entry[4]);
+        uint32_t data = snapshot_get_le32(&entry[8]);
+        struct snapshot_seg *seg;
+
+        if ((uint64_t)data + len > file->len) {
+            loge("Region %" PRIu32 " of %s is truncated\n", i, path);
+            return -EINVAL;
+        }
+
+        if (!(seg = snapshot_add_seg(ctx, phys, len)))
+            return -ENOMEM;
+
+        if (!(seg->base = malloc(len ? len : 1)))
+            return -ENOMEM;
+        memcpy(seg->base, &buf[data], len);
+    }
+
+    logd("Modelling %" PRIu32 " register blocks from %s\n", nregions, path);
+
+    /* The SCU may have been excluded from the capture */
+    if ((rc = snapshot_model_rev(ctx, snapshot_get_le32(&buf[12]))) < 0)
+        return rc;
+
+    return 0;
+}
+
+/* Lines of "ADDRESS VALUE", with '#' starting a comment */
+static int snapshot_load_registers(struct snapshot *ctx, const char *path)
+{
+    unsigned int lineno = 0;
+    char line[128];
+    FILE *stream;
+    int rc = 0;
+
+    if (!(stream = fopen(path, "r")))
+        return -errno;
+
+    while (!rc && fgets(line, sizeof(line), stream)) {
+        unsigned long phys, val;
+        char *cursor, *end;
+
+        lineno++;
+
+        if ((cursor = strchr(line, '#')))
+            *cursor = '\0';
+
+        cursor = line + strspn(line, " \t\r\n");
+        if (!*cursor)
+            continue;
+
+        phys = strtoul(cursor, &end, 0);
+        if (end == cursor || phys > UINT32_MAX || (phys & 3))
+            goto invalid;
+
+        cursor = end;
+        val = strtoul(cursor, &end, 0);
+        if (end == cursor || val > UINT32_MAX || end[strspn(end, " \t\r\n")])
+            goto invalid;
+
+        rc = snapshot_set_reg(ctx, phys, val);
+        continue;
+
+invalid:
+        loge("%s:%u: expected 'ADDRESS VALUE'\n", path, lineno);
+        rc = -EINVAL;
+    }
+
+    fclose(stream);
+
+    return rc;
+}
+
+static int snapshot_add_extent(struct snapshot *ctx, uint32_t phys, uint32_t len,
+                               const uint8_t *data)
+{
+    struct snapshot_extent *extents;
+
+    extents = realloc(ctx->extents, (ctx->nextents + 1) * sizeof(*extents));
+    if (!extents)
+        return -ENOMEM;
+
+    extents[ctx->nextents].phys = phys;
+    extents[ctx->nextents].len = len;
+    extents[ctx->nextents].data = data;
+    extents[ctx->nextents].used = false;
+    ctx->extents = extents;
+    ctx->nextents++;
+
+    return 0;
+}
+
+/* Replays the register reads and any bulk read data of a --record file */
+static int snapshot_load_recording(struct snapshot *ctx,
+                                   struct snapshot_file *file, const char *path)
+{
+    const uint8_t *cursor = (const uint8_t *)file->base + 16;
+    const uint8_t *end = (const uint8_t *)file->base + file->len;
+    size_t nreads = 0;
+    int rc = 0;
+
+    while (!rc && cursor + sizeof(struct record_entry) <= end) {
+        struct record_entry entry;
+        uint32_t len;
+
+        memcpy(&entry, cursor, sizeof(entry));
+        cursor += sizeof(entry);
+        len = le32toh(entry.len);
+
+        if (entry.op == RECORD_OP_BRIDGE ||
+                (le16toh(entry.flags) & RECORD_E_DATA)) {
+            if ((size_t)(end - cursor) < len) {
+                logi("%s is truncated, replaying what's there\n", path);
+                break;
+            }
+            cursor += len;
+        }
+
+        if (entry.op == RECORD_OP_BRIDGE || (le16toh(entry.flags) & RECORD_E_ERROR))
+            continue;
+
+        if (entry.op == ahb_op_readl) {
+            rc = snapshot_replay_reg(ctx, le32toh(entry.phys),
+                                     le32toh(entry.value));
+            nreads++;
+        } else if (entry.op == ahb_op_read &&
+                   (le16toh(entry.flags) & RECORD_E_DATA)) {
+            rc = snapshot_add_extent(ctx, le32toh(entry.phys), len,
+                                     cursor - len);
+        }
+    }
+
+    logd("Replaying %zu register reads and %zu bulk reads from %s\n", nreads,
+         ctx->nextents, path);
+
+    return rc;
+}
+
+/*
+ * Each run of abutting blocks becomes a segment. Blocks stored as they are
+ * and falling on pages are mapped from the file and zero blocks are left to
+ * the anonymous mapping. Compressed blocks stay packed, read through the
+ * archive's cache until written.
+ */
+static int snapshot_load_container(struct snapshot *ctx, const char *path)
+{
+    long pgsize = sysconf(_SC_PAGE_SIZE);
+    struct snapshot_archive **archives;
+    size_t i, j, mapped = 0, packed = 0;
+    struct snapshot_archive *archive;
+    struct container *container;
+    int fd, rc;
+
+    if (!(archive = calloc(1, sizeof(*archive))))
+        return -ENOMEM;
+
+    container = &archive->container;
+    if ((rc = container_open(container, path)) < 0)
+        goto cleanup_archive;
+
+    if ((fd = open(path, O_RDONLY)) < 0) {
+        rc = -errno;
+        goto cleanup_container;
+    }
+
+    for (i = 0; i < container->nblocks; i = j) {
+        const struct container_block *blk = &container->blocks[i];
+        uint64_t end = (uint64_t)blk->phys + blk->len;
+        struct snapshot_seg *seg;
+        uint8_t *base;
+
+        for (j = i + 1; j < container->nblocks &&
+                        container->blocks[j].phys == end; j++)
+            end += container->blocks[j].len;
+
+        base = mmap(NULL, end - blk->phys, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (base == MAP_FAILED) {
+            rc = -errno;
+            break;
+        }
+
+        if (!(seg = snapshot_add_seg(ctx, blk->phys, end - blk->phys))) {
+            munmap(base, end - blk->phys);
+            rc = -ENOMEM;
+            break;
+        }
+
+        seg->base = base;
+        seg->mapped = true;
+
+        if (!(seg->packed = calloc(j - i, sizeof(*seg->packed)))) {
+            rc = -ENOMEM;
+            break;
+        }
+        seg->archive = archive;
+        seg->first = i;
+        seg->nblocks = j - i;
+
+        for (; blk < &container->blocks[j]; blk++) {
+            uint8_t *dst = base + (blk->phys - seg->phys);
+
+            if (blk->flags & CONTAINER_ZERO)
+                continue;
+
+            if (blk->flags & CONTAINER_ZSTD) {
+                seg->packed[blk - &container->blocks[i]] = true;
+                packed++;
+                continue;
+            }
+
+            if (!(((uintptr_t)dst | blk->offset | blk->len) & (pgsize - 1)) &&
+                    mmap(dst, blk->len, PROT_READ | PROT_WRITE,
+                         MAP_PRIVATE | MAP_FIXED, fd, blk->offset) != MAP_FAILED) {
+                mapped++;
+                continue;
+            }
+
+            if ((rc = container_read_block(container, blk, dst)) < 0) {
+                loge("Block 0x%08" PRIx32 " of %s is corrupt: %d\n", blk->phys,
+                     path, rc);
+                break;
+            }
+        }
+
+        if (rc < 0)
+            break;
+
+        logd("Loaded snapshot of 0x%08" PRIx32 "-0x%08" PRIx32 "\n", seg->phys,
+             (uint32_t)(seg->phys + seg->len - 1));
+    }
+
+    close(fd);
+
+    if (rc < 0)
+        goto cleanup_segs;
+
+    rc = container_cache_init(&archive->cache, container,
+                              CONTAINER_CACHE_BLOCKS);
+    if (rc < 0)
+        goto cleanup_segs;
+
+    archives = realloc(ctx->archives, (ctx->narchives + 1) * sizeof(*archives));
+    if (!archives) {
+        rc = -ENOMEM;
+        goto cleanup_cache;
+    }
+    ctx->archives = archives;
+    ctx->archives[ctx->narchives++] = archive;
+
+    logd("Mapped %zu and left %zu packed of %zu blocks of %s\n", mapped,
+         packed, container->nblocks, path);
+
+    return snapshot_model_rev(ctx, container->soc.rev);
+
+cleanup_cache:
+    container_cache_destroy(&archive->cache);
+
+cleanup_segs:
+    /* The segments stay until the snapshot goes, without the archive */
+    for (i = 0; i < ctx->nsegs; i++) {
+        if (ctx->segs[i].archive == archive) {
+            free(ctx->segs[i].packed);
+            ctx->segs[i].packed = NULL;
+            ctx->segs[i].archive = NULL;
+        }
+    }
+
+cleanup_container:
+    container_close(container);
+
+cleanup_archive:
+    free(archive);
+
+    return rc;
+}
+
+/* Tells the kinds of file apart by their magic, anything else is a register list */
+static int snapshot_load(struct snapshot *ctx, const char *path)
+{
+    struct snapshot_file *files, *file;
+    int rc;
+
+    files = realloc(ctx->files, (ctx->nfiles + 1) * sizeof(*files));
+    if (!files)
+        return -ENOMEM;
+    ctx->files = files;
+
+    file = &files[ctx->nfiles];
+    if ((rc = snapshot_map_file(path, file)) < 0)
+        return rc;
+
+    /* Recordings stay mapped, their bulk read data is used in place */
+    if (file->len >= 16 && !memcmp(file->base, RECORD_MAGIC, 8)) {
+        ctx->nfiles++;
+        return snapshot_load_recording(ctx, file, path);
+    }
+
+    if (file->len >= SELFMAG && !memcmp(file->base, ELFMAG, SELFMAG))
+        rc = snapshot_load_core(ctx, file, path);
+    else if (file->len >= 8 && !memcmp(file->base, SNAPSHOT_REGS_MAGIC, 8))
+        rc = snapshot_load_regs(ctx, file, path);
+    else if (container_is(file->base, file->len))
+        rc = snapshot_load_container(ctx, path);
+    else
+        rc = snapshot_load_registers(ctx, path);
+
+    munmap(file->base, file->len);
+
+    return rc;
+}
+
+/* The block of the segment's container that holds @phys */
+static const struct container_block *
+snapshot_seg_block(const struct snapshot_seg *seg, uint32_t phys, size_t *index)
+{
+    const struct container_block *blocks;
+    size_t lo = 0, hi = seg->nblocks;
+
+    blocks = &seg->archive->container.blocks[seg->first];
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if ((uint64_t)blocks[mid].phys + blocks[mid].len <= phys)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    *index = lo;
+
+    return &blocks[lo];
+}
+
+/* Copies out of the segment, through the cache for blocks still packed */
+static int snapshot_seg_read(struct snapshot_seg *seg, uint32_t phys,
+                             void *buf, size_t len)
+{
+    uint8_t *cursor = buf;
+    int rc;
+
+    if (!seg->archive) {
+        memcpy(buf, seg->base + (phys - seg->phys), len);
+        return 0;
+    }
+
+    while (len) {
+        const struct container_block *blk;
+        size_t index, offset, chunk;
+
+        blk = snapshot_seg_block(seg, phys, &index);
+        offset = phys - blk->phys;
+        chunk = blk->len - offset < len ? blk->len - offset : len;
+
+        if (seg->packed[index]) {
+            rc = container_cache_read(&seg->archive->cache, blk, offset, cursor,
+                                      chunk);
+            if (rc < 0) {
+                loge("Failed to unpack block 0x%08" PRIx32 ": %d\n", blk->phys,
+                     rc);
+                return rc;
+            }
+        } else {
+            memcpy(cursor, seg->base + (phys - seg->phys), chunk);
+        }
+
+        cursor += chunk;
+        phys += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+/* Packed blocks are unpacked into the segment for good before they're written */
+static int snapshot_seg_write(struct snapshot_seg *seg, uint32_t phys,
+                              const void *buf, size_t len)
+{
+    uint64_t cursor = phys, end = (uint64_t)phys + len;
+    int rc;
+
+    while (seg->archive && cursor < end) {
+        const struct container_block *blk;
+        size_t index;
+
+        blk = snapshot_seg_block(seg, cursor, &index);
+        if (seg->packed[index]) {
+            rc = container_cache_read(&seg->archive->cache, blk, 0,
+                                      seg->base + (blk->phys - seg->phys),
+                                      blk->len);
+            if (rc < 0) {
+                loge("Failed to unpack block 0x%08" PRIx32 ": %d\n", blk->phys,
+                     rc);
+                return rc;
+            }
+            seg->packed[index] = false;
+        }
+
+        cursor = (uint64_t)blk->phys + blk->len;
+    }
+
+    memcpy(seg->base + (phys - seg->phys), buf, len);
+
+    return 0;
+}
+
+static int snapshot_get_word(struct snapshot *ctx, uint32_t phys, uint32_t *val)
+{
+    struct snapshot_seg *seg;
+    struct snapshot_reg *reg;
+
+    if (phys & 0x3)
+        return -EINVAL;
+
+    if ((reg = snapshot_find_reg(ctx, phys))) {
+        if (reg->next < reg->nreplay)
+            reg->val = reg->replay[reg->next++];
+        *val = reg->val;
+        return 0;
+    }
+
+    if ((seg = snapshot_find_seg(ctx, phys, sizeof(*val)))) {
+        uint32_t container;
+        int rc;
+
+        if ((rc = snapshot_seg_read(seg, phys, &container, sizeof(container))) < 0)
+            return rc;
+        *val = le32toh(container);
+        return 0;
+    }
+
+    logd("Unmodelled read of 0x%08" PRIx32 "\n", phys);
+    *val = 0;
+
+    return 0;
+}
+
+static int snapshot_put_word(struct snapshot *ctx, uint32_t phys, uint32_t val)
+{
+    struct snapshot_seg *seg;
+
+    if (phys & 0x3)
+        return -EINVAL;
+
+    if (!snapshot_find_reg(ctx, phys) &&
+            (seg = snapshot_find_seg(ctx, phys, sizeof(val)))) {
+        uint32_t container = htole32(val);
+
+        return snapshot_seg_write(seg, phys, &container, sizeof(container));
+    }
+
+    return snapshot_set_reg(ctx, phys, val);
+}
+
+static ssize_t snapshot_get(struct snapshot *ctx, uint32_t phys, void *buf,
+                            size_t len)
+{
+    struct snapshot_seg *seg;
+    uint8_t *cursor = buf;
+    size_t i;
+    int rc;
+
+    if ((seg = snapshot_find_seg(ctx, phys, len))) {
+        if ((rc = snapshot_seg_read(seg, phys, buf, len)) < 0)
+            return rc;
+        return len;
+    }
+
+    for (i = 0; i < ctx->nextents; i++) {
+        struct snapshot_extent *extent = &ctx->extents[i];
+
+        if (!extent->used && extent->phys == phys && extent->len >= len) {
+            memcpy(buf, extent->data, len);
+            extent->used = true;
+            return len;
+        }
+    }
+
+    /* Piece it together from the segments and the register model */
+    while (len) {
+        uint32_t word = phys & ~3;
+        size_t chunk = 4 - (phys & 3);
+        uint32_t val;
+
+        if (chunk > len)
+            chunk = len;
+
+        if ((seg = snapshot_find_seg(ctx, phys, chunk))) {
+            if ((rc = snapshot_seg_read(seg, phys, cursor, chunk)) < 0)
+                return rc;
+        } else {
+            if ((rc = snapshot_get_word(ctx, word, &val)) < 0)
+                return rc;
+            val = htole32(val);
+            memcpy(cursor, (uint8_t *)&val + (phys & 3), chunk);
+        }
+
+        cursor += chunk;
+        phys += chunk;
+        len -= chunk;
+    }
+
+    return cursor - (uint8_t *)buf;
+}
+
+static ssize_t snapshot_put(struct snapshot *ctx, uint32_t phys,
+                            const void *buf, size_t len)
+{
+    const uint8_t *cursor = buf;
+    struct snapshot_seg *seg;
+    int rc;
+
+    if ((seg = snapshot_find_seg(ctx, phys, len))) {
+        if ((rc = snapshot_seg_write(seg, phys, buf, len)) < 0)
+            return rc;
+        return len;
+    }
+
+    while (len) {
+        uint32_t word = phys & ~3;
+        size_t chunk = 4 - (phys & 3);
+        uint32_t val;
+
+        if (chunk > len)
+            chunk = len;
+
+        if ((seg = snapshot_find_seg(ctx, phys, chunk))) {
+            if ((rc = snapshot_seg_write(seg, phys, cursor, chunk)) < 0)
+                return rc;
+        } else {
+            /* Merge partial words with what the model holds */
+            if (chunk < 4 && (rc = snapshot_get_word(ctx, word, &val)) < 0)
+                return rc;
+            val = htole32(val);
+            memcpy((uint8_t *)&val + (phys & 3), cursor, chunk);
+            if ((rc = snapshot_put_word(ctx, word, le32toh(val))) < 0)
+                return rc;
+        }
+
+        cursor += chunk;
+        phys += chunk;
+        len -= chunk;
+    }
+
+    return cursor - (const uint8_t *)buf;
+}
+
+static void snapshot_wait(uint64_t ns)
+{
+    struct timespec now, deadline;
+    uint64_t end;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    end = now.tv_sec * 1000000000ULL + now.tv_nsec + ns;
+    deadline.tv_sec = end / 1000000000ULL;
+    deadline.tv_nsec = end % 1000000000ULL;
+
+    if (ns >= SNAPSHOT_SPIN_NS) {
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL))
+            ;
+        return;
+    }
+
+    do {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (now.tv_sec < deadline.tv_sec ||
+             (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec));
+}
+
+/* Spends as long on the access as the modelled bridge would */
+static void snapshot_charge(struct snapshot *ctx, uint32_t phys, size_t len)
+{
+    const struct snapshot_model *model = &ctx->model;
+    uint64_t ns;
+
+    if (!ctx->modelled)
+        return;
+
+    ns = model->op_ns + (uint64_t)len * model->byte_ps / 1000;
+
+    if (model->window && len) {
+        uint32_t first = phys / model->window;
+        uint32_t last = (uint32_t)((phys + (uint64_t)len - 1) / model->window);
+        uint32_t window;
+
+        for (window = first; window <= last; window++) {
+            if (ctx->mapped && ctx->window == window)
+                continue;
+
+            ns += model->remap_ns;
+            ahb_stats_remap(&ctx->ahb, span_begin());
+            ctx->window = window;
+            ctx->mapped = true;
+        }
+    }
+
+    snapshot_wait(ns);
+}
+
+static int snapshot_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    struct snapshot *ctx = to_snapshot(ahb);
+
+    snapshot_charge(ctx, phys, sizeof(*val));
+
+    return snapshot_get_word(ctx, phys, val);
+}
+
+static int snapshot_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    struct snapshot *ctx = to_snapshot(ahb);
+
+    snapshot_charge(ctx, phys, sizeof(val));
+
+    return snapshot_put_word(ctx, phys, val);
+}
+
+static ssize_t snapshot_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
+{
+    struct snapshot *ctx = to_snapshot(ahb);
+
+    snapshot_charge(ctx, phys, len);
+
+    return snapshot_get(ctx, phys, buf, len);
+}
+
+static ssize_t snapshot_write(struct ahb *ahb, uint32_t phys, const void *buf,
+                              size_t len)
+{
+    struct snapshot *ctx = to_snapshot(ahb);
+
+    snapshot_charge(ctx, phys, len);
+
+    return snapshot_put(ctx, phys, buf, len);
+}
+
+static const struct ahb_ops snapshot_ahb_ops = {
+    .read = snapshot_read,
+    .write = snapshot_write,
+    .readl = snapshot_readl,
+    .writel = snapshot_writel,
+};
+
+static struct ahb *snapshot_driver_probe(int argc, char *argv[]);
+static void snapshot_driver_destroy(struct ahb *ahb);
+
+static struct bridge_driver snapshot_driver = {
+    .name = "snapshot",
+    .probe = snapshot_driver_probe,
+    .destroy = snapshot_driver_destroy,
+    .bus = "snapshot",
+    .priority = 80,
+    .caps = {
+        .burst = (1 << 20),
+        .subword = true,
+        .op_ns = 50,
+        .byte_ps = 100,
+    },
+};
+REGISTER_BRIDGE_DRIVER(snapshot_driver);
+
+static bool snapshot_parse_u32(const char **cursor, uint32_t *val)
+{
+    unsigned long parsed;
+    char *end;
+
+    errno = 0;
+    parsed = strtoul(*cursor, &end, 0);
+    if (errno || end == *cursor || parsed > UINT32_MAX)
+        return false;
+
+    *val = parsed;
+    *cursor = *end == ',' ? end + 1 : end;
+
+    return true;
+}
+
+/*
+ * @spec names a bridge driver whose costs are copied, or gives them as
+ * OP_NS,BYTE_PS[,WINDOW[,REMAP_NS]].
+ */
+static int snapshot_set_model(struct snapshot *ctx, const char *spec)
+{
+    struct snapshot_model *model = &ctx->model;
+    struct bridge_driver **bridges;
+    const char *cursor = spec;
+    size_t n_bridges, i;
+
+    ctx->drv = snapshot_driver;
+
+    if (isdigit((unsigned char)*spec)) {
+        memset(model, 0, sizeof(*model));
+        if (!snapshot_parse_u32(&cursor, &model->op_ns) ||
+                !snapshot_parse_u32(&cursor, &model->byte_ps) ||
+                (*cursor && !snapshot_parse_u32(&cursor, &model->window)) ||
+                (*cursor && !snapshot_parse_u32(&cursor, &model->remap_ns)) ||
+                *cursor || (model->window & (model->window - 1)) ||
+                (model->window && model->window < 4))
+            return -EINVAL;
+
+        ctx->drv.caps.op_ns = model->op_ns;
+        ctx->drv.caps.byte_ps = model->byte_ps;
+        ctx->drv.caps.window = model->window;
+        if (model->window && model->window < ctx->drv.caps.burst)
+            ctx->drv.caps.burst = model->window;
+    } else {
+        bridges = host_bridge_drivers(&n_bridges);
+
+        for (i = 0; i < n_bridges; i++) {
+            if (bridges[i] != &snapshot_driver && !strcmp(bridges[i]->name, spec))
+                break;
+        }
+
+        if (i == n_bridges)
+            return -ENOENT;
+
+        ctx->drv.caps = bridges[i]->caps;
+
+        model->op_ns = ctx->drv.caps.op_ns;
+        model->byte_ps = ctx->drv.caps.byte_ps;
+        model->window = ctx->drv.caps.window;
+        model->remap_ns = 0;
+        for (i = 0; i < ARRAY_SIZE(snapshot_remap_costs); i++) {
+            if (!strcmp(snapshot_remap_costs[i].name, spec))
+                model->remap_ns = snapshot_remap_costs[i].remap_ns;
+        }
+    }
+
+    logd("Modelling %" PRIu32 "ns per operation, %" PRIu32 "ps per byte and %"
+         PRIu32 "ns per remap of a 0x%" PRIx32 " byte window\n", model->op_ns,
+         model->byte_ps, model->remap_ns, model->window);
+
+    ctx->modelled = true;
+
+    return 0;
+}
+
+static void snapshot_destroy(struct snapshot *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nsegs; i++) {
+        if (ctx->segs[i].mapped)
+            munmap(ctx->segs[i].base, ctx->segs[i].len);
+        else
+            free(ctx->segs[i].base);
+        free(ctx->segs[i].packed);
+    }
+    free(ctx->segs);
+
+    for (i = 0; i < ctx->narchives; i++) {
+        container_cache_destroy(&ctx->archives[i]->cache);
+        container_close(&ctx->archives[i]->container);
+        free(ctx->archives[i]);
+    }
+    free(ctx->archives);
+
+    for (i = 0; i < ctx->nregs; i++)
+        free(ctx->regs[i].replay);
+    free(ctx->regs);
+
+    free(ctx->extents);
+
+    for (i = 0; i < ctx->nfiles; i++)
+        munmap(ctx->files[i].base, ctx->files[i].len);
+    free(ctx->files);
+}
+
+/*
+ * Takes "snapshot [model=MODEL] FILE..." as the interface, where each file is
+ * a core from 'read --elf', a container from 'read --container', a register
+ * snapshot from the snapshot command, a recording from --record or a list of
+ * register values. "rev=REV" in place of a file stands in a synthetic SoC of
+ * that silicon revision. With a model the bridge takes as long as the
+ * modelled one would, see snapshot_set_model().
+ */
+static struct ahb *snapshot_driver_probe(int argc, char *argv[])
+{
+    struct snapshot *ctx;
+    int rc;
+    int i;
+
+    if (argc < 2 || strcmp(argv[0], "snapshot"))
+        return NULL;
+
+    if (!(ctx = calloc(1, sizeof(*ctx))))
+        return NULL;
+
+    i = 1;
+    if (!strncmp(argv[i], "model=", strlen("model="))) {
+        if ((rc = snapshot_set_model(ctx, argv[i] + strlen("model="))) < 0) {
+            loge("Unrecognised bridge model '%s'\n", argv[i]);
+            goto cleanup_ctx;
+        }
+        i++;
+    }
+
+    if (i == argc) {
+        loge("No snapshot to run against\n");
+        goto cleanup_ctx;
+    }
+
+    for (; i < argc; i++) {
+        if (!strncmp(argv[i], "rev=", strlen("rev="))) {
+            rc = snapshot_synthesise(ctx, argv[i] + strlen("rev="));
+            if (rc < 0) {
+                loge("Failed to synthesise a SoC for '%s': %d\n", argv[i], rc);
+                goto cleanup_ctx;
+            }
+            continue;
+        }
+
+        if ((rc = snapshot_load(ctx, argv[i])) < 0) {
+            loge("Failed to load snapshot %s: %d\n", argv[i], rc);
+            goto cleanup_ctx;
+        }
+    }
+
+    ahb_init_ops(&ctx->ahb, ctx->modelled ? &ctx->drv : &snapshot_driver,
+                 &snapshot_ahb_ops);
+
+    return &ctx->ahb;
+
+cleanup_ctx:
+    snapshot_destroy(ctx);
+    free(ctx);
+
+    return NULL;
+}
+
+static void snapshot_driver_destroy(struct ahb *ahb)
+{
+    struct snapshot *ctx = to_snapshot(ahb);
+
+    snapshot_destroy(ctx);
+    free(ctx);
+}
@@ -0,0 +1,473 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "bridge.h"
+#include "log.h"
+#include "span.h"
+#include "stripe.h"
+
+#include "ccan/container_of/container_of.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/* Transfers shorter than this aren't worth the thread handoff */
+#define STRIPE_MIN_LEN      (256 << 10)
+/* Every share of a striped transfer is a multiple of this */
+#define STRIPE_ALIGN        (4 << 10)
+#define STRIPE_MIN_SHARE    (64 << 10)
+
+#define to_stripe(ahb) container_of(ahb, struct stripe, ahb)
+
+enum stripe_dir { stripe_read, stripe_write };
+
+struct stripe_task {
+    struct stripe_member *member;
+    enum stripe_dir dir;
+    uint32_t phys;
+    void *buf;
+    size_t len;
+    ssize_t rc;
+    uint64_t ns;
+    pthread_t thread;
+};
+
+static uint64_t stripe_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* The bridge's own estimate, amortising the fixed cost over a burst */
+static double stripe_caps_cost(const struct bridge_caps *caps)
+{
+    double cost = caps->byte_ps;
+
+    if (caps->burst)
+        cost += caps->op_ns * 1000.0 / caps->burst;
+
+    return cost > 0 ? cost : 1;
+}
+
+static double stripe_estimate(const struct stripe_member *member,
+                              enum stripe_dir dir, size_t len)
+{
+    return ahb_bridge_caps(member->ahb)->op_ns + member->cost[dir] * len / 1000;
+}
+
+static void stripe_task_run(struct stripe_task *task)
+{
+    struct ahb *ahb = task->member->ahb;
+    uint64_t start = stripe_now();
+
+    if (task->dir == stripe_read)
+        task->rc = ahb_read(ahb, task->phys, task->buf, task->len);
+    else
+        task->rc = ahb_write(ahb, task->phys, task->buf, task->len);
+
+    task->ns = stripe_now() - start;
+}
+
+static void *stripe_task_worker(void *arg)
+{
+    struct stripe_task *task = arg;
+
+    span_thread_name(task->member->ahb->drv->name);
+    stripe_task_run(task);
+
+    return NULL;
+}
+
+/* Weights each member's share of @len by its expected throughput */
+static size_t stripe_plan(struct stripe *ctx, enum stripe_dir dir, size_t len,
+                          size_t shares[STRIPE_MAX_MEMBERS])
+{
+    bool active[STRIPE_MAX_MEMBERS];
+    size_t i, nr_active, assigned;
+    double total;
+    bool changed;
+
+    for (i = 0; i < ctx->nr_members; i++)
+        active[i] = true;
+
+    /* Drop members whose share would be too small to pay for itself */
+    do {
+        total = 0;
+        for (i = 0; i < ctx->nr_members; i++) {
+            if (active[i])
+                total += 1 / ctx->members[i].cost[dir];
+        }
+
+        changed = false;
+        nr_active = 0;
+        for (i = 0; i < ctx->nr_members; i++) {
+            if (!active[i])
+                continue;
+
+            shares[i] = (len * (1 / ctx->members[i].cost[dir]) / total);
+            shares[i] &= ~(size_t)(STRIPE_ALIGN - 1);
+            if (shares[i] < STRIPE_MIN_SHARE) {
+                active[i] = false;
+                changed = true;
+            } else {
+                nr_active++;
+            }
+        }
+    } while (changed && nr_active > 1);
+
+    /* Hand the rounding slack to the fastest active member */
+    assigned = 0;
+    for (i = 0; i < ctx->nr_members; i++) {
+        if (!active[i])
+            shares[i] = 0;
+        assigned += shares[i];
+    }
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if (active[i]) {
+            shares[i] += len - assigned;
+            break;
+        }
+    }
+
+    return nr_active;
+}
+
+static struct stripe_member *stripe_pick(struct stripe *ctx,
+                                         enum stripe_dir dir, size_t len)
+{
+    struct stripe_member *best = &ctx->members[0];
+    size_t i;
+
+    for (i = 1; i < ctx->nr_members; i++) {
+        if (stripe_estimate(&ctx->members[i], dir, len) <
+            stripe_estimate(best, dir, len))
+            best = &ctx->members[i];
+    }
+
+    return best;
+}
+
+static ssize_t stripe_transfer(struct stripe *ctx, enum stripe_dir dir,
+                               uint32_t phys, void *buf, size_t len)
+{
+    struct stripe_task tasks[STRIPE_MAX_MEMBERS];
+    size_t shares[STRIPE_MAX_MEMBERS];
+    struct stripe_task *local = NULL;
+    size_t i, nr_tasks = 0;
+    bool short_xfer = false;
+    ssize_t rc = 0, err = 0;
+
+    if (len < STRIPE_MIN_LEN || stripe_plan(ctx, dir, len, shares) < 2) {
+        struct stripe_task task = {
+            .member = stripe_pick(ctx, dir, len),
+            .dir = dir, .phys = phys, .buf = buf, .len = len,
+        };
+
+        stripe_task_run(&task);
+
+        return task.rc;
+    }
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        struct stripe_task *task;
+
+        if (!shares[i])
+            continue;
+
+        task = &tasks[nr_tasks++];
+        task->member = &ctx->members[i];
+        task->dir = dir;
+        task->phys = phys;
+        task->buf = buf;
+        task->len = shares[i];
+        task->rc = -EIO;
+
+        phys += shares[i];
+        buf += shares[i];
+
+        /* The calling thread services the first share itself */
+        if (!local) {
+            local = task;
+            continue;
+        }
+
+        if (pthread_create(&task->thread, NULL, stripe_task_worker, task)) {
+            /* Fall back to servicing the share once the others are done */
+            task->thread = pthread_self();
+        }
+    }
+
+    stripe_task_run(local);
+
+    for (i = 0; i < nr_tasks; i++) {
+        struct stripe_task *task = &tasks[i];
+
+        if (task == local)
+            continue;
+
+        if (pthread_equal(task->thread, pthread_self()))
+            stripe_task_run(task);
+        else
+            pthread_join(task->thread, NULL);
+    }
+
+    for (i = 0; i < nr_tasks; i++) {
+        struct stripe_task *task = &tasks[i];
+        double measured;
+
+        if (task->rc < 0) {
+            loge("Striped %s through %s failed: %zd\n",
+                 dir == stripe_read ? "read" : "write",
+                 task->member->ahb->drv->name, task->rc);
+            err = task->rc;
+            continue;
+        }
+
+        /* Only the contiguous prefix counts once a member comes up short */
+        if (!short_xfer) {
+            rc += task->rc;
+            short_xfer = (size_t)task->rc < task->len;
+        }
+
+        if (!task->rc)
+            continue;
+
+        /* Track how the bridge is really performing */
+        measured = task->ns * 1000.0 / task->rc;
+        task->member->cost[dir] = (3 * task->member->cost[dir] + measured) / 4;
+    }
+
+    return err ? err : rc;
+}
+
+static ssize_t stripe_read_op(struct ahb *ahb, uint32_t phys, void *buf,
+                              size_t len)
+{
+    return stripe_transfer(to_stripe(ahb), stripe_read, phys, buf, len);
+}
+
+static ssize_t stripe_write_op(struct ahb *ahb, uint32_t phys, const void *buf,
+                               size_t len)
+{
+    return stripe_transfer(to_stripe(ahb), stripe_write, phys, (void *)buf,
+                           len);
+}
+
+static int stripe_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    return ahb_readl(to_stripe(ahb)->best, phys, val);
+}
+
+static int stripe_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    return ahb_writel(to_stripe(ahb)->best, phys, val);
+}
+
+static int stripe_poll(struct ahb *ahb, uint32_t phys, uint32_t mask,
+                       uint32_t value, uint64_t timeout_us,
+                       const struct ahb_poll_policy *policy, uint32_t *val)
+{
+    return ahb_poll(to_stripe(ahb)->best, phys, mask, value, timeout_us,
+                    policy, val);
+}
+
+static int stripe_modifyl(struct ahb *ahb, uint32_t phys, uint32_t clear,
+                          uint32_t set)
+{
+    return ahb_modifyl(to_stripe(ahb)->best, phys, clear, set);
+}
+
+static ssize_t stripe_readv(struct ahb *ahb, const struct ahb_iov *iov,
+                            size_t iovcnt)
+{
+    return ahb_readv(to_stripe(ahb)->best, iov, iovcnt);
+}
+
+static ssize_t stripe_writev(struct ahb *ahb, const struct ahb_iov *iov,
+                             size_t iovcnt)
+{
+    return ahb_writev(to_stripe(ahb)->best, iov, iovcnt);
+}
+
+static int stripe_aperture(struct ahb *ahb, uint32_t phys, size_t len)
+{
+    struct stripe *ctx = to_stripe(ahb);
+    int rc, found = -ENOTSUP;
+    size_t i;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if (!ahb_has_aperture(ctx->members[i].ahb))
+            continue;
+
+        if ((rc = ahb_set_aperture(ctx->members[i].ahb, phys, len)) < 0)
+            return rc;
+
+        found = 0;
+    }
+
+    return found;
+}
+
+static int stripe_session(struct ahb *ahb, bool open)
+{
+    struct stripe *ctx = to_stripe(ahb);
+    int rc, failed = 0;
+    size_t i;
+
+    if (!open) {
+        /* Close every member's session even if one of them fails */
+        for (i = 0; i < ctx->nr_members; i++) {
+            if ((rc = ahb_session_end(ctx->members[i].ahb)) < 0)
+                failed = rc;
+        }
+
+        return failed;
+    }
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if ((rc = ahb_session_begin(ctx->members[i].ahb)) < 0)
+            goto unwind;
+    }
+
+    return 0;
+
+unwind:
+    while (i--)
+        ahb_session_end(ctx->members[i].ahb);
+
+    return rc;
+}
+
+static const struct ahb_ops stripe_ops = {
+    .read = stripe_read_op,
+    .write = stripe_write_op,
+    .readl = stripe_readl,
+    .writel = stripe_writel,
+    .readv = stripe_readv,
+    .writev = stripe_writev,
+    .aperture = stripe_aperture,
+    .session = stripe_session,
+    .poll = stripe_poll,
+    .modifyl = stripe_modifyl,
+};
+
+static int stripe_release(struct ahb *ahb)
+{
+    struct stripe *ctx = to_stripe(ahb);
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if ((rc = ahb_release_bridge(ctx->members[i].ahb)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int stripe_reinit(struct ahb *ahb)
+{
+    struct stripe *ctx = to_stripe(ahb);
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        if ((rc = ahb_reinit_bridge(ctx->members[i].ahb)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+void stripe_init(struct stripe *ctx)
+{
+    memset(&ctx->driver, 0, sizeof(ctx->driver));
+    ctx->driver.name = "stripe";
+    ctx->driver.release = stripe_release;
+    ctx->driver.reinit = stripe_reinit;
+    ctx->driver.caps.burst = 4 * STRIPE_MIN_LEN;
+    ctx->driver.caps.subword = true;
+
+    ctx->nr_members = 0;
+    ctx->best = NULL;
+
+    ahb_init_ops(&ctx->ahb, &ctx->driver, &stripe_ops);
+}
+
+/* Recomputes the register bridge and the aggregate costs */
+static void stripe_update(struct stripe *ctx)
+{
+    struct bridge_caps *mine = &ctx->driver.caps;
+    double rate = 0;
+    size_t i;
+
+    ctx->best = NULL;
+    for (i = 0; i < ctx->nr_members; i++) {
+        struct ahb *ahb = ctx->members[i].ahb;
+
+        if (!ctx->best ||
+            ahb_bridge_caps(ahb)->op_ns < ahb_bridge_caps(ctx->best)->op_ns)
+            ctx->best = ahb;
+
+        rate += 1 / ctx->members[i].cost[stripe_read];
+    }
+
+    mine->op_ns = ahb_bridge_caps(ctx->best)->op_ns;
+    mine->byte_ps = 1 / rate;
+}
+
+/*
+ * Only one bridge per bus can take part. If @ahb shares a bus with an existing
+ * member then the cheaper of the two is kept.
+ */
+int stripe_add(struct stripe *ctx, struct ahb *ahb)
+{
+    double cost = stripe_caps_cost(ahb_bridge_caps(ahb));
+    struct stripe_member *member = NULL;
+    const char *bus = ahb->drv->bus;
+    size_t i;
+
+    for (i = 0; i < ctx->nr_members; i++) {
+        const char *theirs = ctx->members[i].ahb->drv->bus;
+
+        if (!bus || !theirs || strcmp(bus, theirs))
+            continue;
+
+        if (ctx->members[i].cost[stripe_read] <= cost)
+            return -EBUSY;
+
+        logd("Preferring %s to %s on the %s bus\n", ahb->drv->name,
+             ctx->members[i].ahb->drv->name, bus);
+        member = &ctx->members[i];
+        break;
+    }
+
+    if (!member) {
+        if (ctx->nr_members == STRIPE_MAX_MEMBERS)
+            return -ENOSPC;
+
+        member = &ctx->members[ctx->nr_members++];
+    }
+
+    member->ahb = ahb;
+    member->cost[stripe_read] = cost;
+    member->cost[stripe_write] = cost;
+
+    stripe_update(ctx);
+
+    return 0;
+}
+
+void stripe_destroy(struct stripe *ctx)
+{
+    ctx->nr_members = 0;
+    ctx->best = NULL;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _STRIPE_H
+#define _STRIPE_H
+
+#include "ahb.h"
+#include "bridge.h"
+
+#include <stddef.h>
+
+#define STRIPE_MAX_MEMBERS 4
+
+struct stripe_member {
+    struct ahb *ahb;
+    /* Running estimates of the cost per byte for reads and writes, in ps */
+    double cost[2];
+};
+
+/*
+ * Spreads bulk reads and writes across several bridges on independent buses,
+ * in proportion to how fast each has been. Register accesses and small
+ * transfers go to the single bridge expected to complete them soonest.
+ */
+struct stripe {
+    struct ahb ahb;
+    struct bridge_driver driver;
+    struct stripe_member members[STRIPE_MAX_MEMBERS];
+    size_t nr_members;
+    /* The member with the lowest per-operation cost */
+    struct ahb *best;
+};
+
+void stripe_init(struct stripe *ctx);
+int stripe_add(struct stripe *ctx, struct ahb *ahb);
+void stripe_destroy(struct stripe *ctx);
+
+static inline struct ahb *stripe_as_ahb(struct stripe *ctx)
+{
+    return &ctx->ahb;
+}
+
+#endif
@@ -0,0 +1,148 @@
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * The debug stub's binary protocol over the host side of a VUART, leaving the
+ * physical debug UART free. The VUART's FIFOs are reached over LPC I/O from
+ * the host and through its tty on the BMC, where `culvert serve --stub TTY`
+ * answers the requests.
+ *
+ * The VUART raises SIRQ as a 16550 would, but the host kernel owns the line,
+ * so like the SUART consoles the host polls.
+ */
+
+#include "ahb.h"
+#include "bridge.h"
+#include "compiler.h"
+#include "debug.h"
+#include "debugstub.h"
+#include "log.h"
+#include "prompt.h"
+#include "uart/suart.h"
+
+#include "ccan/container_of/container_of.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Where the AST2x00 VUART sits unless the BMC moves it, as COM1 */
+#define VUARTB_DEFAULT_PORT     0x3f8
+
+/* The VUART moves bytes as fast as LPC does, whatever its divisor says */
+#define VUARTB_POLL_BAUD        1500000
+
+/* Only the debug bridge's AHB and prompt are used, by the stub's ops */
+struct vuartb {
+    struct debug debug;
+    struct suart uart;
+};
+
+#define to_vuartb(ahb) container_of(ahb, struct vuartb, debug.ahb)
+
+static ssize_t vuartb_recv(void *priv, char *buf, size_t len, int timeout_ms)
+{
+    return suart_recv_any(priv, buf, len, timeout_ms);
+}
+
+static ssize_t vuartb_send(void *priv, const char *buf, size_t len)
+{
+    ssize_t rc;
+
+    if ((rc = suart_flush(priv, buf, len)) < 0)
+        return rc;
+
+    return len;
+}
+
+static const struct prompt_ops vuartb_prompt_ops = {
+    .recv = vuartb_recv,
+    .send = vuartb_send,
+};
+
+static struct ahb *vuartb_driver_probe(int argc, char *argv[]);
+static void vuartb_driver_destroy(struct ahb *ahb);
+
+static struct bridge_driver vuartb_driver = {
+    .name = "vuart",
+    .probe = vuartb_driver_probe,
+    .destroy = vuartb_driver_destroy,
+    .bus = "lpc",
+    .priority = 55,
+    .thread_bound = true,
+    .caps = {
+        .burst = DEBUGSTUB_MAX,
+        .subword = true,
+        .op_ns = 1000000,
+        .byte_ps = 2000000,
+    },
+};
+REGISTER_BRIDGE_DRIVER(vuartb_driver);
+
+static struct ahb *vuartb_driver_probe(int argc, char *argv[])
+{
+    unsigned long port = VUARTB_DEFAULT_PORT;
+    struct vuartb *ctx;
+    char *endp;
+    int rc;
+
+    /* Something else may be on the port, only talk to it when asked to */
+    if (argc < 1 || argc > 2 || strcmp(argv[0], "vuart"))
+        return NULL;
+
+    if (argc == 2) {
+        errno = 0;
+        port = strtoul(argv[1], &endp, 0);
+        if (errno || *endp || port > UINT16_MAX) {
+            loge("Invalid VUART I/O port '%s'\n", argv[1]);
+            return NULL;
+        }
+    }
+
+    if (!(ctx = calloc(1, sizeof(*ctx))))
+        return NULL;
+
+    if ((rc = suart_init_port(&ctx->uart, port)) < 0) {
+        loge("Failed to initialise the VUART at 0x%lx: %d\n", port, rc);
+        goto cleanup_ctx;
+    }
+
+    ctx->uart.baud = VUARTB_POLL_BAUD;
+
+    if ((rc = prompt_init_ops(&ctx->debug.prompt, &vuartb_prompt_ops,
+                              &ctx->uart, "\n", false)) < 0)
+        goto cleanup_uart;
+
+    ahb_init_ops(&ctx->debug.ahb, &vuartb_driver, NULL);
+
+    if ((rc = debug_stub_attach(&ctx->debug)) < 0) {
+        loge("No agent answered on the VUART at 0x%lx: %d\n", port, rc);
+        goto cleanup_prompt;
+    }
+
+    return debug_as_ahb(&ctx->debug);
+
+cleanup_prompt:
+    prompt_destroy(&ctx->debug.prompt);
+
+cleanup_uart:
+    suart_destroy(&ctx->uart);
+
+cleanup_ctx:
+    free(ctx);
+
+    return NULL;
+}
+
+static void vuartb_driver_destroy(struct ahb *ahb)
+{
+    struct vuartb *ctx = to_vuartb(ahb);
+    int rc;
+
+    prompt_destroy(&ctx->debug.prompt);
+
+    if ((rc = suart_destroy(&ctx->uart)) < 0)
+        loge("Failed to release the VUART: %d\n", rc);
+
+    free(ctx);
+}
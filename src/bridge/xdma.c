@@ -0,0 +1,642 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "ahb.h"
+#include "array.h"
+#include "bits.h"
+#include "bridge.h"
+#include "compiler.h"
+#include "log.h"
+#include "p2a.h"
+#include "pci.h"
+#include "rev.h"
+
+#include "ccan/container_of/container_of.h"
+
+/*
+ * The X-DMA engine copies between BMC DRAM and host memory as the VGA device.
+ * It's programmed over P2A: commands are written to a queue in a free page of
+ * BMC DRAM and the engine is kicked through its write pointer. Upstream
+ * commands land the data in a physically contiguous host buffer from the
+ * u-dma-buf driver, which is copied out once the batch completes. The
+ * register and command layouts follow the Linux aspeed-xdma driver.
+ */
+#define XDMA_BASE                       0x1e6e7000
+#define XDMA_CMDQ_LEN                   4096
+#define XDMA_NR_CMDS                    (XDMA_CMDQ_LEN / sizeof(struct xdma_cmd))
+/* One line per command, the line sizes allow up to 0x7ff0 bytes */
+#define XDMA_CMD_LEN                    (16 << 10)
+#define XDMA_ALIGN                      16
+#define XDMA_TIMEOUT_NS                 (1000 * 1000 * 1000ULL)
+#define XDMA_CMDQ_READP_RESET           0xee882266
+
+#define MIN(a, b)                       ((a) < (b) ? (a) : (b))
+
+#define AST2500_XDMA_CMD_PITCH_UPSTREAM BIT(31)
+#define AST2500_XDMA_CMD_PITCH_ADDR     0x3ffffff0
+#define AST2500_XDMA_CMD_PITCH_HOST(x)  ((uint64_t)(x) << 35)
+#define AST2500_XDMA_CMD_PITCH_BMC(x)   ((uint64_t)(x) << 51)
+#define AST2500_XDMA_CMD_PITCH_ID       BIT(0)
+#define AST2500_XDMA_CMD_IRQ_EN         BIT(31)
+#define AST2500_XDMA_CMD_LINE_NO(x)     ((uint64_t)(x) << 16)
+#define AST2500_XDMA_CMD_IRQ_BMC        BIT(15)
+#define AST2500_XDMA_CMD_LINE_SIZE(x)   ((uint64_t)(x) & 0x7ff0)
+#define AST2500_XDMA_CMD_ID             BIT(1)
+
+#define AST2600_XDMA_CMD_PITCH_ADDR     0x7fffffff
+#define AST2600_XDMA_CMD_PITCH_HOST(x)  ((uint64_t)(x) << 32)
+#define AST2600_XDMA_CMD_PITCH_BMC(x)   ((uint64_t)(x) << 48)
+#define AST2600_XDMA_CMD_64_EN          (1ULL << 40)
+#define AST2600_XDMA_CMD_IRQ_BMC        (1ULL << 37)
+#define AST2600_XDMA_CMD_UPSTREAM       (1ULL << 32)
+#define AST2600_XDMA_CMD_LINE_NO(x)     ((uint64_t)(x) << 16)
+#define AST2600_XDMA_CMD_LINE_SIZE(x)   ((uint64_t)(x) & 0x7fff)
+
+#define AST_SCU_PCIE_CONFIG_G5          0x1e6e2180
+#define AST_SCU_PCIE_CONFIG_G6          0x1e6e2c20
+#define   AST_SCU_PCIE_CONFIG_VGA_XDMA  BIT(6)
+#define AST_SCU_RESET_G5                0x1e6e2004
+#define AST_SCU_RESET_G6                0x1e6e2040
+#define   AST_SCU_RESET_XDMA            BIT(25)
+#define AST_SDMC_GMP                    0x1e6e0008
+
+#define to_xdma(ahb) container_of(ahb, struct xdma, ahb)
+
+struct xdma_cmd {
+    uint64_t host_addr;
+    uint64_t pitch;
+    uint64_t cmd;
+    uint64_t reserved;
+};
+
+struct xdma_pdata {
+    uint32_t cmdq_addr;
+    uint32_t cmdq_endp;
+    uint32_t cmdq_writep;
+    uint32_t cmdq_readp;
+    uint32_t ctrl;
+    uint32_t status;
+    uint32_t us_comp;
+    /* The queue pointers count in units of 32 / units bytes */
+    unsigned int units;
+    uint32_t scu_pcie_config;
+    uint32_t scu_reset;
+    uint32_t gmp_xdma_mask;
+    uint32_t dram_start;
+    void (*encode)(struct xdma_cmd *cmd, uint64_t host, uint32_t bmc,
+                   uint32_t len, bool irq);
+};
+
+struct xdma {
+    struct ahb ahb;
+    struct p2ab p2ab;
+    const struct xdma_pdata *pdata;
+    uint32_t cmdq;
+    unsigned int idx;
+    /* The engine's state before we took it over */
+    uint32_t saved_cmdq;
+    uint32_t saved_endp;
+    uint32_t saved_ctrl;
+    int fd;
+    void *buf;
+    uint64_t buf_phys;
+    size_t buf_len;
+    size_t batch;
+};
+
+static void ast2500_xdma_encode(struct xdma_cmd *cmd, uint64_t host,
+                                uint32_t bmc, uint32_t len, bool irq)
+{
+    uint64_t val;
+
+    cmd->host_addr = htole64(host);
+    cmd->pitch = htole64(AST2500_XDMA_CMD_PITCH_UPSTREAM |
+                         (bmc & AST2500_XDMA_CMD_PITCH_ADDR) |
+                         AST2500_XDMA_CMD_PITCH_HOST(1) |
+                         AST2500_XDMA_CMD_PITCH_BMC(1) |
+                         AST2500_XDMA_CMD_PITCH_ID);
+
+    val = AST2500_XDMA_CMD_LINE_NO(1) | AST2500_XDMA_CMD_LINE_SIZE(len) |
+          AST2500_XDMA_CMD_ID;
+    if (irq)
+        val |= AST2500_XDMA_CMD_IRQ_EN | AST2500_XDMA_CMD_IRQ_BMC;
+    cmd->cmd = htole64(val);
+    cmd->reserved = 0;
+}
+
+static void ast2600_xdma_encode(struct xdma_cmd *cmd, uint64_t host,
+                                uint32_t bmc, uint32_t len, bool irq)
+{
+    uint64_t val;
+
+    cmd->host_addr = htole64(host);
+    cmd->pitch = htole64((bmc & AST2600_XDMA_CMD_PITCH_ADDR) |
+                         AST2600_XDMA_CMD_PITCH_HOST(1) |
+                         AST2600_XDMA_CMD_PITCH_BMC(1));
+
+    val = AST2600_XDMA_CMD_UPSTREAM | AST2600_XDMA_CMD_LINE_NO(1) |
+          AST2600_XDMA_CMD_LINE_SIZE(len);
+    if (host >> 32)
+        val |= AST2600_XDMA_CMD_64_EN;
+    if (irq)
+        val |= AST2600_XDMA_CMD_IRQ_BMC;
+    cmd->cmd = htole64(val);
+    cmd->reserved = 0;
+}
+
+static const struct xdma_pdata ast2500_xdma_pdata = {
+    .cmdq_addr = XDMA_BASE | 0x10,
+    .cmdq_endp = XDMA_BASE | 0x14,
+    .cmdq_writep = XDMA_BASE | 0x18,
+    .cmdq_readp = XDMA_BASE | 0x1c,
+    .ctrl = XDMA_BASE | 0x20,
+    .status = XDMA_BASE | 0x24,
+    .us_comp = BIT(4),
+    .units = 4,
+    .scu_pcie_config = AST_SCU_PCIE_CONFIG_G5,
+    .scu_reset = AST_SCU_RESET_G5,
+    .gmp_xdma_mask = BIT(17),
+    .dram_start = 0x80000000,
+    .encode = ast2500_xdma_encode,
+};
+
+static const struct xdma_pdata ast2600_xdma_pdata = {
+    .cmdq_addr = XDMA_BASE | 0x14,
+    .cmdq_endp = XDMA_BASE | 0x18,
+    .cmdq_writep = XDMA_BASE | 0x1c,
+    .cmdq_readp = XDMA_BASE | 0x20,
+    .ctrl = XDMA_BASE | 0x38,
+    .status = XDMA_BASE | 0x3c,
+    .us_comp = BIT(16),
+    .units = 2,
+    .scu_pcie_config = AST_SCU_PCIE_CONFIG_G6,
+    .scu_reset = AST_SCU_RESET_G6,
+    .gmp_xdma_mask = BIT(18) | BIT(25),
+    .dram_start = 0x80000000,
+    .encode = ast2600_xdma_encode,
+};
+
+static inline struct ahb *xdma_p2a(struct xdma *ctx)
+{
+    return p2ab_as_ahb(&ctx->p2ab);
+}
+
+static uint64_t xdma_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Writes the commands into the queue, wrapping at its end */
+static int xdma_queue(struct xdma *ctx, const struct xdma_cmd *cmds, size_t n)
+{
+    size_t chunk;
+    ssize_t rc;
+
+    while (n) {
+        chunk = MIN(n, XDMA_NR_CMDS - ctx->idx);
+        rc = p2ab_write(xdma_p2a(ctx),
+                        ctx->cmdq + ctx->idx * sizeof(*cmds), cmds,
+                        chunk * sizeof(*cmds));
+        if (rc < 0)
+            return rc;
+
+        ctx->idx = (ctx->idx + chunk) % XDMA_NR_CMDS;
+        cmds += chunk;
+        n -= chunk;
+    }
+
+    return 0;
+}
+
+/* Copies @len bytes at @bmc into the start of the host buffer */
+static int xdma_transfer(struct xdma *ctx, uint32_t bmc, size_t len)
+{
+    const struct xdma_pdata *pdata = ctx->pdata;
+    struct xdma_cmd cmds[XDMA_NR_CMDS];
+    uint64_t deadline;
+    size_t off, n;
+    uint32_t val;
+    int rc;
+
+    for (n = 0, off = 0; off < len; n++, off += XDMA_CMD_LEN) {
+        pdata->encode(&cmds[n], ctx->buf_phys + off, bmc + off,
+                      MIN(len - off, XDMA_CMD_LEN),
+                      off + XDMA_CMD_LEN >= len);
+    }
+
+    if ((rc = p2ab_writel(xdma_p2a(ctx), pdata->status, pdata->us_comp)) < 0)
+        return rc;
+
+    if ((rc = xdma_queue(ctx, cmds, n)) < 0)
+        return rc;
+
+    rc = p2ab_writel(xdma_p2a(ctx), pdata->cmdq_writep, ctx->idx * pdata->units);
+    if (rc < 0)
+        return rc;
+
+    /* Only the last command of the batch raises the completion status */
+    deadline = xdma_now() + XDMA_TIMEOUT_NS;
+    do {
+        if ((rc = p2ab_readl(xdma_p2a(ctx), pdata->status, &val)) < 0)
+            return rc;
+
+        if (val & pdata->us_comp)
+            return p2ab_writel(xdma_p2a(ctx), pdata->status, pdata->us_comp);
+    } while (xdma_now() < deadline);
+
+    loge("Timed out waiting for X-DMA of 0x%zx bytes from 0x%08" PRIx32 "\n",
+         len, bmc);
+
+    return -ETIMEDOUT;
+}
+
+static ssize_t xdma_read(struct ahb *ahb, uint32_t phys, void *buf, size_t len)
+{
+    struct xdma *ctx = to_xdma(ahb);
+    uint64_t start, end, cursor;
+    size_t chunk, skip;
+    uint8_t *dst = buf;
+    int rc;
+
+    if (phys < ctx->pdata->dram_start)
+        return p2ab_read(xdma_p2a(ctx), phys, buf, len);
+
+    /* The engine moves 16-byte aligned blocks, the slack is dropped */
+    cursor = phys;
+    end = (uint64_t)phys + len;
+    while (cursor < end) {
+        start = cursor & ~(uint64_t)(XDMA_ALIGN - 1);
+        chunk = MIN(end - start, ctx->batch);
+        chunk = (chunk + XDMA_ALIGN - 1) & ~(size_t)(XDMA_ALIGN - 1);
+        if (start + chunk > (1ULL << 32))
+            chunk = (1ULL << 32) - start;
+
+        if ((rc = xdma_transfer(ctx, start, chunk)) < 0)
+            return rc;
+
+        skip = cursor - start;
+        chunk = MIN(chunk - skip, end - cursor);
+        memcpy(dst, (uint8_t *)ctx->buf + skip, chunk);
+
+        dst += chunk;
+        cursor += chunk;
+    }
+
+    return len;
+}
+
+static ssize_t xdma_write(struct ahb *ahb, uint32_t phys, const void *buf,
+                          size_t len)
+{
+    return p2ab_write(xdma_p2a(to_xdma(ahb)), phys, buf, len);
+}
+
+static int xdma_readl(struct ahb *ahb, uint32_t phys, uint32_t *val)
+{
+    return p2ab_readl(xdma_p2a(to_xdma(ahb)), phys, val);
+}
+
+static int xdma_writel(struct ahb *ahb, uint32_t phys, uint32_t val)
+{
+    return p2ab_writel(xdma_p2a(to_xdma(ahb)), phys, val);
+}
+
+static const struct ahb_ops xdma_ahb_ops = {
+    .read = xdma_read,
+    .write = xdma_write,
+    .readl = xdma_readl,
+    .writel = xdma_writel,
+};
+
+static struct ahb *xdma_driver_probe(int argc, char *argv[]);
+static void xdma_driver_destroy(struct ahb *ahb);
+static int xdma_driver_reinit(struct ahb *ahb);
+
+static struct bridge_driver xdma_driver = {
+    .name = "xdma",
+    .probe = xdma_driver_probe,
+    .destroy = xdma_driver_destroy,
+    .reinit = xdma_driver_reinit,
+    .bus = "pcie",
+    .priority = 10,
+    .caps = {
+        .window = 0x10000,
+        .burst = (2 << 20),
+        .subword = true,
+        .mmio_width = 8,
+        .op_ns = 1000,
+        .byte_ps = 2500,
+    },
+};
+REGISTER_BRIDGE_DRIVER(xdma_driver);
+
+static int xdma_read_sysfs(const char *name, const char *attr, uint64_t *val)
+{
+    static const char *classes[] = { "u-dma-buf", "udmabuf" };
+    char path[128], buf[32];
+    ssize_t len;
+    size_t i;
+    int fd;
+
+    for (i = 0; i < ARRAY_SIZE(classes); i++) {
+        snprintf(path, sizeof(path), "/sys/class/%s/%s/%s", classes[i], name,
+                 attr);
+        if ((fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+            break;
+    }
+
+    if (fd < 0)
+        return -errno;
+
+    len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len < 0)
+        return -errno;
+
+    buf[len] = '\0';
+    errno = 0;
+    *val = strtoull(buf, NULL, 0);
+
+    return errno ? -errno : 0;
+}
+
+static void xdma_set_batch(struct xdma *ctx)
+{
+    ctx->batch = MIN(ctx->buf_len, (XDMA_NR_CMDS - 1) * XDMA_CMD_LEN);
+    ctx->batch &= ~(size_t)(XDMA_CMD_LEN - 1);
+}
+
+/* Under vfio the buffer needn't be contiguous, the IOMMU makes it so */
+static int xdma_init_vfio_buf(struct xdma *ctx)
+{
+    ctx->fd = -1;
+    ctx->buf_len = (XDMA_NR_CMDS - 1) * XDMA_CMD_LEN;
+    ctx->buf = pci_dma_alloc(ctx->p2ab.bdf, AST_PCI_VID, AST_PCI_DID_VGA,
+                             ctx->buf_len, &ctx->buf_phys);
+    if (!ctx->buf)
+        return -errno;
+
+    xdma_set_batch(ctx);
+
+    return 0;
+}
+
+static int xdma_init_buf(struct xdma *ctx, const char *name)
+{
+    char path[64];
+    uint64_t len;
+    int rc;
+
+    if (!strcmp(name, "vfio"))
+        return xdma_init_vfio_buf(ctx);
+
+    if ((rc = xdma_read_sysfs(name, "phys_addr", &ctx->buf_phys)) < 0 ||
+            (rc = xdma_read_sysfs(name, "size", &len)) < 0) {
+        logd("Failed to find u-dma-buf device %s: %d\n", name, rc);
+        return rc;
+    }
+
+    if (len < XDMA_CMD_LEN || (ctx->buf_phys & (XDMA_ALIGN - 1)))
+        return -EINVAL;
+
+    snprintf(path, sizeof(path), "/dev/%s", name);
+    if ((ctx->fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+        return -errno;
+
+    ctx->buf = mmap(NULL, len, PROT_READ, MAP_SHARED, ctx->fd, 0);
+    if (ctx->buf == MAP_FAILED) {
+        rc = -errno;
+        close(ctx->fd);
+        return rc;
+    }
+
+    ctx->buf_len = len;
+    xdma_set_batch(ctx);
+
+    return 0;
+}
+
+static void xdma_destroy_buf(struct xdma *ctx)
+{
+    if (ctx->fd < 0) {
+        pci_dma_free(ctx->buf, ctx->buf_len, ctx->buf_phys);
+        return;
+    }
+
+    munmap(ctx->buf, ctx->buf_len);
+    close(ctx->fd);
+}
+
+/* The engine has to be out of reset and mastering as the VGA device */
+static int xdma_check_engine(struct xdma *ctx)
+{
+    const struct xdma_pdata *pdata = ctx->pdata;
+    uint32_t val;
+    int rc;
+
+    if ((rc = p2ab_readl(xdma_p2a(ctx), pdata->scu_reset, &val)) < 0)
+        return rc;
+
+    if (val & AST_SCU_RESET_XDMA) {
+        logd("The X-DMA engine is held in reset\n");
+        return -ENODEV;
+    }
+
+    if ((rc = p2ab_readl(xdma_p2a(ctx), pdata->scu_pcie_config, &val)) < 0)
+        return rc;
+
+    if (!(val & AST_SCU_PCIE_CONFIG_VGA_XDMA)) {
+        logd("X-DMA is disabled for the VGA device\n");
+        return -ENODEV;
+    }
+
+    if ((rc = p2ab_readl(xdma_p2a(ctx), AST_SDMC_GMP, &val)) < 0)
+        return rc;
+
+    if (val & pdata->gmp_xdma_mask) {
+        logd("X-DMA is constrained to the VGA memory\n");
+        return -EPERM;
+    }
+
+    return 0;
+}
+
+/* Points the engine at our queue, remembering how the BMC had it set up */
+static int xdma_init_engine(struct xdma *ctx)
+{
+    const struct xdma_pdata *pdata = ctx->pdata;
+    struct ahb *p2a = xdma_p2a(ctx);
+    int rc;
+
+    if ((rc = p2ab_readl(p2a, pdata->cmdq_addr, &ctx->saved_cmdq)) < 0 ||
+            (rc = p2ab_readl(p2a, pdata->cmdq_endp, &ctx->saved_endp)) < 0 ||
+            (rc = p2ab_readl(p2a, pdata->ctrl, &ctx->saved_ctrl)) < 0)
+        return rc;
+
+    ctx->idx = 0;
+
+    if ((rc = p2ab_writel(p2a, pdata->cmdq_endp,
+                          XDMA_NR_CMDS * pdata->units)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->cmdq_readp,
+                              XDMA_CMDQ_READP_RESET)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->cmdq_writep, 0)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->ctrl,
+                              ctx->saved_ctrl | pdata->us_comp)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->cmdq_addr, ctx->cmdq)) < 0)
+        return rc;
+
+    return 0;
+}
+
+/*
+ * The BMC's own queue can't be resumed where it left off, so it's handed back
+ * empty.
+ */
+static void xdma_restore_engine(struct xdma *ctx)
+{
+    const struct xdma_pdata *pdata = ctx->pdata;
+    struct ahb *p2a = xdma_p2a(ctx);
+    int rc;
+
+    if ((rc = p2ab_writel(p2a, pdata->cmdq_endp, ctx->saved_endp)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->cmdq_readp,
+                              XDMA_CMDQ_READP_RESET)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->cmdq_writep, 0)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->ctrl, ctx->saved_ctrl)) < 0 ||
+            (rc = p2ab_writel(p2a, pdata->cmdq_addr, ctx->saved_cmdq)) < 0)
+        loge("Failed to restore the X-DMA engine: %d\n", rc);
+}
+
+/*
+ * Takes "xdma QUEUE [BUFFER]" as the interface, where QUEUE is the address of
+ * a free, page-aligned 4KiB of BMC DRAM for the command queue and BUFFER names
+ * the u-dma-buf device to copy into, by default udmabuf0. The buffer's
+ * physical address is handed to the engine as is, so the host's IOMMU must
+ * leave the VGA device untranslated. A BUFFER of "vfio" instead maps one
+ * through the IOMMU, with --vfio.
+ */
+static struct ahb *xdma_driver_probe(int argc, char *argv[])
+{
+    const char *buf = "udmabuf0";
+    unsigned long cmdq;
+    struct xdma *ctx;
+    int64_t rev;
+    char *end;
+    int rc;
+
+    if (argc < 2 || argc > 3 || strcmp(argv[0], "xdma"))
+        return NULL;
+
+    errno = 0;
+    cmdq = strtoul(argv[1], &end, 0);
+    if (errno || end == argv[1] || *end || cmdq > UINT32_MAX ||
+            (cmdq & (XDMA_CMDQ_LEN - 1))) {
+        loge("Invalid X-DMA queue address '%s'\n", argv[1]);
+        return NULL;
+    }
+
+    if (argc == 3)
+        buf = argv[2];
+
+    if (!(ctx = malloc(sizeof(*ctx))))
+        return NULL;
+
+    ctx->cmdq = cmdq;
+
+    if ((rc = p2ab_init(&ctx->p2ab, NULL, AST_PCI_VID, AST_PCI_DID_VGA)) < 0) {
+        logd("Failed to initialise P2A bridge for X-DMA: %d\n", rc);
+        goto cleanup_ctx;
+    }
+
+    if ((rc = p2ab_probe(&ctx->p2ab)) < 0) {
+        logd("Failed P2A probe for X-DMA: %d\n", rc);
+        goto cleanup_p2ab;
+    }
+
+    if ((rev = rev_probe(xdma_p2a(ctx))) < 0) {
+        rc = rev;
+        goto cleanup_p2ab;
+    }
+
+    if (rev_is_generation(rev, ast_g5)) {
+        ctx->pdata = &ast2500_xdma_pdata;
+    } else if (rev_is_generation(rev, ast_g6)) {
+        ctx->pdata = &ast2600_xdma_pdata;
+    } else {
+        logd("X-DMA is unsupported on the %s\n", rev_name(rev));
+        goto cleanup_p2ab;
+    }
+
+    if (ctx->cmdq < ctx->pdata->dram_start) {
+        loge("The X-DMA queue must be in DRAM\n");
+        goto cleanup_p2ab;
+    }
+
+    if ((rc = xdma_check_engine(ctx)) < 0)
+        goto cleanup_p2ab;
+
+    if ((rc = xdma_init_buf(ctx, buf)) < 0) {
+        loge("Failed to map X-DMA buffer %s: %d\n", buf, rc);
+        goto cleanup_p2ab;
+    }
+
+    if ((rc = xdma_init_engine(ctx)) < 0) {
+        loge("Failed to configure the X-DMA engine: %d\n", rc);
+        goto cleanup_buf;
+    }
+
+    logd("X-DMA copies up to 0x%zx bytes at a time into 0x%" PRIx64 "\n",
+         ctx->batch, ctx->buf_phys);
+
+    ahb_init_ops(&ctx->ahb, &xdma_driver, &xdma_ahb_ops);
+    p2ab_arbitrate(&ctx->p2ab, &ctx->ahb);
+
+    return &ctx->ahb;
+
+cleanup_buf:
+    xdma_destroy_buf(ctx);
+
+cleanup_p2ab:
+    p2ab_destroy(&ctx->p2ab);
+
+cleanup_ctx:
+    free(ctx);
+
+    return NULL;
+}
+
+static void xdma_driver_destroy(struct ahb *ahb)
+{
+    struct xdma *ctx = to_xdma(ahb);
+    int rc;
+
+    xdma_restore_engine(ctx);
+    xdma_destroy_buf(ctx);
+
+    if ((rc = p2ab_destroy(&ctx->p2ab)) < 0)
+        loge("Failed to destroy P2A bridge: %d\n", rc);
+
+    free(ctx);
+}
+
+/* The engine's registers are reached through the P2A window */
+static int xdma_driver_reinit(struct ahb *ahb)
+{
+    return ahb_reinit_bridge(xdma_p2a(to_xdma(ahb)));
+}
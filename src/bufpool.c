@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+
+#include "bufpool.h"
+#include "log.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#define BUFPOOL_HUGE        (2UL << 20)
+/* Enough for the deepest pipeline's buffers and a spare set */
+#define BUFPOOL_CACHED      16
+
+struct bufpool_entry {
+    void *buf;
+    size_t size;
+};
+
+static pthread_mutex_t bufpool_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct bufpool_entry bufpool_free[BUFPOOL_CACHED];
+static unsigned int bufpool_nr_free;
+static bool bufpool_hugepages;
+
+void bufpool_enable_hugepages(void)
+{
+    bufpool_hugepages = true;
+}
+
+static size_t bufpool_round(size_t size)
+{
+    size_t align = size >= BUFPOOL_HUGE ? BUFPOOL_HUGE : (size_t)sysconf(_SC_PAGE_SIZE);
+
+    return (size + align - 1) & ~(align - 1);
+}
+
+static void *bufpool_map(size_t size)
+{
+    void *buf;
+
+    if (bufpool_hugepages && size >= BUFPOOL_HUGE) {
+        buf = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (buf != MAP_FAILED)
+            return buf;
+
+        logd("No huge pages for a %zu byte buffer, using normal pages\n", size);
+    }
+
+    buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+               -1, 0);
+    if (buf == MAP_FAILED)
+        return NULL;
+
+    if (size >= BUFPOOL_HUGE)
+        madvise(buf, size, MADV_HUGEPAGE);
+
+    return buf;
+}
+
+void *bufpool_get(size_t size)
+{
+    unsigned int i;
+    void *buf;
+
+    if (!size)
+        return NULL;
+
+    size = bufpool_round(size);
+
+    pthread_mutex_lock(&bufpool_lock);
+    for (i = 0; i < bufpool_nr_free; i++) {
+        if (bufpool_free[i].size == size) {
+            buf = bufpool_free[i].buf;
+            bufpool_free[i] = bufpool_free[--bufpool_nr_free];
+            pthread_mutex_unlock(&bufpool_lock);
+            return buf;
+        }
+    }
+    pthread_mutex_unlock(&bufpool_lock);
+
+    return bufpool_map(size);
+}
+
+void bufpool_put(void *buf, size_t size)
+{
+    if (!buf)
+        return;
+
+    size = bufpool_round(size);
+
+    pthread_mutex_lock(&bufpool_lock);
+    if (bufpool_nr_free < BUFPOOL_CACHED) {
+        bufpool_free[bufpool_nr_free].buf = buf;
+        bufpool_free[bufpool_nr_free].size = size;
+        bufpool_nr_free++;
+        buf = NULL;
+    }
+    pthread_mutex_unlock(&bufpool_lock);
+
+    if (buf)
+        munmap(buf, size);
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _BUFPOOL_H
+#define _BUFPOOL_H
+
+#include <stddef.h>
+
+/*
+ * Page-aligned transfer buffers shared by the pipelines and commands, so a
+ * batch of commands or a resumed dump reuses the same pages rather than
+ * faulting in fresh ones for each transfer. The alignment suits O_DIRECT.
+ * Buffers are returned with the size they were taken with. Large buffers are
+ * backed by huge pages once bufpool_enable_hugepages() is called, if the
+ * system has them reserved, and otherwise by transparent huge pages where the
+ * kernel is willing.
+ */
+void *bufpool_get(size_t size);
+void bufpool_put(void *buf, size_t size);
+
+void bufpool_enable_hugepages(void);
+
+#endif
@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include "bridge/p2a.h"
+#include "cache.h"
+#include "crc32.h"
+#include "log.h"
+#include "pci.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define CACHE_MAX_FIELDS    16
+#define CACHE_NAME_LEN      32
+#define CACHE_VALUE_LEN     64
+
+struct cache_field {
+    char name[CACHE_NAME_LEN];
+    char value[CACHE_VALUE_LEN];
+};
+
+struct cache {
+    char *path;
+    char key[9];
+    bool selected;
+    /* Entries for other hosts, carried through verbatim on save */
+    char **others;
+    size_t nr_others;
+    struct cache_field fields[CACHE_MAX_FIELDS];
+    size_t nr_fields;
+};
+
+static struct cache cache;
+
+static int cache_default_path(char **path)
+{
+    const char *base = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int rc;
+
+    if (base && *base)
+        rc = asprintf(path, "%s/culvert/probe", base);
+    else if (home && *home)
+        rc = asprintf(path, "%s/.cache/culvert/probe", home);
+    else
+        return -ENOENT;
+
+    return rc < 0 ? -ENOMEM : 0;
+}
+
+int cache_enable(const char *path)
+{
+    free(cache.path);
+
+    if (!path)
+        return cache_default_path(&cache.path);
+
+    return (cache.path = strdup(path)) ? 0 : -ENOMEM;
+}
+
+bool cache_enabled(void)
+{
+    return !!cache.path;
+}
+
+static void cache_reset(void)
+{
+    size_t i;
+
+    for (i = 0; i < cache.nr_others; i++)
+        free(cache.others[i]);
+    free(cache.others);
+
+    cache.others = NULL;
+    cache.nr_others = 0;
+    cache.nr_fields = 0;
+    cache.selected = false;
+}
+
+static void cache_parse_fields(char *line)
+{
+    char *tok, *save, *eq;
+
+    for (tok = strtok_r(line, " \n", &save); tok;
+         tok = strtok_r(NULL, " \n", &save)) {
+        struct cache_field *field;
+
+        if (!(eq = strchr(tok, '=')) || cache.nr_fields == CACHE_MAX_FIELDS)
+            continue;
+
+        *eq = '\0';
+        field = &cache.fields[cache.nr_fields++];
+        snprintf(field->name, sizeof(field->name), "%s", tok);
+        snprintf(field->value, sizeof(field->value), "%s", eq + 1);
+    }
+}
+
+static int cache_load(void)
+{
+    char *line = NULL;
+    size_t len = 0;
+    char **others;
+    FILE *file;
+
+    if (!(file = fopen(cache.path, "r")))
+        return errno == ENOENT ? 0 : -errno;
+
+    while (getline(&line, &len, file) > 0) {
+        if (!strncmp(line, cache.key, sizeof(cache.key) - 1) &&
+            line[sizeof(cache.key) - 1] == ' ') {
+            cache_parse_fields(line + sizeof(cache.key));
+            continue;
+        }
+
+        others = realloc(cache.others,
+                         (cache.nr_others + 1) * sizeof(*cache.others));
+        if (!others)
+            break;
+
+        cache.others = others;
+        if (!(cache.others[cache.nr_others] = strdup(line)))
+            break;
+        cache.nr_others++;
+    }
+
+    free(line);
+    fclose(file);
+
+    return 0;
+}
+
+static int cache_mkdirs(const char *path)
+{
+    char *dir, *sep;
+    int rc = 0;
+
+    if (!(dir = strdup(path)))
+        return -ENOMEM;
+
+    for (sep = strchr(dir + 1, '/'); sep; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        if (mkdir(dir, 0700) && errno != EEXIST) {
+            rc = -errno;
+            break;
+        }
+        *sep = '/';
+    }
+
+    free(dir);
+
+    return rc;
+}
+
+static void cache_save(void)
+{
+    FILE *file;
+    char *tmp;
+    size_t i;
+
+    if (!cache.selected)
+        return;
+
+    if (cache_mkdirs(cache.path) < 0 ||
+        asprintf(&tmp, "%s.%d", cache.path, getpid()) < 0)
+        return;
+
+    if (!(file = fopen(tmp, "w")))
+        goto cleanup_tmp;
+
+    for (i = 0; i < cache.nr_others; i++)
+        fputs(cache.others[i], file);
+
+    if (cache.nr_fields) {
+        fputs(cache.key, file);
+        for (i = 0; i < cache.nr_fields; i++)
+            fprintf(file, " %s=%s", cache.fields[i].name,
+                    cache.fields[i].value);
+        fputc('\n', file);
+    }
+
+    if (fclose(file) || rename(tmp, cache.path)) {
+        logd("Failed to update probe cache '%s': %s\n", cache.path,
+             strerror(errno));
+        unlink(tmp);
+    }
+
+cleanup_tmp:
+    free(tmp);
+}
+
+int cache_select(int argc, char *argv[])
+{
+    char host[256], topology[512];
+    uint32_t crc;
+    int i, rc;
+
+    if (!cache.path)
+        return 0;
+
+    cache_reset();
+
+    if (gethostname(host, sizeof(host)))
+        return -errno;
+    host[sizeof(host) - 1] = '\0';
+
+    if (pci_describe(AST_PCI_VID, topology, sizeof(topology)) < 0)
+        topology[0] = '\0';
+
+    crc = crc32_update(0, host, strlen(host) + 1);
+    crc = crc32_update(crc, topology, strlen(topology) + 1);
+    for (i = 0; i < argc; i++)
+        crc = crc32_update(crc, argv[i], strlen(argv[i]) + 1);
+
+    snprintf(cache.key, sizeof(cache.key), "%08" PRIx32, crc);
+
+    if ((rc = cache_load()) < 0) {
+        logd("Failed to load probe cache '%s': %d\n", cache.path, rc);
+        cache_reset();
+        return rc;
+    }
+
+    cache.selected = true;
+
+    return 0;
+}
+
+static struct cache_field *cache_find(const char *name)
+{
+    size_t i;
+
+    for (i = 0; i < cache.nr_fields; i++) {
+        if (!strcmp(cache.fields[i].name, name))
+            return &cache.fields[i];
+    }
+
+    return NULL;
+}
+
+const char *cache_get(const char *name)
+{
+    struct cache_field *field;
+
+    if (!cache.selected || !(field = cache_find(name)))
+        return NULL;
+
+    return field->value;
+}
+
+void cache_set(const char *name, const char *fmt, ...)
+{
+    struct cache_field *field;
+    char value[CACHE_VALUE_LEN];
+    va_list args;
+
+    if (!cache.selected)
+        return;
+
+    va_start(args, fmt);
+    vsnprintf(value, sizeof(value), fmt, args);
+    va_end(args);
+
+    if (!(field = cache_find(name))) {
+        if (cache.nr_fields == CACHE_MAX_FIELDS)
+            return;
+
+        field = &cache.fields[cache.nr_fields++];
+        snprintf(field->name, sizeof(field->name), "%s", name);
+    } else if (!strcmp(field->value, value)) {
+        return;
+    }
+
+    snprintf(field->value, sizeof(field->value), "%s", value);
+
+    cache_save();
+}
+
+void cache_invalidate(const char *name)
+{
+    struct cache_field *field;
+
+    if (!cache.selected || !(field = cache_find(name)))
+        return;
+
+    *field = cache.fields[--cache.nr_fields];
+
+    cache_save();
+}
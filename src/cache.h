@@ -0,0 +1,27 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _CACHE_H
+#define _CACHE_H
+
+#include <stdbool.h>
+
+/*
+ * An opt-in on-disk record of what worked on previous runs against the same
+ * BMC: the bridge, the SoC revision and flash controller calibration. Entries
+ * are keyed by hostname, the BMC's PCI functions and the bridge arguments.
+ * Everything read from the cache is a hint, callers must verify it.
+ */
+
+/* @path may be NULL for the default under $XDG_CACHE_HOME */
+int cache_enable(const char *path);
+bool cache_enabled(void);
+
+/* Selects the entry for the current host and bridge arguments */
+int cache_select(int argc, char *argv[]);
+
+const char *cache_get(const char *name);
+void cache_set(const char *name, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+void cache_invalidate(const char *name);
+
+#endif
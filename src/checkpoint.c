@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include "checkpoint.h"
+#include "crc32.h"
+#include "log.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define CHECKPOINT_MAGIC    "culvert-checkpoint"
+#define CHECKPOINT_VERSION  1
+#define CHECKPOINT_BUF      (64 << 10)
+
+size_t checkpoint_done_bytes(struct checkpoint *ctx)
+{
+    size_t done = ctx->done * ctx->extent;
+
+    return done > ctx->len ? ctx->len : done;
+}
+
+size_t checkpoint_extent_len(struct checkpoint *ctx, size_t index)
+{
+    size_t start = index * ctx->extent;
+
+    if (start >= ctx->len)
+        return 0;
+
+    return (ctx->len - start) > ctx->extent ? ctx->extent : ctx->len - start;
+}
+
+static int checkpoint_crc_extent(struct checkpoint *ctx, size_t index,
+                                 uint32_t *crc)
+{
+    size_t len = checkpoint_extent_len(ctx, index);
+    off_t offset = ctx->offset + index * ctx->extent;
+    ssize_t ingress;
+    void *buf;
+
+    if (!(buf = malloc(CHECKPOINT_BUF)))
+        return -ENOMEM;
+
+    *crc = 0;
+    while (len) {
+        ingress = pread(ctx->datafd, buf,
+                        len > CHECKPOINT_BUF ? CHECKPOINT_BUF : len, offset);
+        if (ingress <= 0) {
+            free(buf);
+            return ingress < 0 ? -errno : -ENODATA;
+        }
+
+        *crc = crc32_update(*crc, buf, ingress);
+        offset += ingress;
+        len -= ingress;
+    }
+
+    free(buf);
+
+    return 0;
+}
+
+static int checkpoint_write_header(struct checkpoint *ctx)
+{
+    if (fprintf(ctx->file, "%s %d %#" PRIx32 " %zu %zu %jd\n", CHECKPOINT_MAGIC,
+                CHECKPOINT_VERSION, ctx->phys, ctx->len, ctx->extent,
+                (intmax_t)ctx->offset) < 0)
+        return -EIO;
+
+    return 0;
+}
+
+static int checkpoint_sync(struct checkpoint *ctx)
+{
+    if (fflush(ctx->file) || fdatasync(fileno(ctx->file)))
+        return -errno;
+
+    return 0;
+}
+
+/* Adopts the extent size of a previous run of the same dump */
+static bool checkpoint_match(struct checkpoint *ctx, FILE *prev)
+{
+    size_t len, extent;
+    intmax_t offset;
+    uint32_t phys;
+    int version;
+
+    if (fscanf(prev, CHECKPOINT_MAGIC " %d %" SCNx32 " %zu %zu %jd\n",
+               &version, &phys, &len, &extent, &offset) != 5)
+        return false;
+
+    if (version != CHECKPOINT_VERSION || phys != ctx->phys ||
+        len != ctx->len || offset != ctx->offset || !extent) {
+        logi("Checkpoint describes a different dump, starting over\n");
+        return false;
+    }
+
+    ctx->extent = extent;
+
+    return true;
+}
+
+/* Carries over the leading extents of the previous run that still match */
+static int checkpoint_verify(struct checkpoint *ctx, FILE *prev)
+{
+    uint32_t crc, expected;
+    size_t index;
+    int rc;
+
+    while (fscanf(prev, "%zu %" SCNx32 "\n", &index, &expected) == 2) {
+        if (index != ctx->done || !checkpoint_extent_len(ctx, index))
+            break;
+
+        if ((rc = checkpoint_crc_extent(ctx, index, &crc)) == -ENOMEM)
+            return rc;
+
+        if (rc < 0 || crc != expected) {
+            logi("Extent %zu of the output doesn't match the checkpoint\n",
+                 index);
+            break;
+        }
+
+        if (fprintf(ctx->file, "%zu %08" PRIx32 "\n", index, crc) < 0)
+            return -EIO;
+
+        ctx->done++;
+    }
+
+    return 0;
+}
+
+int checkpoint_open(struct checkpoint *ctx, const char *path, int datafd,
+                    off_t offset, uint32_t phys, size_t len, size_t extent)
+{
+    bool resume = false;
+    FILE *prev;
+    char *tmp;
+    int rc;
+
+    ctx->datafd = datafd;
+    ctx->phys = phys;
+    ctx->len = len;
+    ctx->extent = extent;
+    ctx->offset = offset;
+    ctx->done = 0;
+
+    if ((prev = fopen(path, "r")))
+        resume = checkpoint_match(ctx, prev);
+    else if (errno != ENOENT)
+        return -errno;
+
+    /* Only the extents that verify are carried into the new checkpoint */
+    if (asprintf(&tmp, "%s.tmp", path) < 0) {
+        rc = -ENOMEM;
+        goto cleanup_prev;
+    }
+
+    if (!(ctx->file = fopen(tmp, "w"))) {
+        rc = -errno;
+        goto cleanup_tmp;
+    }
+
+    if ((rc = checkpoint_write_header(ctx)) < 0)
+        goto cleanup_file;
+
+    if (resume && (rc = checkpoint_verify(ctx, prev)) < 0)
+        goto cleanup_file;
+
+    if ((rc = checkpoint_sync(ctx)) < 0)
+        goto cleanup_file;
+
+    if (rename(tmp, path)) {
+        rc = -errno;
+        goto cleanup_file;
+    }
+
+    if (ctx->done)
+        logi("Resuming after %zu verified bytes\n", checkpoint_done_bytes(ctx));
+
+    free(tmp);
+    if (prev)
+        fclose(prev);
+
+    return 0;
+
+cleanup_file:
+    fclose(ctx->file);
+    unlink(tmp);
+
+cleanup_tmp:
+    free(tmp);
+
+cleanup_prev:
+    if (prev)
+        fclose(prev);
+
+    return rc;
+}
+
+void checkpoint_close(struct checkpoint *ctx)
+{
+    fclose(ctx->file);
+}
+
+int checkpoint_record(struct checkpoint *ctx)
+{
+    uint32_t crc;
+    int rc;
+
+    if (fdatasync(ctx->datafd))
+        return -errno;
+
+    if ((rc = checkpoint_crc_extent(ctx, ctx->done, &crc)) < 0)
+        return rc;
+
+    if (fprintf(ctx->file, "%zu %08" PRIx32 "\n", ctx->done, crc) < 0)
+        return -EIO;
+
+    if ((rc = checkpoint_sync(ctx)) < 0)
+        return rc;
+
+    ctx->done++;
+
+    return 0;
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _CHECKPOINT_H
+#define _CHECKPOINT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+/*
+ * Tracks the progress of a dump into a regular file as a sidecar list of
+ * completed extents and their checksums. Extents are recorded only once their
+ * data is durable in the output, so after an interruption the dump can resume
+ * from the first extent that doesn't verify.
+ */
+struct checkpoint {
+    FILE *file;
+    int datafd;
+    uint32_t phys;
+    size_t len;
+    size_t extent;
+    off_t offset;
+    size_t done;
+};
+
+/*
+ * @datafd must be readable and refer to the output file, with the dump
+ * starting at @offset. On success ctx->done holds the number of extents that
+ * were verified from a previous run.
+ */
+int checkpoint_open(struct checkpoint *ctx, const char *path, int datafd,
+                    off_t offset, uint32_t phys, size_t len, size_t extent);
+void checkpoint_close(struct checkpoint *ctx);
+
+/* Bytes already in place, and the length of the extent at @index */
+size_t checkpoint_done_bytes(struct checkpoint *ctx);
+size_t checkpoint_extent_len(struct checkpoint *ctx, size_t index);
+
+/* Flushes the next extent to stable storage and records its checksum */
+int checkpoint_record(struct checkpoint *ctx);
+
+#endif
@@ -0,0 +1,393 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "host.h"
+#include "log.h"
+#include "soc.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * A profile is lines of "NODE OFFSET MASK VALUE", setting the bits of MASK in
+ * the register OFFSET bytes into the devicetree node NODE to those of VALUE.
+ * NODE is a node name, alias or path as for the other commands. '#' starts a
+ * comment. Later lines for the same register take precedence over the bits
+ * they share with earlier ones.
+ */
+struct apply_entry {
+    char *node;
+    uint32_t offset;
+    uint32_t mask;
+    uint32_t value;
+    unsigned int line;
+    uint32_t phys;
+    uint32_t have;
+};
+
+struct apply_profile {
+    struct apply_entry *entries;
+    size_t count;
+    size_t alloc;
+};
+
+static void apply_profile_free(struct apply_profile *profile)
+{
+    size_t i;
+
+    for (i = 0; i < profile->count; i++)
+        free(profile->entries[i].node);
+
+    free(profile->entries);
+}
+
+static int apply_parse_u32(const char *str, uint32_t *val)
+{
+    unsigned long parsed;
+    char *endp;
+
+    errno = 0;
+    parsed = strtoul(str, &endp, 0);
+    if (errno || *endp || endp == str || parsed > UINT32_MAX)
+        return -EINVAL;
+
+    *val = parsed;
+
+    return 0;
+}
+
+static int apply_profile_load(struct apply_profile *profile, const char *path)
+{
+    unsigned int lineno = 0;
+    char *line = NULL;
+    size_t size = 0;
+    FILE *stream;
+    int rc = 0;
+
+    memset(profile, 0, sizeof(*profile));
+
+    if (!(stream = fopen(path, "r"))) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", path, rc);
+        return rc;
+    }
+
+    while (getline(&line, &size, stream) >= 0) {
+        char *fields[4], *save, *tok, *hash;
+        struct apply_entry *entry;
+        int n = 0;
+
+        lineno++;
+
+        if ((hash = strchr(line, '#')))
+            *hash = '\0';
+
+        for (tok = strtok_r(line, " \t\n", &save); tok;
+             tok = strtok_r(NULL, " \t\n", &save)) {
+            if (n < 4)
+                fields[n] = tok;
+            n++;
+        }
+
+        if (!n)
+            continue;
+
+        if (n != 4) {
+            loge("%s:%u: Expected NODE OFFSET MASK VALUE\n", path, lineno);
+            rc = -EINVAL;
+            break;
+        }
+
+        if (profile->count == profile->alloc) {
+            size_t alloc = profile->alloc ? 2 * profile->alloc : 32;
+            struct apply_entry *entries;
+
+            entries = realloc(profile->entries, alloc * sizeof(*entries));
+            if (!entries) {
+                rc = -ENOMEM;
+                break;
+            }
+
+            profile->entries = entries;
+            profile->alloc = alloc;
+        }
+
+        entry = &profile->entries[profile->count];
+        if (apply_parse_u32(fields[1], &entry->offset) < 0 ||
+                apply_parse_u32(fields[2], &entry->mask) < 0 ||
+                apply_parse_u32(fields[3], &entry->value) < 0) {
+            loge("%s:%u: Invalid number\n", path, lineno);
+            rc = -EINVAL;
+            break;
+        }
+
+        if (entry->offset & 3) {
+            loge("%s:%u: Register offset 0x%" PRIx32 " isn't word-aligned\n",
+                 path, lineno, entry->offset);
+            rc = -EINVAL;
+            break;
+        }
+
+        if (!(entry->node = strdup(fields[0]))) {
+            rc = -ENOMEM;
+            break;
+        }
+
+        entry->line = lineno;
+        profile->count++;
+    }
+
+    free(line);
+    fclose(stream);
+
+    if (rc < 0)
+        apply_profile_free(profile);
+
+    return rc;
+}
+
+/*
+ * Finds each entry's register, folding entries for the same one together.
+ * Binding the node's driver first lets it unlock the block, as the SCU's does.
+ */
+static int apply_profile_resolve(struct soc *soc, struct apply_profile *profile,
+                                 const char *path)
+{
+    struct soc_device_node dn;
+    struct soc_region region;
+    const char *node = NULL;
+    size_t i, j, n;
+    int rc;
+
+    for (i = 0, n = 0; i < profile->count; i++) {
+        struct apply_entry *entry = &profile->entries[i];
+
+        if (!node || strcmp(node, entry->node)) {
+            if ((rc = soc_device_from_name(soc, entry->node, &dn)) < 0) {
+                loge("%s:%u: No devicetree node '%s': %d\n", path, entry->line,
+                     entry->node, rc);
+                return rc;
+            }
+
+            if ((rc = soc_device_get_memory(soc, &dn, &region)) < 0) {
+                loge("%s:%u: No registers for '%s': %d\n", path, entry->line,
+                     entry->node, rc);
+                return rc;
+            }
+
+            soc_driver_get_drvdata_by_node(soc, &dn);
+            node = entry->node;
+        }
+
+        if (entry->offset > region.length - 4) {
+            loge("%s:%u: Offset 0x%" PRIx32 " is beyond '%s'\n", path,
+                 entry->line, entry->offset, entry->node);
+            return -ERANGE;
+        }
+
+        entry->phys = region.start + entry->offset;
+
+        for (j = 0; j < n; j++) {
+            struct apply_entry *prior = &profile->entries[j];
+
+            if (prior->phys != entry->phys)
+                continue;
+
+            prior->value = (prior->value & ~entry->mask) |
+                           (entry->value & entry->mask);
+            prior->mask |= entry->mask;
+            break;
+        }
+
+        if (j < n)
+            continue;
+
+        /* Keep the first line for each register, in the order given */
+        if (n != i) {
+            struct apply_entry tmp = profile->entries[n];
+
+            profile->entries[n] = *entry;
+            profile->entries[i] = tmp;
+
+            /* @node pointed into the entry just moved */
+            node = profile->entries[n].node;
+        }
+        n++;
+    }
+
+    /* After the loop the folded entries are in [n, count), free them */
+    for (i = n; i < profile->count; i++)
+        free(profile->entries[i].node);
+    profile->count = n;
+
+    return 0;
+}
+
+static int apply_snapshot(struct soc *soc, struct apply_profile *profile,
+                          struct ahb_iov *iov)
+{
+    ssize_t rc;
+    size_t i;
+
+    for (i = 0; i < profile->count; i++) {
+        iov[i].phys = profile->entries[i].phys;
+        iov[i].base = &profile->entries[i].have;
+        iov[i].len = sizeof(profile->entries[i].have);
+    }
+
+    if ((rc = soc_readv(soc, iov, profile->count)) < 0)
+        return rc;
+
+    return (size_t)rc == profile->count * 4 ? 0 : -EIO;
+}
+
+static inline uint32_t apply_want(const struct apply_entry *entry)
+{
+    return (entry->have & ~entry->mask) | (entry->value & entry->mask);
+}
+
+int cmd_apply(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct apply_profile profile;
+    size_t i, changes = 0;
+    bool dry_run = false;
+    struct ahb_iov *iov;
+    struct ahb *ahb;
+    int rc, commit;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "dry-run", no_argument, NULL, 'n' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "n", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'n':
+                dry_run = true;
+                break;
+            default:
+                return -EINVAL;
+        }
+    }
+
+    if (optind == argc) {
+        loge("Not enough arguments for apply command\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if ((rc = apply_profile_load(&profile, argv[optind])) < 0)
+        return rc;
+
+    if (!(iov = calloc(profile.count ? profile.count : 1, sizeof(*iov)))) {
+        rc = -ENOMEM;
+        goto cleanup_profile;
+    }
+
+    if ((rc = host_init(host, argc - optind - 1, argv + optind + 1)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        goto cleanup_iov;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0) {
+        loge("Failed to probe SoC: %d\n", rc);
+        goto cleanup_host;
+    }
+
+    if ((rc = apply_profile_resolve(soc, &profile, argv[optind])) < 0)
+        goto cleanup_soc;
+
+    if ((rc = apply_snapshot(soc, &profile, iov)) < 0) {
+        loge("Failed to read the profile's registers: %d\n", rc);
+        goto cleanup_soc;
+    }
+
+    for (i = 0; i < profile.count; i++) {
+        const struct apply_entry *entry = &profile.entries[i];
+
+        if (apply_want(entry) == entry->have)
+            continue;
+
+        logi("%s+0x%" PRIx32 " [0x%08" PRIx32 "]: 0x%08" PRIx32 " -> 0x%08"
+             PRIx32 "\n", entry->node, entry->offset, entry->phys, entry->have,
+             apply_want(entry));
+        changes++;
+    }
+
+    logi("%zu of %zu registers to change\n", changes, profile.count);
+
+    if (dry_run || !changes)
+        goto cleanup_soc;
+
+    /* Posted together in the order given, the profile may sequence them */
+    soc_txn_begin(soc);
+    for (i = 0; i < profile.count; i++) {
+        const struct apply_entry *entry = &profile.entries[i];
+
+        if (apply_want(entry) != entry->have &&
+                (rc = soc_writel(soc, entry->phys, apply_want(entry))) < 0)
+            break;
+    }
+    if ((commit = soc_txn_commit(soc)) < 0 && !rc)
+        rc = commit;
+    if (rc < 0) {
+        loge("Failed to apply the profile: %d\n", rc);
+        goto cleanup_soc;
+    }
+
+    /* What was wanted of each register before the writes */
+    for (i = 0; i < profile.count; i++)
+        profile.entries[i].value = apply_want(&profile.entries[i]);
+
+    if ((rc = apply_snapshot(soc, &profile, iov)) < 0) {
+        loge("Failed to read back the profile's registers: %d\n", rc);
+        goto cleanup_soc;
+    }
+
+    for (i = 0; i < profile.count; i++) {
+        const struct apply_entry *entry = &profile.entries[i];
+
+        if (!((entry->have ^ entry->value) & entry->mask))
+            continue;
+
+        loge("%s+0x%" PRIx32 " [0x%08" PRIx32 "]: read back 0x%08" PRIx32
+             ", expected 0x%08" PRIx32 " under mask 0x%08" PRIx32 "\n",
+             entry->node, entry->offset, entry->phys, entry->have,
+             entry->value, entry->mask);
+        rc = -EIO;
+    }
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+cleanup_iov:
+    free(iov);
+
+cleanup_profile:
+    apply_profile_free(&profile);
+
+    return rc;
+}
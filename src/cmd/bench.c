@@ -0,0 +1,1046 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "array.h"
+#include "async.h"
+#include "bridge.h"
+#include "bridge/debug.h"
+#include "compiler.h"
+#include "crc32.h"
+#include "fill.h"
+#include "flash.h"
+#include "host.h"
+#include "log.h"
+#include "mmio.h"
+#include "prompt.h"
+#include "search.h"
+#include "soc.h"
+#include "soc/sdmc.h"
+#include "soc/sfc.h"
+#include "tracedec.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* Rough time budget for each measurement, scaled by the bridge's costs */
+#define BENCH_BUDGET_NS     (2 * 1000 * 1000 * 1000ULL)
+#define BENCH_MIN_ITERS     8
+#define BENCH_MAX_ITERS     10000
+
+/* Distance between accesses in the window-crossing test */
+#define BENCH_STRIDE        (64 << 10)
+
+/* Requests kept in flight by the queued test */
+#define BENCH_QUEUE_DEPTH   16
+
+/* Time spent on each host-side kernel, and the data it works through per pass */
+#define BENCH_KERNEL_NS     (500 * 1000 * 1000ULL)
+#define BENCH_KERNEL_LEN    (1 << 20)
+
+/* Passes per flash read setting, and flash operations timed of each kind */
+#define BENCH_FLASH_READS   4
+#define BENCH_FLASH_POLLS   64
+#define BENCH_FLASH_ERASES  4
+#define BENCH_FLASH_PAGES   64
+
+/* The flash suite erases in 64K blocks at most, bar the whole chip */
+#define BENCH_FLASH_BLOCK   (64 << 10)
+
+static const size_t bench_sizes[] = { 4 << 10, 64 << 10, 1 << 20 };
+static const uint32_t bench_aligns[] = { 0, 1, 4 };
+
+struct bench_lat {
+    uint64_t min;
+    uint64_t max;
+    uint64_t total;
+    unsigned int iters;
+};
+
+static uint64_t bench_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static unsigned int bench_iters(const struct bridge_caps *caps, size_t len)
+{
+    uint64_t est = caps->op_ns + (len * (uint64_t)caps->byte_ps) / 1000;
+    uint64_t iters;
+
+    if (!est)
+        return BENCH_MAX_ITERS;
+
+    iters = BENCH_BUDGET_NS / est;
+    if (iters < BENCH_MIN_ITERS)
+        return BENCH_MIN_ITERS;
+
+    return iters > BENCH_MAX_ITERS ? BENCH_MAX_ITERS : iters;
+}
+
+/* Whether a transfer of @len is expected to complete within the budget */
+static bool bench_affordable(const struct bridge_caps *caps, size_t len)
+{
+    uint64_t est = caps->op_ns + (len * (uint64_t)caps->byte_ps) / 1000;
+
+    return est * BENCH_MIN_ITERS <= BENCH_BUDGET_NS;
+}
+
+static void bench_lat_init(struct bench_lat *lat)
+{
+    lat->min = UINT64_MAX;
+    lat->max = 0;
+    lat->total = 0;
+    lat->iters = 0;
+}
+
+static void bench_lat_add(struct bench_lat *lat, uint64_t ns)
+{
+    if (ns < lat->min)
+        lat->min = ns;
+    if (ns > lat->max)
+        lat->max = ns;
+    lat->total += ns;
+    lat->iters++;
+}
+
+static void bench_lat_print(const char *label, const struct bench_lat *lat)
+{
+    printf("  %-24s %8u %10.2f %10.2f %10.2f\n", label, lat->iters,
+           lat->min / 1000.0, (lat->total / 1000.0) / lat->iters,
+           lat->max / 1000.0);
+}
+
+struct bench_queue {
+    struct ahb_async async;
+    struct ahb_req reqs[BENCH_QUEUE_DEPTH];
+    struct bench_lat lat;
+    uint64_t last;
+    unsigned int remaining;
+    int rc;
+};
+
+static void bench_queue_complete(struct ahb_req *req)
+{
+    struct bench_queue *queue = req->priv;
+    uint64_t now = bench_now();
+    int rc;
+
+    if (req->rc < 0 && !queue->rc)
+        queue->rc = req->rc;
+
+    bench_lat_add(&queue->lat, now - queue->last);
+    queue->last = now;
+
+    if (!queue->remaining || queue->rc)
+        return;
+
+    queue->remaining--;
+    if ((rc = ahb_async_submit(&queue->async, req)) < 0)
+        queue->rc = rc;
+}
+
+/* Times between completions, what a word costs with the queue kept full */
+static int bench_queued(struct ahb *ahb, uint32_t base, unsigned int iters,
+                        struct bench_lat *lat)
+{
+    struct bench_queue queue = { 0 };
+    unsigned int i;
+    int rc;
+
+    if ((rc = ahb_async_init(&queue.async, ahb, BENCH_QUEUE_DEPTH)) < 0)
+        return rc;
+
+    bench_lat_init(&queue.lat);
+    queue.remaining = iters;
+    queue.last = bench_now();
+
+    for (i = 0; i < BENCH_QUEUE_DEPTH && queue.remaining; i++) {
+        queue.reqs[i].op = ahb_req_readl;
+        queue.reqs[i].phys = base;
+        queue.reqs[i].complete = bench_queue_complete;
+        queue.reqs[i].priv = &queue;
+
+        queue.remaining--;
+        if ((rc = ahb_async_submit(&queue.async, &queue.reqs[i])) < 0) {
+            queue.rc = rc;
+            break;
+        }
+    }
+
+    ahb_async_destroy(&queue.async);
+
+    *lat = queue.lat;
+
+    return queue.rc;
+}
+
+static int bench_word(struct ahb *ahb, uint32_t base)
+{
+    const struct bridge_caps *caps = ahb_bridge_caps(ahb);
+    struct bench_lat rd, wr, cross, queued;
+    unsigned int i, iters;
+    uint64_t start;
+    uint32_t val;
+    int rc;
+
+    iters = bench_iters(caps, 4);
+
+    bench_lat_init(&rd);
+    for (i = 0; i < iters; i++) {
+        start = bench_now();
+        if ((rc = ahb_readl(ahb, base, &val)) < 0)
+            return rc;
+        bench_lat_add(&rd, bench_now() - start);
+    }
+
+    bench_lat_init(&wr);
+    for (i = 0; i < iters; i++) {
+        start = bench_now();
+        if ((rc = ahb_writel(ahb, base, val)) < 0)
+            return rc;
+        bench_lat_add(&wr, bench_now() - start);
+    }
+
+    /* Alternate between two windows so every access forces a remap */
+    bench_lat_init(&cross);
+    for (i = 0; i < iters; i++) {
+        start = bench_now();
+        if ((rc = ahb_readl(ahb, base + (i & 1) * BENCH_STRIDE, &val)) < 0)
+            return rc;
+        bench_lat_add(&cross, bench_now() - start);
+    }
+
+    if ((rc = bench_queued(ahb, base, iters, &queued)) < 0)
+        return rc;
+
+    printf("  %-24s %8s %10s %10s %10s\n", "latency (us)", "iters", "min",
+           "avg", "max");
+    bench_lat_print("readl", &rd);
+    bench_lat_print("writel", &wr);
+    bench_lat_print("readl, window crossing", &cross);
+    bench_lat_print("readl, 16 in flight", &queued);
+
+    return 0;
+}
+
+static int bench_bulk(struct ahb *ahb, uint32_t base, void *buf)
+{
+    const struct bridge_caps *caps = ahb_bridge_caps(ahb);
+    unsigned int i, j, k, iters;
+    uint64_t start, rd, wr;
+    ssize_t rc;
+
+    printf("  %-24s %8s %10s %10s\n", "throughput (MiB/s)", "iters", "read",
+           "write");
+
+    for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+        size_t len = bench_sizes[i];
+
+        if (!bench_affordable(caps, len)) {
+            logd("Skipping %zu byte transfers, too slow on %s\n", len,
+                 ahb->drv->name);
+            continue;
+        }
+
+        iters = bench_iters(caps, len);
+        if (iters > 64)
+            iters = 64;
+
+        for (j = 0; j < ARRAY_SIZE(bench_aligns); j++) {
+            uint32_t phys = base + bench_aligns[j];
+            char label[32];
+
+            start = bench_now();
+            for (k = 0; k < iters; k++) {
+                if ((rc = ahb_read(ahb, phys, buf, len)) < 0)
+                    return -EIO;
+            }
+            rd = bench_now() - start;
+
+            start = bench_now();
+            for (k = 0; k < iters; k++) {
+                if ((rc = ahb_write(ahb, phys, buf, len)) < 0)
+                    return -EIO;
+            }
+            wr = bench_now() - start;
+
+            snprintf(label, sizeof(label), "%zuKiB @ +%" PRIu32, len >> 10,
+                     bench_aligns[j]);
+            printf("  %-24s %8u %10.2f %10.2f\n", label, iters,
+                   ((double)len * iters / (1 << 20)) / (rd / 1e9),
+                   ((double)len * iters / (1 << 20)) / (wr / 1e9));
+        }
+    }
+
+    return 0;
+}
+
+static size_t bench_scratch_len(const struct bridge_caps *caps)
+{
+    size_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+        if (bench_affordable(caps, bench_sizes[i]))
+            len = bench_sizes[i];
+    }
+
+    len += bench_aligns[ARRAY_SIZE(bench_aligns) - 1];
+
+    /* The window-crossing test needs a second word a stride away */
+    return len > BENCH_STRIDE + 4 ? len : BENCH_STRIDE + 4;
+}
+
+static int bench_bridge(struct ahb *ahb)
+{
+    struct soc _soc, *soc = &_soc;
+    struct soc_region vram;
+    struct sdmc *sdmc;
+    void *save, *buf;
+    size_t len;
+    uint32_t base;
+    ssize_t rc;
+    int cleanup;
+
+    if ((rc = soc_probe(soc, ahb)) < 0)
+        return rc;
+
+    if (!(sdmc = sdmc_get(soc))) {
+        rc = -ENODEV;
+        goto cleanup_soc;
+    }
+
+    if ((rc = sdmc_get_vram(sdmc, &vram)) < 0)
+        goto cleanup_soc;
+
+    /* Use the top of VRAM, the framebuffer lives at the bottom */
+    len = bench_scratch_len(ahb_bridge_caps(ahb));
+    if (len > vram.length) {
+        rc = -ENOSPC;
+        goto cleanup_soc;
+    }
+    base = (vram.start + vram.length - len) & ~(uint32_t)(BENCH_STRIDE - 1);
+
+    logi("Benchmarking the %s bridge against 0x%08" PRIx32 "-0x%08" PRIx32 "\n",
+         ahb->drv->name, base, (uint32_t)(base + len - 1));
+
+    if (!(save = malloc(len))) {
+        rc = -ENOMEM;
+        goto cleanup_soc;
+    }
+
+    if (!(buf = malloc(len))) {
+        rc = -ENOMEM;
+        goto cleanup_save;
+    }
+
+    /* Preserve the scratch region so the benchmark isn't destructive */
+    if ((rc = ahb_read(ahb, base, save, len)) < 0)
+        goto cleanup_buf;
+    memcpy(buf, save, len);
+
+    printf("%s:\n", ahb->drv->name);
+
+    if ((rc = bench_word(ahb, base)) < 0)
+        goto restore_scratch;
+
+    rc = bench_bulk(ahb, base, buf);
+
+restore_scratch:
+    if ((cleanup = ahb_write(ahb, base, save, len)) < 0)
+        loge("Failed to restore scratch region: %d\n", cleanup);
+
+cleanup_buf:
+    free(buf);
+
+cleanup_save:
+    free(save);
+
+cleanup_soc:
+    soc_destroy(soc);
+
+    return rc;
+}
+
+static const char *const bench_read_modes[] = {
+    [sfc_read_normal] = "READ",
+    [sfc_read_fast] = "FAST_READ",
+    [sfc_read_dual] = "dual",
+};
+
+static const uint32_t bench_erase_sizes[] = { 4 << 10, 32 << 10, 64 << 10 };
+
+/* Throughput of each read mode at each divisor, checked against @ref */
+static int bench_flash_reads(struct flash_chip *chip, uint32_t base,
+                             const uint8_t *ref, uint8_t *buf, size_t len)
+{
+    unsigned int mode, hdiv, i;
+    uint64_t start, elapsed;
+    uint32_t save;
+    bool good;
+    int cleanup;
+    int rc;
+
+    printf("  %-24s %8s %10s\n", "read (MiB/s)", "divisor", "rate");
+
+    for (mode = 0; mode < sfc_read_max; mode++) {
+        for (hdiv = 1; hdiv <= 5; hdiv++) {
+            char label[32];
+            char div[8];
+
+            rc = sfc_read_mode_save(chip->ctrl, mode, hdiv, &save);
+            if (rc == -EOPNOTSUPP) {
+                logd("Skipping %s reads, unsupported by the chip\n",
+                     bench_read_modes[mode]);
+                break;
+            }
+            if (rc < 0)
+                return rc;
+
+            good = true;
+            start = bench_now();
+            for (i = 0; i < BENCH_FLASH_READS; i++) {
+                if ((rc = flash_read(chip, base, buf, len)) < 0)
+                    break;
+                good = good && !memcmp(buf, ref, len);
+            }
+            elapsed = bench_now() - start;
+
+            if ((cleanup = sfc_read_mode_restore(chip->ctrl, save)) < 0)
+                return cleanup;
+
+            if (rc < 0)
+                return rc;
+
+            snprintf(label, sizeof(label), "%s, %zuKiB",
+                     bench_read_modes[mode], len >> 10);
+            snprintf(div, sizeof(div), "HCLK/%u", hdiv);
+            if (good)
+                printf("  %-24s %8s %10.2f\n", label, div,
+                       ((double)len * BENCH_FLASH_READS / (1 << 20)) /
+                       (elapsed / 1e9));
+            else
+                printf("  %-24s %8s %10s\n", label, div, "corrupt");
+        }
+    }
+
+    return 0;
+}
+
+static void bench_flash_lat_add(struct bench_lat *busy, struct bench_lat *issue,
+                                unsigned int *polls,
+                                const struct flash_timing *timing)
+{
+    bench_lat_add(busy, timing->busy_us * 1000);
+    bench_lat_add(issue, timing->issue_us * 1000);
+    *polls += timing->polls;
+}
+
+static void bench_flash_lat_print(const char *label, const struct bench_lat *busy,
+                                  const struct bench_lat *issue,
+                                  unsigned int polls)
+{
+    char name[32];
+
+    if (!busy->iters)
+        return;
+
+    snprintf(name, sizeof(name), "%s, busy", label);
+    bench_lat_print(name, busy);
+    snprintf(name, sizeof(name), "%s, issue", label);
+    bench_lat_print(name, issue);
+    logd("%s took %.1f status reads on average\n", label,
+         (double)polls / busy->iters);
+}
+
+/* Leaves the first BENCH_FLASH_BLOCK of the scratch region programmed */
+static int bench_flash_writes(struct flash_chip *chip, uint32_t base,
+                              uint32_t len, uint8_t *buf)
+{
+    struct bench_lat busy, issue, stat;
+    struct flash_timing timing;
+    unsigned int polls;
+    unsigned int i, j;
+    uint32_t x = 0x2545f491;
+    uint64_t start;
+    uint8_t status;
+    int rc;
+
+    printf("  %-24s %8s %10s %10s %10s\n", "flash (us)", "iters", "min",
+           "avg", "max");
+
+    /* What each poll of an erase or program costs on this bridge */
+    bench_lat_init(&stat);
+    for (i = 0; i < BENCH_FLASH_POLLS; i++) {
+        start = bench_now();
+        rc = chip->ctrl->cmd_rd(chip->ctrl, CMD_RDSR, false, 0, &status, 1);
+        if (rc < 0)
+            return rc;
+        bench_lat_add(&stat, bench_now() - start);
+    }
+    bench_lat_print("status read", &stat);
+
+    /* The 64K erases come last, so the start of the region ends up blank */
+    for (i = 0; i < ARRAY_SIZE(bench_erase_sizes); i++) {
+        uint32_t size = bench_erase_sizes[i];
+        char label[16];
+
+        bench_lat_init(&busy);
+        bench_lat_init(&issue);
+        polls = 0;
+
+        for (j = 0; j < BENCH_FLASH_ERASES && (j + 1) * size <= len; j++) {
+            rc = flash_erase_timed(chip, base + j * size, size, &timing);
+            if (rc == -EOPNOTSUPP) {
+                logd("Skipping %" PRIu32 "K erases, unsupported by the chip\n",
+                     size >> 10);
+                break;
+            }
+            if (rc < 0)
+                return rc;
+
+            bench_flash_lat_add(&busy, &issue, &polls, &timing);
+        }
+
+        snprintf(label, sizeof(label), "%" PRIu32 "K erase", size >> 10);
+        bench_flash_lat_print(label, &busy, &issue, polls);
+    }
+
+    if (!busy.iters) {
+        loge("The chip has no 64K erase to program against\n");
+        return -EOPNOTSUPP;
+    }
+
+    /* xorshift32, so nothing is left to the chip to skip */
+    for (i = 0; i < chip->page_size; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        buf[i] = x;
+    }
+
+    bench_lat_init(&busy);
+    bench_lat_init(&issue);
+    polls = 0;
+
+    for (i = 0; i < BENCH_FLASH_PAGES &&
+            (i + 1) * chip->page_size <= BENCH_FLASH_BLOCK; i++) {
+        rc = flash_program_timed(chip, base + i * chip->page_size, buf,
+                                 chip->page_size, &timing);
+        if (rc < 0)
+            return rc;
+
+        bench_flash_lat_add(&busy, &issue, &polls, &timing);
+    }
+
+    bench_flash_lat_print("page program", &busy, &issue, polls);
+
+    return 0;
+}
+
+/* The whole chip is only erased if it was given over as scratch */
+static int bench_flash_chip_erase(struct flash_chip *chip)
+{
+    struct bench_lat busy, issue;
+    struct flash_timing timing;
+    int rc;
+
+    if ((rc = flash_erase_timed(chip, 0, chip->tsize, &timing)) < 0)
+        return rc == -EOPNOTSUPP ? 0 : rc;
+
+    bench_lat_init(&busy);
+    bench_lat_init(&issue);
+    bench_lat_add(&busy, timing.busy_us * 1000);
+    bench_lat_add(&issue, timing.issue_us * 1000);
+    bench_flash_lat_print("chip erase", &busy, &issue, timing.polls);
+
+    return 0;
+}
+
+static int bench_flash(struct ahb *ahb, struct flash_chip *chip, uint32_t base,
+                       uint32_t len)
+{
+    const struct bridge_caps *caps = ahb_bridge_caps(ahb);
+    size_t sample = 0;
+    uint8_t *save, *buf;
+    unsigned int i;
+    int cleanup;
+    int rc;
+
+    for (i = 0; i < ARRAY_SIZE(bench_sizes); i++) {
+        if (bench_sizes[i] <= len && bench_affordable(caps, bench_sizes[i]))
+            sample = bench_sizes[i];
+    }
+
+    if (!sample)
+        sample = bench_sizes[0];
+
+    if (!(save = malloc(len)))
+        return -ENOMEM;
+
+    if (!(buf = malloc(sample > chip->page_size ? sample : chip->page_size))) {
+        rc = -ENOMEM;
+        goto cleanup_save;
+    }
+
+    /* Preserve the scratch region, read back in the mode the chip was in */
+    logi("Saving 0x%08" PRIx32 "-0x%08" PRIx32 " of flash\n", base,
+         base + len - 1);
+    if ((rc = flash_read(chip, base, save, len)) < 0)
+        goto cleanup_buf;
+
+    printf("flash, %s on %s:\n", chip->info.name ? chip->info.name : "unknown",
+           ahb->drv->name);
+
+    if ((rc = bench_flash_reads(chip, base, save, buf, sample)) < 0)
+        goto cleanup_buf;
+
+    if ((rc = bench_flash_writes(chip, base, len, buf)) < 0)
+        goto restore_scratch;
+
+    if (base == 0 && len == chip->tsize)
+        rc = bench_flash_chip_erase(chip);
+
+restore_scratch:
+    logi("Restoring 0x%08" PRIx32 "-0x%08" PRIx32 " of flash\n", base,
+         base + len - 1);
+    if ((cleanup = flash_smart_write(chip, base, save, len)) < 0) {
+        loge("Failed to restore the scratch region: %d\n", cleanup);
+        rc = rc < 0 ? rc : cleanup;
+    }
+
+cleanup_buf:
+    free(buf);
+
+cleanup_save:
+    free(save);
+
+    return rc;
+}
+
+static int bench_flash_run(int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct flash_chip *chip;
+    uint32_t base, len;
+    struct sfc *sfc;
+    struct ahb *ahb;
+    char *end;
+    int rc;
+
+    if (argc < 3) {
+        loge("Usage: bench flash CONTROLLER OFFSET LENGTH\n");
+        return -EINVAL;
+    }
+
+    base = strtoul(argv[1], &end, 0);
+    if (end == argv[1] || *end)
+        return -EINVAL;
+
+    len = strtoul(argv[2], &end, 0);
+    if (end == argv[2] || *end)
+        return -EINVAL;
+
+    if (!len || ((base | len) & (BENCH_FLASH_BLOCK - 1))) {
+        loge("The scratch region must be a non-empty run of 64K blocks\n");
+        return -EINVAL;
+    }
+
+    if ((rc = host_init(host, argc - 3, argv + 3)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0)
+        goto cleanup_host;
+
+    if (!(sfc = sfc_get(soc, argv[0]))) {
+        rc = -ENODEV;
+        goto cleanup_soc;
+    }
+
+    if ((rc = flash_init(sfc, &chip)) < 0)
+        goto cleanup_soc;
+
+    if (base + len < base || base + len > chip->tsize) {
+        loge("The scratch region runs past the 0x%" PRIx32 " byte chip\n",
+             chip->tsize);
+        rc = -EINVAL;
+        goto cleanup_flash;
+    }
+
+    logi("Erasing and programming 0x%08" PRIx32 "-0x%08" PRIx32 " of flash\n",
+         base, base + len - 1);
+
+    /* Flash commands poll the controller, keep the bridge set up between them */
+    if ((rc = ahb_session_begin(ahb)) < 0)
+        goto cleanup_flash;
+
+    rc = bench_flash(ahb, chip, base, len);
+
+    ahb_session_end(ahb);
+
+cleanup_flash:
+    flash_destroy(chip);
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
+
+/*
+ * Host-side kernels that bound bridge throughput once the bridge itself is
+ * fast, each run over the same pseudo-random data. A pass returns the bytes
+ * it processed or a negative error.
+ */
+struct bench_data {
+    uint8_t *in;
+    uint8_t *out;
+    /* Erased flash, which the classifier has to read to the end */
+    uint8_t *blank;
+    /* 'd' output for the input, one line per 16 bytes */
+    char *lines;
+    size_t nlines;
+    /* Text ending in the monitor prompt, for the prompt matcher */
+    FILE *console;
+    struct search search;
+    FILE *null;
+};
+
+#define BENCH_D_LINE        sizeof("00000000:00000000 00000000 00000000 00000000\n")
+
+static ssize_t bench_mmio_read(struct bench_data *data, unsigned int width)
+{
+    mmio_read(data->out, data->in, BENCH_KERNEL_LEN, width);
+
+    return BENCH_KERNEL_LEN;
+}
+
+static ssize_t bench_mmio_read_4(struct bench_data *data)
+{
+    return bench_mmio_read(data, 4);
+}
+
+static ssize_t bench_mmio_read_8(struct bench_data *data)
+{
+    return bench_mmio_read(data, 8);
+}
+
+static ssize_t bench_mmio_read_16(struct bench_data *data)
+{
+    return bench_mmio_read(data, 16);
+}
+
+static ssize_t bench_mmio_write(struct bench_data *data, unsigned int width)
+{
+    /* Offset the source so the RAM side is misaligned, as it often is */
+    mmio_write(data->out, data->in + 1, BENCH_KERNEL_LEN - 1, width);
+
+    return BENCH_KERNEL_LEN - 1;
+}
+
+static ssize_t bench_mmio_write_4(struct bench_data *data)
+{
+    return bench_mmio_write(data, 4);
+}
+
+static ssize_t bench_mmio_write_8(struct bench_data *data)
+{
+    return bench_mmio_write(data, 8);
+}
+
+static ssize_t bench_mmio_write_16(struct bench_data *data)
+{
+    return bench_mmio_write(data, 16);
+}
+
+static ssize_t bench_debug_parse_d(struct bench_data *data)
+{
+    ssize_t rc;
+    size_t i;
+
+    for (i = 0; i < data->nlines; i++) {
+        rc = debug_parse_d(&data->lines[i * BENCH_D_LINE], i * 16,
+                           &data->out[i * 16], 16);
+        if (rc < 0)
+            return rc;
+    }
+
+    return data->nlines * 16;
+}
+
+static ssize_t bench_prompt(struct bench_data *data)
+{
+    struct prompt prompt;
+    int rc;
+
+    rewind(data->console);
+    prompt_init(&prompt, fileno(data->console), "\r", false);
+
+    /* Not prompt_destroy(), the file is read again on the next pass */
+    if ((rc = prompt_expect(&prompt, "$ ")) < 0)
+        return rc;
+
+    return BENCH_KERNEL_LEN;
+}
+
+static ssize_t bench_flash_smart_comp(struct bench_data *data)
+{
+    uint32_t i;
+
+    /* Identical sectors, so each is compared to the end */
+    for (i = 0; i < BENCH_KERNEL_LEN; i += 4096) {
+        if (flash_smart_comp(data->in + i, data->out + i, 4096) != sm_no_change)
+            return -EINVAL;
+    }
+
+    return BENCH_KERNEL_LEN;
+}
+
+static ssize_t bench_fill_classify(struct bench_data *data)
+{
+    if (fill_classify(data->blank, BENCH_KERNEL_LEN, NULL) != fill_ones)
+        return -EINVAL;
+
+    return BENCH_KERNEL_LEN;
+}
+
+static ssize_t bench_tracedec(struct bench_data *data)
+{
+    struct tracedec ctx;
+    int rc;
+
+    rc = tracedec_init(&ctx, 4, tracedec_none,
+                       TRACEDEC_HISTOGRAM | TRACEDEC_RUNS, NULL);
+    if (rc < 0)
+        return rc;
+
+    if ((rc = tracedec_feed(&ctx, data->in, BENCH_KERNEL_LEN)) >= 0)
+        rc = tracedec_finish(&ctx, data->null);
+
+    tracedec_destroy(&ctx);
+
+    return rc < 0 ? rc : BENCH_KERNEL_LEN;
+}
+
+static int bench_search_match(void *priv __unused, unsigned int pattern __unused,
+                              uint64_t offset __unused, size_t len __unused)
+{
+    return 0;
+}
+
+static ssize_t bench_search(struct bench_data *data)
+{
+    int rc;
+
+    rc = search_feed(&data->search, data->in, BENCH_KERNEL_LEN,
+                     bench_search_match, NULL);
+
+    return rc < 0 ? rc : BENCH_KERNEL_LEN;
+}
+
+static ssize_t bench_crc32(struct bench_data *data)
+{
+    volatile uint32_t crc;
+
+    crc = crc32_update(0, data->in, BENCH_KERNEL_LEN);
+    (void)crc;
+
+    return BENCH_KERNEL_LEN;
+}
+
+static ssize_t bench_crc32c(struct bench_data *data)
+{
+    volatile uint32_t crc;
+
+    crc = crc32c_update(0, data->in, BENCH_KERNEL_LEN);
+    (void)crc;
+
+    return BENCH_KERNEL_LEN;
+}
+
+static const struct {
+    const char *name;
+    ssize_t (*pass)(struct bench_data *data);
+} bench_kernels[] = {
+    { "mmio_read, 4 byte", bench_mmio_read_4 },
+    { "mmio_read, 8 byte", bench_mmio_read_8 },
+    { "mmio_read, 16 byte", bench_mmio_read_16 },
+    { "mmio_write, 4 byte", bench_mmio_write_4 },
+    { "mmio_write, 8 byte", bench_mmio_write_8 },
+    { "mmio_write, 16 byte", bench_mmio_write_16 },
+    { "debug_parse_d", bench_debug_parse_d },
+    { "prompt_expect", bench_prompt },
+    { "flash_smart_comp", bench_flash_smart_comp },
+    { "fill_classify", bench_fill_classify },
+    { "tracedec_feed", bench_tracedec },
+    { "search_feed", bench_search },
+    { "crc32_update", bench_crc32 },
+    { "crc32c_update", bench_crc32c },
+};
+
+static int bench_data_init(struct bench_data *data)
+{
+    uint32_t x = 0x2545f491;
+    size_t i;
+    int rc;
+
+    memset(data, 0, sizeof(*data));
+    search_init(&data->search);
+
+    data->in = malloc(BENCH_KERNEL_LEN);
+    data->out = malloc(BENCH_KERNEL_LEN);
+    data->blank = malloc(BENCH_KERNEL_LEN);
+    data->nlines = BENCH_KERNEL_LEN / 16;
+    data->lines = malloc(data->nlines * BENCH_D_LINE);
+    data->console = tmpfile();
+    data->null = fopen("/dev/null", "w");
+    if (!data->in || !data->out || !data->blank || !data->lines ||
+            !data->console || !data->null)
+        return -ENOMEM;
+
+    memset(data->blank, 0xff, BENCH_KERNEL_LEN);
+
+    /* xorshift32, so runs are comparable */
+    for (i = 0; i < BENCH_KERNEL_LEN; i++) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        data->in[i] = x;
+    }
+    memcpy(data->out, data->in, BENCH_KERNEL_LEN);
+
+    for (i = 0; i < data->nlines; i++) {
+        const uint32_t *words = (const uint32_t *)&data->in[i * 16];
+
+        snprintf(&data->lines[i * BENCH_D_LINE], BENCH_D_LINE,
+                 "%08zx:%08" PRIx32 " %08" PRIx32 " %08" PRIx32 " %08" PRIx32 "\n",
+                 i * 16, le32toh(words[0]), le32toh(words[1]),
+                 le32toh(words[2]), le32toh(words[3]));
+    }
+
+    /* Printable text with the prompt's first character scattered through it */
+    for (i = 0; i < BENCH_KERNEL_LEN - 2; i++)
+        fputc(data->in[i] & 0x80 ? '$' : 'a' + data->in[i] % 26, data->console);
+    fputs("$ ", data->console);
+    if (fflush(data->console))
+        return -errno;
+
+    if ((rc = search_add_literal(&data->search, "root:x:0:0:", 11)) < 0 ||
+            (rc = search_add_literal(&data->search, "password", 8)) < 0 ||
+            (rc = search_add_hex(&data->search, "de ad be ef")) < 0 ||
+            (rc = search_compile(&data->search)) < 0)
+        return rc;
+
+    return 0;
+}
+
+static void bench_data_destroy(struct bench_data *data)
+{
+    search_destroy(&data->search);
+    if (data->null)
+        fclose(data->null);
+    if (data->console)
+        fclose(data->console);
+    free(data->lines);
+    free(data->blank);
+    free(data->out);
+    free(data->in);
+}
+
+static int bench_kernels_run(void)
+{
+    struct bench_data data;
+    uint64_t start, elapsed;
+    unsigned int i;
+    ssize_t rc;
+
+    if ((rc = bench_data_init(&data)) < 0) {
+        loge("Failed to set up the kernel benchmarks: %zd\n", rc);
+        goto cleanup_data;
+    }
+
+    printf("kernels:\n");
+    printf("  %-24s %8s %10s\n", "throughput (MiB/s)", "passes", "rate");
+
+    for (i = 0; i < ARRAY_SIZE(bench_kernels); i++) {
+        unsigned int passes = 0;
+        uint64_t bytes = 0;
+
+        start = bench_now();
+        do {
+            if ((rc = bench_kernels[i].pass(&data)) < 0) {
+                loge("Failed to run %s: %zd\n", bench_kernels[i].name, rc);
+                goto cleanup_data;
+            }
+            bytes += rc;
+            passes++;
+            elapsed = bench_now() - start;
+        } while (elapsed < BENCH_KERNEL_NS);
+
+        printf("  %-24s %8u %10.2f\n", bench_kernels[i].name, passes,
+               ((double)bytes / (1 << 20)) / (elapsed / 1e9));
+    }
+
+    rc = 0;
+
+cleanup_data:
+    bench_data_destroy(&data);
+
+    return rc;
+}
+
+int cmd_bench(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct ahb *ahb = NULL;
+    int failed = 0;
+    int rc;
+
+    if (argc == 1 && !strcmp(argv[0], "kernels"))
+        return bench_kernels_run();
+
+    if (argc >= 1 && !strcmp(argv[0], "flash"))
+        return bench_flash_run(argc - 1, argv + 1);
+
+    host_probe_all_bridges();
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    /* Measure every bridge that probed successfully */
+    while ((ahb = host_next_ahb(host, ahb))) {
+        if ((rc = bench_bridge(ahb)) < 0) {
+            loge("Failed to benchmark the %s bridge: %d\n", ahb->drv->name,
+                 rc);
+            failed = rc;
+        }
+    }
+
+    host_destroy(host);
+
+    return failed;
+}
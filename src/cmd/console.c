@@ -4,23 +4,379 @@
 #include "ahb.h"
 #include "ast.h"
 #include "compiler.h"
+#include "conlog.h"
 #include "host.h"
 #include "log.h"
 #include "priv.h"
+#include "prompt.h"
 #include "soc/clk.h"
 #include "soc/uart/mux.h"
+#include "soc/uart/vuart.h"
+#include "uart/conmux.h"
 #include "uart/suart.h"
 
+#include <fcntl.h>
+#include <getopt.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/* Generous for a loaded BMC, where the old fixed delays were 3 or 5 seconds */
+#define CONSOLE_PROMPT_MS 5000
+#define CONSOLE_DRAIN_MS 3000
+
+static ssize_t console_recv(void *priv, char *buf, size_t len, int timeout_ms)
+{
+    return suart_recv_any(priv, buf, len, timeout_ms);
+}
+
+static ssize_t console_send(void *priv, const char *buf, size_t len)
+{
+    ssize_t rc;
+
+    if ((rc = suart_flush(priv, buf, len)) < 0)
+        return rc;
+
+    return len;
+}
+
+static const struct prompt_ops console_prompt_ops = {
+    .recv = console_recv,
+    .send = console_send,
+};
+
+/*
+ * Sends @line and waits for @expect if it isn't NULL. A prompt that doesn't
+ * show isn't fatal, the console may already be past it, so carry on as the
+ * fixed delays did.
+ */
+static int console_run_expect(struct prompt *prompt, const char *line,
+                              const char *expect)
+{
+    int rc;
+
+    if ((rc = prompt_run(prompt, line)) < 0)
+        return rc;
+
+    if (!expect)
+        return 0;
+
+    if ((rc = prompt_expect(prompt, expect)) == -ETIMEDOUT) {
+        logi("Timed out waiting for '%s' on the BMC console, continuing\n",
+             expect);
+        return 0;
+    }
+
+    return rc < 0 ? rc : 0;
+}
+
+/* Log in to whatever getty is on the other end of @suart */
+static int console_login(struct suart *suart, const char *user,
+                         const char *pass, const char *shell)
+{
+    struct prompt prompt;
+    int rc;
+
+    prompt_init_ops(&prompt, &console_prompt_ops, suart, "\n", false);
+    prompt_set_timeout(&prompt, CONSOLE_PROMPT_MS);
+
+    if ((rc = console_run_expect(&prompt, "", "login:")) < 0)
+        return rc;
+
+    if ((rc = console_run_expect(&prompt, user, "assword:")) < 0)
+        return rc;
+
+    return console_run_expect(&prompt, pass, shell);
+}
+
+//culvert console replay [--speed FACTOR] [--timestamps] FILE
+static int console_replay(int argc, char *argv[])
+{
+    enum conlog_pace pace = conlog_pace_realtime;
+    double speed = 1.0;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "speed", required_argument, NULL, 's' },
+            { "timestamps", no_argument, NULL, 't' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "s:t", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 's':
+                speed = strtod(optarg, NULL);
+                if (!(speed > 0)) {
+                    loge("Replay speed must be positive: %s\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 't':
+                pace = conlog_pace_timestamps;
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    if (optind >= argc) {
+        loge("Not enough arguments for console replay command\n");
+        return -EINVAL;
+    }
+
+    if ((rc = conlog_replay(argv[optind], 1, pace, speed)) < 0)
+        loge("Failed to replay %s: %d\n", argv[optind], rc);
+
+    return rc;
+}
+
+static const struct {
+    const char *name;
+    enum sio_dev dev;
+} console_suarts[] = {
+    { "suart1", sio_suart1 },
+    { "suart2", sio_suart2 },
+    { "suart3", sio_suart3 },
+    { "suart4", sio_suart4 },
+};
+
+/* Returns 0 for a VUART, found through the SoC rather than SuperIO */
+static int console_mux_parse_dev(const char *name, enum sio_dev *dev)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(console_suarts) / sizeof(console_suarts[0]); i++) {
+        if (!strcmp(console_suarts[i].name, name)) {
+            *dev = console_suarts[i].dev;
+            return 1;
+        }
+    }
+
+    if (!strncmp(name, "vuart", strlen("vuart")))
+        return 0;
+
+    loge("Unrecognised UART '%s'\n", name);
+    return -EINVAL;
+}
+
+/* Finds where the host reaches each VUART, they're set up from the BMC side */
+static int console_mux_vuarts(struct conmux_port *ports, size_t count,
+                              const bool *is_vuart, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct vuart *vuart;
+    struct ahb *ahb;
+    uint16_t base;
+    size_t i;
+    int rc;
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0) {
+        loge("Failed to probe SoC: %d\n", rc);
+        goto cleanup_host;
+    }
+
+    for (i = 0; i < count; i++) {
+        if (!is_vuart[i])
+            continue;
+
+        if (!(vuart = vuart_get_by_name(soc, ports[i].name))) {
+            loge("Failed to find %s\n", ports[i].name);
+            rc = -ENODEV;
+            break;
+        }
+
+        if ((rc = vuart_get_host_port(vuart, &base)) < 0) {
+            loge("Failed to find the host's I/O address for %s: %d\n",
+                 ports[i].name, rc);
+            break;
+        }
+
+        if ((rc = suart_init_port(ports[i].uart, base)) < 0) {
+            loge("Failed to initialise %s at 0x%x: %d\n", ports[i].name, base,
+                 rc);
+            break;
+        }
+    }
+
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
+
+/*
+ * culvert console mux [--baud N] --port UART[=FILE]... [INTERFACE ...]
+ *
+ * Each UART's output goes to FILE, or to stdout for the one UART without a
+ * FILE, which also takes stdin and ends the session when it closes.
+ */
+static int console_mux(int argc, char *argv[])
+{
+    struct suart suarts[SUART_BATCH_MAX], vuarts[SUART_BATCH_MAX];
+    struct conmux_port ports[SUART_BATCH_MAX];
+    enum sio_dev devs[SUART_BATCH_MAX];
+    bool is_vuart[SUART_BATCH_MAX];
+    const char *paths[SUART_BATCH_MAX];
+    size_t nports = 0, nsuarts = 0, nvuarts = 0;
+    bool interactive = false;
+    int cleanup;
+    int baud = 0;
+    size_t i;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        char *sep;
+        int c;
+
+        static struct option long_options[] = {
+            { "baud", required_argument, NULL, 'b' },
+            { "port", required_argument, NULL, 'p' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "b:p:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'b':
+                baud = atoi(optarg);
+                if (baud <= 0) {
+                    loge("Invalid baud rate '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'p':
+                if (nports == SUART_BATCH_MAX) {
+                    loge("Too many UARTs, at most %d can be multiplexed\n",
+                         SUART_BATCH_MAX);
+                    return -EINVAL;
+                }
+
+                if ((sep = strchr(optarg, '=')))
+                    *sep++ = '\0';
+
+                ports[nports].name = optarg;
+                paths[nports] = sep;
+
+                if (!sep) {
+                    if (interactive) {
+                        loge("Only one UART can use stdin and stdout\n");
+                        return -EINVAL;
+                    }
+                    interactive = true;
+                }
+
+                if ((rc = console_mux_parse_dev(optarg, &devs[nsuarts])) < 0)
+                    return rc;
+
+                is_vuart[nports] = !rc;
+                ports[nports].uart = rc ? &suarts[nsuarts++] : &vuarts[nvuarts++];
+                nports++;
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    if (!nports) {
+        loge("No UARTs to multiplex, give at least one --port\n");
+        return -EINVAL;
+    }
+
+    for (i = 0; i < nports; i++)
+        ports[i].out = -1;
+
+    for (i = 0; i < nports; i++) {
+        if (!paths[i]) {
+            ports[i].in = STDIN_FILENO;
+            ports[i].out = STDOUT_FILENO;
+            continue;
+        }
+
+        ports[i].in = -1;
+        ports[i].out = open(paths[i], O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC,
+                            0644);
+        if (ports[i].out < 0) {
+            rc = -errno;
+            loge("Failed to open %s for %s: %d\n", paths[i], ports[i].name, rc);
+            goto cleanup_files;
+        }
+    }
+
+    if (nvuarts) {
+        rc = console_mux_vuarts(ports, nports, is_vuart, argc - optind,
+                                argv + optind);
+        if (rc < 0)
+            goto cleanup_files;
+    }
+
+    /* One SuperIO session configures the lot */
+    if ((rc = suart_init_many(suarts, devs, nsuarts)) < 0) {
+        loge("Failed to initialise the SUARTs: %d\n", rc);
+        goto cleanup_files;
+    }
+
+    for (i = 0; baud && i < nports; i++) {
+        if ((rc = suart_set_baud(ports[i].uart, baud)) < 0) {
+            loge("Failed to set %s to %d baud: %d\n", ports[i].name, baud, rc);
+            goto cleanup_suarts;
+        }
+    }
+
+    if (!interactive)
+        logi("Logging %zu UARTs, interrupt to stop\n", nports);
+
+    rc = conmux_run(ports, nports);
+    if (rc)
+        loge("Failed to multiplex UARTs: %d\n", rc);
+
+cleanup_suarts:
+    cleanup = suart_destroy_many(suarts, nsuarts);
+    if (cleanup)
+        loge("Failed to disable the SUARTs: %d\n", cleanup);
+
+cleanup_files:
+    for (i = 0; i < nports; i++) {
+        if (paths[i] && ports[i].out >= 0)
+            close(ports[i].out);
+    }
+
+    return rc;
+}
+
 int cmd_console(const char *name __unused, int argc, char *argv[])
 {
     struct suart _suart, *suart = &_suart;
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
+    size_t capture_size = CONLOG_SIZE_DEFAULT;
+    struct conlog _capture, *capture = NULL;
+    const char *capture_path = NULL;
     const char *user, *pass;
     struct uart_mux *mux;
     struct ahb *ahb;
@@ -29,6 +385,41 @@ int cmd_console(const char *name __unused, int argc, char *argv[])
     int baud;
     int rc;
 
+    if (argc > 1 && !strcmp(argv[1], "replay"))
+        return console_replay(argc - 1, argv + 1);
+
+    if (argc > 1 && !strcmp(argv[1], "mux"))
+        return console_mux(argc - 1, argv + 1);
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "capture", required_argument, NULL, 'c' },
+            { "capture-size", required_argument, NULL, 'S' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "+c:S:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'c':
+                capture_path = optarg;
+                break;
+            case 'S':
+                capture_size = strtoul(optarg, NULL, 0);
+                break;
+            case '?':
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
     if (argc < 5) {
         loge("Not enough arguments for console command\n");
         exit(EXIT_FAILURE);
@@ -55,7 +446,7 @@ int cmd_console(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (!(ahb = host_get_ahb(host))) {
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
         loge("Failed to acquire AHB interface, exiting\n");
         rc = EXIT_FAILURE;
         goto host_cleanup;
@@ -101,32 +492,16 @@ int cmd_console(const char *name __unused, int argc, char *argv[])
     if (rc) { errno = -rc; perror("suart_set_baud"); goto suart_cleanup; }
 
     logi("Starting getty from BMC console\n");
-    rc = suart_flush(suart, user, strlen(user));
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    rc = suart_flush(suart, "\n", 5);
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    sleep(3);
-
-    rc = suart_flush(suart, pass, strlen(pass));
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    rc = suart_flush(suart, "\n", 8);
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    sleep(5);
+    rc = console_login(suart, user, pass, "# ");
+    if (rc) { errno = -rc; perror("console_login"); goto suart_cleanup; }
 
     const char *run_getty = "/sbin/agetty -8 -L ttyS1 1200 xterm &\n";
     rc = suart_flush(suart, run_getty, strlen(run_getty));
     if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
 
-    /* We need to wait for the XMIT FIFO to clear before changing the UART
-     * routing.
-     *
-     * TODO: Make this suck less by spinning on THRE
-     */
-    sleep(3);
+    /* The XMIT FIFO must be clear before changing the UART routing */
+    rc = suart_drain(suart, CONSOLE_DRAIN_MS);
+    if (rc) { errno = -rc; perror("suart_drain"); goto suart_cleanup; }
 
     logi("Launched getty with: %s", run_getty);
 
@@ -141,27 +516,25 @@ int cmd_console(const char *name __unused, int argc, char *argv[])
     rc = suart_set_baud(suart, baud);
     if (rc) { errno = -rc; perror("suart_set_baud"); goto suart_cleanup; }
 
-    rc = suart_flush(suart, "\n", 1);
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    sleep(5);
-
-    rc = suart_flush(suart, user, strlen(user)); /* username */
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-    rc = suart_flush(suart, "\n", 5);
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    sleep(3);
-
-    rc = suart_flush(suart, pass, strlen(pass)); /* password */
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
-
-    rc = suart_flush(suart, "\n", 1);
-    if (rc) { errno = -rc; perror("suart_flush"); goto suart_cleanup; }
+    /* Whatever the session's shell prompt is, it's passed through from here */
+    rc = console_login(suart, user, pass, NULL);
+    if (rc) { errno = -rc; perror("console_login"); goto suart_cleanup; }
+
+    if (capture_path) {
+        rc = conlog_create(&_capture, capture_path, capture_size);
+        if (rc) {
+            loge("Failed to create console capture %s: %d\n", capture_path, rc);
+            goto suart_cleanup;
+        }
+        capture = &_capture;
+    }
 
-    rc = suart_run(suart, 0, 1);
+    rc = suart_run(suart, 0, 1, capture);
     if (rc) { errno = -rc; perror("suart_run"); }
 
+    if (capture && (cleanup = conlog_close(capture)))
+        loge("Failed to flush console capture: %d\n", cleanup);
+
 suart_cleanup:
     cleanup = suart_destroy(suart);
     if (cleanup) { errno = -cleanup; perror("suart_destroy"); }
@@ -3,18 +3,28 @@
 
 #include "bits.h"
 #include "compiler.h"
+#include "delta.h"
 #include "host.h"
 #include "log.h"
+#include "mirror.h"
+#include "pipeline.h"
+#include "progress.h"
 #include "rev.h"
 #include "soc.h"
 #include "soc/scu.h"
 #include "soc/sdmc.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <limits.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #define COPROC_CACHED_MEM_SIZE (16 * 1024 * 1024)
@@ -32,11 +42,164 @@
 #define SCU_COPROC_CACHE_FUNC 0xa48
 #define   SCU_COPROC_CACHE_EN BIT(0)
 
+/*
+ * Minimum times the SSP cache programming procedure holds the configuration
+ * before releasing the reset, and the reset before enabling the core. They're
+ * counted from when the preceding write completed, so bridge work done in the
+ * meantime counts towards them.
+ */
+#define COPROC_RESET_PRE_US 1000
+#define COPROC_RESET_POST_US 1000
+
+#define COPROC_LOAD_CHUNK (1 << 20)
+
+struct coproc_image {
+    const char *path;
+    void *map;
+    size_t len;
+    bool delta;
+    bool verify;
+    uint32_t scratch;
+};
+
+static int coproc_image_map(struct coproc_image *image)
+{
+    struct stat st;
+    int fd, rc = 0;
+
+    if ((fd = open(image->path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    if (!st.st_size || st.st_size > COPROC_TOTAL_MEM_SIZE) {
+        loge("Coprocessor image '%s' must be non-empty and fit in 32M\n",
+             image->path);
+        rc = -EINVAL;
+        goto cleanup_fd;
+    }
+
+    image->len = st.st_size;
+    image->map = mmap(NULL, image->len, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image->map == MAP_FAILED) {
+        image->map = NULL;
+        rc = -errno;
+    }
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+/* The whole image, with the next chunk staged while the last goes out */
+static int coproc_image_copy(struct soc *soc, uint32_t phys,
+                             struct coproc_image *image)
+{
+    struct pipeline pipeline;
+    int rc;
+
+    if ((rc = pipeline_init(&pipeline, "write", COPROC_LOAD_CHUNK,
+                            image->len)) < 0)
+        return rc;
+
+    pipeline_set_base(&pipeline, phys);
+
+    if ((rc = pipeline_add_mem_source(&pipeline, image->map, image->len)) < 0)
+        goto cleanup_pipeline;
+
+    if ((rc = pipeline_add_bridge_sink(&pipeline, soc->ahb, phys)) < 0)
+        goto cleanup_pipeline;
+
+    rc = pipeline_run(&pipeline);
+
+cleanup_pipeline:
+    pipeline_destroy(&pipeline);
+
+    return rc;
+}
+
+/*
+ * A mapped image is written out whole by coproc_image_copy(). With
+ * @image->delta only what differs from the memory is written, which on a
+ * reload of a similar image, or over zero fill already in place, skips most
+ * of it.
+ */
+static int coproc_image_load(struct soc *soc, uint32_t phys,
+                             struct coproc_image *image)
+{
+    struct progress progress;
+    struct delta delta;
+    size_t offset;
+    int rc;
+
+    if ((rc = delta_init(&delta, soc, image->scratch)) < 0)
+        return rc;
+
+    if (!image->delta) {
+        rc = coproc_image_copy(soc, phys, image);
+        goto verify;
+    }
+
+    progress_init(&progress, "write", image->len);
+    for (offset = 0; offset < image->len;) {
+        size_t len = image->len - offset;
+
+        len = len < COPROC_LOAD_CHUNK ? len : COPROC_LOAD_CHUNK;
+        if ((rc = delta_write(&delta, phys + offset,
+                              (uint8_t *)image->map + offset, len)) < 0)
+            break;
+
+        offset += len;
+        progress_update(&progress, len);
+    }
+    progress_end(&progress);
+
+    if (!rc)
+        logi("Wrote %zu of %zu bytes that differed\n", delta.written,
+             delta.compared);
+
+verify:
+    if (!rc && image->verify) {
+        logi("Verifying the coprocessor image\n");
+        if ((rc = delta_verify(&delta, phys, image->map, image->len)) < 0)
+            loge("Coprocessor image verification failed: %d\n", rc);
+    }
+
+    delta_destroy(&delta);
+
+    return rc;
+}
+
+static uint64_t coproc_now_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void coproc_sleep_until(uint64_t us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
 static int cmd_coprocessor_run(const char *name __unused, int argc, char *argv[])
 {
     const char *arg_mem_base, *arg_mem_size;
+    struct coproc_image image = { 0 };
     struct host _host, *host = &_host;
     unsigned long mem_base, mem_size;
+    unsigned long scratch;
     struct soc _soc, *soc = &_soc;
     struct soc_region dram;
     struct sdmc *sdmc;
@@ -46,13 +209,61 @@ static int cmd_coprocessor_run(const char *name __unused, int argc, char *argv[]
     char *endp;
     int rc;
 
-    if (argc < 3) {
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "delta", no_argument, NULL, 'd' },
+            { "file", required_argument, NULL, 'f' },
+            { "hash-scratch", required_argument, NULL, 'H' },
+            { "verify", no_argument, NULL, 'v' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "df:H:v", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'd':
+                image.delta = true;
+                break;
+            case 'f':
+                image.path = optarg;
+                break;
+            case 'H':
+                errno = 0;
+                scratch = strtoul(optarg, &endp, 0);
+                if (errno || *endp || !scratch || scratch > UINT32_MAX) {
+                    loge("Invalid hash scratch address '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                image.scratch = scratch;
+                break;
+            case 'v':
+                image.verify = true;
+                break;
+            case '?':
+                return EXIT_FAILURE;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2) {
         loge("Not enough arguments for coprocessor command\n");
         return EXIT_FAILURE;
     }
 
-    arg_mem_base = argv[1];
-    arg_mem_size = argv[2];
+    if (!image.path && (image.delta || image.verify || image.scratch)) {
+        loge("--delta, --verify and --hash-scratch need the image given by --file\n");
+        return EXIT_FAILURE;
+    }
+
+    arg_mem_base = argv[0];
+    arg_mem_size = argv[1];
 
     errno = 0;
     mem_base = strtoul(arg_mem_base, &endp, 0);
@@ -79,11 +290,17 @@ static int cmd_coprocessor_run(const char *name __unused, int argc, char *argv[]
         return EXIT_FAILURE;
     }
 
-    if ((rc = host_init(host, argc - 3, argv + 3)) < 0) {
-        loge("Failed to initialise host interface: %d\n", rc);
+    if (image.path && (rc = coproc_image_map(&image)) < 0) {
+        loge("Failed to map coprocessor image '%s': %d\n", image.path, rc);
         return EXIT_FAILURE;
     }
 
+    if ((rc = host_init(host, argc - 2, argv + 2)) < 0) {
+        loge("Failed to initialise host interface: %d\n", rc);
+        rc = EXIT_FAILURE;
+        goto cleanup_image;
+    }
+
     if (!(ahb = host_get_ahb(host))) {
         loge("Failed to acquire AHB interface\n");
         rc = EXIT_FAILURE;
@@ -159,33 +376,36 @@ static int cmd_coprocessor_run(const char *name __unused, int argc, char *argv[]
     }
 
     /* 3. */
-    if ((src = soc_siphon_in(soc, mem_base, mem_size, STDIN_FILENO)) < 0) {
+    if (image.path)
+        src = coproc_image_load(soc, mem_base, &image);
+    else
+        src = soc_siphon_in(soc, mem_base, mem_size, STDIN_FILENO);
+    if (src < 0) {
         loge("Failed to load coprocessor firmware to provided region: %d\n", src);
         rc = EXIT_FAILURE;
         goto cleanup_scu;
     }
 
-        /* 4. */
-    if (scu_writel(scu, SCU_COPROC_MEM_BASE, mem_base) ||
-        /* 5. */
-        scu_writel(scu, SCU_COPROC_IMEM_LIMIT,
-                   mem_base + COPROC_CACHED_MEM_SIZE) ||
-        /* 6. */
-        scu_writel(scu, SCU_COPROC_DMEM_LIMIT, mem_base + mem_size) ||
-        /* 7. */
-        scu_writel(scu, SCU_COPROC_CACHE_RANGE, SCU_COPROC_CACHE_1ST_16MB_EN) ||
-        /* 8. */
-        scu_writel(scu, SCU_COPROC_CACHE_FUNC, SCU_COPROC_CACHE_EN)) {
+    /* Steps 4 to 8 have no ordering constraints, so go to the bridge as a batch */
+    soc_txn_begin(soc);
+    /* 4. */
+    rc = scu_writel(scu, SCU_COPROC_MEM_BASE, mem_base) ||
+         /* 5. */
+         scu_writel(scu, SCU_COPROC_IMEM_LIMIT,
+                    mem_base + COPROC_CACHED_MEM_SIZE) ||
+         /* 6. */
+         scu_writel(scu, SCU_COPROC_DMEM_LIMIT, mem_base + mem_size) ||
+         /* 7. */
+         scu_writel(scu, SCU_COPROC_CACHE_RANGE, SCU_COPROC_CACHE_1ST_16MB_EN) ||
+         /* 8. */
+         scu_writel(scu, SCU_COPROC_CACHE_FUNC, SCU_COPROC_CACHE_EN);
+    if (soc_txn_commit(soc) < 0 || rc) {
         loge("Failed to configure coprocessor control registers\n");
         rc = EXIT_FAILURE;
         goto cleanup_scu;
     }
 
-    if (usleep(1000) == -1) {
-        loge("Coprocessor reset pre-delay failed: %s", strerror(errno));
-        rc = EXIT_FAILURE;
-        goto cleanup_scu;
-    }
+    coproc_sleep_until(coproc_now_us() + COPROC_RESET_PRE_US);
 
     /* 9. */
     if ((rc = scu_writel(scu, SCU_COPROC_CTRL, 0)) < 0) {
@@ -194,13 +414,10 @@ static int cmd_coprocessor_run(const char *name __unused, int argc, char *argv[]
         goto cleanup_scu;
     }
 
-    if (usleep(1000) == -1) {
-        loge("Coprocessor reset post-delay failed: %s", strerror(errno));
-        rc = EXIT_FAILURE;
-        goto cleanup_scu;
-    }
+    coproc_sleep_until(coproc_now_us() + COPROC_RESET_POST_US);
 
-    /* 10. */
+    /* 10. The coprocessor is free to write its memory from here */
+    mirror_invalidate("coprocessor started");
     if ((rc = scu_writel(scu, SCU_COPROC_CTRL, SCU_COPROC_CTRL_EN)) < 0) {
         loge("Failed to start coprocessor: %d\n", rc);
         rc = EXIT_FAILURE;
@@ -218,6 +435,10 @@ cleanup_soc:
 cleanup_host:
     host_destroy(host);
 
+cleanup_image:
+    if (image.map)
+        munmap(image.map, image.len);
+
     return rc;
 }
 
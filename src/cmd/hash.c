@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "flash.h"
+#include "host.h"
+#include "layout.h"
+#include "log.h"
+#include "soc.h"
+#include "soc/hace.h"
+#include "soc/sdmc.h"
+#include "soc/sfc.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static bool hash_parse_u32(const char *arg, uint32_t *val)
+{
+    unsigned long parsed;
+    char *end;
+
+    errno = 0;
+    parsed = strtoul(arg, &end, 0);
+    if (errno || end == arg || *end || parsed > UINT32_MAX)
+        return false;
+
+    *val = parsed;
+
+    return true;
+}
+
+/* Without @range, all of DRAM below the VGA reservation */
+static int hash_ram_region(struct soc *soc, char *range[],
+                           struct soc_region *region)
+{
+    struct soc_region dram, vram;
+    struct sdmc *sdmc;
+    int rc;
+
+    if (!(sdmc = sdmc_get(soc))) {
+        loge("Failed to acquire memory controller, exiting\n");
+        return -ENODEV;
+    }
+
+    if ((rc = sdmc_get_dram(sdmc, &dram)) < 0)
+        return rc;
+
+    if (range) {
+        if (!hash_parse_u32(range[0], &region->start) ||
+                !hash_parse_u32(range[1], &region->length) ||
+                !region->length || region->start < dram.start ||
+                region->start - dram.start + (uint64_t)region->length >
+                    dram.length) {
+            loge("Invalid RAM range '%s %s'\n", range[0], range[1]);
+            return -EINVAL;
+        }
+
+        return 0;
+    }
+
+    if ((rc = sdmc_get_vram(sdmc, &vram)) < 0)
+        return rc;
+
+    region->start = dram.start;
+    region->length = vram.start - dram.start;
+
+    return 0;
+}
+
+static int hash_firmware_region(struct soc *soc, const char *spec,
+                                const char *partition,
+                                struct soc_region *region)
+{
+    struct flash_part part = { .offset = 0 };
+    struct soc_region flash;
+    struct flash_chip *chip;
+    struct sfc *sfc;
+    int rc;
+
+    if (!(sfc = sfc_get(soc, spec))) {
+        loge("Failed to acquire SPI controller\n");
+        return -ENODEV;
+    }
+
+    if ((rc = flash_init(sfc, &chip)) < 0)
+        return rc;
+
+    if ((rc = sfc_get_flash(sfc, &flash)) < 0)
+        goto cleanup_chip;
+
+    part.size = chip->info.size;
+    if (partition && (rc = flash_get_part(chip, partition, &part)) < 0)
+        goto cleanup_chip;
+
+    region->start = flash.start + part.offset;
+    region->length = part.size;
+
+cleanup_chip:
+    flash_destroy(chip);
+
+    return rc;
+}
+
+int cmd_hash(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    uint8_t digest[HACE_SHA256_LEN];
+    const char *partition = NULL;
+    const char *spec = "fmc";
+    struct soc_region region;
+    uint32_t scratch = 0;
+    struct hace *hace;
+    char **range = NULL;
+    const char *space;
+    struct ahb *ahb;
+    unsigned int i;
+    uint32_t addr;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "flash", required_argument, NULL, 'F' },
+            { "partition", required_argument, NULL, 'P' },
+            { "scratch", required_argument, NULL, 'S' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "F:P:S:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'F':
+                spec = optarg;
+                break;
+            case 'P':
+                partition = optarg;
+                break;
+            case 'S':
+                if (!hash_parse_u32(optarg, &scratch) || (scratch & 7)) {
+                    loge("Invalid scratch address '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1 || !scratch) {
+        loge("Not enough arguments for hash command\n");
+        return -EINVAL;
+    }
+
+    space = argv[0];
+    if (strcmp("ram", space) && strcmp("firmware", space)) {
+        loge("Unsupported hash space: '%s'\n", space);
+        return -EINVAL;
+    }
+
+    argc--;
+    argv++;
+
+    /* Interface names aren't numbers, so a range is told apart by its start */
+    if (!strcmp("ram", space) && argc >= 2 && hash_parse_u32(argv[0], &addr)) {
+        range = argv;
+        argc -= 2;
+        argv += 2;
+    }
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0)
+        goto cleanup_host;
+
+    if (!(hace = hace_get(soc))) {
+        loge("No hash engine on this SoC\n");
+        rc = -ENODEV;
+        goto cleanup_soc;
+    }
+
+    if (!strcmp("ram", space))
+        rc = hash_ram_region(soc, range, &region);
+    else
+        rc = hash_firmware_region(soc, spec, partition, &region);
+    if (rc < 0)
+        goto cleanup_soc;
+
+    if (scratch + HACE_SHA256_LEN > region.start &&
+            scratch < region.start + (uint64_t)region.length) {
+        loge("The scratch area overlaps the hashed range\n");
+        rc = -EINVAL;
+        goto cleanup_soc;
+    }
+
+    logi("Hashing %s 0x%08" PRIx32 "-0x%08" PRIx32 " on the BMC\n", space,
+         region.start, region.start + region.length - 1);
+
+    if ((rc = hace_sha256(hace, region.start, region.length, scratch,
+                          digest)) < 0) {
+        loge("Failed to hash the range: %d\n", rc);
+        goto cleanup_soc;
+    }
+
+    for (i = 0; i < sizeof(digest); i++)
+        printf("%02x", digest[i]);
+    printf("  %s:0x%08" PRIx32 ",0x%" PRIx32 "\n", space, region.start,
+           region.length);
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
@@ -7,19 +7,26 @@
 #include "host.h"
 #include "log.h"
 #include "priv.h"
+#include "rt.h"
 #include "soc.h"
 #include "soc/clk.h"
 #include "soc/jtag.h"
+#include "svf.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <netdb.h>
+#include <signal.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
 #include <getopt.h>
 
@@ -30,107 +37,410 @@ cmd_jtag_help(const char *name, int argc __unused, char *argv[] __unused)
                 "Usage:\n"
                 "%s jtag --help\n"
                 "%s jtag --port OPENOCD-PORT ...\n"
-                "%s jtag --target <arm|pcie|external>\n";
+                "%s jtag --socket PATH ...\n"
+                "%s jtag --vpi --port OPENOCD-PORT ...\n"
+                "%s jtag --target <arm|pcie|external>\n"
+                "%s jtag [--bitbang] play FILE.svf|FILE.xsvf ...\n"
+                "%s jtag [--bitbang] [--count N] [--interval US] sample IR-BITS:IR DR-BITS FILE|- ...\n"
+                "\n"
+                "sample loads IR once, e.g. with SAMPLE/PRELOAD, then captures DR-BITS of DR\n"
+                "until interrupted, writing a line per capture of the seconds since the first\n"
+                "and the captured bits in hex, bit 0 rightmost.\n";
 
-        printf(jtag_help, name, name, name, name);
+        printf(jtag_help, name, name, name, name, name, name, name);
 }
 
-static int run_openocd_bitbang_server(struct jtag *jtag, uint16_t port)
+/* Widest IR the command line takes, every TAP on the chain included */
+#define SAMPLE_IR_MAX           64
+#define SAMPLE_DR_MAX           (1 << 20)
+
+struct jtag_sample {
+        bool bitbang;
+        unsigned int ir_bits;
+        uint64_t ir;
+        size_t dr_bits;
+        uint64_t count;
+        uint64_t interval_us;
+};
+
+static volatile sig_atomic_t sample_stop_requested;
+
+static void sample_handle_signal(int signo __unused)
+{
+        sample_stop_requested = 1;
+}
+
+static uint64_t sample_now_ns(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Clocks the @bits of @tms with TDI low, the first in bit 0 */
+static int sample_clock(struct jtag *jtag, uint8_t tms, unsigned int bits)
+{
+        uint8_t states[16];
+        unsigned int i;
+
+        for (i = 0; i < bits; i++) {
+                uint8_t m = (tms >> i) & 1;
+
+                states[2 * i] = m << 1;
+                states[2 * i + 1] = 4 | (m << 1);
+        }
+
+        return jtag_bitbang_set_states(jtag, states, 2 * bits);
+}
+
+/* A scan from Run-Test/Idle back to it, by the engine or by bit-bang */
+static int sample_scan(struct jtag *jtag, bool bitbang, bool ir,
+                       const uint8_t *tdi, uint8_t *tdo, size_t bits)
+{
+        int rc;
+
+        if (!bitbang)
+                return jtag_shift(jtag, ir, tdi, tdo, bits);
+
+        /* Select-DR, and Select-IR, Capture, Shift */
+        if ((rc = ir ? sample_clock(jtag, 0x3, 4) : sample_clock(jtag, 0x1, 3)) < 0)
+                return rc;
+
+        if ((rc = jtag_bitbang_scan(jtag, tdi, tdo, bits)) < 0)
+                return rc;
+
+        /* Exit1 to Update to Run-Test/Idle */
+        return sample_clock(jtag, 0x1, 2);
+}
+
+static void sample_print(FILE *out, uint64_t t_ns, const uint8_t *dr,
+                         size_t bits)
+{
+        size_t i = (bits + 7) / 8;
+        uint8_t top = bits % 8 ? (1 << (bits % 8)) - 1 : 0xff;
+
+        fprintf(out, "%" PRIu64 ".%09" PRIu64 " ", t_ns / 1000000000,
+                t_ns % 1000000000);
+
+        /* Whole hex digits, the top one only as wide as the bits left */
+        if ((bits % 8) && (bits % 8) <= 4)
+                fprintf(out, "%x", dr[--i] & top);
+        else
+                fprintf(out, "%02x", dr[--i] & top);
+        while (i)
+                fprintf(out, "%02x", dr[--i]);
+        fputc('\n', out);
+}
+
+/*
+ * TDI recirculates what was captured, so whatever PRELOAD left in the
+ * boundary register stays there while the pins are watched.
+ */
+static int jtag_sample(struct jtag *jtag, const struct jtag_sample *opts,
+                       const char *path)
+{
+        struct sigaction sa = { .sa_handler = sample_handle_signal };
+        uint64_t origin, deadline, before, after, samples = 0;
+        uint8_t ir[SAMPLE_IR_MAX / 8], ir_out[SAMPLE_IR_MAX / 8];
+        size_t dr_len = (opts->dr_bits + 7) / 8;
+        uint8_t *tdi, *tdo, *swap;
+        struct sigaction old;
+        struct timespec ts;
+        struct rt_state rt;
+        unsigned int i;
+        FILE *out;
+        int rc;
+
+        if (!strcmp(path, "-")) {
+                out = stdout;
+        } else if (!(out = fopen(path, "w"))) {
+                rc = -errno;
+                loge("Failed to open %s: %d\n", path, rc);
+                return rc;
+        }
+
+        tdi = calloc(2, dr_len);
+        if (!tdi) {
+                rc = -ENOMEM;
+                goto cleanup_out;
+        }
+        tdo = tdi + dr_len;
+
+        for (i = 0; i < sizeof(ir); i++)
+                ir[i] = opts->ir >> (8 * i);
+
+        /* Five TMS highs reach Test-Logic-Reset from anywhere, then Idle */
+        if ((rc = sample_clock(jtag, 0x1f, 6)) < 0)
+                goto cleanup_bufs;
+
+        if ((rc = sample_scan(jtag, opts->bitbang, true, ir, ir_out,
+                              opts->ir_bits)) < 0) {
+                loge("Failed to load the instruction: %d\n", rc);
+                goto cleanup_bufs;
+        }
+
+        sigemptyset(&sa.sa_mask);
+        sigaction(SIGINT, &sa, &old);
+
+        logi("Sampling %zu bits of DR, interrupt to stop\n", opts->dr_bits);
+
+        rt_enter(&rt, "jtag-sample");
+
+        origin = deadline = sample_now_ns();
+        while (!sample_stop_requested &&
+               (!opts->count || samples < opts->count)) {
+                before = sample_now_ns();
+                rc = sample_scan(jtag, opts->bitbang, false, tdi, tdo,
+                                 opts->dr_bits);
+                if (rc < 0) {
+                        loge("Failed to capture DR: %d\n", rc);
+                        break;
+                }
+                after = sample_now_ns();
+
+                /* The pins were captured somewhere within the scan */
+                sample_print(out, before + (after - before) / 2 - origin, tdo,
+                             opts->dr_bits);
+                samples++;
+
+                swap = tdi;
+                tdi = tdo;
+                tdo = swap;
+
+                if (!opts->interval_us)
+                        continue;
+
+                /* Keep to the schedule, dropping the slots already passed */
+                deadline += opts->interval_us * 1000;
+                if (after > deadline)
+                        deadline += ((after - deadline) / (opts->interval_us * 1000) + 1) *
+                                    opts->interval_us * 1000;
+
+                ts.tv_sec = deadline / 1000000000ULL;
+                ts.tv_nsec = deadline % 1000000000ULL;
+                while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR &&
+                       !sample_stop_requested);
+        }
+
+        rt_leave(&rt);
+
+        after = sample_now_ns();
+        logi("%" PRIu64 " samples in %.3fs: %.1f Hz\n", samples,
+             (after - origin) / 1e9,
+             after > origin ? samples * 1e9 / (after - origin) : 0.0);
+
+        sigaction(SIGINT, &old, NULL);
+        sample_stop_requested = 0;
+
+        if (fflush(out) && rc >= 0)
+                rc = -errno;
+
+cleanup_bufs:
+        free(tdi < tdo ? tdi : tdo);
+
+cleanup_out:
+        if (out != stdout)
+                fclose(out);
+
+        return rc;
+}
+
+static int sample_parse(struct jtag_sample *opts, const char *ir,
+                        const char *dr)
+{
+        unsigned long long val;
+        unsigned long bits;
+        char *end;
+
+        errno = 0;
+        bits = strtoul(ir, &end, 0);
+        if (errno || end == ir || *end != ':' || !bits || bits > SAMPLE_IR_MAX)
+                return -EINVAL;
+
+        ir = end + 1;
+        val = strtoull(ir, &end, 0);
+        if (errno || end == ir || *end ||
+                        (bits < 64 && val >> bits))
+                return -EINVAL;
+
+        opts->ir_bits = bits;
+        opts->ir = val;
+
+        bits = strtoul(dr, &end, 0);
+        if (errno || end == dr || *end || !bits || bits > SAMPLE_DR_MAX)
+                return -EINVAL;
+
+        opts->dr_bits = bits;
+
+        return 0;
+}
+
+/* Commands taken from the socket per read() */
+#define BITBANG_RX_LEN  4096
+
+static int bitbang_send(int fd, const char *buf, size_t len)
+{
+        ssize_t rc;
+
+        while (len) {
+                if ((rc = write(fd, buf, len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+
+                buf += rc;
+                len -= rc;
+        }
+
+        return 0;
+}
+
+/* Listen on @path if it isn't NULL, or @port on loopback. Returns the socket or -1 */
+static int openocd_listen(uint16_t port, const char *path)
 {
-        int server_fd;
-        int client_fd;
         struct sockaddr_in listen_addr;
-        struct sockaddr_in client_addr;
+        struct sockaddr_un unix_addr;
+        struct sockaddr *addr;
+        socklen_t addr_len;
+        struct stat st;
+        int server_fd;
         int opt = 1;
 
-        if ((server_fd = socket(PF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
-                loge("socket() failed: %s\n", strerror(errno));
-                return 1;
+        if (path) {
+                memset(&unix_addr, 0, sizeof(unix_addr));
+                unix_addr.sun_family = AF_UNIX;
+                if (strlen(path) >= sizeof(unix_addr.sun_path)) {
+                        loge("Socket path too long: %s\n", path);
+                        return -1;
+                }
+                strcpy(unix_addr.sun_path, path);
+                addr = (struct sockaddr *)&unix_addr;
+                addr_len = sizeof(unix_addr);
+
+                /* Replace a socket left behind by an earlier run, but nothing else */
+                if (!stat(path, &st) && S_ISSOCK(st.st_mode))
+                        unlink(path);
+
+                server_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        } else {
+                memset(&listen_addr, 0, sizeof(listen_addr));
+                listen_addr.sin_family = AF_INET;
+                listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+                listen_addr.sin_port = htons(port);
+                addr = (struct sockaddr *)&listen_addr;
+                addr_len = sizeof(listen_addr);
+
+                server_fd = socket(PF_INET, SOCK_STREAM | SOCK_CLOEXEC, IPPROTO_TCP);
         }
 
-        setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        if (server_fd < 0) {
+                loge("socket() failed: %s\n", strerror(errno));
+                return -1;
+        }
 
-        memset(&listen_addr, 0, sizeof(listen_addr));
-        listen_addr.sin_family = AF_INET;
-        listen_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-        listen_addr.sin_port = htons(port);
+        if (!path) {
+                setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+                setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+        }
 
-        if (bind(server_fd, (struct sockaddr *)&listen_addr, sizeof(listen_addr)) < 0) {
+        if (bind(server_fd, addr, addr_len) < 0) {
                 loge("bind() failed: %s\n", strerror(errno));
-                return 1;
+                close(server_fd);
+                return -1;
         }
         if (listen(server_fd, 5) < 0) {
                 loge("listen() failed: %s\n", strerror(errno));
-                return 1;
+                close(server_fd);
+                return -1;
         }
 
-        logi("Ready to accept OpenOCD remote_bitbang connection on 127.0.0.1:%u\n", port);
+        if (path)
+                logi("Ready to accept OpenOCD connections on %s\n", path);
+        else
+                logi("Ready to accept OpenOCD connections on 127.0.0.1:%u\n", port);
 
-        while (true) {
-                socklen_t addr_len = sizeof(client_addr);
+        return server_fd;
+}
 
-                if ((client_fd = accept(server_fd, (struct sockaddr *)&client_addr, &addr_len)) < 0) {
+static int openocd_accept(int server_fd)
+{
+        int client_fd;
+
+        while ((client_fd = accept(server_fd, NULL, NULL)) < 0) {
+                if (errno != EINTR) {
                         loge("accept() failed: %s\n", strerror(errno));
-                        return 1;
+                        return -1;
                 }
+        }
 
-                logi("New connection from %s\n", inet_ntoa(client_addr.sin_addr));
-
-                while (true) {
-			int rc;
-			uint8_t state;
-			uint8_t tdo;
-                        uint8_t tdi;
-                        uint8_t tms;
-                        uint8_t tck;
-
-                        char command = 0;
-                        ssize_t n = read(client_fd, &command, 1);
-                        if (n <= 0) {
-                                loge("Client closed connection\n");
-                                close(server_fd);
-                                return 1;
-                        }
+        logi("New OpenOCD connection\n");
+
+        return client_fd;
+}
+
+/* Returns once the client goes away, or on failure to drive the TAP */
+static int bitbang_serve_client(struct jtag *jtag, int client_fd)
+{
+        static char cmds[BITBANG_RX_LEN], rsp[BITBANG_RX_LEN];
+        static uint8_t states[BITBANG_RX_LEN];
+        int last = -1;
+
+        while (true) {
+                size_t nstates = 0, nrsp = 0;
+                ssize_t i, n;
+                int rc;
 
-                        switch (command) {
+                n = read(client_fd, cmds, sizeof(cmds));
+                if (n < 0 && errno == EINTR)
+                        continue;
+                if (n <= 0) {
+                        logi("Client closed connection\n");
+                        return 0;
+                }
+
+                for (i = 0; i < n; i++) {
+                        uint8_t state;
+                        uint8_t tdo;
+
+                        switch (cmds[i]) {
                         /* LED blink commands */
                         case 'B':
                         case 'b':
                                 break;
                         /* Read state */
                         case 'R':
+                                /* TDO has to reflect the states before it */
+                                rc = jtag_bitbang_set_states(jtag, states, nstates);
+                                if (rc < 0) {
+                                        loge("jtag_bitbang_set_states() failed: %d\n", rc);
+                                        return -EIO;
+                                }
+                                nstates = 0;
+
                                 rc = jtag_bitbang_get(jtag, &tdo);
                                 if (rc < 0) {
                                         loge("jtag_bitbang_get() failed\n");
-                                        return 1;
+                                        return -EIO;
                                 }
 
                                 // send ASCII 0 or 1 for TDO state
-                                tdo += '0';
-                                rc = write(client_fd, &tdo, 1);
-                                if (rc < 0) {
-                                        loge("write(client_fd) failed: %d\n", rc);
-                                        return 1;
-                                }
+                                rsp[nrsp++] = tdo + '0';
                                 break;
                         case 'Q':
                                 logi("Received quit request from OpenOCD\n");
-                                close(client_fd);
-                                close(server_fd);
-                                return 1;
+                                jtag_bitbang_set_states(jtag, states, nstates);
+                                bitbang_send(client_fd, rsp, nrsp);
+                                return 0;
                         /* Data requests */
                         case '0'...'7':
-                                state = command - '0';
-
-                                tdi = !!(state & 1);
-                                tms = !!(state & 2);
-                                tck = !!(state & 4);
-
-                                rc = jtag_bitbang_set(jtag, tck, tms, tdi);
-                                if (rc < 0) {
-                                        loge("jtag_bitbang_set() failed: %d\n", rc);
-                                        return 1;
+                                /* Writing the state already driven changes nothing */
+                                state = cmds[i] - '0';
+                                if (state != last) {
+                                        states[nstates++] = state;
+                                        last = state;
                                 }
                                 break;
                         /* Reset requests */
@@ -141,12 +451,375 @@ static int run_openocd_bitbang_server(struct jtag *jtag, uint16_t port)
                                 logt("Received reset request from OpenOCD, currently unsupported\n");
                                 break;
                         default:
-                                loge("Received unknown command from OpenOCD: %c\n", command);
-                        } 
+                                loge("Received unknown command from OpenOCD: %c\n", cmds[i]);
+                        }
+                }
+
+                /* Everything received is done before waiting on the client again */
+                rc = jtag_bitbang_set_states(jtag, states, nstates);
+                if (rc < 0) {
+                        loge("jtag_bitbang_set_states() failed: %d\n", rc);
+                        return -EIO;
+                }
+
+                if ((rc = bitbang_send(client_fd, rsp, nrsp)) < 0) {
+                        loge("write(client_fd) failed: %d\n", rc);
+                        return -EIO;
                 }
         }
 }
 
+static int run_openocd_bitbang_server(struct jtag *jtag, int server_fd)
+{
+        struct rt_state rt;
+        int client_fd;
+        int rc;
+
+        rt_enter(&rt, "remote_bitbang");
+
+        /* Clients are served in turn, they'd otherwise fight over the one TAP */
+        while ((client_fd = openocd_accept(server_fd)) >= 0) {
+                if ((rc = bitbang_serve_client(jtag, client_fd)) < 0)
+                        loge("Dropped remote_bitbang client: %d\n", rc);
+
+                close(client_fd);
+        }
+
+        rt_leave(&rt);
+
+        return -EIO;
+}
+
+/*
+ * OpenOCD's jtag_vpi protocol: fixed-size commands carrying TMS sequences and
+ * scans of up to 4096 bits, little-endian. Scans are answered with the command
+ * echoed back, TDO in the input buffer.
+ */
+#define VPI_XFER_MAX            512
+#define VPI_CMD_LEN             (4 + 2 * VPI_XFER_MAX + 4 + 4)
+#define VPI_CMD_OUT             4
+#define VPI_CMD_IN              (VPI_CMD_OUT + VPI_XFER_MAX)
+#define VPI_CMD_BYTES           (VPI_CMD_IN + VPI_XFER_MAX)
+#define VPI_CMD_BITS            (VPI_CMD_BYTES + 4)
+
+enum vpi_cmd {
+        vpi_cmd_reset = 0,
+        vpi_cmd_tms_seq,
+        vpi_cmd_scan_chain,
+        vpi_cmd_scan_chain_flip_tms,
+        vpi_cmd_stop_simu,
+};
+
+/* The moves the shift engine makes itself on its way from Run-Test/Idle */
+static const uint8_t vpi_idle_to_drshift[] = { 1, 0, 0 };
+static const uint8_t vpi_idle_to_irshift[] = { 1, 1, 0, 0 };
+
+#define VPI_PENDING_MAX         256
+
+/*
+ * TMS moves are held back until a scan shows whether the engine can make them
+ * instead. @real is where the TAP is, and @pending the moves from there to
+ * where OpenOCD believes it to be.
+ */
+struct vpi_server {
+        struct jtag *jtag;
+        enum tap_state real;
+        uint8_t pending[VPI_PENDING_MAX];
+        size_t npending;
+        /*
+         * After an engine scan the TAP is in Run-Test/Idle while OpenOCD has
+         * it in Exit1. The two agree on everything after an Update, so that
+         * has to be the next move.
+         */
+        bool in_exit1;
+};
+
+static uint32_t vpi_get_le32(const uint8_t *p)
+{
+        return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static int vpi_flush(struct vpi_server *vpi, size_t count)
+{
+        uint8_t states[2 * VPI_PENDING_MAX];
+        size_t i;
+        int rc;
+
+        for (i = 0; i < count; i++) {
+                states[2 * i] = vpi->pending[i] << 1;
+                states[2 * i + 1] = 4 | (vpi->pending[i] << 1);
+                vpi->real = jtag_tap_next[vpi->real][vpi->pending[i]];
+        }
+
+        if ((rc = jtag_bitbang_set_states(vpi->jtag, states, 2 * count)) < 0)
+                return rc;
+
+        memmove(vpi->pending, &vpi->pending[count], vpi->npending - count);
+        vpi->npending -= count;
+
+        return 0;
+}
+
+static int vpi_tms_seq(struct vpi_server *vpi, const uint8_t *tms, size_t bits)
+{
+        size_t i;
+        int rc;
+
+        for (i = 0; i < bits; i++) {
+                uint8_t bit = (tms[i / 8] >> (i % 8)) & 1;
+
+                if (vpi->in_exit1) {
+                        if (!bit) {
+                                loge("Moving to Pause after a shift engine scan is unsupported\n");
+                                return -EPROTO;
+                        }
+                        /* Exit1 to Update, which Run-Test/Idle stands in for */
+                        vpi->in_exit1 = false;
+                        continue;
+                }
+
+                if (vpi->npending == VPI_PENDING_MAX &&
+                                (rc = vpi_flush(vpi, vpi->npending)) < 0)
+                        return rc;
+
+                vpi->pending[vpi->npending++] = bit;
+        }
+
+        return 0;
+}
+
+/* Where the pending moves would leave the TAP */
+static enum tap_state vpi_virtual(struct vpi_server *vpi)
+{
+        enum tap_state state = vpi->real;
+        size_t i;
+
+        for (i = 0; i < vpi->npending; i++)
+                state = jtag_tap_next[state][vpi->pending[i]];
+
+        return state;
+}
+
+/*
+ * Whether the pending moves end with the engine's own path from
+ * Run-Test/Idle to Shift-xR, in which case @prefix gets the moves before it.
+ */
+static bool vpi_engine_can_scan(struct vpi_server *vpi, bool *ir,
+                                size_t *prefix)
+{
+        const uint8_t *path;
+        enum tap_state state = vpi->real;
+        ssize_t idle = -1;
+        size_t i, len;
+
+        if (vpi->in_exit1)
+                return false;
+
+        for (i = 0; i <= vpi->npending; i++) {
+                if (state == tap_idle)
+                        idle = i;
+                if (i < vpi->npending)
+                        state = jtag_tap_next[state][vpi->pending[i]];
+        }
+
+        if (idle < 0 || (state != tap_drshift && state != tap_irshift))
+                return false;
+
+        *ir = state == tap_irshift;
+        path = *ir ? vpi_idle_to_irshift : vpi_idle_to_drshift;
+        len = *ir ? sizeof(vpi_idle_to_irshift) : sizeof(vpi_idle_to_drshift);
+
+        if (vpi->npending - idle != len ||
+                        memcmp(&vpi->pending[idle], path, len))
+                return false;
+
+        *prefix = idle;
+
+        return true;
+}
+
+/* Clock @bits through whatever state OpenOCD has the TAP in, by bit-bang */
+static int vpi_soft_scan(struct vpi_server *vpi, const uint8_t *tdi,
+                         uint8_t *tdo, size_t bits, bool flip)
+{
+        size_t i;
+        int rc;
+
+        if (vpi->in_exit1) {
+                loge("Scanning from Exit1 after a shift engine scan is unsupported\n");
+                return -EPROTO;
+        }
+
+        if ((rc = vpi_flush(vpi, vpi->npending)) < 0)
+                return rc;
+
+        memset(tdo, 0, (bits + 7) / 8);
+
+        for (i = 0; i < bits; i++) {
+                uint8_t tms = flip && i == bits - 1;
+                uint8_t bit = (tdi[i / 8] >> (i % 8)) & 1;
+                uint8_t out;
+
+                if ((rc = jtag_bitbang_set(vpi->jtag, 0, tms, bit)) < 0)
+                        return rc;
+
+                if ((rc = jtag_bitbang_get(vpi->jtag, &out)) < 0)
+                        return rc;
+
+                if ((rc = jtag_bitbang_set(vpi->jtag, 1, tms, bit)) < 0)
+                        return rc;
+
+                tdo[i / 8] |= out << (i % 8);
+                vpi->real = jtag_tap_next[vpi->real][tms];
+        }
+
+        return 0;
+}
+
+static int vpi_scan(struct vpi_server *vpi, const uint8_t *tdi, uint8_t *tdo,
+                    size_t bits, bool flip)
+{
+        size_t prefix;
+        bool ir;
+        int rc;
+
+        /* The engine always finishes a scan with TMS raised on the last bit */
+        if (!flip || !vpi_engine_can_scan(vpi, &ir, &prefix))
+                return vpi_soft_scan(vpi, tdi, tdo, bits, flip);
+
+        if ((rc = vpi_flush(vpi, prefix)) < 0)
+                return rc;
+
+        vpi->npending = 0;
+
+        if ((rc = jtag_shift(vpi->jtag, ir, tdi, tdo, bits)) < 0)
+                return rc;
+
+        vpi->real = tap_idle;
+        vpi->in_exit1 = true;
+
+        return 0;
+}
+
+static int vpi_reset(struct vpi_server *vpi)
+{
+        int rc;
+
+        vpi->in_exit1 = false;
+
+        /* Five clocks with TMS high reach Test-Logic-Reset from anywhere */
+        memset(vpi->pending, 1, 5);
+        vpi->npending = 5;
+
+        if ((rc = vpi_flush(vpi, vpi->npending)) < 0)
+                return rc;
+
+        vpi->real = tap_reset;
+
+        return 0;
+}
+
+static int vpi_recv(int fd, uint8_t *buf, size_t len)
+{
+        ssize_t rc;
+
+        while (len) {
+                if ((rc = read(fd, buf, len)) < 0) {
+                        if (errno == EINTR)
+                                continue;
+                        return -errno;
+                }
+
+                if (!rc)
+                        return -ECONNRESET;
+
+                buf += rc;
+                len -= rc;
+        }
+
+        return 0;
+}
+
+static int vpi_serve_client(struct vpi_server *vpi, int client_fd)
+{
+        static uint8_t cmd[VPI_CMD_LEN];
+        uint32_t bits;
+        int rc;
+
+        vpi->real = tap_reset;
+        vpi->npending = 0;
+        vpi->in_exit1 = false;
+
+        while (true) {
+                if ((rc = vpi_recv(client_fd, cmd, sizeof(cmd))) < 0)
+                        return rc;
+
+                bits = vpi_get_le32(&cmd[VPI_CMD_BITS]);
+                if (bits > VPI_XFER_MAX * 8) {
+                        loge("Received oversized jtag_vpi command: %" PRIu32 " bits\n",
+                             bits);
+                        return -EMSGSIZE;
+                }
+
+                switch (vpi_get_le32(cmd)) {
+                case vpi_cmd_reset:
+                        rc = vpi_reset(vpi);
+                        break;
+                case vpi_cmd_tms_seq:
+                        rc = vpi_tms_seq(vpi, &cmd[VPI_CMD_OUT], bits);
+                        break;
+                case vpi_cmd_scan_chain:
+                case vpi_cmd_scan_chain_flip_tms:
+                        if (!bits) {
+                                rc = -EINVAL;
+                                break;
+                        }
+
+                        rc = vpi_scan(vpi, &cmd[VPI_CMD_OUT], &cmd[VPI_CMD_IN],
+                                      bits,
+                                      vpi_get_le32(cmd) == vpi_cmd_scan_chain_flip_tms);
+                        if (!rc)
+                                rc = bitbang_send(client_fd, (char *)cmd,
+                                                  sizeof(cmd));
+                        break;
+                case vpi_cmd_stop_simu:
+                        logi("Received stop request from OpenOCD\n");
+                        return 0;
+                default:
+                        loge("Received unknown jtag_vpi command: %" PRIu32 "\n",
+                             vpi_get_le32(cmd));
+                        rc = -EPROTO;
+                }
+
+                if (rc < 0)
+                        return rc;
+
+                logt("jtag_vpi: TAP in state %d, %zu moves pending\n",
+                     vpi_virtual(vpi), vpi->npending);
+        }
+}
+
+static int run_openocd_vpi_server(struct jtag *jtag, int server_fd)
+{
+        struct vpi_server vpi = { .jtag = jtag };
+        struct rt_state rt;
+        int client_fd;
+        int rc;
+
+        rt_enter(&rt, "jtag_vpi");
+
+        while ((client_fd = openocd_accept(server_fd)) >= 0) {
+                if ((rc = vpi_serve_client(&vpi, client_fd)) < 0)
+                        loge("Dropped jtag_vpi client: %d\n", rc);
+
+                close(client_fd);
+        }
+
+        rt_leave(&rt);
+
+        return -EIO;
+}
+
 int cmd_jtag(const char *name, int argc, char *argv[])
 {
         struct host _host, *host = &_host;
@@ -157,6 +830,14 @@ int cmd_jtag(const char *name, int argc, char *argv[])
         uint32_t target_bits = SCU_JTAG_MASTER_TO_ARM;
         int port = 33333;
         const char *controller = "jtag";
+        const char *path = NULL;
+        const char *svf = NULL;
+        struct jtag_sample sample = { 0 };
+        const char *sample_path = NULL;
+        bool bitbang = false;
+        bool vpi = false;
+        struct rt_state rt;
+        int server_fd;
 
         // getopt() expects the first argument to be a program name
         // somewhat ugly trick, but works
@@ -168,18 +849,26 @@ int cmd_jtag(const char *name, int argc, char *argv[])
                 int c;
 
                 static struct option long_options[] = {
+                        { "bitbang", no_argument, NULL, 'b' },
                         { "controller", required_argument, NULL, 'c' },
+                        { "count", required_argument, NULL, 'n' },
                         { "help", no_argument, NULL, 'h' },
+                        { "interval", required_argument, NULL, 'i' },
                         { "port", required_argument, NULL, 'p' },
+                        { "socket", required_argument, NULL, 's' },
                         { "target", required_argument, NULL, 't' },
+                        { "vpi", no_argument, NULL, 'v' },
                         { },
                 };
 
-                c = getopt_long(argc, argv, "c:hp:t:", long_options, &option_index);
+                c = getopt_long(argc, argv, "bc:hi:n:p:s:t:v", long_options, &option_index);
                 if (c == -1)
                         break;
 
                 switch (c) {
+                        case 'b':
+                                bitbang = true;
+                                break;
                         case 'c':
                                 controller = optarg;
                                 break;
@@ -187,6 +876,27 @@ int cmd_jtag(const char *name, int argc, char *argv[])
                                 cmd_jtag_help(name, argc, argv);
                                 rc = EXIT_SUCCESS;
                                 goto done;
+                        case 'i':
+                        case 'n':
+                        {
+                                unsigned long long val;
+                                char *end;
+
+                                errno = 0;
+                                val = strtoull(optarg, &end, 0);
+                                if (errno || end == optarg || *end) {
+                                        loge("Invalid %s '%s'\n",
+                                             c == 'i' ? "interval" : "count", optarg);
+                                        rc = EXIT_FAILURE;
+                                        goto done;
+                                }
+
+                                if (c == 'i')
+                                        sample.interval_us = val;
+                                else
+                                        sample.count = val;
+                                break;
+                        }
                         case 'p':
                                 port = atoi(optarg);
                                 if (!port || port > UINT16_MAX) {
@@ -195,6 +905,9 @@ int cmd_jtag(const char *name, int argc, char *argv[])
                                         goto done;
                                 }
                                 break;
+                        case 's':
+                                path = optarg;
+                                break;
                         case 't':
                         {
                                 if (!strcmp("arm", optarg)) {
@@ -214,6 +927,9 @@ int cmd_jtag(const char *name, int argc, char *argv[])
                                 }
                                 break;
                         }
+                        case 'v':
+                                vpi = true;
+                                break;
                         case '?':
                                 loge("Unknown command line option: %s\n", optopt);
                                 rc = EXIT_FAILURE;
@@ -221,6 +937,34 @@ int cmd_jtag(const char *name, int argc, char *argv[])
                 }
         }
 
+        if (optind < argc && !strcmp("play", argv[optind])) {
+                if (optind + 1 >= argc) {
+                        loge("Not enough arguments for `jtag play` command\n");
+                        rc = EXIT_FAILURE;
+                        goto done;
+                }
+
+                svf = argv[optind + 1];
+                optind += 2;
+        } else if (optind < argc && !strcmp("sample", argv[optind])) {
+                if (optind + 3 >= argc) {
+                        loge("Not enough arguments for `jtag sample` command\n");
+                        rc = EXIT_FAILURE;
+                        goto done;
+                }
+
+                if (sample_parse(&sample, argv[optind + 1], argv[optind + 2]) < 0) {
+                        loge("Expected IR-BITS:IR and DR-BITS, found '%s' and '%s'\n",
+                             argv[optind + 1], argv[optind + 2]);
+                        rc = EXIT_FAILURE;
+                        goto done;
+                }
+
+                sample.bitbang = bitbang;
+                sample_path = argv[optind + 3];
+                optind += 4;
+        }
+
         if ((rc = host_init(host, argc - optind, &argv[optind])) < 0) {
                 loge("Failed to initialise host interfaces: %d\n", rc);
                 rc = EXIT_FAILURE;
@@ -247,10 +991,36 @@ int cmd_jtag(const char *name, int argc, char *argv[])
 
         jtag_route(jtag, target_bits);
 
-        while (true) {
-                run_openocd_bitbang_server(jtag, port);
+        /* Played straight to the controller, there's no OpenOCD in the way */
+        if (svf) {
+                rt_enter(&rt, "svf");
+                rc = svf_play(jtag, svf, bitbang) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+                rt_leave(&rt);
+                goto cleanup_soc;
         }
 
+        if (sample_path) {
+                rc = jtag_sample(jtag, &sample, sample_path) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+                goto cleanup_soc;
+        }
+
+        /* The listener outlives each client, the setup above is done once */
+        if ((server_fd = openocd_listen(port, path)) < 0) {
+                rc = EXIT_FAILURE;
+                goto cleanup_soc;
+        }
+
+        if (vpi)
+                run_openocd_vpi_server(jtag, server_fd);
+        else
+                run_openocd_bitbang_server(jtag, server_fd);
+
+        rc = EXIT_FAILURE;
+
+        close(server_fd);
+        if (path)
+                unlink(path);
+
 cleanup_soc:
         soc_destroy(soc);
 
@@ -0,0 +1,295 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "host.h"
+#include "image.h"
+#include "log.h"
+#include "progress.h"
+#include "soc.h"
+#include "soc/lpcctl.h"
+#include "soc/sdmc.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LPCFW_CHUNK (1 << 20)
+
+/*
+ * Copy the image into the DRAM behind the window. Whatever follows a short
+ * image is left as it was, so the host sees the rest of the region's contents.
+ */
+static int lpcfw_load_image(struct soc *soc, const char *path, uint32_t phys,
+                            uint32_t size)
+{
+    struct image_source src;
+    struct progress progress;
+    const char *buf = NULL;
+    uint64_t loaded = 0;
+    ssize_t ingress;
+    size_t len;
+    int rc = 0;
+
+    if ((rc = image_source_open(&src, path, LPCFW_CHUNK)) < 0) {
+        loge("Failed to open the firmware image: %d\n", rc);
+        return rc;
+    }
+
+    image_source_map(&src, &len);
+    progress_init(&progress, "load", len);
+    while ((ingress = image_source_next(&src, &buf)) > 0) {
+        if (loaded + ingress > size) {
+            loge("Firmware image exceeds the %" PRIu32 " byte window\n", size);
+            rc = -EFBIG;
+            break;
+        }
+
+        if ((rc = soc_write(soc, phys + loaded, buf, ingress)) < 0) {
+            loge("Failed to write the image to 0x%08" PRIx64 ": %d\n",
+                 phys + loaded, rc);
+            break;
+        }
+
+        loaded += ingress;
+        progress_update(&progress, ingress);
+    }
+    progress_end(&progress);
+
+    image_source_close(&src);
+
+    if (ingress < 0)
+        return ingress;
+
+    if (!rc && loaded < size)
+        logi("Loaded %" PRIu64 " bytes, short of the %" PRIu32 " byte window\n",
+             loaded, size);
+
+    return rc;
+}
+
+static int lpcfw_load(struct soc *soc, struct ahb *ahb, const char *path,
+                      uint32_t phys, uint32_t size, uint32_t lpc)
+{
+    struct soc_region dram;
+    struct lpcctl *lpcctl;
+    struct sdmc *sdmc;
+    int rc;
+
+    /* The bridge moves HICR7 and HICR8 about for its own accesses */
+    if (!strcmp(ahb->drv->name, "l2a")) {
+        loge("The L2A bridge can't be used to set up the LPC firmware window\n");
+        return -EBUSY;
+    }
+
+    if (size < (1 << 16) || (size & (size - 1)) || ((phys | lpc) & (size - 1))) {
+        loge("The window must be a power of two of at least 64KiB, with the "
+             "DRAM and LPC addresses aligned to it\n");
+        return -EINVAL;
+    }
+
+    if (!(sdmc = sdmc_get(soc))) {
+        loge("Failed to acquire SDRAM memory controller\n");
+        return -ENODEV;
+    }
+
+    if ((rc = sdmc_get_dram(sdmc, &dram))) {
+        loge("Failed to locate DRAM: %d\n", rc);
+        return rc;
+    }
+
+    if (phys < dram.start ||
+            (uint64_t)phys + size > (uint64_t)dram.start + dram.length) {
+        loge("The window must lie in DRAM\n");
+        return -EINVAL;
+    }
+
+    if (!(lpcctl = lpcctl_get(soc))) {
+        loge("Failed to acquire LPC controller\n");
+        return -ENODEV;
+    }
+
+    /* Don't let the host fetch a half-written image */
+    if ((rc = lpcctl_fw_unmap(lpcctl)) < 0) {
+        loge("Failed to disable the LPC firmware window: %d\n", rc);
+        return rc;
+    }
+
+    if ((rc = lpcfw_load_image(soc, path, phys, size)) < 0)
+        return rc;
+
+    if ((rc = lpcctl_fw_map(lpcctl, phys, size, lpc)) < 0) {
+        loge("Failed to map the LPC firmware window: %d\n", rc);
+        return rc;
+    }
+
+    logi("LPC firmware 0x%08" PRIx32 "-0x%08" PRIx32 " now reads DRAM at 0x%08"
+         PRIx32 "\n", lpc, lpc + size - 1, phys);
+
+    return 0;
+}
+
+static int lpcfw_status(struct soc *soc)
+{
+    struct lpcctl *lpcctl;
+    struct lpcctl_fw fw;
+    int rc;
+
+    if (!(lpcctl = lpcctl_get(soc))) {
+        loge("Failed to acquire LPC controller\n");
+        return -ENODEV;
+    }
+
+    if ((rc = lpcctl_fw_status(lpcctl, &fw)) < 0) {
+        loge("Failed to read the LPC firmware window: %d\n", rc);
+        return rc;
+    }
+
+    printf("LPC firmware window: %s\n", fw.enabled ? "Enabled" : "Disabled");
+    printf("\tLPC: 0x%08" PRIx32 "-0x%08" PRIx32 "\n", fw.lpc,
+           fw.lpc + fw.ahb.length - 1);
+    printf("\tAHB: 0x%08" PRIx32 "-0x%08" PRIx32 "\n", fw.ahb.start,
+           fw.ahb.start + fw.ahb.length - 1);
+
+    return 0;
+}
+
+static int lpcfw_unmap(struct soc *soc)
+{
+    struct lpcctl *lpcctl;
+    int rc;
+
+    if (!(lpcctl = lpcctl_get(soc))) {
+        loge("Failed to acquire LPC controller\n");
+        return -ENODEV;
+    }
+
+    if ((rc = lpcctl_fw_unmap(lpcctl)) < 0)
+        loge("Failed to disable the LPC firmware window: %d\n", rc);
+
+    return rc;
+}
+
+static int lpcfw_parse_u32(const char *arg, const char *what, uint32_t *val)
+{
+    unsigned long parsed;
+    char *endp;
+
+    errno = 0;
+    parsed = strtoul(arg, &endp, 0);
+    if (errno || *endp || parsed > UINT32_MAX) {
+        loge("Invalid %s '%s'\n", what, arg);
+        return -EINVAL;
+    }
+
+    *val = parsed;
+
+    return 0;
+}
+
+int cmd_lpcfw(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    const char *path = NULL;
+    uint32_t phys = 0, size = 0;
+    uint32_t lpc = 0;
+    const char *op;
+    struct ahb *ahb;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "file", required_argument, NULL, 'f' },
+            { "lpc-offset", required_argument, NULL, 'o' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "f:o:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'f':
+                path = optarg;
+                break;
+            case 'o':
+                if ((rc = lpcfw_parse_u32(optarg, "LPC offset", &lpc)) < 0)
+                    return rc;
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        loge("Not enough arguments for lpcfw command\n");
+        return -EINVAL;
+    }
+
+    op = argv[0];
+    argc--;
+    argv++;
+
+    if (!strcmp("load", op)) {
+        if (argc < 2) {
+            loge("Not enough arguments for `lpcfw load` command\n");
+            return -EINVAL;
+        }
+
+        if ((rc = lpcfw_parse_u32(argv[0], "DRAM address", &phys)) < 0)
+            return rc;
+
+        if ((rc = lpcfw_parse_u32(argv[1], "window length", &size)) < 0)
+            return rc;
+
+        argc -= 2;
+        argv += 2;
+    } else if (strcmp("status", op) && strcmp("unmap", op)) {
+        loge("Unsupported lpcfw operation '%s'\n", op);
+        return -EINVAL;
+    } else if (path || lpc) {
+        loge("--file and --lpc-offset only apply to `lpcfw load`\n");
+        return -EINVAL;
+    }
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0) {
+        loge("Failed to probe SoC: %d\n", rc);
+        goto cleanup_host;
+    }
+
+    if (!strcmp("load", op))
+        rc = lpcfw_load(soc, ahb, path, phys, size, lpc);
+    else if (!strcmp("status", op))
+        rc = lpcfw_status(soc);
+    else
+        rc = lpcfw_unmap(soc);
+
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
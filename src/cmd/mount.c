@@ -0,0 +1,824 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "config.h"
+#include "flash.h"
+#include "host.h"
+#include "log.h"
+#include "soc.h"
+#include "soc/sdmc.h"
+#include "soc/sfc.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if HAVE_FUSE
+#include <dirent.h>
+#include <fcntl.h>
+#include <linux/fuse.h>
+#include <signal.h>
+#include <sys/mount.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+/*
+ * Serves BMC DRAM and flash as read-only files under a FUSE mount, speaking
+ * the kernel's protocol on /dev/fuse directly. Reads are satisfied from a
+ * bounded cache of blocks, and a miss in a run of sequential reads fetches
+ * the blocks after it in the same bridge transfer. Nothing is read until a
+ * tool asks for it, so analysis can start as soon as the mount is up.
+ *
+ * The contents are as they were when each block was first fetched. The
+ * kernel's page cache is allowed to keep them too, so a busy BMC's DRAM is a
+ * view assembled over time rather than a consistent snapshot.
+ */
+#define MOUNT_BLOCK             (64 << 10)
+#define MOUNT_CACHE_DEFAULT     (64 << 20)
+#define MOUNT_READAHEAD_DEFAULT (1 << 20)
+/* The largest read the kernel is told to send */
+#define MOUNT_READ_MAX          (128 << 10)
+/* Requests other than writes are small, and there are no writes */
+#define MOUNT_REQ_LEN           (FUSE_MIN_READ_BUFFER + 4096)
+#define MOUNT_ATTR_VALID        3600
+
+#define MOUNT_MAX_FILES         2
+
+struct mount;
+
+struct mount_file {
+    const char *name;
+    uint64_t ino;
+    uint64_t size;
+    int (*fetch)(struct mount *ctx, struct mount_file *file, uint64_t offset,
+                 void *buf, size_t len);
+    uint32_t base;
+    /* The block after the last one read, to spot sequential access */
+    uint64_t next;
+};
+
+struct mount_block {
+    struct mount_file *file;
+    uint64_t index;
+    uint64_t used;
+    bool valid;
+    uint8_t *data;
+};
+
+struct mount {
+    struct soc *soc;
+    struct flash_chip *chip;
+    struct mount_file files[MOUNT_MAX_FILES];
+    size_t nfiles;
+    struct mount_block *blocks;
+    size_t nblocks;
+    uint8_t *arena;
+    /* Where a run of blocks lands before it's split between them */
+    uint8_t *staging;
+    size_t readahead;
+    uint64_t clock;
+    uint64_t hits;
+    uint64_t misses;
+    uint8_t *reply;
+    uid_t uid;
+    gid_t gid;
+};
+
+static volatile sig_atomic_t mount_stop;
+
+static void mount_handle_signal(int signo __unused)
+{
+    mount_stop = 1;
+}
+
+static int mount_fetch_ram(struct mount *ctx, struct mount_file *file,
+                           uint64_t offset, void *buf, size_t len)
+{
+    ssize_t rc;
+
+    if ((rc = soc_read(ctx->soc, file->base + offset, buf, len)) < 0)
+        return rc;
+
+    return (size_t)rc == len ? 0 : -EIO;
+}
+
+static int mount_fetch_flash(struct mount *ctx, struct mount_file *file __unused,
+                             uint64_t offset, void *buf, size_t len)
+{
+    int rc;
+
+    if ((rc = flash_read(ctx->chip, offset, buf, len)) < 0)
+        return rc;
+
+    return 0;
+}
+
+static struct mount_block *mount_cache_find(struct mount *ctx,
+                                            struct mount_file *file,
+                                            uint64_t index)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nblocks; i++) {
+        struct mount_block *blk = &ctx->blocks[i];
+
+        if (blk->valid && blk->file == file && blk->index == index)
+            return blk;
+    }
+
+    return NULL;
+}
+
+static struct mount_block *mount_cache_victim(struct mount *ctx)
+{
+    struct mount_block *victim = &ctx->blocks[0];
+    size_t i;
+
+    for (i = 0; i < ctx->nblocks; i++) {
+        struct mount_block *blk = &ctx->blocks[i];
+
+        if (!blk->valid)
+            return blk;
+
+        if (blk->used < victim->used)
+            victim = blk;
+    }
+
+    return victim;
+}
+
+/*
+ * Fetches the block at @index, and after a sequential miss those up to the
+ * read-ahead that follow it and aren't already held, in one transfer
+ */
+static struct mount_block *mount_cache_fill(struct mount *ctx,
+                                            struct mount_file *file,
+                                            uint64_t index, bool sequential)
+{
+    uint64_t last = (file->size - 1) / MOUNT_BLOCK;
+    size_t count = 1, want, i;
+    struct mount_block *blk, *first = NULL;
+    uint64_t offset;
+    size_t len;
+    int rc;
+
+    want = sequential ? ctx->readahead / MOUNT_BLOCK : 1;
+    if (want > ctx->nblocks / 2)
+        want = ctx->nblocks / 2 ? ctx->nblocks / 2 : 1;
+
+    while (count < want && index + count <= last &&
+           !mount_cache_find(ctx, file, index + count))
+        count++;
+
+    offset = index * MOUNT_BLOCK;
+    len = count * MOUNT_BLOCK;
+    if (offset + len > file->size)
+        len = file->size - offset;
+
+    if ((rc = file->fetch(ctx, file, offset, ctx->staging, len)) < 0) {
+        loge("Failed to read %s at 0x%" PRIx64 ": %d\n", file->name, offset, rc);
+        return NULL;
+    }
+
+    for (i = 0; i < count; i++) {
+        size_t chunk = len - i * MOUNT_BLOCK;
+
+        if (chunk > MOUNT_BLOCK)
+            chunk = MOUNT_BLOCK;
+
+        blk = mount_cache_victim(ctx);
+        memcpy(blk->data, ctx->staging + i * MOUNT_BLOCK, chunk);
+        blk->file = file;
+        blk->index = index + i;
+        blk->used = ++ctx->clock;
+        blk->valid = true;
+
+        if (!first)
+            first = blk;
+    }
+
+    /* The run's first block is the one wanted, keep it warmest */
+    first->used = ++ctx->clock;
+
+    return first;
+}
+
+static ssize_t mount_read(struct mount *ctx, struct mount_file *file,
+                          uint64_t offset, size_t len, uint8_t *buf)
+{
+    size_t done = 0;
+
+    if (offset >= file->size)
+        return 0;
+
+    if (len > file->size - offset)
+        len = file->size - offset;
+
+    while (done < len) {
+        uint64_t index = (offset + done) / MOUNT_BLOCK;
+        size_t within = (offset + done) % MOUNT_BLOCK;
+        size_t chunk = MOUNT_BLOCK - within;
+        struct mount_block *blk;
+
+        if (chunk > len - done)
+            chunk = len - done;
+
+        if ((blk = mount_cache_find(ctx, file, index))) {
+            blk->used = ++ctx->clock;
+            ctx->hits++;
+        } else {
+            ctx->misses++;
+            blk = mount_cache_fill(ctx, file, index,
+                                   index == file->next || index == file->next - 1);
+            if (!blk)
+                return -EIO;
+        }
+
+        memcpy(buf + done, blk->data + within, chunk);
+        file->next = index + 1;
+        done += chunk;
+    }
+
+    return done;
+}
+
+static struct mount_file *mount_file_by_ino(struct mount *ctx, uint64_t ino)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nfiles; i++) {
+        if (ctx->files[i].ino == ino)
+            return &ctx->files[i];
+    }
+
+    return NULL;
+}
+
+static int mount_add_file(struct mount *ctx, const char *name, uint64_t size,
+                          uint32_t base,
+                          int (*fetch)(struct mount *, struct mount_file *,
+                                       uint64_t, void *, size_t))
+{
+    struct mount_file *file;
+
+    if (ctx->nfiles == MOUNT_MAX_FILES || !size)
+        return -EINVAL;
+
+    file = &ctx->files[ctx->nfiles];
+    file->name = name;
+    file->ino = FUSE_ROOT_ID + 1 + ctx->nfiles;
+    file->size = size;
+    file->base = base;
+    file->fetch = fetch;
+    file->next = UINT64_MAX;
+    ctx->nfiles++;
+
+    logi("Serving %s, %" PRIu64 " bytes\n", name, size);
+
+    return 0;
+}
+
+static int mount_reply(int fd, uint64_t unique, int error, const void *data,
+                       size_t len)
+{
+    struct fuse_out_header hdr;
+    struct iovec iov[2];
+    ssize_t rc;
+
+    hdr.len = sizeof(hdr) + (error ? 0 : len);
+    hdr.error = error;
+    hdr.unique = unique;
+
+    iov[0].iov_base = &hdr;
+    iov[0].iov_len = sizeof(hdr);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = error ? 0 : len;
+
+    while ((rc = writev(fd, iov, 2)) < 0) {
+        /* The request was interrupted and is gone, not a failure of ours */
+        if (errno == ENOENT)
+            return 0;
+        if (errno != EINTR)
+            return -errno;
+    }
+
+    return 0;
+}
+
+static void mount_attr(struct mount *ctx, const struct mount_file *file,
+                       struct fuse_attr *attr)
+{
+    memset(attr, 0, sizeof(*attr));
+    attr->uid = ctx->uid;
+    attr->gid = ctx->gid;
+    attr->blksize = MOUNT_BLOCK;
+
+    if (!file) {
+        attr->ino = FUSE_ROOT_ID;
+        attr->mode = S_IFDIR | 0555;
+        attr->nlink = 2;
+        return;
+    }
+
+    attr->ino = file->ino;
+    attr->mode = S_IFREG | 0444;
+    attr->nlink = 1;
+    attr->size = file->size;
+    attr->blocks = (file->size + 511) / 512;
+}
+
+static int mount_do_init(struct mount *ctx __unused, int fd,
+                         const struct fuse_in_header *in, const void *arg)
+{
+    const struct fuse_init_in *init = arg;
+    struct fuse_init_out out;
+    size_t len = sizeof(out);
+
+    if (init->major != FUSE_KERNEL_VERSION) {
+        loge("Unsupported FUSE protocol %" PRIu32 ".%" PRIu32 "\n", init->major,
+             init->minor);
+        mount_reply(fd, in->unique, -EPROTO, NULL, 0);
+        return -EPROTO;
+    }
+
+    memset(&out, 0, sizeof(out));
+    out.major = FUSE_KERNEL_VERSION;
+    out.minor = FUSE_KERNEL_MINOR_VERSION;
+    out.max_readahead = init->max_readahead;
+    out.max_write = 4096;
+    out.time_gran = 1;
+
+    if (init->minor < 23)
+        len = FUSE_COMPAT_22_INIT_OUT_SIZE;
+
+    return mount_reply(fd, in->unique, 0, &out, len);
+}
+
+static int mount_do_lookup(struct mount *ctx, int fd,
+                           const struct fuse_in_header *in, const char *name)
+{
+    struct fuse_entry_out out;
+    size_t i;
+
+    if (in->nodeid != FUSE_ROOT_ID)
+        return mount_reply(fd, in->unique, -ENOENT, NULL, 0);
+
+    for (i = 0; i < ctx->nfiles; i++) {
+        if (strcmp(ctx->files[i].name, name))
+            continue;
+
+        memset(&out, 0, sizeof(out));
+        out.nodeid = ctx->files[i].ino;
+        out.entry_valid = MOUNT_ATTR_VALID;
+        out.attr_valid = MOUNT_ATTR_VALID;
+        mount_attr(ctx, &ctx->files[i], &out.attr);
+
+        return mount_reply(fd, in->unique, 0, &out, sizeof(out));
+    }
+
+    return mount_reply(fd, in->unique, -ENOENT, NULL, 0);
+}
+
+static int mount_do_getattr(struct mount *ctx, int fd,
+                            const struct fuse_in_header *in)
+{
+    struct mount_file *file = mount_file_by_ino(ctx, in->nodeid);
+    struct fuse_attr_out out;
+
+    if (!file && in->nodeid != FUSE_ROOT_ID)
+        return mount_reply(fd, in->unique, -ENOENT, NULL, 0);
+
+    memset(&out, 0, sizeof(out));
+    out.attr_valid = MOUNT_ATTR_VALID;
+    mount_attr(ctx, file, &out.attr);
+
+    return mount_reply(fd, in->unique, 0, &out, sizeof(out));
+}
+
+static int mount_do_open(struct mount *ctx, int fd,
+                         const struct fuse_in_header *in, const void *arg)
+{
+    const struct fuse_open_in *open_in = arg;
+    struct fuse_open_out out;
+    bool dir = in->opcode == FUSE_OPENDIR;
+
+    if (dir ? in->nodeid != FUSE_ROOT_ID : !mount_file_by_ino(ctx, in->nodeid))
+        return mount_reply(fd, in->unique, -ENOENT, NULL, 0);
+
+    if ((open_in->flags & O_ACCMODE) != O_RDONLY)
+        return mount_reply(fd, in->unique, -EROFS, NULL, 0);
+
+    memset(&out, 0, sizeof(out));
+    out.fh = in->nodeid;
+    if (!dir)
+        out.open_flags = FOPEN_KEEP_CACHE;
+
+    return mount_reply(fd, in->unique, 0, &out, sizeof(out));
+}
+
+static int mount_do_read(struct mount *ctx, int fd,
+                         const struct fuse_in_header *in, const void *arg)
+{
+    const struct fuse_read_in *read_in = arg;
+    struct mount_file *file = mount_file_by_ino(ctx, in->nodeid);
+    size_t len = read_in->size;
+    ssize_t rc;
+
+    if (!file)
+        return mount_reply(fd, in->unique, -ENOENT, NULL, 0);
+
+    if (len > MOUNT_READ_MAX)
+        len = MOUNT_READ_MAX;
+
+    if ((rc = mount_read(ctx, file, read_in->offset, len, ctx->reply)) < 0)
+        return mount_reply(fd, in->unique, rc, NULL, 0);
+
+    return mount_reply(fd, in->unique, 0, ctx->reply, rc);
+}
+
+static size_t mount_dirent(uint8_t *buf, size_t avail, uint64_t ino,
+                           uint64_t off, const char *name, unsigned int type)
+{
+    struct fuse_dirent *dirent = (struct fuse_dirent *)buf;
+    size_t namelen = strlen(name);
+    size_t len = FUSE_DIRENT_SIZE(&(struct fuse_dirent){ .namelen = namelen });
+
+    if (len > avail)
+        return 0;
+
+    memset(buf, 0, len);
+    dirent->ino = ino;
+    dirent->off = off;
+    dirent->namelen = namelen;
+    dirent->type = type;
+    memcpy(dirent->name, name, namelen);
+
+    return len;
+}
+
+static int mount_do_readdir(struct mount *ctx, int fd,
+                            const struct fuse_in_header *in, const void *arg)
+{
+    const struct fuse_read_in *read_in = arg;
+    size_t avail = read_in->size, used = 0, len;
+    uint64_t i;
+
+    if (in->nodeid != FUSE_ROOT_ID)
+        return mount_reply(fd, in->unique, -ENOTDIR, NULL, 0);
+
+    if (avail > MOUNT_READ_MAX)
+        avail = MOUNT_READ_MAX;
+
+    /* ".", ".." and then the files, each entry's offset that of the next */
+    for (i = read_in->offset; i < 2 + ctx->nfiles; i++) {
+        const char *name = i == 0 ? "." : i == 1 ? ".." : ctx->files[i - 2].name;
+        uint64_t ino = i < 2 ? FUSE_ROOT_ID : ctx->files[i - 2].ino;
+
+        len = mount_dirent(ctx->reply + used, avail - used, ino, i + 1, name,
+                           i < 2 ? DT_DIR : DT_REG);
+        if (!len)
+            break;
+
+        used += len;
+    }
+
+    return mount_reply(fd, in->unique, 0, ctx->reply, used);
+}
+
+static int mount_do_statfs(struct mount *ctx, int fd,
+                           const struct fuse_in_header *in)
+{
+    struct fuse_statfs_out out;
+    uint64_t total = 0;
+    size_t i;
+
+    for (i = 0; i < ctx->nfiles; i++)
+        total += ctx->files[i].size;
+
+    memset(&out, 0, sizeof(out));
+    out.st.bsize = MOUNT_BLOCK;
+    out.st.frsize = MOUNT_BLOCK;
+    out.st.blocks = (total + MOUNT_BLOCK - 1) / MOUNT_BLOCK;
+    out.st.files = ctx->nfiles + 1;
+    out.st.namelen = 255;
+
+    return mount_reply(fd, in->unique, 0, &out, sizeof(out));
+}
+
+/* Returns once the mount goes away, or on an interrupt */
+static int mount_serve(struct mount *ctx, int fd)
+{
+    static uint8_t req[MOUNT_REQ_LEN];
+    int rc = 0;
+
+    while (!mount_stop) {
+        const struct fuse_in_header *in = (const void *)req;
+        const void *arg = req + sizeof(*in);
+        ssize_t n;
+
+        if ((n = read(fd, req, sizeof(req))) < 0) {
+            if (errno == EINTR || errno == ENOENT || errno == EAGAIN)
+                continue;
+            /* Unmounted from under us */
+            if (errno == ENODEV)
+                return 0;
+            return -errno;
+        }
+
+        if ((size_t)n < sizeof(*in) || in->len != (size_t)n) {
+            loge("Malformed FUSE request of %zd bytes\n", n);
+            return -EPROTO;
+        }
+
+        /* Arguments are NUL-terminated names or fixed structures */
+        req[n < (ssize_t)sizeof(req) ? n : n - 1] = '\0';
+
+        switch (in->opcode) {
+        case FUSE_INIT:
+            rc = mount_do_init(ctx, fd, in, arg);
+            break;
+        case FUSE_LOOKUP:
+            rc = mount_do_lookup(ctx, fd, in, arg);
+            break;
+        case FUSE_GETATTR:
+            rc = mount_do_getattr(ctx, fd, in);
+            break;
+        case FUSE_OPEN:
+        case FUSE_OPENDIR:
+            rc = mount_do_open(ctx, fd, in, arg);
+            break;
+        case FUSE_READ:
+            rc = mount_do_read(ctx, fd, in, arg);
+            break;
+        case FUSE_READDIR:
+            rc = mount_do_readdir(ctx, fd, in, arg);
+            break;
+        case FUSE_STATFS:
+            rc = mount_do_statfs(ctx, fd, in);
+            break;
+        case FUSE_RELEASE:
+        case FUSE_RELEASEDIR:
+        case FUSE_FLUSH:
+        case FUSE_ACCESS:
+            rc = mount_reply(fd, in->unique, 0, NULL, 0);
+            break;
+        /* These go unanswered */
+        case FUSE_FORGET:
+        case FUSE_BATCH_FORGET:
+        case FUSE_INTERRUPT:
+            rc = 0;
+            break;
+        case FUSE_DESTROY:
+            mount_reply(fd, in->unique, 0, NULL, 0);
+            return 0;
+        default:
+            logd("Unsupported FUSE request %" PRIu32 "\n", in->opcode);
+            rc = mount_reply(fd, in->unique, -ENOSYS, NULL, 0);
+            break;
+        }
+
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int mount_cache_init(struct mount *ctx, size_t cache, size_t readahead)
+{
+    size_t i;
+
+    ctx->nblocks = cache / MOUNT_BLOCK;
+    if (ctx->nblocks < 2)
+        ctx->nblocks = 2;
+
+    readahead -= readahead % MOUNT_BLOCK;
+    if (readahead < MOUNT_BLOCK)
+        readahead = MOUNT_BLOCK;
+    if (readahead > (ctx->nblocks / 2) * MOUNT_BLOCK)
+        readahead = (ctx->nblocks / 2) * MOUNT_BLOCK;
+    ctx->readahead = readahead;
+
+    ctx->blocks = calloc(ctx->nblocks, sizeof(*ctx->blocks));
+    ctx->arena = malloc(ctx->nblocks * MOUNT_BLOCK);
+    ctx->staging = malloc(ctx->readahead);
+    ctx->reply = malloc(MOUNT_READ_MAX);
+    if (!ctx->blocks || !ctx->arena || !ctx->staging || !ctx->reply)
+        return -ENOMEM;
+
+    for (i = 0; i < ctx->nblocks; i++)
+        ctx->blocks[i].data = ctx->arena + i * MOUNT_BLOCK;
+
+    return 0;
+}
+
+static void mount_cache_destroy(struct mount *ctx)
+{
+    if (ctx->hits || ctx->misses)
+        logi("Served %" PRIu64 " blocks from the cache, fetched for %" PRIu64
+             " misses\n", ctx->hits, ctx->misses);
+
+    free(ctx->reply);
+    free(ctx->staging);
+    free(ctx->arena);
+    free(ctx->blocks);
+}
+
+static int mount_run(struct mount *ctx, const char *mountpoint)
+{
+    struct sigaction sa = { .sa_handler = mount_handle_signal };
+    struct sigaction oldint, oldterm;
+    char opts[128];
+    int fd, rc;
+
+    if ((fd = open("/dev/fuse", O_RDWR | O_CLOEXEC)) < 0) {
+        rc = -errno;
+        loge("Failed to open /dev/fuse: %d\n", rc);
+        return rc;
+    }
+
+    ctx->uid = getuid();
+    ctx->gid = getgid();
+
+    snprintf(opts, sizeof(opts),
+             "fd=%d,rootmode=%o,user_id=%u,group_id=%u,max_read=%u", fd,
+             S_IFDIR, (unsigned int)ctx->uid, (unsigned int)ctx->gid,
+             MOUNT_READ_MAX);
+
+    if (mount("culvert", mountpoint, "fuse.culvert",
+              MS_RDONLY | MS_NOSUID | MS_NODEV, opts) < 0) {
+        rc = -errno;
+        loge("Failed to mount on %s: %d\n", mountpoint, rc);
+        goto cleanup_fd;
+    }
+
+    /* Without SA_RESTART, so the read of the next request is interrupted */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &oldint);
+    sigaction(SIGTERM, &sa, &oldterm);
+
+    logi("Mounted on %s, interrupt or unmount to stop\n", mountpoint);
+
+    rc = mount_serve(ctx, fd);
+    if (rc < 0)
+        loge("Failed to serve the mount: %d\n", rc);
+
+    sigaction(SIGINT, &oldint, NULL);
+    sigaction(SIGTERM, &oldterm, NULL);
+    mount_stop = 0;
+
+    /* Lazily, as a tool may still hold a file open */
+    if (umount2(mountpoint, MNT_DETACH) < 0 && errno != EINVAL && errno != ENOENT)
+        logd("Failed to unmount %s: %d\n", mountpoint, -errno);
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+int cmd_mount(const char *name __unused, int argc, char *argv[])
+{
+    struct mount _ctx = { 0 }, *ctx = &_ctx;
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    size_t readahead = MOUNT_READAHEAD_DEFAULT;
+    size_t cache = MOUNT_CACHE_DEFAULT;
+    const char *spec = "fmc";
+    struct soc_region dram;
+    const char *mountpoint;
+    struct sdmc *sdmc;
+    struct sfc *sfc = NULL;
+    struct ahb *ahb;
+    uint32_t wp;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        unsigned long val;
+        char *end;
+        int c;
+
+        static struct option long_options[] = {
+            { "cache", required_argument, NULL, 'c' },
+            { "flash", required_argument, NULL, 'f' },
+            { "read-ahead", required_argument, NULL, 'r' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "c:f:r:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'c':
+            case 'r':
+                errno = 0;
+                val = strtoul(optarg, &end, 0);
+                if (errno || end == optarg || *end) {
+                    loge("Invalid size '%s'\n", optarg);
+                    return -EINVAL;
+                }
+
+                if (c == 'c')
+                    cache = val;
+                else
+                    readahead = val;
+                break;
+            case 'f':
+                spec = optarg;
+                break;
+            default:
+                return -EINVAL;
+        }
+    }
+
+    if (optind == argc) {
+        loge("Not enough arguments for mount command\n");
+        exit(EXIT_FAILURE);
+    }
+
+    mountpoint = argv[optind];
+
+    if ((rc = mount_cache_init(ctx, cache, readahead)) < 0)
+        goto cleanup_cache;
+
+    if ((rc = host_init(host, argc - optind - 1, argv + optind + 1)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        goto cleanup_cache;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0) {
+        loge("Failed to probe SoC: %d\n", rc);
+        goto cleanup_host;
+    }
+
+    ctx->soc = soc;
+
+    if (!(sdmc = sdmc_get(soc)) || (rc = sdmc_get_dram(sdmc, &dram)) < 0) {
+        loge("Failed to find the BMC's DRAM\n");
+        rc = -ENODEV;
+        goto cleanup_soc;
+    }
+
+    if ((rc = mount_add_file(ctx, "ram", dram.length, dram.start,
+                             mount_fetch_ram)) < 0)
+        goto cleanup_soc;
+
+    /* Flash is a bonus, the mount goes ahead without it */
+    if (!(sfc = sfc_get(soc, spec))) {
+        logi("No %s flash controller, serving DRAM alone\n", spec);
+    } else if ((rc = flash_init(sfc, &ctx->chip)) < 0) {
+        logi("Failed to initialise %s flash, serving DRAM alone: %d\n", spec, rc);
+        sfc = NULL;
+    } else if ((rc = sfc_write_protect_save(sfc, true, &wp)) < 0) {
+        loge("Failed to write-protect the chip-select: %d\n", rc);
+        goto cleanup_chip;
+    } else if ((rc = mount_add_file(ctx, "firmware", ctx->chip->info.size, 0,
+                                    mount_fetch_flash)) < 0) {
+        goto cleanup_wp;
+    }
+
+    rc = mount_run(ctx, mountpoint);
+
+cleanup_wp:
+    if (sfc && sfc_write_protect_restore(sfc, wp) < 0)
+        loge("Failed to restore the chip-select's write protection\n");
+
+cleanup_chip:
+    if (ctx->chip)
+        flash_destroy(ctx->chip);
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+cleanup_cache:
+    mount_cache_destroy(ctx);
+
+    return rc;
+}
+#else
+int cmd_mount(const char *name __unused, int argc __unused,
+              char *argv[] __unused)
+{
+    loge("Built without FUSE support\n");
+
+    return -ENOTSUP;
+}
+#endif
@@ -0,0 +1,824 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "flash.h"
+#include "host.h"
+#include "log.h"
+#include "remote.h"
+#include "soc.h"
+#include "soc/sfc.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/*
+ * Exports a flash chip over the NBD protocol's fixed newstyle handshake, for
+ * nbd-client, qemu-nbd --connect or nbdcopy on the host. Blocks are read
+ * through a bounded cache on first touch. Writes land on the cached blocks and
+ * reach the chip through the smart-write planner when the client flushes,
+ * asks for FUA, or disconnects, or when a dirty block is evicted. Only erase
+ * blocks whose contents changed are erased and programmed.
+ */
+#define NBD_DEFAULT_LISTEN      "10809"
+#define NBD_BLOCK               (64 << 10)
+#define NBD_CACHE_DEFAULT       (64 << 20)
+/* The largest request the protocol's clients are expected to send */
+#define NBD_MAX_REQUEST         (32 << 20)
+#define NBD_MAX_OPTION          4096
+
+#define NBD_MAGIC               0x4e42444d41474943ULL
+#define NBD_IHAVEOPT            0x49484156454f5054ULL
+#define NBD_REP_MAGIC           0x0003e889045565a9ULL
+#define NBD_REQUEST_MAGIC       0x25609513
+#define NBD_SIMPLE_REPLY_MAGIC  0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE (1 << 0)
+#define NBD_FLAG_NO_ZEROES      (1 << 1)
+
+#define NBD_FLAG_HAS_FLAGS      (1 << 0)
+#define NBD_FLAG_READ_ONLY      (1 << 1)
+#define NBD_FLAG_SEND_FLUSH     (1 << 2)
+#define NBD_FLAG_SEND_FUA       (1 << 3)
+
+#define NBD_OPT_EXPORT_NAME     1
+#define NBD_OPT_ABORT           2
+#define NBD_OPT_LIST            3
+#define NBD_OPT_INFO            6
+#define NBD_OPT_GO              7
+
+#define NBD_REP_ACK             1
+#define NBD_REP_SERVER          2
+#define NBD_REP_INFO            3
+#define NBD_REP_ERR_UNSUP       (0x80000000 | 1)
+#define NBD_REP_ERR_INVALID     (0x80000000 | 3)
+#define NBD_REP_ERR_UNKNOWN     (0x80000000 | 6)
+
+#define NBD_INFO_EXPORT         0
+#define NBD_INFO_BLOCK_SIZE     3
+
+#define NBD_CMD_READ            0
+#define NBD_CMD_WRITE           1
+#define NBD_CMD_DISC            2
+#define NBD_CMD_FLUSH           3
+
+#define NBD_CMD_FLAG_FUA        (1 << 0)
+
+#define NBD_EPERM               1
+#define NBD_EIO                 5
+#define NBD_ENOMEM              12
+#define NBD_EINVAL              22
+#define NBD_ENOSPC              28
+
+struct nbd_option {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t len;
+} __attribute__((packed));
+
+struct nbd_option_reply {
+    uint64_t magic;
+    uint32_t option;
+    uint32_t type;
+    uint32_t len;
+} __attribute__((packed));
+
+struct nbd_info_export {
+    uint16_t type;
+    uint64_t size;
+    uint16_t flags;
+} __attribute__((packed));
+
+struct nbd_info_block_size {
+    uint16_t type;
+    uint32_t min;
+    uint32_t preferred;
+    uint32_t max;
+} __attribute__((packed));
+
+struct nbd_request {
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t type;
+    uint64_t cookie;
+    uint64_t offset;
+    uint32_t len;
+} __attribute__((packed));
+
+struct nbd_reply {
+    uint32_t magic;
+    uint32_t error;
+    uint64_t cookie;
+} __attribute__((packed));
+
+struct nbd_block {
+    uint32_t index;
+    uint64_t used;
+    bool valid;
+    bool dirty;
+    uint8_t *data;
+};
+
+struct nbd {
+    struct flash_chip *chip;
+    struct ahb *ahb;
+    const char *name;
+    uint64_t size;
+    bool readonly;
+    struct nbd_block *blocks;
+    size_t nblocks;
+    uint8_t *arena;
+    uint8_t *buf;
+    uint64_t clock;
+    uint64_t fetched;
+    uint64_t flushed;
+};
+
+static volatile sig_atomic_t nbd_stop;
+
+static void nbd_handle_signal(int signo __unused)
+{
+    nbd_stop = 1;
+}
+
+/* As remote_recv(), but gives up on an interrupt so a client can't hold us */
+static int nbd_recv(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t rc = recv(fd, buf, len, 0);
+
+        if (rc < 0) {
+            if (errno == EINTR && !nbd_stop)
+                continue;
+            return -errno;
+        }
+
+        if (!rc)
+            return -ECONNRESET;
+
+        buf = (char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static size_t nbd_block_len(struct nbd *ctx, uint32_t index)
+{
+    uint64_t base = (uint64_t)index * NBD_BLOCK;
+
+    return ctx->size - base < NBD_BLOCK ? ctx->size - base : NBD_BLOCK;
+}
+
+static int nbd_block_flush(struct nbd *ctx, struct nbd_block *blk)
+{
+    int rc;
+
+    if (!blk->dirty)
+        return 0;
+
+    rc = flash_smart_write(ctx->chip, (uint64_t)blk->index * NBD_BLOCK,
+                           blk->data, nbd_block_len(ctx, blk->index));
+    if (rc < 0) {
+        loge("Failed to write back the block at 0x%" PRIx64 ": %d\n",
+             (uint64_t)blk->index * NBD_BLOCK, rc);
+        return rc;
+    }
+
+    blk->dirty = false;
+    ctx->flushed++;
+
+    return 0;
+}
+
+/* Dirty blocks go out in address order, the planner reads ahead of itself */
+static int nbd_flush(struct nbd *ctx)
+{
+    struct nbd_block *next;
+    int rc;
+
+    do {
+        size_t i;
+
+        next = NULL;
+        for (i = 0; i < ctx->nblocks; i++) {
+            struct nbd_block *blk = &ctx->blocks[i];
+
+            if (blk->dirty && (!next || blk->index < next->index))
+                next = blk;
+        }
+
+        if (next && (rc = nbd_block_flush(ctx, next)) < 0)
+            return rc;
+    } while (next);
+
+    return 0;
+}
+
+/*
+ * Finds the block at @index, or takes over the least recently used one for it,
+ * writing that back first if dirty. The contents are only read from the chip
+ * if @fill, a write covering the whole block doesn't need them.
+ */
+static int nbd_cache_get(struct nbd *ctx, uint32_t index, bool fill,
+                         struct nbd_block **found)
+{
+    struct nbd_block *victim = NULL;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ctx->nblocks; i++) {
+        struct nbd_block *blk = &ctx->blocks[i];
+
+        if (blk->valid && blk->index == index) {
+            blk->used = ++ctx->clock;
+            *found = blk;
+            return 0;
+        }
+
+        if (!victim || !blk->valid || (victim->valid && blk->used < victim->used))
+            victim = blk;
+    }
+
+    if (victim->valid && (rc = nbd_block_flush(ctx, victim)) < 0)
+        return rc;
+
+    victim->valid = false;
+
+    if (fill) {
+        rc = flash_read(ctx->chip, (uint64_t)index * NBD_BLOCK, victim->data,
+                        nbd_block_len(ctx, index));
+        if (rc < 0) {
+            loge("Failed to read the block at 0x%" PRIx64 ": %d\n",
+                 (uint64_t)index * NBD_BLOCK, rc);
+            return rc;
+        }
+
+        ctx->fetched++;
+    }
+
+    victim->index = index;
+    victim->used = ++ctx->clock;
+    victim->dirty = false;
+    victim->valid = true;
+    *found = victim;
+
+    return 0;
+}
+
+static int nbd_read(struct nbd *ctx, uint64_t offset, uint8_t *buf, size_t len)
+{
+    while (len) {
+        size_t within = offset % NBD_BLOCK;
+        size_t chunk = NBD_BLOCK - within;
+        struct nbd_block *blk;
+        int rc;
+
+        if (chunk > len)
+            chunk = len;
+
+        if ((rc = nbd_cache_get(ctx, offset / NBD_BLOCK, true, &blk)) < 0)
+            return rc;
+
+        memcpy(buf, blk->data + within, chunk);
+
+        offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static int nbd_write(struct nbd *ctx, uint64_t offset, const uint8_t *buf,
+                     size_t len)
+{
+    while (len) {
+        uint32_t index = offset / NBD_BLOCK;
+        size_t within = offset % NBD_BLOCK;
+        size_t chunk = NBD_BLOCK - within;
+        struct nbd_block *blk;
+        bool whole;
+        int rc;
+
+        if (chunk > len)
+            chunk = len;
+
+        whole = !within && chunk == nbd_block_len(ctx, index);
+        if ((rc = nbd_cache_get(ctx, index, !whole, &blk)) < 0)
+            return rc;
+
+        memcpy(blk->data + within, buf, chunk);
+        blk->dirty = true;
+
+        offset += chunk;
+        buf += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+static uint32_t nbd_errno(int rc)
+{
+    switch (rc) {
+        case -EPERM:
+        case -EROFS:
+            return NBD_EPERM;
+        case -ENOMEM:
+            return NBD_ENOMEM;
+        case -EINVAL:
+            return NBD_EINVAL;
+        case -ENOSPC:
+            return NBD_ENOSPC;
+        default:
+            return NBD_EIO;
+    }
+}
+
+static uint16_t nbd_transmission_flags(struct nbd *ctx)
+{
+    uint16_t flags = NBD_FLAG_HAS_FLAGS;
+
+    if (ctx->readonly)
+        flags |= NBD_FLAG_READ_ONLY;
+    else
+        flags |= NBD_FLAG_SEND_FLUSH | NBD_FLAG_SEND_FUA;
+
+    return flags;
+}
+
+static int nbd_option_reply(int fd, uint32_t option, uint32_t type,
+                            const void *data, size_t len)
+{
+    struct nbd_option_reply reply = {
+        .magic = htobe64(NBD_REP_MAGIC),
+        .option = htobe32(option),
+        .type = htobe32(type),
+        .len = htobe32(len),
+    };
+
+    return remote_send_msg(fd, &reply, sizeof(reply), data, len);
+}
+
+/* The export is named for the controller, but the default name finds it too */
+static bool nbd_name_matches(struct nbd *ctx, const uint8_t *data, uint32_t len)
+{
+    uint32_t namelen;
+
+    if (len < sizeof(namelen))
+        return false;
+
+    memcpy(&namelen, data, sizeof(namelen));
+    namelen = be32toh(namelen);
+    if (namelen > len - sizeof(namelen))
+        return false;
+
+    return !namelen || (namelen == strlen(ctx->name) &&
+                        !memcmp(data + sizeof(namelen), ctx->name, namelen));
+}
+
+static int nbd_option_info(struct nbd *ctx, int fd, uint32_t option,
+                           const uint8_t *data, uint32_t len)
+{
+    struct nbd_info_export export = {
+        .type = htobe16(NBD_INFO_EXPORT),
+        .size = htobe64(ctx->size),
+        .flags = htobe16(nbd_transmission_flags(ctx)),
+    };
+    struct nbd_info_block_size sizes = {
+        .type = htobe16(NBD_INFO_BLOCK_SIZE),
+        .min = htobe32(1),
+        .preferred = htobe32(NBD_BLOCK),
+        .max = htobe32(NBD_MAX_REQUEST),
+    };
+    int rc;
+
+    if (!nbd_name_matches(ctx, data, len))
+        return nbd_option_reply(fd, option, NBD_REP_ERR_UNKNOWN, NULL, 0);
+
+    if ((rc = nbd_option_reply(fd, option, NBD_REP_INFO, &export,
+                               sizeof(export))) < 0)
+        return rc;
+
+    if ((rc = nbd_option_reply(fd, option, NBD_REP_INFO, &sizes,
+                               sizeof(sizes))) < 0)
+        return rc;
+
+    return nbd_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+}
+
+static int nbd_option_list(struct nbd *ctx, int fd)
+{
+    uint8_t entry[4 + NBD_MAX_OPTION];
+    uint32_t namelen = strlen(ctx->name);
+    uint32_t be = htobe32(namelen);
+    int rc;
+
+    memcpy(entry, &be, sizeof(be));
+    memcpy(entry + sizeof(be), ctx->name, namelen);
+
+    if ((rc = nbd_option_reply(fd, NBD_OPT_LIST, NBD_REP_SERVER, entry,
+                               sizeof(be) + namelen)) < 0)
+        return rc;
+
+    return nbd_option_reply(fd, NBD_OPT_LIST, NBD_REP_ACK, NULL, 0);
+}
+
+/* Returns 1 to move on to transmission, 0 if the client gave up */
+static int nbd_negotiate(struct nbd *ctx, int fd)
+{
+    struct __attribute__((packed)) {
+        uint64_t magic;
+        uint64_t opt;
+        uint16_t flags;
+    } hello = {
+        .magic = htobe64(NBD_MAGIC),
+        .opt = htobe64(NBD_IHAVEOPT),
+        .flags = htobe16(NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES),
+    };
+    uint8_t data[NBD_MAX_OPTION];
+    uint32_t client;
+    int rc;
+
+    if ((rc = remote_send(fd, &hello, sizeof(hello))) < 0)
+        return rc;
+
+    if ((rc = nbd_recv(fd, &client, sizeof(client))) < 0)
+        return rc;
+
+    client = be32toh(client);
+    if (!(client & NBD_FLAG_FIXED_NEWSTYLE)) {
+        loge("Client doesn't support the fixed newstyle handshake\n");
+        return -EPROTO;
+    }
+
+    while (!nbd_stop) {
+        struct nbd_option opt;
+        uint32_t option, len;
+
+        if ((rc = nbd_recv(fd, &opt, sizeof(opt))) < 0)
+            return rc;
+
+        option = be32toh(opt.option);
+        len = be32toh(opt.len);
+        if (be64toh(opt.magic) != NBD_IHAVEOPT || len > sizeof(data))
+            return -EPROTO;
+
+        if ((rc = nbd_recv(fd, data, len)) < 0)
+            return rc;
+
+        switch (option) {
+            case NBD_OPT_EXPORT_NAME:
+            {
+                struct __attribute__((packed)) {
+                    uint64_t size;
+                    uint16_t flags;
+                    uint8_t zeroes[124];
+                } export = {
+                    .size = htobe64(ctx->size),
+                    .flags = htobe16(nbd_transmission_flags(ctx)),
+                };
+                size_t elen = sizeof(export);
+
+                if (client & NBD_FLAG_NO_ZEROES)
+                    elen -= sizeof(export.zeroes);
+
+                /* There's no way to refuse the name, only to hang up */
+                if (len && (len != strlen(ctx->name) ||
+                            memcmp(data, ctx->name, len)))
+                    return -ENOENT;
+
+                if ((rc = remote_send(fd, &export, elen)) < 0)
+                    return rc;
+
+                return 1;
+            }
+            case NBD_OPT_ABORT:
+                nbd_option_reply(fd, option, NBD_REP_ACK, NULL, 0);
+                return 0;
+            case NBD_OPT_LIST:
+                rc = len ? nbd_option_reply(fd, option, NBD_REP_ERR_INVALID,
+                                            NULL, 0)
+                         : nbd_option_list(ctx, fd);
+                break;
+            case NBD_OPT_INFO:
+            case NBD_OPT_GO:
+                if ((rc = nbd_option_info(ctx, fd, option, data, len)) < 0)
+                    return rc;
+
+                if (option == NBD_OPT_GO && nbd_name_matches(ctx, data, len))
+                    return 1;
+                break;
+            default:
+                rc = nbd_option_reply(fd, option, NBD_REP_ERR_UNSUP, NULL, 0);
+                break;
+        }
+
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int nbd_reply(int fd, uint64_t cookie, uint32_t error, const void *data,
+                     size_t len)
+{
+    struct nbd_reply reply = {
+        .magic = htobe32(NBD_SIMPLE_REPLY_MAGIC),
+        .error = htobe32(error),
+        .cookie = cookie,
+    };
+
+    return remote_send_msg(fd, &reply, sizeof(reply), data, error ? 0 : len);
+}
+
+static int nbd_transmit(struct nbd *ctx, int fd)
+{
+    struct nbd_request req;
+    int rc;
+
+    while (!nbd_stop) {
+        uint64_t offset;
+        uint32_t len;
+        uint16_t type;
+        int err;
+
+        if ((rc = nbd_recv(fd, &req, sizeof(req))) < 0)
+            return rc == -ECONNRESET ? 0 : rc;
+
+        if (be32toh(req.magic) != NBD_REQUEST_MAGIC)
+            return -EPROTO;
+
+        type = be16toh(req.type);
+        offset = be64toh(req.offset);
+        len = be32toh(req.len);
+
+        err = 0;
+        if (len > NBD_MAX_REQUEST) {
+            /* A write's payload can't be skipped without reading it */
+            if (type == NBD_CMD_WRITE)
+                return -EMSGSIZE;
+            err = -EINVAL;
+        } else if ((type == NBD_CMD_READ || type == NBD_CMD_WRITE) &&
+                   (offset > ctx->size || len > ctx->size - offset)) {
+            err = type == NBD_CMD_WRITE ? -ENOSPC : -EINVAL;
+        }
+
+        if (type == NBD_CMD_WRITE && (rc = nbd_recv(fd, ctx->buf, len)) < 0)
+            return rc;
+
+        switch (type) {
+            case NBD_CMD_READ:
+                if (!err)
+                    err = nbd_read(ctx, offset, ctx->buf, len);
+                rc = nbd_reply(fd, req.cookie, err ? nbd_errno(err) : 0,
+                               ctx->buf, len);
+                break;
+            case NBD_CMD_WRITE:
+                if (!err && ctx->readonly)
+                    err = -EPERM;
+                if (!err)
+                    err = nbd_write(ctx, offset, ctx->buf, len);
+                if (!err && (be16toh(req.flags) & NBD_CMD_FLAG_FUA))
+                    err = nbd_flush(ctx);
+                rc = nbd_reply(fd, req.cookie, err ? nbd_errno(err) : 0,
+                               NULL, 0);
+                break;
+            case NBD_CMD_FLUSH:
+                err = nbd_flush(ctx);
+                rc = nbd_reply(fd, req.cookie, err ? nbd_errno(err) : 0,
+                               NULL, 0);
+                break;
+            case NBD_CMD_DISC:
+                return 0;
+            default:
+                rc = nbd_reply(fd, req.cookie, NBD_EINVAL, NULL, 0);
+                break;
+        }
+
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int nbd_client(struct nbd *ctx, int fd)
+{
+    int rc, cleanup;
+
+    if ((rc = nbd_negotiate(ctx, fd)) <= 0)
+        return rc;
+
+    logi("Exporting %s, %" PRIu64 " bytes%s\n", ctx->name, ctx->size,
+         ctx->readonly ? ", read-only" : "");
+
+    /* Flash commands poll the controller, keep the bridge set up between them */
+    if ((rc = ahb_session_begin(ctx->ahb)) < 0)
+        return rc;
+
+    rc = nbd_transmit(ctx, fd);
+
+    /* The client going away is a flush, whether or not it asked for one */
+    if ((cleanup = nbd_flush(ctx)) < 0 && !rc)
+        rc = cleanup;
+
+    ahb_session_end(ctx->ahb);
+
+    return rc;
+}
+
+static int nbd_cache_init(struct nbd *ctx, size_t cache)
+{
+    size_t i;
+
+    ctx->nblocks = cache / NBD_BLOCK;
+    if (!ctx->nblocks)
+        ctx->nblocks = 1;
+
+    ctx->blocks = calloc(ctx->nblocks, sizeof(*ctx->blocks));
+    ctx->arena = malloc(ctx->nblocks * NBD_BLOCK);
+    ctx->buf = malloc(NBD_MAX_REQUEST);
+    if (!ctx->blocks || !ctx->arena || !ctx->buf)
+        return -ENOMEM;
+
+    for (i = 0; i < ctx->nblocks; i++)
+        ctx->blocks[i].data = ctx->arena + i * NBD_BLOCK;
+
+    return 0;
+}
+
+static void nbd_cache_destroy(struct nbd *ctx)
+{
+    if (ctx->fetched || ctx->flushed)
+        logi("Fetched %" PRIu64 " blocks, wrote back %" PRIu64 "\n",
+             ctx->fetched, ctx->flushed);
+
+    free(ctx->buf);
+    free(ctx->arena);
+    free(ctx->blocks);
+}
+
+int cmd_nbd(const char *name __unused, int argc, char *argv[])
+{
+    struct sigaction sa = { .sa_handler = nbd_handle_signal };
+    struct nbd _ctx = { 0 }, *ctx = &_ctx;
+    struct host _host, *host = &_host;
+    const char *spec = NBD_DEFAULT_LISTEN;
+    struct soc _soc, *soc = &_soc;
+    size_t cache = NBD_CACHE_DEFAULT;
+    struct sfc *sfc;
+    uint32_t wp = 0;
+    int sfd, cfd;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        unsigned long val;
+        char *end;
+        int c;
+
+        static struct option long_options[] = {
+            { "cache", required_argument, NULL, 'c' },
+            { "listen", required_argument, NULL, 'l' },
+            { "read-only", no_argument, NULL, 'r' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "c:l:r", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'c':
+                errno = 0;
+                val = strtoul(optarg, &end, 0);
+                if (errno || end == optarg || *end) {
+                    loge("Invalid size '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                cache = val;
+                break;
+            case 'l':
+                spec = optarg;
+                break;
+            case 'r':
+                ctx->readonly = true;
+                break;
+            default:
+                return -EINVAL;
+        }
+    }
+
+    if (optind == argc) {
+        loge("Not enough arguments for nbd command\n");
+        exit(EXIT_FAILURE);
+    }
+
+    ctx->name = argv[optind];
+
+    if ((rc = nbd_cache_init(ctx, cache)) < 0)
+        goto cleanup_cache;
+
+    if ((rc = host_init(host, argc - optind - 1, argv + optind + 1)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        goto cleanup_cache;
+    }
+
+    if (!(ctx->ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ctx->ahb)) < 0) {
+        loge("Failed to probe SoC: %d\n", rc);
+        goto cleanup_host;
+    }
+
+    if (!(sfc = sfc_get(soc, ctx->name))) {
+        loge("Failed to acquire SPI controller, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_soc;
+    }
+
+    if ((rc = flash_init(sfc, &ctx->chip)) < 0)
+        goto cleanup_soc;
+
+    ctx->size = ctx->chip->tsize;
+
+    /* A read-only export holds the chip-select safe whatever the client does */
+    if (ctx->readonly && (rc = sfc_write_protect_save(sfc, true, &wp)) < 0) {
+        loge("Failed to write-protect the chip-select: %d\n", rc);
+        goto cleanup_flash;
+    }
+
+    if ((sfd = remote_listen(spec)) < 0) {
+        rc = sfd;
+        loge("Failed to listen on %s: %d\n", spec, rc);
+        goto cleanup_wp;
+    }
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    logi("Serving %s over NBD on %s\n", ctx->name, spec);
+
+    rc = 0;
+    while (!nbd_stop) {
+        if ((cfd = remote_accept(sfd)) < 0) {
+            if (cfd == -EINTR)
+                continue;
+            rc = cfd;
+            loge("Failed to accept client: %d\n", rc);
+            break;
+        }
+
+        logd("Client connected\n");
+
+        if ((rc = nbd_client(ctx, cfd)) < 0)
+            logi("Dropped client: %d\n", rc);
+        else
+            logd("Client disconnected\n");
+
+        close(cfd);
+        rc = 0;
+    }
+
+    close(sfd);
+
+    /* A dirty block left over from a failed flush gets one more go */
+    if (nbd_flush(ctx) < 0)
+        rc = -EIO;
+
+cleanup_wp:
+    if (ctx->readonly && sfc_write_protect_restore(sfc, wp) < 0)
+        loge("Failed to restore the chip-select's write protection\n");
+
+cleanup_flash:
+    flash_destroy(ctx->chip);
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+cleanup_cache:
+    nbd_cache_destroy(ctx);
+
+    return rc;
+}
@@ -8,10 +8,151 @@
 #include "priv.h"
 #include "soc/otp.h"
 
+#include <endian.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+
+static int otp_save_image(struct otp *otp, const char *path)
+{
+    uint32_t image[OTP_IMAGE_WORDS];
+    const char *cursor;
+    unsigned int i;
+    size_t remaining;
+    ssize_t wrote;
+    int fd;
+    int rc;
+
+    if ((rc = otp_dump(otp, image)) < 0) {
+        loge("Failed to read the OTP: %d\n", rc);
+        return rc;
+    }
+
+    for (i = 0; i < OTP_IMAGE_WORDS; i++)
+        image[i] = htole32(image[i]);
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", path, rc);
+        return rc;
+    }
+
+    cursor = (const char *)image;
+    remaining = sizeof(image);
+    while (remaining) {
+        if ((wrote = write(fd, cursor, remaining)) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -errno;
+            loge("Failed to write %s: %d\n", path, rc);
+            goto cleanup_fd;
+        }
+
+        cursor += wrote;
+        remaining -= wrote;
+    }
+
+    logi("Wrote %zu byte OTP image to %s\n", sizeof(image), path);
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+static int otp_load_image(const char *path, uint32_t *image)
+{
+    unsigned int i;
+    size_t len;
+    FILE *f;
+    int rc = 0;
+
+    if (!(f = fopen(path, "rb"))) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", path, rc);
+        return rc;
+    }
+
+    len = fread(image, sizeof(*image), OTP_IMAGE_WORDS, f);
+    if (len != OTP_IMAGE_WORDS || fgetc(f) != EOF) {
+        loge("%s is not a %zu byte OTP image\n", path,
+             OTP_IMAGE_WORDS * sizeof(*image));
+        rc = -EINVAL;
+        goto cleanup_file;
+    }
+
+    for (i = 0; i < OTP_IMAGE_WORDS; i++)
+        image[i] = le32toh(image[i]);
+
+cleanup_file:
+    fclose(f);
+
+    return rc;
+}
+
+/*
+ * A diff is lines of "data WORD MASK" or "conf WORD MASK" naming the bits to
+ * set, with '#' starting a comment.
+ */
+static int otp_load_diff(const char *path, uint32_t *image)
+{
+    unsigned int lineno = 0;
+    size_t size = 0;
+    char *line = NULL;
+    FILE *f;
+    int rc = 0;
+
+    if (!(f = fopen(path, "r"))) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", path, rc);
+        return rc;
+    }
+
+    memset(image, 0, OTP_IMAGE_WORDS * sizeof(*image));
+
+    while (getline(&line, &size, f) >= 0) {
+        long long word, mask;
+        char region[5];
+        char *hash;
+        int end = 0;
+
+        lineno++;
+
+        if ((hash = strchr(line, '#')))
+            *hash = '\0';
+
+        if (!line[strspn(line, " \t\r\n")])
+            continue;
+
+        if (sscanf(line, "%4s %lli %lli %n", region, &word, &mask, &end) != 3 ||
+            line[end] || mask < 0 || mask > UINT32_MAX) {
+            loge("%s:%u: Expected REGION WORD MASK\n", path, lineno);
+            rc = -EINVAL;
+            goto cleanup_line;
+        }
+
+        if (!strcmp("data", region) && word >= 0 && word < OTP_DATA_WORDS) {
+            image[word] |= mask;
+        } else if (!strcmp("conf", region) && word >= 0 &&
+                   word < OTP_CONF_WORDS) {
+            image[OTP_DATA_WORDS + word] |= mask;
+        } else {
+            loge("%s:%u: Invalid OTP word: %s %lld\n", path, lineno, region,
+                 word);
+            rc = -EINVAL;
+            goto cleanup_line;
+        }
+    }
+
+cleanup_line:
+    free(line);
+    fclose(f);
+
+    return rc;
+}
 
 int cmd_otp(const char *name __unused, int argc, char *argv[])
 {
@@ -20,6 +161,10 @@ int cmd_otp(const char *name __unused, int argc, char *argv[])
     struct soc _soc, *soc = &_soc;
     struct otp *otp;
     struct ahb *ahb;
+    uint32_t image[OTP_IMAGE_WORDS];
+    const char *program = NULL;
+    const char *path = NULL;
+    bool exact = false;
     bool rd = true;
     int argo = 2;
     int rc;
@@ -29,7 +174,17 @@ int cmd_otp(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (!strcmp("conf", argv[1]))
+    if (!strcmp("program", argv[0])) {
+        if (!strcmp("image", argv[1]))
+            exact = true;
+        else if (strcmp("diff", argv[1])) {
+            loge("Unsupported otp program source: %s\n", argv[1]);
+            exit(EXIT_FAILURE);
+        }
+        program = argv[1];
+    } else if (!strcmp("dump", argv[0]))
+        path = argv[1];
+    else if (!strcmp("conf", argv[1]))
         reg = otp_region_conf;
     else if (!strcmp("strap", argv[1]))
         reg = otp_region_strap;
@@ -38,7 +193,12 @@ int cmd_otp(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (!strcmp("write", argv[0])) {
+    if (program) {
+        rd = false;
+        argo++;
+    } else if (path) {
+        rd = false;
+    } else if (!strcmp("write", argv[0])) {
         rd = false;
         argo += 2;
     } else if (strcmp("read", argv[0])) {
@@ -51,12 +211,19 @@ int cmd_otp(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    if (program) {
+        rc = exact ? otp_load_image(argv[2], image) :
+                     otp_load_diff(argv[2], image);
+        if (rc < 0)
+            exit(EXIT_FAILURE);
+    }
+
     if ((rc = host_init(host, argc - argo, argv + argo)) < 0) {
         loge("Failed to initialise host interfaces: %d\n", rc);
         exit(EXIT_FAILURE);
     }
 
-    if (!(ahb = host_get_ahb(host))) {
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
         loge("Failed to acquire AHB interface, exiting\n");
         rc = EXIT_FAILURE;
         goto cleanup_host;
@@ -74,7 +241,11 @@ int cmd_otp(const char *name __unused, int argc, char *argv[])
         goto cleanup_soc;
     }
 
-    if (rd)
+    if (program)
+        rc = otp_program_image(otp, image, exact);
+    else if (path)
+        rc = otp_save_image(otp, path);
+    else if (rd)
         rc = otp_read(otp, reg);
     else {
         if (reg == otp_region_strap) {
@@ -19,9 +19,9 @@ int cmd_p2a(const char *name, int argc, char *argv[])
     int rc;
 
     if (!strcmp("vga", argv[0]))
-        rc = p2ab_init(p2ab, AST_PCI_VID, AST_PCI_DID_VGA);
+        rc = p2ab_init(p2ab, NULL, AST_PCI_VID, AST_PCI_DID_VGA);
     else if (!strcmp("bmc", argv[0]))
-        rc = p2ab_init(p2ab, AST_PCI_VID, AST_PCI_DID_BMC);
+        rc = p2ab_init(p2ab, NULL, AST_PCI_VID, AST_PCI_DID_BMC);
     else {
         loge("Unknown PCIe device: %s\n", argv[0]);
         exit(EXIT_FAILURE);
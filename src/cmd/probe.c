@@ -19,11 +19,44 @@ cmd_probe_help(const char *name, int argc __unused, char *argv[] __unused)
         "%s probe --help\n"
         "%s probe --interface INTERFACE ...\n"
         "%s probe --list-interfaces\n"
-        "%s probe --require <integrity|confidentiality>\n";
+        "%s probe --require <integrity|confidentiality> [--fail-fast]\n"
+        "\n"
+        "With --fail-fast no reports are printed. The interfaces are checked\n"
+        "cheapest first, stopping at the first that falls short, and the verdict\n"
+        "is a single line: 'pass', 'fail INTERFACE MODE' or 'error'.\n";
 
     printf(probe_help, name, name, name, name);
 }
 
+static const char *cmd_probe_mode[] = {
+    [bm_permissive] = "permissive",
+    [bm_restricted] = "restricted",
+    [bm_disabled] = "disabled",
+};
+
+static int cmd_probe_audit(struct soc *soc, enum bridge_mode required,
+                           const char *iface)
+{
+    struct bridgectl *violator;
+    enum bridge_mode mode;
+    int rc;
+
+    rc = soc_audit_bridge_controllers(soc, required, iface, &violator, &mode);
+    if (rc < 0) {
+        printf("error\n");
+        return EXIT_FAILURE;
+    }
+
+    if (violator) {
+        printf("fail %s %s\n", bridgectl_name(violator), cmd_probe_mode[mode]);
+        return EXIT_FAILURE;
+    }
+
+    printf("pass\n");
+
+    return EXIT_SUCCESS;
+}
+
 int cmd_probe(const char *name, int argc, char *argv[])
 {
     enum bridge_mode required = bm_permissive;
@@ -31,6 +64,7 @@ int cmd_probe(const char *name, int argc, char *argv[])
     struct soc _soc, *soc = &_soc;
     enum bridge_mode discovered;
     bool opt_list_ifaces = false;
+    bool opt_fail_fast = false;
     char *opt_iface = NULL;
     struct ahb *ahb;
     int rc;
@@ -40,6 +74,7 @@ int cmd_probe(const char *name, int argc, char *argv[])
         int c;
 
         static struct option long_options[] = {
+            { "fail-fast", no_argument, NULL, 'f' },
             { "help", no_argument, NULL, 'h' },
             { "interface", required_argument, NULL, 'i' },
             { "list-interfaces", no_argument, NULL, 'l' },
@@ -47,11 +82,14 @@ int cmd_probe(const char *name, int argc, char *argv[])
             { },
         };
 
-        c = getopt_long(argc, argv, "hi:lr:", long_options, &option_index);
+        c = getopt_long(argc, argv, "fhi:lr:", long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c) {
+            case 'f':
+                opt_fail_fast = true;
+                break;
             case 'h':
                 cmd_probe_help(name, argc, argv);
                 rc = EXIT_SUCCESS;
@@ -84,13 +122,19 @@ int cmd_probe(const char *name, int argc, char *argv[])
         }
     }
 
+    if (opt_fail_fast && (required == bm_permissive || opt_list_ifaces)) {
+        loge("--fail-fast needs --require and can't list interfaces\n");
+        rc = EXIT_FAILURE;
+        goto done;
+    }
+
     if ((rc = host_init(host, argc - optind, &argv[optind])) < 0) {
         loge("Failed to initialise host interfaces: %d\n", rc);
         rc = EXIT_FAILURE;
         goto done;
     }
 
-    if (!(ahb = host_get_ahb(host))) {
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
         loge("Failed to acquire AHB interface, exiting\n");
         rc = EXIT_FAILURE;
         goto cleanup_host;
@@ -104,6 +148,8 @@ int cmd_probe(const char *name, int argc, char *argv[])
     if (opt_list_ifaces) {
         soc_list_bridge_controllers(soc);
         rc = EXIT_SUCCESS;
+    } else if (opt_fail_fast) {
+        rc = cmd_probe_audit(soc, required, opt_iface);
     } else {
         if ((rc = soc_probe_bridge_controllers(soc, &discovered, opt_iface)) < 0) {
             loge("Failed to probe SoC bridge controllers: %d\n", rc);
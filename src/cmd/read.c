@@ -4,23 +4,265 @@
 #include "ahb.h"
 #include "ast.h"
 #include "compiler.h"
+#include "container.h"
+#include "digest.h"
+#include "elfcore.h"
 #include "flash.h"
 #include "host.h"
+#include "klog.h"
+#include "layout.h"
 #include "log.h"
+#include "manifest.h"
 #include "priv.h"
+#include "progress.h"
+#include "sha256.h"
 #include "soc.h"
+#include "soc/hace.h"
 #include "soc/sdmc.h"
 #include "soc/sfc.h"
+#include "triage.h"
+#include "vmem.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-static int cmd_read_firmware(int argc, char *argv[])
+/* Where one pass over the region can go, see sink.h */
+#define READ_MAX_SINKS 8
+
+/* ALGO[,BLOCK], the algorithm defaulting to SHA-256 */
+static int read_parse_digest(const char *arg, struct ahb_siphon_opts *opts)
 {
+    unsigned long block;
+    char algo[16];
+    const char *sep;
+    char *endp;
+    size_t len;
+
+    opts->digest = true;
+    opts->digest_algo = digest_sha256;
+    opts->digest_block = 0;
+
+    if (!arg)
+        return 0;
+
+    sep = strchr(arg, ',');
+    len = sep ? (size_t)(sep - arg) : strlen(arg);
+    if (len) {
+        if (len >= sizeof(algo))
+            return -EINVAL;
+
+        memcpy(algo, arg, len);
+        algo[len] = '\0';
+        if (digest_parse_algo(algo, &opts->digest_algo) < 0)
+            return -EINVAL;
+    }
+
+    if (sep) {
+        errno = 0;
+        block = strtoul(sep + 1, &endp, 0);
+        if (errno || *endp || !block || block > (1UL << 30))
+            return -EINVAL;
+
+        opts->digest_block = block;
+    }
+
+    return 0;
+}
+
+struct read_ram_opts {
+    const char *manifest;
+    const char *priority;
+    uint32_t scratch;
+    bool elf;
+    bool container;
+};
+
+/* Blocks hashed per trip to the engine, so @scratch needs 2KiB */
+#define READ_FLASH_BATCH        64
+
+/*
+ * Whether the flash at @offset no longer holds the container's @blk. With
+ * @digest it was already taken on the BMC. Otherwise there's nothing on the
+ * BMC to trust for the comparison, as the controller's DMA checksum only sums
+ * words, so the flash is read into @buf and compared with the block in @prev.
+ */
+static int read_flash_changed(struct container_writer *container,
+                              struct flash_chip *chip, uint32_t offset,
+                              const struct container_block *blk,
+                              const uint8_t *digest, void *buf, void *prev)
+{
+    uint8_t have[SHA256_LEN];
+    int rc;
+
+    if ((rc = container_writer_read(container, blk, digest ? buf : prev)) < 0) {
+        loge("Failed to read block 0x%08" PRIx32 " from the container: %d\n",
+             blk->phys, rc);
+        return rc;
+    }
+
+    if (digest) {
+        sha256(buf, blk->len, have);
+        return !!memcmp(have, digest, SHA256_LEN);
+    }
+
+    if ((rc = flash_read(chip, offset, buf, blk->len)) < 0) {
+        loge("Failed to read flash at 0x%08" PRIx32 ": %d\n", offset, rc);
+        return rc;
+    }
+
+    return !!memcmp(buf, prev, blk->len);
+}
+
+/*
+ * Dumps the flash into a container a block at a time. If the output already
+ * holds one, each block is compared against the latest copy there and only
+ * those that changed are appended, as a layer over the blocks from before.
+ * With @scratch the comparison happens on the BMC and only changed blocks are
+ * fetched, otherwise every block is.
+ */
+static int read_firmware_container(struct soc *soc, struct flash_chip *chip,
+                                   uint32_t phys,
+                                   const struct flash_part *part, int outfd,
+                                   int level, uint32_t scratch)
+{
+    const struct elfcore_soc desc = { .rev = soc->rev };
+    struct container_writer container;
+    uint8_t *digests = NULL;
+    struct progress progress;
+    size_t changed = 0, total = 0;
+    struct hace *hace = NULL;
+    uint32_t offset;
+    void *buf, *prev;
+    int rc;
+
+    buf = malloc(2 * CONTAINER_DEFAULT_BLOCK);
+    if (!buf)
+        return -ENOMEM;
+    prev = (uint8_t *)buf + CONTAINER_DEFAULT_BLOCK;
+
+    rc = container_writer_init(&container, outfd, CONTAINER_DEFAULT_BLOCK,
+                               level, &desc);
+    if (rc < 0)
+        goto cleanup_buf;
+
+    if (scratch & 7) {
+        loge("The hash scratch area must be 8-byte aligned\n");
+        rc = -EINVAL;
+        goto cleanup_container;
+    }
+
+    if (scratch && container.nblocks) {
+        if (!(hace = hace_get(soc))) {
+            loge("No hash engine to compare blocks on the BMC with\n");
+            rc = -ENODEV;
+            goto cleanup_container;
+        }
+
+        if (!(digests = malloc(READ_FLASH_BATCH * HACE_SHA256_LEN))) {
+            rc = -ENOMEM;
+            goto cleanup_container;
+        }
+    } else if (container.nblocks) {
+        logi("Without --hash-scratch, every block is read to find changes\n");
+    }
+
+    progress_init(&progress, container.nblocks ? "compare" : "read",
+                  part->size);
+    progress_set_base(&progress, part->offset);
+    for (offset = 0; offset < part->size; offset += CONTAINER_DEFAULT_BLOCK) {
+        uint32_t len = part->size - offset < CONTAINER_DEFAULT_BLOCK ?
+                           part->size - offset : CONTAINER_DEFAULT_BLOCK;
+        const struct container_block *blk;
+        bool fetched = false;
+        size_t at = (offset / CONTAINER_DEFAULT_BLOCK) % READ_FLASH_BATCH;
+
+        if (hace && !at) {
+            uint32_t batch = part->size - offset;
+
+            if (batch > READ_FLASH_BATCH * CONTAINER_DEFAULT_BLOCK)
+                batch = READ_FLASH_BATCH * CONTAINER_DEFAULT_BLOCK;
+
+            rc = hace_sha256_blocks(hace, phys + offset, batch,
+                                    CONTAINER_DEFAULT_BLOCK, scratch, digests);
+            if (rc < 0) {
+                loge("Failed to hash blocks from 0x%08" PRIx32 ": %d\n",
+                     phys + offset, rc);
+                break;
+            }
+        }
+
+        total++;
+
+        blk = container_writer_latest(&container, phys + offset);
+        if (blk && blk->len == len) {
+            rc = read_flash_changed(&container, chip, part->offset + offset,
+                                    blk, hace ? &digests[at * HACE_SHA256_LEN] :
+                                                NULL,
+                                    buf, prev);
+            if (rc < 0)
+                break;
+
+            if (!rc) {
+                progress_update(&progress, len);
+                continue;
+            }
+
+            fetched = !hace;
+        }
+
+        if (!fetched &&
+            (rc = flash_read(chip, part->offset + offset, buf, len)) < 0) {
+            loge("Failed to read flash at 0x%08" PRIx32 ": %d\n",
+                 part->offset + offset, rc);
+            break;
+        }
+
+        if ((rc = container_append(&container, phys + offset, buf, len)) < 0) {
+            loge("Failed to write block 0x%08" PRIx32 " to the container: %d\n",
+                 phys + offset, rc);
+            break;
+        }
+
+        changed++;
+        progress_update(&progress, len);
+    }
+    progress_end(&progress);
+
+    if (rc < 0)
+        goto cleanup_digests;
+
+    if ((rc = container_finish(&container)) < 0) {
+        loge("Failed to write the container's index: %d\n", rc);
+        goto cleanup_digests;
+    }
+
+    logi("Fetched %zu of %zu blocks\n", changed, total);
+
+cleanup_digests:
+    free(digests);
+
+cleanup_container:
+    container_writer_destroy(&container);
+
+cleanup_buf:
+    free(buf);
+
+    return rc;
+}
+
+static int cmd_read_firmware(int argc, char *argv[], const char *spec,
+                             const char *partition,
+                             const struct ahb_siphon_opts *opts,
+                             const struct read_ram_opts *ram)
+{
+    struct flash_part part = { .offset = 0 };
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
     struct ahb *ahb;
@@ -46,7 +288,7 @@ static int cmd_read_firmware(int argc, char *argv[])
         goto cleanup_host;
 
     logi("Initialising flash controller\n");
-    if (!(sfc = sfc_get_by_name(soc, "fmc"))) {
+    if (!(sfc = sfc_get(soc, spec))) {
         loge("Failed to acquire SPI controller\n");
         rc = -ENODEV;
         goto cleanup_soc;
@@ -57,17 +299,34 @@ static int cmd_read_firmware(int argc, char *argv[])
         goto cleanup_soc;
     }
 
-    logi("Write-protecting all chip-selects\n");
+    logi("Write-protecting the chip-select\n");
     if ((rc = sfc_write_protect_save(sfc, true, &wp)))
         goto cleanup_chip;
 
     if ((rc = sfc_get_flash(sfc, &flash)) < 0)
-        goto cleanup_chip;
+        goto cleanup_wp;
 
-    logi("Exfiltrating BMC flash to stdout\n\n");
-    rc = soc_siphon_out(soc, flash.start, chip->info.size, 1);
+    part.size = chip->info.size;
+    if (partition && (rc = flash_get_part(chip, partition, &part)) < 0)
+        goto cleanup_wp;
+
+    /* zstd's default level unless another is given */
+    if (ram->container) {
+        logi("Backing up %s flash to the container on stdout\n\n", spec);
+        rc = read_firmware_container(soc, chip, flash.start + part.offset,
+                                     &part, STDOUT_FILENO,
+                                     opts->compress ?
+                                         (opts->compress_level ?: 3) : 0,
+                                     ram->scratch);
+        goto cleanup_wp;
+    }
+
+    logi("Exfiltrating %s flash to stdout\n\n", spec);
+    rc = soc_siphon_out_opts(soc, flash.start + part.offset, part.size, 1,
+                             opts);
     if (rc) { errno = -rc; perror("soc_siphon_in"); }
 
+cleanup_wp:
     if ((cleanup = sfc_write_protect_restore(sfc, wp)) < 0) {
         errno = -rc;
         perror("sfc_write_protect_restore");
@@ -85,7 +344,267 @@ cleanup_host:
     return rc;
 }
 
-static int cmd_read_ram(int argc, char *argv[])
+/* Pages hashed per trip to the engine, so @scratch needs 4KiB */
+#define READ_MANIFEST_PAGE      (4 << 10)
+#define READ_MANIFEST_BATCH     128
+#define READ_MANIFEST_RUN       (1 << 20)
+
+/*
+ * Updates a previous capture of the same region in the output file in place,
+ * hashing each page on the BMC and fetching only those whose digest differs
+ * from the manifest. The manifest is replaced once the data is on disk.
+ */
+static int read_ram_incremental(struct soc *soc, uint32_t start, uint32_t length,
+                                int outfd, const char *path, uint32_t scratch)
+{
+    size_t batch_len = READ_MANIFEST_BATCH * READ_MANIFEST_PAGE;
+    struct manifest manifest;
+    struct progress progress;
+    size_t i, changed = 0;
+    uint8_t *digests;
+    struct stat st;
+    struct hace *hace;
+    off_t base;
+    void *buf;
+    int flags;
+    int rc;
+
+    if (fstat(outfd, &st) || !S_ISREG(st.st_mode) ||
+            (flags = fcntl(outfd, F_GETFL)) < 0 || (flags & O_APPEND)) {
+        loge("Incremental dumps must be written to a regular file, without O_APPEND\n");
+        return -EINVAL;
+    }
+
+    if ((start & (READ_MANIFEST_PAGE - 1)) || (scratch & 7) ||
+            (scratch + READ_MANIFEST_BATCH * HACE_SHA256_LEN > start &&
+             scratch < start + length)) {
+        loge("The hash scratch area must be aligned and outside the dumped range\n");
+        return -EINVAL;
+    }
+
+    if (!(hace = hace_get(soc))) {
+        loge("No hash engine to compare pages on the BMC with\n");
+        return -ENODEV;
+    }
+
+    if ((base = lseek(outfd, 0, SEEK_CUR)) < 0)
+        return -errno;
+
+    if ((rc = manifest_load(&manifest, path, start, length, READ_MANIFEST_PAGE)) < 0)
+        return rc;
+
+    /* The digests only describe the output if it still holds the capture */
+    if (manifest.digests && st.st_size < base + (off_t)length) {
+        logi("Output is shorter than the previous capture, fetching everything\n");
+        free(manifest.digests);
+        manifest.digests = NULL;
+    }
+
+    digests = malloc(manifest.npages * MANIFEST_DIGEST_LEN);
+    buf = malloc(READ_MANIFEST_RUN);
+    if (!digests || !buf) {
+        rc = -ENOMEM;
+        goto cleanup_buf;
+    }
+
+    progress_init(&progress, "hash", length);
+    for (i = 0; i < manifest.npages; i += READ_MANIFEST_BATCH) {
+        size_t offset = i * READ_MANIFEST_PAGE;
+        size_t len = length - offset < batch_len ? length - offset : batch_len;
+
+        rc = hace_sha256_blocks(hace, start + offset, len, READ_MANIFEST_PAGE,
+                                scratch, &digests[i * MANIFEST_DIGEST_LEN]);
+        if (rc < 0) {
+            loge("Failed to hash pages from 0x%08zx: %d\n", start + offset, rc);
+            break;
+        }
+
+        progress_update(&progress, len);
+    }
+    progress_end(&progress);
+
+    if (rc < 0)
+        goto cleanup_buf;
+
+    progress_init(&progress, "read", 0);
+    for (i = 0; i < manifest.npages;) {
+        size_t offset, len, end = i;
+        ssize_t egress;
+
+        /* Coalesce changed pages into runs of up to READ_MANIFEST_RUN */
+        while (end < manifest.npages &&
+               (end - i) * READ_MANIFEST_PAGE < READ_MANIFEST_RUN &&
+               (!manifest.digests ||
+                memcmp(&manifest.digests[end * MANIFEST_DIGEST_LEN],
+                       &digests[end * MANIFEST_DIGEST_LEN],
+                       MANIFEST_DIGEST_LEN)))
+            end++;
+
+        if (end == i) {
+            i++;
+            continue;
+        }
+
+        offset = i * READ_MANIFEST_PAGE;
+        len = end * READ_MANIFEST_PAGE;
+        len = (len > length ? length : len) - offset;
+
+        if ((rc = soc_read(soc, start + offset, buf, len)) < 0) {
+            loge("Failed to read 0x%08zx: %d\n", start + offset, rc);
+            break;
+        }
+
+        egress = pwrite(outfd, buf, len, base + offset);
+        if (egress < 0 || (size_t)egress != len) {
+            rc = egress < 0 ? -errno : -EIO;
+            break;
+        }
+
+        progress_update(&progress, len);
+        changed += end - i;
+        i = end;
+    }
+    progress_end(&progress);
+
+    if (rc < 0)
+        goto cleanup_buf;
+
+    if (fdatasync(outfd)) {
+        rc = -errno;
+        goto cleanup_buf;
+    }
+
+    if ((rc = manifest_save(&manifest, path, digests)) < 0) {
+        loge("Failed to save manifest '%s': %d\n", path, rc);
+        goto cleanup_buf;
+    }
+
+    logi("Fetched %zu of %zu pages\n", changed, manifest.npages);
+
+cleanup_buf:
+    free(buf);
+    free(digests);
+    manifest_destroy(&manifest);
+
+    return rc;
+}
+
+/*
+ * The core's headers go out first describing every segment, so however far
+ * the dump gets the file is a core of the segments that made it.
+ */
+static int read_ram_prioritised(struct soc *soc, uint32_t start, uint32_t length,
+                                const struct elfcore_soc *desc,
+                                const struct ahb_siphon_opts *opts,
+                                const struct read_ram_opts *ram,
+                                const struct klog_opts *klog)
+{
+    struct triage plan;
+    size_t i;
+    int rc;
+
+    if ((rc = triage_plan(&plan, soc, ram->priority, klog, start, length)) < 0)
+        return rc;
+
+    if ((rc = elfcore_write_segments(STDOUT_FILENO, plan.segs, plan.nsegs, desc)) < 0) {
+        loge("Failed to write the ELF core header: %d\n", rc);
+        return rc;
+    }
+
+    for (i = 0; i < plan.nsegs; i++) {
+        const struct elfcore_segment *seg = &plan.segs[i];
+
+        logi("Dumping segment %zu of %zu, %" PRIu32 "KiB at 0x%08" PRIx32 "\n",
+             i + 1, plan.nsegs, seg->len >> 10, seg->phys);
+
+        if ((rc = soc_siphon_out_opts(soc, seg->phys, seg->len, STDOUT_FILENO,
+                                      opts)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+/*
+ * Each block goes into the container as it's read, so an interrupted dump
+ * resumes from the blocks that made it, and zero blocks take no space.
+ */
+static int read_ram_container(struct soc *soc, uint32_t start, uint32_t length,
+                              int outfd, const struct elfcore_soc *desc,
+                              int level)
+{
+    struct container_writer container;
+    struct progress progress;
+    size_t offset, len, reused = 0;
+    void *buf;
+    int rc;
+
+    rc = container_writer_init(&container, outfd, CONTAINER_DEFAULT_BLOCK,
+                               level, desc);
+    if (rc < 0)
+        return rc;
+
+    if (!(buf = malloc(CONTAINER_DEFAULT_BLOCK))) {
+        rc = -ENOMEM;
+        goto cleanup_container;
+    }
+
+    progress_init(&progress, "read", length);
+    for (offset = 0; offset < length; offset += len) {
+        len = length - offset;
+        if (len > CONTAINER_DEFAULT_BLOCK)
+            len = CONTAINER_DEFAULT_BLOCK;
+
+        if (container_writer_has(&container, start + offset, len)) {
+            reused++;
+            progress_update(&progress, len);
+            continue;
+        }
+
+        if ((rc = soc_read(soc, start + offset, buf, len)) < 0) {
+            loge("Failed to read 0x%08zx: %d\n", start + offset, rc);
+            break;
+        }
+
+        if ((rc = container_append(&container, start + offset, buf, len)) < 0) {
+            loge("Failed to write block 0x%08zx to the container: %d\n",
+                 start + offset, rc);
+            break;
+        }
+
+        progress_update(&progress, len);
+    }
+    progress_end(&progress);
+
+    if (rc < 0)
+        goto cleanup_buf;
+
+    if ((rc = container_finish(&container)) < 0) {
+        loge("Failed to write the container's index: %d\n", rc);
+        goto cleanup_buf;
+    }
+
+    if (reused)
+        logi("Kept %zu blocks from the previous run\n", reused);
+
+    if (container.ingress)
+        logi("Stored %" PRIu64 " bytes in %" PRIu64 " (%.1f%%)\n",
+             container.ingress, container.egress,
+             container.egress * 100.0 / container.ingress);
+
+cleanup_buf:
+    free(buf);
+
+cleanup_container:
+    container_writer_destroy(&container);
+
+    return rc;
+}
+
+static int cmd_read_ram(int argc, char *argv[],
+                        const struct ahb_siphon_opts *opts,
+                        const struct read_ram_opts *ram,
+                        const struct klog_opts *klog)
 {
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
@@ -158,6 +677,10 @@ static int cmd_read_ram(int argc, char *argv[])
         goto cleanup_soc;
     }
 
+    if ((rc = sdmc_get_vram(sdmc, &vram))) {
+        goto cleanup_soc;
+    }
+
     if (start && length) {
         if (start < dram.start || (start + length) > (dram.start + dram.length)) {
             rc = -EINVAL;
@@ -167,10 +690,6 @@ static int cmd_read_ram(int argc, char *argv[])
         logi("Dumping %" PRId32 "MiB (%#.8" PRIx32 "-%#.8" PRIx32 ")",
              length >> 20, start, start + length - 1);
     } else {
-        if ((rc = sdmc_get_vram(sdmc, &vram))) {
-            goto cleanup_soc;
-        }
-
         start = dram.start;
         length = dram.length - vram.length;
 
@@ -179,7 +698,39 @@ static int cmd_read_ram(int argc, char *argv[])
              (dram.length - vram.length) >> 20, dram.start, vram.start - 1);
     }
 
-    rc = soc_siphon_out(soc, start, length, STDOUT_FILENO);
+    if (ram->elf || ram->priority || ram->container) {
+        struct elfcore_soc desc = {
+            .rev = soc->rev,
+            .dram_start = dram.start,
+            .dram_length = dram.length,
+            .vram_start = vram.start,
+            .vram_length = vram.length,
+        };
+
+        if (ram->priority) {
+            rc = read_ram_prioritised(soc, start, length, &desc, opts, ram, klog);
+            goto cleanup_soc;
+        }
+
+        /* zstd's default level unless another is given */
+        if (ram->container) {
+            rc = read_ram_container(soc, start, length, STDOUT_FILENO, &desc,
+                                    opts->compress ?
+                                        (opts->compress_level ?: 3) : 0);
+            goto cleanup_soc;
+        }
+
+        if ((rc = elfcore_write_header(STDOUT_FILENO, start, length, &desc)) < 0) {
+            loge("Failed to write the ELF core header: %d\n", rc);
+            goto cleanup_soc;
+        }
+    }
+
+    if (ram->manifest)
+        rc = read_ram_incremental(soc, start, length, STDOUT_FILENO,
+                                  ram->manifest, ram->scratch);
+    else
+        rc = soc_siphon_out_opts(soc, start, length, STDOUT_FILENO, opts);
     if (rc) {
         errno = -rc;
         perror("soc_siphon_in");
@@ -194,21 +745,318 @@ cleanup_host:
     return rc;
 }
 
+static int cmd_read_klog(int argc, char *argv[], const struct klog_opts *klog)
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct ahb *ahb;
+    int rc;
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0)
+        goto cleanup_host;
+
+    if ((rc = klog_read(soc, klog, stdout)) < 0)
+        loge("Failed to recover the kernel log: %d\n", rc);
+
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
+
+static int cmd_read_vmem(int argc, char *argv[], const struct vmem_opts *vmem)
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    unsigned long virt, len;
+    long pid = VMEM_KERNEL;
+    struct ahb *ahb;
+    char *endp;
+    int rc;
+
+    if (argc < 3) {
+        loge("Not enough arguments for `read vmem` command\n");
+        return -EINVAL;
+    }
+
+    if (strcmp("kernel", argv[0])) {
+        errno = 0;
+        pid = strtol(argv[0], &endp, 0);
+        if (errno || *endp || pid < 0 || pid > INT32_MAX) {
+            loge("Invalid PID '%s', expected a number or 'kernel'\n", argv[0]);
+            return -EINVAL;
+        }
+    }
+
+    errno = 0;
+    virt = strtoul(argv[1], &endp, 0);
+    if (errno || *endp || virt > UINT32_MAX) {
+        loge("Invalid virtual address '%s'\n", argv[1]);
+        return -EINVAL;
+    }
+
+    errno = 0;
+    len = strtoul(argv[2], &endp, 0);
+    if (errno || *endp || len > UINT32_MAX - virt + 1) {
+        loge("Invalid length '%s'\n", argv[2]);
+        return -EINVAL;
+    }
+
+    argc -= 3;
+    argv += 3;
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0)
+        goto cleanup_host;
+
+    if ((rc = vmem_read(soc, vmem, pid, virt, len, stdout)) < 0)
+        loge("Failed to read virtual memory: %d\n", rc);
+
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
+
 int cmd_read(const char *name __unused, int argc, char *argv[])
 {
+    struct vmem_task_layout task = { 0 };
+    struct klog_opts klog = { .page_offset = KLOG_PAGE_OFFSET };
+    struct ahb_siphon_opts opts = { 0 };
+    const char *partition = NULL;
+    struct read_ram_opts ram = { 0 };
+    const char *sinks[READ_MAX_SINKS];
+    const char *spec = "fmc";
+    unsigned long scratch, offset;
+    bool kernel;
+    char *endp;
     int rc;
 
-    if (argc < 1) {
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "checkpoint", required_argument, NULL, 'c' },
+            { "compress", optional_argument, NULL, 'z' },
+            { "container", no_argument, NULL, 'C' },
+            { "digest", optional_argument, NULL, 'd' },
+            { "digest-file", required_argument, NULL, 'f' },
+            { "direct", no_argument, NULL, 'D' },
+            { "elf", no_argument, NULL, 'e' },
+            { "flash", required_argument, NULL, 'F' },
+            { "hash-scratch", required_argument, NULL, 'H' },
+            { "manifest", required_argument, NULL, 'm' },
+            { "page-offset", required_argument, NULL, 'p' },
+            { "partition", required_argument, NULL, 'P' },
+            { "priority", optional_argument, NULL, 'r' },
+            { "sink", required_argument, NULL, 'o' },
+            { "sparse", no_argument, NULL, 's' },
+            { "system-map", required_argument, NULL, 'S' },
+            { "task-layout", required_argument, NULL, 'T' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "Cc:d::DeF:f:H:m:o:P:p:r::S:sT:z::", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'C':
+                ram.container = true;
+                break;
+            case 'c':
+                opts.checkpoint = optarg;
+                break;
+            case 'd':
+                if (read_parse_digest(optarg, &opts) < 0) {
+                    loge("Invalid digest '%s', expected sha256, crc32 or crc32c with an optional block size\n",
+                         optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'D':
+                opts.direct = true;
+                break;
+            case 'f':
+                opts.digest_file = optarg;
+                break;
+            case 'e':
+                ram.elf = true;
+                break;
+            case 'F':
+                spec = optarg;
+                break;
+            case 'H':
+                errno = 0;
+                scratch = strtoul(optarg, &endp, 0);
+                if (errno || *endp || scratch > UINT32_MAX) {
+                    loge("Invalid hash scratch address '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                ram.scratch = scratch;
+                break;
+            case 'm':
+                ram.manifest = optarg;
+                break;
+            case 'o':
+                if (opts.nr_sinks == READ_MAX_SINKS) {
+                    loge("At most %d sinks can be given\n", READ_MAX_SINKS);
+                    return EXIT_FAILURE;
+                }
+                sinks[opts.nr_sinks++] = optarg;
+                opts.sinks = sinks;
+                break;
+            case 'P':
+                partition = optarg;
+                break;
+            case 'p':
+                errno = 0;
+                offset = strtoul(optarg, &endp, 0);
+                if (errno || *endp || offset > UINT32_MAX) {
+                    loge("Invalid page offset '%s'\n", optarg);
+                    return EXIT_FAILURE;
+                }
+                klog.page_offset = offset;
+                break;
+            case 'S':
+                klog.system_map = optarg;
+                break;
+            case 'T':
+                if (vmem_parse_task_layout(optarg, &task) < 0) {
+                    loge("Invalid task layout '%s', expected TASKS,PID,MM,PGD offsets\n",
+                         optarg);
+                    return EXIT_FAILURE;
+                }
+                break;
+            case 'r':
+                ram.priority = optarg ? optarg : TRIAGE_DEFAULT_SPEC;
+                break;
+            case 's':
+                opts.sparse = true;
+                break;
+            case 'z':
+                opts.compress = true;
+                opts.compress_level = optarg ? atoi(optarg) : 0;
+                break;
+            case '?':
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (optind >= argc) {
         loge("Not enough arguments for read command\n");
         return EXIT_FAILURE;
     }
 
-    if (!strcmp("firmware", argv[0])) {
-        rc = cmd_read_firmware(argc - 1, argv + 1);
-    } else if (!strcmp("ram", argv[0])) {
-        rc = cmd_read_ram(argc - 1, argv + 1);
+    if (ram.elf && (strcmp("ram", argv[optind]) || opts.compress)) {
+        loge("ELF cores are for RAM, and can't be compressed\n");
+        return EXIT_FAILURE;
+    }
+
+    if (opts.nr_sinks && (ram.elf || ram.manifest || opts.checkpoint ||
+                          opts.sparse || opts.direct)) {
+        loge("--sink can't be combined with --elf, --manifest, "
+             "--checkpoint, --sparse or --direct\n");
+        return EXIT_FAILURE;
+    }
+
+    if (opts.direct && (opts.compress || opts.sparse)) {
+        loge("--direct can't be combined with --compress or --sparse\n");
+        return EXIT_FAILURE;
+    }
+
+    kernel = !strcmp("klog", argv[optind]) || !strcmp("vmem", argv[optind]);
+
+    if (kernel &&
+            (ram.elf || ram.manifest || opts.nr_sinks ||
+             opts.checkpoint || opts.compress || opts.sparse || opts.direct ||
+             opts.digest || opts.digest_file)) {
+        loge("The dump options don't apply to `read klog` or `read vmem`\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!kernel && !ram.priority &&
+            (klog.system_map || klog.page_offset != KLOG_PAGE_OFFSET)) {
+        loge("--system-map and --page-offset only apply to `read klog`, `read vmem` and --priority\n");
+        return EXIT_FAILURE;
+    }
+
+    if (ram.priority && (strcmp("ram", argv[optind]) || ram.manifest ||
+                         opts.nr_sinks || opts.checkpoint || opts.compress ||
+                         opts.sparse)) {
+        loge("--priority is for RAM, and can't be combined with --manifest, --sink, "
+             "--checkpoint, --compress or --sparse\n");
+        return EXIT_FAILURE;
+    }
+
+    if (ram.container && ((strcmp("ram", argv[optind]) &&
+                           strcmp("firmware", argv[optind])) || ram.elf ||
+                          ram.priority || ram.manifest ||
+                          opts.nr_sinks || opts.checkpoint || opts.sparse ||
+                          opts.direct || opts.digest || opts.digest_file)) {
+        loge("--container is for RAM and firmware, and only combines with "
+             "--compress, and --hash-scratch for firmware\n");
+        return EXIT_FAILURE;
+    }
+
+    if (task.known && strcmp("vmem", argv[optind])) {
+        loge("--task-layout only applies to `read vmem`\n");
+        return EXIT_FAILURE;
+    }
+
+    if (opts.digest_file && !opts.digest)
+        read_parse_digest(NULL, &opts);
+
+    if (ram.manifest && (strcmp("ram", argv[optind]) || !ram.scratch ||
+                         opts.checkpoint || opts.compress || opts.sparse ||
+                         opts.direct || opts.digest)) {
+        loge("--manifest is for RAM, needs --hash-scratch and excludes the other dump options\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!strcmp("firmware", argv[optind])) {
+        rc = cmd_read_firmware(argc - optind - 1, &argv[optind + 1], spec,
+                               partition, &opts, &ram);
+    } else if (!strcmp("ram", argv[optind])) {
+        rc = cmd_read_ram(argc - optind - 1, &argv[optind + 1], &opts, &ram, &klog);
+    } else if (!strcmp("klog", argv[optind])) {
+        rc = cmd_read_klog(argc - optind - 1, &argv[optind + 1], &klog);
+    } else if (!strcmp("vmem", argv[optind])) {
+        struct vmem_opts vmem = {
+            .system_map = klog.system_map,
+            .page_offset = klog.page_offset,
+            .task = task,
+        };
+
+        rc = cmd_read_vmem(argc - optind - 1, &argv[optind + 1], &vmem);
     } else {
-        loge("Unsupported read type '%s'", argv[0]);
+        loge("Unsupported read type '%s'", argv[optind]);
         rc = -EINVAL;
     }
 
@@ -8,27 +8,129 @@
 #include "host.h"
 #include "log.h"
 #include "priv.h"
+#include "search.h"
 #include "soc.h"
 #include "soc/sdmc.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define DUMP_RAM_WIN  (8 << 20)
+struct replace_matches {
+    uint64_t *offsets;
+    size_t count;
+    size_t alloc;
+};
+
+static int replace_collect(void *priv, unsigned int pattern __unused,
+                           uint64_t offset, size_t len __unused)
+{
+    struct replace_matches *matches = priv;
+
+    if (matches->count == matches->alloc) {
+        size_t alloc = matches->alloc ? 2 * matches->alloc : 64;
+        uint64_t *offsets;
+
+        offsets = realloc(matches->offsets, alloc * sizeof(*offsets));
+        if (!offsets)
+            return -ENOMEM;
+
+        matches->offsets = offsets;
+        matches->alloc = alloc;
+    }
+
+    matches->offsets[matches->count++] = offset;
+
+    return 0;
+}
+
+/* The bytes a replacement changes, contiguous runs of them in one write each */
+struct replace_patches {
+    struct ahb_iov *iov;
+    size_t count;
+    uint8_t *data;
+    size_t len;
+    /* Matches that weren't consumed by the one before */
+    size_t applied;
+};
+
+static void replace_patches_free(struct replace_patches *patches)
+{
+    free(patches->iov);
+    free(patches->data);
+}
+
+/*
+ * Turns the matches into the runs of bytes to write. Only what differs
+ * between MATCH and REPLACE is written, and matches that abut go out as a
+ * single write as the bytes between them are known. Overlapping matches are
+ * consumed by the first replacement.
+ */
+static int replace_plan(const struct replace_matches *matches, uint32_t base,
+                        const uint8_t *patched, size_t match_len, size_t first,
+                        size_t last, struct replace_patches *patches)
+{
+    uint64_t prev = 0;
+    size_t i, n, pos;
+
+    memset(patches, 0, sizeof(*patches));
+
+    if (!matches->count)
+        return 0;
+
+    /* At worst every match is its own run */
+    patches->iov = malloc(matches->count * sizeof(*patches->iov));
+    patches->data = malloc(matches->count * match_len);
+    if (!patches->iov || !patches->data)
+        return -ENOMEM;
+
+    for (i = 0, n = 0, pos = 0; i < matches->count; i++) {
+        uint64_t offset = matches->offsets[i];
+
+        if (i && offset < prev + match_len)
+            continue;
+
+        if (n && offset == prev + match_len) {
+            /* The tail of the one before, then the head of this one */
+            memcpy(&patches->data[pos], &patched[last], match_len - last);
+            pos += match_len - last;
+            memcpy(&patches->data[pos], patched, last);
+            pos += last;
+            patches->iov[n - 1].len += match_len;
+        } else {
+            patches->iov[n].phys = base + offset + first;
+            patches->iov[n].base = &patches->data[pos];
+            patches->iov[n].len = last - first;
+            memcpy(&patches->data[pos], &patched[first], last - first);
+            pos += last - first;
+            n++;
+        }
+
+        prev = offset;
+        patches->applied++;
+    }
+
+    patches->count = n;
+    patches->len = pos;
+
+    return 0;
+}
 
 int cmd_replace(const char *name __unused, int argc, char *argv[])
 {
+    struct replace_matches matches = { 0 };
+    struct replace_patches patches = { 0 };
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
     struct soc_region dram, vram;
-    size_t replace_len;
+    size_t match_len, repl_len, first, last;
+    struct search search;
     struct sdmc *sdmc;
-    size_t ram_cursor;
     struct ahb *ahb;
-    void *win_chunk;
-    void *needle;
+    uint8_t *patched;
+    ssize_t written;
     int rc;
 
     if (argc < 3) {
@@ -47,13 +149,32 @@ int cmd_replace(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    win_chunk = malloc(DUMP_RAM_WIN);
-    if (!win_chunk) { perror("malloc"); exit(EXIT_FAILURE); }
+    match_len = strlen(argv[1]);
+    repl_len = strlen(argv[2]);
+
+    /* What a match looks like once replaced, and the span of it that changes */
+    if (!(patched = malloc(match_len))) {
+        loge("Failed to allocate replacement buffer\n");
+        exit(EXIT_FAILURE);
+    }
+
+    memcpy(patched, argv[1], match_len);
+    memcpy(patched, argv[2], repl_len);
+    for (first = 0; first < repl_len && patched[first] == (uint8_t)argv[1][first];)
+        first++;
+    for (last = repl_len; last > first && patched[last - 1] == (uint8_t)argv[1][last - 1];)
+        last--;
+
+    search_init(&search);
+    if ((rc = search_add_literal(&search, argv[1], match_len)) < 0 ||
+            (rc = search_compile(&search)) < 0) {
+        loge("Failed to prepare search for '%s': %d\n", argv[1], rc);
+        goto search_cleanup;
+    }
 
     if ((rc = host_init(host, argc - 3, argv + 3)) < 0) {
         loge("Failed to initialise host interfaces: %d\n", rc);
-        rc = EXIT_FAILURE;
-        goto win_chunk_cleanup;
+        goto search_cleanup;
     }
 
     if (!(ahb = host_get_ahb(host))) {
@@ -77,44 +198,42 @@ int cmd_replace(const char *name __unused, int argc, char *argv[])
     if ((rc = sdmc_get_vram(sdmc, &vram)))
         goto soc_cleanup;
 
-    replace_len = strlen(argv[1]);
-    for (ram_cursor = dram.start;
-         ram_cursor < vram.start;
-         ram_cursor += DUMP_RAM_WIN) {
-        logi("Scanning BMC RAM in range 0x%08zx-0x%08zx\n",
-             ram_cursor, ram_cursor + DUMP_RAM_WIN - 1);
-        rc = ahb_read(ahb, ram_cursor, win_chunk, DUMP_RAM_WIN);
-        if (rc < 0) {
-            errno = -rc;
-            perror("l2ab_read");
-            break;
-        } else if (rc != DUMP_RAM_WIN) {
-            loge("Short read: %d\n", rc);
-            break;
-        }
+    logi("Scanning BMC RAM in range 0x%08" PRIx32 "-0x%08" PRIx32 "\n",
+         dram.start, vram.start - 1);
 
-        /* FIXME: Handle sub-strings at the right hand edge */
-        needle = win_chunk;
-        while ((needle = memmem(needle, win_chunk + DUMP_RAM_WIN - needle,
-                                argv[1], strlen(argv[1])))) {
-            logi("0x%08zx: Replacing '%s' with '%s'\n",
-                 ram_cursor + (needle - win_chunk), argv[1], argv[2]);
-            rc = ahb_write(ahb, ram_cursor + (needle - win_chunk), argv[2],
-                           strlen(argv[2]));
-            if (rc < 0) {
-                errno = -rc;
-                perror("l2ab_write");
-                break;
-            } else if ((size_t)rc != strlen(argv[2])) {
-                loge("Short write: %d\n", rc);
-                break;
-            }
-
-            if ((needle + replace_len) > win_chunk + DUMP_RAM_WIN)
-                break;
-
-            needle += replace_len;
-        }
+    /* Find everything first so replacements can't feed back into the scan */
+    rc = search_ahb(&search, ahb, dram.start, vram.start - dram.start,
+                    replace_collect, &matches);
+    if (rc < 0) {
+        loge("Failed to scan BMC RAM: %d\n", rc);
+        goto soc_cleanup;
+    }
+
+    if (first == last) {
+        logi("REPLACE is already the start of MATCH, nothing to write\n");
+        goto soc_cleanup;
+    }
+
+    if ((rc = replace_plan(&matches, dram.start, patched, match_len, first,
+                           last, &patches)) < 0) {
+        loge("Failed to plan replacements: %d\n", rc);
+        goto soc_cleanup;
+    }
+
+    if (!patches.count)
+        goto soc_cleanup;
+
+    logi("Replacing '%s' with '%s' at %zu matches, in %zu writes of %zu bytes\n",
+         argv[1], argv[2], patches.applied, patches.count, patches.len);
+
+    /* Bridges that can, take them all in one go */
+    written = ahb_writev(ahb, patches.iov, patches.count);
+    if (written < 0) {
+        rc = written;
+        loge("Failed to write replacements: %d\n", rc);
+    } else if ((size_t)written != patches.len) {
+        loge("Short write: %zd\n", written);
+        rc = -EIO;
     }
 
 soc_cleanup:
@@ -123,8 +242,11 @@ soc_cleanup:
 host_cleanup:
     host_destroy(host);
 
-win_chunk_cleanup:
-    free(win_chunk);
+search_cleanup:
+    replace_patches_free(&patches);
+    free(matches.offsets);
+    search_destroy(&search);
+    free(patched);
 
     return rc;
 }
@@ -42,7 +42,7 @@ int cmd_reset(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (!(ahb = host_get_ahb(host))) {
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
         loge("Failed to acquire AHB interface, exiting\n");
         exit(EXIT_FAILURE);
     }
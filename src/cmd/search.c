@@ -0,0 +1,170 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "host.h"
+#include "log.h"
+#include "search.h"
+#include "soc.h"
+#include "soc/sdmc.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct search_report {
+    struct search *search;
+    uint32_t base;
+    unsigned long long matches;
+    unsigned long long limit;
+};
+
+static int search_report_match(void *priv, unsigned int pattern,
+                               uint64_t offset, size_t len)
+{
+    struct search_report *report = priv;
+
+    printf("0x%08" PRIx32 ": %s (%zu bytes)\n",
+           (uint32_t)(report->base + offset),
+           search_describe(report->search, pattern), len);
+
+    report->matches++;
+
+    return report->limit && report->matches == report->limit;
+}
+
+int cmd_search(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct search_report report = { 0 };
+    struct soc_region dram, vram;
+    struct search ctx;
+    struct sdmc *sdmc;
+    struct ahb *ahb;
+    char *end;
+    int rc;
+
+    search_init(&ctx);
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "hex", required_argument, NULL, 'x' },
+            { "max-matches", required_argument, NULL, 'm' },
+            { "regex", required_argument, NULL, 'e' },
+            { "string", required_argument, NULL, 's' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "e:m:s:x:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'e':
+                rc = search_add_regex(&ctx, optarg);
+                break;
+            case 'm':
+                report.limit = strtoull(optarg, &end, 0);
+                rc = (*end || !report.limit) ? -EINVAL : 0;
+                if (rc)
+                    loge("Invalid match count '%s'\n", optarg);
+                break;
+            case 's':
+                rc = search_add_literal(&ctx, optarg, strlen(optarg));
+                if (rc == -EINVAL)
+                    loge("Empty search string\n");
+                break;
+            case 'x':
+                rc = search_add_hex(&ctx, optarg);
+                if (rc == -EINVAL)
+                    loge("Invalid hex pattern '%s'\n", optarg);
+                break;
+            case '?':
+            default:
+                rc = -EINVAL;
+                break;
+        }
+
+        if (rc < 0)
+            goto cleanup_search;
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1 || !ctx.npatterns) {
+        loge("Not enough arguments for search command\n");
+        rc = -EINVAL;
+        goto cleanup_search;
+    }
+
+    if (strcmp("ram", argv[0])) {
+        loge("Unsupported search space: '%s'\n", argv[0]);
+        rc = -EINVAL;
+        goto cleanup_search;
+    }
+
+    if ((rc = search_compile(&ctx)) < 0)
+        goto cleanup_search;
+
+    if ((rc = host_init(host, argc - 1, argv + 1)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        goto cleanup_search;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)))
+        goto cleanup_host;
+
+    if (!(sdmc = sdmc_get(soc))) {
+        loge("Failed to acquire memory controller, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_soc;
+    }
+
+    if ((rc = sdmc_get_dram(sdmc, &dram)))
+        goto cleanup_soc;
+
+    if ((rc = sdmc_get_vram(sdmc, &vram)))
+        goto cleanup_soc;
+
+    logi("Searching BMC RAM in range 0x%08" PRIx32 "-0x%08" PRIx32 " for %u patterns\n",
+         dram.start, vram.start - 1, ctx.npatterns);
+
+    report.search = &ctx;
+    report.base = dram.start;
+    rc = search_ahb(&ctx, ahb, dram.start, vram.start - dram.start,
+                    search_report_match, &report);
+    if (rc < 0) {
+        loge("Failed to search BMC RAM: %d\n", rc);
+        goto cleanup_soc;
+    }
+
+    logi("Found %llu matches\n", report.matches);
+
+    /* Like grep(1), report whether anything was found */
+    rc = !report.matches;
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+cleanup_search:
+    search_destroy(&ctx);
+
+    return rc;
+}
@@ -0,0 +1,871 @@
+// SPDX-License-Identifier: Apache-2.0
+#define _GNU_SOURCE
+
+#include "ahb.h"
+#include "bridge/debugstub.h"
+#include "compiler.h"
+#include "crc32.h"
+#include "flash.h"
+#include "host.h"
+#include "log.h"
+#include "remote.h"
+#include "soc.h"
+#include "soc/sfc.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+/*
+ * Wire format, in host byte order as the socket is local:
+ *
+ * A request is a struct serve_req followed by @len bytes of payload for the
+ * write operations. The daemon answers every request with a struct serve_rsp
+ * followed by @len bytes of payload for the read operations. @rc is zero or a
+ * negative errno. readl and writel carry their value as a 4-byte payload.
+ *
+ * Clients are served one at a time, each for as long as it stays connected.
+ * With --listen the daemon instead speaks the remote bridge's protocol over
+ * TCP, see remote.h. With --stub it answers the debug stub's protocol on a
+ * tty, the BMC end of a VUART for the host's vuart bridge, see
+ * bridge/debugstub.c.
+ */
+enum serve_op {
+    serve_op_readl = 1,
+    serve_op_writel,
+    serve_op_read,
+    serve_op_write,
+    serve_op_flash_read,
+    serve_op_flash_write,
+    serve_op_flash_erase,
+};
+
+struct serve_req {
+    uint32_t op;
+    uint32_t addr;
+    uint32_t len;
+};
+
+struct serve_rsp {
+    int32_t rc;
+    uint32_t len;
+};
+
+/* Upper bound on a single request's payload */
+#define SERVE_MAX_LEN   (16 << 20)
+
+/* Descriptors and data of the largest remote request */
+#define SERVE_REMOTE_RAW_LEN \
+    (REMOTE_MAX_IOV * sizeof(struct remote_iov) + REMOTE_MAX_LEN)
+
+struct serve {
+    struct host host;
+    struct soc soc;
+    struct ahb *ahb;
+    struct flash_chip *chip;
+    void *buf;
+    /* For remote clients, compressed payloads and the decoded regions */
+    void *wire;
+    size_t wire_len;
+    struct ahb_iov *iov;
+    uint32_t flags;
+};
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_handle_signal(int signo __unused)
+{
+    serve_stop = 1;
+}
+
+static int serve_recv(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t rc = recv(fd, buf, len, 0);
+
+        if (rc < 0) {
+            if (errno == EINTR && !serve_stop)
+                continue;
+            return -errno;
+        }
+
+        if (!rc)
+            return -ECONNRESET;
+
+        buf = (char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int serve_send(int fd, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t rc = send(fd, buf, len, MSG_NOSIGNAL);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        buf = (const char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/* The flash stack is comparatively expensive to bring up, defer it */
+static int serve_get_flash(struct serve *ctx, struct flash_chip **chip)
+{
+    struct sfc *sfc;
+    int rc;
+
+    if (!ctx->chip) {
+        if (!(sfc = sfc_get_by_name(&ctx->soc, "fmc")))
+            return -ENODEV;
+
+        if ((rc = flash_init(sfc, &ctx->chip)) < 0) {
+            ctx->chip = NULL;
+            return rc;
+        }
+    }
+
+    *chip = ctx->chip;
+
+    return 0;
+}
+
+static int serve_dispatch(struct serve *ctx, const struct serve_req *req,
+                          uint32_t *rsp_len)
+{
+    struct flash_chip *chip;
+    ssize_t rc;
+
+    *rsp_len = 0;
+
+    switch (req->op) {
+        case serve_op_readl:
+            if ((rc = ahb_readl(ctx->ahb, req->addr, ctx->buf)) < 0)
+                return rc;
+            *rsp_len = sizeof(uint32_t);
+            return 0;
+        case serve_op_writel:
+            if (req->len != sizeof(uint32_t))
+                return -EINVAL;
+            return ahb_writel(ctx->ahb, req->addr, *(uint32_t *)ctx->buf);
+        case serve_op_read:
+            if ((rc = ahb_read(ctx->ahb, req->addr, ctx->buf, req->len)) < 0)
+                return rc;
+            *rsp_len = rc;
+            return 0;
+        case serve_op_write:
+            rc = ahb_write(ctx->ahb, req->addr, ctx->buf, req->len);
+            if (rc < 0)
+                return rc;
+            return (size_t)rc == req->len ? 0 : -EIO;
+        case serve_op_flash_read:
+            if ((rc = serve_get_flash(ctx, &chip)) < 0)
+                return rc;
+            if ((rc = flash_read(chip, req->addr, ctx->buf, req->len)) < 0)
+                return rc;
+            *rsp_len = req->len;
+            return 0;
+        case serve_op_flash_write:
+            if ((rc = serve_get_flash(ctx, &chip)) < 0)
+                return rc;
+            return flash_write(chip, req->addr, ctx->buf, req->len, true);
+        case serve_op_flash_erase:
+            if ((rc = serve_get_flash(ctx, &chip)) < 0)
+                return rc;
+            return flash_erase(chip, req->addr, req->len);
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+static bool serve_has_payload(uint32_t op)
+{
+    return op == serve_op_writel || op == serve_op_write ||
+           op == serve_op_flash_write;
+}
+
+static int serve_client(struct serve *ctx, int fd)
+{
+    struct serve_req req;
+    struct serve_rsp rsp;
+    uint32_t len;
+    int rc;
+
+    while (!serve_stop) {
+        if ((rc = serve_recv(fd, &req, sizeof(req))) < 0)
+            return rc == -ECONNRESET ? 0 : rc;
+
+        /* Reject oversized requests without losing sync with the stream */
+        if (req.len > SERVE_MAX_LEN)
+            return -EMSGSIZE;
+
+        if (serve_has_payload(req.op) &&
+                (rc = serve_recv(fd, ctx->buf, req.len)) < 0)
+            return rc;
+
+        rsp.rc = serve_dispatch(ctx, &req, &len);
+        rsp.len = rsp.rc ? 0 : len;
+
+        logt("serve: op %u addr 0x%08x len %u: %d\n", req.op, req.addr,
+             req.len, rsp.rc);
+
+        if ((rc = serve_send(fd, &rsp, sizeof(rsp))) < 0)
+            return rc;
+
+        if (rsp.len && (rc = serve_send(fd, ctx->buf, rsp.len)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int serve_remote_hello(struct serve *ctx, int fd)
+{
+    const struct bridge_caps *caps = ahb_bridge_caps(ctx->ahb);
+    struct remote_hello hello;
+    int rc;
+
+    if ((rc = serve_recv(fd, &hello, sizeof(hello))) < 0)
+        return rc;
+
+    if (memcmp(hello.magic, REMOTE_MAGIC, sizeof(hello.magic)) ||
+            le32toh(hello.version) != REMOTE_VERSION)
+        return -EPROTO;
+
+    ctx->flags = le32toh(hello.flags) &
+                 ((remote_have_zstd() ? REMOTE_F_ZSTD : 0) | REMOTE_F_POLL |
+                  REMOTE_F_MODIFY);
+
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, REMOTE_MAGIC, sizeof(hello.magic));
+    hello.version = htole32(REMOTE_VERSION);
+    hello.flags = htole32(ctx->flags);
+    strncpy(hello.bridge, ctx->ahb->drv->name, sizeof(hello.bridge) - 1);
+    hello.window = htole32(caps->window);
+    hello.burst = htole32(caps->burst);
+    hello.subword = htole32(caps->subword);
+
+    return remote_send(fd, &hello, sizeof(hello));
+}
+
+/*
+ * Points the regions described at the start of @raw at the data following
+ * the descriptors, checking they add up to @len.
+ */
+static int serve_remote_iov(struct serve *ctx, void *raw, size_t count,
+                            uint32_t len)
+{
+    struct remote_iov *desc = raw;
+    uint8_t *data = (uint8_t *)(desc + count);
+    uint64_t total = 0;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        ctx->iov[i].phys = le32toh(desc[i].phys);
+        ctx->iov[i].len = le32toh(desc[i].len);
+        ctx->iov[i].base = data + total;
+        total += ctx->iov[i].len;
+    }
+
+    return total == len ? 0 : -EINVAL;
+}
+
+static int serve_remote_poll(struct serve *ctx, uint32_t phys,
+                             const struct remote_poll *args, uint32_t *value)
+{
+    struct ahb_poll_policy policy = {
+        .holdoff_us = le32toh(args->holdoff_us),
+        .interval_us = le32toh(args->interval_us),
+        .max_us = le32toh(args->max_us),
+    };
+
+    return ahb_poll(ctx->ahb, phys, le32toh(args->mask),
+                    le32toh(args->value), le64toh(args->timeout_us), &policy,
+                    value);
+}
+
+static int serve_remote_modify(struct serve *ctx, uint32_t phys,
+                               const struct remote_modify *args)
+{
+    return ahb_modifyl(ctx->ahb, phys, le32toh(args->clear),
+                       le32toh(args->set));
+}
+
+static ssize_t serve_remote_dispatch(struct serve *ctx,
+                                     const struct remote_req *req,
+                                     void *raw, uint32_t *value)
+{
+    size_t count = le16toh(req->count);
+    uint32_t phys = le32toh(req->phys);
+    uint32_t len = le32toh(req->len);
+    void *data = (struct remote_iov *)raw + count;
+    int rc;
+
+    switch (req->op) {
+        case remote_op_readl:
+            return ahb_readl(ctx->ahb, phys, value);
+        case remote_op_writel:
+            return ahb_writel(ctx->ahb, phys, le32toh(req->value));
+        case remote_op_read:
+            return ahb_read(ctx->ahb, phys, data, len);
+        case remote_op_write:
+            return ahb_write(ctx->ahb, phys, data, len);
+        case remote_op_readv:
+            if ((rc = serve_remote_iov(ctx, raw, count, len)) < 0)
+                return rc;
+            return ahb_readv(ctx->ahb, ctx->iov, count);
+        case remote_op_writev:
+            if ((rc = serve_remote_iov(ctx, raw, count, len)) < 0)
+                return rc;
+            return ahb_writev(ctx->ahb, ctx->iov, count);
+        case remote_op_poll:
+            return serve_remote_poll(ctx, phys, raw, value);
+        case remote_op_modifyl:
+            return serve_remote_modify(ctx, phys, raw);
+        default:
+            return -EOPNOTSUPP;
+    }
+}
+
+/* How much a request sends, and how much data its response carries */
+static int serve_remote_sizes(const struct remote_req *req, size_t *in,
+                              size_t *out)
+{
+    size_t desc = le16toh(req->count) * sizeof(struct remote_iov);
+    uint32_t len = le32toh(req->len);
+
+    if (len > REMOTE_MAX_LEN || le16toh(req->count) > REMOTE_MAX_IOV)
+        return -EMSGSIZE;
+
+    *in = 0;
+    *out = 0;
+
+    switch (req->op) {
+        case remote_op_read:
+            *out = len;
+            break;
+        case remote_op_write:
+            *in = len;
+            break;
+        case remote_op_readv:
+            *in = desc;
+            *out = len;
+            break;
+        case remote_op_writev:
+            *in = desc + len;
+            break;
+        case remote_op_poll:
+            *in = sizeof(struct remote_poll);
+            break;
+        case remote_op_modifyl:
+            *in = sizeof(struct remote_modify);
+            break;
+    }
+
+    return 0;
+}
+
+static int serve_remote_client(struct serve *ctx, int fd)
+{
+    struct remote_req req;
+    struct remote_rsp rsp;
+    size_t in, out, packed;
+    const void *payload;
+    uint32_t value;
+    uint8_t *raw;
+    ssize_t rc;
+
+    if ((rc = serve_remote_hello(ctx, fd)) < 0)
+        return rc;
+
+    raw = ctx->buf;
+
+    while (!serve_stop) {
+        if ((rc = serve_recv(fd, &req, sizeof(req))) < 0)
+            return rc == -ECONNRESET ? 0 : rc;
+
+        if ((rc = serve_remote_sizes(&req, &in, &out)) < 0)
+            return rc;
+
+        /* Payloads are only ever sized from the header, never trusted */
+        if (req.flags & REMOTE_M_ZSTD) {
+            if (le32toh(req.payload) > ctx->wire_len)
+                return -EMSGSIZE;
+            if ((rc = serve_recv(fd, ctx->wire, le32toh(req.payload))) < 0)
+                return rc;
+            if ((rc = remote_unpack(raw, in, ctx->wire,
+                                    le32toh(req.payload))) < 0)
+                return rc;
+        } else {
+            if (le32toh(req.payload) != in)
+                return -EPROTO;
+            if ((rc = serve_recv(fd, raw, in)) < 0)
+                return rc;
+        }
+
+        value = 0;
+        rc = serve_remote_dispatch(ctx, &req, raw, &value);
+
+        logt("serve: remote op %u addr 0x%08x len %u: %zd\n", req.op,
+             le32toh(req.phys), le32toh(req.len), rc);
+
+        memset(&rsp, 0, sizeof(rsp));
+        rsp.tag = req.tag;
+        rsp.rc = htole32(rc);
+        rsp.value = htole32(value);
+
+        payload = NULL;
+        packed = 0;
+        if (rc > 0 && out) {
+            /* readv's data follows its descriptors */
+            payload = raw + (req.op == remote_op_readv ? in : 0);
+            out = rc;
+
+            if (ctx->flags & REMOTE_F_ZSTD)
+                packed = remote_pack(ctx->wire, ctx->wire_len, payload, out);
+            if (packed) {
+                rsp.flags = REMOTE_M_ZSTD;
+                payload = ctx->wire;
+                out = packed;
+            }
+        } else {
+            out = 0;
+        }
+
+        rsp.payload = htole32(out);
+
+        if ((rc = remote_send_msg(fd, &rsp, sizeof(rsp), payload, out)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int serve_tty_read(int fd, void *buf, size_t len)
+{
+    while (len) {
+        ssize_t rc = read(fd, buf, len);
+
+        if (rc < 0) {
+            if (errno == EINTR && !serve_stop)
+                continue;
+            return -errno;
+        }
+
+        if (!rc)
+            return -ECONNRESET;
+
+        buf = (char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int serve_tty_write(int fd, const void *buf, size_t len)
+{
+    while (len) {
+        ssize_t rc = write(fd, buf, len);
+
+        if (rc < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        buf = (const char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/* What follows a request's header, and what its response carries */
+static int serve_stub_sizes(uint8_t op, uint16_t count, size_t *in,
+                            size_t *out)
+{
+    switch (op) {
+        case debugstub_op_ping:
+            *in = 0;
+            *out = sizeof(uint32_t);
+            return count == *out ? 0 : -EINVAL;
+        case debugstub_op_read:
+            *in = 0;
+            *out = count;
+            return 0;
+        case debugstub_op_write:
+            *in = count;
+            *out = 0;
+            return 0;
+        case debugstub_op_poll:
+            *in = 3 * sizeof(uint32_t);
+            *out = sizeof(uint32_t);
+            return count == *in ? 0 : -EINVAL;
+        case debugstub_op_modify:
+            *in = 2 * sizeof(uint32_t);
+            *out = 0;
+            return count == *in ? 0 : -EINVAL;
+    }
+
+    return -EOPNOTSUPP;
+}
+
+static int serve_stub_dispatch(struct serve *ctx, uint8_t op, uint32_t addr,
+                               uint8_t *buf, uint16_t count)
+{
+    uint32_t val;
+    ssize_t rc;
+    int err;
+
+    switch (op) {
+        case debugstub_op_ping:
+            debugstub_put_le32(buf, DEBUGSTUB_VERSION);
+            return 0;
+        case debugstub_op_read:
+            rc = ahb_read(ctx->ahb, addr, buf, count);
+            return rc < 0 ? rc : 0;
+        case debugstub_op_write:
+            rc = ahb_write(ctx->ahb, addr, buf, count);
+            return rc < 0 ? rc : 0;
+        case debugstub_op_poll:
+            err = ahb_poll(ctx->ahb, addr, debugstub_get_le32(&buf[0]),
+                           debugstub_get_le32(&buf[4]),
+                           debugstub_get_le32(&buf[8]), NULL, &val);
+            if (err == -ETIMEDOUT)
+                return -EAGAIN;
+            if (err < 0)
+                return err;
+            debugstub_put_le32(buf, val);
+            return 0;
+        case debugstub_op_modify:
+            return ahb_modifyl(ctx->ahb, addr, debugstub_get_le32(&buf[0]),
+                               debugstub_get_le32(&buf[4]));
+    }
+
+    return -EOPNOTSUPP;
+}
+
+/*
+ * Requests that fail their CRC or don't make sense are dropped without an
+ * answer, the host retries once its response times out.
+ */
+static int serve_stub(struct serve *ctx, int fd)
+{
+    uint8_t hdr[DEBUGSTUB_HDR_LEN], crc[DEBUGSTUB_CRC_LEN];
+    uint8_t *buf = ctx->buf;
+    size_t in, out;
+    uint16_t count;
+    uint32_t addr;
+    int32_t status;
+    uint32_t sum;
+    int rc;
+
+    while (!serve_stop) {
+        do {
+            if ((rc = serve_tty_read(fd, hdr, 1)) < 0)
+                return rc;
+        } while (hdr[0] != DEBUGSTUB_SYNC_REQ);
+
+        if ((rc = serve_tty_read(fd, &hdr[1], sizeof(hdr) - 1)) < 0)
+            return rc;
+
+        count = debugstub_get_le16(&hdr[2]);
+        addr = debugstub_get_le32(&hdr[4]);
+
+        if (count > DEBUGSTUB_MAX ||
+                serve_stub_sizes(hdr[1], count, &in, &out) < 0) {
+            logd("Dropping malformed stub request %u of %u bytes\n", hdr[1],
+                 count);
+            continue;
+        }
+
+        if (in && (rc = serve_tty_read(fd, buf, in)) < 0)
+            return rc;
+
+        if ((rc = serve_tty_read(fd, crc, sizeof(crc))) < 0)
+            return rc;
+
+        sum = crc32_update(crc32_update(0, hdr, sizeof(hdr)), buf, in);
+        if (debugstub_get_le32(crc) != sum) {
+            logd("Dropping stub request %u at 0x%08x with a bad CRC\n",
+                 hdr[1], addr);
+            continue;
+        }
+
+        status = serve_stub_dispatch(ctx, hdr[1], addr, buf, count);
+
+        logt("serve: stub op %u addr 0x%08x len %u: %d\n", hdr[1], addr,
+             count, status);
+
+        if (status)
+            out = 0;
+
+        hdr[0] = DEBUGSTUB_SYNC_RSP;
+        debugstub_put_le16(&hdr[2], out);
+        debugstub_put_le32(&hdr[4], status);
+        debugstub_put_le32(crc, crc32_update(crc32_update(0, hdr, sizeof(hdr)),
+                                             buf, out));
+
+        if ((rc = serve_tty_write(fd, hdr, sizeof(hdr))) < 0)
+            return rc;
+
+        if (out && (rc = serve_tty_write(fd, buf, out)) < 0)
+            return rc;
+
+        if ((rc = serve_tty_write(fd, crc, sizeof(crc))) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int serve_stub_open(const char *path)
+{
+    struct termios termios;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDWR | O_NOCTTY | O_CLOEXEC)) < 0)
+        return -errno;
+
+    if (tcgetattr(fd, &termios) < 0)
+        goto cleanup_fd;
+
+    /* Bytes of a frame mustn't be mangled or eaten by the line discipline */
+    cfmakeraw(&termios);
+    if (tcsetattr(fd, TCSAFLUSH, &termios) < 0)
+        goto cleanup_fd;
+
+    return fd;
+
+cleanup_fd:
+    rc = -errno;
+    close(fd);
+
+    return rc;
+}
+
+static int serve_listen(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+
+    strcpy(addr.sun_path, path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -errno;
+
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        goto cleanup_fd;
+
+    if (listen(fd, 1) < 0)
+        goto cleanup_path;
+
+    return fd;
+
+cleanup_path:
+    unlink(path);
+
+cleanup_fd:
+    {
+        int rc = -errno;
+
+        close(fd);
+
+        return rc;
+    }
+}
+
+int cmd_serve(const char *name __unused, int argc, char *argv[])
+{
+    struct sigaction sa = { .sa_handler = serve_handle_signal };
+    struct serve _ctx, *ctx = &_ctx;
+    const char *spec = NULL;
+    const char *path = NULL;
+    const char *tty = NULL;
+    int sfd, cfd;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "listen", required_argument, NULL, 'l' },
+            { "stub", required_argument, NULL, 's' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "l:s:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'l':
+                spec = optarg;
+                break;
+            case 's':
+                tty = optarg;
+                break;
+            case '?':
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (spec && tty) {
+        loge("--listen and --stub are exclusive\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!spec && !tty) {
+        if (argc < 1) {
+            loge("Not enough arguments for serve command\n");
+            exit(EXIT_FAILURE);
+        }
+
+        path = argv[0];
+        argc--;
+        argv++;
+    }
+
+    if ((rc = host_init(&ctx->host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!(ctx->ahb = host_get_ahb(&ctx->host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(&ctx->soc, ctx->ahb)) < 0)
+        goto cleanup_host;
+
+    ctx->chip = NULL;
+    ctx->wire = NULL;
+    ctx->iov = NULL;
+
+    if (!(ctx->buf = malloc(spec ? SERVE_REMOTE_RAW_LEN : SERVE_MAX_LEN))) {
+        rc = -ENOMEM;
+        goto cleanup_soc;
+    }
+
+    if (spec) {
+        ctx->wire_len = remote_pack_bound(SERVE_REMOTE_RAW_LEN);
+        ctx->wire = malloc(ctx->wire_len);
+        ctx->iov = calloc(REMOTE_MAX_IOV, sizeof(*ctx->iov));
+        if (!ctx->wire || !ctx->iov) {
+            rc = -ENOMEM;
+            goto cleanup_buf;
+        }
+    }
+
+    /* No SA_RESTART so a blocked accept() or recv() notices the signal */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* The tty is the one client, for as long as the agent runs */
+    if (tty) {
+        if ((cfd = serve_stub_open(tty)) < 0) {
+            rc = cfd;
+            loge("Failed to open %s: %d\n", tty, rc);
+            goto cleanup_buf;
+        }
+
+        logi("Serving the BMC on %s\n", tty);
+
+        rc = serve_stub(ctx, cfd);
+        if (rc == -EINTR)
+            rc = 0;
+        else if (rc < 0)
+            loge("Failed to serve %s: %d\n", tty, rc);
+
+        close(cfd);
+        goto cleanup_buf;
+    }
+
+    if ((sfd = spec ? remote_listen(spec) : serve_listen(path)) < 0) {
+        rc = sfd;
+        loge("Failed to listen on %s: %d\n", spec ?: path, rc);
+        goto cleanup_buf;
+    }
+
+    logi("Serving the BMC on %s\n", spec ?: path);
+
+    rc = 0;
+    while (!serve_stop) {
+        if (spec)
+            cfd = remote_accept(sfd);
+        else if ((cfd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+            cfd = -errno;
+
+        if (cfd < 0) {
+            if (cfd == -EINTR)
+                continue;
+            rc = cfd;
+            loge("Failed to accept client: %d\n", rc);
+            break;
+        }
+
+        logd("Client connected\n");
+
+        if (spec)
+            rc = serve_remote_client(ctx, cfd);
+        else
+            rc = serve_client(ctx, cfd);
+
+        if (rc < 0)
+            logi("Dropped client: %d\n", rc);
+        else
+            logd("Client disconnected\n");
+
+        close(cfd);
+        rc = 0;
+    }
+
+    close(sfd);
+    if (path)
+        unlink(path);
+
+cleanup_buf:
+    free(ctx->iov);
+    free(ctx->wire);
+    free(ctx->buf);
+
+    if (ctx->chip)
+        flash_destroy(ctx->chip);
+
+cleanup_soc:
+    soc_destroy(&ctx->soc);
+
+cleanup_host:
+    host_destroy(&ctx->host);
+
+    return rc;
+}
@@ -5,30 +5,141 @@
 #include "compiler.h"
 #include "flash.h"
 #include "host.h"
+#include "image.h"
+#include "layout.h"
 #include "log.h"
 #include "priv.h"
+#include "progress.h"
+#include "ring.h"
 #include "soc/sfc.h"
+#include "span.h"
+#include "tune.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define SFC_FLASH_WIN (64 << 10)
+/* Memory held for a read is bounded to RING_DEPTH of these */
+#define SFC_READ_CHUNK (1 << 20)
 
 enum flash_op { flash_op_read, flash_op_write, flash_op_erase };
 
+static void *sfc_read_drain(void *arg)
+{
+    struct ring *ring = arg;
+    struct ring_slot *slot;
+
+    span_thread_name("sfc-drain");
+
+    while ((slot = ring_get_full(ring))) {
+        const char *cursor = slot->buf;
+        ssize_t remaining = slot->len;
+
+        while (remaining) {
+            ssize_t egress = write(1, cursor, remaining);
+
+            if (egress < 0) {
+                if (errno == EINTR)
+                    continue;
+                perror("write");
+                ring_abort(ring, -errno);
+                return NULL;
+            }
+
+            cursor += egress;
+            remaining -= egress;
+        }
+
+        ring_put_empty(ring);
+    }
+
+    return NULL;
+}
+
+/*
+ * Reads go through the bridge on the calling thread while a worker writes the
+ * previous chunks out, so large chips need neither their size in RAM nor the
+ * two halves of the copy serialised.
+ */
+static int sfc_read(struct flash_chip *chip, uint32_t offset, uint32_t len)
+{
+    struct progress progress;
+    struct ring_slot *slot;
+    struct ring ring;
+    struct tune tune;
+    pthread_t worker;
+    uint64_t begin;
+    int rc;
+
+    if ((rc = ring_init(&ring, SFC_READ_CHUNK)) < 0)
+        return rc;
+
+    /* Whole flash windows, up to what a slot holds */
+    tune_init(&tune, "flash read", SFC_READ_CHUNK, SFC_FLASH_WIN,
+              SFC_READ_CHUNK, SFC_FLASH_WIN);
+
+    if ((rc = -pthread_create(&worker, NULL, sfc_read_drain, &ring)))
+        goto cleanup_ring;
+
+    progress_init(&progress, "read", len);
+    progress_set_base(&progress, offset);
+
+    while (len) {
+        uint32_t chunk = tune_size(&tune);
+
+        if (chunk > len)
+            chunk = len;
+
+        begin = tune_now();
+        if (!(slot = ring_get_empty(&ring)))
+            break;
+
+        if ((rc = flash_read(chip, offset, slot->buf, chunk)) < 0) {
+            ring_abort(&ring, rc);
+            break;
+        }
+
+        slot->len = chunk;
+        ring_put_full(&ring);
+
+        offset += chunk;
+        len -= chunk;
+
+        progress_update(&progress, chunk);
+        tune_sample(&tune, chunk, tune_now() - begin);
+    }
+
+    ring_finish(&ring);
+    pthread_join(worker, NULL);
+
+    progress_end(&progress);
+
+    rc = ring_status(&ring);
+
+cleanup_ring:
+    ring_destroy(&ring);
+
+    return rc;
+}
+
 int cmd_sfc(const char *name __unused, int argc, char *argv[])
 {
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
+    const char *partition = NULL;
+    uint32_t offset, len, limit;
     struct flash_chip *chip;
-    uint32_t offset, len;
     enum flash_op op;
+    bool whole;
+    char *end;
     struct sfc *sfc;
     struct ahb *ahb;
-    char *buf;
     int rc;
 
     if (argc < 4) {
@@ -36,11 +147,6 @@ int cmd_sfc(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    if (strcmp("fmc", argv[0])) {
-        loge("Unsupported sfc type: '%s'\n", argv[0]);
-        exit(EXIT_FAILURE);
-    }
-
     if (!strcmp("read", argv[1])) {
         op = flash_op_read;
     } else if (!strcmp("write", argv[1])) {
@@ -52,8 +158,13 @@ int cmd_sfc(const char *name __unused, int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
-    offset = strtoul(argv[2], NULL, 0);
-    len = strtoul(argv[3], NULL, 0);
+    /* ADDRESS may name a partition instead, and LENGTH may be '-' for all of it */
+    offset = strtoul(argv[2], &end, 0);
+    if (end == argv[2] || *end)
+        partition = argv[2];
+
+    whole = !strcmp("-", argv[3]);
+    len = whole ? 0 : strtoul(argv[3], NULL, 0);
 
     if ((rc = host_init(host, argc - 4, argv + 4)) < 0) {
         loge("Failed to initialise host interfaces: %d\n", rc);
@@ -70,9 +181,9 @@ int cmd_sfc(const char *name __unused, int argc, char *argv[])
     if (rc < 0)
         goto cleanup_host;
 
-    ;
-    if (!(sfc = sfc_get_by_name(soc, "fmc"))) {
+    if (!(sfc = sfc_get(soc, argv[0]))) {
         loge("Failed to acquire SPI controller, exiting\n");
+        rc = -ENODEV;
         goto cleanup_soc;
     }
 
@@ -80,47 +191,73 @@ int cmd_sfc(const char *name __unused, int argc, char *argv[])
     if (rc < 0)
         goto cleanup_soc;
 
-    if (op == flash_op_read) {
-        ssize_t egress;
+    limit = chip->tsize;
+    if (partition) {
+        struct flash_part part;
 
-        buf = malloc(len);
-        if (!buf)
+        if ((rc = flash_get_part(chip, partition, &part)) < 0)
             goto cleanup_flash;
 
-        rc = flash_read(chip, offset, buf, len);
-        egress = write(1, buf, len);
-        if (egress == -1) {
-            rc = -errno;
-            perror("write");
+        if (len > part.size) {
+            loge("Length 0x%" PRIx32 " exceeds the 0x%" PRIx32 " bytes of %s\n",
+                 len, part.size, part.name);
+            rc = -EFBIG;
+            goto cleanup_flash;
         }
 
-        free(buf);
+        offset = part.offset;
+        limit = part.offset + part.size;
+    } else if (offset >= limit) {
+        loge("Address 0x%" PRIx32 " is beyond the end of the flash\n", offset);
+        rc = -EINVAL;
+        goto cleanup_flash;
+    }
+
+    if (whole)
+        len = limit - offset;
+
+    /* Flash commands poll the controller, keep the bridge set up between them */
+    if ((rc = ahb_session_begin(ahb)) < 0)
+        goto cleanup_flash;
+
+    if (op == flash_op_read) {
+        rc = sfc_read(chip, offset, len);
     } else if (op == flash_op_write) {
+        struct image_source src;
+        const char *data;
         ssize_t ingress;
 
-        len = SFC_FLASH_WIN;
-        buf = malloc(len);
-        if (!buf)
-            goto cleanup_flash;
+        /* A compressed image is decompressed by a reader as we program */
+        if ((rc = image_source_open(&src, NULL, SFC_FLASH_WIN)) < 0) {
+            loge("Failed to read the image on stdin: %d\n", rc);
+            goto end_session;
+        }
 
-        while ((ingress = read(0, buf, len))) {
-            if (ingress < 0) {
-                rc = -errno;
+        while ((ingress = image_source_next(&src, &data)) > 0) {
+            if ((uint32_t)ingress > limit - offset) {
+                loge("Input runs past 0x%08" PRIx32 "\n", limit);
+                ingress = -EFBIG;
                 break;
             }
 
-            rc = flash_write(chip, offset, buf, ingress, true);
+            rc = flash_write(chip, offset, data, ingress, true);
             if (rc < 0)
                 break;
 
             offset += ingress;
         }
 
-        free(buf);
+        if (ingress < 0)
+            rc = ingress;
+
+        image_source_close(&src);
     } else if (op == flash_op_erase) {
         rc = flash_erase(chip, offset, len);
     }
 
+end_session:
+    ahb_session_end(ahb);
+
 cleanup_flash:
     flash_destroy(chip);
 
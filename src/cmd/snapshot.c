@@ -0,0 +1,667 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "host.h"
+#include "log.h"
+#include "soc.h"
+
+#include <libfdt.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/*
+ * A snapshot captures the register blocks of every devicetree node with a
+ * reg property, as little-endian fields:
+ *
+ *   header:  "CVSNAP\0\0", le32 version, le32 SoC revision, le32 region
+ *            count, le32 file offset of the string table
+ *   index:   per region, le32 address, le32 length, le32 file offset of its
+ *            data, le32 string table offset of the node's path
+ *   strings: the NUL-terminated node paths
+ *   data:    each region's contents as read from the bus
+ *
+ * Nodes carrying a "culvert,snapshot-exclude" property with no value are
+ * skipped, otherwise its <address length> pairs are left out of the node's
+ * regions. Those cover registers whose read has side-effects, such as FIFOs.
+ *
+ * `snapshot diff` compares a snapshot against another or against the SoC as
+ * it is now, reading only the base snapshot's regions, and reports each
+ * changed word under the node it belongs to.
+ */
+#define SNAPSHOT_MAGIC          "CVSNAP\0\0"
+#define SNAPSHOT_VERSION        1
+#define SNAPSHOT_HDR_LEN        24
+#define SNAPSHOT_ENTRY_LEN      16
+
+#define SNAPSHOT_EXCLUDE        "culvert,snapshot-exclude"
+
+/* Equal blocks are skipped with memcmp() before looking at words */
+#define SNAPSHOT_DIFF_BLOCK     64
+
+struct snapshot_region {
+    uint32_t phys;
+    uint32_t len;
+    uint32_t name;
+};
+
+struct snapshot {
+    struct snapshot_region *regions;
+    size_t nregions;
+    char *strings;
+    size_t strings_len;
+    size_t data_len;
+};
+
+static int snapshot_add(struct snapshot *ctx, uint32_t name, uint64_t start,
+                        uint64_t end)
+{
+    struct snapshot_region *regions;
+
+    if (start >= end)
+        return 0;
+
+    regions = realloc(ctx->regions, (ctx->nregions + 1) * sizeof(*regions));
+    if (!regions)
+        return -ENOMEM;
+
+    ctx->regions = regions;
+    regions[ctx->nregions].phys = start;
+    regions[ctx->nregions].len = end - start;
+    regions[ctx->nregions].name = name;
+    ctx->nregions++;
+    ctx->data_len += end - start;
+
+    return 0;
+}
+
+/* Add @region less the parts covered by the @nexcl pairs in @excl */
+static int snapshot_add_region(struct snapshot *ctx, uint32_t name,
+                               const struct soc_region *region,
+                               const uint32_t *excl, int nexcl)
+{
+    uint64_t cursor = region->start;
+    uint64_t end = cursor + region->length;
+    int rc;
+
+    while (cursor < end) {
+        uint64_t next_start = end, next_end = end;
+        int i;
+
+        /* The first exclusion overlapping what's left */
+        for (i = 0; i < nexcl; i++) {
+            uint64_t ex_start = be32toh(excl[2 * i]);
+            uint64_t ex_end = ex_start + be32toh(excl[2 * i + 1]);
+
+            if (ex_end <= cursor || ex_start >= end || ex_start >= next_start)
+                continue;
+
+            next_start = ex_start > cursor ? ex_start : cursor;
+            next_end = ex_end < end ? ex_end : end;
+        }
+
+        if ((rc = snapshot_add(ctx, name, cursor, next_start)) < 0)
+            return rc;
+
+        cursor = next_end;
+    }
+
+    return 0;
+}
+
+static int snapshot_add_name(struct snapshot *ctx, const char *path,
+                             uint32_t *name)
+{
+    size_t len = strlen(path) + 1;
+    char *strings;
+
+    strings = realloc(ctx->strings, ctx->strings_len + len);
+    if (!strings)
+        return -ENOMEM;
+
+    memcpy(&strings[ctx->strings_len], path, len);
+    ctx->strings = strings;
+    *name = ctx->strings_len;
+    ctx->strings_len += len;
+
+    return 0;
+}
+
+static int snapshot_add_node(struct snapshot *ctx, struct soc *soc, int node)
+{
+    struct soc_device_node dn = { .fdt = &soc->fdt, .offset = node };
+    const void *fdt = soc->fdt.start;
+    struct soc_region region;
+    const uint32_t *excl;
+    const char *type;
+    char path[PATH_MAX];
+    uint32_t name;
+    int index;
+    int len;
+    int rc;
+
+    /* DRAM isn't a register block */
+    type = fdt_getprop(fdt, node, "device_type", NULL);
+    if (type && !strcmp(type, "memory"))
+        return 0;
+
+    if (!fdt_getprop(fdt, node, "reg", NULL))
+        return 0;
+
+    if ((rc = fdt_get_path(fdt, node, path, sizeof(path))) < 0)
+        return -EUCLEAN;
+
+    excl = fdt_getprop(fdt, node, SNAPSHOT_EXCLUDE, &len);
+    if (excl && !len) {
+        logd("Excluding %s from the snapshot\n", path);
+        return 0;
+    }
+
+    if ((rc = snapshot_add_name(ctx, path, &name)) < 0)
+        return rc;
+
+    for (index = 0; !soc_device_get_memory_index(soc, &dn, index, &region);
+         index++) {
+        rc = snapshot_add_region(ctx, name, &region, excl,
+                                 excl ? len / (2 * sizeof(*excl)) : 0);
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int snapshot_discover(struct snapshot *ctx, struct soc *soc)
+{
+    int depth = 0;
+    int node;
+    int rc;
+
+    for (node = fdt_next_node(soc->fdt.start, -1, &depth);
+         node >= 0 && depth >= 0;
+         node = fdt_next_node(soc->fdt.start, node, &depth)) {
+        if ((rc = snapshot_add_node(ctx, soc, node)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static void snapshot_destroy(struct snapshot *ctx)
+{
+    free(ctx->regions);
+    free(ctx->strings);
+}
+
+static void snapshot_put_le32(uint8_t *p, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static int snapshot_write_all(int fd, const void *buf, size_t len)
+{
+    const char *cursor = buf;
+    ssize_t wrote;
+
+    while (len) {
+        if ((wrote = write(fd, cursor, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        cursor += wrote;
+        len -= wrote;
+    }
+
+    return 0;
+}
+
+/* Read each region in one access, then write out the file in one pass */
+static int snapshot_save(struct snapshot *ctx, struct soc *soc, int fd)
+{
+    size_t index_len, strings_off, data_off, meta_len, i;
+    uint8_t *meta, *data, *cursor;
+    ssize_t rc;
+
+    index_len = ctx->nregions * SNAPSHOT_ENTRY_LEN;
+    strings_off = SNAPSHOT_HDR_LEN + index_len;
+    /* Keep the data word-aligned, the regions are all word multiples */
+    data_off = (strings_off + ctx->strings_len + 3) & ~(size_t)3;
+    meta_len = data_off;
+
+    if (!(meta = calloc(1, meta_len)))
+        return -ENOMEM;
+
+    if (!(data = malloc(ctx->data_len))) {
+        rc = -ENOMEM;
+        goto cleanup_meta;
+    }
+
+    if ((rc = ahb_session_begin(soc->ahb)) < 0)
+        goto cleanup_data;
+
+    for (i = 0, cursor = data; i < ctx->nregions; i++) {
+        const struct snapshot_region *region = &ctx->regions[i];
+
+        logd("Reading %s: 0x%08" PRIx32 "+0x%" PRIx32 "\n",
+             &ctx->strings[region->name], region->phys, region->len);
+
+        rc = soc_read(soc, region->phys, cursor, region->len);
+        if (rc < 0 || (size_t)rc != region->len) {
+            loge("Failed to read %" PRIu32 " bytes at 0x%08" PRIx32 ": %zd\n",
+                 region->len, region->phys, rc);
+            rc = rc < 0 ? rc : -EIO;
+            ahb_session_end(soc->ahb);
+            goto cleanup_data;
+        }
+
+        snapshot_put_le32(&meta[SNAPSHOT_HDR_LEN + i * SNAPSHOT_ENTRY_LEN + 0],
+                          region->phys);
+        snapshot_put_le32(&meta[SNAPSHOT_HDR_LEN + i * SNAPSHOT_ENTRY_LEN + 4],
+                          region->len);
+        snapshot_put_le32(&meta[SNAPSHOT_HDR_LEN + i * SNAPSHOT_ENTRY_LEN + 8],
+                          data_off + (cursor - data));
+        snapshot_put_le32(&meta[SNAPSHOT_HDR_LEN + i * SNAPSHOT_ENTRY_LEN + 12],
+                          region->name);
+
+        cursor += region->len;
+    }
+
+    ahb_session_end(soc->ahb);
+
+    memcpy(&meta[0], SNAPSHOT_MAGIC, 8);
+    snapshot_put_le32(&meta[8], SNAPSHOT_VERSION);
+    snapshot_put_le32(&meta[12], soc->rev);
+    snapshot_put_le32(&meta[16], ctx->nregions);
+    snapshot_put_le32(&meta[20], strings_off);
+    memcpy(&meta[strings_off], ctx->strings, ctx->strings_len);
+
+    if ((rc = snapshot_write_all(fd, meta, meta_len)) < 0)
+        goto cleanup_data;
+
+    rc = snapshot_write_all(fd, data, ctx->data_len);
+
+cleanup_data:
+    free(data);
+
+cleanup_meta:
+    free(meta);
+
+    return rc;
+}
+
+static uint32_t snapshot_get_le32(const uint8_t *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+
+    return le32toh(val);
+}
+
+/* A snapshot file loaded for comparison */
+struct snapshot_image {
+    uint8_t *buf;
+    size_t len;
+    uint32_t rev;
+    uint32_t nregions;
+};
+
+struct snapshot_entry {
+    uint32_t phys;
+    uint32_t len;
+    const uint8_t *data;
+    const char *name;
+};
+
+static int snapshot_get_entry(const struct snapshot_image *image, uint32_t index,
+                              struct snapshot_entry *entry)
+{
+    const uint8_t *raw = &image->buf[SNAPSHOT_HDR_LEN + index * SNAPSHOT_ENTRY_LEN];
+    uint32_t strings = snapshot_get_le32(&image->buf[20]);
+    uint32_t data, name;
+
+    entry->phys = snapshot_get_le32(&raw[0]);
+    entry->len = snapshot_get_le32(&raw[4]);
+    data = snapshot_get_le32(&raw[8]);
+    name = snapshot_get_le32(&raw[12]);
+
+    if (data > image->len || entry->len > image->len - data ||
+            (uint64_t)strings + name >= image->len ||
+            !memchr(&image->buf[strings + name], '\0', image->len - strings - name))
+        return -EBADMSG;
+
+    entry->data = &image->buf[data];
+    entry->name = (const char *)&image->buf[strings + name];
+
+    return 0;
+}
+
+static int snapshot_load(struct snapshot_image *image, const char *path)
+{
+    struct snapshot_entry entry;
+    struct stat st;
+    ssize_t got;
+    size_t done;
+    uint32_t i;
+    int fd;
+    int rc;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    image->len = st.st_size;
+    if (!(image->buf = malloc(image->len ? image->len : 1))) {
+        rc = -ENOMEM;
+        goto cleanup_fd;
+    }
+
+    for (done = 0; done < image->len; done += got) {
+        if ((got = read(fd, &image->buf[done], image->len - done)) <= 0) {
+            if (got < 0 && errno == EINTR) {
+                got = 0;
+                continue;
+            }
+            rc = got < 0 ? -errno : -EBADMSG;
+            goto cleanup_buf;
+        }
+    }
+
+    if (image->len < SNAPSHOT_HDR_LEN || memcmp(image->buf, SNAPSHOT_MAGIC, 8) ||
+            snapshot_get_le32(&image->buf[8]) != SNAPSHOT_VERSION) {
+        rc = -EBADMSG;
+        goto cleanup_buf;
+    }
+
+    image->rev = snapshot_get_le32(&image->buf[12]);
+    image->nregions = snapshot_get_le32(&image->buf[16]);
+    if ((image->len - SNAPSHOT_HDR_LEN) / SNAPSHOT_ENTRY_LEN < image->nregions) {
+        rc = -EBADMSG;
+        goto cleanup_buf;
+    }
+
+    /* Check the index once so lookups can't run off the end */
+    for (i = 0; i < image->nregions; i++) {
+        if ((rc = snapshot_get_entry(image, i, &entry)) < 0)
+            goto cleanup_buf;
+    }
+
+    close(fd);
+
+    return 0;
+
+cleanup_buf:
+    free(image->buf);
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+/* Regions come out of the same devicetree in the same order, try @hint first */
+static int snapshot_find(const struct snapshot_image *image, uint32_t hint,
+                         const struct snapshot_entry *want,
+                         struct snapshot_entry *found)
+{
+    uint32_t i;
+
+    for (i = 0; i < image->nregions; i++) {
+        snapshot_get_entry(image, (hint + i) % image->nregions, found);
+        if (found->phys == want->phys && found->len == want->len)
+            return 0;
+    }
+
+    return -ENOENT;
+}
+
+struct snapshot_diff {
+    const char *node;
+    unsigned long changed;
+};
+
+static void snapshot_diff_region(struct snapshot_diff *ctx,
+                                 const struct snapshot_entry *base,
+                                 const uint8_t *other)
+{
+    uint32_t off, end, word;
+
+    for (off = 0; off < base->len; off = end) {
+        end = off + SNAPSHOT_DIFF_BLOCK;
+        if (end > base->len)
+            end = base->len;
+
+        if (!memcmp(&base->data[off], &other[off], end - off))
+            continue;
+
+        for (word = off; word < end; word += 4) {
+            uint32_t was, now;
+
+            if (end - word < 4) {
+                was = now = 0;
+                memcpy(&was, &base->data[word], end - word);
+                memcpy(&now, &other[word], end - word);
+            } else {
+                was = snapshot_get_le32(&base->data[word]);
+                now = snapshot_get_le32(&other[word]);
+            }
+
+            if (was == now)
+                continue;
+
+            if (ctx->node != base->name) {
+                printf("%s:\n", base->name);
+                ctx->node = base->name;
+            }
+
+            printf("  0x%08" PRIx32 ": 0x%08" PRIx32 " -> 0x%08" PRIx32 "\n",
+                   base->phys + word, was, now);
+            ctx->changed++;
+        }
+    }
+}
+
+static int snapshot_diff_files(const struct snapshot_image *base,
+                               const struct snapshot_image *other)
+{
+    struct snapshot_diff diff = { 0 };
+    struct snapshot_entry entry, match;
+    uint32_t i;
+
+    if (base->rev != other->rev)
+        printf("SoC revision: 0x%08" PRIx32 " -> 0x%08" PRIx32 "\n",
+               base->rev, other->rev);
+
+    for (i = 0; i < base->nregions; i++) {
+        snapshot_get_entry(base, i, &entry);
+
+        if (snapshot_find(other, i, &entry, &match) < 0) {
+            printf("%s: 0x%08" PRIx32 "+0x%" PRIx32 " only in the base\n",
+                   entry.name, entry.phys, entry.len);
+            diff.changed++;
+            continue;
+        }
+
+        snapshot_diff_region(&diff, &entry, match.data);
+    }
+
+    for (i = 0; i < other->nregions; i++) {
+        snapshot_get_entry(other, i, &entry);
+
+        if (snapshot_find(base, i, &entry, &match) < 0) {
+            printf("%s: 0x%08" PRIx32 "+0x%" PRIx32 " only in the comparison\n",
+                   entry.name, entry.phys, entry.len);
+            diff.changed++;
+        }
+    }
+
+    logi("%lu differences\n", diff.changed);
+
+    return diff.changed ? 1 : 0;
+}
+
+static int snapshot_diff_live(const struct snapshot_image *base, struct soc *soc)
+{
+    struct snapshot_diff diff = { 0 };
+    struct snapshot_entry entry;
+    uint32_t max = 0, i;
+    uint8_t *live;
+    ssize_t rc;
+
+    if (base->rev != soc->rev)
+        printf("SoC revision: 0x%08" PRIx32 " -> 0x%08" PRIx32 "\n",
+               base->rev, soc->rev);
+
+    for (i = 0; i < base->nregions; i++) {
+        snapshot_get_entry(base, i, &entry);
+        if (entry.len > max)
+            max = entry.len;
+    }
+
+    if (!(live = malloc(max ? max : 1)))
+        return -ENOMEM;
+
+    if ((rc = ahb_session_begin(soc->ahb)) < 0)
+        goto cleanup_live;
+
+    for (i = 0; i < base->nregions; i++) {
+        snapshot_get_entry(base, i, &entry);
+
+        rc = soc_read(soc, entry.phys, live, entry.len);
+        if (rc < 0 || (size_t)rc != entry.len) {
+            loge("Failed to read %" PRIu32 " bytes at 0x%08" PRIx32 ": %zd\n",
+                 entry.len, entry.phys, rc);
+            rc = rc < 0 ? rc : -EIO;
+            goto end_session;
+        }
+
+        snapshot_diff_region(&diff, &entry, live);
+    }
+
+    logi("%lu differences\n", diff.changed);
+    rc = diff.changed ? 1 : 0;
+
+end_session:
+    ahb_session_end(soc->ahb);
+
+cleanup_live:
+    free(live);
+
+    return rc;
+}
+
+int cmd_snapshot(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct snapshot_image base, other;
+    struct snapshot snapshot = { 0 };
+    const char *path = NULL;
+    struct ahb *ahb;
+    int argo = 1;
+    int fd;
+    int rc;
+
+    if (argc < 1) {
+        loge("Not enough arguments for snapshot command\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (!strcmp("diff", argv[0])) {
+        if (argc < 3) {
+            loge("Not enough arguments for snapshot diff\n");
+            exit(EXIT_FAILURE);
+        }
+
+        if ((rc = snapshot_load(&base, argv[1])) < 0) {
+            loge("Failed to load snapshot %s: %d\n", argv[1], rc);
+            exit(EXIT_FAILURE);
+        }
+
+        if (strcmp("--live", argv[2])) {
+            if ((rc = snapshot_load(&other, argv[2])) < 0) {
+                loge("Failed to load snapshot %s: %d\n", argv[2], rc);
+                free(base.buf);
+                exit(EXIT_FAILURE);
+            }
+
+            rc = snapshot_diff_files(&base, &other);
+            free(other.buf);
+            free(base.buf);
+
+            return rc;
+        }
+
+        argo = 3;
+    } else {
+        path = argv[0];
+    }
+
+    if ((rc = host_init(host, argc - argo, argv + argo)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = EXIT_FAILURE;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0) {
+        errno = -rc;
+        perror("soc_probe");
+        goto cleanup_host;
+    }
+
+    if (!path) {
+        rc = snapshot_diff_live(&base, soc);
+        goto cleanup_snapshot;
+    }
+
+    if ((rc = snapshot_discover(&snapshot, soc)) < 0) {
+        loge("Failed to walk the devicetree: %d\n", rc);
+        goto cleanup_snapshot;
+    }
+
+    if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", path, rc);
+        goto cleanup_snapshot;
+    }
+
+    if ((rc = snapshot_save(&snapshot, soc, fd)) < 0)
+        loge("Failed to save the snapshot: %d\n", rc);
+    else
+        logi("Captured %zu regions, %zu bytes\n", snapshot.nregions,
+             snapshot.data_len);
+
+    close(fd);
+
+cleanup_snapshot:
+    snapshot_destroy(&snapshot);
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    if (!path)
+        free(base.buf);
+
+    return rc;
+}
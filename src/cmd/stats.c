@@ -0,0 +1,379 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "host.h"
+#include "log.h"
+#include "soc.h"
+
+#include <libfdt.h>
+
+#include <endian.h>
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * The registers sampled are described on their devicetree nodes by
+ *
+ *   culvert,counters = <offset mask>...;
+ *   culvert,counter-names = "...";
+ *   culvert,status = <offset mask>...;
+ *   culvert,status-names = "...";
+ *
+ * with offsets from the node's first reg region and masks selecting the field.
+ * Counters are reported as the change since the previous sample, wrapping at
+ * the width of the field, status fields as they are. Only registers whose
+ * reads have no side-effects belong in either, as they're read at the rate
+ * asked for while other commands may be running against the BMC.
+ */
+#define STATS_COUNTERS          "culvert,counters"
+#define STATS_COUNTER_NAMES     "culvert,counter-names"
+#define STATS_STATUS            "culvert,status"
+#define STATS_STATUS_NAMES      "culvert,status-names"
+
+#define STATS_FIELDS_MAX        64
+#define STATS_RATE_DEFAULT      10
+
+struct stats_field {
+    char name[64];
+    uint32_t phys;
+    uint32_t mask;
+    unsigned int shift;
+    bool counter;
+    /* Where its register lands among those read each sample */
+    unsigned int reg;
+};
+
+struct stats_set {
+    struct stats_field fields[STATS_FIELDS_MAX];
+    unsigned int nfields;
+    /* Each register once, however many fields it holds */
+    uint32_t regs[STATS_FIELDS_MAX];
+    unsigned int nregs;
+};
+
+static volatile sig_atomic_t stats_stop_requested;
+
+static void stats_handle_signal(int signo __unused)
+{
+    stats_stop_requested = 1;
+}
+
+static uint64_t stats_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int stats_add_field(struct stats_set *set, const char *node,
+                           const char *name, uint32_t phys, uint32_t mask,
+                           bool counter)
+{
+    struct stats_field *field;
+    unsigned int i;
+
+    if (set->nfields == STATS_FIELDS_MAX)
+        return -E2BIG;
+
+    if (!mask || (phys & 3))
+        return -EINVAL;
+
+    field = &set->fields[set->nfields];
+    snprintf(field->name, sizeof(field->name), "%s.%s", node, name);
+    field->phys = phys;
+    field->mask = mask;
+    field->shift = __builtin_ctz(mask);
+    field->counter = counter;
+
+    for (i = 0; i < set->nregs && set->regs[i] != phys; i++)
+        ;
+
+    if (i == set->nregs)
+        set->regs[set->nregs++] = phys;
+
+    field->reg = i;
+    set->nfields++;
+
+    return 0;
+}
+
+static int stats_add_node(struct stats_set *set, struct soc *soc, int node,
+                          const char *prop, const char *names_prop,
+                          bool counter)
+{
+    struct soc_device_node dn = { .fdt = &soc->fdt, .offset = node };
+    const void *fdt = soc->fdt.start;
+    struct soc_region region;
+    const uint32_t *cells;
+    const char *label;
+    int i, len, count;
+    int rc;
+
+    if (!(cells = fdt_getprop(fdt, node, prop, &len)))
+        return 0;
+
+    if ((rc = soc_device_get_memory(soc, &dn, &region)) < 0)
+        return rc;
+
+    count = len / (2 * sizeof(*cells));
+    if (fdt_stringlist_count(fdt, node, names_prop) != count)
+        return -EUCLEAN;
+
+    label = fdt_get_name(fdt, node, NULL);
+
+    for (i = 0; i < count; i++) {
+        uint32_t offset = be32toh(cells[2 * i]);
+        uint32_t mask = be32toh(cells[2 * i + 1]);
+        const char *name;
+
+        if (offset >= region.length)
+            return -EUCLEAN;
+
+        name = fdt_stringlist_get(fdt, node, names_prop, i, NULL);
+        rc = stats_add_field(set, label, name, region.start + offset, mask,
+                             counter);
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int stats_discover(struct stats_set *set, struct soc *soc)
+{
+    int depth = 0;
+    int node;
+    int rc;
+
+    for (node = fdt_next_node(soc->fdt.start, -1, &depth);
+         node >= 0 && depth >= 0;
+         node = fdt_next_node(soc->fdt.start, node, &depth)) {
+        rc = stats_add_node(set, soc, node, STATS_COUNTERS,
+                            STATS_COUNTER_NAMES, true);
+        if (rc < 0)
+            return rc;
+
+        rc = stats_add_node(set, soc, node, STATS_STATUS, STATS_STATUS_NAMES,
+                            false);
+        if (rc < 0)
+            return rc;
+    }
+
+    return set->nfields ? 0 : -ENOENT;
+}
+
+static uint32_t stats_field_value(const struct stats_field *field,
+                                  const uint32_t *vals)
+{
+    return (vals[field->reg] & field->mask) >> field->shift;
+}
+
+static void stats_print_header(const struct stats_set *set)
+{
+    unsigned int i;
+
+    printf("# time");
+    for (i = 0; i < set->nfields; i++)
+        printf(" %s", set->fields[i].name);
+    printf("\n");
+}
+
+/* Counters as the change over the interval, modulo their field's width */
+static void stats_print(const struct stats_set *set, uint64_t t_ns,
+                        const uint32_t *vals, const uint32_t *prev)
+{
+    unsigned int i;
+
+    printf("%" PRIu64 ".%09" PRIu64, t_ns / 1000000000, t_ns % 1000000000);
+    for (i = 0; i < set->nfields; i++) {
+        const struct stats_field *field = &set->fields[i];
+        uint32_t width = field->mask >> field->shift;
+        uint32_t now = stats_field_value(field, vals);
+
+        if (field->counter)
+            printf(" %" PRIu32, (now - stats_field_value(field, prev)) & width);
+        else
+            printf(" 0x%" PRIx32, now);
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+static int stats_run(struct ahb *ahb, const struct stats_set *set,
+                     uint64_t period_ns, uint64_t limit)
+{
+    struct sigaction sa = { .sa_handler = stats_handle_signal };
+    struct ahb_iov iov[STATS_FIELDS_MAX];
+    uint32_t vals[2][STATS_FIELDS_MAX];
+    uint64_t origin, deadline, samples = 0;
+    struct sigaction old;
+    struct timespec ts;
+    unsigned int i, cur = 0;
+    ssize_t rc;
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+
+    if ((rc = ahb_session_begin(ahb)) < 0)
+        goto restore_signal;
+
+    stats_print_header(set);
+
+    origin = deadline = stats_now_ns();
+    while (!stats_stop_requested && (!limit || samples <= limit)) {
+        uint64_t before, after;
+
+        /* Every register in the one vectored access, so they line up */
+        for (i = 0; i < set->nregs; i++) {
+            iov[i].phys = set->regs[i];
+            iov[i].base = &vals[cur][i];
+            iov[i].len = sizeof(vals[cur][i]);
+        }
+
+        before = stats_now_ns();
+        if ((rc = ahb_readv(ahb, iov, set->nregs)) < 0) {
+            loge("Failed to sample the SoC's counters: %zd\n", rc);
+            break;
+        }
+        after = stats_now_ns();
+
+        /* The first sample is only the baseline for the deltas */
+        if (samples++)
+            stats_print(set, before + (after - before) / 2 - origin,
+                        vals[cur], vals[!cur]);
+
+        cur = !cur;
+
+        /* Slots already passed are skipped, a delta then covers several */
+        deadline += period_ns;
+        if (after > deadline)
+            deadline += ((after - deadline) / period_ns + 1) * period_ns;
+
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR &&
+               !stats_stop_requested);
+    }
+
+    ahb_session_end(ahb);
+
+    if (rc > 0)
+        rc = 0;
+
+restore_signal:
+    sigaction(SIGINT, &old, NULL);
+    stats_stop_requested = 0;
+
+    return rc;
+}
+
+static int cmd_stats_soc(int argc, char *argv[], double rate, uint64_t limit)
+{
+    struct host _host, *host = &_host;
+    struct soc _soc, *soc = &_soc;
+    struct stats_set set = { 0 };
+    struct ahb *ahb;
+    int rc;
+
+    if ((rc = host_init(host, argc, argv)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ahb = host_get_ahb(host))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    if ((rc = soc_probe(soc, ahb)) < 0)
+        goto cleanup_host;
+
+    if ((rc = stats_discover(&set, soc)) < 0) {
+        if (rc == -ENOENT)
+            loge("The SoC's devicetree describes no counters to sample\n");
+        else
+            loge("Failed to collect the counters from the devicetree: %d\n", rc);
+        goto cleanup_soc;
+    }
+
+    logi("Sampling %u fields from %u registers at %.1f Hz, interrupt to stop\n",
+         set.nfields, set.nregs, rate);
+
+    rc = stats_run(ahb, &set, 1e9 / rate, limit);
+
+cleanup_soc:
+    soc_destroy(soc);
+
+cleanup_host:
+    host_destroy(host);
+
+    return rc;
+}
+
+int cmd_stats(const char *name __unused, int argc, char *argv[])
+{
+    double rate = STATS_RATE_DEFAULT;
+    unsigned long long limit = 0;
+    char *end;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "rate", required_argument, NULL, 'r' },
+            { "samples", required_argument, NULL, 'n' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "n:r:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'n':
+                limit = strtoull(optarg, &end, 0);
+                if (*end || !limit) {
+                    loge("Invalid sample count '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'r':
+                rate = strtod(optarg, &end);
+                if (*end || rate <= 0) {
+                    loge("Invalid sample rate '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        loge("Not enough arguments for stats command\n");
+        return -EINVAL;
+    }
+
+    if (!strcmp("soc", argv[0]))
+        return cmd_stats_soc(argc - 1, argv + 1, rate, limit);
+
+    loge("Unsupported stats type '%s'\n", argv[0]);
+
+    return -EINVAL;
+}
@@ -0,0 +1,84 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "compiler.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define STATUS_LINE_MAX 256
+
+/* Sends one command to a job's --control socket and prints the reply */
+int cmd_status(const char *name __unused, int argc, char *argv[])
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    char line[STATUS_LINE_MAX];
+    size_t len = 0;
+    char buf[4096];
+    ssize_t ingress;
+    int fd, i, rc;
+
+    if (argc < 1) {
+        loge("Not enough arguments for status command\n");
+        exit(EXIT_FAILURE);
+    }
+
+    if (strlen(argv[0]) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+
+    strcpy(addr.sun_path, argv[0]);
+
+    /* The words of the command are sent as the one line, "status" without */
+    if (argc == 1) {
+        len = snprintf(line, sizeof(line), "status\n");
+    } else {
+        for (i = 1; i < argc; i++) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%s", argv[i],
+                            i + 1 < argc ? " " : "\n");
+            if (len >= sizeof(line)) {
+                loge("Command is too long\n");
+                return -E2BIG;
+            }
+        }
+    }
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -errno;
+
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        rc = -errno;
+        loge("Failed to connect to %s: %d\n", argv[0], rc);
+        goto cleanup_fd;
+    }
+
+    if (send(fd, line, len, MSG_NOSIGNAL) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    rc = 0;
+    while ((ingress = recv(fd, buf, sizeof(buf), 0)) != 0) {
+        if (ingress < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -errno;
+            break;
+        }
+
+        fwrite(buf, 1, ingress, stdout);
+
+        /* Replies are a line, and report failure in an "error" member */
+        if (memmem(buf, ingress, "\"error\"", strlen("\"error\"")))
+            rc = -EINVAL;
+    }
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
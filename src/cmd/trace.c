@@ -7,19 +7,254 @@
 #include "compiler.h"
 #include "host.h"
 #include "log.h"
+#include "pipeline.h"
 #include "priv.h"
 #include "soc.h"
+#include "soc/sdmc.h"
 #include "soc/trace.h"
+#include "tracedec.h"
 
 #include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
 #include <inttypes.h>
 #include <signal.h>
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
-//culvert trace ADDRESS WIDTH:OFFSET MODE
+/* How long to wait before looking again when the buffer hasn't moved */
+#define TRACE_POLL_US   10000
+
+static volatile sig_atomic_t trace_stop_requested;
+
+static void trace_handle_signal(int signo __unused)
+{
+    trace_stop_requested = 1;
+}
+
+/* Drain the buffer to stdout as it fills, until interrupted */
+static int trace_stream(struct trace *trace)
+{
+    struct sigaction sa = { .sa_handler = trace_handle_signal };
+    struct sigaction old;
+    int rc, cleanup;
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+
+    if ((rc = trace_stream_start(trace)) < 0)
+        goto restore_signal;
+
+    logi("Streaming trace to stdout, interrupt to stop\n");
+
+    while (!trace_stop_requested) {
+        if ((rc = trace_drain(trace, 1)))
+            break;
+
+        usleep(TRACE_POLL_US);
+    }
+
+    if ((cleanup = trace_stop(trace))) {
+        loge("Unable to stop trace: %d\n", cleanup);
+        rc = rc ? rc : cleanup;
+    } else if (!rc) {
+        rc = trace_drain(trace, 1);
+    }
+
+    if (trace_overruns(trace))
+        loge("Trace overran %lu times, poll faster or narrow the capture\n",
+             trace_overruns(trace));
+
+restore_signal:
+    sigaction(SIGINT, &old, NULL);
+    trace_stop_requested = 0;
+
+    return rc;
+}
+
+/* LEN[@ADDR], the address defaulting to the SRAM */
+static int trace_parse_buffer(const char *arg, uint32_t *phys, uint32_t *len)
+{
+    char *end;
+
+    errno = 0;
+    *len = strtoul(arg, &end, 0);
+    if (errno || end == arg)
+        return -EINVAL;
+
+    *phys = 0;
+    if (*end == '@') {
+        arg = end + 1;
+        *phys = strtoul(arg, &end, 0);
+        if (errno || end == arg || !*phys)
+            return -EINVAL;
+    }
+
+    return *end ? -EINVAL : 0;
+}
+
+static int trace_configure_buffer(struct soc *soc, struct trace *trace,
+                                  uint32_t phys, uint32_t len)
+{
+    struct soc_region dram;
+    struct sdmc *sdmc;
+    int rc;
+
+    /* Anywhere but the SRAM has to be DRAM, never registers */
+    if (phys) {
+        if (!(sdmc = sdmc_get(soc)))
+            return -ENODEV;
+
+        if ((rc = sdmc_get_dram(sdmc, &dram)) < 0)
+            return rc;
+
+        if (phys < dram.start || phys - dram.start + (uint64_t)len > dram.length) {
+            loge("Trace buffer 0x%08" PRIx32 "+0x%" PRIx32 " is outside DRAM\n",
+                 phys, len);
+            return -ERANGE;
+        }
+    }
+
+    return trace_set_buffer(trace, phys, len);
+}
+
+/* Large enough to amortise the syscalls, small enough not to matter */
+#define TRACE_DECODE_CHUNK  (64 << 10)
+
+static ssize_t trace_decode_run(struct pipeline_stage *stage,
+                                struct pipeline_buf *buf)
+{
+    return tracedec_feed(stage->priv, buf->data, buf->len);
+}
+
+static const struct pipeline_stage_ops trace_decode_ops = {
+    .run = trace_decode_run,
+};
+
+/* Reading the capture overlaps decoding what's already been read */
+static int trace_decode_fd(struct tracedec *dec, int fd)
+{
+    struct pipeline pipeline;
+    int rc;
+
+    if ((rc = pipeline_init(&pipeline, NULL, TRACE_DECODE_CHUNK, 0)) < 0)
+        return rc;
+
+    if ((rc = pipeline_add_fd_source(&pipeline, fd, 0)) < 0)
+        goto cleanup_pipeline;
+
+    if ((rc = pipeline_add(&pipeline, "tracedec", &trace_decode_ops, dec)) < 0)
+        goto cleanup_pipeline;
+
+    rc = pipeline_run(&pipeline);
+
+cleanup_pipeline:
+    pipeline_destroy(&pipeline);
+
+    return rc;
+}
+
+//culvert trace decode [--format csv|binary|none] [--histogram] [--runs] [--merge WORD] WIDTH [FILE]
+static int trace_decode(int argc, char *argv[])
+{
+    enum tracedec_format format = tracedec_csv;
+    uint32_t merge = 0, width;
+    struct tracedec dec;
+    bool have_merge = false;
+    unsigned int flags = 0;
+    FILE *report;
+    int fd = 0;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "format", required_argument, NULL, 'f' },
+            { "histogram", no_argument, NULL, 'H' },
+            { "merge", required_argument, NULL, 'm' },
+            { "runs", no_argument, NULL, 'r' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "f:Hm:r", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'f':
+                if (tracedec_parse_format(optarg, &format) < 0) {
+                    loge("Unrecognised trace format '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'H':
+                flags |= TRACEDEC_HISTOGRAM;
+                break;
+            case 'm':
+                merge = strtoul(optarg, NULL, 0);
+                have_merge = true;
+                break;
+            case 'r':
+                flags |= TRACEDEC_RUNS;
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        loge("Not enough arguments for trace decode command\n");
+        return -EINVAL;
+    }
+
+    width = strtoul(argv[0], NULL, 0);
+    if ((rc = tracedec_init(&dec, width, format, flags, stdout)) < 0) {
+        loge("Unable to decode %s byte samples: %d\n", argv[0], rc);
+        return rc;
+    }
+
+    if (argc > 1 && strcmp(argv[1], "-") &&
+            (fd = open(argv[1], O_RDONLY | O_CLOEXEC)) < 0) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", argv[1], rc);
+        goto cleanup_dec;
+    }
+
+    if ((rc = trace_decode_fd(&dec, fd)) < 0) {
+        loge("Failed to decode trace: %d\n", rc);
+        goto cleanup_fd;
+    }
+
+    if (have_merge && (rc = tracedec_merge(&dec, merge)) < 0) {
+        loge("Failed to decode merge FIFO: %d\n", rc);
+        goto cleanup_fd;
+    }
+
+    /* Keep the statistics out of the way of any records */
+    report = format == tracedec_none ? stdout : stderr;
+    if ((rc = tracedec_finish(&dec, report)) < 0)
+        loge("Failed to write decoded trace: %d\n", rc);
+
+cleanup_fd:
+    if (fd)
+        close(fd);
+
+cleanup_dec:
+    tracedec_destroy(&dec);
+
+    return rc;
+}
+
+//culvert trace [--stream] [--buffer LEN[@ADDR]] ADDRESS WIDTH:OFFSET MODE
 //culvert trace 0x1e788000 1:0 read
 //culvert trace 0x1e788000 2:2 read
 //culvert trace 0x1e788000 4:0 write
@@ -30,11 +265,49 @@ int cmd_trace(const char *name __unused, int argc, char *argv[])
     enum trace_mode mode;
     uint32_t addr, width;
     struct trace *trace;
+    uint32_t buf_phys = 0, buf_len = 0;
+    bool stream = false;
     struct ahb *ahb;
     sigset_t set;
     int sig;
     int rc;
 
+    if (argc > 1 && !strcmp(argv[1], "decode"))
+        return trace_decode(argc - 1, argv + 1);
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "buffer", required_argument, NULL, 'b' },
+            { "stream", no_argument, NULL, 's' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "b:s", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'b':
+                if (trace_parse_buffer(optarg, &buf_phys, &buf_len)) {
+                    loge("Malformed trace buffer '%s', expected LEN[@ADDR]\n",
+                         optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 's':
+                stream = true;
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
     if (argc < 3) {
         loge("Not enough arguments for trace command\n");
         return -EINVAL;
@@ -92,12 +365,26 @@ int cmd_trace(const char *name __unused, int argc, char *argv[])
         goto cleanup_soc;
     }
 
+    if (buf_len &&
+            (rc = trace_configure_buffer(soc, trace, buf_phys, buf_len)) < 0) {
+        loge("Unable to use a 0x%" PRIx32 " byte trace buffer: %d\n", buf_len,
+             rc);
+        goto cleanup_soc;
+    }
+
     if ((rc = trace_start(trace, addr, width, mode))) {
         loge("Unable to start trace for 0x%08x %db %s: %d\n",
              addr, width, mode, rc);
         goto cleanup_soc;
     }
 
+    /* Streaming keeps the bridge busy throughout, so hold on to it */
+    if (stream) {
+        if ((rc = trace_stream(trace)))
+            loge("Unable to stream trace to stdout: %d\n", rc);
+        goto cleanup_soc;
+    }
+
     /*
      * The trace command waits for an unbounded amount of time while the trace
      * is collected; it's possible the bridge state may change while we're
@@ -0,0 +1,429 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "compiler.h"
+#include "host.h"
+#include "log.h"
+#include "rt.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WATCH_ADDRS_MAX         64
+#define WATCH_RATE_DEFAULT      1000
+#define WATCH_RING_DEFAULT      (1 << 20)
+
+/*
+ * Samples go to a fixed-size file mapped as a ring of equally sized slots,
+ * the oldest overwritten once it fills. Each slot is the u64 nanoseconds since
+ * the first sample, then a u32 value per watched address in the order given.
+ * As for console captures the file is in host byte order.
+ */
+#define WATCH_MAGIC             "CVWATCH"
+#define WATCH_VERSION           1
+
+struct watch_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t naddrs;
+    uint32_t nslots;
+    /* The next slot written, the oldest once @count exceeds @nslots */
+    uint32_t head;
+    uint64_t count;
+    uint64_t start_realtime_us;
+    /* The requested sampling period, 0 for as fast as the bridge allows */
+    uint64_t period_ns;
+    /* Followed by the addresses, padded to a multiple of 8 bytes */
+};
+
+struct watch_ring {
+    int fd;
+    struct watch_hdr *hdr;
+    uint8_t *slots;
+    size_t slot_len;
+    size_t len;
+};
+
+struct watch_stats {
+    uint64_t samples;
+    uint64_t missed;
+    uint64_t last_ns;
+    /* Spread of the intervals between samples, and starts past schedule */
+    uint64_t min_interval_ns;
+    uint64_t max_interval_ns;
+    uint64_t total_late_ns;
+    uint64_t max_late_ns;
+};
+
+static volatile sig_atomic_t watch_stop_requested;
+
+static void watch_handle_signal(int signo __unused)
+{
+    watch_stop_requested = 1;
+}
+
+static uint64_t watch_now_ns(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static int watch_parse_addrs(char *arg, uint32_t *addrs, unsigned int *naddrs)
+{
+    char *tok, *save, *end;
+
+    *naddrs = 0;
+    for (tok = strtok_r(arg, ",", &save); tok; tok = strtok_r(NULL, ",", &save)) {
+        if (*naddrs == WATCH_ADDRS_MAX)
+            return -E2BIG;
+
+        errno = 0;
+        addrs[*naddrs] = strtoul(tok, &end, 0);
+        if (errno || end == tok || *end || (addrs[*naddrs] & 3))
+            return -EINVAL;
+
+        (*naddrs)++;
+    }
+
+    return *naddrs ? 0 : -EINVAL;
+}
+
+static int watch_ring_create(struct watch_ring *ring, const char *path,
+                             size_t size, const uint32_t *addrs,
+                             unsigned int naddrs, uint64_t period_ns)
+{
+    size_t hdr_len;
+    void *map;
+    int rc;
+
+    hdr_len = sizeof(*ring->hdr) + ((naddrs + 1) & ~1U) * sizeof(*addrs);
+    ring->slot_len = sizeof(uint64_t) + ((naddrs + 1) & ~1U) * sizeof(uint32_t);
+    if (size < hdr_len + ring->slot_len)
+        return -EINVAL;
+
+    ring->len = size;
+    ring->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (ring->fd < 0)
+        return -errno;
+
+    if (ftruncate(ring->fd, ring->len) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    map = mmap(NULL, ring->len, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (map == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    ring->hdr = map;
+    ring->slots = (uint8_t *)map + hdr_len;
+
+    memcpy(ring->hdr->magic, WATCH_MAGIC, sizeof(ring->hdr->magic));
+    ring->hdr->version = WATCH_VERSION;
+    ring->hdr->naddrs = naddrs;
+    ring->hdr->nslots = (size - hdr_len) / ring->slot_len;
+    ring->hdr->start_realtime_us = watch_now_ns(CLOCK_REALTIME) / 1000;
+    ring->hdr->period_ns = period_ns;
+    memcpy(ring->hdr + 1, addrs, naddrs * sizeof(*addrs));
+
+    return 0;
+
+cleanup_fd:
+    close(ring->fd);
+
+    return rc;
+}
+
+static void watch_ring_append(struct watch_ring *ring, uint64_t t_ns,
+                              const uint32_t *vals)
+{
+    struct watch_hdr *hdr = ring->hdr;
+    uint8_t *slot = &ring->slots[hdr->head * ring->slot_len];
+
+    memcpy(slot, &t_ns, sizeof(t_ns));
+    memcpy(slot + sizeof(t_ns), vals, hdr->naddrs * sizeof(*vals));
+
+    if (++hdr->head == hdr->nslots)
+        hdr->head = 0;
+    hdr->count++;
+}
+
+static int watch_ring_close(struct watch_ring *ring)
+{
+    int rc = 0;
+
+    if (msync(ring->hdr, ring->len, MS_SYNC) < 0)
+        rc = -errno;
+
+    munmap(ring->hdr, ring->len);
+    close(ring->fd);
+
+    return rc;
+}
+
+static void watch_stats_add(struct watch_stats *stats, uint64_t t_ns)
+{
+    uint64_t interval;
+
+    if (stats->samples) {
+        interval = t_ns - stats->last_ns;
+        if (stats->samples == 1 || interval < stats->min_interval_ns)
+            stats->min_interval_ns = interval;
+        if (interval > stats->max_interval_ns)
+            stats->max_interval_ns = interval;
+    }
+
+    stats->last_ns = t_ns;
+    stats->samples++;
+}
+
+static void watch_stats_late(struct watch_stats *stats, uint64_t late_ns)
+{
+    stats->total_late_ns += late_ns;
+    if (late_ns > stats->max_late_ns)
+        stats->max_late_ns = late_ns;
+}
+
+static void watch_stats_report(const struct watch_stats *stats,
+                               uint64_t elapsed_ns, uint64_t period_ns)
+{
+    char target[32] = "";
+    char late[96] = "";
+
+    if (period_ns) {
+        snprintf(target, sizeof(target), " of %.1f Hz", 1e9 / period_ns);
+        snprintf(late, sizeof(late),
+                 ", started late by %.1fus mean %.1fus max, %" PRIu64 " periods missed",
+                 stats->samples ? stats->total_late_ns / 1e3 / stats->samples : 0.0,
+                 stats->max_late_ns / 1e3, stats->missed);
+    }
+
+    logi("%" PRIu64 " samples in %.3fs: %.1f Hz achieved%s, intervals %.1fus to %.1fus%s\n",
+         stats->samples, elapsed_ns / 1e9,
+         elapsed_ns ? stats->samples * 1e9 / elapsed_ns : 0.0, target,
+         stats->min_interval_ns / 1e3, stats->max_interval_ns / 1e3, late);
+}
+
+static void watch_print(uint64_t t_ns, const uint32_t *vals, unsigned int naddrs)
+{
+    unsigned int i;
+
+    printf("%" PRIu64 ".%09" PRIu64, t_ns / 1000000000, t_ns % 1000000000);
+    for (i = 0; i < naddrs; i++)
+        printf(" 0x%08" PRIx32, vals[i]);
+    printf("\n");
+}
+
+static int watch_run(struct ahb *ahb, const uint32_t *addrs, unsigned int naddrs,
+                     uint64_t period_ns, uint64_t limit, struct watch_ring *ring)
+{
+    struct ahb_iov iov[WATCH_ADDRS_MAX];
+    uint32_t vals[WATCH_ADDRS_MAX];
+    struct watch_stats stats = { 0 };
+    struct sigaction sa = { .sa_handler = watch_handle_signal };
+    struct sigaction old;
+    struct rt_state rt;
+    uint64_t origin, deadline, t_ns;
+    struct timespec ts;
+    unsigned int i;
+    ssize_t rc;
+
+    for (i = 0; i < naddrs; i++) {
+        iov[i].phys = addrs[i];
+        iov[i].base = &vals[i];
+        iov[i].len = sizeof(vals[i]);
+    }
+
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, &old);
+
+    if ((rc = ahb_session_begin(ahb)) < 0)
+        goto restore_signal;
+
+    logi("Sampling %u addresses, interrupt to stop\n", naddrs);
+
+    rt_enter(&rt, "watch");
+
+    origin = deadline = watch_now_ns(CLOCK_MONOTONIC);
+    while (!watch_stop_requested && (!limit || stats.samples < limit)) {
+        uint64_t before, after;
+
+        before = watch_now_ns(CLOCK_MONOTONIC);
+        if ((rc = ahb_readv(ahb, iov, naddrs)) < 0) {
+            loge("Failed to sample the watched addresses: %zd\n", rc);
+            break;
+        }
+        after = watch_now_ns(CLOCK_MONOTONIC);
+
+        /* The values were latched somewhere within the access */
+        t_ns = before + (after - before) / 2 - origin;
+        watch_stats_add(&stats, t_ns);
+
+        if (ring)
+            watch_ring_append(ring, t_ns, vals);
+        else
+            watch_print(t_ns, vals, naddrs);
+
+        if (!period_ns)
+            continue;
+
+        watch_stats_late(&stats, before > deadline ? before - deadline : 0);
+
+        /* Keep to the schedule, dropping the slots already passed */
+        deadline += period_ns;
+        if (after > deadline) {
+            uint64_t behind = (after - deadline) / period_ns + 1;
+
+            stats.missed += behind;
+            deadline += behind * period_ns;
+        }
+
+        ts.tv_sec = deadline / 1000000000ULL;
+        ts.tv_nsec = deadline % 1000000000ULL;
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR &&
+               !watch_stop_requested);
+    }
+
+    rt_leave(&rt);
+
+    ahb_session_end(ahb);
+
+    watch_stats_report(&stats, watch_now_ns(CLOCK_MONOTONIC) - origin, period_ns);
+
+    if (rc > 0)
+        rc = 0;
+
+restore_signal:
+    sigaction(SIGINT, &old, NULL);
+    watch_stop_requested = 0;
+
+    return rc;
+}
+
+int cmd_watch(const char *name __unused, int argc, char *argv[])
+{
+    struct host _host, *host = &_host;
+    uint32_t addrs[WATCH_ADDRS_MAX];
+    size_t ring_size = WATCH_RING_DEFAULT;
+    struct watch_ring ring;
+    const char *output = NULL;
+    unsigned long long limit = 0;
+    double rate = WATCH_RATE_DEFAULT;
+    uint64_t period_ns;
+    unsigned int naddrs;
+    struct ahb *ahb;
+    char *end;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "output", required_argument, NULL, 'o' },
+            { "rate", required_argument, NULL, 'r' },
+            { "ring-size", required_argument, NULL, 'S' },
+            { "samples", required_argument, NULL, 'n' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "n:o:r:S:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'n':
+                limit = strtoull(optarg, &end, 0);
+                if (*end || !limit) {
+                    loge("Invalid sample count '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'o':
+                output = optarg;
+                break;
+            case 'r':
+                rate = strtod(optarg, &end);
+                if (*end || rate < 0) {
+                    loge("Invalid sample rate '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case 'S':
+                ring_size = strtoull(optarg, &end, 0);
+                if (*end) {
+                    loge("Invalid ring size '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
+            case '?':
+                return -EINVAL;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 1) {
+        loge("Not enough arguments for watch command\n");
+        return -EINVAL;
+    }
+
+    if ((rc = watch_parse_addrs(argv[0], addrs, &naddrs)) < 0) {
+        loge("Expected up to %d comma-separated word-aligned addresses\n",
+             WATCH_ADDRS_MAX);
+        return rc;
+    }
+
+    /* A rate of zero samples as fast as the bridge allows */
+    period_ns = rate ? 1e9 / rate : 0;
+
+    if (output) {
+        rc = watch_ring_create(&ring, output, ring_size, addrs, naddrs, period_ns);
+        if (rc < 0) {
+            loge("Failed to create the sample ring %s: %d\n", output, rc);
+            return rc;
+        }
+    }
+
+    if ((rc = host_init(host, argc - 1, argv + 1)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        goto cleanup_ring;
+    }
+
+    if (!(ahb = host_get_ahb_for(host, host_usage_register))) {
+        loge("Failed to acquire AHB interface, exiting\n");
+        rc = -ENODEV;
+        goto cleanup_host;
+    }
+
+    rc = watch_run(ahb, addrs, naddrs, period_ns, limit, output ? &ring : NULL);
+
+cleanup_host:
+    host_destroy(host);
+
+cleanup_ring:
+    if (output) {
+        int cleanup = watch_ring_close(&ring);
+
+        rc = rc ? rc : cleanup;
+    }
+
+    return rc;
+}
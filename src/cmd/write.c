@@ -2,39 +2,380 @@
 // Copyright (C) 2018,2021 IBM Corp.
 #include "ahb.h"
 #include "ast.h"
+#include "bufpool.h"
 #include "compiler.h"
+#include "delta.h"
 #include "flash.h"
 #include "host.h"
+#include "image.h"
+#include "layout.h"
 #include "log.h"
+#include "mirror.h"
 #include "priv.h"
 #include "soc/clk.h"
 #include "soc/sdmc.h"
 #include "soc/sfc.h"
 #include "soc/uart/vuart.h"
 #include "soc/wdt.h"
+#include "span.h"
 
 #include <errno.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
 #define SFC_FLASH_WIN (64 << 10)
+/* Input consumed per smart write when planning, bounding what's held in RAM */
+#define SFC_PLAN_WIN (1 << 20)
+/* Every chip-select of the FMC and both SPI controllers */
+#define WRITE_TARGETS_MAX 7
+
+/*
+ * A flash to program and the image for it. With several, each is driven by a
+ * worker thread with its own source, and the workers take turns on the bridge
+ * so one chip's erase and program times overlap with work on the others.
+ */
+struct write_target {
+    const char *flash;
+    const char *path;
+    const char *partition;
+    bool plan;
+    bool chip_erase;
+    struct soc *soc;
+    pthread_t worker;
+    int rc;
+};
+
+/* Fill @buf from stdin, short only at the end of the input */
+static ssize_t write_fill(char *buf, size_t len)
+{
+    size_t filled = 0;
+
+    while (filled < len) {
+        ssize_t ingress;
+
+        /* Only a blocked read may be cancelled, never the ring's locking */
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ingress = read(0, buf + filled, len - filled);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (ingress < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (!ingress)
+            break;
+
+        filled += ingress;
+    }
+
+    return filled;
+}
 
-static int cmd_write_firmware(int argc, char *argv[])
+/*
+ * Compare each window of the image against the chip and only erase and
+ * program the blocks that differ, see flash_smart_write()
+ */
+static int write_firmware_planned(struct flash_chip *chip,
+                                  struct image_source *src,
+                                  const struct flash_part *part)
+{
+    const struct flash_smart_stats *stats = &chip->smart_stats;
+    uint32_t phys = part->offset;
+    ssize_t ingress;
+    const char *buf = NULL;
+    int rc;
+
+    while ((ingress = image_source_next(src, &buf)) > 0) {
+        if (phys - part->offset + ingress > part->size) {
+            loge("Firmware image exceeds the %" PRIu32 " bytes of %s\n",
+                 part->size, part->name);
+            return -EFBIG;
+        }
+
+        do {
+            rc = flash_smart_write(chip, phys, buf, ingress);
+        } while (rc == -EREMOTEIO); /* Miscompare, replan against the chip */
+
+        if (rc)
+            return rc;
+
+        phys += ingress;
+    }
+
+    if (ingress < 0)
+        return ingress;
+
+    logi("%" PRIu64 "KiB unchanged, %" PRIu64 "KiB erased, %" PRIu64
+         "KiB programmed\n", stats->same >> 10, stats->erased >> 10,
+         stats->programmed >> 10);
+
+    return 0;
+}
+
+/* The image may be on stdin, so ask on the terminal */
+static bool write_confirm_chip_erase(const char *flash)
+{
+    char inp[8];
+    FILE *tty;
+    bool yes;
+
+    if (!(tty = fopen("/dev/tty", "r+"))) {
+        loge("No terminal to confirm a chip erase on: %d\n", -errno);
+        return false;
+    }
+
+    fprintf(tty, "Erase all of the %s flash? If so, type YES: ", flash);
+    fflush(tty);
+    yes = fscanf(tty, "%7s", inp) == 1 && !strcmp(inp, "YES");
+    fclose(tty);
+
+    return yes;
+}
+
+/*
+ * An image covering the whole chip can go in after a single chip erase, with
+ * only its non-blank pages programmed, rather than polling through an erase
+ * of each block. Planned writes only do so if most blocks need erasing
+ * anyway. Returns 0 if the image should be written as usual instead.
+ */
+static int write_firmware_chip(struct flash_chip *chip,
+                               struct image_source *src,
+                               const struct flash_part *part,
+                               const struct write_target *target)
+{
+    struct flash_plan plan;
+    const char *image;
+    uint32_t off, len;
+    size_t size;
+    int rc;
+
+    image = image_source_map(src, &size);
+    if (!image || part->offset || part->size != chip->tsize ||
+            size != chip->tsize) {
+        logi("Chip erase needs an uncompressed --file the size of the chip\n");
+        return 0;
+    }
+
+    if (target->plan) {
+        if ((rc = flash_smart_plan(chip, 0, image, size, &plan)) < 0)
+            return rc;
+
+        logi("%" PRIu32 " of %" PRIu32 " erase blocks need erasing\n",
+             plan.erase, plan.blocks);
+        if (plan.erase <= plan.blocks / 2)
+            return 0;
+    }
+
+    if (!write_confirm_chip_erase(target->flash)) {
+        logi("Chip erase unconfirmed, erasing by block\n");
+        return 0;
+    }
+
+    logi("Erasing %s flash\n", target->flash);
+    if ((rc = flash_erase_chip(chip)) == -EOPNOTSUPP) {
+        logi("The %s flash can't be erased whole\n", target->flash);
+        return 0;
+    }
+    if (rc < 0)
+        return rc;
+
+    logi("Writing %s firmware image\n", target->flash);
+    for (off = 0; off < size; off += len) {
+        len = size - off < SFC_PLAN_WIN ? size - off : SFC_PLAN_WIN;
+        if ((rc = flash_write_erased(chip, off, image + off, len)) < 0)
+            return rc;
+    }
+
+    logi("%" PRIu64 "KiB programmed\n", chip->smart_stats.programmed >> 10);
+
+    return 1;
+}
+
+/* Erase and write every block of the image, whatever the chip holds */
+static int write_firmware_blocks(struct flash_chip *chip,
+                                 struct image_source *src,
+                                 const struct flash_part *part)
+{
+    uint32_t phys = part->offset;
+    ssize_t ingress;
+    const char *buf = NULL;
+    int rc;
+
+    if ((part->offset | part->size) & chip->min_erase_mask) {
+        loge("%s isn't aligned to the chip's erase blocks\n", part->name);
+        return -EINVAL;
+    }
+
+    while ((ingress = image_source_next(src, &buf)) > 0) {
+        /* The image may end part way into a block, erase all of it */
+        uint32_t span = (ingress + chip->min_erase_mask) & ~chip->min_erase_mask;
+
+        if (phys - part->offset + span > part->size) {
+            loge("Firmware image exceeds the %" PRIu32 " bytes of %s\n",
+                 part->size, part->name);
+            return -EFBIG;
+        }
+
+        do {
+            rc = flash_erase(chip, phys, span);
+            if (rc < 0)
+                return rc;
+
+            rc = flash_write(chip, phys, buf, ingress, true);
+        } while (rc == -EREMOTEIO); /* Miscompare */
+
+        if (rc)
+            return rc;
+
+        phys += ingress;
+    }
+
+    return ingress;
+}
+
+static int write_target_run(struct write_target *target)
+{
+    struct flash_part part = { .name = "the flash", .offset = 0 };
+    struct flash_chip *chip;
+    struct image_source src;
+    struct sfc *sfc;
+    int rc;
+
+    logi("Initialising %s flash\n", target->flash);
+    if (!(sfc = sfc_get(target->soc, target->flash))) {
+        loge("Failed to acquire SPI flash controller, exiting\n");
+        return -ENODEV;
+    }
+
+    if ((rc = flash_init(sfc, &chip)) < 0)
+        return rc;
+
+    part.size = chip->tsize;
+    if (target->partition &&
+            (rc = flash_get_part(chip, target->partition, &part)) < 0)
+        goto cleanup_flash;
+
+    rc = image_source_open(&src, target->path,
+                           target->plan ? SFC_PLAN_WIN : SFC_FLASH_WIN);
+    if (rc < 0) {
+        loge("Failed to open firmware image %s: %d\n",
+             target->path ? target->path : "on stdin", rc);
+        goto cleanup_flash;
+    }
+
+    if (target->chip_erase &&
+            (rc = write_firmware_chip(chip, &src, &part, target))) {
+        if (rc > 0)
+            rc = 0;
+    } else if (target->plan) {
+        logi("Updating %s firmware image\n", target->flash);
+        rc = write_firmware_planned(chip, &src, &part);
+    } else {
+        logi("Writing %s firmware image\n", target->flash);
+        rc = write_firmware_blocks(chip, &src, &part);
+    }
+
+    image_source_close(&src);
+
+cleanup_flash:
+    flash_destroy(chip);
+
+    return rc;
+}
+
+static void *write_target_worker(void *arg)
+{
+    struct write_target *target = arg;
+    struct ahb *ahb = target->soc->ahb;
+
+    span_thread_name("write-target");
+
+    ahb_lock(ahb);
+    target->rc = write_target_run(target);
+    ahb_unlock(ahb);
+
+    return NULL;
+}
+
+static int write_targets_parallel(struct ahb *ahb, struct write_target *targets,
+                                  unsigned int ntargets)
+{
+    unsigned int i, started;
+    int rc = 0;
+
+    ahb_share(ahb, true);
+
+    for (started = 0; started < ntargets; started++) {
+        rc = -pthread_create(&targets[started].worker, NULL,
+                             write_target_worker, &targets[started]);
+        if (rc)
+            break;
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(targets[i].worker, NULL);
+
+        if (targets[i].rc < 0) {
+            loge("Failed to write %s flash: %d\n", targets[i].flash,
+                 targets[i].rc);
+            if (!rc)
+                rc = targets[i].rc;
+        }
+    }
+
+    ahb_share(ahb, false);
+
+    return rc;
+}
+
+/* The chip-selects of one controller can't be driven at the same time */
+static bool write_targets_conflict(const struct write_target *a,
+                                   const struct write_target *b)
+{
+    size_t len = strcspn(a->flash, ":");
+
+    return len == strcspn(b->flash, ":") && !strncmp(a->flash, b->flash, len);
+}
+
+static int cmd_write_firmware(int argc, char *argv[], bool plan,
+                              bool chip_erase, struct write_target *targets,
+                              unsigned int ntargets)
 {
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
     struct ahb *ahb;
-    struct flash_chip *chip;
     struct vuart *vuart;
     struct clk *clk;
-    ssize_t ingress;
-    struct sfc *sfc;
+    unsigned int i, j;
     int rc, cleanup;
-    uint32_t phys;
-    char *buf;
+
+    for (i = 0; ntargets > 1 && i < ntargets; i++) {
+        if (!targets[i].path) {
+            loge("Writing several flashes needs a --file for each\n");
+            return -EINVAL;
+        }
+
+        if (chip_erase) {
+            loge("--chip-erase asks for confirmation, write one flash at a time\n");
+            return -EINVAL;
+        }
+
+        for (j = i + 1; j < ntargets; j++) {
+            if (write_targets_conflict(&targets[i], &targets[j])) {
+                loge("Can't write %s and %s at once, they share a controller\n",
+                     targets[i].flash, targets[j].flash);
+                return -EINVAL;
+            }
+        }
+    }
 
     if ((rc = host_init(host, argc, argv)) < 0) {
         loge("Failed to initialise host interfaces: %d\n", rc);
@@ -80,56 +421,21 @@ static int cmd_write_firmware(int argc, char *argv[])
             goto cleanup_state;
     }
 
-    logi("Initialising flash subsystem\n");
-    if (!(sfc = sfc_get_by_name(soc, "fmc"))) {
-        loge("Failed to acquire SPI flash controller, exiting\n");
-        rc = -ENODEV;
-        goto cleanup_state;
+    for (i = 0; i < ntargets; i++) {
+        targets[i].plan = plan;
+        targets[i].chip_erase = chip_erase;
+        targets[i].soc = soc;
     }
 
-    rc = flash_init(sfc, &chip);
-    if (rc < 0)
+    if ((rc = ahb_session_begin(ahb)) < 0)
         goto cleanup_state;
 
-    /* FIXME: Make this common with the sfc write implementation */
-    buf = malloc(SFC_FLASH_WIN);
-    if (!buf) {
-        rc = -ENOMEM;
-        goto cleanup_flash;
-    }
-
-    logi("Writing firmware image\n");
-    phys = 0;
-    while ((ingress = read(0, buf, SFC_FLASH_WIN))) {
-        if (ingress < 0) {
-            rc = -errno;
-            break;
-        }
-
-        do {
-            if (ingress < SFC_FLASH_WIN) {
-                loge("Unexpected ingress value: 0x%zx\n", ingress);
-                goto cleanup_buf;
-            }
-
-            rc = flash_erase(chip, phys, ingress);
-            if (rc < 0)
-                goto cleanup_buf;
-
-            rc = flash_write(chip, phys, buf, ingress, true);
-        } while (rc == -EREMOTEIO); /* Miscompare */
-
-        if (rc)
-            break;
+    if (ntargets == 1)
+        rc = write_target_run(&targets[0]);
+    else
+        rc = write_targets_parallel(ahb, targets, ntargets);
 
-        phys += ingress;
-    }
-
-cleanup_buf:
-    free(buf);
-
-cleanup_flash:
-    flash_destroy(chip);
+    ahb_session_end(ahb);
 
 cleanup_state:
     if (rc == 0) {
@@ -170,7 +476,103 @@ cleanup_host:
     return rc;
 }
 
-static int cmd_write_ram(int argc, char *argv[])
+/*
+ * What the session's mirror holds is compared on the host and only what
+ * differs is written. The rest is compared on the BMC if @compare, otherwise
+ * it's written as it is.
+ */
+static int write_ram_window(struct delta *delta, bool compare, uint32_t phys,
+                            const uint8_t *want, size_t len)
+{
+    uint32_t cursor = phys;
+    size_t done = 0;
+    ssize_t wr;
+    int rc;
+
+    while (done < len) {
+        const uint8_t *have;
+        size_t span;
+
+        span = mirror_span(cursor, len - done, &have);
+        if (have) {
+            rc = delta_write_known(delta, cursor, want + done, have, span);
+        } else if (compare && !(delta->hace && (cursor & 7))) {
+            rc = delta_write(delta, cursor, want + done, span);
+        } else {
+            /* The hash engine needs alignment, so catch up to it first */
+            if (compare && span > 8 - (cursor & 7))
+                span = 8 - (cursor & 7);
+
+            rc = 0;
+            if ((wr = soc_write(delta->soc, cursor, want + done, span)) < 0)
+                rc = wr;
+            delta->compared += span;
+            delta->written += span;
+        }
+        if (rc < 0)
+            return rc;
+
+        cursor += span;
+        done += span;
+    }
+
+    mirror_store(phys, want, len);
+
+    return 0;
+}
+
+/* Compares and writes the input a window at a time as it arrives */
+static int write_ram_delta(struct soc *soc, uint32_t start, uint32_t length,
+                           bool compare, uint32_t scratch)
+{
+    struct delta delta;
+    size_t offset;
+    uint8_t *want;
+    int rc;
+
+    if ((rc = delta_init(&delta, soc, compare ? scratch : 0)) < 0)
+        return rc;
+
+    if (!(want = bufpool_get(DELTA_WIN))) {
+        rc = -ENOMEM;
+        goto cleanup_delta;
+    }
+
+    for (offset = 0; offset < length;) {
+        size_t len = length - offset < DELTA_WIN ? length - offset : DELTA_WIN;
+        ssize_t filled;
+
+        if ((filled = write_fill((char *)want, len)) < 0) {
+            rc = filled;
+            break;
+        }
+
+        /* Like a plain write, stop short with the input */
+        if (!filled)
+            break;
+
+        rc = write_ram_window(&delta, compare, start + offset, want, filled);
+        if (rc < 0)
+            break;
+
+        offset += filled;
+        if ((size_t)filled < len)
+            break;
+    }
+
+    if (!rc)
+        logi("Wrote %zu of %zu bytes that differed\n", delta.written,
+             delta.compared);
+
+    bufpool_put(want, DELTA_WIN);
+
+cleanup_delta:
+    delta_destroy(&delta);
+
+    return rc;
+}
+
+static int cmd_write_ram(int argc, char *argv[], bool delta, uint32_t scratch)
 {
     struct host _host, *host = &_host;
     struct soc _soc, *soc = &_soc;
@@ -268,7 +670,12 @@ static int cmd_write_ram(int argc, char *argv[])
     }
 #endif
 
-    if ((rc = soc_siphon_in(soc, start, length, STDIN_FILENO))) {
+    /* Under batch --mirror, what was written before needn't be compared */
+    if (delta || mirror_enabled)
+        rc = write_ram_delta(soc, start, length, delta, scratch);
+    else
+        rc = soc_siphon_in(soc, start, length, STDIN_FILENO);
+    if (rc) {
         loge("Failed to write to provided memory region: %d\n", rc);
     }
 
@@ -283,6 +690,15 @@ cleanup_host:
 
 int cmd_write(const char *name __unused, int argc, char *argv[])
 {
+    struct write_target targets[WRITE_TARGETS_MAX] = { { .flash = "fmc" } };
+    struct write_target *target = &targets[0];
+    unsigned int ntargets = 1;
+    unsigned long scratch = 0;
+    bool named = false;
+    bool chip_erase = false;
+    bool delta = false;
+    bool plan = false;
+    char *endp;
     int rc;
 
     if (argc < 1) {
@@ -296,27 +712,75 @@ int cmd_write(const char *name __unused, int argc, char *argv[])
         int c;
 
         static struct option long_options[] = {
+            { "chip-erase", no_argument, NULL, 'C' },
+            { "delta", no_argument, NULL, 'd' },
+            { "file", required_argument, NULL, 'f' },
+            { "flash", required_argument, NULL, 'F' },
+            { "hash-scratch", required_argument, NULL, 'H' },
             { "live", no_argument, NULL, 'l' },
+            { "partition", required_argument, NULL, 'P' },
+            { "plan", no_argument, NULL, 'p' },
             { },
         };
 
-        c = getopt_long(argc, argv, "l", long_options, &option_index);
+        c = getopt_long(argc, argv, "CdF:f:H:lP:p", long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c) {
+            case 'C':
+                chip_erase = true;
+                break;
+            case 'd':
+                delta = true;
+                break;
+            case 'F':
+                /* --file and --partition apply to the latest --flash */
+                if (named) {
+                    if (ntargets == WRITE_TARGETS_MAX) {
+                        loge("Too many flashes to write at once\n");
+                        return -EINVAL;
+                    }
+                    target = &targets[ntargets++];
+                }
+                target->flash = optarg;
+                named = true;
+                break;
+            case 'f':
+                target->path = optarg;
+                break;
+            case 'H':
+                errno = 0;
+                scratch = strtoul(optarg, &endp, 0);
+                if (errno || *endp || !scratch || scratch > UINT32_MAX) {
+                    loge("Invalid hash scratch address '%s'\n", optarg);
+                    return -EINVAL;
+                }
+                break;
             case 'l':
                 /* no-op flag retained for backwards compatibility */
                 break;
+            case 'P':
+                target->partition = optarg;
+                break;
+            case 'p':
+                plan = true;
+                break;
             case '?':
                 return -EINVAL;
         }
     }
 
+    if (scratch && !delta) {
+        loge("--hash-scratch is only used by --delta\n");
+        return -EINVAL;
+    }
+
     if (!strcmp("firmware", argv[optind])) {
-        rc = cmd_write_firmware(argc - optind, &argv[optind]);
+        rc = cmd_write_firmware(argc - optind, &argv[optind], plan,
+                                chip_erase, targets, ntargets);
     } else if (!strcmp("ram", argv[optind])) {
-        rc = cmd_write_ram(argc - optind, &argv[optind]);
+        rc = cmd_write_ram(argc - optind, &argv[optind], delta, scratch);
     } else {
         loge("Unsupported write type '%s'\n", argv[optind]);
         rc = -EINVAL;
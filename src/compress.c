@@ -0,0 +1,436 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "compiler.h"
+#include "compress.h"
+#include "config.h"
+#include "log.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+
+static int compress_flush(struct compress *ctx, int fd, size_t len)
+{
+    const uint8_t *cursor = ctx->buf;
+    ssize_t egress;
+
+    while (len) {
+        egress = write(fd, cursor, len);
+        if (egress == -1)
+            return -errno;
+
+        cursor += egress;
+        len -= egress;
+        ctx->egress += egress;
+    }
+
+    return 0;
+}
+
+static int compress_stream(struct compress *ctx, int fd, const void *buf,
+                           size_t len, ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer in = { .src = buf, .size = len, .pos = 0 };
+    ZSTD_outBuffer out;
+    size_t remaining;
+    bool done;
+    int rc;
+
+    do {
+        out.dst = ctx->buf;
+        out.size = ctx->size;
+        out.pos = 0;
+
+        remaining = ZSTD_compressStream2(ctx->stream, &out, &in, mode);
+        if (ZSTD_isError(remaining)) {
+            loge("Compression failed: %s\n", ZSTD_getErrorName(remaining));
+            return -EIO;
+        }
+
+        if ((rc = compress_flush(ctx, fd, out.pos)) < 0)
+            return rc;
+
+        done = (mode == ZSTD_e_end) ? !remaining : in.pos == in.size;
+    } while (!done);
+
+    ctx->ingress += len;
+
+    return 0;
+}
+
+int compress_init(struct compress *ctx, int level)
+{
+    size_t rc;
+
+    if (!(ctx->stream = ZSTD_createCCtx()))
+        return -ENOMEM;
+
+    rc = ZSTD_CCtx_setParameter(ctx->stream, ZSTD_c_compressionLevel, level);
+    if (ZSTD_isError(rc)) {
+        loge("Unsupported compression level %d: %s\n", level,
+             ZSTD_getErrorName(rc));
+        ZSTD_freeCCtx(ctx->stream);
+        return -EINVAL;
+    }
+
+    ctx->size = ZSTD_CStreamOutSize();
+    if (!(ctx->buf = malloc(ctx->size))) {
+        ZSTD_freeCCtx(ctx->stream);
+        return -ENOMEM;
+    }
+
+    ctx->ingress = 0;
+    ctx->egress = 0;
+
+    return 0;
+}
+
+void compress_destroy(struct compress *ctx)
+{
+    free(ctx->buf);
+    ZSTD_freeCCtx(ctx->stream);
+}
+
+int compress_write(struct compress *ctx, int fd, const void *buf, size_t len)
+{
+    return compress_stream(ctx, fd, buf, len, ZSTD_e_continue);
+}
+
+int compress_finish(struct compress *ctx, int fd)
+{
+    return compress_stream(ctx, fd, NULL, 0, ZSTD_e_end);
+}
+#else
+int compress_init(struct compress *ctx __unused, int level __unused)
+{
+    loge("culvert was built without zstd support\n");
+
+    return -ENOTSUP;
+}
+
+void compress_destroy(struct compress *ctx __unused) { }
+
+int compress_write(struct compress *ctx __unused, int fd __unused,
+                   const void *buf __unused, size_t len __unused)
+{
+    return -ENOTSUP;
+}
+
+int compress_finish(struct compress *ctx __unused, int fd __unused)
+{
+    return -ENOTSUP;
+}
+#endif
+
+#if HAVE_XZ
+#include <lzma.h>
+#endif
+
+#include <pthread.h>
+#include <string.h>
+
+#define DECOMPRESS_IN_SIZE (128 << 10)
+
+static const uint8_t decompress_zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+static const uint8_t decompress_xz_magic[] = { 0xfd, '7', 'z', 'X', 'Z', 0x00 };
+
+static ssize_t decompress_input(struct decompress *ctx, void *buf, size_t len)
+{
+    ssize_t ingress;
+    int state;
+
+    do {
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+        ingress = read(ctx->fd, buf, len);
+        pthread_setcancelstate(state, NULL);
+    } while (ingress < 0 && errno == EINTR);
+
+    if (ingress < 0)
+        return -errno;
+
+    if (!ingress)
+        ctx->eof = true;
+
+    return ingress;
+}
+
+#if HAVE_ZSTD || HAVE_XZ
+/* Top up the input buffer once everything in it has been consumed */
+static int decompress_refill(struct decompress *ctx)
+{
+    ssize_t ingress;
+
+    if (ctx->in_pos < ctx->in_len || ctx->eof)
+        return 0;
+
+    if ((ingress = decompress_input(ctx, ctx->in, DECOMPRESS_IN_SIZE)) < 0)
+        return ingress;
+
+    ctx->in_pos = 0;
+    ctx->in_len = ingress;
+
+    return 0;
+}
+#endif
+
+#if HAVE_ZSTD
+static int decompress_zstd_init(struct decompress *ctx)
+{
+    return (ctx->stream = ZSTD_createDCtx()) ? 0 : -ENOMEM;
+}
+
+static ssize_t decompress_zstd_read(struct decompress *ctx, void *buf,
+                                    size_t len)
+{
+    ZSTD_outBuffer out = { .dst = buf, .size = len, .pos = 0 };
+    ZSTD_inBuffer in;
+    size_t remaining, pos;
+    int rc;
+
+    while (out.pos < out.size) {
+        if ((rc = decompress_refill(ctx)) < 0)
+            return rc;
+
+        /* The input may only run out between frames */
+        if (ctx->eof && ctx->in_pos == ctx->in_len && ctx->ended)
+            break;
+
+        in.src = ctx->in;
+        in.size = ctx->in_len;
+        in.pos = ctx->in_pos;
+        pos = out.pos;
+
+        remaining = ZSTD_decompressStream(ctx->stream, &out, &in);
+        if (ZSTD_isError(remaining)) {
+            loge("Decompression failed: %s\n", ZSTD_getErrorName(remaining));
+            return -EIO;
+        }
+
+        ctx->in_pos = in.pos;
+        ctx->ended = !remaining;
+
+        if (ctx->eof && in.pos == in.size && out.pos == pos && !ctx->ended) {
+            loge("Compressed image is truncated\n");
+            return -EIO;
+        }
+    }
+
+    return out.pos;
+}
+
+static void decompress_zstd_destroy(struct decompress *ctx)
+{
+    ZSTD_freeDCtx(ctx->stream);
+}
+#else
+static int decompress_zstd_init(struct decompress *ctx __unused)
+{
+    loge("culvert was built without zstd support\n");
+
+    return -ENOTSUP;
+}
+
+static ssize_t decompress_zstd_read(struct decompress *ctx __unused,
+                                    void *buf __unused, size_t len __unused)
+{
+    return -ENOTSUP;
+}
+
+static void decompress_zstd_destroy(struct decompress *ctx __unused) { }
+#endif
+
+#if HAVE_XZ
+static int decompress_xz_init(struct decompress *ctx)
+{
+    const lzma_stream init = LZMA_STREAM_INIT;
+    lzma_stream *strm;
+    lzma_ret ret;
+
+    if (!(strm = malloc(sizeof(*strm))))
+        return -ENOMEM;
+
+    *strm = init;
+    ret = lzma_stream_decoder(strm, UINT64_MAX, LZMA_CONCATENATED);
+    if (ret != LZMA_OK) {
+        free(strm);
+        return ret == LZMA_MEM_ERROR ? -ENOMEM : -EINVAL;
+    }
+
+    ctx->stream = strm;
+
+    return 0;
+}
+
+static ssize_t decompress_xz_read(struct decompress *ctx, void *buf,
+                                  size_t len)
+{
+    lzma_stream *strm = ctx->stream;
+    lzma_ret ret;
+    int rc;
+
+    strm->next_out = buf;
+    strm->avail_out = len;
+
+    while (strm->avail_out && !ctx->ended) {
+        if ((rc = decompress_refill(ctx)) < 0)
+            return rc;
+
+        strm->next_in = ctx->in + ctx->in_pos;
+        strm->avail_in = ctx->in_len - ctx->in_pos;
+
+        ret = lzma_code(strm, ctx->eof ? LZMA_FINISH : LZMA_RUN);
+        ctx->in_pos = ctx->in_len - strm->avail_in;
+
+        if (ret == LZMA_STREAM_END) {
+            ctx->ended = true;
+        } else if (ret == LZMA_BUF_ERROR && ctx->eof) {
+            loge("Compressed image is truncated\n");
+            return -EIO;
+        } else if (ret != LZMA_OK) {
+            loge("Decompression failed: %d\n", ret);
+            return -EIO;
+        }
+    }
+
+    return len - strm->avail_out;
+}
+
+static void decompress_xz_destroy(struct decompress *ctx)
+{
+    lzma_end(ctx->stream);
+    free(ctx->stream);
+}
+#else
+static int decompress_xz_init(struct decompress *ctx __unused)
+{
+    loge("culvert was built without xz support\n");
+
+    return -ENOTSUP;
+}
+
+static ssize_t decompress_xz_read(struct decompress *ctx __unused,
+                                  void *buf __unused, size_t len __unused)
+{
+    return -ENOTSUP;
+}
+
+static void decompress_xz_destroy(struct decompress *ctx __unused) { }
+#endif
+
+static bool decompress_magic(struct decompress *ctx, const uint8_t *magic,
+                             size_t len)
+{
+    return ctx->in_len >= len && !memcmp(ctx->in, magic, len);
+}
+
+int decompress_init(struct decompress *ctx, int fd)
+{
+    ssize_t ingress;
+    int rc;
+
+    ctx->fd = fd;
+    ctx->stream = NULL;
+    ctx->in_pos = 0;
+    ctx->in_len = 0;
+    ctx->eof = false;
+    ctx->ended = false;
+
+    if (!(ctx->in = malloc(DECOMPRESS_IN_SIZE)))
+        return -ENOMEM;
+
+    /* Pipes may hand over less than the magic at a time */
+    while (ctx->in_len < sizeof(decompress_xz_magic) && !ctx->eof) {
+        ingress = decompress_input(ctx, ctx->in + ctx->in_len,
+                                   DECOMPRESS_IN_SIZE - ctx->in_len);
+        if (ingress < 0) {
+            rc = ingress;
+            goto cleanup_in;
+        }
+
+        ctx->in_len += ingress;
+    }
+
+    if (decompress_magic(ctx, decompress_zstd_magic,
+                         sizeof(decompress_zstd_magic))) {
+        ctx->format = decompress_zstd;
+        rc = decompress_zstd_init(ctx);
+    } else if (decompress_magic(ctx, decompress_xz_magic,
+                                sizeof(decompress_xz_magic))) {
+        ctx->format = decompress_xz;
+        rc = decompress_xz_init(ctx);
+    } else {
+        ctx->format = decompress_none;
+        rc = 0;
+    }
+
+    if (rc < 0)
+        goto cleanup_in;
+
+    return 0;
+
+cleanup_in:
+    free(ctx->in);
+
+    return rc;
+}
+
+void decompress_destroy(struct decompress *ctx)
+{
+    if (ctx->format == decompress_zstd)
+        decompress_zstd_destroy(ctx);
+    else if (ctx->format == decompress_xz)
+        decompress_xz_destroy(ctx);
+
+    free(ctx->in);
+}
+
+const char *decompress_name(enum decompress_format format)
+{
+    switch (format) {
+    case decompress_zstd:
+        return "zstd";
+    case decompress_xz:
+        return "xz";
+    default:
+        return "uncompressed";
+    }
+}
+
+static ssize_t decompress_copy(struct decompress *ctx, void *buf, size_t len)
+{
+    size_t filled;
+    ssize_t ingress;
+
+    /* First whatever was read looking for the magic */
+    filled = ctx->in_len - ctx->in_pos;
+    if (filled > len)
+        filled = len;
+    memcpy(buf, ctx->in + ctx->in_pos, filled);
+    ctx->in_pos += filled;
+
+    while (filled < len && !ctx->eof) {
+        ingress = decompress_input(ctx, (uint8_t *)buf + filled, len - filled);
+        if (ingress < 0)
+            return ingress;
+
+        filled += ingress;
+    }
+
+    return filled;
+}
+
+ssize_t decompress_read(struct decompress *ctx, void *buf, size_t len)
+{
+    switch (ctx->format) {
+    case decompress_zstd:
+        return decompress_zstd_read(ctx, buf, len);
+    case decompress_xz:
+        return decompress_xz_read(ctx, buf, len);
+    default:
+        return decompress_copy(ctx, buf, len);
+    }
+}
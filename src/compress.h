@@ -0,0 +1,60 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _COMPRESS_H
+#define _COMPRESS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* A zstd stream that writes its frames straight out to a file descriptor */
+struct compress {
+    void *stream;
+    void *buf;
+    size_t size;
+    uint64_t ingress;
+    uint64_t egress;
+};
+
+/* Returns -ENOTSUP if culvert was built without zstd */
+int compress_init(struct compress *ctx, int level);
+void compress_destroy(struct compress *ctx);
+
+int compress_write(struct compress *ctx, int fd, const void *buf, size_t len);
+int compress_finish(struct compress *ctx, int fd);
+
+enum decompress_format {
+    decompress_none,
+    decompress_zstd,
+    decompress_xz,
+};
+
+/*
+ * Reads from a file descriptor through zstd or xz, whichever the stream's
+ * magic says it is, or as it is if it has neither
+ */
+struct decompress {
+    int fd;
+    enum decompress_format format;
+    void *stream;
+    uint8_t *in;
+    size_t in_pos;
+    size_t in_len;
+    bool eof;
+    bool ended;
+};
+
+/* Returns -ENOTSUP if the stream needs a library culvert was built without */
+int decompress_init(struct decompress *ctx, int fd);
+void decompress_destroy(struct decompress *ctx);
+
+const char *decompress_name(enum decompress_format format);
+
+/*
+ * Fill @buf, short only at the end of the stream. A blocked read of the
+ * input is a cancellation point whatever the caller's cancel state.
+ */
+ssize_t decompress_read(struct decompress *ctx, void *buf, size_t len);
+
+#endif
@@ -0,0 +1,359 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "conlog.h"
+#include "log.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONLOG_MAGIC        "CVCONLOG"
+#define CONLOG_VERSION      1
+
+/* A record is its timestamp in microseconds and length, then the data */
+#define CONLOG_REC_HDR      10
+#define CONLOG_REC_MAX      4096
+/* In place of a length, the rest of the ring up to its end is unused */
+#define CONLOG_REC_WRAP     0xffff
+
+struct conlog_hdr {
+    char magic[8];
+    uint32_t version;
+    /* Bytes of ring following the header */
+    uint32_t size;
+    /* Next record goes here, the oldest starts at @tail */
+    uint32_t head;
+    uint32_t tail;
+    /* Bytes from @tail to @head, including any wrap padding */
+    uint32_t fill;
+    uint32_t reserved;
+    /* Wall clock time of the start of the capture */
+    uint64_t start_realtime_us;
+};
+
+static uint64_t conlog_now_us(clockid_t clock)
+{
+    struct timespec now;
+
+    clock_gettime(clock, &now);
+
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+int conlog_create(struct conlog *ctx, const char *path, size_t size)
+{
+    void *map;
+    int rc;
+
+    if (size < CONLOG_SIZE_MIN || size > UINT32_MAX)
+        return -EINVAL;
+
+    ctx->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (ctx->fd < 0)
+        return -errno;
+
+    ctx->len = sizeof(*ctx->hdr) + size;
+    if (ftruncate(ctx->fd, ctx->len) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    map = mmap(NULL, ctx->len, PROT_READ | PROT_WRITE, MAP_SHARED, ctx->fd, 0);
+    if (map == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    ctx->hdr = map;
+    ctx->data = (uint8_t *)map + sizeof(*ctx->hdr);
+    ctx->start_us = conlog_now_us(CLOCK_MONOTONIC);
+
+    memcpy(ctx->hdr->magic, CONLOG_MAGIC, sizeof(ctx->hdr->magic));
+    ctx->hdr->version = CONLOG_VERSION;
+    ctx->hdr->size = size;
+    ctx->hdr->start_realtime_us = conlog_now_us(CLOCK_REALTIME);
+
+    return 0;
+
+cleanup_fd:
+    close(ctx->fd);
+
+    return rc;
+}
+
+/* Whether the ring has no room for a record header before its end */
+static bool conlog_at_end(const struct conlog_hdr *hdr, const uint8_t *data,
+                          uint32_t pos)
+{
+    uint16_t len;
+
+    if (hdr->size - pos < CONLOG_REC_HDR)
+        return true;
+
+    memcpy(&len, &data[pos + sizeof(uint64_t)], sizeof(len));
+
+    return len == CONLOG_REC_WRAP;
+}
+
+static void conlog_drop_oldest(struct conlog *ctx)
+{
+    struct conlog_hdr *hdr = ctx->hdr;
+    uint16_t len;
+
+    if (conlog_at_end(hdr, ctx->data, hdr->tail)) {
+        hdr->fill -= hdr->size - hdr->tail;
+        hdr->tail = 0;
+        return;
+    }
+
+    memcpy(&len, &ctx->data[hdr->tail + sizeof(uint64_t)], sizeof(len));
+    hdr->fill -= CONLOG_REC_HDR + len;
+    hdr->tail += CONLOG_REC_HDR + len;
+    if (hdr->tail == hdr->size)
+        hdr->tail = 0;
+}
+
+/* Free a contiguous @need bytes at the head, dropping the oldest records */
+static void conlog_make_room(struct conlog *ctx, uint32_t need)
+{
+    struct conlog_hdr *hdr = ctx->hdr;
+    uint16_t wrap = CONLOG_REC_WRAP;
+
+    while (1) {
+        if (!hdr->fill) {
+            hdr->head = hdr->tail = 0;
+            return;
+        }
+
+        if (hdr->head > hdr->tail) {
+            if (hdr->size - hdr->head >= need)
+                return;
+
+            /* Pad out the end and carry on from the start */
+            if (hdr->size - hdr->head >= CONLOG_REC_HDR)
+                memcpy(&ctx->data[hdr->head + sizeof(uint64_t)], &wrap,
+                       sizeof(wrap));
+            hdr->fill += hdr->size - hdr->head;
+            hdr->head = 0;
+            continue;
+        }
+
+        if (hdr->head < hdr->tail && hdr->tail - hdr->head >= need)
+            return;
+
+        conlog_drop_oldest(ctx);
+    }
+}
+
+int conlog_append(struct conlog *ctx, const void *buf, size_t len)
+{
+    struct conlog_hdr *hdr = ctx->hdr;
+    const uint8_t *cursor = buf;
+    uint64_t us;
+
+    us = conlog_now_us(CLOCK_MONOTONIC) - ctx->start_us;
+
+    while (len) {
+        uint16_t chunk = len > CONLOG_REC_MAX ? CONLOG_REC_MAX : len;
+        uint32_t need = CONLOG_REC_HDR + chunk;
+
+        /* Keep records small against the ring so it holds a few of them */
+        if (need > hdr->size / 4) {
+            chunk = hdr->size / 4 - CONLOG_REC_HDR;
+            need = CONLOG_REC_HDR + chunk;
+        }
+
+        conlog_make_room(ctx, need);
+
+        memcpy(&ctx->data[hdr->head], &us, sizeof(us));
+        memcpy(&ctx->data[hdr->head + sizeof(us)], &chunk, sizeof(chunk));
+        memcpy(&ctx->data[hdr->head + CONLOG_REC_HDR], cursor, chunk);
+
+        hdr->fill += need;
+        hdr->head += need;
+        if (hdr->head == hdr->size)
+            hdr->head = 0;
+
+        cursor += chunk;
+        len -= chunk;
+    }
+
+    return 0;
+}
+
+int conlog_close(struct conlog *ctx)
+{
+    int rc = 0;
+
+    if (msync(ctx->hdr, ctx->len, MS_SYNC) < 0)
+        rc = -errno;
+
+    munmap(ctx->hdr, ctx->len);
+    close(ctx->fd);
+
+    return rc;
+}
+
+static int conlog_write_all(int fd, const void *buf, size_t len)
+{
+    const char *cursor = buf;
+    ssize_t wrote;
+
+    while (len) {
+        if ((wrote = write(fd, cursor, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        cursor += wrote;
+        len -= wrote;
+    }
+
+    return 0;
+}
+
+static int conlog_emit_stamped(int outfd, uint64_t us, const uint8_t *buf,
+                               size_t len, bool *bol)
+{
+    char stamp[32];
+    size_t line;
+    int rc;
+
+    while (len) {
+        if (*bol) {
+            snprintf(stamp, sizeof(stamp), "[%5" PRIu64 ".%06" PRIu64 "] ",
+                     us / 1000000, us % 1000000);
+            if ((rc = conlog_write_all(outfd, stamp, strlen(stamp))) < 0)
+                return rc;
+            *bol = false;
+        }
+
+        for (line = 0; line < len && buf[line] != '\n'; line++);
+        if (line < len) {
+            line++;
+            *bol = true;
+        }
+
+        if ((rc = conlog_write_all(outfd, buf, line)) < 0)
+            return rc;
+
+        buf += line;
+        len -= line;
+    }
+
+    return 0;
+}
+
+static void conlog_sleep_until(uint64_t us)
+{
+    struct timespec ts = {
+        .tv_sec = us / 1000000,
+        .tv_nsec = (us % 1000000) * 1000,
+    };
+
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+int conlog_replay(const char *path, int outfd, enum conlog_pace pace,
+                  double speed)
+{
+    const struct conlog_hdr *hdr;
+    uint64_t origin = 0, first = 0;
+    uint32_t pos, remaining;
+    bool started = false;
+    bool bol = true;
+    const uint8_t *data;
+    struct stat st;
+    void *map;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    if ((size_t)st.st_size < sizeof(*hdr)) {
+        rc = -EBADMSG;
+        goto cleanup_fd;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    hdr = map;
+    data = (const uint8_t *)map + sizeof(*hdr);
+
+    if (memcmp(hdr->magic, CONLOG_MAGIC, sizeof(hdr->magic)) ||
+            hdr->version != CONLOG_VERSION ||
+            sizeof(*hdr) + (uint64_t)hdr->size > (uint64_t)st.st_size ||
+            hdr->tail >= hdr->size || hdr->fill > hdr->size) {
+        loge("%s isn't a console capture\n", path);
+        rc = -EBADMSG;
+        goto cleanup_map;
+    }
+
+    rc = 0;
+    pos = hdr->tail;
+    remaining = hdr->fill;
+    while (remaining) {
+        uint16_t len;
+        uint64_t us;
+
+        if (conlog_at_end(hdr, data, pos)) {
+            remaining -= hdr->size - pos;
+            pos = 0;
+            continue;
+        }
+
+        memcpy(&us, &data[pos], sizeof(us));
+        memcpy(&len, &data[pos + sizeof(us)], sizeof(len));
+        if (len > CONLOG_REC_MAX || CONLOG_REC_HDR + (uint32_t)len > remaining) {
+            loge("Corrupt console capture record at 0x%" PRIx32 "\n", pos);
+            rc = -EBADMSG;
+            break;
+        }
+
+        if (pace == conlog_pace_timestamps) {
+            rc = conlog_emit_stamped(outfd, us, &data[pos + CONLOG_REC_HDR], len,
+                                     &bol);
+        } else {
+            if (!started) {
+                origin = conlog_now_us(CLOCK_MONOTONIC);
+                first = us;
+                started = true;
+            }
+
+            conlog_sleep_until(origin + (uint64_t)((us - first) / speed));
+            rc = conlog_write_all(outfd, &data[pos + CONLOG_REC_HDR], len);
+        }
+        if (rc < 0)
+            break;
+
+        remaining -= CONLOG_REC_HDR + len;
+        pos += CONLOG_REC_HDR + len;
+        if (pos == hdr->size)
+            pos = 0;
+    }
+
+cleanup_map:
+    munmap(map, st.st_size);
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
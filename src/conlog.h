@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _CONLOG_H
+#define _CONLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A console capture: a fixed-size file mapped as a ring of timestamped
+ * records, the oldest overwritten once it fills. Used in host byte order, the
+ * file isn't meant to move between machines of differing endianness.
+ */
+#define CONLOG_SIZE_DEFAULT     (1 << 20)
+#define CONLOG_SIZE_MIN         (4 << 10)
+
+struct conlog_hdr;
+
+struct conlog {
+    int fd;
+    struct conlog_hdr *hdr;
+    uint8_t *data;
+    size_t len;
+    uint64_t start_us;
+};
+
+/* Create or truncate @path to hold @size bytes of records */
+int conlog_create(struct conlog *ctx, const char *path, size_t size);
+int conlog_append(struct conlog *ctx, const void *buf, size_t len);
+int conlog_close(struct conlog *ctx);
+
+/* How conlog_replay() paces the records out */
+enum conlog_pace { conlog_pace_realtime, conlog_pace_timestamps };
+
+/*
+ * Write the records in @path to @outfd, either sleeping so they come out with
+ * their original spacing divided by @speed, or immediately with each line
+ * prefixed by its time since the start of the capture.
+ */
+int conlog_replay(const char *path, int outfd, enum conlog_pace pace,
+                  double speed);
+
+#endif
@@ -0,0 +1,970 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "compiler.h"
+#include "config.h"
+#include "container.h"
+#include "crc32.h"
+#include "fill.h"
+#include "log.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define CONTAINER_BLOCK_MAGIC   "CVBK"
+#define CONTAINER_INDEX_MAGIC   "CVINDEX\0"
+
+static inline off_t container_align(off_t off, off_t align)
+{
+    return (off + align - 1) & ~(align - 1);
+}
+
+static uint32_t container_get_le32(const uint8_t *p)
+{
+    uint32_t val;
+
+    memcpy(&val, p, sizeof(val));
+
+    return le32toh(val);
+}
+
+static uint64_t container_get_le64(const uint8_t *p)
+{
+    uint64_t val;
+
+    memcpy(&val, p, sizeof(val));
+
+    return le64toh(val);
+}
+
+static void container_put_le32(uint8_t *p, uint32_t val)
+{
+    val = htole32(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void container_put_le64(uint8_t *p, uint64_t val)
+{
+    val = htole64(val);
+    memcpy(p, &val, sizeof(val));
+}
+
+static void container_encode_header(uint8_t *hdr, uint32_t block_size,
+                                    const struct elfcore_soc *soc)
+{
+    memset(hdr, 0, CONTAINER_HDR_LEN);
+    memcpy(hdr, CONTAINER_MAGIC, 8);
+    container_put_le32(&hdr[8], CONTAINER_VERSION);
+    container_put_le32(&hdr[12], block_size);
+    container_put_le32(&hdr[16], soc->rev);
+    container_put_le32(&hdr[20], soc->dram_start);
+    container_put_le32(&hdr[24], soc->dram_length);
+    container_put_le32(&hdr[28], soc->vram_start);
+    container_put_le32(&hdr[32], soc->vram_length);
+}
+
+static int container_decode_header(const uint8_t *hdr, size_t len,
+                                   uint32_t *block_size,
+                                   struct elfcore_soc *soc)
+{
+    if (!container_is(hdr, len) ||
+            container_get_le32(&hdr[8]) != CONTAINER_VERSION)
+        return -EINVAL;
+
+    *block_size = container_get_le32(&hdr[12]);
+    if (!*block_size)
+        return -EINVAL;
+
+    soc->rev = container_get_le32(&hdr[16]);
+    soc->dram_start = container_get_le32(&hdr[20]);
+    soc->dram_length = container_get_le32(&hdr[24]);
+    soc->vram_start = container_get_le32(&hdr[28]);
+    soc->vram_length = container_get_le32(&hdr[32]);
+
+    return 0;
+}
+
+bool container_is(const void *buf, size_t len)
+{
+    return len >= CONTAINER_HDR_LEN && !memcmp(buf, CONTAINER_MAGIC, 8);
+}
+
+static int container_add(struct container_block **blocks, size_t *nblocks,
+                         size_t *alloc, const struct container_block *blk)
+{
+    if (*nblocks == *alloc) {
+        size_t grown = *alloc ? 2 * *alloc : 64;
+        struct container_block *resized;
+
+        if (!(resized = realloc(*blocks, grown * sizeof(*resized))))
+            return -ENOMEM;
+
+        *blocks = resized;
+        *alloc = grown;
+    }
+
+    (*blocks)[(*nblocks)++] = *blk;
+
+    return 0;
+}
+
+/* Decompresses or copies the block's data into @buf and checks it */
+static int container_unpack(void **dctx, const uint8_t *data,
+                            const struct container_block *blk, void *buf)
+{
+    if (blk->flags & CONTAINER_ZERO) {
+        memset(buf, 0, blk->len);
+        return 0;
+    }
+
+    if (blk->flags & CONTAINER_ZSTD) {
+#if HAVE_ZSTD
+        size_t rc;
+
+        if (!*dctx && !(*dctx = ZSTD_createDCtx()))
+            return -ENOMEM;
+
+        rc = ZSTD_decompressDCtx(*dctx, buf, blk->len, data, blk->stored);
+        if (ZSTD_isError(rc) || rc != blk->len)
+            return -EIO;
+#else
+        (void)dctx;
+        loge("culvert was built without zstd support\n");
+        return -ENOTSUP;
+#endif
+    } else {
+        memcpy(buf, data, blk->len);
+    }
+
+    return crc32c_update(0, buf, blk->len) == blk->crc ? 0 : -EIO;
+}
+
+/*
+ * Walks the block records from after the header, stopping at the first that
+ * doesn't verify. With @verify, the data of each is checked too.
+ */
+static int container_scan(const uint8_t *base, size_t size,
+                          uint32_t block_size, bool verify,
+                          struct container_block **blocks, size_t *nblocks,
+                          off_t *end)
+{
+    size_t pos = CONTAINER_HDR_LEN, alloc = 0;
+    void *dctx = NULL;
+    void *scratch = NULL;
+    int rc = 0;
+
+    *blocks = NULL;
+    *nblocks = 0;
+
+    if (verify && !(scratch = malloc(block_size)))
+        return -ENOMEM;
+
+    while (pos + CONTAINER_RECORD_LEN <= size) {
+        const uint8_t *rec = base + pos;
+        struct container_block blk;
+
+        /* Padding out to a page-aligned block */
+        if (fill_is_zero(rec, CONTAINER_RECORD_LEN)) {
+            pos += CONTAINER_RECORD_LEN;
+            continue;
+        }
+
+        if (memcmp(rec, CONTAINER_BLOCK_MAGIC, 4) ||
+                crc32c_update(0, rec, 24) != container_get_le32(&rec[24]))
+            break;
+
+        blk.phys = container_get_le32(&rec[4]);
+        blk.len = container_get_le32(&rec[8]);
+        blk.stored = container_get_le32(&rec[12]);
+        blk.crc = container_get_le32(&rec[16]);
+        blk.flags = container_get_le32(&rec[20]);
+        blk.offset = pos + CONTAINER_RECORD_LEN;
+
+        if (!blk.len || blk.len > block_size ||
+                blk.stored > size - blk.offset ||
+                (!blk.flags && blk.stored != blk.len))
+            break;
+
+        if (verify && container_unpack(&dctx, base + blk.offset, &blk, scratch) < 0)
+            break;
+
+        if ((rc = container_add(blocks, nblocks, &alloc, &blk)) < 0)
+            break;
+
+        pos = container_align(blk.offset + blk.stored, CONTAINER_RECORD_LEN);
+    }
+
+    /* Past the end of the file if the last block's padding wasn't written */
+    *end = pos;
+
+#if HAVE_ZSTD
+    ZSTD_freeDCtx(dctx);
+#endif
+    free(scratch);
+
+    if (rc < 0) {
+        free(*blocks);
+        *blocks = NULL;
+        *nblocks = 0;
+    }
+
+    return rc;
+}
+
+static int container_load_index(struct container *ctx)
+{
+    const uint8_t *trailer, *entry;
+    uint64_t offset;
+    uint32_t count, i;
+
+    if (ctx->size < CONTAINER_HDR_LEN + CONTAINER_RECORD_LEN)
+        return -ENOENT;
+
+    trailer = ctx->base + ctx->size - CONTAINER_RECORD_LEN;
+    if (memcmp(trailer, CONTAINER_INDEX_MAGIC, 8))
+        return -ENOENT;
+
+    offset = container_get_le64(&trailer[8]);
+    count = container_get_le32(&trailer[16]);
+    if (offset < CONTAINER_HDR_LEN ||
+            offset + (uint64_t)count * CONTAINER_RECORD_LEN >
+                ctx->size - CONTAINER_RECORD_LEN)
+        return -EINVAL;
+
+    if (crc32c_update(0, ctx->base + offset, count * CONTAINER_RECORD_LEN) !=
+            container_get_le32(&trailer[20]))
+        return -EINVAL;
+
+    if (!(ctx->blocks = calloc(count ? count : 1, sizeof(*ctx->blocks))))
+        return -ENOMEM;
+
+    for (i = 0; i < count; i++) {
+        struct container_block *blk = &ctx->blocks[i];
+
+        entry = ctx->base + offset + i * CONTAINER_RECORD_LEN;
+        blk->phys = container_get_le32(&entry[0]);
+        blk->len = container_get_le32(&entry[4]);
+        blk->offset = container_get_le64(&entry[8]);
+        blk->stored = container_get_le32(&entry[16]);
+        blk->crc = container_get_le32(&entry[20]);
+        blk->flags = container_get_le32(&entry[24]);
+
+        if (!blk->len || blk->len > ctx->block_size ||
+                (uint64_t)blk->offset + blk->stored > offset) {
+            free(ctx->blocks);
+            ctx->blocks = NULL;
+            return -EINVAL;
+        }
+    }
+
+    ctx->nblocks = count;
+    ctx->end = offset;
+
+    return 0;
+}
+
+/* By address, the latest written last */
+static int container_block_cmp(const void *a, const void *b)
+{
+    const struct container_block *l = a, *r = b;
+
+    if (l->phys != r->phys)
+        return l->phys < r->phys ? -1 : 1;
+
+    return (l->offset > r->offset) - (l->offset < r->offset);
+}
+
+static void container_sort(struct container *ctx)
+{
+    size_t i, n;
+
+    qsort(ctx->blocks, ctx->nblocks, sizeof(*ctx->blocks), container_block_cmp);
+
+    for (i = 0, n = 0; i < ctx->nblocks; i++) {
+        if (n && ctx->blocks[n - 1].phys == ctx->blocks[i].phys)
+            n--;
+        ctx->blocks[n++] = ctx->blocks[i];
+    }
+
+    ctx->nblocks = n;
+}
+
+int container_open(struct container *ctx, const char *path)
+{
+    struct stat st;
+    void *base;
+    int fd, rc;
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+        return -errno;
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    if (st.st_size < CONTAINER_HDR_LEN) {
+        rc = -EINVAL;
+        goto cleanup_fd;
+    }
+
+    base = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    ctx->base = base;
+    ctx->size = st.st_size;
+
+    if ((rc = container_decode_header(ctx->base, ctx->size, &ctx->block_size,
+                                      &ctx->soc)) < 0) {
+        loge("%s is not a supported container\n", path);
+        goto cleanup_map;
+    }
+
+    if (!(rc = container_load_index(ctx))) {
+        ctx->indexed = true;
+    } else if (rc == -ENOMEM) {
+        goto cleanup_map;
+    } else {
+        logi("%s has no usable index, scanning its blocks\n", path);
+        rc = container_scan(ctx->base, ctx->size, ctx->block_size, false,
+                            &ctx->blocks, &ctx->nblocks, &ctx->end);
+        if (rc < 0)
+            goto cleanup_map;
+    }
+
+    container_sort(ctx);
+
+    logd("%s holds %zu blocks of up to %" PRIu32 " bytes\n", path,
+         ctx->nblocks, ctx->block_size);
+
+    close(fd);
+
+    return 0;
+
+cleanup_map:
+    munmap((void *)ctx->base, ctx->size);
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+void container_close(struct container *ctx)
+{
+#if HAVE_ZSTD
+    ZSTD_freeDCtx(ctx->dctx);
+#endif
+    free(ctx->blocks);
+    munmap((void *)ctx->base, ctx->size);
+}
+
+const struct container_block *container_find(const struct container *ctx,
+                                             uint32_t phys)
+{
+    const struct container_block *found = NULL;
+    size_t lo = 0, hi = ctx->nblocks;
+
+    /* The first block starting after @phys */
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (ctx->blocks[mid].phys <= phys)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    /* Blocks of runs at different alignments can overlap, the latest wins */
+    while (lo--) {
+        const struct container_block *blk = &ctx->blocks[lo];
+
+        if (phys - blk->phys >= ctx->block_size)
+            break;
+
+        if (phys - blk->phys < blk->len &&
+                (!found || blk->offset > found->offset))
+            found = blk;
+    }
+
+    return found;
+}
+
+const void *container_block_data(const struct container *ctx,
+                                 const struct container_block *blk)
+{
+    return blk->flags ? NULL : ctx->base + blk->offset;
+}
+
+int container_read_block(struct container *ctx,
+                         const struct container_block *blk, void *buf)
+{
+    return container_unpack(&ctx->dctx, ctx->base + blk->offset, blk, buf);
+}
+
+enum container_slot_state {
+    container_slot_empty,
+    container_slot_queued,
+    container_slot_busy,
+    container_slot_ready,
+};
+
+struct container_slot {
+    const struct container_block *blk;
+    uint8_t *data;
+    enum container_slot_state state;
+    int rc;
+    uint64_t used;
+};
+
+static void *container_cache_worker(void *arg)
+{
+    struct container_cache *cache = arg;
+    struct container_slot *slot, *next;
+    size_t i;
+
+    pthread_mutex_lock(&cache->lock);
+
+    while (1) {
+        /* Oldest request first */
+        for (i = 0, next = NULL; i < cache->nslots; i++) {
+            slot = &cache->slots[i];
+            if (slot->state == container_slot_queued &&
+                    (!next || slot->used < next->used))
+                next = slot;
+        }
+
+        if (!next) {
+            if (cache->stopping)
+                break;
+            pthread_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+
+        next->state = container_slot_busy;
+        pthread_mutex_unlock(&cache->lock);
+
+        next->rc = container_read_block(cache->container, next->blk, next->data);
+
+        pthread_mutex_lock(&cache->lock);
+        next->state = container_slot_ready;
+        pthread_cond_broadcast(&cache->cond);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return NULL;
+}
+
+int container_cache_init(struct container_cache *cache,
+                         struct container *container, size_t nslots)
+{
+    size_t i;
+
+    memset(cache, 0, sizeof(*cache));
+    cache->container = container;
+    cache->nslots = nslots;
+
+    if (!(cache->slots = calloc(nslots, sizeof(*cache->slots))))
+        return -ENOMEM;
+
+    for (i = 0; i < nslots; i++) {
+        if (!(cache->slots[i].data = malloc(container->block_size)))
+            goto cleanup_slots;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+
+    return 0;
+
+cleanup_slots:
+    while (i--)
+        free(cache->slots[i].data);
+    free(cache->slots);
+
+    return -ENOMEM;
+}
+
+void container_cache_destroy(struct container_cache *cache)
+{
+    size_t i;
+
+    if (cache->started) {
+        pthread_mutex_lock(&cache->lock);
+        cache->stopping = true;
+        pthread_cond_broadcast(&cache->cond);
+        pthread_mutex_unlock(&cache->lock);
+        pthread_join(cache->worker, NULL);
+    }
+
+    if (cache->hits || cache->misses)
+        logd("Container cache: %" PRIu64 " hits, %" PRIu64 " misses, %" PRIu64
+             " blocks read ahead\n", cache->hits, cache->misses, cache->ahead);
+
+    for (i = 0; i < cache->nslots; i++)
+        free(cache->slots[i].data);
+    free(cache->slots);
+
+    pthread_cond_destroy(&cache->cond);
+    pthread_mutex_destroy(&cache->lock);
+}
+
+static struct container_slot *
+container_cache_lookup(struct container_cache *cache,
+                       const struct container_block *blk)
+{
+    size_t i;
+
+    for (i = 0; i < cache->nslots; i++) {
+        if (cache->slots[i].state != container_slot_empty &&
+                cache->slots[i].blk == blk)
+            return &cache->slots[i];
+    }
+
+    return NULL;
+}
+
+/* Queues @blk into the least recently used slot the worker isn't filling */
+static struct container_slot *
+container_cache_queue(struct container_cache *cache,
+                      const struct container_block *blk)
+{
+    struct container_slot *slot, *victim = NULL;
+    size_t i;
+
+    for (i = 0; i < cache->nslots; i++) {
+        slot = &cache->slots[i];
+
+        if (slot->state == container_slot_queued ||
+                slot->state == container_slot_busy)
+            continue;
+
+        if (slot->state == container_slot_empty) {
+            victim = slot;
+            break;
+        }
+
+        if (!victim || slot->used < victim->used)
+            victim = slot;
+    }
+
+    if (!victim)
+        return NULL;
+
+    victim->blk = blk;
+    victim->state = container_slot_queued;
+    victim->used = cache->clock++;
+
+    return victim;
+}
+
+/* Following on from the last block read, queue those after it */
+static void container_cache_read_ahead(struct container_cache *cache,
+                                       const struct container_block *blk)
+{
+    const struct container *container = cache->container;
+    const struct container_block *end = &container->blocks[container->nblocks];
+    const struct container_block *next;
+    size_t n;
+
+    if (!cache->last || cache->last + 1 != blk ||
+            cache->last->phys + cache->last->len != blk->phys)
+        return;
+
+    for (next = blk + 1, n = 0; next < end && n < CONTAINER_READAHEAD;
+         next++, n++) {
+        if (next[-1].phys + next[-1].len != next->phys ||
+                !(next->flags & CONTAINER_ZSTD))
+            break;
+
+        if (container_cache_lookup(cache, next))
+            continue;
+
+        if (!container_cache_queue(cache, next))
+            break;
+
+        cache->ahead++;
+    }
+}
+
+int container_cache_read(struct container_cache *cache,
+                         const struct container_block *blk, size_t offset,
+                         void *buf, size_t len)
+{
+    struct container_slot *slot;
+    int rc;
+
+    if (offset > blk->len || len > blk->len - offset)
+        return -EINVAL;
+
+    pthread_mutex_lock(&cache->lock);
+
+    if (!cache->started) {
+        if ((rc = -pthread_create(&cache->worker, NULL, container_cache_worker,
+                                  cache))) {
+            pthread_mutex_unlock(&cache->lock);
+            return rc;
+        }
+        cache->started = true;
+    }
+
+again:
+    if ((slot = container_cache_lookup(cache, blk))) {
+        /* Keep it from being taken for what's read ahead */
+        slot->used = cache->clock++;
+        cache->hits++;
+    } else if ((slot = container_cache_queue(cache, blk))) {
+        cache->misses++;
+    } else {
+        pthread_mutex_unlock(&cache->lock);
+        return -EBUSY;
+    }
+
+    container_cache_read_ahead(cache, blk);
+    cache->last = blk;
+    pthread_cond_broadcast(&cache->cond);
+
+    while (slot->state != container_slot_ready && slot->blk == blk)
+        pthread_cond_wait(&cache->cond, &cache->lock);
+
+    /* Another reader took the slot for something else in the meantime */
+    if (slot->blk != blk)
+        goto again;
+
+    if (!(rc = slot->rc))
+        memcpy(buf, slot->data + offset, len);
+    else
+        slot->state = container_slot_empty;
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return rc;
+}
+
+static int container_writer_resume(struct container_writer *ctx,
+                                   const struct elfcore_soc *soc,
+                                   size_t size)
+{
+    struct elfcore_soc found;
+    uint32_t block_size;
+    void *base;
+    int rc;
+
+    base = mmap(NULL, size, PROT_READ, MAP_SHARED, ctx->fd, 0);
+    if (base == MAP_FAILED)
+        return -errno;
+
+    if (container_decode_header(base, size, &block_size, &found) < 0) {
+        loge("Output exists but isn't a container\n");
+        rc = -EINVAL;
+        goto cleanup_map;
+    }
+
+    if (block_size != ctx->block_size || memcmp(&found, soc, sizeof(found))) {
+        loge("Output is a container of another SoC or block size\n");
+        rc = -EINVAL;
+        goto cleanup_map;
+    }
+
+    rc = container_scan(base, size, block_size, true, &ctx->blocks,
+                        &ctx->nblocks, &ctx->end);
+    if (rc < 0)
+        goto cleanup_map;
+
+    ctx->alloc = ctx->nblocks;
+    ctx->resumed = ctx->nblocks;
+
+    /* The old index and anything torn go, the index is rewritten at the end */
+    if (ftruncate(ctx->fd, ctx->end) < 0) {
+        rc = -errno;
+        goto cleanup_map;
+    }
+
+    logi("Resuming container with %zu blocks\n", ctx->nblocks);
+
+cleanup_map:
+    munmap(base, size);
+
+    return rc;
+}
+
+int container_writer_init(struct container_writer *ctx, int fd,
+                          uint32_t block_size, int level,
+                          const struct elfcore_soc *soc)
+{
+    uint8_t hdr[CONTAINER_HDR_LEN];
+    struct stat st;
+    ssize_t egress;
+    int rc;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->fd = fd;
+    ctx->block_size = block_size;
+    ctx->level = level;
+
+    if (!block_size || (block_size & 3)) {
+        loge("Container blocks must be a non-zero multiple of 4 bytes\n");
+        return -EINVAL;
+    }
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        loge("Containers must be written to a regular file\n");
+        return -EINVAL;
+    }
+
+    if (level) {
+#if HAVE_ZSTD
+        if (!(ctx->cctx = ZSTD_createCCtx()))
+            return -ENOMEM;
+        ctx->buf_size = ZSTD_compressBound(block_size);
+        if (!(ctx->buf = malloc(ctx->buf_size))) {
+            rc = -ENOMEM;
+            goto cleanup_cctx;
+        }
+#else
+        loge("culvert was built without zstd support\n");
+        return -ENOTSUP;
+#endif
+    }
+
+    if (st.st_size) {
+        if ((rc = container_writer_resume(ctx, soc, st.st_size)) < 0)
+            goto cleanup_buf;
+
+        return 0;
+    }
+
+    container_encode_header(hdr, block_size, soc);
+    egress = pwrite(fd, hdr, sizeof(hdr), 0);
+    if (egress != sizeof(hdr)) {
+        rc = egress < 0 ? -errno : -EIO;
+        goto cleanup_buf;
+    }
+
+    ctx->end = CONTAINER_HDR_LEN;
+
+    return 0;
+
+cleanup_buf:
+    free(ctx->buf);
+
+#if HAVE_ZSTD
+cleanup_cctx:
+    ZSTD_freeCCtx(ctx->cctx);
+#endif
+
+    return rc;
+}
+
+void container_writer_destroy(struct container_writer *ctx)
+{
+#if HAVE_ZSTD
+    ZSTD_freeCCtx(ctx->cctx);
+    ZSTD_freeDCtx(ctx->dctx);
+#endif
+    free(ctx->stored);
+    free(ctx->buf);
+    free(ctx->blocks);
+}
+
+const struct container_block *
+container_writer_latest(struct container_writer *ctx, uint32_t phys)
+{
+    size_t i;
+
+    for (i = ctx->nblocks; i > 0; i--) {
+        if (ctx->blocks[i - 1].phys == phys)
+            return &ctx->blocks[i - 1];
+    }
+
+    return NULL;
+}
+
+int container_writer_read(struct container_writer *ctx,
+                          const struct container_block *blk, void *buf)
+{
+    ssize_t ingress;
+
+    if (!(blk->flags & CONTAINER_ZERO) && !ctx->stored &&
+            !(ctx->stored = malloc(ctx->block_size)))
+        return -ENOMEM;
+
+    if (blk->stored) {
+        ingress = pread(ctx->fd, ctx->stored, blk->stored, blk->offset);
+        if (ingress < 0 || (size_t)ingress != blk->stored)
+            return ingress < 0 ? -errno : -EIO;
+    }
+
+    return container_unpack(&ctx->dctx, ctx->stored, blk, buf);
+}
+
+bool container_writer_has(struct container_writer *ctx, uint32_t phys,
+                          uint32_t len)
+{
+    size_t i, n;
+
+    /* A resumed dump asks after the blocks in the order they were written */
+    for (n = 0; n < ctx->resumed; n++) {
+        i = (ctx->hint + n) % ctx->resumed;
+
+        if (ctx->blocks[i].phys == phys && ctx->blocks[i].len == len) {
+            ctx->hint = i + 1;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+/* Compressed into ctx->buf, or 0 if it's no smaller for it */
+static size_t container_compress(struct container_writer *ctx, const void *buf,
+                                 uint32_t len)
+{
+#if HAVE_ZSTD
+    size_t rc;
+
+    if (!ctx->level)
+        return 0;
+
+    rc = ZSTD_compressCCtx(ctx->cctx, ctx->buf, ctx->buf_size, buf, len,
+                           ctx->level);
+    if (ZSTD_isError(rc)) {
+        logd("Compressing block failed: %s\n", ZSTD_getErrorName(rc));
+        return 0;
+    }
+
+    return rc < len ? rc : 0;
+#else
+    (void)ctx;
+    (void)buf;
+    (void)len;
+
+    return 0;
+#endif
+}
+
+int container_append(struct container_writer *ctx, uint32_t phys,
+                     const void *buf, uint32_t len)
+{
+    uint8_t rec[CONTAINER_RECORD_LEN] = { 0 };
+    struct container_block blk;
+    struct iovec iov[2];
+    ssize_t egress;
+    size_t packed;
+    off_t at;
+    int rc;
+
+    if (!len || len > ctx->block_size)
+        return -EINVAL;
+
+    blk.phys = phys;
+    blk.len = len;
+    blk.crc = crc32c_update(0, buf, len);
+
+    if (fill_is_zero(buf, len)) {
+        blk.flags = CONTAINER_ZERO;
+        blk.stored = 0;
+    } else if ((packed = container_compress(ctx, buf, len))) {
+        blk.flags = CONTAINER_ZSTD;
+        blk.stored = packed;
+        buf = ctx->buf;
+    } else {
+        blk.flags = 0;
+        blk.stored = len;
+    }
+
+    /* Data stored as it is starts on a page, the gap reads back as padding */
+    at = ctx->end;
+    if (!blk.flags)
+        at = container_align(at + CONTAINER_RECORD_LEN, CONTAINER_ALIGN) -
+             CONTAINER_RECORD_LEN;
+    blk.offset = at + CONTAINER_RECORD_LEN;
+
+    memcpy(rec, CONTAINER_BLOCK_MAGIC, 4);
+    container_put_le32(&rec[4], blk.phys);
+    container_put_le32(&rec[8], blk.len);
+    container_put_le32(&rec[12], blk.stored);
+    container_put_le32(&rec[16], blk.crc);
+    container_put_le32(&rec[20], blk.flags);
+    container_put_le32(&rec[24], crc32c_update(0, rec, 24));
+
+    iov[0].iov_base = rec;
+    iov[0].iov_len = sizeof(rec);
+    iov[1].iov_base = (void *)buf;
+    iov[1].iov_len = blk.stored;
+
+    egress = pwritev(ctx->fd, iov, 2, at);
+    if (egress < 0 || (size_t)egress != sizeof(rec) + blk.stored)
+        return egress < 0 ? -errno : -EIO;
+
+    if ((rc = container_add(&ctx->blocks, &ctx->nblocks, &ctx->alloc, &blk)) < 0)
+        return rc;
+
+    ctx->end = container_align(blk.offset + blk.stored, CONTAINER_RECORD_LEN);
+    ctx->ingress += len;
+    ctx->egress += ctx->end - at;
+
+    return 0;
+}
+
+int container_finish(struct container_writer *ctx)
+{
+    size_t len = (ctx->nblocks + 1) * CONTAINER_RECORD_LEN;
+    uint8_t *index, *trailer;
+    ssize_t egress;
+    size_t i;
+    int rc = 0;
+
+    if (!(index = calloc(1, len)))
+        return -ENOMEM;
+
+    for (i = 0; i < ctx->nblocks; i++) {
+        const struct container_block *blk = &ctx->blocks[i];
+        uint8_t *entry = &index[i * CONTAINER_RECORD_LEN];
+
+        container_put_le32(&entry[0], blk->phys);
+        container_put_le32(&entry[4], blk->len);
+        container_put_le64(&entry[8], blk->offset);
+        container_put_le32(&entry[16], blk->stored);
+        container_put_le32(&entry[20], blk->crc);
+        container_put_le32(&entry[24], blk->flags);
+    }
+
+    trailer = &index[ctx->nblocks * CONTAINER_RECORD_LEN];
+    memcpy(trailer, CONTAINER_INDEX_MAGIC, 8);
+    container_put_le64(&trailer[8], ctx->end);
+    container_put_le32(&trailer[16], ctx->nblocks);
+    container_put_le32(&trailer[20],
+                       crc32c_update(0, index, ctx->nblocks * CONTAINER_RECORD_LEN));
+
+    egress = pwrite(ctx->fd, index, len, ctx->end);
+    if (egress < 0 || (size_t)egress != len) {
+        rc = egress < 0 ? -errno : -EIO;
+        goto cleanup_index;
+    }
+
+    if (ftruncate(ctx->fd, ctx->end + len) < 0 || fdatasync(ctx->fd) < 0)
+        rc = -errno;
+
+cleanup_index:
+    free(index);
+
+    return rc;
+}
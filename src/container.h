@@ -0,0 +1,182 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _CONTAINER_H
+#define _CONTAINER_H
+
+#include "elfcore.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * A container holds memory captured from the BMC as independently stored
+ * blocks of up to the container's block size, as little-endian fields:
+ *
+ *   header:  "CVDUMP\0\0", le32 version, le32 block size, then the SoC's
+ *            revision and DRAM and VRAM layout as le32 fields in the order of
+ *            struct elfcore_soc, padded to CONTAINER_HDR_LEN
+ *   blocks:  per block a record of "CVBK", le32 address, le32 length, le32
+ *            stored length, le32 CRC32C of the block's data, le32 flags, le32
+ *            CRC32C of the record's first 24 bytes, le32 zero, followed by
+ *            the stored data and zeros out to CONTAINER_RECORD_LEN
+ *   index:   once finished, per block le32 address, le32 length, le64 file
+ *            offset of its stored data, le32 stored length, le32 CRC32C, le32
+ *            flags, le32 zero, then a trailer of "CVINDEX\0", le64 file offset
+ *            of the index, le32 block count, le32 CRC32C of the index entries
+ *            and zeros out to CONTAINER_RECORD_LEN
+ *
+ * Blocks stored as they are start on a page boundary, so they can be mapped
+ * straight out of the file. Blocks of zeros store nothing. The records alone
+ * describe the blocks, so a container cut short by an interruption, without
+ * its index, is resumed by appending after the last record that verifies. A
+ * later block of the same address supersedes an earlier one, so a container
+ * is also brought up to date by appending a layer of the blocks that changed.
+ */
+#define CONTAINER_MAGIC         "CVDUMP\0\0"
+#define CONTAINER_VERSION       1
+#define CONTAINER_HDR_LEN       64
+#define CONTAINER_RECORD_LEN    32
+#define CONTAINER_ALIGN         4096
+
+#define CONTAINER_DEFAULT_BLOCK (64 << 10)
+
+#define CONTAINER_ZSTD          (1 << 0)
+#define CONTAINER_ZERO          (1 << 1)
+
+struct container_block {
+    uint32_t phys;
+    uint32_t len;
+    off_t offset;
+    uint32_t stored;
+    uint32_t crc;
+    uint32_t flags;
+};
+
+/* An open container, mapped for reading */
+struct container {
+    const uint8_t *base;
+    size_t size;
+    uint32_t block_size;
+    struct elfcore_soc soc;
+    /* Sorted by address, superseded blocks dropped */
+    struct container_block *blocks;
+    size_t nblocks;
+    /* Where the next block goes, after the last record that verifies */
+    off_t end;
+    bool indexed;
+    void *dctx;
+};
+
+/* If the file is a container, going by its header */
+bool container_is(const void *buf, size_t len);
+
+int container_open(struct container *ctx, const char *path);
+void container_close(struct container *ctx);
+
+/* The block holding @phys, or NULL if none does */
+const struct container_block *container_find(const struct container *ctx,
+                                             uint32_t phys);
+
+/* The block's data in the mapping if it's stored as it is, otherwise NULL */
+const void *container_block_data(const struct container *ctx,
+                                 const struct container_block *blk);
+
+/* Fill @buf with the block's @blk->len bytes, verifying its checksum */
+int container_read_block(struct container *ctx,
+                         const struct container_block *blk, void *buf);
+
+#define CONTAINER_CACHE_BLOCKS  64
+#define CONTAINER_READAHEAD     4
+
+struct container_slot;
+
+/*
+ * A bounded LRU of unpacked blocks, for random access to a compressed
+ * container without unpacking all of it. A worker thread does the unpacking,
+ * running ahead of reads that walk the blocks in order, so a sequential scan
+ * mostly finds the next block already waiting.
+ */
+struct container_cache {
+    struct container *container;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    pthread_t worker;
+    bool started;
+    bool stopping;
+    struct container_slot *slots;
+    size_t nslots;
+    uint64_t clock;
+    const struct container_block *last;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t ahead;
+};
+
+/* Once the cache is set up, blocks of @container are read only through it */
+int container_cache_init(struct container_cache *cache,
+                         struct container *container, size_t nslots);
+void container_cache_destroy(struct container_cache *cache);
+
+/* Copy @len bytes from @offset into the block */
+int container_cache_read(struct container_cache *cache,
+                         const struct container_block *blk, size_t offset,
+                         void *buf, size_t len);
+
+/*
+ * Appends blocks to a container in a regular file, beginning one if the file
+ * is empty and otherwise resuming the one it holds.
+ */
+struct container_writer {
+    int fd;
+    uint32_t block_size;
+    int level;
+    void *cctx;
+    void *buf;
+    size_t buf_size;
+    off_t end;
+    /* Every block in the file, in the order written */
+    struct container_block *blocks;
+    size_t nblocks;
+    size_t alloc;
+    /* Those of them found when resuming, and where to look among them next */
+    size_t resumed;
+    size_t hint;
+    uint64_t ingress;
+    uint64_t egress;
+    /* For reading back blocks already in the file */
+    void *dctx;
+    void *stored;
+};
+
+/*
+ * Blocks are compressed with zstd at @level, or with @level 0 stored as they
+ * are. Resuming a container requires the same block size and SoC.
+ */
+int container_writer_init(struct container_writer *ctx, int fd,
+                          uint32_t block_size, int level,
+                          const struct elfcore_soc *soc);
+void container_writer_destroy(struct container_writer *ctx);
+
+/* If an earlier run already wrote the block of @len bytes at @phys */
+bool container_writer_has(struct container_writer *ctx, uint32_t phys,
+                          uint32_t len);
+
+/* The last block written for @phys, resumed ones included, or NULL if none */
+const struct container_block *
+container_writer_latest(struct container_writer *ctx, uint32_t phys);
+
+/* Fill @buf with the data of a block in the file, verifying its checksum */
+int container_writer_read(struct container_writer *ctx,
+                          const struct container_block *blk, void *buf);
+
+/* @len is at most the container's block size */
+int container_append(struct container_writer *ctx, uint32_t phys,
+                     const void *buf, uint32_t len);
+
+/* Writes the index and flushes the container to stable storage */
+int container_finish(struct container_writer *ctx);
+
+#endif
@@ -0,0 +1,493 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "bridge.h"
+#include "compiler.h"
+#include "control.h"
+#include "log.h"
+#include "progress.h"
+#include "throttle.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#define CONTROL_MAX_BRIDGES     16
+/* Transfers nest, as a flash write's verify pass inside a program */
+#define CONTROL_MAX_DEPTH       4
+#define CONTROL_HISTORY         16
+#define CONTROL_LINE_MAX        256
+#define CONTROL_REPLY_MAX       8192
+/* The window the current rate is taken over */
+#define CONTROL_RATE_NS         (1000 * 1000000ULL)
+
+/* A copy of a transfer's progress, taken on the transfer's own thread */
+struct control_transfer {
+    const struct progress *progress;
+    const char *label;
+    uint64_t base;
+    bool has_base;
+    uint64_t done;
+    uint64_t total;
+    uint64_t start_ns;
+    uint64_t end_ns;
+    uint64_t window_ns;
+    uint64_t window_done;
+    double rate;
+};
+
+struct control {
+    pthread_mutex_t lock;
+    pthread_cond_t resumed;
+    pthread_t thread;
+    int fd;
+    const char *path;
+    bool paused;
+    struct ahb *bridges[CONTROL_MAX_BRIDGES];
+    size_t nr_bridges;
+    struct control_transfer stack[CONTROL_MAX_DEPTH];
+    size_t depth;
+    /* Completed transfers, those after the first CONTROL_HISTORY overwriting */
+    struct control_transfer history[CONTROL_HISTORY];
+    uint64_t completed;
+};
+
+static struct control control = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .resumed = PTHREAD_COND_INITIALIZER,
+    .fd = -1,
+};
+
+static bool control_active;
+
+static uint64_t control_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+bool control_enabled(void)
+{
+    return control_active;
+}
+
+void control_add_bridge(struct ahb *ahb)
+{
+    if (!control_active)
+        return;
+
+    pthread_mutex_lock(&control.lock);
+    if (control.nr_bridges < CONTROL_MAX_BRIDGES)
+        control.bridges[control.nr_bridges++] = ahb;
+    pthread_mutex_unlock(&control.lock);
+}
+
+void control_remove_bridge(struct ahb *ahb)
+{
+    size_t i;
+
+    if (!control_active)
+        return;
+
+    pthread_mutex_lock(&control.lock);
+    for (i = 0; i < control.nr_bridges; i++) {
+        if (control.bridges[i] != ahb)
+            continue;
+
+        control.bridges[i] = control.bridges[--control.nr_bridges];
+        break;
+    }
+    pthread_mutex_unlock(&control.lock);
+}
+
+static struct control_transfer *control_find(const struct progress *progress)
+{
+    size_t i;
+
+    for (i = control.depth; i; i--) {
+        if (control.stack[i - 1].progress == progress)
+            return &control.stack[i - 1];
+    }
+
+    return NULL;
+}
+
+void control_progress_begin(struct progress *progress)
+{
+    struct control_transfer *xfer;
+
+    if (!control_active)
+        return;
+
+    pthread_mutex_lock(&control.lock);
+    if (control.depth < CONTROL_MAX_DEPTH) {
+        xfer = &control.stack[control.depth++];
+        memset(xfer, 0, sizeof(*xfer));
+        xfer->progress = progress;
+        xfer->label = progress->label;
+        xfer->total = progress->total;
+        xfer->start_ns = control_now();
+        xfer->window_ns = xfer->start_ns;
+    }
+    pthread_mutex_unlock(&control.lock);
+}
+
+void control_progress_update(struct progress *progress)
+{
+    struct control_transfer *xfer;
+    uint64_t now;
+
+    if (!control_active)
+        return;
+
+    pthread_mutex_lock(&control.lock);
+
+    if ((xfer = control_find(progress))) {
+        now = control_now();
+        xfer->base = progress->base;
+        xfer->has_base = progress->has_base;
+        xfer->done = progress->done;
+
+        if (now - xfer->window_ns >= CONTROL_RATE_NS) {
+            xfer->rate = (xfer->done - xfer->window_done) * 1e9 /
+                         (now - xfer->window_ns);
+            xfer->window_ns = now;
+            xfer->window_done = xfer->done;
+        }
+    }
+
+    /* Between chunks, so whatever the transfer holds is in a consistent state */
+    if (control.paused) {
+        logi("Paused\n");
+        while (control.paused)
+            pthread_cond_wait(&control.resumed, &control.lock);
+        logi("Resumed\n");
+
+        /* Time spent paused isn't the bridge's to answer for */
+        if (xfer) {
+            xfer->window_ns = control_now();
+            xfer->window_done = xfer->done;
+        }
+    }
+
+    pthread_mutex_unlock(&control.lock);
+}
+
+void control_progress_end(struct progress *progress)
+{
+    struct control_transfer *xfer;
+
+    if (!control_active)
+        return;
+
+    pthread_mutex_lock(&control.lock);
+    if ((xfer = control_find(progress))) {
+        xfer->done = progress->done;
+        xfer->base = progress->base;
+        xfer->has_base = progress->has_base;
+        xfer->end_ns = control_now();
+        xfer->progress = NULL;
+        control.history[control.completed++ % CONTROL_HISTORY] = *xfer;
+
+        /* Anything begun inside it without ending went with it */
+        control.depth = xfer - control.stack;
+    }
+    pthread_mutex_unlock(&control.lock);
+}
+
+struct control_reply {
+    char buf[CONTROL_REPLY_MAX];
+    size_t len;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+control_printf(struct control_reply *reply, const char *fmt, ...)
+{
+    va_list args;
+    int rc;
+
+    if (reply->len >= sizeof(reply->buf))
+        return;
+
+    va_start(args, fmt);
+    rc = vsnprintf(reply->buf + reply->len, sizeof(reply->buf) - reply->len,
+                   fmt, args);
+    va_end(args);
+
+    if (rc > 0)
+        reply->len += rc;
+}
+
+static void control_print_transfer(struct control_reply *reply,
+                                   const struct control_transfer *xfer,
+                                   uint64_t now)
+{
+    uint64_t elapsed = (xfer->end_ns ? xfer->end_ns : now) - xfer->start_ns;
+
+    control_printf(reply, "{\"op\":\"%s\"", xfer->label);
+    if (xfer->has_base)
+        control_printf(reply, ",\"start\":%" PRIu64 ",\"address\":%" PRIu64,
+                       xfer->base, xfer->base + xfer->done);
+    control_printf(reply, ",\"bytes\":%" PRIu64 ",\"total\":%" PRIu64, xfer->done,
+                   xfer->total);
+    if (!xfer->end_ns)
+        control_printf(reply, ",\"rate\":%.0f", xfer->rate);
+    control_printf(reply, ",\"avg\":%.0f,\"elapsed\":%.3f}",
+                   elapsed ? xfer->done * 1e9 / elapsed : 0, elapsed / 1e9);
+}
+
+/*
+ * The bridges' counters are read as the transfer updates them, so a report
+ * can be a few operations behind.
+ */
+static void control_print_bridge(struct control_reply *reply, struct ahb *ahb)
+{
+    uint64_t calls = 0, errors = 0, bytes = 0, remaps = 0;
+    unsigned int i;
+
+    if (ahb->stats) {
+        for (i = 0; i < ahb_op_max; i++) {
+            calls += ahb->stats->ops[i].calls;
+            errors += ahb->stats->ops[i].errors;
+            bytes += ahb->stats->ops[i].bytes;
+        }
+        remaps = ahb->stats->remaps;
+    }
+
+    control_printf(reply, "{\"name\":\"%s\",\"calls\":%" PRIu64
+                   ",\"errors\":%" PRIu64 ",\"bytes\":%" PRIu64
+                   ",\"remaps\":%" PRIu64, ahb->drv->name, calls, errors, bytes,
+                   remaps);
+
+    if (ahb->throttle)
+        control_printf(reply, ",\"limit\":%" PRIu64 ",\"ops_limit\":%" PRIu64
+                       ",\"throttled\":%.3f", ahb->throttle->bytes,
+                       ahb->throttle->ops, ahb->throttle->waited_ns / 1e9);
+
+    control_printf(reply, "}");
+}
+
+static void control_status(struct control_reply *reply)
+{
+    uint64_t now = control_now(), first;
+    size_t i;
+
+    control_printf(reply, "{\"state\":\"%s\",\"transfer\":",
+                   control.paused ? "paused" : "running");
+
+    if (control.depth)
+        control_print_transfer(reply, &control.stack[control.depth - 1], now);
+    else
+        control_printf(reply, "null");
+
+    first = control.completed > CONTROL_HISTORY ?
+            control.completed - CONTROL_HISTORY : 0;
+
+    control_printf(reply, ",\"completed\":%" PRIu64 ",\"extents\":[",
+                   control.completed);
+    for (i = 0; first + i < control.completed; i++) {
+        if (i)
+            control_printf(reply, ",");
+        control_print_transfer(reply,
+                               &control.history[(first + i) % CONTROL_HISTORY],
+                               now);
+    }
+
+    control_printf(reply, "],\"bridges\":[");
+    for (i = 0; i < control.nr_bridges; i++) {
+        if (i)
+            control_printf(reply, ",");
+        control_print_bridge(reply, control.bridges[i]);
+    }
+    control_printf(reply, "]}");
+}
+
+static void control_rate(struct control_reply *reply, const char *spec)
+{
+    char bridge[THROTTLE_NAME_MAX];
+    uint64_t bytes, ops;
+    unsigned int found = 0;
+    size_t i;
+
+    if (throttle_parse(spec, bridge, &bytes, &ops) < 0) {
+        control_printf(reply, "{\"error\":\"invalid rate\"}");
+        return;
+    }
+
+    for (i = 0; i < control.nr_bridges; i++) {
+        struct ahb *ahb = control.bridges[i];
+
+        if (!ahb->throttle || (bridge[0] && strcmp(bridge, ahb->drv->name)))
+            continue;
+
+        throttle_set(ahb->throttle, bytes, ops);
+        found++;
+    }
+
+    if (!found)
+        control_printf(reply, "{\"error\":\"no such bridge\"}");
+    else
+        control_printf(reply, "{\"ok\":true,\"bridges\":%u}", found);
+}
+
+static void control_command(struct control_reply *reply, char *line)
+{
+    pthread_mutex_lock(&control.lock);
+
+    if (!strcmp(line, "status")) {
+        control_status(reply);
+    } else if (!strcmp(line, "pause")) {
+        control.paused = true;
+        control_printf(reply, "{\"ok\":true}");
+    } else if (!strcmp(line, "resume")) {
+        control.paused = false;
+        pthread_cond_broadcast(&control.resumed);
+        control_printf(reply, "{\"ok\":true}");
+    } else if (!strncmp(line, "rate ", strlen("rate "))) {
+        control_rate(reply, line + strlen("rate "));
+    } else {
+        control_printf(reply, "{\"error\":\"unknown command\"}");
+    }
+
+    pthread_mutex_unlock(&control.lock);
+
+    control_printf(reply, "\n");
+}
+
+static void control_client(int fd)
+{
+    struct timeval timeout = { .tv_sec = 1 };
+    struct control_reply reply = { .len = 0 };
+    char line[CONTROL_LINE_MAX];
+    size_t len = 0;
+    ssize_t rc;
+    char *nl;
+
+    /* A client that connects and says nothing doesn't get to hold us up */
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    while (!(nl = memchr(line, '\n', len))) {
+        if (len == sizeof(line) - 1)
+            return;
+
+        if ((rc = recv(fd, line + len, sizeof(line) - 1 - len, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+
+        /* A last line without its newline is still a line */
+        if (!rc) {
+            if (!len)
+                return;
+            nl = line + len;
+            break;
+        }
+
+        len += rc;
+    }
+
+    *nl = '\0';
+    if (nl > line && nl[-1] == '\r')
+        nl[-1] = '\0';
+
+    control_command(&reply, line);
+
+    send(fd, reply.buf, reply.len, MSG_NOSIGNAL);
+}
+
+static void *control_serve(void *arg __unused)
+{
+    int fd;
+
+    while ((fd = accept4(control.fd, NULL, NULL, SOCK_CLOEXEC)) >= 0 ||
+           errno == EINTR || errno == ECONNABORTED) {
+        if (fd < 0)
+            continue;
+
+        control_client(fd);
+        close(fd);
+    }
+
+    return NULL;
+}
+
+int control_start(const char *path)
+{
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    int rc;
+
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -ENAMETOOLONG;
+
+    strcpy(addr.sun_path, path);
+
+    if ((control.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0)
+        return -errno;
+
+    if (bind(control.fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    if (listen(control.fd, 4) < 0) {
+        rc = -errno;
+        goto cleanup_path;
+    }
+
+    control.path = path;
+    control_active = true;
+
+    /* Limits can then be changed on bridges that were started without one */
+    throttle_enable_adjust();
+
+    if ((rc = -pthread_create(&control.thread, NULL, control_serve, NULL)) < 0) {
+        control_active = false;
+        goto cleanup_path;
+    }
+
+    return 0;
+
+cleanup_path:
+    unlink(path);
+
+cleanup_fd:
+    close(control.fd);
+    control.fd = -1;
+
+    return rc;
+}
+
+void control_stop(void)
+{
+    if (!control_active)
+        return;
+
+    /* Wakes the accept() */
+    shutdown(control.fd, SHUT_RDWR);
+    pthread_join(control.thread, NULL);
+
+    close(control.fd);
+    control.fd = -1;
+    unlink(control.path);
+
+    pthread_mutex_lock(&control.lock);
+    control.paused = false;
+    pthread_cond_broadcast(&control.resumed);
+    pthread_mutex_unlock(&control.lock);
+
+    control_active = false;
+}
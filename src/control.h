@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stdbool.h>
+
+struct ahb;
+struct progress;
+
+/*
+ * A Unix socket on which a running command answers for its transfers. A
+ * client sends one line and gets one line of JSON back:
+ *
+ *   status                     the transfer under way, those completed, and
+ *                              the bridges' counters and limits
+ *   pause, resume              hold the transfer at its next chunk, or not
+ *   rate [BRIDGE=]BYTES[,OPS]  change the throttle as for --rate
+ */
+int control_start(const char *path);
+void control_stop(void);
+bool control_enabled(void);
+
+/* The bridges the status reports on, from host setup and teardown */
+void control_add_bridge(struct ahb *ahb);
+void control_remove_bridge(struct ahb *ahb);
+
+/*
+ * From the progress hooks: a transfer's state is copied over as it's updated,
+ * which is also where a paused transfer waits
+ */
+void control_progress_begin(struct progress *progress);
+void control_progress_update(struct progress *progress);
+void control_progress_end(struct progress *progress);
+
+#endif
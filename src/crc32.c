@@ -0,0 +1,276 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "crc32.h"
+
+#include <pthread.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_CRC32
+#define HWCAP_CRC32 (1 << 7)
+#endif
+#endif
+
+#define CRC32_POLY  0xedb88320
+#define CRC32C_POLY 0x82f63b78
+
+/* Below this the folding kernel's setup costs more than it saves */
+#define CRC32_FOLD_MIN 64
+
+/* Each kernel works on the inverted CRC, what the instructions expect */
+typedef uint32_t (*crc32_kernel_fn)(uint32_t crc, const uint8_t *buf,
+                                    size_t len);
+
+/* Slicing-by-8, table [k][b] is byte b followed by k zero bytes */
+static uint32_t crc32_table[8][256];
+static uint32_t crc32c_table[8][256];
+static crc32_kernel_fn crc32_kernel;
+static crc32_kernel_fn crc32c_kernel;
+static pthread_once_t crc32_once = PTHREAD_ONCE_INIT;
+
+static void crc32_init_slices(uint32_t table[8][256], uint32_t poly)
+{
+    uint32_t val;
+    int i, j;
+
+    for (i = 0; i < 256; i++) {
+        val = i;
+        for (j = 0; j < 8; j++)
+            val = (val >> 1) ^ ((val & 1) ? poly : 0);
+        table[0][i] = val;
+    }
+
+    for (i = 0; i < 256; i++) {
+        for (j = 1; j < 8; j++)
+            table[j][i] = table[0][table[j - 1][i] & 0xff] ^
+                          (table[j - 1][i] >> 8);
+    }
+}
+
+static inline uint32_t crc32_slices(const uint32_t table[8][256], uint32_t crc,
+                                    const uint8_t *buf, size_t len)
+{
+    uint32_t lo, hi;
+
+    while (len >= 8) {
+        lo = (buf[0] | (buf[1] << 8) | (buf[2] << 16) |
+              ((uint32_t)buf[3] << 24)) ^ crc;
+        hi = buf[4] | (buf[5] << 8) | (buf[6] << 16) |
+             ((uint32_t)buf[7] << 24);
+
+        crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^
+              table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+              table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^
+              table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = table[0][(crc ^ *buf++) & 0xff] ^ (crc >> 8);
+
+    return crc;
+}
+
+static uint32_t crc32_table_kernel(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    return crc32_slices(crc32_table, crc, buf, len);
+}
+
+static uint32_t crc32c_table_kernel(uint32_t crc, const uint8_t *buf,
+                                    size_t len)
+{
+    return crc32_slices(crc32c_table, crc, buf, len);
+}
+
+#if defined(__x86_64__)
+/*
+ * Folds 64 bytes at a time by carry-less multiplication, as in Intel's "Fast
+ * CRC Computation for Generic Polynomials Using PCLMULQDQ", reduced to 32 bits
+ * with Barrett. The constants are for the bit-reflected IEEE polynomial.
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_fold(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    const __m128i k1k2 = _mm_set_epi64x(0x1c6e41596, 0x154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x0ccaa009e, 0x1751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x1f7011641, 0x1db710641);
+    const __m128i mask32 = _mm_set_epi32(0, 0, 0, -1);
+    __m128i x0, x1, x2, x3, t0, t1, t2, t3;
+    size_t tail = len & 15;
+
+    len -= tail;
+
+    x0 = _mm_xor_si128(_mm_loadu_si128((const __m128i *)buf),
+                       _mm_cvtsi32_si128(crc));
+    x1 = _mm_loadu_si128((const __m128i *)(buf + 16));
+    x2 = _mm_loadu_si128((const __m128i *)(buf + 32));
+    x3 = _mm_loadu_si128((const __m128i *)(buf + 48));
+    buf += 64;
+    len -= 64;
+
+    while (len >= 64) {
+        t0 = _mm_clmulepi64_si128(x0, k1k2, 0x11);
+        t1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        t2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        t3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x0 = _mm_xor_si128(_mm_clmulepi64_si128(x0, k1k2, 0x00), t0);
+        x1 = _mm_xor_si128(_mm_clmulepi64_si128(x1, k1k2, 0x00), t1);
+        x2 = _mm_xor_si128(_mm_clmulepi64_si128(x2, k1k2, 0x00), t2);
+        x3 = _mm_xor_si128(_mm_clmulepi64_si128(x3, k1k2, 0x00), t3);
+        x0 = _mm_xor_si128(x0, _mm_loadu_si128((const __m128i *)buf));
+        x1 = _mm_xor_si128(x1, _mm_loadu_si128((const __m128i *)(buf + 16)));
+        x2 = _mm_xor_si128(x2, _mm_loadu_si128((const __m128i *)(buf + 32)));
+        x3 = _mm_xor_si128(x3, _mm_loadu_si128((const __m128i *)(buf + 48)));
+        buf += 64;
+        len -= 64;
+    }
+
+    /* Down to one register, then take in what's left 16 bytes at a time */
+#define CRC32_FOLD_INTO(x, next) \
+    _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k3k4, 0x00), \
+                                _mm_clmulepi64_si128(x, k3k4, 0x11)), next)
+    x0 = CRC32_FOLD_INTO(x0, x1);
+    x0 = CRC32_FOLD_INTO(x0, x2);
+    x0 = CRC32_FOLD_INTO(x0, x3);
+    while (len) {
+        x0 = CRC32_FOLD_INTO(x0, _mm_loadu_si128((const __m128i *)buf));
+        buf += 16;
+        len -= 16;
+    }
+#undef CRC32_FOLD_INTO
+
+    /* 128 to 64 bits, then 64 to 32 bits */
+    t0 = _mm_clmulepi64_si128(k3k4, x0, 0x01);
+    x0 = _mm_xor_si128(_mm_srli_si128(x0, 8), t0);
+    t0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), k5, 0x00);
+    x0 = _mm_xor_si128(_mm_srli_si128(x0, 4), t0);
+
+    /* Barrett reduction */
+    t0 = _mm_clmulepi64_si128(_mm_and_si128(x0, mask32), poly, 0x10);
+    t0 = _mm_clmulepi64_si128(_mm_and_si128(t0, mask32), poly, 0x00);
+    crc = _mm_extract_epi32(_mm_xor_si128(x0, t0), 1);
+
+    return crc32_slices(crc32_table, crc, buf, tail);
+}
+
+static uint32_t crc32_fold_kernel(uint32_t crc, const uint8_t *buf, size_t len)
+{
+    if (len < CRC32_FOLD_MIN)
+        return crc32_slices(crc32_table, crc, buf, len);
+
+    return crc32_fold(crc, buf, len);
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42_kernel(uint32_t crc, const uint8_t *buf,
+                                    size_t len)
+{
+    uint64_t crc64 = crc, word;
+
+    while (len >= 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    crc = crc64;
+    while (len--)
+        crc = _mm_crc32_u8(crc, *buf++);
+
+    return crc;
+}
+
+static void crc32_init_kernels(void)
+{
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+        crc32_kernel = crc32_fold_kernel;
+
+    if (__builtin_cpu_supports("sse4.2"))
+        crc32c_kernel = crc32c_sse42_kernel;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static uint32_t crc32_armv8_kernel(uint32_t crc, const uint8_t *buf,
+                                   size_t len)
+{
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32d(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = __crc32b(crc, *buf++);
+
+    return crc;
+}
+
+__attribute__((target("+crc")))
+static uint32_t crc32c_armv8_kernel(uint32_t crc, const uint8_t *buf,
+                                    size_t len)
+{
+    uint64_t word;
+
+    while (len >= 8) {
+        memcpy(&word, buf, sizeof(word));
+        crc = __crc32cd(crc, word);
+        buf += 8;
+        len -= 8;
+    }
+
+    while (len--)
+        crc = __crc32cb(crc, *buf++);
+
+    return crc;
+}
+
+static void crc32_init_kernels(void)
+{
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) {
+        crc32_kernel = crc32_armv8_kernel;
+        crc32c_kernel = crc32c_armv8_kernel;
+    }
+}
+#else
+static void crc32_init_kernels(void)
+{
+}
+#endif
+
+static void crc32_init(void)
+{
+    crc32_init_slices(crc32_table, CRC32_POLY);
+    crc32_init_slices(crc32c_table, CRC32C_POLY);
+
+    crc32_kernel = crc32_table_kernel;
+    crc32c_kernel = crc32c_table_kernel;
+
+    crc32_init_kernels();
+}
+
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32_once, crc32_init);
+
+    return ~crc32_kernel(~crc, buf, len);
+}
+
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len)
+{
+    pthread_once(&crc32_once, crc32_init);
+
+    return ~crc32c_kernel(~crc, buf, len);
+}
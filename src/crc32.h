@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _CRC32_H
+#define _CRC32_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The IEEE 802.3 CRC as used by zlib, start with @crc of 0. Both CRCs use the
+ * CPU's CRC or carry-less multiply instructions where it has them.
+ */
+uint32_t crc32_update(uint32_t crc, const void *buf, size_t len);
+
+/* The Castagnoli CRC as used by iSCSI and ext4, start with @crc of 0 */
+uint32_t crc32c_update(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -6,19 +6,55 @@
 #define _GNU_SOURCE
 
 #include <errno.h>
+#include <fcntl.h>
 #include <getopt.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "config.h"
 #include "compiler.h"
 #include "log.h"
 #include "version.h"
 #include "ahb.h"
+#include "arb.h"
+#include "bridge/debug.h"
+#include "bridge/p2a.h"
+#include "bufpool.h"
+#include "cache.h"
+#include "control.h"
+#include "flash.h"
 #include "host.h"
+#include "layout.h"
+#include "lpc.h"
+#include "mirror.h"
+#include "pci.h"
+#include "progress.h"
+#include "record.h"
+#include "rt.h"
+#include "soc.h"
+#include "soc/sfc.h"
+#include "span.h"
+#include "throttle.h"
+#include "timing.h"
+#include "ts16.h"
 
+#define BATCH_MAX_ARGS 32
+
+#define FLEET_JOBS 16
+#define FLEET_MAX_JOBS 1024
+
+int cmd_apply(const char *name, int argc, char *argv[]);
+int cmd_bench(const char *name, int argc, char *argv[]);
 int cmd_ilpc(const char *name, int argc, char *argv[]);
 int cmd_p2a(const char *name, int argc, char *argv[]);
 int cmd_debug(const char *name, int argc, char *argv[]);
@@ -27,13 +63,23 @@ int cmd_console(const char *name, int argc, char *argv[]);
 int cmd_read(const char *name, int argc, char *argv[]);
 int cmd_write(const char *name, int argc, char *argv[]);
 int cmd_replace(const char *name, int argc, char *argv[]);
+int cmd_search(const char *name, int argc, char *argv[]);
+int cmd_hash(const char *name, int argc, char *argv[]);
 int cmd_probe(const char *name, int argc, char *argv[]);
 int cmd_reset(const char *name, int argc, char *argv[]);
 int cmd_jtag(const char *name, int argc, char *argv[]);
+int cmd_lpcfw(const char *name, int argc, char *argv[]);
+int cmd_mount(const char *name, int argc, char *argv[]);
+int cmd_nbd(const char *name, int argc, char *argv[]);
 int cmd_sfc(const char *name, int argc, char *argv[]);
 int cmd_otp(const char *name, int argc, char *argv[]);
 int cmd_trace(const char *name, int argc, char *argv[]);
 int cmd_coprocessor(const char *name, int argc, char *argv[]);
+int cmd_serve(const char *name, int argc, char *argv[]);
+int cmd_snapshot(const char *name, int argc, char *argv[]);
+int cmd_stats(const char *name, int argc, char *argv[]);
+int cmd_status(const char *name, int argc, char *argv[]);
+int cmd_watch(const char *name, int argc, char *argv[]);
 
 static void print_version(const char *name)
 {
@@ -45,6 +91,33 @@ static void print_help(const char *name)
     print_version(name);
     printf("Usage:\n");
     printf("\n");
+    printf("Options:\n");
+    printf("  --cache[=FILE]   Remember working bridge and SoC settings between runs\n");
+    printf("  --control=SOCKET Answer 'status' queries and take pause, resume and rate commands on SOCKET\n");
+    printf("  --debug-baud=N   Debug UART rate to escalate to, 115200 (default) or 1500000\n");
+    printf("  --debug-cache    Read SCU and SDMC registers over the debug UART a line at a time\n");
+    printf("  --debug-credits=N Bytes of debug UART commands to send ahead of responses\n");
+    printf("  --debug-upload=N Bytes per debug UART upload command (default 128)\n");
+    printf("  --failover       Move to the next best bridge if one fails mid-transfer\n");
+    printf("  --flash-layout=L mtdparts-style partitions, or 'openbmc'/'openbmc-64', for partition names\n");
+    printf("  --hugepages      Back large transfer buffers with reserved huge pages\n");
+    printf("  --io-settle=MODE Pace x86 port I/O with 'port80' (default), 'delay' or 'none'\n");
+    printf("  --lock-dir=DIR   Arbitrate bridges with other culvert processes through DIR (default /run/lock), or 'none'\n");
+    printf("  --lpc-fw=A,LEN   Host physical range A decoding to LPC firmware cycles, for L2A on x86\n");
+    printf("  --progress=MODE  Report transfer progress as 'human' (default), 'json' or 'none'\n");
+    printf("  --realtime=SPEC  Run polling loops under fifo[:PRIO] or rr[:PRIO], pinned with cpu=N, with slack=NS of timer slack\n");
+    printf("  --record=FILE[,data] Log bridge operations to FILE in binary, with bulk data\n");
+    printf("  --sfc-dma=A,LEN  Free BMC DRAM range A to copy bulk flash reads through by DMA\n");
+    printf("  --sfc-fast       Calibrate fast and dual I/O flash reads, reconfiguring the chip\n");
+    printf("  --span-trace=FILE Write a Chrome trace of bridge, flash and pipeline activity to FILE\n");
+    printf("  --stats          Print bridge operation counters and latencies on exit\n");
+    printf("  --stripe         Split bulk transfers across bridges on independent buses\n");
+    printf("  --throttle=[BRIDGE=]BYTES[,OPS] Limit bulk transfers to BYTES/s and register accesses to OPS/s\n");
+    printf("  --timings[=MODE] Print how long each phase of the command took, as 'table' (default) or 'json'\n");
+    printf("  --ts16-sockbuf=N Socket buffer size for Digi Portserver TS connections\n");
+    printf("  --vfio           Claim PCI devices through vfio-pci, for IOMMU-mapped DMA buffers\n");
+    printf("  --write-combine  Map the P2A data window write-combining for bulk writes\n");
+    printf("\n");
     printf("%s probe [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s ilpc read ADDRESS\n", name);
     printf("%s ilpc write ADDRESS VALUE\n", name);
@@ -54,23 +127,76 @@ static void print_help(const char *name)
     printf("%s debug write ADDRESS VALUE INTERFACE [IP PORT USERNAME PASSWORD]\n", name);
     printf("%s devmem read ADDRESS\n", name);
     printf("%s devmem write ADDRESS VALUE\n", name);
-    printf("%s console HOST_UART BMC_UART BAUD USER PASSWORD\n", name);
-    printf("%s read firmware [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s read ram ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s write firmware [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s write ram ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s console [--capture FILE [--capture-size BYTES]] HOST_UART BMC_UART BAUD USER PASSWORD\n", name);
+    printf("%s console replay [--speed FACTOR] [--timestamps] FILE\n", name);
+    printf("%s console mux [--baud RATE] --port UART[=FILE]... [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read [--sparse] [--checkpoint FILE] [--compress[=LEVEL]] [--direct] [--digest[=ALGO[,BLOCK]] [--digest-file FILE]] [--sink SPEC]... [--flash NAME[:CS]] [--partition NAME] firmware [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read --container [--compress[=LEVEL]] [--hash-scratch ADDRESS] [--flash NAME[:CS]] [--partition NAME] firmware [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read [--sparse] [--checkpoint FILE] [--compress[=LEVEL]] [--direct] [--digest[=ALGO[,BLOCK]] [--digest-file FILE]] [--sink SPEC]... [--elf] [--priority[=SPEC]] [--system-map FILE] ram ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read [--system-map FILE] [--page-offset ADDRESS] klog [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read [--system-map FILE] [--page-offset ADDRESS] [--task-layout TASKS,PID,MM,PGD] vmem PID|kernel ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read --manifest FILE --hash-scratch ADDRESS [--elf] ram ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s read --container [--compress[=LEVEL]] ram ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s write firmware [--plan] [--chip-erase] [[--flash NAME[:CS]] [--file IMAGE] [--partition NAME]]... [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s write [--delta [--hash-scratch ADDRESS]] ram ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s replace ram MATCH REPLACE\n", name);
+    printf("%s apply [--dry-run] PROFILE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s hash --scratch ADDRESS ram [ADDRESS LENGTH] [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s hash --scratch ADDRESS [--flash NAME[:CS]] [--partition NAME] firmware [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s search [--string TEXT]... [--hex BYTES]... [--regex RE]... [--max-matches N] ram [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s reset TYPE WDT [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s jtag [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s sfc fmc read ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s sfc fmc erase ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s sfc fmc write ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s jtag [--vpi] [--port PORT | --socket PATH] [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s jtag [--bitbang] [--target TARGET] play FILE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s jtag [--bitbang] [--target TARGET] [--count N] [--interval US] sample IR-BITS:IR DR-BITS FILE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s lpcfw load [--file IMAGE] [--lpc-offset OFFSET] ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s lpcfw status|unmap [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s mount [--cache BYTES] [--read-ahead BYTES] [--flash NAME[:CS]] MOUNTPOINT [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s nbd [--listen [HOST:]PORT] [--cache BYTES] [--read-only] NAME[:CS] [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s sfc NAME[:CS] read ADDRESS|PARTITION LENGTH|- [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s sfc NAME[:CS] erase ADDRESS|PARTITION LENGTH|- [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s sfc NAME[:CS] write ADDRESS|PARTITION LENGTH|- [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s otp read conf [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s otp read strap [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s otp write strap BIT VALUE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
     printf("%s otp write conf WORD BIT [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s trace ADDRESS WIDTH MODE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
-    printf("%s coprocessor run ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s otp dump FILE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s otp program image|diff FILE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s trace [--stream] [--buffer LEN[@ADDR]] ADDRESS WIDTH MODE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s trace decode [--format csv|binary|none] [--histogram] [--runs] [--merge WORD] WIDTH [FILE]\n", name);
+    printf("%s coprocessor run [--file IMAGE [--delta] [--verify] [--hash-scratch ADDRESS]] ADDRESS LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s snapshot FILE [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s snapshot diff BASE FILE|--live [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s watch [--rate HZ] [--samples N] [--output FILE [--ring-size BYTES]] ADDRESS[,ADDRESS...] [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s stats [--rate HZ] [--samples N] soc [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s bench [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s bench kernels\n", name);
+    printf("%s bench flash CONTROLLER OFFSET LENGTH [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s serve SOCKET [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s serve --listen [HOST:]PORT [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s serve --stub TTY [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s batch [--mirror] FILE|- [INTERFACE [IP PORT USERNAME PASSWORD]]\n", name);
+    printf("%s status SOCKET [status|pause|resume|rate [BRIDGE=]BYTES[,OPS]]\n", name);
+    printf("%s fleet [--jobs N] [--timeout SECONDS] TARGETS COMMAND [ARGS...]\n", name);
+    printf("\n");
+    printf("INTERFACE may be 'snapshot [model=MODEL] FILE...' to run offline against 'read --elf'\n");
+    printf("cores, 'read --container' dumps, register snapshots, --record recordings and 'ADDRESS\n");
+    printf("VALUE' register lists.\n");
+    printf("MODEL is a bridge name or OP_NS,BYTE_PS[,WINDOW[,REMAP_NS]] to emulate its costs,\n");
+    printf("and 'rev=REV' in place of a FILE stands in a synthetic SoC of that silicon revision\n");
+    printf("\n");
+    printf("INTERFACE may be 'xdma QUEUE [BUFFER]' to read DRAM by X-DMA into u-dma-buf device\n");
+    printf("BUFFER (default udmabuf0, or 'vfio' with --vfio), with registers over P2A and the engine's command queue\n");
+    printf("in the free, page-aligned BMC DRAM at QUEUE\n");
+    printf("\n");
+    printf("INTERFACE may be 'p2a [BDF]' or 'ilpc [BASE]' to pick one of several BMCs by the PCI\n");
+    printf("address of its VGA device or the I/O port its SuperIO decodes, 0x2e or 0x4e\n");
+    printf("\n");
+    printf("INTERFACE may be 'vuart [PORT]' to reach the BMC through the VUART at host I/O PORT\n");
+    printf("(default 0x3f8), with 'serve --stub' running on the BMC end of it\n");
+    printf("\n");
+    printf("INTERFACE may be 'remote [HOST:]PORT' to use the bridge of 'serve --listen' elsewhere.\n");
+    printf("The protocol is unauthenticated and serves the loopback interface unless given a\n");
+    printf("HOST, so reach it through an SSH tunnel\n");
 }
 
 struct command {
@@ -78,6 +204,9 @@ struct command {
     int (*fn)(const char *, int, char *[]);
 };
 
+static int cmd_batch(const char *name, int argc, char *argv[]);
+static int cmd_fleet(const char *name, int argc, char *argv[]);
+
 static const struct command cmds[] = {
     { "ilpc", cmd_ilpc },
     { "p2a", cmd_p2a },
@@ -85,59 +214,1084 @@ static const struct command cmds[] = {
     { "read", cmd_read },
     { "write", cmd_write },
     { "replace", cmd_replace },
+    { "apply", cmd_apply },
+    { "search", cmd_search },
+    { "hash", cmd_hash },
     { "probe", cmd_probe },
     { "debug", cmd_debug },
     { "reset", cmd_reset },
     { "jtag", cmd_jtag },
+    { "lpcfw", cmd_lpcfw },
+    { "mount", cmd_mount },
+    { "nbd", cmd_nbd },
     { "devmem", cmd_devmem },
     { "sfc", cmd_sfc },
     { "otp", cmd_otp },
     { "trace", cmd_trace },
     { "coprocessor", cmd_coprocessor},
+    { "snapshot", cmd_snapshot },
+    { "watch", cmd_watch },
+    { "stats", cmd_stats },
+    { "bench", cmd_bench },
+    { "serve", cmd_serve },
+    { "batch", cmd_batch },
+    { "fleet", cmd_fleet },
+    { "status", cmd_status },
     { },
 };
 
+/* Commands that can share a host session in a batch */
+static const char *batch_cmds[] = {
+    "read", "write", "sfc", "trace", "otp", "reset", "snapshot", "apply", NULL,
+};
+
+static bool batch_allowed(const char *name)
+{
+    const char **allowed;
+
+    for (allowed = &batch_cmds[0]; *allowed; allowed++) {
+        if (!strcmp(*allowed, name))
+            return true;
+    }
+
+    return false;
+}
+
+static const struct command *find_command(const char *name)
+{
+    const struct command *cmd;
+
+    for (cmd = &cmds[0]; cmd->fn; cmd++) {
+        if (!strcmp(cmd->name, name))
+            return cmd;
+    }
+
+    return NULL;
+}
+
+/* @argv starts with the command name */
+static int run_command(const struct command *cmd, int argc, char *argv[])
+{
+    int offset = 0;
+
+    /* probe uses getopt, but for subcommands not using getopt */
+    if (!(!strcmp("probe", cmd->name) || !strcmp("write", cmd->name) ||
+          !strcmp("read", cmd->name) || !strcmp("trace", cmd->name) ||
+          !strcmp("console", cmd->name) || !strcmp("watch", cmd->name) ||
+          !strcmp("search", cmd->name) || !strcmp("fleet", cmd->name) ||
+          !strcmp("hash", cmd->name) || !strcmp("serve", cmd->name) ||
+          !strcmp("lpcfw", cmd->name) || !strcmp("apply", cmd->name) ||
+          !strcmp("mount", cmd->name) || !strcmp("nbd", cmd->name) ||
+          !strcmp("stats", cmd->name))) {
+        offset += 1;
+    }
+
+    /* Zero rather than one also resets getopt's state between batch commands */
+    optind = 0;
+
+    return cmd->fn(program_invocation_short_name, argc - offset, argv + offset);
+}
+
+static int batch_redirect(int fd, const char *path, int flags)
+{
+    int saved, target;
+
+    if ((target = open(path, flags | O_CLOEXEC, 0666)) < 0)
+        return -errno;
+
+    if ((saved = dup(fd)) < 0 || dup2(target, fd) < 0) {
+        int rc = -errno;
+
+        if (saved >= 0)
+            close(saved);
+        close(target);
+
+        return rc;
+    }
+
+    close(target);
+
+    return saved;
+}
+
+static void batch_restore(int fd, int saved)
+{
+    dup2(saved, fd);
+    close(saved);
+}
+
+static int batch_run(const struct command *cmd, int argc, char *argv[],
+                     const char *in, const char *out)
+{
+    int saved_in = -1, saved_out = -1;
+    int rc;
+
+    if (in && (saved_in = batch_redirect(0, in, O_RDONLY)) < 0) {
+        loge("Failed to open %s: %d\n", in, saved_in);
+        return saved_in;
+    }
+
+    if (out && (saved_out = batch_redirect(1, out, O_WRONLY | O_CREAT | O_TRUNC)) < 0) {
+        loge("Failed to open %s: %d\n", out, saved_out);
+        rc = saved_out;
+        goto restore_in;
+    }
+
+    rc = run_command(cmd, argc, argv);
+
+    if (saved_out >= 0) {
+        fflush(stdout);
+        batch_restore(1, saved_out);
+    }
+
+restore_in:
+    if (saved_in >= 0)
+        batch_restore(0, saved_in);
+
+    return rc;
+}
+
+/*
+ * Each line of the script is a command and its arguments, without the bridge
+ * arguments which are given once to the batch command. '<FILE' and '>FILE'
+ * redirect the command's stdin and stdout, '#' starts a comment. The batch
+ * stops at the first failing command.
+ *
+ * With --mirror, RAM written by one command is remembered so a later write of
+ * much the same image sends only what changed. That trusts the BMC not to
+ * write the memory itself in between, so it's only for a halted BMC, and the
+ * mirror is dropped whenever a command resets the SoC or lets a CPU run.
+ */
+static int cmd_batch(const char *name __unused, int argc, char *argv[])
+{
+    const struct command *cmd;
+    unsigned int lineno = 0;
+    bool mirror = false;
+    char *line = NULL;
+    size_t size = 0;
+    FILE *script;
+    int rc;
+
+    if (argc > 0 && !strcmp("--mirror", argv[0])) {
+        mirror = true;
+        argc--;
+        argv++;
+    }
+
+    if (argc < 1) {
+        loge("Not enough arguments for batch command\n");
+        exit(EXIT_FAILURE);
+    }
+
+    script = strcmp("-", argv[0]) ? fopen(argv[0], "r") : stdin;
+    if (!script) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", argv[0], rc);
+        return rc;
+    }
+
+    if ((rc = host_session_begin(argc - 1, argv + 1)) < 0) {
+        loge("Failed to initialise host interfaces: %d\n", rc);
+        goto cleanup_script;
+    }
+
+    soc_enable_retention();
+    flash_enable_retention();
+    if (mirror)
+        mirror_enable();
+
+    while (getline(&line, &size, script) >= 0) {
+        char *args[BATCH_MAX_ARGS + 1];
+        const char *in = NULL, *out = NULL;
+        const char **redirect = NULL;
+        char *tok, *save;
+        int nargs = 0;
+
+        lineno++;
+
+        for (tok = strtok_r(line, " \t\n", &save); tok;
+             tok = strtok_r(NULL, " \t\n", &save)) {
+            if (*tok == '#')
+                break;
+
+            if (redirect) {
+                *redirect = tok;
+                redirect = NULL;
+                continue;
+            }
+
+            if (*tok == '<' || *tok == '>') {
+                redirect = (*tok == '<') ? &in : &out;
+                if (tok[1]) {
+                    *redirect = tok + 1;
+                    redirect = NULL;
+                }
+                continue;
+            }
+
+            if (nargs == BATCH_MAX_ARGS) {
+                loge("%s:%u: Too many arguments\n", argv[0], lineno);
+                rc = -E2BIG;
+                goto cleanup_session;
+            }
+
+            args[nargs++] = tok;
+        }
+
+        if (redirect) {
+            loge("%s:%u: Missing redirection target\n", argv[0], lineno);
+            rc = -EINVAL;
+            goto cleanup_session;
+        }
+
+        if (!nargs)
+            continue;
+
+        args[nargs] = NULL;
+
+        if (!batch_allowed(args[0]) || !(cmd = find_command(args[0]))) {
+            loge("%s:%u: '%s' can't be run in a batch\n", argv[0], lineno,
+                 args[0]);
+            rc = -EINVAL;
+            goto cleanup_session;
+        }
+
+        logd("%s:%u: Running %s\n", argv[0], lineno, args[0]);
+
+        if ((rc = batch_run(cmd, nargs, args, in, out))) {
+            loge("%s:%u: %s failed: %d\n", argv[0], lineno, args[0], rc);
+            goto cleanup_session;
+        }
+    }
+
+    if (ferror(script)) {
+        rc = -EIO;
+        loge("Failed to read %s\n", argv[0]);
+    }
+
+cleanup_session:
+    mirror_destroy();
+    host_session_end();
+
+cleanup_script:
+    free(line);
+    if (script != stdin)
+        fclose(script);
+
+    return rc;
+}
+
+struct fleet_target {
+    char *line;
+    char *name;
+    char *args[BATCH_MAX_ARGS + 1];
+    int nargs;
+    pid_t pid;
+    int fd;
+    /* Output not yet forwarded for want of a newline */
+    char pending[256];
+    size_t nr_pending;
+    uint64_t output;
+    uint64_t start;
+    uint64_t end;
+    int status;
+    int rc;
+    bool timed_out;
+};
+
+static uint64_t fleet_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void fleet_free(struct fleet_target *targets, size_t nr_targets)
+{
+    size_t i;
+
+    for (i = 0; i < nr_targets; i++)
+        free(targets[i].line);
+    free(targets);
+}
+
+/* Each line is a NAME for the report followed by the target's INTERFACE */
+static int fleet_load(const char *path, struct fleet_target **targets,
+                      size_t *nr_targets)
+{
+    struct fleet_target *target, *grown;
+    unsigned int lineno = 0;
+    char *line = NULL;
+    size_t size = 0;
+    FILE *file;
+    int rc = 0;
+
+    *targets = NULL;
+    *nr_targets = 0;
+
+    if (!(file = fopen(path, "r"))) {
+        rc = -errno;
+        loge("Failed to open %s: %d\n", path, rc);
+        return rc;
+    }
+
+    while (getline(&line, &size, file) >= 0) {
+        char *tok, *save;
+
+        lineno++;
+
+        if (!(grown = realloc(*targets, (*nr_targets + 1) * sizeof(*grown)))) {
+            rc = -ENOMEM;
+            goto cleanup_targets;
+        }
+        *targets = grown;
+
+        target = &grown[*nr_targets];
+        memset(target, 0, sizeof(*target));
+        target->fd = -1;
+
+        for (tok = strtok_r(line, " \t\n", &save); tok;
+             tok = strtok_r(NULL, " \t\n", &save)) {
+            if (*tok == '#')
+                break;
+
+            if (!target->name) {
+                target->name = tok;
+                continue;
+            }
+
+            if (target->nargs == BATCH_MAX_ARGS) {
+                loge("%s:%u: Too many arguments\n", path, lineno);
+                rc = -E2BIG;
+                goto cleanup_targets;
+            }
+
+            target->args[target->nargs++] = tok;
+        }
+
+        if (!target->name)
+            continue;
+
+        /* The target keeps the line its tokens point into */
+        target->line = line;
+        line = NULL;
+        size = 0;
+        (*nr_targets)++;
+    }
+
+    if (ferror(file)) {
+        rc = -EIO;
+        loge("Failed to read %s\n", path);
+        goto cleanup_targets;
+    }
+
+    if (!*nr_targets) {
+        loge("No targets in %s\n", path);
+        rc = -EINVAL;
+        goto cleanup_targets;
+    }
+
+    free(line);
+    fclose(file);
+
+    return 0;
+
+cleanup_targets:
+    fleet_free(*targets, *nr_targets);
+    *targets = NULL;
+    *nr_targets = 0;
+    free(line);
+    fclose(file);
+
+    return rc;
+}
+
+static void fleet_forward(struct fleet_target *target, const char *buf,
+                          size_t len)
+{
+    size_t i;
+
+    target->output += len;
+
+    for (i = 0; i < len; i++) {
+        bool full = target->nr_pending == sizeof(target->pending) - 1;
+
+        if (buf[i] != '\n' && !full) {
+            target->pending[target->nr_pending++] = buf[i];
+            continue;
+        }
+
+        printf("%s: %.*s\n", target->name, (int)target->nr_pending,
+               target->pending);
+        target->nr_pending = 0;
+
+        /* A line too long for the buffer continues on the next */
+        if (buf[i] != '\n')
+            target->pending[target->nr_pending++] = buf[i];
+    }
+}
+
+/* Runs in the forked child, with the target's arguments after the command's */
+static void fleet_child(const struct command *cmd, int argc, char *argv[],
+                        struct fleet_target *target, int out)
+{
+    char *args[2 * BATCH_MAX_ARGS + 1];
+    int devnull;
+    int nargs;
+    int rc;
+
+    if ((devnull = open("/dev/null", O_RDONLY)) >= 0) {
+        dup2(devnull, 0);
+        close(devnull);
+    }
+
+    dup2(out, 1);
+    dup2(out, 2);
+    close(out);
+
+    /* Keep the command's output and its log messages in order */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    progress_set_mode(progress_none);
+
+    memcpy(args, argv, argc * sizeof(*args));
+    memcpy(&args[argc], target->args, target->nargs * sizeof(*args));
+    nargs = argc + target->nargs;
+    args[nargs] = NULL;
+
+    rc = run_command(cmd, nargs, args);
+
+    exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void fleet_start(const struct command *cmd, int argc, char *argv[],
+                        struct fleet_target *targets, size_t nr_targets,
+                        struct fleet_target *target)
+{
+    int fds[2];
+    size_t i;
+
+    target->start = fleet_now();
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        target->rc = -errno;
+        goto failed;
+    }
+
+    /* Stdio buffers are duplicated by fork() */
+    fflush(stdout);
+    fflush(stderr);
+
+    if ((target->pid = fork()) < 0) {
+        target->rc = -errno;
+        close(fds[0]);
+        close(fds[1]);
+        goto failed;
+    }
+
+    if (!target->pid) {
+        close(fds[0]);
+        for (i = 0; i < nr_targets; i++) {
+            if (targets[i].fd >= 0)
+                close(targets[i].fd);
+        }
+        fleet_child(cmd, argc, argv, target, fds[1]);
+    }
+
+    close(fds[1]);
+    target->fd = fds[0];
+
+    logd("%s: Started %s as %d\n", target->name, cmd->name, target->pid);
+
+    return;
+
+failed:
+    target->end = target->start;
+    loge("%s: Failed to start %s: %d\n", target->name, cmd->name, target->rc);
+}
+
+static void fleet_reap(struct fleet_target *target)
+{
+    int status;
+
+    if (target->nr_pending)
+        fleet_forward(target, "\n", 1);
+
+    close(target->fd);
+    target->fd = -1;
+
+    while (waitpid(target->pid, &status, 0) < 0) {
+        if (errno != EINTR) {
+            target->rc = -errno;
+            status = 0;
+            break;
+        }
+    }
+
+    target->end = fleet_now();
+    target->status = status;
+
+    if (target->rc)
+        return;
+
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS)
+        target->rc = 0;
+    else if (target->timed_out)
+        target->rc = -ETIMEDOUT;
+    else
+        target->rc = -EREMOTEIO;
+}
+
+static bool fleet_succeeded(const struct fleet_target *target)
+{
+    return target->end && !target->rc;
+}
+
+static void fleet_report(const char *cmd, struct fleet_target *targets,
+                         size_t nr_targets, unsigned int jobs, uint64_t wall)
+{
+    uint64_t busy = 0, output = 0, slowest = 0;
+    size_t i, ok = 0, timed_out = 0;
+
+    printf("\n%-24s %-10s %10s %10s\n", "TARGET", "STATUS", "SECONDS",
+           "OUTPUT");
+
+    for (i = 0; i < nr_targets; i++) {
+        struct fleet_target *target = &targets[i];
+        uint64_t elapsed = target->end - target->start;
+        char status[16];
+
+        if (fleet_succeeded(target))
+            snprintf(status, sizeof(status), "ok");
+        else if (target->timed_out)
+            snprintf(status, sizeof(status), "timeout");
+        else if (target->pid > 0 && WIFSIGNALED(target->status))
+            snprintf(status, sizeof(status), "signal %d",
+                     WTERMSIG(target->status));
+        else if (target->pid > 0 && WIFEXITED(target->status))
+            snprintf(status, sizeof(status), "exit %d",
+                     WEXITSTATUS(target->status));
+        else
+            snprintf(status, sizeof(status), "error %d", target->rc);
+
+        printf("%-24s %-10s %10.3f %10" PRIu64 "\n", target->name, status,
+               elapsed / 1e9, target->output);
+
+        ok += fleet_succeeded(target);
+        timed_out += target->timed_out;
+        busy += elapsed;
+        output += target->output;
+        if (elapsed > slowest)
+            slowest = elapsed;
+    }
+
+    printf("\n%s: %zu of %zu targets succeeded, %zu timed out\n", cmd, ok,
+           nr_targets, timed_out);
+    printf("%.3fs elapsed over %u jobs, %.1f targets per minute, %.2fx overlap\n",
+           wall / 1e9, jobs, wall ? nr_targets * 60e9 / wall : 0.0,
+           wall ? (double)busy / wall : 0.0);
+    printf("%.3fs mean and %.3fs slowest per target, %" PRIu64 " bytes of output\n",
+           busy / 1e9 / nr_targets, slowest / 1e9, output);
+}
+
+static void cmd_fleet_help(const char *name)
+{
+    printf("Usage: %s fleet [--jobs N] [--timeout SECONDS] TARGETS COMMAND [ARGS...]\n",
+           name);
+    printf("\n");
+    printf("Runs COMMAND against each target listed in TARGETS, a file of 'NAME INTERFACE\n");
+    printf("[ARGS...]' lines whose INTERFACE and ARGS are appended to the command's own.\n");
+    printf("NAME labels the target's output and its line in the closing report\n");
+    printf("\n");
+    printf("  --jobs N           Run N targets at a time (default %d)\n", FLEET_JOBS);
+    printf("  --timeout SECONDS  Kill a target's command after SECONDS (default none)\n");
+}
+
+/*
+ * Bridge drivers block and keep their state in globals, so each target's
+ * command runs in a forked child. This process is the event loop over them:
+ * it keeps up to --jobs running, forwards their output line by line as it
+ * arrives, enforces the timeout and collects their exit statuses.
+ */
+static int cmd_fleet(const char *name, int argc, char *argv[])
+{
+    unsigned long jobs = FLEET_JOBS, timeout = 0;
+    struct fleet_target *targets, *target;
+    const struct command *cmd;
+    size_t nr_targets, next, i;
+    struct pollfd *pfds;
+    size_t running = 0;
+    uint64_t start;
+    char *end;
+    int rc;
+
+    while (1) {
+        int option_index = 0;
+        int c;
+
+        static struct option long_options[] = {
+            { "help", no_argument, NULL, 'h' },
+            { "jobs", required_argument, NULL, 'j' },
+            { "timeout", required_argument, NULL, 't' },
+            { },
+        };
+
+        c = getopt_long(argc, argv, "+hj:t:", long_options, &option_index);
+        if (c == -1)
+            break;
+
+        switch (c) {
+            case 'h':
+                cmd_fleet_help(name);
+                exit(EXIT_SUCCESS);
+            case 'j':
+                errno = 0;
+                jobs = strtoul(optarg, &end, 0);
+                if (errno || *end || !jobs || jobs > FLEET_MAX_JOBS) {
+                    loge("Invalid job count: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 't':
+                errno = 0;
+                timeout = strtoul(optarg, &end, 0);
+                if (errno || *end) {
+                    loge("Invalid timeout: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case '?':
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (argc - optind < 2) {
+        loge("Not enough arguments for fleet command\n");
+        cmd_fleet_help(name);
+        exit(EXIT_FAILURE);
+    }
+
+    if (!(cmd = find_command(argv[optind + 1])) || cmd->fn == cmd_fleet) {
+        loge("'%s' can't be run across a fleet\n", argv[optind + 1]);
+        return -EINVAL;
+    }
+
+    if (argc - optind - 1 > BATCH_MAX_ARGS) {
+        loge("Too many arguments for %s\n", cmd->name);
+        return -E2BIG;
+    }
+
+    /* Every child would append to the one recording */
+    if (record_enabled()) {
+        loge("--record can't be used with fleet\n");
+        return -EINVAL;
+    }
+
+    if ((rc = fleet_load(argv[optind], &targets, &nr_targets)) < 0)
+        return rc;
+
+    if (!(pfds = calloc(jobs, sizeof(*pfds)))) {
+        rc = -ENOMEM;
+        goto cleanup_targets;
+    }
+
+    start = fleet_now();
+    next = 0;
+
+    while (next < nr_targets || running) {
+        uint64_t now, deadline = UINT64_MAX;
+        int wait = -1;
+        size_t nfds = 0;
+
+        while (running < jobs && next < nr_targets) {
+            target = &targets[next++];
+            fleet_start(cmd, argc - optind - 1, argv + optind + 1, targets,
+                        nr_targets, target);
+            if (target->fd >= 0)
+                running++;
+        }
+
+        if (!running)
+            break;
+
+        for (i = 0; i < next; i++) {
+            target = &targets[i];
+            if (target->fd < 0)
+                continue;
+
+            pfds[nfds].fd = target->fd;
+            pfds[nfds].events = POLLIN;
+            nfds++;
+
+            if (timeout && !target->timed_out &&
+                target->start + timeout * 1000000000ULL < deadline)
+                deadline = target->start + timeout * 1000000000ULL;
+        }
+
+        if (deadline != UINT64_MAX) {
+            now = fleet_now();
+            wait = deadline > now ? (deadline - now) / 1000000 + 1 : 0;
+        }
+
+        if (poll(pfds, nfds, wait) < 0) {
+            if (errno == EINTR)
+                continue;
+            rc = -errno;
+            loge("Failed to poll fleet targets: %d\n", rc);
+            break;
+        }
+
+        now = fleet_now();
+        nfds = 0;
+
+        for (i = 0; i < next; i++) {
+            struct pollfd *pfd;
+            char buf[4096];
+            ssize_t len;
+
+            target = &targets[i];
+            if (target->fd < 0)
+                continue;
+
+            pfd = &pfds[nfds++];
+
+            if (timeout && !target->timed_out &&
+                now - target->start >= timeout * 1000000000ULL) {
+                loge("%s: Timed out after %lus\n", target->name, timeout);
+                kill(target->pid, SIGKILL);
+                target->timed_out = true;
+            }
+
+            if (!pfd->revents)
+                continue;
+
+            if ((len = read(target->fd, buf, sizeof(buf))) > 0) {
+                fleet_forward(target, buf, len);
+                continue;
+            }
+
+            if (len < 0 && (errno == EINTR || errno == EAGAIN))
+                continue;
+
+            fleet_reap(target);
+            running--;
+        }
+    }
+
+    /* Only after a failed poll() are there still children to clean up */
+    for (i = 0; i < next; i++) {
+        target = &targets[i];
+        if (target->fd >= 0) {
+            kill(target->pid, SIGKILL);
+            fleet_reap(target);
+        }
+    }
+
+    fleet_report(cmd->name, targets, nr_targets, jobs, fleet_now() - start);
+
+    if (!rc) {
+        for (i = 0; i < nr_targets; i++) {
+            if (!fleet_succeeded(&targets[i])) {
+                rc = -EREMOTEIO;
+                break;
+            }
+        }
+    }
+
+    free(pfds);
+
+cleanup_targets:
+    fleet_free(targets, nr_targets);
+
+    return rc;
+}
+
+static int parse_debug_credits(const char *arg)
+{
+    unsigned long credits;
+    char *end;
+
+    errno = 0;
+    credits = strtoul(arg, &end, 0);
+    if (errno || *end || !credits)
+        return -EINVAL;
+
+    debug_set_credits(credits);
+
+    return 0;
+}
+
+static int parse_debug_baud(const char *arg)
+{
+    unsigned long baud;
+    char *end;
+
+    errno = 0;
+    baud = strtoul(arg, &end, 0);
+    if (errno || *end || baud > INT_MAX)
+        return -EINVAL;
+
+    return debug_set_baud(baud);
+}
+
+static int parse_debug_upload(const char *arg)
+{
+    unsigned long len;
+    char *end;
+
+    errno = 0;
+    len = strtoul(arg, &end, 0);
+    if (errno || *end)
+        return -EINVAL;
+
+    return debug_set_upload(len);
+}
+
+static int parse_ts16_sockbuf(const char *arg)
+{
+    unsigned long bytes;
+    char *end;
+
+    errno = 0;
+    bytes = strtoul(arg, &end, 0);
+    if (errno || *end || bytes > INT_MAX)
+        return -EINVAL;
+
+    ts16_set_sockbuf(bytes);
+
+    return 0;
+}
+
+/* ADDR,LEN in any base strtoull() accepts */
+static int parse_lpc_fw(const char *arg)
+{
+    unsigned long long phys, len;
+    char *end;
+
+    errno = 0;
+    phys = strtoull(arg, &end, 0);
+    if (errno || *end != ',')
+        return -EINVAL;
+
+    len = strtoull(end + 1, &end, 0);
+    if (errno || *end || len > SIZE_MAX)
+        return -EINVAL;
+
+    return lpc_set_fw_window(phys, len);
+}
+
+static int parse_sfc_dma(const char *arg)
+{
+    unsigned long long phys, len;
+    char *end;
+
+    errno = 0;
+    phys = strtoull(arg, &end, 0);
+    if (errno || *end != ',' || phys > UINT32_MAX)
+        return -EINVAL;
+
+    len = strtoull(end + 1, &end, 0);
+    if (errno || *end || len > UINT32_MAX)
+        return -EINVAL;
+
+    return sfc_set_dma_scratch(phys, len);
+}
+
 int main(int argc, char *argv[])
 {
-    const struct command *cmd = &cmds[0];
+    const struct command *cmd;
+    enum progress_mode progress = progress_human;
+    enum timing_mode timings = timing_none;
+    enum lpc_settle settle;
     bool show_help = false;
+    const char *control = NULL;
     bool quiet = false;
     int verbose = 0;
 
     while (1) {
         static struct option long_options[] = {
+            { "cache", optional_argument, NULL, 'C' },
+            { "control", required_argument, NULL, 'c' },
+            { "debug-baud", required_argument, NULL, 'B' },
+            { "debug-cache", no_argument, NULL, 'Y' },
+            { "debug-credits", required_argument, NULL, 'D' },
+            { "debug-upload", required_argument, NULL, 'u' },
+            { "failover", no_argument, NULL, 'f' },
+            { "flash-layout", required_argument, NULL, 'L' },
             { "help", no_argument, NULL, 'h' },
+            { "hugepages", no_argument, NULL, 'G' },
+            { "io-settle", required_argument, NULL, 'I' },
             { "quiet", no_argument, NULL, 'q' },
+            { "sfc-dma", required_argument, NULL, 'M' },
+            { "sfc-fast", no_argument, NULL, 'R' },
             { "skip-bridge", required_argument, NULL, 's' },
+            { "span-trace", required_argument, NULL, 'K' },
             { "list-bridges", no_argument, NULL, 'l' },
+            { "lock-dir", required_argument, NULL, 'J' },
+            { "lpc-fw", required_argument, NULL, 'F' },
+            { "progress", required_argument, NULL, 'P' },
+            { "realtime", required_argument, NULL, 'O' },
+            { "record", required_argument, NULL, 'A' },
+            { "stats", no_argument, NULL, 'S' },
+            { "stripe", no_argument, NULL, 'T' },
+            { "throttle", required_argument, NULL, 'Q' },
+            { "timings", optional_argument, NULL, 'E' },
+            { "ts16-sockbuf", required_argument, NULL, 'N' },
+            { "write-combine", no_argument, NULL, 'W' },
             { "verbose", no_argument, NULL, 'v' },
+            { "vfio", no_argument, NULL, 'X' },
             { "version", no_argument, NULL, 'V' },
             { },
         };
         int option_index = 0;
         int c;
 
-        c = getopt_long(argc, argv, "+hlqs:vV", long_options, &option_index);
+        c = getopt_long(argc, argv, "+A:B:C::c:D:E::fF:GhI:J:K:L:lM:N:O:P:Q:qRSs:Tu:vVWXY", long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c) {
+            case 'A':
+                if (record_enable(optarg)) {
+                    fprintf(stderr, "Error: failed to open bridge recording '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'B':
+                if (parse_debug_baud(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a supported debug UART rate\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'C':
+                if (cache_enable(optarg)) {
+                    fprintf(stderr, "Error: failed to set up the probe cache\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'c':
+                control = optarg;
+                break;
+            case 'D':
+                if (parse_debug_credits(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a usable credit window\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'E':
+                if (timing_parse_mode(optarg, &timings)) {
+                    fprintf(stderr, "Error: '%s' not a recognized timings format\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'f':
+                host_enable_failover();
+                break;
+            case 'F':
+                if (parse_lpc_fw(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a usable LPC firmware window\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'G':
+                bufpool_enable_hugepages();
+                break;
             case 'h':
                 show_help = true;
                 break;
+            case 'I':
+                if (lpc_parse_settle(optarg, &settle)) {
+                    fprintf(stderr, "Error: '%s' not a recognized I/O settle mode\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                lpc_set_settle(settle);
+                break;
+            case 'J':
+                if (arb_set_dir(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a usable lock directory\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'K':
+                if (span_enable(optarg)) {
+                    fprintf(stderr, "Error: failed to open span trace '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                if (layout_set_spec(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a recognized flash layout\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'l':
                 print_bridge_drivers();
                 exit(EXIT_SUCCESS);
                 break;
+            case 'M':
+                if (parse_sfc_dma(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a usable flash DMA scratch region\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'N':
+                if (parse_ts16_sockbuf(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a usable socket buffer size\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'v':
                 verbose++;
                 break;
             case 'V':
                 print_version(program_invocation_short_name);
                 exit(EXIT_SUCCESS);
+            case 'O':
+                if (rt_parse(optarg)) {
+                    fprintf(stderr, "Error: invalid real-time settings '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'P':
+                if (progress_parse_mode(optarg, &progress)) {
+                    fprintf(stderr, "Error: '%s' not a recognized progress mode\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'Q':
+                if (throttle_add(optarg)) {
+                    fprintf(stderr, "Error: invalid bridge throttle '%s'\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
             case 'q':
                 quiet = true;
                 break;
+            case 'R':
+                sfc_enable_fast_reads();
+                break;
+            case 'S':
+                host_enable_stats();
+                break;
+            case 'T':
+                host_enable_striping();
+                break;
+            case 'u':
+                if (parse_debug_upload(optarg)) {
+                    fprintf(stderr, "Error: '%s' not a usable upload size\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W':
+                p2ab_enable_write_combining();
+                break;
+            case 'X':
+                pci_enable_vfio();
+                break;
+            case 'Y':
+                debug_enable_cache();
+                break;
             case 's':
                 if (disable_bridge_driver(optarg)) {
                     fprintf(stderr, "Error: '%s' not a recognized bridge name (use '-l' to list)\n", optarg);
@@ -158,6 +1312,9 @@ int main(int argc, char *argv[])
         exit(EXIT_FAILURE);
     }
 
+    progress_set_mode(quiet ? progress_none : progress);
+    timing_set_mode(timings);
+
     if (quiet) {
         log_set_level(level_none);
     } else if ((level_info + verbose) <= level_trace) {
@@ -166,22 +1323,21 @@ int main(int argc, char *argv[])
         log_set_level(level_trace);
     }
 
-    while (cmd->fn) {
-        if (!strcmp(cmd->name, argv[optind])) {
-            int offset = optind;
-            int rc;
-
-            /* probe uses getopt, but for subcommands not using getopt */
-            if (!(!strcmp("probe", argv[optind]) || !strcmp("write", argv[optind]))) {
-                offset += 1;
-            }
-            optind = 1;
+    if (control && control_start(control)) {
+        fprintf(stderr, "Error: failed to listen for control on '%s'\n", control);
+        exit(EXIT_FAILURE);
+    }
 
-            rc = cmd->fn(program_invocation_short_name, argc - offset, argv + offset);
-            exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
-        }
+    if ((cmd = find_command(argv[optind]))) {
+        int timing = timing_begin("command", cmd->name);
+        int rc = run_command(cmd, argc - optind, argv + optind);
 
-        cmd++;
+        timing_end(timing);
+        control_stop();
+        timing_report();
+        span_dump();
+        record_close();
+        exit(rc ? EXIT_FAILURE : EXIT_SUCCESS);
     }
 
     fprintf(stderr, "Error: unknown command: %s\n", argv[1]);
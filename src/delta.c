@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "delta.h"
+#include "log.h"
+#include "sha256.h"
+#include "soc/hace.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Differing words this close together are cheaper to write as one run */
+#define DELTA_GAP 64
+
+int delta_init(struct delta *ctx, struct soc *soc, uint32_t scratch)
+{
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->soc = soc;
+    ctx->scratch = scratch;
+
+    if (scratch) {
+        if (scratch & 7) {
+            loge("The hash scratch area must be 8-byte aligned\n");
+            return -EINVAL;
+        }
+
+        if (!(ctx->hace = hace_get(soc))) {
+            loge("No hash engine to compare blocks on the BMC with\n");
+            return -ENODEV;
+        }
+
+        if (!(ctx->digests = malloc(DELTA_BATCH * HACE_SHA256_LEN)))
+            return -ENOMEM;
+    } else if (!(ctx->have = malloc(DELTA_WIN))) {
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void delta_destroy(struct delta *ctx)
+{
+    free(ctx->digests);
+    free(ctx->have);
+}
+
+static int delta_write_range(struct delta *ctx, uint32_t phys,
+                             const uint8_t *buf, size_t len)
+{
+    ssize_t rc;
+
+    if ((rc = soc_write(ctx->soc, phys, buf, len)) < 0)
+        return rc;
+
+    ctx->written += len;
+
+    return 0;
+}
+
+/* Writes the words of @want that differ from @have, in runs */
+static int delta_write_words(struct delta *ctx, uint32_t phys,
+                             const uint8_t *want, const uint8_t *have,
+                             size_t len)
+{
+    size_t run_start = 0, run_end = 0;
+    bool run = false;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < len; i += 4) {
+        size_t word = len - i < 4 ? len - i : 4;
+
+        if (!memcmp(&want[i], &have[i], word))
+            continue;
+
+        if (run && i - run_end >= DELTA_GAP) {
+            rc = delta_write_range(ctx, phys + run_start, &want[run_start],
+                                   run_end - run_start);
+            if (rc < 0)
+                return rc;
+            run = false;
+        }
+
+        if (!run) {
+            run_start = i;
+            run = true;
+        }
+        run_end = i + word;
+    }
+
+    if (!run)
+        return 0;
+
+    return delta_write_range(ctx, phys + run_start, &want[run_start],
+                             run_end - run_start);
+}
+
+static int delta_check_scratch(struct delta *ctx, uint32_t phys, size_t len)
+{
+    if ((phys & 7) ||
+            (ctx->scratch + DELTA_BATCH * HACE_SHA256_LEN > phys &&
+             ctx->scratch < (uint64_t)phys + len)) {
+        loge("The hash scratch area must be outside the range, which must be aligned\n");
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+/* Compare a window of at most DELTA_WIN bytes and write what differs */
+static int delta_write_win(struct delta *ctx, uint32_t phys,
+                           const uint8_t *want, size_t len)
+{
+    uint8_t digest[SHA256_LEN];
+    size_t block;
+    ssize_t rd;
+    int rc;
+
+    if (!ctx->hace) {
+        if ((rd = soc_read(ctx->soc, phys, ctx->have, len)) < 0)
+            return rd;
+
+        return delta_write_words(ctx, phys, want, ctx->have, len);
+    }
+
+    rc = hace_sha256_blocks(ctx->hace, phys, len, DELTA_BLOCK, ctx->scratch,
+                            ctx->digests);
+    if (rc < 0)
+        return rc;
+
+    for (block = 0; block < len; block += DELTA_BLOCK) {
+        size_t chunk = len - block < DELTA_BLOCK ? len - block : DELTA_BLOCK;
+
+        sha256(&want[block], chunk, digest);
+        if (!memcmp(digest, &ctx->digests[(block / DELTA_BLOCK) * SHA256_LEN],
+                    SHA256_LEN))
+            continue;
+
+        if ((rc = delta_write_range(ctx, phys + block, &want[block], chunk)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+int delta_write(struct delta *ctx, uint32_t phys, const void *buf, size_t len)
+{
+    const uint8_t *want = buf;
+    int rc;
+
+    if (ctx->hace && (rc = delta_check_scratch(ctx, phys, len)) < 0)
+        return rc;
+
+    while (len) {
+        size_t win = len < DELTA_WIN ? len : DELTA_WIN;
+
+        if ((rc = delta_write_win(ctx, phys, want, win)) < 0)
+            return rc;
+
+        ctx->compared += win;
+        phys += win;
+        want += win;
+        len -= win;
+    }
+
+    return 0;
+}
+
+int delta_write_known(struct delta *ctx, uint32_t phys, const void *buf,
+                      const void *have, size_t len)
+{
+    int rc;
+
+    if ((rc = delta_write_words(ctx, phys, buf, have, len)) < 0)
+        return rc;
+
+    ctx->compared += len;
+
+    return 0;
+}
+
+int delta_verify(struct delta *ctx, uint32_t phys, const void *buf, size_t len)
+{
+    uint8_t want[SHA256_LEN], have[HACE_SHA256_LEN];
+    const uint8_t *cursor = buf;
+    ssize_t rd;
+    int rc;
+
+    if (ctx->hace) {
+        if ((rc = delta_check_scratch(ctx, phys, len)) < 0)
+            return rc;
+
+        if ((rc = hace_sha256(ctx->hace, phys, len, ctx->scratch, have)) < 0)
+            return rc;
+
+        sha256(buf, len, want);
+
+        return memcmp(want, have, SHA256_LEN) ? -EBADMSG : 0;
+    }
+
+    while (len) {
+        size_t win = len < DELTA_WIN ? len : DELTA_WIN;
+
+        if ((rd = soc_read(ctx->soc, phys, ctx->have, win)) < 0)
+            return rd;
+
+        if (memcmp(cursor, ctx->have, win)) {
+            loge("Memory differs in the 0x%zx bytes at 0x%08" PRIx32 "\n", win,
+                 phys);
+            return -EBADMSG;
+        }
+
+        phys += win;
+        cursor += win;
+        len -= win;
+    }
+
+    return 0;
+}
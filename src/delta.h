@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _DELTA_H
+#define _DELTA_H
+
+#include "soc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Blocks compared at a time, one pass of the hash engine */
+#define DELTA_BLOCK (4 << 10)
+#define DELTA_BATCH 128
+#define DELTA_WIN   (DELTA_BATCH * DELTA_BLOCK)
+
+/*
+ * Brings BMC memory into line with a buffer by writing only what differs.
+ * With a hash engine and somewhere for it to put digests the destination is
+ * compared a block at a time by SHA-256 without reading it back, otherwise
+ * it's read and compared a word at a time.
+ */
+struct delta {
+    struct soc *soc;
+    struct hace *hace;
+    uint32_t scratch;
+    uint8_t *have;
+    uint8_t *digests;
+    /* Bytes compared and written so far */
+    size_t compared;
+    size_t written;
+};
+
+/* @scratch is 8-byte aligned free DRAM for the engine, or 0 to read back */
+int delta_init(struct delta *ctx, struct soc *soc, uint32_t scratch);
+void delta_destroy(struct delta *ctx);
+
+int delta_write(struct delta *ctx, uint32_t phys, const void *buf, size_t len);
+
+/* As delta_write(), where @have is known to be what's at @phys already */
+int delta_write_known(struct delta *ctx, uint32_t phys, const void *buf,
+                      const void *have, size_t len);
+
+/* Whether the memory at @phys holds @buf, -EBADMSG if it doesn't */
+int delta_verify(struct delta *ctx, uint32_t phys, const void *buf, size_t len);
+
+#endif
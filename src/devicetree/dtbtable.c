@@ -0,0 +1,460 @@
+// SPDX-License-Identifier: Apache-2.0
+
+/*
+ * Compiles a devicetree blob into the tables of devicetree/table.h, run on the
+ * build machine:
+ *
+ *	dtbtable NAME INPUT.dtb OUTPUT.c
+ *
+ * The tables are named soc_dt_NAME. The blob is parsed directly rather than
+ * through libfdt, which may only be available for the target.
+ */
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FDT_MAGIC	0xd00dfeed
+#define FDT_BEGIN_NODE	0x1
+#define FDT_END_NODE	0x2
+#define FDT_PROP	0x3
+#define FDT_NOP		0x4
+#define FDT_END		0x9
+
+#define DT_MAX_DEPTH	32
+
+struct dt_prop {
+	const char *name;
+	const uint8_t *data;
+	uint32_t len;
+};
+
+struct dt_node {
+	uint32_t offset;
+	int depth;
+	int parent;
+	int child;
+	int sibling;
+	const char *name;
+	char *path;
+	struct dt_prop *props;
+	size_t nr_props;
+};
+
+struct dt {
+	const uint8_t *blob;
+	size_t len;
+	struct dt_node *nodes;
+	size_t nr_nodes;
+};
+
+static uint32_t be32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+	       (uint32_t)p[2] << 8 | p[3];
+}
+
+static void *xrealloc(void *ptr, size_t len)
+{
+	void *res;
+
+	if (!(res = realloc(ptr, len))) {
+		perror("realloc");
+		exit(EXIT_FAILURE);
+	}
+
+	return res;
+}
+
+static const struct dt_prop *dt_prop(const struct dt *dt, int node,
+				     const char *name)
+{
+	const struct dt_node *n = &dt->nodes[node];
+	size_t i;
+
+	for (i = 0; i < n->nr_props; i++) {
+		if (!strcmp(n->props[i].name, name))
+			return &n->props[i];
+	}
+
+	return NULL;
+}
+
+/* Whether any of the strings in @prop is @str */
+static bool dt_prop_has(const struct dt_prop *prop, const char *str)
+{
+	const char *cursor, *end;
+
+	if (!prop)
+		return false;
+
+	cursor = (const char *)prop->data;
+	end = cursor + prop->len;
+	for (; cursor < end; cursor += strlen(cursor) + 1) {
+		if (!strcmp(cursor, str))
+			return true;
+	}
+
+	return false;
+}
+
+static int dt_parse(struct dt *dt)
+{
+	uint32_t off_struct, off_strings, size_struct, size_strings;
+	int stack[DT_MAX_DEPTH];
+	const uint8_t *base;
+	uint32_t cursor = 0;
+	int depth = -1;
+	int last = -1;
+
+	if (dt->len < 40 || be32(dt->blob) != FDT_MAGIC)
+		return -EINVAL;
+
+	off_struct = be32(dt->blob + 8);
+	off_strings = be32(dt->blob + 12);
+	size_strings = be32(dt->blob + 32);
+	size_struct = be32(dt->blob + 36);
+	if (off_struct > dt->len || size_struct > dt->len - off_struct ||
+	    off_strings > dt->len || size_strings > dt->len - off_strings)
+		return -EINVAL;
+
+	base = dt->blob + off_struct;
+
+	while (cursor + 4 <= size_struct) {
+		uint32_t token = be32(base + cursor);
+		uint32_t at = cursor;
+		struct dt_node *n;
+		struct dt_prop *p;
+		size_t len;
+
+		cursor += 4;
+
+		switch (token) {
+		case FDT_BEGIN_NODE:
+			if (++depth >= DT_MAX_DEPTH)
+				return -EINVAL;
+
+			len = strnlen((const char *)base + cursor,
+				      size_struct - cursor);
+			if (cursor + len >= size_struct)
+				return -EINVAL;
+
+			dt->nodes = xrealloc(dt->nodes, (dt->nr_nodes + 1) *
+					     sizeof(*dt->nodes));
+			n = &dt->nodes[dt->nr_nodes];
+			memset(n, 0, sizeof(*n));
+			n->offset = at;
+			n->depth = depth;
+			n->name = (const char *)base + cursor;
+			n->parent = depth ? stack[depth - 1] : -1;
+			n->child = -1;
+			n->sibling = -1;
+
+			/* Link in after the last node seen at this depth */
+			if (last >= 0 && dt->nodes[last].depth == depth)
+				dt->nodes[last].sibling = dt->nr_nodes;
+			else if (depth)
+				dt->nodes[n->parent].child = dt->nr_nodes;
+
+			stack[depth] = dt->nr_nodes++;
+			last = -1;
+			cursor += (len + 4) & ~3u;
+			break;
+		case FDT_END_NODE:
+			if (depth < 0)
+				return -EINVAL;
+			last = stack[depth--];
+			break;
+		case FDT_PROP:
+			if (depth < 0 || cursor + 8 > size_struct)
+				return -EINVAL;
+
+			n = &dt->nodes[stack[depth]];
+			n->props = xrealloc(n->props, (n->nr_props + 1) *
+					    sizeof(*n->props));
+			p = &n->props[n->nr_props++];
+			p->len = be32(base + cursor);
+			if (be32(base + cursor + 4) >= size_strings)
+				return -EINVAL;
+			p->name = (const char *)dt->blob + off_strings +
+				  be32(base + cursor + 4);
+			p->data = base + cursor + 8;
+			if (p->len > size_struct - cursor - 8)
+				return -EINVAL;
+			cursor += 8 + ((p->len + 3) & ~3u);
+			break;
+		case FDT_NOP:
+			break;
+		case FDT_END:
+			return depth == -1 && dt->nr_nodes ? 0 : -EINVAL;
+		default:
+			return -EINVAL;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static void dt_paths(struct dt *dt)
+{
+	struct dt_node *n, *parent;
+	size_t i, len;
+
+	for (i = 0; i < dt->nr_nodes; i++) {
+		n = &dt->nodes[i];
+		if (n->parent < 0) {
+			n->path = strdup("/");
+			continue;
+		}
+
+		parent = &dt->nodes[n->parent];
+		len = strlen(parent->path) + strlen(n->name) + 2;
+		n->path = xrealloc(NULL, len);
+		snprintf(n->path, len, "%s%s%s", parent->path,
+			 parent->parent < 0 ? "" : "/", n->name);
+	}
+}
+
+static int dt_by_phandle(const struct dt *dt, uint32_t phandle)
+{
+	const struct dt_prop *prop;
+	size_t i;
+
+	for (i = 0; i < dt->nr_nodes; i++) {
+		if (((prop = dt_prop(dt, i, "phandle")) ||
+		     (prop = dt_prop(dt, i, "linux,phandle"))) &&
+		    prop->len == 4 && be32(prop->data) == phandle)
+			return i;
+	}
+
+	return -1;
+}
+
+/* As soc_device_get_memory_index() looks through a simple-mfd parent */
+static const struct dt_prop *dt_reg(const struct dt *dt, int node)
+{
+	const struct dt_node *n = &dt->nodes[node];
+
+	if (n->parent < 0)
+		return NULL;
+
+	if (dt_prop_has(dt_prop(dt, n->parent, "compatible"), "simple-mfd"))
+		node = n->parent;
+
+	return dt_prop(dt, node, "reg");
+}
+
+static void emit_string(FILE *out, const char *str, size_t len)
+{
+	size_t i;
+
+	fputc('"', out);
+	for (i = 0; i < len; i++) {
+		unsigned char c = str[i];
+
+		if (c == '"' || c == '\\')
+			fprintf(out, "\\%c", c);
+		else if (c < 0x20 || c >= 0x7f)
+			fprintf(out, "\\%03o", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+
+static void emit_regs(FILE *out, const struct dt_prop *reg)
+{
+	uint32_t i;
+
+	for (i = 0; i + 8 <= reg->len; i += 8)
+		fprintf(out, "\t{ 0x%08x, 0x%08x },\n", be32(reg->data + i),
+			be32(reg->data + i + 4));
+}
+
+static void emit(FILE *out, const struct dt *dt, const char *name)
+{
+	const struct dt_prop *prop, *names, *phandles, *reg;
+	size_t *reg_at, *regions_at, *nr_regions;
+	const char *cursor, *end;
+	size_t nr_reg = 0, nr_named = 0;
+	size_t i;
+	int idx;
+
+	reg_at = xrealloc(NULL, dt->nr_nodes * sizeof(*reg_at));
+	regions_at = xrealloc(NULL, dt->nr_nodes * sizeof(*regions_at));
+	nr_regions = xrealloc(NULL, dt->nr_nodes * sizeof(*nr_regions));
+
+	fprintf(out, "// Generated by dtbtable, do not edit\n\n");
+	fprintf(out, "#include \"devicetree/table.h\"\n\n");
+
+	fprintf(out, "static const struct soc_region soc_dt_%s_reg[] = {\n",
+		name);
+	for (i = 0; i < dt->nr_nodes; i++) {
+		reg_at[i] = nr_reg;
+		if ((reg = dt_reg(dt, i))) {
+			emit_regs(out, reg);
+			nr_reg += reg->len / 8;
+		}
+	}
+	fprintf(out, "\t{ 0, 0 }\n};\n\n");
+
+	fprintf(out, "static const struct soc_dt_region soc_dt_%s_regions[] = {\n",
+		name);
+	for (i = 0; i < dt->nr_nodes; i++) {
+		regions_at[i] = nr_named;
+		nr_regions[i] = 0;
+
+		names = dt_prop(dt, i, "memory-region-names");
+		phandles = dt_prop(dt, i, "memory-region");
+		if (!names || !phandles)
+			continue;
+
+		/* The first of a repeated name wins, as fdt_stringlist_search() */
+		cursor = (const char *)names->data;
+		end = cursor + names->len;
+		for (idx = 0; cursor < end; cursor += strlen(cursor) + 1, idx++) {
+			const char *seen;
+			int target;
+
+			for (seen = (const char *)names->data; seen < cursor;
+			     seen += strlen(seen) + 1) {
+				if (!strcmp(seen, cursor))
+					break;
+			}
+			if (seen < cursor)
+				continue;
+
+			if ((size_t)idx * 4 + 4 > phandles->len)
+				break;
+
+			target = dt_by_phandle(dt, be32(phandles->data + idx * 4));
+			if (target < 0 || !(reg = dt_reg(dt, target)) ||
+			    reg->len < 8)
+				continue;
+
+			fprintf(out, "\t{ ");
+			emit_string(out, cursor, strlen(cursor));
+			fprintf(out, ", { 0x%08x, 0x%08x } },\n", be32(reg->data),
+				be32(reg->data + 4));
+			nr_named++;
+			nr_regions[i]++;
+		}
+	}
+	fprintf(out, "\t{ NULL, { 0, 0 } }\n};\n\n");
+
+	fprintf(out, "static const struct soc_dt_node soc_dt_%s_nodes[] = {\n",
+		name);
+	for (i = 0; i < dt->nr_nodes; i++) {
+		const struct dt_node *n = &dt->nodes[i];
+
+		fprintf(out, "\t{\n");
+		fprintf(out, "\t\t.offset = %u,\n", n->offset);
+		fprintf(out, "\t\t.depth = %d,\n", n->depth);
+		fprintf(out, "\t\t.parent = %d,\n", n->parent);
+		fprintf(out, "\t\t.child = %d,\n", n->child);
+		fprintf(out, "\t\t.sibling = %d,\n", n->sibling);
+		fprintf(out, "\t\t.name = ");
+		emit_string(out, n->name, strlen(n->name));
+		fprintf(out, ",\n\t\t.path = ");
+		emit_string(out, n->path, strlen(n->path));
+		fprintf(out, ",\n");
+
+		if ((prop = dt_prop(dt, i, "compatible"))) {
+			fprintf(out, "\t\t.compatible = ");
+			emit_string(out, (const char *)prop->data, prop->len);
+			fprintf(out, ",\n\t\t.compatible_len = %u,\n", prop->len);
+			fprintf(out, "\t\t.bus = %s,\n",
+				dt_prop_has(prop, "simple-bus") ||
+				dt_prop_has(prop, "simple-mfd") ? "true" : "false");
+		}
+
+		if ((prop = dt_prop(dt, i, "device_type")) && prop->len) {
+			fprintf(out, "\t\t.device_type = ");
+			emit_string(out, (const char *)prop->data,
+				    strnlen((const char *)prop->data, prop->len));
+			fprintf(out, ",\n");
+		}
+
+		if ((reg = dt_reg(dt, i)) && reg->len >= 8) {
+			fprintf(out, "\t\t.reg = &soc_dt_%s_reg[%zu],\n", name,
+				reg_at[i]);
+			fprintf(out, "\t\t.nr_reg = %u,\n", reg->len / 8);
+		}
+
+		if (nr_regions[i]) {
+			fprintf(out, "\t\t.regions = &soc_dt_%s_regions[%zu],\n",
+				name, regions_at[i]);
+			fprintf(out, "\t\t.nr_regions = %zu,\n", nr_regions[i]);
+		}
+
+		fprintf(out, "\t},\n");
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "const struct soc_dt soc_dt_%s = {\n", name);
+	fprintf(out, "\t.nodes = soc_dt_%s_nodes,\n", name);
+	fprintf(out, "\t.nr_nodes = %zu,\n", dt->nr_nodes);
+	fprintf(out, "};\n");
+
+	free(nr_regions);
+	free(regions_at);
+	free(reg_at);
+}
+
+int main(int argc, char *argv[])
+{
+	struct dt dt = { 0 };
+	uint8_t *blob = NULL;
+	size_t len = 0;
+	FILE *in, *out;
+	size_t ingress;
+	int rc;
+
+	if (argc != 4) {
+		fprintf(stderr, "Usage: %s NAME INPUT OUTPUT\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!(in = fopen(argv[2], "rb"))) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	do {
+		blob = xrealloc(blob, len + 4096);
+		ingress = fread(blob + len, 1, 4096, in);
+		len += ingress;
+	} while (ingress == 4096);
+
+	if (ferror(in)) {
+		perror(argv[2]);
+		return EXIT_FAILURE;
+	}
+	fclose(in);
+
+	dt.blob = blob;
+	dt.len = len;
+	if ((rc = dt_parse(&dt)) < 0) {
+		fprintf(stderr, "%s: Malformed devicetree blob\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	dt_paths(&dt);
+
+	if (!(out = fopen(argv[3], "w"))) {
+		perror(argv[3]);
+		return EXIT_FAILURE;
+	}
+
+	emit(out, &dt, argv[1]);
+
+	if (fclose(out)) {
+		perror(argv[3]);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
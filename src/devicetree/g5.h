@@ -7,4 +7,7 @@ extern void *_binary_src_devicetree_g5_dtb_start;
 extern void *_binary_src_devicetree_g5_dtb_end;
 extern size_t _binary_src_devicetree_g5_dtb_size;
 
+struct soc_dt;
+extern const struct soc_dt soc_dt_g5;
+
 #endif
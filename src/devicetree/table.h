@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _DEVICETREE_TABLE_H
+#define _DEVICETREE_TABLE_H
+
+#include "soc.h"
+
+#include <stdbool.h>
+
+/*
+ * A devicetree blob compiled into tables by dtbtable at build time, so the
+ * devices and their resources are found without walking the blob. Nodes are
+ * in the blob's depth-first order, which is also the order of their offsets.
+ */
+struct soc_dt_region {
+	const char *name;
+	struct soc_region region;
+};
+
+struct soc_dt_node {
+	/* The node's offset in the blob */
+	int offset;
+	int depth;
+	/* Indices into the node table, -1 for none */
+	int parent;
+	int child;
+	int sibling;
+	const char *name;
+	const char *path;
+	/* The compatible property's NUL-terminated strings, or NULL */
+	const char *compatible;
+	int compatible_len;
+	const char *device_type;
+	/* Compatible with simple-bus or simple-mfd, so the children are devices */
+	bool bus;
+	/* The reg property, from the parent if that's a simple-mfd */
+	const struct soc_region *reg;
+	int nr_reg;
+	/* The memory-region-names that resolve to a region */
+	const struct soc_dt_region *regions;
+	int nr_regions;
+};
+
+struct soc_dt {
+	const struct soc_dt_node *nodes;
+	int nr_nodes;
+};
+
+#endif
@@ -0,0 +1,269 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bufpool.h"
+#include "crc32.h"
+#include "digest.h"
+#include "log.h"
+#include "sha256.h"
+#include "span.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The copies handed to the worker, independent of the leaf size */
+#define DIGEST_CHUNK        (256 << 10)
+
+static const char *digest_algo_names[] = {
+    [digest_sha256] = "sha256",
+    [digest_crc32] = "crc32",
+    [digest_crc32c] = "crc32c",
+};
+
+int digest_parse_algo(const char *name, enum digest_algo *algo)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(digest_algo_names) / sizeof(digest_algo_names[0]); i++) {
+        if (!strcmp(digest_algo_names[i], name)) {
+            *algo = i;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+const char *digest_algo_name(enum digest_algo algo)
+{
+    return digest_algo_names[algo];
+}
+
+static size_t digest_len(enum digest_algo algo)
+{
+    return algo == digest_sha256 ? SHA256_LEN : sizeof(uint32_t);
+}
+
+static void digest_compute(enum digest_algo algo, const void *buf, size_t len,
+                           uint8_t *out)
+{
+    uint32_t crc;
+
+    if (algo == digest_sha256) {
+        sha256(buf, len, out);
+        return;
+    }
+
+    if (algo == digest_crc32c)
+        crc = crc32c_update(0, buf, len);
+    else
+        crc = crc32_update(0, buf, len);
+    out[0] = crc >> 24;
+    out[1] = crc >> 16;
+    out[2] = crc >> 8;
+    out[3] = crc;
+}
+
+static void digest_print(FILE *stream, const uint8_t *digest, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        fprintf(stream, "%02x", digest[i]);
+}
+
+static int digest_leaf(struct digest *ctx)
+{
+    uint8_t *leaf;
+    void *grown;
+
+    if (ctx->nr_leaves == ctx->max_leaves) {
+        size_t max = ctx->max_leaves ? ctx->max_leaves * 2 : 64;
+
+        if (!(grown = realloc(ctx->leaves, max * ctx->len)))
+            return -ENOMEM;
+
+        ctx->leaves = grown;
+        ctx->max_leaves = max;
+    }
+
+    leaf = &ctx->leaves[ctx->nr_leaves++ * ctx->len];
+    digest_compute(ctx->algo, ctx->leaf, ctx->fill, leaf);
+
+    if (ctx->sidecar) {
+        fprintf(ctx->sidecar, "0x%08" PRIx64 " %zu ", ctx->offset, ctx->fill);
+        digest_print(ctx->sidecar, leaf, ctx->len);
+        fprintf(ctx->sidecar, "\n");
+    }
+
+    ctx->offset += ctx->fill;
+    ctx->fill = 0;
+
+    return 0;
+}
+
+static void *digest_worker(void *arg)
+{
+    struct digest *ctx = arg;
+    struct ring_slot *slot;
+    const uint8_t *buf;
+    size_t len, take;
+    int rc;
+
+    span_thread_name("digest");
+
+    while ((slot = ring_get_full(&ctx->ring))) {
+        uint64_t span = span_begin();
+
+        buf = slot->buf;
+        len = slot->len;
+
+        while (len) {
+            take = ctx->block - ctx->fill;
+            if (take > len)
+                take = len;
+
+            memcpy(ctx->leaf + ctx->fill, buf, take);
+            ctx->fill += take;
+            buf += take;
+            len -= take;
+
+            if (ctx->fill == ctx->block && (rc = digest_leaf(ctx)) < 0) {
+                ring_abort(&ctx->ring, rc);
+                return NULL;
+            }
+        }
+
+        span_end("digest", "hash", span, 0, slot->len);
+        ring_put_empty(&ctx->ring);
+    }
+
+    if (ctx->fill && !ring_status(&ctx->ring) && (rc = digest_leaf(ctx)) < 0)
+        ring_abort(&ctx->ring, rc);
+
+    return NULL;
+}
+
+int digest_init(struct digest *ctx, enum digest_algo algo, size_t block,
+                const char *sidecar)
+{
+    int rc;
+
+    if (!block)
+        return -EINVAL;
+
+    ctx->algo = algo;
+    ctx->block = block;
+    ctx->len = digest_len(algo);
+    ctx->fill = 0;
+    ctx->offset = 0;
+    ctx->leaves = NULL;
+    ctx->nr_leaves = 0;
+    ctx->max_leaves = 0;
+    ctx->sidecar = NULL;
+
+    if (!(ctx->leaf = bufpool_get(block)))
+        return -ENOMEM;
+
+    if ((rc = ring_init(&ctx->ring, DIGEST_CHUNK)) < 0)
+        goto cleanup_leaf;
+
+    if (sidecar) {
+        if (!(ctx->sidecar = fopen(sidecar, "w"))) {
+            rc = -errno;
+            loge("Failed to open digest file '%s': %d\n", sidecar, rc);
+            goto cleanup_ring;
+        }
+
+        fprintf(ctx->sidecar, "# %s tree, %zu byte blocks: offset length digest\n",
+                digest_algo_name(algo), block);
+    }
+
+    if ((rc = -pthread_create(&ctx->worker, NULL, digest_worker, ctx)))
+        goto cleanup_sidecar;
+
+    ctx->running = true;
+
+    return 0;
+
+cleanup_sidecar:
+    if (ctx->sidecar)
+        fclose(ctx->sidecar);
+
+cleanup_ring:
+    ring_destroy(&ctx->ring);
+
+cleanup_leaf:
+    bufpool_put(ctx->leaf, block);
+
+    return rc;
+}
+
+int digest_feed(struct digest *ctx, const void *buf, size_t len)
+{
+    struct ring_slot *slot;
+    size_t take;
+
+    while (len) {
+        if (!(slot = ring_get_empty(&ctx->ring)))
+            return ring_status(&ctx->ring);
+
+        take = len > ctx->ring.size ? ctx->ring.size : len;
+        memcpy(slot->buf, buf, take);
+        slot->len = take;
+        ring_put_full(&ctx->ring);
+
+        buf = (const uint8_t *)buf + take;
+        len -= take;
+    }
+
+    return 0;
+}
+
+int digest_finish(struct digest *ctx)
+{
+    uint8_t root[DIGEST_MAX_LEN];
+    int rc;
+
+    ring_finish(&ctx->ring);
+    pthread_join(ctx->worker, NULL);
+    ctx->running = false;
+
+    if ((rc = ring_status(&ctx->ring)) < 0)
+        return rc;
+
+    digest_compute(ctx->algo, ctx->leaves, ctx->nr_leaves * ctx->len, root);
+
+    fprintf(stderr, "%s tree root over %zu blocks of %zu bytes: ",
+            digest_algo_name(ctx->algo), ctx->nr_leaves, ctx->block);
+    digest_print(stderr, root, ctx->len);
+    fprintf(stderr, "\n");
+
+    if (ctx->sidecar) {
+        fprintf(ctx->sidecar, "root %" PRIu64 " ", ctx->offset);
+        digest_print(ctx->sidecar, root, ctx->len);
+        fprintf(ctx->sidecar, "\n");
+
+        if (fflush(ctx->sidecar) || ferror(ctx->sidecar))
+            return -EIO;
+    }
+
+    return 0;
+}
+
+void digest_destroy(struct digest *ctx)
+{
+    /* Unwinding an error before digest_finish() */
+    if (ctx->running) {
+        ring_abort(&ctx->ring, -ECANCELED);
+        pthread_join(ctx->worker, NULL);
+    }
+
+    if (ctx->sidecar)
+        fclose(ctx->sidecar);
+
+    ring_destroy(&ctx->ring);
+    free(ctx->leaves);
+    bufpool_put(ctx->leaf, ctx->block);
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _DIGEST_H
+#define _DIGEST_H
+
+#include "ring.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define DIGEST_MAX_LEN      32
+#define DIGEST_DEFAULT_BLOCK (1 << 20)
+
+enum digest_algo { digest_sha256, digest_crc32, digest_crc32c };
+
+/*
+ * A two level tree hash of a stream: each block of @block bytes gets a leaf
+ * digest, and the root is the digest of the leaves concatenated. Leaves can
+ * be checked one by one against the matching ranges of a partial dump, and
+ * are written to the sidecar as they're done.
+ *
+ * The stream is copied into a ring and hashed on a worker, so the caller only
+ * pays for the copy.
+ */
+struct digest {
+    enum digest_algo algo;
+    size_t block;
+    size_t len;
+    struct ring ring;
+    pthread_t worker;
+    bool running;
+    uint8_t *leaf;
+    size_t fill;
+    uint64_t offset;
+    uint8_t *leaves;
+    size_t nr_leaves;
+    size_t max_leaves;
+    FILE *sidecar;
+};
+
+int digest_parse_algo(const char *name, enum digest_algo *algo);
+const char *digest_algo_name(enum digest_algo algo);
+
+/* @sidecar may be NULL */
+int digest_init(struct digest *ctx, enum digest_algo algo, size_t block,
+                const char *sidecar);
+/* Hands @buf to the worker. Returns an error if hashing has failed */
+int digest_feed(struct digest *ctx, const void *buf, size_t len);
+/* Waits for the worker and reports the root, to stderr and the sidecar */
+int digest_finish(struct digest *ctx);
+void digest_destroy(struct digest *ctx);
+
+#endif
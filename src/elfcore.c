@@ -0,0 +1,115 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "elfcore.h"
+
+#include <elf.h>
+#include <endian.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ELFCORE_NOTE_NAME   "CULVERT"
+#define ELFCORE_NOTE_SOC    1
+
+struct elfcore_note {
+    Elf32_Nhdr nhdr;
+    char name[8];
+    struct elfcore_soc desc;
+};
+
+/* The note leads so the program headers can run on to fill the page */
+struct elfcore_header {
+    Elf32_Ehdr ehdr;
+    struct elfcore_note note;
+    Elf32_Phdr phdr[1 + ELFCORE_MAX_SEGMENTS];
+};
+
+int elfcore_write_segments(int fd, const struct elfcore_segment *segs,
+                           size_t nsegs, const struct elfcore_soc *soc)
+{
+    uint8_t buf[ELFCORE_DATA_OFFSET] = { 0 };
+    struct elfcore_header *hdr = (void *)buf;
+    size_t remaining = sizeof(buf);
+    uint64_t offset = ELFCORE_DATA_OFFSET;
+    uint8_t *cursor = buf;
+    ssize_t egress;
+    size_t i;
+
+    _Static_assert(sizeof(*hdr) <= ELFCORE_DATA_OFFSET, "ELF headers overrun");
+
+    if (nsegs > ELFCORE_MAX_SEGMENTS)
+        return -E2BIG;
+
+    memcpy(hdr->ehdr.e_ident, ELFMAG, SELFMAG);
+    hdr->ehdr.e_ident[EI_CLASS] = ELFCLASS32;
+    hdr->ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+    hdr->ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+    hdr->ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+    hdr->ehdr.e_type = htole16(ET_CORE);
+    hdr->ehdr.e_machine = htole16(EM_ARM);
+    hdr->ehdr.e_version = htole32(EV_CURRENT);
+    hdr->ehdr.e_flags = htole32(EF_ARM_EABI_VER5);
+    hdr->ehdr.e_phoff = htole32(offsetof(struct elfcore_header, phdr));
+    hdr->ehdr.e_ehsize = htole16(sizeof(hdr->ehdr));
+    hdr->ehdr.e_phentsize = htole16(sizeof(hdr->phdr[0]));
+    hdr->ehdr.e_phnum = htole16(1 + nsegs);
+
+    hdr->phdr[0].p_type = htole32(PT_NOTE);
+    hdr->phdr[0].p_offset = htole32(offsetof(struct elfcore_header, note));
+    hdr->phdr[0].p_filesz = htole32(sizeof(hdr->note));
+    hdr->phdr[0].p_align = htole32(4);
+
+    /* There's no MMU view of a raw dump, so addresses are physical in both */
+    for (i = 0; i < nsegs; i++) {
+        Elf32_Phdr *phdr = &hdr->phdr[1 + i];
+
+        if (offset + segs[i].len > UINT32_MAX)
+            return -EFBIG;
+
+        phdr->p_type = htole32(PT_LOAD);
+        phdr->p_offset = htole32(offset);
+        phdr->p_vaddr = htole32(segs[i].phys);
+        phdr->p_paddr = htole32(segs[i].phys);
+        phdr->p_filesz = htole32(segs[i].len);
+        phdr->p_memsz = htole32(segs[i].len);
+        phdr->p_flags = htole32(PF_R | PF_W | PF_X);
+        /* Mappable in place where the file and memory page offsets agree */
+        phdr->p_align = htole32((offset ^ segs[i].phys) & (ELFCORE_DATA_OFFSET - 1) ?
+                                1 : ELFCORE_DATA_OFFSET);
+
+        offset += segs[i].len;
+    }
+
+    hdr->note.nhdr.n_namesz = htole32(sizeof(ELFCORE_NOTE_NAME));
+    hdr->note.nhdr.n_descsz = htole32(sizeof(hdr->note.desc));
+    hdr->note.nhdr.n_type = htole32(ELFCORE_NOTE_SOC);
+    memcpy(hdr->note.name, ELFCORE_NOTE_NAME, sizeof(ELFCORE_NOTE_NAME));
+    hdr->note.desc.rev = htole32(soc->rev);
+    hdr->note.desc.dram_start = htole32(soc->dram_start);
+    hdr->note.desc.dram_length = htole32(soc->dram_length);
+    hdr->note.desc.vram_start = htole32(soc->vram_start);
+    hdr->note.desc.vram_length = htole32(soc->vram_length);
+
+    while (remaining) {
+        if ((egress = write(fd, cursor, remaining)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        cursor += egress;
+        remaining -= egress;
+    }
+
+    return 0;
+}
+
+int elfcore_write_header(int fd, uint32_t phys, uint32_t len,
+                         const struct elfcore_soc *soc)
+{
+    const struct elfcore_segment seg = { .phys = phys, .len = len };
+
+    return elfcore_write_segments(fd, &seg, 1, soc);
+}
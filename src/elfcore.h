@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _ELFCORE_H
+#define _ELFCORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Where the memory image starts in the file, so it can be mapped in place */
+#define ELFCORE_DATA_OFFSET 4096
+
+/* As many program headers as fit ahead of ELFCORE_DATA_OFFSET */
+#define ELFCORE_MAX_SEGMENTS 96
+
+/* Describes the BMC the memory came from, as a little-endian "CULVERT" note */
+struct elfcore_soc {
+    uint32_t rev;
+    uint32_t dram_start;
+    uint32_t dram_length;
+    uint32_t vram_start;
+    uint32_t vram_length;
+};
+
+struct elfcore_segment {
+    uint32_t phys;
+    uint32_t len;
+};
+
+/*
+ * Writes the ELF header, program headers and note for a core holding @len
+ * bytes of memory from @phys, then pads up to ELFCORE_DATA_OFFSET. The fd is
+ * left where the memory image goes, which is written separately.
+ */
+int elfcore_write_header(int fd, uint32_t phys, uint32_t len,
+                         const struct elfcore_soc *soc);
+
+/*
+ * As elfcore_write_header(), for a core whose memory is the @nsegs segments
+ * laid out back to back in the order given. Written in that order, a core cut
+ * short still describes the segments that made it whole.
+ */
+int elfcore_write_segments(int fd, const struct elfcore_segment *segs,
+                           size_t nsegs, const struct elfcore_soc *soc);
+
+#endif
@@ -0,0 +1,103 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "fill.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define FILL_HAVE_SSE2 1
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#define FILL_HAVE_NEON 1
+#endif
+
+/*
+ * Bytes compared between checks for a difference. There's no early exit
+ * inside a stride, so data is given up on within one and a repeated byte
+ * runs at the speed of the loads.
+ */
+#define FILL_STRIDE 256
+
+static inline uint64_t fill_load64(const uint8_t *p)
+{
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+/* Whether all @len bytes of @p are @b */
+static bool fill_is_repeated(const uint8_t *p, size_t len, uint8_t b)
+{
+    uint64_t pat64 = 0x0101010101010101ULL * b;
+    uint64_t acc64 = 0;
+    size_t i = 0, j;
+
+#if defined(FILL_HAVE_SSE2)
+    const __m128i pat = _mm_set1_epi8(b);
+    __m128i acc = _mm_setzero_si128();
+
+    for (; i + FILL_STRIDE <= len; i += FILL_STRIDE) {
+        for (j = 0; j < FILL_STRIDE; j += 16) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i + j));
+
+            acc = _mm_or_si128(acc, _mm_xor_si128(v, pat));
+        }
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(acc, _mm_setzero_si128())) != 0xffff)
+            return false;
+    }
+#elif defined(FILL_HAVE_NEON)
+    const uint8x16_t pat = vdupq_n_u8(b);
+    uint8x16_t acc = vdupq_n_u8(0);
+
+    for (; i + FILL_STRIDE <= len; i += FILL_STRIDE) {
+        for (j = 0; j < FILL_STRIDE; j += 16)
+            acc = vorrq_u8(acc, veorq_u8(vld1q_u8(p + i + j), pat));
+        if (vmaxvq_u8(acc))
+            return false;
+    }
+#else
+    for (; i + FILL_STRIDE <= len; i += FILL_STRIDE) {
+        for (j = 0; j < FILL_STRIDE; j += 8)
+            acc64 |= fill_load64(p + i + j) ^ pat64;
+        if (acc64)
+            return false;
+    }
+#endif
+
+    for (; i + 8 <= len; i += 8)
+        acc64 |= fill_load64(p + i) ^ pat64;
+    if (acc64)
+        return false;
+
+    for (; i < len; i++) {
+        if (p[i] != b)
+            return false;
+    }
+
+    return true;
+}
+
+enum fill fill_classify(const void *buf, size_t len, uint8_t *byte)
+{
+    const uint8_t *p = buf;
+
+    if (!len)
+        return fill_uniform;
+
+    if (!fill_is_repeated(p, len, p[0]))
+        return fill_data;
+
+    if (byte)
+        *byte = p[0];
+
+    switch (p[0]) {
+        case 0x00:
+            return fill_zero;
+        case 0xff:
+            return fill_ones;
+        default:
+            return fill_uniform;
+    }
+}
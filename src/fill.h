@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _FILL_H
+#define _FILL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * What a block holds: all zeros as a sparse dump skips, all ones as erased
+ * flash reads, some other byte throughout, or anything else
+ */
+enum fill { fill_data, fill_zero, fill_ones, fill_uniform };
+
+/*
+ * Classify @len bytes in one pass, with SSE2 or NEON where the CPU has them.
+ * Unless it's data, @byte if not NULL is set to the repeated value. An empty
+ * buffer is uniform without a value.
+ */
+enum fill fill_classify(const void *buf, size_t len, uint8_t *byte);
+
+static inline bool fill_is_zero(const void *buf, size_t len)
+{
+    return !len || fill_classify(buf, len, NULL) == fill_zero;
+}
+
+static inline bool fill_is_ones(const void *buf, size_t len)
+{
+    return !len || fill_classify(buf, len, NULL) == fill_ones;
+}
+
+#endif
@@ -8,34 +8,64 @@
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
 
+#include "ahb.h"
+#include "bufpool.h"
+#include "fill.h"
 #include "flash.h"
 #include "log.h"
+#include "progress.h"
+#include "span.h"
+#include "timing.h"
 
 #ifndef MIN
 #define MIN(a, b)	((a) < (b) ? (a) : (b))
 #endif
 
+/* Ranges this small are read back rather than checked in place */
+#define FLASH_VERIFY_LEAF	0x1000
+
+/* Smart writes plan this much flash at a time, in whole erase blocks */
+#define FLASH_PLAN_WINDOW	0x100000
+#define FLASH_COMP_STRIDE	0x100
+
+/* Bounds on the interval between status polls while the chip is busy */
+#define FL_POLL_MIN_US		50
+#define FL_POLL_MAX_US		100000
+
+/* Serial Flash Discoverable Parameters, JESD216 */
+#define SFDP_SIGNATURE		0x50444653	/* "SFDP" */
+#define SFDP_ID_BFPT		0xff00		/* Basic flash parameters */
+#define SFDP_ID_4BAIT		0xff84		/* 4B address instructions */
+#define SFDP_MAX_HEADERS	16
+#define SFDP_MAX_DWORDS		16
+
 #define FL_ERR(fmt, ...) loge(fmt, ##__VA_ARGS__)
 #define FL_DBG(fmt, ...) logd(fmt, ##__VA_ARGS__)
 
 static const struct flash_info flash_info[] = {
 	{ 0xc22018, 0x01000000, FL_ERASE_ALL | FL_CAN_4B, "Macronix MXxxL12835F"},
-	{ 0xc22019, 0x02000000, FL_ERASE_ALL | FL_CAN_4B, "Macronix MXxxL25635F"},
-	{ 0xc2201a, 0x04000000, FL_ERASE_ALL | FL_CAN_4B, "Macronix MXxxL51235F"},
-	{ 0xc2201b, 0x08000000, FL_ERASE_ALL | FL_CAN_4B, "Macronix MX66L1G45G"},
+	{ 0xc22019, 0x02000000, FL_ERASE_ALL | FL_CAN_4B | FL_4B_OPS,
+							"Macronix MXxxL25635F"},
+	{ 0xc2201a, 0x04000000, FL_ERASE_ALL | FL_CAN_4B | FL_4B_OPS,
+							"Macronix MXxxL51235F"},
+	{ 0xc2201b, 0x08000000, FL_ERASE_ALL | FL_CAN_4B | FL_4B_OPS,
+							"Macronix MX66L1G45G"},
 	{ 0xef4018, 0x01000000, FL_ERASE_ALL,             "Winbond W25Q128BV"   },
 	{ 0xef4019, 0x02000000, FL_ERASE_ALL | FL_ERASE_64K | FL_CAN_4B |
-				FL_ERASE_BULK,
+				FL_ERASE_BULK | FL_4B_OPS,
 							"Winbond W25Q256BV"},
 	{ 0xef4020, 0x04000000, FL_ERASE_ALL | FL_ERASE_64K | FL_CAN_4B |
-				FL_ERASE_BULK,
+				FL_ERASE_BULK | FL_4B_OPS,
 							"Winbond W25Q512JV"},
 	{ 0xef4021, 0x08000000, FL_ERASE_ALL | FL_ERASE_64K | FL_CAN_4B |
-				FL_ERASE_BULK,
+				FL_ERASE_BULK | FL_4B_OPS,
 							"Winbond W25Q01JV"},
 	{ 0x20ba20, 0x04000000, FL_ERASE_4K  | FL_ERASE_64K | FL_CAN_4B |
-                                FL_ERASE_BULK | FL_MICRON_BUGS,
+                                FL_ERASE_BULK | FL_MICRON_BUGS | FL_4B_OPS,
                                                           "Micron N25Qx512Ax"   },
 	{ 0x20ba19, 0x02000000, FL_ERASE_4K  | FL_ERASE_64K | FL_CAN_4B |
                                 FL_ERASE_BULK | FL_MICRON_BUGS,
@@ -65,13 +95,81 @@ static void fl_micron_status(struct sfc *ct)
 	ct->cmd_rd(ct, CMD_MIC_RDFLST, false, 0, &flst, 1);
 }
 
-/* Synchronous write completion, probably need a yield hook */
-static int fl_sync_wait_idle(struct sfc *ct)
+/* What the chip is busy with, which tells us how long to expect it to take */
+enum fl_busy {
+	fl_busy_unknown,
+	fl_busy_program,
+	fl_busy_erase_4k,
+	fl_busy_erase_32k,
+	fl_busy_erase_64k,
+	fl_busy_erase_chip,
+};
+
+/*
+ * Typical and maximum times in microseconds, from the Macronix, Winbond and
+ * Micron parts in flash_info[]. The typical times are the lower of the lot
+ * so faster parts aren't held up, the maximums the highest so slower parts
+ * aren't failed. Chip erase scales with the size of the chip.
+ */
+static const struct {
+	uint64_t typ;
+	uint64_t max;
+} fl_busy_times[] = {
+	[fl_busy_unknown]	= {      0,       0 },
+	[fl_busy_program]	= {    300,    5000 },
+	[fl_busy_erase_4k]	= {  40000,  800000 },
+	[fl_busy_erase_32k]	= { 120000, 1600000 },
+	[fl_busy_erase_64k]	= { 150000, 3000000 },
+	[fl_busy_erase_chip]	= {      0,       0 },
+};
+
+/* Per 64K of chip, for chip erase */
+#define FL_CE_TYP_US		120000
+#define FL_CE_MAX_US		3000000
+
+static uint64_t fl_now_us(void)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+/*
+ * Synchronous write completion. Each status poll can be a full command
+ * sequence over a slow bridge, so sleep through the typical time for the
+ * operation before looking, then back off exponentially until the maximum.
+ */
+static void fl_busy_limits(struct sfc *ct, enum fl_busy busy, uint64_t *typ,
+			   uint64_t *max)
 {
+	*typ = fl_busy_times[busy].typ;
+	*max = fl_busy_times[busy].max;
+
+	/* We may have walked in on a chip erase */
+	if (busy == fl_busy_erase_chip || busy == fl_busy_unknown) {
+		uint64_t blocks = (ct->finfo->size + 0xffff) >> 16;
+
+		*typ = busy == fl_busy_erase_chip ? blocks * FL_CE_TYP_US : 0;
+		*max = blocks * FL_CE_MAX_US;
+	}
+}
+
+static int fl_sync_wait_idle(struct sfc *ct, enum fl_busy busy)
+{
+	uint64_t typ, max;
+	uint64_t start, delay;
 	uint8_t stat;
 	int rc;
 
-	/* XXX Add timeout */
+	fl_busy_limits(ct, busy, &typ, &max);
+
+	start = fl_now_us();
+	if (typ)
+		ahb_usleep(ct->priv, typ);
+
+	delay = typ / 8 > FL_POLL_MIN_US ? typ / 8 : FL_POLL_MIN_US;
 	for (;;) {
 		rc = fl_read_stat(ct, &stat);
 		if (rc) return rc;
@@ -80,8 +178,62 @@ static int fl_sync_wait_idle(struct sfc *ct)
 				fl_micron_status(ct);
 			return 0;
 		}
+		if (fl_now_us() - start > max) {
+			FL_ERR("LIBFLASH: Timed out waiting for the chip\n");
+			return -ETIMEDOUT;
+		}
+		ahb_usleep(ct->priv, delay);
+		delay = MIN(delay * 2, FL_POLL_MAX_US);
+	}
+}
+
+/*
+ * For characterisation, poll status back to back rather than sleeping, so the
+ * busy time is resolved to a single poll.
+ */
+static int fl_timed_wait_idle(struct sfc *ct, enum fl_busy busy,
+			      struct flash_timing *timing)
+{
+	uint64_t typ, max;
+	uint64_t start;
+	uint8_t stat;
+	int rc;
+
+	fl_busy_limits(ct, busy, &typ, &max);
+
+	start = fl_now_us();
+	timing->polls = 0;
+	for (;;) {
+		rc = fl_read_stat(ct, &stat);
+		if (rc) return rc;
+		timing->polls++;
+		if (!(stat & STAT_WIP))
+			break;
+		if (fl_now_us() - start > max) {
+			FL_ERR("LIBFLASH: Timed out waiting for the chip\n");
+			return -ETIMEDOUT;
+		}
+	}
+	timing->busy_us = fl_now_us() - start;
+
+	if (ct->finfo->flags & FL_MICRON_BUGS)
+		fl_micron_status(ct);
+
+	return 0;
+}
+
+static enum fl_busy fl_erase_busy(uint8_t cmd)
+{
+	switch (cmd) {
+	case CMD_SE:
+		return fl_busy_erase_4k;
+	case CMD_BE32K:
+		return fl_busy_erase_32k;
+	case CMD_BE:
+		return fl_busy_erase_64k;
+	default:
+		return fl_busy_unknown;
 	}
-	/* return FLASH_ERR_WIP_TIMEOUT; */
 }
 
 /* Exported for internal use */
@@ -98,7 +250,7 @@ static int fl_wren(struct sfc *ct)
 		if (rc) return rc;
 		if (stat & STAT_WIP) {
 			FL_ERR("LIBFLASH: WREN has WIP status set !\n");
-			rc = fl_sync_wait_idle(ct);
+			rc = fl_sync_wait_idle(ct, fl_busy_unknown);
 			if (rc)
 				return rc;
 			continue;
@@ -109,6 +261,32 @@ static int fl_wren(struct sfc *ct)
 	return -ETIMEDOUT;
 }
 
+/* The 4B address form of @cmd if the chip is addressed that way */
+static uint8_t fl_cmd(struct flash_chip *c, uint8_t cmd)
+{
+	if (!c->native_4b)
+		return cmd;
+
+	switch (cmd) {
+	case CMD_READ:
+		return CMD_READ4;
+	case CMD_PP:
+		return CMD_PP4;
+	case CMD_SE:
+		return CMD_SE4;
+	case CMD_BE:
+		return CMD_BE4;
+	}
+
+	return cmd;
+}
+
+/* Bytes from @pos to the end of its page */
+static uint32_t fl_page_left(struct flash_chip *c, uint32_t pos)
+{
+	return c->page_size - (pos & (c->page_size - 1));
+}
+
 int flash_read(struct flash_chip *c, uint64_t pos, void *buf, uint64_t len)
 {
 	struct sfc *ct = c->ctrl;
@@ -126,7 +304,7 @@ int flash_read(struct flash_chip *c, uint64_t pos, void *buf, uint64_t len)
 	/* Otherwise, go manual if supported */
 	if (!ct->cmd_rd)
 		return -EOPNOTSUPP;
-	return ct->cmd_rd(ct, CMD_READ, true, pos, buf, len);
+	return ct->cmd_rd(ct, fl_cmd(c, CMD_READ), true, pos, buf, len);
 }
 
 #define COPY_BUFFER_LENGTH 4096
@@ -134,6 +312,12 @@ int flash_read(struct flash_chip *c, uint64_t pos, void *buf, uint64_t len)
 static void fl_get_best_erase(struct flash_chip *c, uint32_t dst, uint32_t size,
 			      uint32_t *chunk, uint8_t *cmd)
 {
+	uint32_t flags = c->info.flags;
+
+	/* There's no 4B address 32k erase common to the chips */
+	if (c->native_4b)
+		flags &= ~FL_ERASE_32K;
+
 	/* Smaller than 32k, use 4k */
 	if ((dst & 0x7fff) || (size < 0x8000)) {
 		*chunk = 0x1000;
@@ -141,15 +325,15 @@ static void fl_get_best_erase(struct flash_chip *c, uint32_t dst, uint32_t size,
 		return;
 	}
 	/* Smaller than 64k and 32k is supported, use it */
-	if ((c->info.flags & FL_ERASE_32K) &&
+	if ((flags & FL_ERASE_32K) &&
 	    ((dst & 0xffff) || (size < 0x10000))) {
 		*chunk = 0x8000;
 		*cmd = CMD_BE32K;
 		return;
 	}
 	/* If 64K is not supported, use whatever smaller size is */
-	if (!(c->info.flags & FL_ERASE_64K)) {
-		if (c->info.flags & FL_ERASE_32K) {
+	if (!(flags & FL_ERASE_64K)) {
+		if (flags & FL_ERASE_32K) {
 			*chunk = 0x8000;
 			*cmd = CMD_BE32K;
 		} else {
@@ -166,7 +350,9 @@ static void fl_get_best_erase(struct flash_chip *c, uint32_t dst, uint32_t size,
 int flash_erase(struct flash_chip *c, uint64_t dst, uint64_t size)
 {
 	struct sfc *ct = c->ctrl;
+	struct progress progress;
 	uint32_t chunk;
+	uint64_t span;
 	uint8_t cmd;
 	int rc;
 
@@ -186,9 +372,12 @@ int flash_erase(struct flash_chip *c, uint64_t dst, uint64_t size)
 		return ct->erase(ct, dst, size);
 
 	/* Allright, loop as long as there's something to erase */
+	progress_init(&progress, "erase", size);
+	progress_set_base(&progress, dst);
 	while(size) {
 		/* How big can we make it based on alignent & size */
 		fl_get_best_erase(c, dst, size, &chunk, &cmd);
+		span = span_begin();
 
 		/* Poke write enable */
 		rc = fl_wren(ct);
@@ -196,22 +385,23 @@ int flash_erase(struct flash_chip *c, uint64_t dst, uint64_t size)
 			return rc;
 
 		/* Send erase command */
-		rc = ct->cmd_wr(ct, cmd, true, dst, NULL, 0);
+		rc = ct->cmd_wr(ct, fl_cmd(c, cmd), true, dst, NULL, 0);
 		if (rc)
 			return rc;
 
 		/* Wait for write complete */
-		rc = fl_sync_wait_idle(ct);
+		rc = fl_sync_wait_idle(ct, fl_erase_busy(cmd));
 		if (rc)
 			return rc;
 
-		fprintf(stderr, ".");
+		span_end("flash", "erase", span, dst, chunk);
+		progress_update(&progress, chunk);
 
 		size -= chunk;
 		dst += chunk;
 	}
 
-	fprintf(stderr, "\n");
+	progress_end(&progress);
 
 	return 0;
 }
@@ -242,37 +432,198 @@ int flash_erase_chip(struct flash_chip *c)
 		return rc;
 
 	/* Wait for write complete */
-	return fl_sync_wait_idle(ct);
+	return fl_sync_wait_idle(ct, fl_busy_erase_chip);
 }
 
-static int fl_wpage(struct flash_chip *c, uint32_t dst, const void *src,
-		    uint32_t size)
+int flash_erase_timed(struct flash_chip *c, uint32_t dst, uint32_t size,
+		      struct flash_timing *timing)
 {
+	uint32_t flags = c->info.flags;
 	struct sfc *ct = c->ctrl;
+	uint64_t start;
+	bool chip;
+	uint8_t cmd;
 	int rc;
 
-	if (size < 1 || size > 0x100)
+	if (ct->erase)
+		return -EOPNOTSUPP;
+
+	chip = size == c->tsize;
+	if (chip && (flags & FL_ERASE_CHIP))
+		cmd = CMD_CE;
+	else if (chip && (flags & FL_ERASE_BULK))
+		cmd = CMD_MIC_BULK_ERASE;
+	else if (size == 0x1000 && (flags & FL_ERASE_4K))
+		cmd = CMD_SE;
+	else if (size == 0x8000 && (flags & FL_ERASE_32K) && !c->native_4b)
+		cmd = CMD_BE32K;
+	else if (size == 0x10000 && (flags & FL_ERASE_64K))
+		cmd = CMD_BE;
+	else
+		return -EOPNOTSUPP;
+
+	if ((dst & (size - 1)) || dst + size > c->tsize)
 		return -EINVAL;
 
+	start = fl_now_us();
+
 	rc = fl_wren(ct);
-	if (rc) return rc;
+	if (rc)
+		return rc;
 
-	rc = ct->cmd_wr(ct, CMD_PP, true, dst, src, size);
+	rc = ct->cmd_wr(ct, fl_cmd(c, cmd), !chip, dst, NULL, 0);
 	if (rc)
 		return rc;
 
+	timing->issue_us = fl_now_us() - start;
+
+	return fl_timed_wait_idle(ct, chip ? fl_busy_erase_chip :
+				  fl_erase_busy(cmd), timing);
+}
+
+int flash_program_timed(struct flash_chip *c, uint32_t dst, const void *src,
+			uint32_t size, struct flash_timing *timing)
+{
+	struct sfc *ct = c->ctrl;
+	uint64_t start;
+	int rc;
+
+	if (size < 1 || size > fl_page_left(c, dst) || dst + size > c->tsize)
+		return -EINVAL;
+
+	start = fl_now_us();
+
+	if (ct->program) {
+		rc = ct->program(ct, fl_cmd(c, CMD_PP), dst, src, size);
+		if (rc)
+			return rc;
+	} else {
+		rc = fl_wren(ct);
+		if (rc) return rc;
+
+		rc = ct->cmd_wr(ct, fl_cmd(c, CMD_PP), true, dst, src, size);
+		if (rc)
+			return rc;
+	}
+
+	timing->issue_us = fl_now_us() - start;
+
+	return fl_timed_wait_idle(ct, fl_busy_program, timing);
+}
+
+static int fl_wpage(struct flash_chip *c, uint32_t dst, const void *src,
+		    uint32_t size)
+{
+	struct sfc *ct = c->ctrl;
+	uint64_t span;
+	int rc;
+
+	if (size < 1 || size > c->page_size)
+		return -EINVAL;
+
+	span = span_begin();
+
+	if (ct->program) {
+		rc = ct->program(ct, fl_cmd(c, CMD_PP), dst, src, size);
+		if (rc)
+			return rc;
+	} else {
+		rc = fl_wren(ct);
+		if (rc) return rc;
+
+		rc = ct->cmd_wr(ct, fl_cmd(c, CMD_PP), true, dst, src, size);
+		if (rc)
+			return rc;
+	}
+
 	/* Wait for write complete */
-	return fl_sync_wait_idle(ct);
+	rc = fl_sync_wait_idle(ct, fl_busy_program);
+	if (rc)
+		return rc;
+
+	span_end("flash", "program", span, dst, size);
+
+	return 0;
+}
+
+static int flash_verify_read(struct flash_chip *c, uint32_t dst,
+			     const uint8_t *src, uint32_t size,
+			     struct progress *progress)
+{
+	uint8_t vbuf[FLASH_VERIFY_LEAF];
+	int rc;
+
+	while (size) {
+		uint32_t chunk, i;
+
+		chunk = sizeof(vbuf);
+		if (chunk > size)
+			chunk = size;
+		rc = flash_read(c, dst, vbuf, chunk);
+		if (rc) return rc;
+		if (memcmp(vbuf, src, chunk)) {
+			for (i = 0; vbuf[i] == src[i]; i++)
+				;
+			FL_ERR("LIBFLASH: Miscompare at 0x%08x\n", dst + i);
+			return -EREMOTEIO;
+		}
+		dst += chunk;
+		src += chunk;
+		size -= chunk;
+
+		progress_update(progress, chunk);
+	}
+
+	return 0;
+}
+
+/*
+ * Have the controller compare large ranges in place, and only read back the
+ * parts it can't vouch for. A failed in-place check is narrowed down by
+ * halving the range, so a single bad page costs a handful of checks and one
+ * small read rather than a read of the whole range.
+ */
+static int flash_verify(struct flash_chip *c, uint32_t dst, const uint8_t *src,
+			uint32_t size, struct progress *progress)
+{
+	struct sfc *ct = c->ctrl;
+	uint32_t half;
+	int rc;
+
+	if (!ct->verify || size <= FLASH_VERIFY_LEAF)
+		return flash_verify_read(c, dst, src, size, progress);
+
+	rc = ct->verify(ct, dst, src, size);
+	if (!rc) {
+		progress_update(progress, size);
+		return 0;
+	}
+	if (rc == -EOPNOTSUPP)
+		return flash_verify_read(c, dst, src, size, progress);
+	if (rc != -EREMOTEIO)
+		return rc;
+
+	FL_DBG("LIBFLASH: In-place verify of 0x%08x..0x%08x failed\n",
+	       dst, dst + size);
+
+	/* Keep the split page aligned so the halves stay word aligned too */
+	half = (size / 2 + 0xff) & ~0xffu;
+
+	rc = flash_verify(c, dst, src, half, progress);
+	if (rc)
+		return rc;
+
+	return flash_verify(c, dst + half, src + half, size - half, progress);
 }
 
 int flash_write(struct flash_chip *c, uint32_t dst, const void *src,
 		uint32_t size, bool verify)
 {
 	struct sfc *ct = c->ctrl;
+	struct progress progress;
 	uint32_t todo = size;
 	uint32_t d = dst;
 	const void *s = src;
-	uint8_t vbuf[0x100];
 	int rc;	
 
 	/* Some sanity checking */
@@ -298,11 +649,13 @@ int flash_write(struct flash_chip *c, uint32_t dst, const void *src,
 		return -EOPNOTSUPP;
 
 	/* Iterate for each page to write */
+	progress_init(&progress, "write", size);
+	progress_set_base(&progress, dst);
 	while(todo) {
 		uint32_t chunk;
 
 		/* Handle misaligned start */
-		chunk = 0x100 - (d & 0xff);
+		chunk = fl_page_left(c, d);
 		if (chunk > todo)
 			chunk = todo;
 
@@ -312,9 +665,9 @@ int flash_write(struct flash_chip *c, uint32_t dst, const void *src,
 		s += chunk;
 		todo -= chunk;
 
-		fprintf(stderr, ".");
+		progress_update(&progress, chunk);
 	}
-	fprintf(stderr, "\n");
+	progress_end(&progress);
 
  writing_done:
 	if (!verify)
@@ -322,66 +675,331 @@ int flash_write(struct flash_chip *c, uint32_t dst, const void *src,
 
 	/* Verify */
 	FL_DBG("LIBFLASH: Verifying...\n");
+	progress_init(&progress, "verify", size);
+	progress_set_base(&progress, dst);
+	rc = flash_verify(c, dst, src, size, &progress);
+	progress_end(&progress);
 
-	while(size) {
-		uint32_t chunk;
+	return rc;
+}
 
-		chunk = sizeof(vbuf);
-		if (chunk > size)
-			chunk = size;
-		rc = flash_read(c, dst, vbuf, chunk);
-		if (rc) return rc;
-		if (memcmp(vbuf, src, chunk)) {
-			FL_ERR("LIBFLASH: Miscompare at 0x%08x\n", dst);
-			return -EREMOTEIO;
+/*
+ * The kernels below work a 64-bit word at a time, with no early exit inside
+ * a stride, so that compilers can turn the inner loops into vector code.
+ */
+static inline uint64_t flash_load64(const uint8_t *p)
+{
+	uint64_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+enum sm_comp_res flash_smart_comp(const uint8_t *b, const uint8_t *s,
+				  uint32_t size)
+{
+	uint64_t need = 0, diff = 0;
+	uint32_t i, j;
+
+	/* SRC DEST  NEED_ERASE
+	 *  0   1       0
+	 *  1   1       0
+	 *  0   0       0
+	 *  1   0       1
+	 */
+	for (i = 0; i + FLASH_COMP_STRIDE <= size; i += FLASH_COMP_STRIDE) {
+		for (j = 0; j < FLASH_COMP_STRIDE; j += 8) {
+			uint64_t sw = flash_load64(s + i + j);
+			uint64_t bw = flash_load64(b + i + j);
+
+			/* Any bit need to be set, need erase */
+			need |= sw & ~bw;
+			diff |= sw ^ bw;
+		}
+		if (need)
+			return sm_need_erase;
+	}
+	for (; i < size; i++) {
+		need |= s[i] & ~b[i];
+		diff |= s[i] ^ b[i];
+	}
+
+	if (need)
+		return sm_need_erase;
+
+	return diff ? sm_need_write : sm_no_change;
+}
+
+/*
+ * Program the pages of @want that differ from @have, which is what the flash
+ * holds in the range, coalescing consecutive pages into single writes.
+ * Pages that only differ in bits already clear are fine to program over.
+ * A NULL @have is an erased range.
+ */
+static int flash_write_changed(struct flash_chip *c, uint32_t dst,
+			       const uint8_t *want, const uint8_t *have,
+			       uint32_t size, bool verify)
+{
+	uint32_t off = 0;
+	int rc;
+
+	while (off < size) {
+		uint32_t run = off, chunk;
+
+		while (run < size) {
+			chunk = MIN(fl_page_left(c, dst + run), size - run);
+			if (have ? !memcmp(want + run, have + run, chunk) :
+				   fill_is_ones(want + run, chunk))
+				break;
+			run += chunk;
 		}
-		dst += chunk;
-		src += chunk;
-		size -= chunk;
 
-		fprintf(stderr, ".");
+		if (run > off) {
+			rc = flash_write(c, dst + off, want + off, run - off,
+					 verify);
+			if (rc)
+				return rc;
+			c->smart_stats.programmed += run - off;
+		}
+
+		/* Skip the page that stopped the run, it's already right */
+		if (run < size)
+			run += MIN(fl_page_left(c, dst + run), size - run);
+
+		off = run;
 	}
-	fprintf(stderr, "\n");
+
 	return 0;
 }
 
-enum sm_comp_res {
-	sm_no_change,
-	sm_need_write,
-	sm_need_erase,
+/* Two planning windows, each the current and wanted contents */
+#define FLASH_SMART_BUF		(4 * FLASH_PLAN_WINDOW)
+
+/*
+ * Held from the first smart write until the chip is destroyed, and also
+ * used by flash_smart_plan()
+ */
+static uint8_t *fl_smart_buf(struct flash_chip *c)
+{
+	if (!c->smart_buf) {
+		c->smart_buf = bufpool_get(FLASH_SMART_BUF);
+		if (!c->smart_buf)
+			FL_ERR("LIBFLASH: Failed to allocate smart buffer !\n");
+	}
+
+	return c->smart_buf;
+}
+
+/* One window of erase blocks, what it holds, should hold, and the plan */
+struct fl_smart_win {
+	const struct flash_chip *c;
+	uint32_t base;
+	uint32_t len;
+	/* Where @src lands in the window, the rest keeps what's there */
+	uint32_t off;
+	const void *src;
+	uint32_t size;
+	uint8_t *have;
+	uint8_t *want;
+	enum sm_comp_res plan[FLASH_PLAN_WINDOW / 0x1000];
+	bool dirty;
+	uint64_t same;
 };
 
-static enum sm_comp_res flash_smart_comp(struct flash_chip *c,
-					 const void *src,
-					 uint32_t offset, uint32_t size)
+/*
+ * Covers as many whole erase blocks from @dst as fit in a window, and reads
+ * what they hold. The bridge and chip are needed, the planning isn't.
+ */
+static int flash_smart_load(struct flash_chip *c, struct fl_smart_win *win,
+			    uint32_t dst, uint32_t end, const void *src)
 {
-	uint8_t *b = c->smart_buf + offset;
-	const uint8_t *s = src;
-	bool is_same = true;
-	uint32_t i;
+	win->c = c;
+	win->base = dst & ~c->min_erase_mask;
+	win->off = dst - win->base;
+	win->len = MIN(FLASH_PLAN_WINDOW,
+		       ((end - win->base) + c->min_erase_mask) &
+		       ~c->min_erase_mask);
+	win->src = src;
+	win->size = MIN(win->len - win->off, end - dst);
+
+	FL_DBG("LIBFLASH:   reading 0x%08x..0x%08x...\n", win->base,
+	       win->base + win->len);
+
+	return flash_read(c, win->base, win->have, win->len);
+}
 
-	/* SRC DEST  NEED_ERASE
-	 *  0   1       0
-	 *  1   1       0
-         *  0   0       0
-         *  1   0       1
-         */
-	for (i = 0; i < size; i++) {
-		/* Any bit need to be set, need erase */
-		if (s[i] & ~b[i])
-			return sm_need_erase;
-		if (is_same && (b[i] != s[i]))
-			is_same = false;
+/*
+ * Classify each block against what we want it to hold. Only touches the
+ * window, so it can run while the chip is busy with the one before.
+ */
+static void *flash_smart_prep(void *arg)
+{
+	struct fl_smart_win *win = arg;
+	uint32_t er_size = win->c->min_erase_mask + 1;
+	uint32_t i, nblocks = win->len / er_size;
+
+	memcpy(win->want, win->have, win->len);
+	memcpy(win->want + win->off, win->src, win->size);
+
+	win->dirty = false;
+	win->same = 0;
+
+	for (i = 0; i < nblocks; i++) {
+		const uint8_t *b = win->have + i * er_size;
+		const uint8_t *w = win->want + i * er_size;
+
+		/* Blank blocks never need an erase, only a look at @want */
+		if (fill_is_ones(b, er_size))
+			win->plan[i] = fill_is_ones(w, er_size) ?
+				       sm_no_change : sm_need_write;
+		else
+			win->plan[i] = flash_smart_comp(b, w, er_size);
+
+		if (win->plan[i] != sm_no_change)
+			win->dirty = true;
+		else
+			win->same += er_size;
+	}
+
+	return NULL;
+}
+
+/*
+ * Erase runs of blocks together so larger erase commands can be used, then
+ * program only the pages that end up differing. They're verified as whole
+ * runs of changed blocks afterwards rather than write by write, so the
+ * in-place check over DMA covers more per command.
+ */
+static int flash_smart_apply(struct flash_chip *c, struct fl_smart_win *win)
+{
+	uint32_t er_size = c->min_erase_mask + 1;
+	uint32_t i, nblocks = win->len / er_size;
+	struct progress progress;
+	uint32_t changed = 0;
+	int rc;
+
+	c->smart_stats.same += win->same;
+
+	if (!win->dirty) {
+		FL_DBG("LIBFLASH:   same !\n");
+		return 0;
+	}
+
+	for (i = 0; i < nblocks; ) {
+		uint32_t run = i;
+
+		while (run < nblocks && win->plan[run] == sm_need_erase)
+			run++;
+
+		if (run == i) {
+			i++;
+			continue;
+		}
+
+		FL_DBG("LIBFLASH:   erasing 0x%08x..0x%08x\n",
+		       win->base + i * er_size, win->base + run * er_size);
+		rc = flash_erase(c, win->base + i * er_size, (run - i) * er_size);
+		if (rc) {
+			FL_DBG("LIBFLASH: erase error %d !\n", rc);
+			return rc;
+		}
+		memset(win->have + i * er_size, 0xff, (run - i) * er_size);
+		c->smart_stats.erased += (run - i) * er_size;
+
+		i = run;
+	}
+
+	rc = flash_write_changed(c, win->base, win->want, win->have, win->len,
+				 false);
+	if (rc) {
+		FL_DBG("LIBFLASH: write error %d !\n", rc);
+		return rc;
+	}
+
+	for (i = 0; i < nblocks; i++) {
+		if (win->plan[i] != sm_no_change)
+			changed += er_size;
+	}
+
+	progress_init(&progress, "verify", changed);
+	progress_set_base(&progress, win->base);
+
+	for (i = 0; i < nblocks; ) {
+		uint32_t run = i;
+
+		while (run < nblocks && win->plan[run] != sm_no_change)
+			run++;
+
+		if (run == i) {
+			i++;
+			continue;
+		}
+
+		rc = flash_verify(c, win->base + i * er_size,
+				  win->want + i * er_size, (run - i) * er_size,
+				  &progress);
+		if (rc)
+			break;
+
+		i = run;
+	}
+
+	progress_end(&progress);
+
+	return rc;
+}
+
+int flash_smart_plan(struct flash_chip *c, uint64_t dst, const void *src,
+		     uint64_t size, struct flash_plan *plan)
+{
+	uint32_t er_size = c->min_erase_mask + 1;
+	const uint8_t *want = src;
+	uint8_t *have;
+	uint64_t off, len, i;
+	int rc;
+
+	if (((dst | size) & c->min_erase_mask) || !size ||
+	    dst + size > c->tsize)
+		return -EINVAL;
+
+	have = fl_smart_buf(c);
+	if (!have)
+		return -ENOMEM;
+
+	plan->blocks = size / er_size;
+	plan->erase = 0;
+
+	for (off = 0; off < size; off += len) {
+		len = MIN(FLASH_PLAN_WINDOW, size - off);
+
+		rc = flash_read(c, dst + off, have, len);
+		if (rc)
+			return rc;
+
+		for (i = 0; i < len; i += er_size) {
+			if (!fill_is_ones(have + i, er_size) &&
+			    flash_smart_comp(have + i, want + off + i, er_size) ==
+			    sm_need_erase)
+				plan->erase++;
+		}
 	}
-	return is_same ? sm_no_change : sm_need_write;
+
+	return 0;
+}
+
+int flash_write_erased(struct flash_chip *c, uint32_t dst, const void *src,
+		       uint32_t size)
+{
+	return flash_write_changed(c, dst, src, NULL, size, true);
 }
 
 int flash_smart_write(struct flash_chip *c, uint64_t dst, const void *src,
 		      uint64_t size)
 {
-	uint32_t er_size = c->min_erase_mask + 1;
+	struct fl_smart_win wins[2], *cur;
 	uint32_t end = dst + size;
-	int rc;
+	uint8_t *buf;
+	int i, rc;
 
 	/* Some sanity checking */
 	if (end <= dst || !size || end > c->tsize) {
@@ -392,63 +1010,57 @@ int flash_smart_write(struct flash_chip *c, uint64_t dst, const void *src,
 	FL_DBG("LIBFLASH: Smart writing to 0x%" PRIx64 "..0%" PRIx64 "...\n",
 	       dst, dst + size);
 
-	/* As long as we have something to write ... */
-	while(dst < end) {
-		uint32_t page, off, chunk;
-		enum sm_comp_res sr;
-
-		/* Figure out which erase page we are in and read it */
-		page = dst & ~c->min_erase_mask;
-		off = dst & c->min_erase_mask;
-		FL_DBG("LIBFLASH:   reading page 0x%08x..0x%08x...",
-		       page, page + er_size);
-		rc = flash_read(c, page, c->smart_buf, er_size);
-		if (rc) {
-			FL_DBG(" error %d!\n", rc);
-			return rc;
-		}
+	buf = fl_smart_buf(c);
+	if (!buf)
+		return -ENOMEM;
 
-		/* Locate the chunk of data we are working on */
-		chunk = er_size - off;
-		if (size < chunk)
-			chunk = size;
+	for (i = 0; i < 2; i++) {
+		wins[i].have = buf + (2 * i) * FLASH_PLAN_WINDOW;
+		wins[i].want = buf + (2 * i + 1) * FLASH_PLAN_WINDOW;
+	}
 
-		/* Compare against what we are writing and ff */
-		sr = flash_smart_comp(c, src, off, chunk);
-		switch(sr) {
-		case sm_no_change:
-			/* Identical, skip it */
-			FL_DBG(" same !\n");
-			break;
-		case sm_need_write:
-			/* Just needs writing over */
-			FL_DBG(" need write !\n");
-			rc = flash_write(c, dst, src, chunk, true);
-			if (rc) {
-				FL_DBG("LIBFLASH: Write error %d !\n", rc);
-				return rc;
-			}
-			break;
-		case sm_need_erase:
-			FL_DBG(" need erase !\n");
-			rc = flash_erase(c, page, er_size);
-			if (rc) {
-				FL_DBG("LIBFLASH: erase error %d !\n", rc);
-				return rc;
-			}
-			/* Then update the portion of the buffer and write the block */
-			memcpy(c->smart_buf + off, src, chunk);
-			rc = flash_write(c, page, c->smart_buf, er_size, true);
-			if (rc) {
-				FL_DBG("LIBFLASH: write error %d !\n", rc);
+	cur = &wins[0];
+	rc = flash_smart_load(c, cur, dst, end, src);
+	if (rc)
+		return rc;
+	flash_smart_prep(cur);
+
+	/*
+	 * Chip reads can't overlap its busy waits, so read the next window
+	 * while the chip is idle, then plan it on another thread while this
+	 * one is erased, programmed and verified.
+	 */
+	while (cur) {
+		struct fl_smart_win *next = NULL;
+		bool threaded = false;
+		pthread_t prep;
+
+		dst += cur->size;
+		src += cur->size;
+
+		if (dst < end) {
+			next = (cur == &wins[0]) ? &wins[1] : &wins[0];
+			rc = flash_smart_load(c, next, dst, end, src);
+			if (rc)
 				return rc;
-			}
-			break;
+
+			threaded = !pthread_create(&prep, NULL, flash_smart_prep,
+						   next);
+			if (!threaded)
+				flash_smart_prep(next);
 		}
-		dst += chunk;
-		src += chunk;
-		size -= chunk;
+
+		rc = flash_smart_apply(c, cur);
+
+		if (threaded)
+			pthread_join(prep, NULL);
+
+		if (rc)
+			return rc;
+
+		cur = next;
 	}
+
 	return 0;
 }
 
@@ -466,7 +1078,7 @@ static int fl_chip_id(struct sfc *ct, uint8_t *id_buf,
 	/* If stuck writing, wait for idle */
 	if (stat & STAT_WIP) {
 		FL_ERR("LIBFLASH: Flash in writing state ! Waiting...\n");
-		rc = fl_sync_wait_idle(ct);
+		rc = fl_sync_wait_idle(ct, fl_busy_unknown);
 		if (rc)
 			return rc;
 	} else
@@ -481,14 +1093,174 @@ static int fl_chip_id(struct sfc *ct, uint8_t *id_buf,
 	return 0;
 }
 
-static int flash_identify(struct flash_chip *c)
+/* The SFDP read takes a 3B address and a dummy byte, clocked in as data */
+static int fl_sfdp_read(struct sfc *ct, uint32_t addr, void *buf,
+			uint32_t len)
 {
-	struct sfc *ct = c->ctrl;
-	const struct flash_info *info = NULL;
-	uint32_t iid, id_size;
+	uint8_t raw[1 + SFDP_MAX_DWORDS * 4];
+	int rc;
+
+	if (len > sizeof(raw) - 1)
+		return -EINVAL;
+
+	rc = ct->cmd_rd(ct, CMD_RDSFDP, true, addr, raw, len + 1);
+	if (rc)
+		return rc;
+
+	memcpy(buf, raw + 1, len);
+
+	return 0;
+}
+
+static uint32_t fl_sfdp_dword(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Read the parameter table @id into @dw, returning how many DWORDs it has */
+static int fl_sfdp_table(struct sfc *ct, const uint8_t *hdrs, int nr,
+			 uint16_t id, uint32_t *dw)
+{
+	uint8_t raw[SFDP_MAX_DWORDS * 4];
+	const uint8_t *h = hdrs;
+	uint32_t ptr;
+	int i, len, rc;
+
+	for (i = 0; i < nr; i++) {
+		h = hdrs + i * 8;
+		if (((h[7] << 8) | h[0]) == id)
+			break;
+	}
+	if (i == nr)
+		return 0;
+
+	len = MIN(h[3], SFDP_MAX_DWORDS);
+	ptr = h[4] | (h[5] << 8) | (h[6] << 16);
+	rc = fl_sfdp_read(ct, ptr, raw, len * 4);
+	if (rc)
+		return rc;
+
+	for (i = 0; i < len; i++)
+		dw[i] = fl_sfdp_dword(raw + i * 4);
+
+	return len;
+}
+
+/*
+ * Discover the chip from its SFDP tables: size, erase sizes with the usual
+ * opcodes, 4B address support, page size and the fastest read the SFC can
+ * issue. The controllers only do single and dual I/O and can't send mode
+ * bits, so that's a 1-1-2 read whose dummy clocks make whole bytes, or
+ * FAST_READ. Returns -ENOENT if the chip has no SFDP.
+ */
+static int fl_sfdp_parse(struct sfc *ct, struct flash_info *info,
+			 struct flash_sfdp *sfdp)
+{
+	uint8_t hdrs[SFDP_MAX_HEADERS * 8];
+	uint32_t bfpt[SFDP_MAX_DWORDS] = { 0 };
+	uint32_t ait[SFDP_MAX_DWORDS] = { 0 };
+	uint8_t hdr[8];
+	int nr, len, i, rc;
+	uint32_t er, dual;
+
+	if (!ct->cmd_rd)
+		return -EOPNOTSUPP;
+
+	rc = fl_sfdp_read(ct, 0, hdr, sizeof(hdr));
+	if (rc)
+		return rc;
+	if (fl_sfdp_dword(hdr) != SFDP_SIGNATURE)
+		return -ENOENT;
+
+	nr = MIN(hdr[6] + 1, SFDP_MAX_HEADERS);
+	rc = fl_sfdp_read(ct, 8, hdrs, nr * 8);
+	if (rc)
+		return rc;
+
+	/* JESD216 has nine DWORDs, the revisions since only add to them */
+	len = fl_sfdp_table(ct, hdrs, nr, SFDP_ID_BFPT, bfpt);
+	if (len < 0)
+		return len;
+	if (len < 9)
+		return -ENOENT;
+
+	memset(info, 0, sizeof(*info));
+	info->flags = FL_ERASE_CHIP;
+
+	if (bfpt[1] & 0x80000000) {
+		if ((bfpt[1] & 0x7fffffff) < 3 || (bfpt[1] & 0x7fffffff) > 34)
+			return -ENOENT;
+		info->size = 1U << ((bfpt[1] & 0x7fffffff) - 3);
+	} else
+		info->size = (bfpt[1] + 1) >> 3;
+
+	/* 3B or 4B addressing, or 4B only */
+	if ((bfpt[0] >> 17) & 3)
+		info->flags |= FL_CAN_4B;
+	/* Later tables say how 4B mode is entered, we send B7h after WREN */
+	if (len >= 16 && !(bfpt[15] & (3 << 24)))
+		info->flags &= ~FL_CAN_4B;
+
+	for (i = 0; i < 4; i++) {
+		er = bfpt[7 + i / 2] >> ((i & 1) * 16);
+		if ((er & 0xffff) == ((CMD_SE << 8) | 12))
+			info->flags |= FL_ERASE_4K;
+		else if ((er & 0xffff) == ((CMD_BE32K << 8) | 15))
+			info->flags |= FL_ERASE_32K;
+		else if ((er & 0xffff) == ((CMD_BE << 8) | 16))
+			info->flags |= FL_ERASE_64K;
+	}
+
+	sfdp->page_size = len >= 11 ? 1U << ((bfpt[10] >> 4) & 0xf) : 0x100;
+
+	sfdp->read_cmd = CMD_FAST_READ;
+	sfdp->read_dummy = 8;
+	dual = bfpt[3] & 0xffff;
+	if ((bfpt[0] & (1 << 16)) && (dual >> 8) == 0x3b &&
+	    !(((dual & 0x1f) + ((dual >> 5) & 7)) & 7) &&
+	    (dual & 0x1f) + ((dual >> 5) & 7) <= 24) {
+		sfdp->read_cmd = dual >> 8;
+		sfdp->read_dummy = (dual & 0x1f) + ((dual >> 5) & 7);
+	}
+
+	/*
+	 * The 4B address instructions must cover READ, FAST_READ and PP, and
+	 * the 4B form of each erase type we'd use must be the usual one
+	 */
+	len = fl_sfdp_table(ct, hdrs, nr, SFDP_ID_4BAIT, ait);
+	if (len < 0)
+		return len;
+	if (len >= 2 && (info->flags & FL_CAN_4B) &&
+	    (ait[0] & 0x43) == 0x43) {
+		info->flags |= FL_4B_OPS;
+		for (i = 0; i < 4; i++) {
+			uint8_t cmd4 = ait[1] >> (i * 8);
+
+			er = (bfpt[7 + i / 2] >> ((i & 1) * 16)) & 0xffff;
+			if (er == ((CMD_SE << 8) | 12))
+				cmd4 = cmd4 == CMD_SE4;
+			else if (er == ((CMD_BE << 8) | 16))
+				cmd4 = cmd4 == CMD_BE4;
+			else
+				continue;
+			if (!cmd4 || !(ait[0] & (1 << (9 + i))))
+				info->flags &= ~FL_4B_OPS;
+		}
+		if ((info->flags & FL_4B_OPS) &&
+		    sfdp->read_cmd != CMD_FAST_READ && !(ait[0] & (1 << 2)))
+			sfdp->read_cmd = CMD_FAST_READ;
+	}
+
+	return 0;
+}
+
+/* Reads the JEDEC ID as a dword, manufacturer in the top byte */
+static int fl_read_iid(struct sfc *ct, uint32_t *iid)
+{
+	uint32_t id_size;
 #define MAX_ID_SIZE	16
 	uint8_t id[MAX_ID_SIZE];
-	int rc, i;
+	int rc;
 
 	if (ct->chip_id) {
 		/* High level controller interface */
@@ -502,12 +1274,22 @@ static int flash_identify(struct flash_chip *c)
 		return -ENXIO;
 
 	/* Convert to a dword for lookup */
-	iid = id[0];
-	iid = (iid << 8) | id[1];
-	iid = (iid << 8) | id[2];
+	*iid = id[0];
+	*iid = (*iid << 8) | id[1];
+	*iid = (*iid << 8) | id[2];
 
 	FL_DBG("LIBFLASH: Flash ID: %02x.%02x.%02x (%06x)\n",
-	       id[0], id[1], id[2], iid);
+	       id[0], id[1], id[2], *iid);
+
+	return 0;
+}
+
+static int flash_identify(struct flash_chip *c, uint32_t iid)
+{
+	struct sfc *ct = c->ctrl;
+	const struct flash_info *info = NULL;
+	struct flash_info sfdp;
+	int rc, i;
 
 	/* Lookup in flash_info */
 	for (i = 0; (size_t)i < ARRAY_SIZE(flash_info); i++) {
@@ -515,11 +1297,29 @@ static int flash_identify(struct flash_chip *c)
 		if (info->id == iid)
 			break;		
 	}
-	if (!info || info->id != iid)
+
+	/*
+	 * Known chips keep their table entry, which has the workarounds the
+	 * SFDP can't tell us about, and take the SFDP page size and read mode.
+	 * Others can still be driven by what their SFDP says.
+	 */
+	rc = fl_sfdp_parse(ct, &sfdp, &c->sfdp);
+	if (rc && rc != -ENOENT && rc != -EOPNOTSUPP)
+		FL_DBG("LIBFLASH: Failed to read SFDP: %d\n", rc);
+	if (info && info->id == iid) {
+		c->info = *info;
+	} else if (!rc && sfdp.size) {
+		sfdp.id = iid;
+		sfdp.name = "SFDP flash";
+		c->info = sfdp;
+		FL_DBG("LIBFLASH: Configured from SFDP, flags 0x%x\n",
+		       sfdp.flags);
+	} else
 		return -ENXIO;
 
-	c->info = *info;
-	c->tsize = info->size;
+	c->page_size = rc ? 0x100 : c->sfdp.page_size;
+	c->tsize = c->info.size;
+	ct->sfdp = rc ? NULL : &c->sfdp;
 	ct->finfo = &c->info;
 
 	/*
@@ -582,6 +1382,29 @@ static int flash_configure(struct flash_chip *c)
 		c->tsize = 0x01000000;
 	}
 
+	/*
+	 * If flash chip > 16M and has the 4B opcodes, only the controller
+	 * needs to send 4 address bytes. The chip's own mode is left alone,
+	 * so an interrupted run can't strand it in one the firmware doesn't
+	 * expect.
+	 */
+	if (c->tsize > 0x01000000 && (c->info.flags & FL_4B_OPS) &&
+	    ct->cmd_wr && ct->set_4b) {
+		FL_DBG("LIBFLASH: Flash >16MB, using 4B opcodes...\n");
+		rc = ct->set_4b(ct, true);
+		if (!rc) {
+			c->native_4b = true;
+			c->mode_4b = true;
+			return 0;
+		}
+		if (rc != -EOPNOTSUPP) {
+			FL_ERR("LIBFLASH: Failed to set controller 4b mode\n");
+			return rc;
+		}
+		/* The controller can't issue them, fall back to 4b mode */
+		c->info.flags &= ~FL_4B_OPS;
+	}
+
 	/* If flash chip > 16M, enable 4b mode */
 	if (c->tsize > 0x01000000) {
 		FL_DBG("LIBFLASH: Flash >16MB, enabling 4B mode...\n");
@@ -605,6 +1428,7 @@ static int flash_configure(struct flash_chip *c)
 				return rc;
 			}
 		}
+		c->mode_4b = true;
 	} else {
 		FL_DBG("LIBFLASH: Flash <=16MB, disabling 4B mode...\n");
 
@@ -646,32 +1470,210 @@ int flash_get_info(struct flash_chip *c, const char **name,
 	return 0;
 }
 
+/*
+ * What a batch's earlier commands learned about each chip. The controller is
+ * rebuilt with the SoC for every command but the chip isn't, so only its ID
+ * and address mode are read again to check it's still the same part in the
+ * same state.
+ */
+#define FL_MAX_RETAINED	4
+
+static bool fl_retain;
+
+static struct fl_retained {
+	bool valid;
+	/* The chip's window on the AHB, which tells the controllers and CSes apart */
+	uint32_t window;
+	uint32_t iid;
+	bool has_sfdp;
+	struct flash_chip chip;
+} fl_retained[FL_MAX_RETAINED];
+
+void flash_enable_retention(void)
+{
+	fl_retain = true;
+}
+
+void flash_drop_retained(void)
+{
+	unsigned int i;
+
+	for (i = 0; i < FL_MAX_RETAINED; i++)
+		fl_retained[i].valid = false;
+}
+
+/*
+ * Reads whether the chip is in 4B address mode: bit 5 of the Macronix
+ * configuration register, bit 0 of the Winbond SR3 (both read with 15h), bit
+ * 0 of the Micron flag status.
+ */
+static int fl_read_mode_4b(struct sfc *ct, uint32_t iid, bool *mode_4b)
+{
+	uint8_t val;
+	int rc;
+
+	switch (iid >> 16) {
+	case 0xc2:
+		rc = ct->cmd_rd(ct, CMD_RDCR, false, 0, &val, 1);
+		val &= 0x20;
+		break;
+	case 0xef:
+		rc = ct->cmd_rd(ct, CMD_RDCR, false, 0, &val, 1);
+		val &= 0x01;
+		break;
+	case 0x20:
+		rc = ct->cmd_rd(ct, CMD_MIC_RDFLST, false, 0, &val, 1);
+		val &= 0x01;
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
+
+	if (rc)
+		return rc;
+
+	*mode_4b = !!val;
+
+	return 0;
+}
+
+static struct fl_retained *fl_retained_find(struct sfc *ctrl, bool claim)
+{
+	struct soc_region window;
+	unsigned int i;
+
+	if (!fl_retain || sfc_get_flash(ctrl, &window))
+		return NULL;
+
+	for (i = 0; i < FL_MAX_RETAINED; i++) {
+		if (fl_retained[i].valid && fl_retained[i].window == window.start)
+			return &fl_retained[i];
+	}
+
+	if (!claim)
+		return NULL;
+
+	for (i = 0; i < FL_MAX_RETAINED; i++) {
+		if (!fl_retained[i].valid) {
+			fl_retained[i].window = window.start;
+			return &fl_retained[i];
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Restores what flash_identify() and flash_configure() settled on for the
+ * chip. The new controller instance still has to be told about it, but if the
+ * chip kept its 4B mode from last time no commands go out to it. Returns
+ * -ESTALE if it didn't, or if that can't be told, and its addressing depends
+ * on the mode.
+ */
+static int flash_reuse(struct flash_chip *c, const struct fl_retained *r)
+{
+	struct sfc *ct = c->ctrl;
+	uint32_t tsize;
+	bool mode_4b;
+	int rc;
+
+	if (!r->chip.native_4b && (r->chip.info.flags & FL_CAN_4B) &&
+	    ct->cmd_rd) {
+		rc = fl_read_mode_4b(ct, r->iid, &mode_4b);
+		if (rc || mode_4b != r->chip.mode_4b)
+			return -ESTALE;
+	}
+
+	c->info = r->chip.info;
+	c->sfdp = r->chip.sfdp;
+	c->tsize = r->chip.tsize;
+	c->page_size = r->chip.page_size;
+	c->min_erase_mask = r->chip.min_erase_mask;
+	c->mode_4b = r->chip.mode_4b;
+	c->native_4b = r->chip.native_4b;
+
+	ct->sfdp = r->has_sfdp ? &c->sfdp : NULL;
+	ct->finfo = &c->info;
+
+	if (ct->setup) {
+		tsize = c->info.size;
+		rc = ct->setup(ct, &tsize);
+		if (rc)
+			return rc;
+	}
+
+	if (ct->set_4b) {
+		rc = ct->set_4b(ct, c->mode_4b);
+		if (rc) {
+			FL_ERR("LIBFLASH: Failed to restore controller 4b mode\n");
+			return rc;
+		}
+	}
+
+	FL_DBG("LIBFLASH: Reusing chip %s size %dM, %s addressing\n",
+	       c->info.name, c->tsize >> 20, c->mode_4b ? "4B" : "3B");
+
+	return 0;
+}
+
 int flash_init(struct sfc *ctrl, struct flash_chip **flash_chip)
 {
+	struct fl_retained *r;
 	struct flash_chip *c;
+	uint32_t iid;
+	int timing;
 	int rc;
 
+	timing = timing_begin("flash-init", NULL);
+
 	c = malloc(sizeof(*c));
-	if (!c)
+	if (!c) {
+		timing_end(timing);
 		return -ENOMEM;
+	}
 	memset(c, 0, sizeof(*c));
 	c->ctrl = ctrl;
 
-	rc = flash_identify(c);
-	if (rc) {
-		FL_ERR("LIBFLASH: Flash identification failed: %d\n", rc);
+	rc = fl_read_iid(ctrl, &iid);
+	if (rc)
 		goto bail;
+
+	r = fl_retained_find(ctrl, false);
+	if (r && r->iid == iid) {
+		rc = flash_reuse(c, r);
+		if (rc == -ESTALE) {
+			FL_DBG("LIBFLASH: Chip's address mode is stale, redoing it\n");
+			r->valid = false;
+		} else {
+			if (rc) {
+				FL_ERR("LIBFLASH: Failed to reuse flash state: %d\n", rc);
+				r->valid = false;
+			}
+			goto bail;
+		}
 	}
-	c->smart_buf = malloc(c->min_erase_mask + 1);
-	if (!c->smart_buf) {
-		FL_ERR("LIBFLASH: Failed to allocate smart buffer !\n");
-		rc = -ENOMEM;
+
+	rc = flash_identify(c, iid);
+	if (rc) {
+		FL_ERR("LIBFLASH: Flash identification failed: %d\n", rc);
 		goto bail;
 	}
 	rc = flash_configure(c);
-	if (rc)
+	if (rc) {
 		FL_ERR("LIBFLASH: Flash configuration failed\n");
+		goto bail;
+	}
+
+	r = fl_retained_find(ctrl, true);
+	if (r) {
+		r->iid = iid;
+		r->has_sfdp = ctrl->sfdp != NULL;
+		r->chip = *c;
+		r->chip.ctrl = NULL;
+		r->valid = true;
+	}
 bail:
+	timing_end(timing);
 	if (rc) {
 		free(c);
 		return rc;
@@ -687,7 +1689,8 @@ void flash_destroy(struct flash_chip *c)
 {
 	/* XXX Make sure we are idle etc... */
 	if (c) {
-		free(c->smart_buf);
+		if (c->smart_buf)
+			bufpool_put(c->smart_buf, FLASH_SMART_BUF);
 		free(c);
 	}
 }
@@ -695,7 +1698,8 @@ void flash_destroy(struct flash_chip *c)
 void flash_exit_close(struct flash_chip *c, void (*close)(struct sfc *ctrl))
 {
 	if (c) {
-		free(c->smart_buf);
+		if (c->smart_buf)
+			bufpool_put(c->smart_buf, FLASH_SMART_BUF);
 		close(c->ctrl);
 		free(c);
 	}
@@ -26,19 +26,41 @@
 #define STAT_WIP	0x01
 #define STAT_WEN	0x02
 
+/* Bytes of flash each smart write outcome accounted for, since flash_init() */
+struct flash_smart_stats {
+    uint64_t same;
+    uint64_t programmed;
+    uint64_t erased;
+};
+
 struct flash_chip {
     struct sfc *ctrl;
     struct flash_info info;
+    struct flash_sfdp sfdp;
     uint32_t tsize;
+    uint32_t page_size;
     uint32_t min_erase_mask;
     bool mode_4b;
+    /* 4B addresses by dedicated opcodes, the chip stays as it was */
+    bool native_4b;
     struct flash_req *cur_req;
     void *smart_buf;
+    struct flash_smart_stats smart_stats;
 };
 
 int flash_init(struct sfc *ctrl, struct flash_chip **chip);
 void flash_destroy(struct flash_chip *chip);
 
+/*
+ * For commands sharing a host session, see soc_enable_retention(). Later
+ * flash_init() calls check the chip ID and address mode before reusing what
+ * was found.
+ */
+void flash_enable_retention(void);
+
+/* Forgets the retained chips, which firmware may reset after an SoC reset */
+void flash_drop_retained(void);
+
 int flash_read(struct flash_chip *c, uint64_t pos, void *buf, uint64_t len);
 int flash_erase(struct flash_chip *c, uint64_t dst, uint64_t size);
 int flash_write(struct flash_chip *c, uint32_t dst, const void *src,
@@ -46,6 +68,50 @@ int flash_write(struct flash_chip *c, uint32_t dst, const void *src,
 int flash_smart_write(struct flash_chip *c, uint64_t dst, const void *src,
 		      uint64_t size);
 
+/* How many of the erase blocks a smart write would have to erase */
+struct flash_plan {
+    uint32_t blocks;
+    uint32_t erase;
+};
+
+/* Plan a smart write of @src over whole erase blocks, erasing nothing */
+int flash_smart_plan(struct flash_chip *c, uint64_t dst, const void *src,
+		     uint64_t size, struct flash_plan *plan);
+
+/* Program @src to erased flash, skipping the pages it leaves blank */
+int flash_write_erased(struct flash_chip *c, uint32_t dst, const void *src,
+		       uint32_t size);
+
+enum sm_comp_res {
+	sm_no_change,
+	sm_need_write,
+	sm_need_erase,
+};
+
+/* How @s can be put over @b, the current contents, without losing data */
+enum sm_comp_res flash_smart_comp(const uint8_t *b, const uint8_t *s,
+				  uint32_t size);
+
 int flash_erase_chip(struct flash_chip *c);
 
+/* Where the time of a single erase or program went, for characterisation */
+struct flash_timing {
+    /* Sending the command, with WREN and any data */
+    uint64_t issue_us;
+    /* From then until the chip reported itself idle */
+    uint64_t busy_us;
+    /* Status reads it took to see that */
+    unsigned int polls;
+};
+
+/*
+ * A single erase command of @size, 4K, 32K or 64K, or the whole chip if @size
+ * is its size. -EOPNOTSUPP if the chip has no command for it.
+ */
+int flash_erase_timed(struct flash_chip *c, uint32_t dst, uint32_t size,
+		      struct flash_timing *timing);
+/* A single page program, which must not cross a page boundary */
+int flash_program_timed(struct flash_chip *c, uint32_t dst, const void *src,
+			uint32_t size, struct flash_timing *timing);
+
 #endif
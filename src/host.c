@@ -5,21 +5,284 @@
 #include "bridge.h"
 #include "bridge/debug.h"
 #include "bridge/devmem.h"
+#include "bridge/failover.h"
 #include "bridge/ilpc.h"
 #include "bridge/l2a.h"
 #include "bridge/p2a.h"
+#include "bridge/stripe.h"
+#include "cache.h"
 #include "compiler.h"
+#include "control.h"
 #include "host.h"
 #include "log.h"
+#include "record.h"
+#include "span.h"
+#include "throttle.h"
+#include "timing.h"
 
 #include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
 
 struct bridge {
 	struct list_node entry;
 	const struct bridge_driver *driver;
 	struct ahb *ahb;
+	/* Calibrated costs of a register read and of a bulk read, in ns */
+	uint64_t readl_ns;
+	uint64_t read_ns;
 };
 
+/*
+ * Calibration reads the SCU, which sits at the same address on all supported
+ * SoCs and has no read side-effects. Calibration is skipped for bridges whose
+ * caps say it would take too long, their estimates are used instead.
+ */
+#define HOST_CALIBRATE_PHYS	0x1e6e2000
+#define HOST_CALIBRATE_LEN	4096
+#define HOST_CALIBRATE_ITERS	4
+#define HOST_CALIBRATE_BUDGET_NS	(50 * 1000 * 1000ULL)
+
+static bool host_stats;
+static bool host_striping;
+static bool host_failover;
+static bool host_all_bridges;
+
+static struct host host_session;
+static bool host_session_active;
+
+void host_probe_all_bridges(void)
+{
+    host_all_bridges = true;
+}
+
+static uint64_t host_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static uint64_t host_estimate_ns(const struct bridge_caps *caps)
+{
+    return caps->op_ns + (HOST_CALIBRATE_LEN * (uint64_t)caps->byte_ps) / 1000;
+}
+
+static void host_calibrate_bridge(struct bridge *bridge)
+{
+    const struct bridge_caps *caps = ahb_bridge_caps(bridge->ahb);
+    uint64_t start, elapsed;
+    uint8_t buf[HOST_CALIBRATE_LEN];
+    uint32_t val;
+    int i;
+
+    bridge->readl_ns = caps->op_ns;
+    bridge->read_ns = host_estimate_ns(caps);
+
+    if (bridge->read_ns * HOST_CALIBRATE_ITERS > HOST_CALIBRATE_BUDGET_NS) {
+        logd("Using estimated costs for the %s bridge\n", bridge->driver->name);
+        return;
+    }
+
+    /* Keep the best of a few runs to filter out scheduling noise */
+    bridge->readl_ns = UINT64_MAX;
+    bridge->read_ns = UINT64_MAX;
+    for (i = 0; i < HOST_CALIBRATE_ITERS; i++) {
+        start = host_now();
+        if (ahb_readl(bridge->ahb, HOST_CALIBRATE_PHYS | 0x004, &val) < 0)
+            goto failed;
+        elapsed = host_now() - start;
+        if (elapsed < bridge->readl_ns)
+            bridge->readl_ns = elapsed;
+
+        start = host_now();
+        if (ahb_read(bridge->ahb, HOST_CALIBRATE_PHYS, buf, sizeof(buf)) < 0)
+            goto failed;
+        elapsed = host_now() - start;
+        if (elapsed < bridge->read_ns)
+            bridge->read_ns = elapsed;
+    }
+
+    logd("Calibrated the %s bridge: readl %" PRIu64 "ns, %d byte read %" PRIu64
+         "ns\n", bridge->driver->name, bridge->readl_ns, HOST_CALIBRATE_LEN,
+         bridge->read_ns);
+
+    return;
+
+failed:
+    logd("Calibration failed for the %s bridge\n", bridge->driver->name);
+    bridge->readl_ns = UINT64_MAX;
+    bridge->read_ns = UINT64_MAX;
+}
+
+static void host_calibrate(struct host *ctx)
+{
+    struct bridge *bridge;
+    int timing;
+
+    if (ctx->calibrated)
+        return;
+
+    list_for_each(&ctx->bridges, bridge, entry) {
+        timing = timing_begin("bridge-calibrate", bridge->driver->name);
+        host_calibrate_bridge(bridge);
+        timing_end(timing);
+    }
+
+    ctx->calibrated = true;
+}
+
+void host_enable_stats(void)
+{
+    host_stats = true;
+}
+
+void host_enable_striping(void)
+{
+    host_striping = true;
+}
+
+static int host_init_stripe(struct host *ctx)
+{
+    struct bridge *bridge;
+    struct stripe *stripe;
+
+    if (!(stripe = malloc(sizeof(*stripe))))
+        return -ENOMEM;
+
+    stripe_init(stripe);
+
+    list_for_each(&ctx->bridges, bridge, entry)
+        stripe_add(stripe, bridge->ahb);
+
+    if (stripe->nr_members < 2) {
+        logd("Striping needs bridges on at least two buses\n");
+        stripe_destroy(stripe);
+        free(stripe);
+        return 0;
+    }
+
+    ctx->stripe = stripe;
+
+    return 0;
+}
+
+void host_enable_failover(void)
+{
+    host_failover = true;
+}
+
+/* Fall back through the bridges in order of their calibrated bulk cost */
+static int host_init_failover(struct host *ctx)
+{
+    struct bridge *bridge, *best;
+    struct failover *failover;
+    size_t nr = 0, i;
+    bool *added;
+    int rc = 0;
+
+    list_for_each(&ctx->bridges, bridge, entry)
+        nr++;
+
+    if (nr < 2) {
+        logd("Failover needs at least two bridges\n");
+        return 0;
+    }
+
+    if (!(failover = malloc(sizeof(*failover))))
+        return -ENOMEM;
+
+    if (!(added = calloc(nr, sizeof(*added)))) {
+        free(failover);
+        return -ENOMEM;
+    }
+
+    host_calibrate(ctx);
+    failover_init(failover);
+
+    while (failover->nr_members < nr) {
+        size_t pick = 0;
+
+        best = NULL;
+        i = 0;
+        list_for_each(&ctx->bridges, bridge, entry) {
+            if (!added[i] && (!best || bridge->read_ns < best->read_ns)) {
+                best = bridge;
+                pick = i;
+            }
+            i++;
+        }
+
+        if ((rc = failover_add(failover, best->ahb)) < 0)
+            break;
+
+        added[pick] = true;
+    }
+
+    free(added);
+
+    /* With more bridges than it can hold, fall back on the best of them */
+    if (rc == -ENOSPC)
+        rc = 0;
+
+    if (rc < 0) {
+        failover_destroy(failover);
+        free(failover);
+        return rc;
+    }
+
+    ctx->failover = failover;
+
+    return 0;
+}
+
+static struct bridge_driver **host_drivers;
+static size_t host_nr_drivers;
+static pthread_once_t host_drivers_once = PTHREAD_ONCE_INIT;
+
+static int host_driver_cmp(const void *a, const void *b)
+{
+    const struct bridge_driver *da = *(struct bridge_driver * const *)a;
+    const struct bridge_driver *db = *(struct bridge_driver * const *)b;
+
+    if (da->priority != db->priority)
+        return da->priority < db->priority ? -1 : 1;
+
+    return strcmp(da->name, db->name);
+}
+
+/*
+ * The linker gathers the drivers into a section, which is sorted in place on
+ * first use. Without section support the table autodata builds is kept.
+ */
+static void host_drivers_init(void)
+{
+    host_drivers = autodata_get(bridge_drivers, &host_nr_drivers);
+    if (!host_drivers) {
+        host_nr_drivers = 0;
+        return;
+    }
+
+    qsort(host_drivers, host_nr_drivers, sizeof(*host_drivers),
+          host_driver_cmp);
+}
+
+struct bridge_driver **host_bridge_drivers(size_t *nr)
+{
+    pthread_once(&host_drivers_once, host_drivers_init);
+
+    *nr = host_nr_drivers;
+
+    return host_drivers;
+}
+
 void print_bridge_drivers(void)
 {
     struct bridge_driver **bridges;
@@ -27,80 +290,334 @@ void print_bridge_drivers(void)
 
     printf("Available bridges:\n");
 
-    bridges = autodata_get(bridge_drivers, &n_bridges);
+    bridges = host_bridge_drivers(&n_bridges);
 
     for (size_t i = 0; i < n_bridges; i++) {
         printf("  %s\n", bridges[i]->name);
     }
-
-    autodata_free(bridges);
 }
 
 int disable_bridge_driver(const char *drv)
 {
     struct bridge_driver **bridges;
     size_t n_bridges = 0;
-    int ret = -ENOENT;
 
-    bridges = autodata_get(bridge_drivers, &n_bridges);
+    bridges = host_bridge_drivers(&n_bridges);
 
     for (size_t i = 0; i < n_bridges; i++) {
         if (!strcmp(bridges[i]->name, drv)) {
             bridges[i]->disabled = true;
-            ret = 0;
-            goto out;
+            return 0;
         }
     }
 
-out:
-    autodata_free(bridges);
+    return -ENOENT;
+}
+
+struct host_probe {
+    struct bridge_driver *driver;
+    struct ahb *ahb;
+    /* Estimated cost of a calibration read, used to order the probes */
+    uint64_t cost;
+};
+
+struct host_probe_ctx {
+    pthread_mutex_t lock;
+    int argc;
+    char **argv;
+    bool all;
+    /* The estimated cost of the cheapest bridge that has probed so far */
+    uint64_t best;
+};
+
+/* The drivers for one bus, which have to be probed one after the other */
+struct host_probe_group {
+    struct host_probe_ctx *ctx;
+    struct host_probe **probes;
+    size_t nr_probes;
+    const char *bus;
+    bool bound;
+    pthread_t thread;
+};
+
+static void *host_probe_group(void *arg)
+{
+    struct host_probe_group *group = arg;
+    struct host_probe_ctx *ctx = group->ctx;
+    struct host_probe *probe;
+    bool skip;
+    int timing;
+    size_t i;
+
+    if (!group->bound)
+        span_thread_name(group->bus ?: "probe");
+
+    for (i = 0; i < group->nr_probes; i++) {
+        probe = group->probes[i];
+
+        /* Probes are in order of cost, so the rest of the group can't win */
+        pthread_mutex_lock(&ctx->lock);
+        skip = !ctx->all && ctx->best <= probe->cost;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (skip) {
+            logd("Skipping bridge driver %s, a faster bridge is available\n",
+                 probe->driver->name);
+            break;
+        }
+
+        logd("Trying bridge driver %s\n", probe->driver->name);
+
+        timing = timing_begin("bridge-probe", probe->driver->name);
+        probe->ahb = probe->driver->probe(ctx->argc, ctx->argv);
+        timing_end(timing);
+
+        if (!probe->ahb)
+            continue;
+
+        pthread_mutex_lock(&ctx->lock);
+        if (probe->cost < ctx->best)
+            ctx->best = probe->cost;
+        pthread_mutex_unlock(&ctx->lock);
+
+        if (!ctx->all)
+            break;
+    }
+
+    return NULL;
+}
+
+static struct host_probe_group *
+host_probe_find_group(struct host_probe_group *groups, size_t nr_groups,
+                      const struct bridge_driver *driver)
+{
+    size_t i;
+
+    if (!driver->bus)
+        return NULL;
+
+    for (i = 0; i < nr_groups; i++) {
+        if (groups[i].bus && !strcmp(groups[i].bus, driver->bus))
+            return &groups[i];
+    }
+
+    return NULL;
+}
+
+static void host_probe_group_add(struct host_probe_group *group,
+                                 struct host_probe *probe)
+{
+    size_t i = group->nr_probes++;
+
+    /* Insertion sort by cost, groups are tiny */
+    while (i && group->probes[i - 1]->cost > probe->cost) {
+        group->probes[i] = group->probes[i - 1];
+        i--;
+    }
+    group->probes[i] = probe;
+
+    group->bound |= probe->driver->thread_bound;
+}
+
+static int host_add_bridge(struct host *ctx, struct bridge_driver *driver,
+                           struct ahb *ahb)
+{
+    struct bridge *bridge;
+
+    if (!(bridge = malloc(sizeof(*bridge)))) {
+        driver->destroy(ahb);
+        return -ENOMEM;
+    }
+
+    bridge->driver = driver;
+    bridge->ahb = ahb;
+    bridge->readl_ns = 0;
+    bridge->read_ns = 0;
+
+    /* The control socket reports the counters while the command runs */
+    if ((host_stats || control_enabled()) && ahb_stats_init(bridge->ahb) < 0)
+        logd("Failed to enable statistics for %s\n", bridge->driver->name);
+
+    if (record_enabled() &&
+            (bridge->ahb->record = record_bridge(bridge->driver->name)) < 0)
+        logd("Failed to record operations for %s\n", bridge->driver->name);
+
+    bridge->ahb->throttle = throttle_get(bridge->driver->name);
+
+    control_add_bridge(bridge->ahb);
+
+    list_add(&ctx->bridges, &bridge->entry);
 
-    return ret;
+    return 0;
 }
 
+/* Tries the bridge that was selected on the last run against this host */
+static int host_probe_cached(struct host *ctx, struct bridge_driver **bridges,
+                             size_t n_bridges, int argc, char *argv[])
+{
+    const char *name;
+    struct ahb *ahb;
+    int timing;
+    size_t i;
+
+    if (!(name = cache_get("bridge")))
+        return 0;
+
+    for (i = 0; i < n_bridges; i++) {
+        if (bridges[i]->disabled || strcmp(bridges[i]->name, name))
+            continue;
+
+        logd("Trying cached bridge driver %s\n", name);
+
+        timing = timing_begin("bridge-probe", name);
+        ahb = bridges[i]->probe(argc, argv);
+        timing_end(timing);
+
+        if (ahb)
+            return host_add_bridge(ctx, bridges[i], ahb) ?: 1;
+
+        break;
+    }
+
+    logd("Cached bridge %s is unavailable\n", name);
+    cache_invalidate("bridge");
+
+    return 0;
+}
+
+/*
+ * Drivers on different buses are probed concurrently, each bus's drivers in
+ * order of their estimated cost. Unless every bridge is wanted, a bus stops
+ * at its first working bridge and drivers that can't beat a bridge that has
+ * already probed are skipped.
+ */
 int host_init(struct host *ctx, int argc, char *argv[])
 {
+    struct host_probe_ctx _probe_ctx, *probe_ctx = &_probe_ctx;
+    struct host_probe_group *groups, *group;
     struct bridge_driver **bridges;
+    struct host_probe *probes;
     size_t n_bridges = 0;
+    size_t nr_groups = 0;
     size_t i;
     int rc;
 
     list_head_init(&ctx->bridges);
+    ctx->stripe = NULL;
+    ctx->failover = NULL;
+    ctx->calibrated = false;
+    ctx->session = NULL;
+
+    if (host_session_active) {
+        if (argc)
+            logd("Ignoring bridge arguments, using the session's bridges\n");
+        ctx->session = &host_session;
+        return 0;
+    }
 
-    bridges = autodata_get(bridge_drivers, &n_bridges);
+    bridges = host_bridge_drivers(&n_bridges);
 
     logd("Found %zu registered bridge drivers\n", n_bridges);
 
+    if (cache_select(argc, argv) < 0)
+        logd("Continuing without the probe cache\n");
+
+    if (host_striping && host_failover) {
+        loge("Striping and failover can't be combined\n");
+        return -EINVAL;
+    }
+
+    if (!(host_all_bridges || host_striping || host_failover)) {
+        rc = host_probe_cached(ctx, bridges, n_bridges, argc, argv);
+        if (rc)
+            return rc < 0 ? rc : 0;
+    }
+
+    probes = calloc(n_bridges, sizeof(*probes));
+    groups = calloc(n_bridges, sizeof(*groups));
+    if (n_bridges && (!probes || !groups)) {
+        rc = -ENOMEM;
+        goto cleanup_probes;
+    }
+
+    pthread_mutex_init(&probe_ctx->lock, NULL);
+    probe_ctx->argc = argc;
+    probe_ctx->argv = argv;
+    probe_ctx->all = host_all_bridges || host_striping || host_failover;
+    probe_ctx->best = UINT64_MAX;
+
     for (i = 0; i < n_bridges; i++) {
-        struct ahb *ahb;
+        struct host_probe *probe = &probes[i];
 
         if (bridges[i]->disabled) {
             logd("Skipping bridge driver %s\n", bridges[i]->name);
             continue;
         }
 
-        logd("Trying bridge driver %s\n", bridges[i]->name);
+        probe->driver = bridges[i];
+        probe->cost = host_estimate_ns(&bridges[i]->caps);
 
-        if ((ahb = bridges[i]->probe(argc, argv))) {
-            struct bridge *bridge;
-
-            bridge = malloc(sizeof(*bridge));
-            if (!bridge) {
+        if (!(group = host_probe_find_group(groups, nr_groups, bridges[i]))) {
+            group = &groups[nr_groups++];
+            group->ctx = probe_ctx;
+            group->bus = bridges[i]->bus;
+            group->probes = calloc(n_bridges, sizeof(*group->probes));
+            if (!group->probes) {
                 rc = -ENOMEM;
-                goto cleanup_bridges;
+                goto cleanup_groups;
             }
+        }
 
-            bridge->driver = bridges[i];
-            bridge->ahb = ahb;
+        host_probe_group_add(group, probe);
+    }
 
-            list_add(&ctx->bridges, &bridge->entry);
-        }
+    /* Bound groups run on this thread once the others are under way */
+    for (i = 0; i < nr_groups; i++) {
+        group = &groups[i];
+
+        if (nr_groups == 1 || group->bound ||
+            pthread_create(&group->thread, NULL, host_probe_group, group))
+            group->bound = true;
+    }
+
+    for (i = 0; i < nr_groups; i++) {
+        if (groups[i].bound)
+            host_probe_group(&groups[i]);
     }
 
+    for (i = 0; i < nr_groups; i++) {
+        if (!groups[i].bound)
+            pthread_join(groups[i].thread, NULL);
+    }
+
+    /* Add the bridges in probe order, whichever probed first */
     rc = 0;
+    for (i = 0; i < n_bridges; i++) {
+        if (!probes[i].ahb)
+            continue;
+
+        if (rc < 0) {
+            probes[i].driver->destroy(probes[i].ahb);
+            continue;
+        }
+
+        rc = host_add_bridge(ctx, probes[i].driver, probes[i].ahb);
+    }
+
+    if (!rc && host_striping)
+        rc = host_init_stripe(ctx);
 
-cleanup_bridges:
-    autodata_free(bridges);
+    if (!rc && host_failover)
+        rc = host_init_failover(ctx);
+
+cleanup_groups:
+    for (i = 0; i < nr_groups; i++)
+        free(groups[i].probes);
+    pthread_mutex_destroy(&probe_ctx->lock);
+
+cleanup_probes:
+    free(groups);
+    free(probes);
 
     return rc;
 }
@@ -108,26 +625,134 @@ cleanup_bridges:
 void host_destroy(struct host *ctx)
 {
     struct bridge *bridge, *next;
+    struct throttle *throttle;
+    struct ahb_arb *arb;
+    int timing;
+
+    /* The bridges outlive the command, see host_session_end() */
+    if (ctx->session)
+        return;
+
+    if (ctx->stripe) {
+        stripe_destroy(ctx->stripe);
+        free(ctx->stripe);
+        ctx->stripe = NULL;
+    }
+
+    if (ctx->failover) {
+        failover_destroy(ctx->failover);
+        free(ctx->failover);
+        ctx->failover = NULL;
+    }
 
     list_for_each_safe(&ctx->bridges, bridge, next, entry) {
+        control_remove_bridge(bridge->ahb);
+        if (host_stats)
+            ahb_stats_dump(bridge->ahb, stderr);
+        ahb_stats_destroy(bridge->ahb);
+        /* The driver's own teardown isn't held back */
+        throttle = bridge->ahb->throttle;
+        bridge->ahb->throttle = NULL;
+        throttle_put(throttle);
+        arb = ahb_arbitrate_detach(bridge->ahb);
+        timing = timing_begin("bridge-destroy", bridge->driver->name);
         bridge->driver->destroy(bridge->ahb);
+        timing_end(timing);
+        ahb_arbitrate_end(arb);
         list_del(&bridge->entry);
         free(bridge);
     }
 }
 
-struct ahb *host_get_ahb(struct host *ctx)
+struct ahb *host_get_ahb_for(struct host *ctx, enum host_usage usage)
 {
-    struct bridge *bridge;
+    struct bridge *bridge, *best = NULL;
+    uint64_t cost, best_cost = 0;
 
-    bridge = list_top(&ctx->bridges, struct bridge, entry);
+    if (ctx->session)
+        ctx = ctx->session;
+
+    if (ctx->stripe) {
+        logd("Accessing the BMC's AHB striped across %zu bridges\n",
+             ctx->stripe->nr_members);
+        return stripe_as_ahb(ctx->stripe);
+    }
+
+    if (ctx->failover) {
+        logd("Accessing the BMC's AHB through %s, with %zu bridges to fail over to\n",
+             ctx->failover->members[ctx->failover->current]->drv->name,
+             ctx->failover->nr_members - ctx->failover->current - 1);
+        return failover_as_ahb(ctx->failover);
+    }
+
+    /* Only pay for calibration if there's a choice to make */
+    if (list_top(&ctx->bridges, struct bridge, entry) !=
+        list_tail(&ctx->bridges, struct bridge, entry))
+        host_calibrate(ctx);
+
+    list_for_each(&ctx->bridges, bridge, entry) {
+        cost = (usage == host_usage_register) ? bridge->readl_ns
+                                               : bridge->read_ns;
+        if (!best || cost < best_cost) {
+            best = bridge;
+            best_cost = cost;
+        }
+    }
 
-    if (bridge) {
+    if (best) {
         logd("Accessing the BMC's AHB via the %s bridge\n",
-             bridge->driver->name);
-        return bridge->ahb;
+             best->driver->name);
+        cache_set("bridge", "%s", best->driver->name);
+        return best->ahb;
     }
 
     loge("Bridge discovery failed, cannot access BMC AHB\n");
     return NULL;
 }
+
+struct ahb *host_get_ahb(struct host *ctx)
+{
+    return host_get_ahb_for(ctx, host_usage_bulk);
+}
+
+struct ahb *host_next_ahb(struct host *ctx, struct ahb *prev)
+{
+    struct bridge *bridge;
+    bool found = !prev;
+
+    if (ctx->session)
+        ctx = ctx->session;
+
+    list_for_each(&ctx->bridges, bridge, entry) {
+        if (found)
+            return bridge->ahb;
+
+        found = (bridge->ahb == prev);
+    }
+
+    return NULL;
+}
+
+int host_session_begin(int argc, char *argv[])
+{
+    int rc;
+
+    if (host_session_active)
+        return -EBUSY;
+
+    if ((rc = host_init(&host_session, argc, argv)) < 0)
+        return rc;
+
+    host_session_active = true;
+
+    return 0;
+}
+
+void host_session_end(void)
+{
+    if (!host_session_active)
+        return;
+
+    host_session_active = false;
+    host_destroy(&host_session);
+}
@@ -6,19 +6,55 @@
 
 #include "ahb.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+
 #include "ccan/list/list.h"
 
+struct failover;
+struct stripe;
+
 struct host {
 	struct list_head bridges;
+	/* NULL unless striping was requested and several buses are usable */
+	struct stripe *stripe;
+	/* NULL unless failover was requested and there's a bridge to fall back on */
+	struct failover *failover;
+	bool calibrated;
+	/* Set when the bridges belong to a session shared between commands */
+	struct host *session;
 };
 
+enum host_usage { host_usage_bulk, host_usage_register };
+
 int host_init(struct host *ctx, int argc, char *argv[]);
 void host_destroy(struct host *ctx);
 
+/* The registered bridge drivers in probe order, built on first use */
+struct bridge_driver **host_bridge_drivers(size_t *nr);
 int disable_bridge_driver(const char *drv);
+void host_enable_stats(void);
+void host_enable_striping(void);
+void host_enable_failover(void);
+/* By default probing stops once the fastest available bridge is found */
+void host_probe_all_bridges(void);
 void print_bridge_drivers(void);
 
+/*
+ * Probe the host once for a sequence of commands. Until the session ends,
+ * host_init() hands out the session's bridges and ignores its arguments.
+ */
+int host_session_begin(int argc, char *argv[]);
+void host_session_end(void);
+
+/*
+ * Picks the bridge with the best calibrated throughput for bulk transfers, or
+ * the lowest latency for register accesses. host_get_ahb() is for bulk use.
+ */
 struct ahb *host_get_ahb(struct host *ctx);
+struct ahb *host_get_ahb_for(struct host *ctx, enum host_usage usage);
+/* Iterate over all probed bridges, starting from a NULL @prev */
+struct ahb *host_next_ahb(struct host *ctx, struct ahb *prev);
 
 static inline int host_bridge_release_from_ahb(struct ahb *ahb)
 {
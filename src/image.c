@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "image.h"
+#include "log.h"
+#include "span.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static void *image_source_read(void *arg)
+{
+    struct image_source *src = arg;
+    struct ring_slot *slot;
+    ssize_t filled;
+    uint64_t span;
+
+    /* Only a blocked read may be cancelled, never the ring's locking */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+    span_thread_name("image");
+
+    while ((slot = ring_get_empty(&src->ring))) {
+        span = span_begin();
+        if ((filled = decompress_read(&src->dec, slot->buf, src->chunk)) < 0) {
+            ring_abort(&src->ring, filled);
+            return NULL;
+        }
+
+        span_end("image", "read", span, 0, filled);
+
+        if (!filled)
+            break;
+
+        slot->len = filled;
+        ring_put_full(&src->ring);
+
+        if ((size_t)filled < src->chunk)
+            break;
+    }
+
+    ring_finish(&src->ring);
+
+    return NULL;
+}
+
+static int image_source_mmap(struct image_source *src)
+{
+    struct stat st;
+
+    if (fstat(src->fd, &st) < 0)
+        return -errno;
+
+    if (!st.st_size)
+        return -ENODATA;
+
+    src->map_len = st.st_size;
+    src->map_off = 0;
+    src->map = mmap(NULL, src->map_len, PROT_READ, MAP_PRIVATE, src->fd, 0);
+    if (src->map == MAP_FAILED) {
+        src->map = NULL;
+        return -errno;
+    }
+
+    madvise((void *)src->map, src->map_len, MADV_SEQUENTIAL);
+
+    return 0;
+}
+
+int image_source_open(struct image_source *src, const char *path,
+                      size_t chunk)
+{
+    int rc;
+
+    src->chunk = chunk;
+    src->map = NULL;
+    src->map_len = 0;
+    src->slot = NULL;
+    src->done = false;
+
+    if (!path)
+        src->fd = 0;
+    else if ((src->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        return -errno;
+
+    /* Only uncompressed files can be mapped, the rest needs a reader */
+    if ((rc = decompress_init(&src->dec, src->fd)) < 0)
+        goto cleanup_fd;
+
+    if (path && src->dec.format == decompress_none) {
+        decompress_destroy(&src->dec);
+        rc = image_source_mmap(src);
+        goto cleanup_fd;
+    }
+
+    if (src->dec.format != decompress_none)
+        logd("Decompressing %s image\n", decompress_name(src->dec.format));
+
+    if ((rc = ring_init(&src->ring, chunk)) < 0)
+        goto cleanup_dec;
+
+    if ((rc = -pthread_create(&src->reader, NULL, image_source_read, src)))
+        goto cleanup_ring;
+
+    return 0;
+
+cleanup_ring:
+    ring_destroy(&src->ring);
+
+cleanup_dec:
+    decompress_destroy(&src->dec);
+
+cleanup_fd:
+    if (path)
+        close(src->fd);
+
+    return rc;
+}
+
+const char *image_source_map(struct image_source *src, size_t *len)
+{
+    *len = src->map_len;
+
+    return src->map;
+}
+
+ssize_t image_source_next(struct image_source *src, const char **data)
+{
+    size_t len;
+
+    if (src->map) {
+        len = src->map_len - src->map_off;
+        if (len > src->chunk)
+            len = src->chunk;
+
+        *data = src->map + src->map_off;
+        src->map_off += len;
+        src->done = !len;
+
+        return len;
+    }
+
+    if (src->slot)
+        ring_put_empty(&src->ring);
+
+    if (!(src->slot = ring_get_full(&src->ring))) {
+        src->done = true;
+        return ring_status(&src->ring);
+    }
+
+    *data = src->slot->buf;
+
+    return src->slot->len;
+}
+
+void image_source_close(struct image_source *src)
+{
+    if (src->map) {
+        munmap((void *)src->map, src->map_len);
+        return;
+    }
+
+    /* Stop the reader if we quit early, it may be blocked on the input */
+    if (!src->done) {
+        ring_abort(&src->ring, -ECANCELED);
+        pthread_cancel(src->reader);
+    }
+
+    pthread_join(src->reader, NULL);
+    ring_destroy(&src->ring);
+    decompress_destroy(&src->dec);
+
+    if (src->fd != STDIN_FILENO)
+        close(src->fd);
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _IMAGE_H
+#define _IMAGE_H
+
+#include "compress.h"
+#include "ring.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Where a flash image comes from: either a mapping of the file named on the
+ * command line, or the file or stdin pulled through a ring by a reader thread
+ * so that input latency, and decompressing a zstd or xz image, overlaps with
+ * programming the flash.
+ */
+struct image_source {
+    const char *map;
+    size_t map_len;
+    size_t map_off;
+    size_t chunk;
+    int fd;
+    struct decompress dec;
+    struct ring ring;
+    struct ring_slot *slot;
+    pthread_t reader;
+    bool done;
+};
+
+/* Reads stdin if @path is NULL, in pieces of up to @chunk bytes */
+int image_source_open(struct image_source *src, const char *path,
+                      size_t chunk);
+
+/* The whole image if it's a mapped file, so it can be looked over first */
+const char *image_source_map(struct image_source *src, size_t *len);
+
+/* Returns the length of the next piece of the image, 0 at its end */
+ssize_t image_source_next(struct image_source *src, const char **data);
+
+void image_source_close(struct image_source *src);
+
+#endif
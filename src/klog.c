@@ -0,0 +1,852 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "array.h"
+#include "compiler.h"
+#include "klog.h"
+#include "log.h"
+#include "progress.h"
+#include "search.h"
+#include "soc/sdmc.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The BMC kernels are 32-bit, so longs and pointers are words */
+#define KLOG_LONG               4
+
+/* vmcoreinfo is at most a page, so a page either side of a match holds it */
+#define KLOG_VMCOREINFO_MAX     4096
+
+#define KLOG_SCAN_CHUNK         (1 << 20)
+#define KLOG_SCAN_ANCHORS       8
+
+/* Bounds on what's fetched for a ring, whatever its description claims */
+#define KLOG_BUF_MAX            (32 << 20)
+/* How far a ring found by its first record is followed */
+#define KLOG_ANCHOR_MAX         (4 << 20)
+/* CONFIG_LOG_BUF_SHIFT's default, for a System.map without log_buf_len */
+#define KLOG_BUF_DEFAULT        (1 << 17)
+
+/* The first record an ARM kernel logs, and so the start of an unwrapped ring */
+#define KLOG_ANCHOR             "Booting Linux on physical CPU"
+
+/* A lockless ring descriptor's state sits in the top two bits of its id */
+#define KLOG_DESC_FLAGS_SHIFT   30
+#define KLOG_DESC_ID_MASK       ((1u << KLOG_DESC_FLAGS_SHIFT) - 1)
+#define KLOG_DESC_COMMITTED     1
+#define KLOG_DESC_FINALIZED     2
+
+/* Symbols are virtual addresses, zero until found. The rest are offsets. */
+struct klog_layout {
+    uint32_t log_buf;
+    uint32_t log_buf_len;
+    uint32_t log_first_idx;
+    uint32_t log_next_idx;
+    uint32_t prb;
+    /* struct printk_log, before 5.10 */
+    uint32_t log_size;
+    uint32_t log_ts_nsec;
+    uint32_t log_len;
+    uint32_t log_text_len;
+    /* struct printk_ringbuffer and what hangs off it, since */
+    uint32_t rb_desc_ring;
+    uint32_t rb_text_data_ring;
+    uint32_t dr_count_bits;
+    uint32_t dr_descs;
+    uint32_t dr_infos;
+    uint32_t dr_head_id;
+    uint32_t dr_tail_id;
+    uint32_t data_size_bits;
+    uint32_t data_data;
+    uint32_t desc_size;
+    uint32_t desc_state_var;
+    uint32_t desc_text_blk_lpos;
+    uint32_t lpos_begin;
+    uint32_t lpos_next;
+    uint32_t info_size;
+    uint32_t info_ts_nsec;
+    uint32_t info_text_len;
+    /* The text ring's offset moved in 6.10, so without vmcoreinfo it's guessed */
+    bool rb_known;
+};
+
+/* As 32-bit ARM lays the structures out */
+static const struct klog_layout klog_layout_arm = {
+    .log_size = 16,
+    .log_ts_nsec = 0,
+    .log_len = 8,
+    .log_text_len = 10,
+    .rb_desc_ring = 0,
+    .rb_text_data_ring = 20,
+    .dr_count_bits = 0,
+    .dr_descs = 4,
+    .dr_infos = 8,
+    .dr_head_id = 12,
+    .dr_tail_id = 16,
+    .data_size_bits = 0,
+    .data_data = 4,
+    .desc_size = 12,
+    .desc_state_var = 0,
+    .desc_text_blk_lpos = 4,
+    .lpos_begin = 0,
+    .lpos_next = 4,
+    .info_size = 88,
+    .info_ts_nsec = 8,
+    .info_text_len = 16,
+};
+
+/* The vmcoreinfo entries that matter here, symbols in hex and the rest decimal */
+static const struct klog_key {
+    const char *key;
+    size_t field;
+} klog_keys[] = {
+    { "SYMBOL(log_buf)", offsetof(struct klog_layout, log_buf) },
+    { "SYMBOL(log_buf_len)", offsetof(struct klog_layout, log_buf_len) },
+    { "SYMBOL(log_first_idx)", offsetof(struct klog_layout, log_first_idx) },
+    { "SYMBOL(log_next_idx)", offsetof(struct klog_layout, log_next_idx) },
+    { "SYMBOL(prb)", offsetof(struct klog_layout, prb) },
+    { "SIZE(printk_log)", offsetof(struct klog_layout, log_size) },
+    { "OFFSET(printk_log.ts_nsec)", offsetof(struct klog_layout, log_ts_nsec) },
+    { "OFFSET(printk_log.len)", offsetof(struct klog_layout, log_len) },
+    { "OFFSET(printk_log.text_len)", offsetof(struct klog_layout, log_text_len) },
+    { "OFFSET(printk_ringbuffer.desc_ring)", offsetof(struct klog_layout, rb_desc_ring) },
+    { "OFFSET(printk_ringbuffer.text_data_ring)", offsetof(struct klog_layout, rb_text_data_ring) },
+    { "OFFSET(prb_desc_ring.count_bits)", offsetof(struct klog_layout, dr_count_bits) },
+    { "OFFSET(prb_desc_ring.descs)", offsetof(struct klog_layout, dr_descs) },
+    { "OFFSET(prb_desc_ring.infos)", offsetof(struct klog_layout, dr_infos) },
+    { "OFFSET(prb_desc_ring.head_id)", offsetof(struct klog_layout, dr_head_id) },
+    { "OFFSET(prb_desc_ring.tail_id)", offsetof(struct klog_layout, dr_tail_id) },
+    { "OFFSET(prb_data_ring.size_bits)", offsetof(struct klog_layout, data_size_bits) },
+    { "OFFSET(prb_data_ring.data)", offsetof(struct klog_layout, data_data) },
+    { "SIZE(prb_desc)", offsetof(struct klog_layout, desc_size) },
+    { "OFFSET(prb_desc.state_var)", offsetof(struct klog_layout, desc_state_var) },
+    { "OFFSET(prb_desc.text_blk_lpos)", offsetof(struct klog_layout, desc_text_blk_lpos) },
+    { "OFFSET(prb_data_blk_lpos.begin)", offsetof(struct klog_layout, lpos_begin) },
+    { "OFFSET(prb_data_blk_lpos.next)", offsetof(struct klog_layout, lpos_next) },
+    { "SIZE(printk_info)", offsetof(struct klog_layout, info_size) },
+    { "OFFSET(printk_info.ts_nsec)", offsetof(struct klog_layout, info_ts_nsec) },
+    { "OFFSET(printk_info.text_len)", offsetof(struct klog_layout, info_text_len) },
+};
+
+struct klog {
+    struct soc *soc;
+    struct klog_layout layout;
+    uint32_t page_offset;
+    /* DRAM less the VRAM carved from its top */
+    uint32_t ram_start;
+    uint32_t ram_len;
+    FILE *out;
+    uint64_t records;
+};
+
+static uint16_t klog_get16(const uint8_t *buf, size_t off)
+{
+    return buf[off] | (buf[off + 1] << 8);
+}
+
+static uint32_t klog_get32(const uint8_t *buf, size_t off)
+{
+    return klog_get16(buf, off) | ((uint32_t)klog_get16(buf, off + 2) << 16);
+}
+
+static uint64_t klog_get64(const uint8_t *buf, size_t off)
+{
+    return klog_get32(buf, off) | ((uint64_t)klog_get32(buf, off + 4) << 32);
+}
+
+static bool klog_set(struct klog_layout *layout, const char *key,
+                     const char *val)
+{
+    unsigned long parsed;
+    char *endp;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(klog_keys); i++) {
+        if (strcmp(klog_keys[i].key, key))
+            continue;
+
+        errno = 0;
+        parsed = strtoul(val, &endp, strncmp(key, "SYMBOL(", 7) ? 10 : 16);
+        if (errno || endp == val || parsed > UINT32_MAX)
+            return false;
+
+        *(uint32_t *)((char *)layout + klog_keys[i].field) = parsed;
+        if (!strcmp(key, "OFFSET(printk_ringbuffer.text_data_ring)"))
+            layout->rb_known = true;
+
+        return true;
+    }
+
+    return false;
+}
+
+/* Lines of KEY=VALUE, among whatever else shares the memory */
+static unsigned int klog_parse_vmcoreinfo(struct klog_layout *layout,
+                                          char *text, size_t len)
+{
+    char *line, *end, *eq, *last = text + len - 1;
+    unsigned int found = 0;
+
+    /* NULs end lines as newlines do */
+    *last = '\0';
+
+    for (line = text; line < last; line = end + 1) {
+        end = line + strcspn(line, "\n");
+        *end = '\0';
+
+        if ((eq = strchr(line, '='))) {
+            *eq = '\0';
+            found += klog_set(layout, line, eq + 1);
+        }
+    }
+
+    return found;
+}
+
+static int klog_parse_system_map(struct klog_layout *layout, const char *path)
+{
+    char line[256], name[128], key[160];
+    unsigned int found = 0;
+    uint32_t addr;
+    char type;
+    FILE *map;
+
+    if (!(map = fopen(path, "r"))) {
+        loge("Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    while (fgets(line, sizeof(line), map)) {
+        char val[sizeof("ffffffff")];
+
+        if (sscanf(line, "%" SCNx32 " %c %127s", &addr, &type, name) != 3)
+            continue;
+
+        snprintf(key, sizeof(key), "SYMBOL(%s)", name);
+        snprintf(val, sizeof(val), "%" PRIx32, addr);
+        found += klog_set(layout, key, val);
+    }
+
+    fclose(map);
+
+    if (!layout->prb && !layout->log_buf) {
+        loge("%s has neither prb nor log_buf\n", path);
+        return -ENOENT;
+    }
+
+    logd("Found %u printk symbols in %s\n", found, path);
+
+    return 0;
+}
+
+static int klog_read_phys(struct klog *ctx, uint32_t phys, void *buf,
+                          size_t len)
+{
+    ssize_t rc;
+
+    if (phys < ctx->ram_start ||
+            (uint64_t)phys + len > (uint64_t)ctx->ram_start + ctx->ram_len)
+        return -ERANGE;
+
+    if ((rc = soc_read(ctx->soc, phys, buf, len)) < 0)
+        return rc;
+
+    return (size_t)rc == len ? 0 : -EIO;
+}
+
+/* The kernel's linear map, which is where its data and allocations live */
+static int klog_read_virt(struct klog *ctx, uint32_t virt, void *buf,
+                          size_t len)
+{
+    if (virt < ctx->page_offset) {
+        loge("Kernel address 0x%08" PRIx32 " is below the linear map\n", virt);
+        return -ERANGE;
+    }
+
+    return klog_read_phys(ctx, ctx->ram_start + (virt - ctx->page_offset),
+                          buf, len);
+}
+
+static int klog_read_word(struct klog *ctx, uint32_t virt, uint32_t *val)
+{
+    uint8_t buf[KLOG_LONG];
+    int rc;
+
+    if ((rc = klog_read_virt(ctx, virt, buf, sizeof(buf))) < 0)
+        return rc;
+
+    *val = klog_get32(buf, 0);
+
+    return 0;
+}
+
+static void klog_emit(struct klog *ctx, uint64_t ts_nsec, const uint8_t *text,
+                      size_t len)
+{
+    fprintf(ctx->out, "[%5" PRIu64 ".%06" PRIu64 "] %.*s\n",
+            ts_nsec / 1000000000, (ts_nsec % 1000000000) / 1000, (int)len,
+            (const char *)text);
+    ctx->records++;
+}
+
+/*
+ * The fixed-record ring, read whole into @buf. Bounded by @first and @next
+ * from the kernel, it's followed around the wrap, otherwise from the start
+ * until the records stop making sense.
+ */
+static void klog_walk_legacy(struct klog *ctx, const uint8_t *buf, size_t len,
+                             uint32_t first, uint32_t next, bool bounded)
+{
+    const struct klog_layout *l = &ctx->layout;
+    size_t idx = bounded ? first : 0;
+    size_t steps;
+
+    for (steps = 0; steps < len / l->log_size; steps++) {
+        uint16_t rec, text;
+
+        if (bounded && idx == next)
+            return;
+
+        if (idx + l->log_size > len || !(rec = klog_get16(buf, idx + l->log_len))) {
+            if (!bounded)
+                return;
+            idx = 0;
+            continue;
+        }
+
+        text = klog_get16(buf, idx + l->log_text_len);
+        if (rec < l->log_size + text || idx + rec > len || (rec & 3)) {
+            if (bounded)
+                loge("Corrupt printk record at offset %zu\n", idx);
+            return;
+        }
+
+        klog_emit(ctx, klog_get64(buf, idx + l->log_ts_nsec),
+                  buf + idx + l->log_size, text);
+        idx += rec;
+    }
+}
+
+/* Where the fixed-record ring is, and its bounds if the kernel exports them */
+struct klog_legacy {
+    uint32_t buf;
+    uint32_t len;
+    uint32_t first;
+    uint32_t next;
+    bool bounded;
+};
+
+static int klog_find_legacy(struct klog *ctx, struct klog_legacy *lg)
+{
+    const struct klog_layout *l = &ctx->layout;
+    int rc;
+
+    lg->len = KLOG_BUF_DEFAULT;
+    lg->first = 0;
+    lg->next = 0;
+
+    if ((rc = klog_read_word(ctx, l->log_buf, &lg->buf)) < 0)
+        return rc;
+
+    if (l->log_buf_len && (rc = klog_read_word(ctx, l->log_buf_len, &lg->len)) < 0)
+        return rc;
+
+    lg->bounded = l->log_first_idx && l->log_next_idx;
+    if (lg->bounded) {
+        if ((rc = klog_read_word(ctx, l->log_first_idx, &lg->first)) < 0)
+            return rc;
+        if ((rc = klog_read_word(ctx, l->log_next_idx, &lg->next)) < 0)
+            return rc;
+    }
+
+    if (!lg->len || lg->len > KLOG_BUF_MAX || lg->first >= lg->len ||
+            lg->next >= lg->len) {
+        loge("Implausible printk ring of %" PRIu32 " bytes\n", lg->len);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int klog_dump_legacy(struct klog *ctx)
+{
+    struct klog_legacy lg;
+    uint8_t *buf;
+    int rc;
+
+    if ((rc = klog_find_legacy(ctx, &lg)) < 0)
+        return rc;
+
+    logi("Reading the %" PRIu32 "KiB printk ring at 0x%08" PRIx32 "\n",
+         lg.len >> 10, lg.buf);
+
+    if (!(buf = malloc(lg.len)))
+        return -ENOMEM;
+
+    if (!(rc = klog_read_virt(ctx, lg.buf, buf, lg.len)))
+        klog_walk_legacy(ctx, buf, lg.len, lg.first, lg.next, lg.bounded);
+
+    free(buf);
+
+    return rc;
+}
+
+/* The rings the lockless ring's description points at, fetched whole */
+struct klog_prb {
+    uint32_t count_bits;
+    uint32_t size_bits;
+    uint32_t head_id;
+    uint32_t tail_id;
+    /* Their kernel addresses */
+    uint32_t descs_at;
+    uint32_t infos_at;
+    uint32_t data_at;
+    uint8_t *descs;
+    uint8_t *infos;
+    uint8_t *data;
+};
+
+static void klog_walk_lockless(struct klog *ctx, const struct klog_prb *prb)
+{
+    const struct klog_layout *l = &ctx->layout;
+    uint32_t count = 1u << prb->count_bits;
+    uint32_t size = 1u << prb->size_bits;
+    uint32_t id = prb->tail_id;
+    uint32_t n;
+
+    for (n = 0; n < count; n++, id = (id + 1) & KLOG_DESC_ID_MASK) {
+        const uint8_t *desc = prb->descs + (id & (count - 1)) * l->desc_size;
+        const uint8_t *info = prb->infos + (id & (count - 1)) * l->info_size;
+        uint32_t sv, state, begin, next, off, blen;
+        uint16_t text;
+
+        sv = klog_get32(desc, l->desc_state_var);
+        state = sv >> KLOG_DESC_FLAGS_SHIFT;
+        if ((sv & KLOG_DESC_ID_MASK) != id ||
+                (state != KLOG_DESC_COMMITTED && state != KLOG_DESC_FINALIZED))
+            goto next;
+
+        begin = klog_get32(desc, l->desc_text_blk_lpos + l->lpos_begin);
+        next = klog_get32(desc, l->desc_text_blk_lpos + l->lpos_next);
+
+        /* Records without text, or whose text didn't fit */
+        if ((begin & 1) || (next & 1))
+            goto next;
+
+        /* A block that would wrap is instead placed at the ring's start */
+        if ((begin >> prb->size_bits) == (next >> prb->size_bits)) {
+            off = begin & (size - 1);
+            blen = next - begin;
+        } else {
+            off = 0;
+            blen = next & (size - 1);
+        }
+
+        if (blen < KLOG_LONG || blen > size - off)
+            goto next;
+
+        text = klog_get16(info, l->info_text_len);
+        if (text > blen - KLOG_LONG)
+            text = blen - KLOG_LONG;
+
+        klog_emit(ctx, klog_get64(info, l->info_ts_nsec),
+                  prb->data + off + KLOG_LONG, text);
+
+next:
+        if (id == prb->head_id)
+            return;
+    }
+}
+
+static int klog_find_lockless(struct klog *ctx, struct klog_prb *prb)
+{
+    static const uint32_t text_rings[] = { 20, 24 };
+    struct klog_layout *l = &ctx->layout;
+    uint32_t rb_virt;
+    uint8_t rb[64];
+    size_t i;
+    int rc;
+
+    if ((rc = klog_read_word(ctx, l->prb, &rb_virt)) < 0)
+        return rc;
+
+    if ((rc = klog_read_virt(ctx, rb_virt, rb, sizeof(rb))) < 0)
+        return rc;
+
+    if (l->rb_desc_ring + l->dr_tail_id + KLOG_LONG > sizeof(rb))
+        return -EINVAL;
+
+    prb->count_bits = klog_get32(rb, l->rb_desc_ring + l->dr_count_bits);
+    prb->descs_at = klog_get32(rb, l->rb_desc_ring + l->dr_descs);
+    prb->infos_at = klog_get32(rb, l->rb_desc_ring + l->dr_infos);
+    prb->head_id = klog_get32(rb, l->rb_desc_ring + l->dr_head_id);
+    prb->tail_id = klog_get32(rb, l->rb_desc_ring + l->dr_tail_id);
+
+    /* Take the first text ring description that looks like one */
+    for (i = 0; i < ARRAY_SIZE(text_rings); i++) {
+        if (!l->rb_known)
+            l->rb_text_data_ring = text_rings[i];
+
+        if (l->rb_text_data_ring + l->data_data + KLOG_LONG > sizeof(rb))
+            return -EINVAL;
+
+        prb->size_bits = klog_get32(rb, l->rb_text_data_ring + l->data_size_bits);
+        prb->data_at = klog_get32(rb, l->rb_text_data_ring + l->data_data);
+        if ((prb->size_bits >= 8 && prb->size_bits <= 25 &&
+                prb->data_at >= ctx->page_offset) || l->rb_known)
+            break;
+    }
+
+    if (prb->count_bits > 20 || prb->size_bits < 8 || prb->size_bits > 25 ||
+            ((uint64_t)l->info_size << prb->count_bits) > KLOG_BUF_MAX) {
+        loge("Implausible printk ring of 2^%" PRIu32 " records in 2^%" PRIu32
+             " bytes\n", prb->count_bits, prb->size_bits);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int klog_dump_lockless(struct klog *ctx)
+{
+    struct klog_layout *l = &ctx->layout;
+    struct klog_prb prb = { 0 };
+    int rc;
+
+    if ((rc = klog_find_lockless(ctx, &prb)) < 0)
+        return rc;
+
+    logi("Reading the %uKiB printk ring at 0x%08" PRIx32 " with %u records\n",
+         (1u << prb.size_bits) >> 10, prb.data_at, 1u << prb.count_bits);
+
+    prb.descs = malloc((size_t)l->desc_size << prb.count_bits);
+    prb.infos = malloc((size_t)l->info_size << prb.count_bits);
+    prb.data = malloc(1u << prb.size_bits);
+    if (!prb.descs || !prb.infos || !prb.data) {
+        rc = -ENOMEM;
+        goto done;
+    }
+
+    if ((rc = klog_read_virt(ctx, prb.descs_at, prb.descs,
+                             (size_t)l->desc_size << prb.count_bits)) < 0)
+        goto done;
+
+    if ((rc = klog_read_virt(ctx, prb.infos_at, prb.infos,
+                             (size_t)l->info_size << prb.count_bits)) < 0)
+        goto done;
+
+    if ((rc = klog_read_virt(ctx, prb.data_at, prb.data, 1u << prb.size_bits)) < 0)
+        goto done;
+
+    klog_walk_lockless(ctx, &prb);
+
+done:
+    free(prb.descs);
+    free(prb.infos);
+    free(prb.data);
+
+    return rc;
+}
+
+/* A ring found by its first record, which only survives until it wraps */
+static int klog_dump_anchor(struct klog *ctx, uint32_t phys)
+{
+    uint32_t len = ctx->ram_start + ctx->ram_len - phys;
+    uint8_t *buf;
+    int rc;
+
+    if (len > KLOG_ANCHOR_MAX)
+        len = KLOG_ANCHOR_MAX;
+
+    logi("Following the printk records from 0x%08" PRIx32 "\n", phys);
+
+    if (!(buf = malloc(len)))
+        return -ENOMEM;
+
+    if (!(rc = klog_read_phys(ctx, phys, buf, len)))
+        klog_walk_legacy(ctx, buf, len, 0, 0, false);
+
+    free(buf);
+
+    return rc;
+}
+
+enum klog_pattern {
+    klog_pattern_log_buf,
+    klog_pattern_prb,
+    klog_pattern_anchor,
+};
+
+struct klog_scan {
+    bool vmcoreinfo;
+    uint64_t vmcoreinfo_at;
+    uint64_t anchors[KLOG_SCAN_ANCHORS];
+    unsigned int nanchors;
+};
+
+static int klog_scan_match(void *priv, unsigned int pattern, uint64_t offset,
+                           size_t len __unused)
+{
+    struct klog_scan *scan = priv;
+
+    /* Checked once the chunk's in, as the bridge is busy until then */
+    if (pattern != klog_pattern_anchor) {
+        if (!scan->vmcoreinfo) {
+            scan->vmcoreinfo = true;
+            scan->vmcoreinfo_at = offset;
+        }
+        return 0;
+    }
+
+    if (scan->nanchors < KLOG_SCAN_ANCHORS)
+        scan->anchors[scan->nanchors++] = offset;
+
+    return 0;
+}
+
+static bool klog_scan_vmcoreinfo(struct klog *ctx, uint32_t phys)
+{
+    uint32_t start, end, ram_end = ctx->ram_start + ctx->ram_len;
+    struct klog_layout layout = klog_layout_arm;
+    unsigned int found;
+    char *text;
+
+    start = phys - ctx->ram_start > KLOG_VMCOREINFO_MAX ?
+            phys - KLOG_VMCOREINFO_MAX : ctx->ram_start;
+    end = ram_end - phys > KLOG_VMCOREINFO_MAX ?
+          phys + KLOG_VMCOREINFO_MAX : ram_end;
+
+    if (!(text = malloc(end - start)))
+        return false;
+
+    if (klog_read_phys(ctx, start, text, end - start) < 0) {
+        free(text);
+        return false;
+    }
+
+    found = klog_parse_vmcoreinfo(&layout, text, end - start);
+    free(text);
+
+    if (!layout.prb && !layout.log_buf)
+        return false;
+
+    logi("Found vmcoreinfo at 0x%08" PRIx32 " with %u printk entries\n", phys,
+         found);
+    ctx->layout = layout;
+
+    return true;
+}
+
+/* The header of the kernel's first record, just before its text */
+static bool klog_scan_anchor(struct klog *ctx, uint32_t text_phys)
+{
+    const struct klog_layout *l = &klog_layout_arm;
+    uint8_t hdr[16];
+    uint16_t rec, text, dict;
+    uint32_t need;
+
+    if (text_phys - ctx->ram_start < sizeof(hdr) ||
+            klog_read_phys(ctx, text_phys - sizeof(hdr), hdr, sizeof(hdr)) < 0)
+        return false;
+
+    rec = klog_get16(hdr, l->log_len);
+    text = klog_get16(hdr, l->log_text_len);
+    dict = klog_get16(hdr, 12);
+    need = sizeof(hdr) + text + dict;
+
+    return text >= strlen(KLOG_ANCHOR) && rec >= need && rec < need + 8 &&
+           !(rec & 3) && klog_get64(hdr, l->log_ts_nsec) < 60000000000ULL;
+}
+
+/* One pass from the bottom of DRAM, stopping at the first usable find */
+static int klog_scan(struct klog *ctx, uint32_t *anchor)
+{
+    struct klog_scan scan = { 0 };
+    struct progress progress;
+    struct search search;
+    uint32_t off, len;
+    unsigned int i;
+    uint8_t *buf;
+    int rc;
+
+    *anchor = 0;
+
+    search_init(&search);
+    if ((rc = search_add_literal(&search, "SYMBOL(log_buf)=", 16)) < 0 ||
+            (rc = search_add_literal(&search, "SYMBOL(prb)=", 12)) < 0 ||
+            (rc = search_add_literal(&search, KLOG_ANCHOR,
+                                     strlen(KLOG_ANCHOR))) < 0 ||
+            (rc = search_compile(&search)) < 0)
+        goto cleanup_search;
+
+    if (!(buf = malloc(KLOG_SCAN_CHUNK))) {
+        rc = -ENOMEM;
+        goto cleanup_search;
+    }
+
+    rc = -ENOENT;
+    progress_init(&progress, "scan", ctx->ram_len);
+    for (off = 0; off < ctx->ram_len; off += len) {
+        len = ctx->ram_len - off < KLOG_SCAN_CHUNK ?
+              ctx->ram_len - off : KLOG_SCAN_CHUNK;
+
+        if ((rc = klog_read_phys(ctx, ctx->ram_start + off, buf, len)) < 0)
+            break;
+
+        if ((rc = search_feed(&search, buf, len, klog_scan_match, &scan)) < 0)
+            break;
+
+        progress_update(&progress, len);
+        rc = -ENOENT;
+
+        if (scan.vmcoreinfo) {
+            scan.vmcoreinfo = false;
+            if (klog_scan_vmcoreinfo(ctx, ctx->ram_start + scan.vmcoreinfo_at)) {
+                rc = 0;
+                break;
+            }
+        }
+
+        for (i = 0; i < scan.nanchors; i++) {
+            if (klog_scan_anchor(ctx, ctx->ram_start + scan.anchors[i])) {
+                *anchor = ctx->ram_start + scan.anchors[i] -
+                          klog_layout_arm.log_size;
+                rc = 0;
+                break;
+            }
+        }
+        scan.nanchors = 0;
+
+        if (*anchor)
+            break;
+    }
+    progress_end(&progress);
+
+    free(buf);
+
+cleanup_search:
+    search_destroy(&search);
+
+    return rc;
+}
+
+static int klog_init(struct klog *ctx, struct soc *soc,
+                     const struct klog_opts *opts, FILE *out)
+{
+    struct soc_region dram, vram;
+    struct sdmc *sdmc;
+    int rc;
+
+    if (!(sdmc = sdmc_get(soc))) {
+        loge("Failed to acquire SDRAM memory controller\n");
+        return -ENODEV;
+    }
+
+    if ((rc = sdmc_get_dram(sdmc, &dram)) < 0 ||
+            (rc = sdmc_get_vram(sdmc, &vram)) < 0) {
+        loge("Failed to locate DRAM: %d\n", rc);
+        return rc;
+    }
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->soc = soc;
+    ctx->layout = klog_layout_arm;
+    ctx->page_offset = opts->page_offset;
+    ctx->ram_start = dram.start;
+    ctx->ram_len = dram.length - vram.length;
+    ctx->out = out;
+
+    return 0;
+}
+
+static int klog_add_region(struct klog *ctx, struct soc_region *regions,
+                           size_t *nregions, uint32_t virt, uint64_t len)
+{
+    if (virt < ctx->page_offset ||
+            virt - ctx->page_offset + len > ctx->ram_len)
+        return -ERANGE;
+
+    regions[*nregions].start = ctx->ram_start + (virt - ctx->page_offset);
+    regions[*nregions].length = len;
+    (*nregions)++;
+
+    return 0;
+}
+
+int klog_locate(struct soc *soc, const struct klog_opts *opts,
+                struct soc_region regions[KLOG_REGIONS_MAX], size_t *nregions)
+{
+    struct klog_legacy lg;
+    struct klog_prb prb;
+    struct klog ctx;
+    int rc;
+
+    *nregions = 0;
+
+    if (!opts->system_map)
+        return -ENOENT;
+
+    if ((rc = klog_init(&ctx, soc, opts, NULL)) < 0)
+        return rc;
+
+    if ((rc = klog_parse_system_map(&ctx.layout, opts->system_map)) < 0)
+        return rc;
+
+    if (ctx.layout.prb) {
+        if ((rc = klog_find_lockless(&ctx, &prb)) < 0)
+            return rc;
+
+        if ((rc = klog_add_region(&ctx, regions, nregions, prb.descs_at,
+                                  (uint64_t)ctx.layout.desc_size << prb.count_bits)) < 0 ||
+                (rc = klog_add_region(&ctx, regions, nregions, prb.infos_at,
+                                      (uint64_t)ctx.layout.info_size << prb.count_bits)) < 0)
+            return rc;
+
+        return klog_add_region(&ctx, regions, nregions, prb.data_at,
+                               1u << prb.size_bits);
+    }
+
+    if ((rc = klog_find_legacy(&ctx, &lg)) < 0)
+        return rc;
+
+    return klog_add_region(&ctx, regions, nregions, lg.buf, lg.len);
+}
+
+int klog_read(struct soc *soc, const struct klog_opts *opts, FILE *out)
+{
+    struct klog ctx;
+    uint32_t anchor = 0;
+    int rc;
+
+    if ((rc = klog_init(&ctx, soc, opts, out)) < 0)
+        return rc;
+
+    if (opts->system_map)
+        rc = klog_parse_system_map(&ctx.layout, opts->system_map);
+    else
+        rc = klog_scan(&ctx, &anchor);
+
+    if (rc < 0) {
+        if (rc == -ENOENT && !opts->system_map)
+            loge("No printk ring found, try --system-map\n");
+        return rc;
+    }
+
+    if (ctx.layout.prb)
+        rc = klog_dump_lockless(&ctx);
+    else if (ctx.layout.log_buf)
+        rc = klog_dump_legacy(&ctx);
+    else
+        rc = klog_dump_anchor(&ctx, anchor);
+
+    if (rc < 0)
+        return rc;
+
+    logi("Recovered %" PRIu64 " kernel log records\n", ctx.records);
+
+    return ctx.records ? 0 : -ENOENT;
+}
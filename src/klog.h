@@ -0,0 +1,43 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _KLOG_H
+#define _KLOG_H
+
+#include "soc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Where the BMC kernel maps DRAM, unless told otherwise */
+#define KLOG_PAGE_OFFSET 0x80000000
+
+/* The lockless ring's descriptors, record metadata and text */
+#define KLOG_REGIONS_MAX 3
+
+struct klog_opts {
+    /* The kernel's System.map, for the printk symbols, or NULL to scan */
+    const char *system_map;
+    /* Virtual address of the start of DRAM in the kernel's linear map */
+    uint32_t page_offset;
+};
+
+/*
+ * Finds the BMC kernel's printk ring and writes its records to @out as dmesg
+ * does. The ring is located from @opts->system_map if given, otherwise by
+ * scanning DRAM for the kernel's vmcoreinfo or, failing that, for the first
+ * record of a ring that hasn't yet wrapped. Both the fixed-record ring of
+ * kernels before 5.10 and the lockless ring since are understood, as laid out
+ * by 32-bit ARM.
+ */
+int klog_read(struct soc *soc, const struct klog_opts *opts, FILE *out);
+
+/*
+ * Finds the physical memory holding the printk ring from @opts->system_map,
+ * without reading the ring itself. Returns -ENOENT without a System.map, as
+ * the alternative is a scan of DRAM.
+ */
+int klog_locate(struct soc *soc, const struct klog_opts *opts,
+                struct soc_region regions[KLOG_REGIONS_MAX], size_t *nregions);
+
+#endif
@@ -0,0 +1,294 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "flash.h"
+#include "layout.h"
+#include "log.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* The partitions from OpenBMC's openbmc-flash-layout{,-64}.dtsi */
+static const struct {
+    const char *name;
+    const char *spec;
+} layout_presets[] = {
+    { "openbmc", "384k(u-boot),128k(u-boot-env),4352k(kernel),23808k(rofs),"
+                 "4096k(rwfs)" },
+    { "openbmc-64", "896k(u-boot),128k(u-boot-env),9216k(kernel),32768k(rofs),"
+                    "22528k(rwfs)" },
+};
+
+#define FMAP_SIGNATURE      "__FMAP__"
+#define FMAP_HDR_LEN        56
+#define FMAP_AREA_LEN       42
+/* FMAPs are placed on an erase block boundary in practice, look at each 64K */
+#define FMAP_STRIDE         (64 << 10)
+
+static const char *layout_spec;
+
+int layout_set_spec(const char *spec)
+{
+    struct flash_layout layout;
+    unsigned int i;
+
+    for (i = 0; i < sizeof(layout_presets) / sizeof(layout_presets[0]); i++) {
+        if (!strcmp(layout_presets[i].name, spec)) {
+            layout_spec = layout_presets[i].spec;
+            return 0;
+        }
+    }
+
+    /* Catch syntax errors up front, bounds are checked against the chip */
+    if (layout_parse_mtdparts(&layout, spec, UINT32_MAX) < 0)
+        return -EINVAL;
+
+    layout_spec = spec;
+
+    return 0;
+}
+
+static int layout_add(struct flash_layout *layout, const char *name,
+                      size_t len, uint64_t offset, uint64_t size,
+                      uint32_t tsize)
+{
+    struct flash_part *part;
+
+    if (layout->nparts == LAYOUT_PARTS_MAX || !len || len > LAYOUT_NAME_MAX)
+        return -EINVAL;
+
+    if (!size || offset + size > tsize)
+        return -ERANGE;
+
+    part = &layout->parts[layout->nparts++];
+    memcpy(part->name, name, len);
+    part->name[len] = '\0';
+    part->offset = offset;
+    part->size = size;
+
+    return 0;
+}
+
+static int layout_parse_size(const char **cursor, uint64_t *size)
+{
+    char *end;
+
+    errno = 0;
+    *size = strtoull(*cursor, &end, 0);
+    if (errno || end == *cursor)
+        return -EINVAL;
+
+    switch (*end) {
+        case 'g': case 'G':
+            *size <<= 10;
+            /* fallthrough */
+        case 'm': case 'M':
+            *size <<= 10;
+            /* fallthrough */
+        case 'k': case 'K':
+            *size <<= 10;
+            end++;
+            break;
+    }
+
+    *cursor = end;
+
+    return 0;
+}
+
+/*
+ * As for the kernel's mtdparts= parameter: comma-separated SIZE[@OFFSET](NAME)
+ * entries with an optional leading "ID:", an optional "ro" suffix, and a SIZE
+ * of '-' for the rest of the chip. Entries without an OFFSET follow on from
+ * the previous one.
+ */
+int layout_parse_mtdparts(struct flash_layout *layout, const char *spec,
+                          uint32_t tsize)
+{
+    uint64_t offset = 0, size;
+    const char *cursor, *name;
+    int rc;
+
+    layout->nparts = 0;
+
+    if ((cursor = strchr(spec, ':')))
+        spec = cursor + 1;
+
+    cursor = spec;
+    while (*cursor) {
+        if (*cursor == '-') {
+            size = 0;
+            cursor++;
+        } else if ((rc = layout_parse_size(&cursor, &size)) < 0) {
+            return rc;
+        }
+
+        if (*cursor == '@') {
+            cursor++;
+            if ((rc = layout_parse_size(&cursor, &offset)) < 0)
+                return rc;
+        }
+
+        if (!size) {
+            if (offset >= tsize)
+                return -ERANGE;
+            size = tsize - offset;
+        }
+
+        if (*cursor++ != '(' || !(name = strchr(cursor, ')')))
+            return -EINVAL;
+
+        rc = layout_add(layout, cursor, name - cursor, offset, size, tsize);
+        if (rc < 0)
+            return rc;
+
+        offset += size;
+        cursor = name + 1;
+
+        if (!strncmp(cursor, "ro", 2))
+            cursor += 2;
+
+        if (*cursor == ',')
+            cursor++;
+        else if (*cursor)
+            return -EINVAL;
+    }
+
+    return layout->nparts ? 0 : -EINVAL;
+}
+
+static uint32_t layout_get_le(const uint8_t *p, unsigned int len)
+{
+    uint32_t val = 0;
+
+    while (len--)
+        val = (val << 8) | p[len];
+
+    return val;
+}
+
+/* @buf holds an FMAP, starting with its signature */
+int layout_parse_fmap(struct flash_layout *layout, const void *buf, size_t len,
+                      uint32_t tsize)
+{
+    const uint8_t *fmap = buf;
+    unsigned int i, nareas;
+    int rc;
+
+    layout->nparts = 0;
+
+    if (len < FMAP_HDR_LEN || memcmp(fmap, FMAP_SIGNATURE, 8) || fmap[8] != 1)
+        return -EINVAL;
+
+    nareas = layout_get_le(&fmap[54], 2);
+    if (len < FMAP_HDR_LEN + nareas * FMAP_AREA_LEN)
+        return -EINVAL;
+
+    for (i = 0; i < nareas; i++) {
+        const uint8_t *area = &fmap[FMAP_HDR_LEN + i * FMAP_AREA_LEN];
+        const char *name = (const char *)&area[8];
+
+        rc = layout_add(layout, name, strnlen(name, LAYOUT_NAME_MAX),
+                        layout_get_le(&area[0], 4), layout_get_le(&area[4], 4),
+                        tsize);
+        if (rc < 0)
+            return rc;
+    }
+
+    return layout->nparts ? 0 : -EINVAL;
+}
+
+static int layout_find_fmap(struct flash_chip *chip, struct flash_layout *layout)
+{
+    uint8_t hdr[FMAP_HDR_LEN];
+    uint32_t offset;
+    uint8_t *fmap;
+    size_t len;
+    int rc;
+
+    logd("Searching for an FMAP\n");
+
+    for (offset = 0; offset + sizeof(hdr) <= chip->tsize; offset += FMAP_STRIDE) {
+        if ((rc = flash_read(chip, offset, hdr, sizeof(hdr))) < 0)
+            return rc;
+
+        if (memcmp(hdr, FMAP_SIGNATURE, 8))
+            continue;
+
+        len = FMAP_HDR_LEN + layout_get_le(&hdr[54], 2) * FMAP_AREA_LEN;
+        if (!(fmap = malloc(len)))
+            return -ENOMEM;
+
+        if ((rc = flash_read(chip, offset, fmap, len)) < 0) {
+            free(fmap);
+            return rc;
+        }
+
+        rc = layout_parse_fmap(layout, fmap, len, chip->tsize);
+        free(fmap);
+
+        if (!rc) {
+            logi("Found an FMAP at 0x%08" PRIx32 "\n", offset);
+            return 0;
+        }
+    }
+
+    return -ENOENT;
+}
+
+int layout_discover(struct flash_chip *chip, struct flash_layout *layout)
+{
+    int rc;
+
+    if (layout_spec) {
+        rc = layout_parse_mtdparts(layout, layout_spec, chip->tsize);
+        if (rc < 0)
+            loge("Flash layout doesn't fit the %" PRIu32 " byte chip: %d\n",
+                 chip->tsize, rc);
+        return rc;
+    }
+
+    if ((rc = layout_find_fmap(chip, layout)) == -ENOENT)
+        loge("No FMAP found on the chip, describe it with --flash-layout\n");
+
+    return rc;
+}
+
+const struct flash_part *layout_find(const struct flash_layout *layout,
+                                     const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < layout->nparts; i++) {
+        if (!strcmp(layout->parts[i].name, name))
+            return &layout->parts[i];
+    }
+
+    return NULL;
+}
+
+int flash_get_part(struct flash_chip *chip, const char *name,
+                   struct flash_part *part)
+{
+    struct flash_layout layout;
+    const struct flash_part *found;
+    unsigned int i;
+    int rc;
+
+    if ((rc = layout_discover(chip, &layout)) < 0)
+        return rc;
+
+    if (!(found = layout_find(&layout, name))) {
+        loge("No partition named '%s', the layout has:\n", name);
+        for (i = 0; i < layout.nparts; i++)
+            loge("  %-16s 0x%08" PRIx32 "-0x%08" PRIx32 "\n",
+                 layout.parts[i].name, layout.parts[i].offset,
+                 layout.parts[i].offset + layout.parts[i].size - 1);
+        return -ENOENT;
+    }
+
+    *part = *found;
+
+    return 0;
+}
@@ -0,0 +1,45 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _LAYOUT_H
+#define _LAYOUT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct flash_chip;
+
+#define LAYOUT_NAME_MAX     32
+#define LAYOUT_PARTS_MAX    32
+
+struct flash_part {
+    char name[LAYOUT_NAME_MAX + 1];
+    uint32_t offset;
+    uint32_t size;
+};
+
+struct flash_layout {
+    struct flash_part parts[LAYOUT_PARTS_MAX];
+    unsigned int nparts;
+};
+
+/*
+ * @spec is an mtdparts-style list, e.g. "384k(u-boot),128k(u-boot-env),-(rofs)",
+ * or the name of a well-known layout such as "openbmc". Without one the layout
+ * is taken from an FMAP on the chip.
+ */
+int layout_set_spec(const char *spec);
+
+int layout_parse_mtdparts(struct flash_layout *layout, const char *spec,
+                          uint32_t tsize);
+int layout_parse_fmap(struct flash_layout *layout, const void *buf, size_t len,
+                      uint32_t tsize);
+
+int layout_discover(struct flash_chip *chip, struct flash_layout *layout);
+const struct flash_part *layout_find(const struct flash_layout *layout,
+                                     const char *name);
+
+/* Discover the chip's layout and look up @name in it */
+int flash_get_part(struct flash_chip *chip, const char *name,
+                   struct flash_part *part);
+
+#endif
@@ -2,9 +2,13 @@
 
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+/* Messages that fit are formatted on the stack, longer ones are allocated */
+#define LOG_BUF_LEN 512
+
 const char *log_colour_codes[] = {
     [colour_white]  = "\e[97m",
     [colour_yellow] = "\e[93m",
@@ -19,7 +23,12 @@ const int log_colour_lookup[] = {
     [level_error] = colour_red,
 };
 
-static enum log_level log_current_level;
+static const char log_reset_code[] = "\e[0m";
+
+enum log_level log_current_level;
+
+/* Whether stderr is a terminal, looked up on the first message */
+static int log_tty = -1;
 
 static void log_write_all(int fd, const char *buf, size_t len)
 {
@@ -36,58 +45,77 @@ static void log_write_all(int fd, const char *buf, size_t len)
     }
 }
 
-static void log_set_colour(int fd, enum log_colour colour)
+/*
+ * Formats @head, the message and @tail into one buffer so each message is a
+ * single write, and isn't torn by output from other threads.
+ */
+static void log_vwrite(int fd, const char *head, const char *tail,
+                       const char *fmt, va_list args)
 {
-    const char *code = log_colour_codes[colour];
+    char stack[LOG_BUF_LEN], *buf = stack;
+    size_t head_len, tail_len;
+    va_list copy;
+    int body;
+
+    head_len = strlen(head);
+    tail_len = strlen(tail);
+    memcpy(stack, head, head_len);
+
+    va_copy(copy, args);
+    body = vsnprintf(stack + head_len, sizeof(stack) - head_len, fmt, copy);
+    va_end(copy);
+    if (body < 0) {
+        perror("vsnprintf");
+        return;
+    }
 
-    log_write_all(fd, code, strlen(code));
-}
+    if (head_len + body + tail_len >= sizeof(stack)) {
+        if (!(buf = malloc(head_len + body + tail_len + 1))) {
+            perror("malloc");
+            return;
+        }
 
-static void log_reset_colour(int fd)
-{
-    const char *reset_code = "\e[0m";
+        memcpy(buf, head, head_len);
+        vsnprintf(buf + head_len, body + 1, fmt, args);
+    }
+
+    memcpy(buf + head_len + body, tail, tail_len);
+    log_write_all(fd, buf, head_len + body + tail_len);
 
-    log_write_all(fd, reset_code, 4);
+    if (buf != stack)
+        free(buf);
 }
 
 void log_msg(enum log_level lvl, const char *fmt, ...)
 {
     const int fd = fileno(stderr);
+    char head[16] = "[*] ";
     va_list args;
-    int rc;
 
     if (lvl > log_current_level)
         return;
 
-    if (isatty(fd))
-        log_set_colour(fd, log_colour_lookup[lvl]);
+    if (log_tty < 0)
+        log_tty = isatty(fd);
 
-    log_write_all(fd, "[*] ", 4);
-
-    if (isatty(fd))
-        log_reset_colour(fd);
+    if (log_tty)
+        snprintf(head, sizeof(head), "%s[*] %s",
+                 log_colour_codes[log_colour_lookup[lvl]], log_reset_code);
 
     va_start(args, fmt);
-    rc = vdprintf(fd, fmt, args);
+    log_vwrite(fd, head, "", fmt, args);
     va_end(args);
-    if (rc < 0) { perror("vdprintf"); }
 }
 
 void log_highlight(int fd, enum log_colour colour, const char *fmt, ...)
 {
+    int tty = isatty(fd);
     va_list args;
-    int rc;
-
-    if (isatty(fd))
-        log_set_colour(fd, colour);
 
     va_start(args, fmt);
-    rc = vdprintf(fd, fmt, args);
+    log_vwrite(fd, tty ? log_colour_codes[colour] : "",
+               tty ? log_reset_code : "", fmt, args);
     va_end(args);
-    if (rc < 0) { perror("vdprintf"); }
-
-    if (isatty(fd))
-        log_reset_colour(fd);
 }
 
 void log_set_level(enum log_level level)
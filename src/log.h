@@ -1,19 +1,38 @@
 #ifndef _LOG_H
 #define _LOG_H
 
+#include "config.h"
+
 enum log_level { level_none, level_error, level_info, level_debug, level_trace };
 
 enum log_colour { colour_white, colour_yellow, colour_green, colour_red };
 
+/* Read at each call site so a disabled level costs a load and a compare */
+extern enum log_level log_current_level;
+
+#if HAVE_LOG_TRACE
+#define LOG_LEVEL_MAX level_trace
+#else
+#define LOG_LEVEL_MAX level_debug
+#endif
+
+#define log_enabled(lvl) ((lvl) <= LOG_LEVEL_MAX && (lvl) <= log_current_level)
+
 void log_msg(enum log_level lvl, const char *fmt, ...);
 
 void log_highlight(int fd, enum log_colour, const char *fmt, ...);
 
 void log_set_level(enum log_level);
 
-#define logt(f, ...) log_msg(level_trace, f, ##__VA_ARGS__)
-#define logd(f, ...) log_msg(level_debug, f, ##__VA_ARGS__)
-#define logi(f, ...) log_msg(level_info, f, ##__VA_ARGS__)
-#define loge(f, ...) log_msg(level_error, f, ##__VA_ARGS__)
+#define log_at(lvl, f, ...) \
+    do { \
+        if (log_enabled(lvl)) \
+            log_msg(lvl, f, ##__VA_ARGS__); \
+    } while (0)
+
+#define logt(f, ...) log_at(level_trace, f, ##__VA_ARGS__)
+#define logd(f, ...) log_at(level_debug, f, ##__VA_ARGS__)
+#define logi(f, ...) log_at(level_info, f, ##__VA_ARGS__)
+#define loge(f, ...) log_at(level_error, f, ##__VA_ARGS__)
 
 #endif
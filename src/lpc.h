@@ -8,16 +8,61 @@
 #include "compiler.h"
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
+#include <string.h>
 
 struct lpc
 {
     int fd;
     const char *space;
+    /* Set by backends reaching the space through a memory mapping */
+    volatile void *map;
+    /* Accessible length of the space, SIZE_MAX if not bounded by the backend */
+    size_t size;
 };
 
+/* A byte access for lpc_rw_batch(), writes take @data and reads fill @val */
+struct lpc_rw
+{
+    size_t addr;
+    bool write;
+    uint8_t data;
+    uint8_t *val;
+};
+
+/*
+ * How port I/O waits for slow devices to settle between accesses. Only the x86
+ * backend issues port I/O directly, elsewhere the policy is ignored.
+ */
+enum lpc_settle { lpc_settle_port80, lpc_settle_none, lpc_settle_delay };
+
+static inline int lpc_parse_settle(const char *name, enum lpc_settle *settle)
+{
+    if (!strcmp("port80", name))
+        *settle = lpc_settle_port80;
+    else if (!strcmp("none", name))
+        *settle = lpc_settle_none;
+    else if (!strcmp("delay", name))
+        *settle = lpc_settle_delay;
+    else
+        return -1;
+
+    return 0;
+}
+
 #if HAVE_LPC
+void lpc_set_settle(enum lpc_settle settle);
+enum lpc_settle lpc_get_settle(void);
+
+/*
+ * Where the host chipset decodes memory accesses to LPC firmware cycles, for
+ * backends without a kernel interface to the "fw" space. Culvert doesn't
+ * program the decode, the platform firmware must have set it up.
+ */
+int lpc_set_fw_window(uint64_t phys, size_t len);
+
 int lpc_init(struct lpc *ctx, const char *space);
 int lpc_destroy(struct lpc *ctx);
 
@@ -30,7 +75,28 @@ int lpc_writel(struct lpc *ctx, size_t addr, uint32_t val);
 
 int lpc_read(struct lpc *ctx, size_t addr, void *val, size_t size);
 int lpc_write(struct lpc *ctx, size_t addr, const void *val, size_t size);
+
+/* Issues @count accesses in order, stopping at the first failure */
+int lpc_rw_batch(struct lpc *ctx, const struct lpc_rw *rw, size_t count);
+
+/*
+ * Writes @count bytes to the one I/O port @addr back to back, settling once
+ * after the last, for filling a device's FIFO
+ */
+int lpc_writesb(struct lpc *ctx, size_t addr, const void *buf, size_t count);
 #else
+static inline void lpc_set_settle(enum lpc_settle settle __unused) { }
+
+static inline enum lpc_settle lpc_get_settle(void)
+{
+    return lpc_settle_port80;
+}
+
+static inline int lpc_set_fw_window(uint64_t phys __unused, size_t len __unused)
+{
+    return -ENOTSUP;
+}
+
 static inline int
 lpc_init(struct lpc *ctx __unused, const char *space __unused)
 {
@@ -96,6 +162,20 @@ lpc_write(struct lpc *ctx __unused, size_t addr __unused, const void *val
 {
     return -ENOTSUP;
 }
+
+static inline int
+lpc_rw_batch(struct lpc *ctx __unused, const struct lpc_rw *rw __unused,
+             size_t count __unused)
+{
+    return -ENOTSUP;
+}
+
+static inline int
+lpc_writesb(struct lpc *ctx __unused, size_t addr __unused,
+            const void *buf __unused, size_t count __unused)
+{
+    return -ENOTSUP;
+}
 #endif
 
 #endif
@@ -0,0 +1,122 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include "log.h"
+#include "manifest.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MANIFEST_MAGIC      "CVMANIF"
+#define MANIFEST_VERSION    1
+
+/* In host byte order, followed by the digests of each page in turn */
+struct manifest_hdr {
+    char magic[8];
+    uint32_t version;
+    uint32_t page;
+    uint32_t phys;
+    uint32_t len;
+};
+
+int manifest_load(struct manifest *ctx, const char *path, uint32_t phys,
+                  uint32_t len, uint32_t page)
+{
+    struct manifest_hdr hdr;
+    size_t digests_len;
+    FILE *prev;
+    int rc = 0;
+
+    ctx->phys = phys;
+    ctx->len = len;
+    ctx->page = page;
+    ctx->npages = (len + (size_t)page - 1) / page;
+    ctx->digests = NULL;
+
+    if (!(prev = fopen(path, "r")))
+        return errno == ENOENT ? 0 : -errno;
+
+    if (fread(&hdr, sizeof(hdr), 1, prev) != 1 ||
+            memcmp(hdr.magic, MANIFEST_MAGIC, sizeof(hdr.magic)) ||
+            hdr.version != MANIFEST_VERSION) {
+        logi("%s isn't a capture manifest, fetching everything\n", path);
+        goto cleanup_prev;
+    }
+
+    if (hdr.page != page || hdr.phys != phys || hdr.len != len) {
+        logi("Manifest describes a different capture, fetching everything\n");
+        goto cleanup_prev;
+    }
+
+    digests_len = ctx->npages * MANIFEST_DIGEST_LEN;
+    if (!(ctx->digests = malloc(digests_len))) {
+        rc = -ENOMEM;
+        goto cleanup_prev;
+    }
+
+    if (fread(ctx->digests, digests_len, 1, prev) != 1) {
+        logi("Manifest is truncated, fetching everything\n");
+        free(ctx->digests);
+        ctx->digests = NULL;
+    }
+
+cleanup_prev:
+    fclose(prev);
+
+    return rc;
+}
+
+void manifest_destroy(struct manifest *ctx)
+{
+    free(ctx->digests);
+}
+
+int manifest_save(const struct manifest *ctx, const char *path,
+                  const uint8_t *digests)
+{
+    struct manifest_hdr hdr = {
+        .magic = MANIFEST_MAGIC,
+        .version = MANIFEST_VERSION,
+        .page = ctx->page,
+        .phys = ctx->phys,
+        .len = ctx->len,
+    };
+    FILE *file;
+    char *tmp;
+    int rc = 0;
+
+    if (asprintf(&tmp, "%s.tmp", path) < 0)
+        return -ENOMEM;
+
+    if (!(file = fopen(tmp, "w"))) {
+        rc = -errno;
+        goto cleanup_tmp;
+    }
+
+    if (fwrite(&hdr, sizeof(hdr), 1, file) != 1 ||
+            fwrite(digests, ctx->npages * MANIFEST_DIGEST_LEN, 1, file) != 1) {
+        rc = -EIO;
+        goto cleanup_file;
+    }
+
+    if (fflush(file) || fdatasync(fileno(file))) {
+        rc = -errno;
+        goto cleanup_file;
+    }
+
+    if (rename(tmp, path))
+        rc = -errno;
+
+cleanup_file:
+    fclose(file);
+    if (rc < 0)
+        unlink(tmp);
+
+cleanup_tmp:
+    free(tmp);
+
+    return rc;
+}
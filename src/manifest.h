@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _MANIFEST_H
+#define _MANIFEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define MANIFEST_DIGEST_LEN 32
+
+/*
+ * The per-page digests of a previous capture of a memory region, so a fresh
+ * capture into the same file only needs to fetch the pages that changed.
+ */
+struct manifest {
+    uint32_t phys;
+    uint32_t len;
+    uint32_t page;
+    size_t npages;
+    /* NULL if there's no previous capture of the same region */
+    uint8_t *digests;
+};
+
+/* A missing or mismatched manifest isn't an error, just leaves no digests */
+int manifest_load(struct manifest *ctx, const char *path, uint32_t phys,
+                  uint32_t len, uint32_t page);
+void manifest_destroy(struct manifest *ctx);
+
+/* Replaces the manifest at @path with @digests, ctx->npages of them */
+int manifest_save(const struct manifest *ctx, const char *path,
+                  const uint8_t *digests);
+
+#endif
@@ -0,0 +1,302 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "log.h"
+#include "mirror.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Past this the BMC's memory is written again rather than kept on the host */
+#define MIRROR_MAX_BYTES    (512UL << 20)
+
+struct mirror_extent {
+    uint32_t start;
+    size_t len;
+    uint8_t *data;
+};
+
+bool mirror_enabled;
+
+static struct {
+    /* Bridges may be striped across threads, see ahb_share() */
+    pthread_mutex_t lock;
+    struct mirror_extent *ext;
+    size_t count;
+    size_t alloc;
+    size_t bytes;
+    bool full;
+} mirror = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static inline uint64_t mirror_end(const struct mirror_extent *ext)
+{
+    return (uint64_t)ext->start + ext->len;
+}
+
+void mirror_enable(void)
+{
+    mirror_enabled = true;
+}
+
+static void mirror_clear(void)
+{
+    size_t i;
+
+    for (i = 0; i < mirror.count; i++)
+        free(mirror.ext[i].data);
+
+    free(mirror.ext);
+    mirror.ext = NULL;
+    mirror.count = 0;
+    mirror.alloc = 0;
+    mirror.bytes = 0;
+    mirror.full = false;
+}
+
+void mirror_destroy(void)
+{
+    mirror_clear();
+    mirror_enabled = false;
+}
+
+void mirror_invalidate(const char *why)
+{
+    if (!mirror_enabled)
+        return;
+
+    pthread_mutex_lock(&mirror.lock);
+    if (mirror.count)
+        logd("Dropping the %zu bytes mirrored of BMC memory: %s\n",
+             mirror.bytes, why);
+    mirror_clear();
+    pthread_mutex_unlock(&mirror.lock);
+}
+
+/* The first extent ending after @phys, or also at it if @touching */
+static size_t mirror_find(uint64_t phys, bool touching)
+{
+    size_t lo = 0, hi = mirror.count;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        uint64_t end = mirror_end(&mirror.ext[mid]);
+
+        if (end > phys || (touching && end == phys))
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+
+    return lo;
+}
+
+static int mirror_insert(size_t i, uint32_t start, size_t len, uint8_t *data)
+{
+    if (mirror.count == mirror.alloc) {
+        size_t alloc = mirror.alloc ? 2 * mirror.alloc : 16;
+        struct mirror_extent *ext;
+
+        if (!(ext = realloc(mirror.ext, alloc * sizeof(*ext))))
+            return -1;
+
+        mirror.ext = ext;
+        mirror.alloc = alloc;
+    }
+
+    memmove(&mirror.ext[i + 1], &mirror.ext[i],
+            (mirror.count - i) * sizeof(*mirror.ext));
+    mirror.ext[i].start = start;
+    mirror.ext[i].len = len;
+    mirror.ext[i].data = data;
+    mirror.count++;
+
+    return 0;
+}
+
+static void mirror_remove(size_t i, size_t n)
+{
+    memmove(&mirror.ext[i], &mirror.ext[i + n],
+            (mirror.count - i - n) * sizeof(*mirror.ext));
+    mirror.count -= n;
+}
+
+/* Drops [@phys, @end) from the extents, splitting any that straddle it */
+static void mirror_forget(uint64_t phys, uint64_t end)
+{
+    size_t i = mirror_find(phys, false);
+
+    while (i < mirror.count && mirror.ext[i].start < end) {
+        struct mirror_extent *ext = &mirror.ext[i];
+        uint64_t ext_end = mirror_end(ext);
+        bool left = ext->start < phys;
+        bool right = ext_end > end;
+
+        if (left && right) {
+            size_t rlen = ext_end - end;
+            uint8_t *rdata;
+
+            /* Without room for the right-hand piece, lose it too */
+            if ((rdata = malloc(rlen))) {
+                memcpy(rdata, ext->data + (end - ext->start), rlen);
+                if (mirror_insert(i + 1, end, rlen, rdata) < 0) {
+                    free(rdata);
+                    mirror.bytes -= rlen;
+                }
+            } else {
+                mirror.bytes -= rlen;
+            }
+
+            ext = &mirror.ext[i];
+            mirror.bytes -= end - phys;
+            ext->len = phys - ext->start;
+            return;
+        }
+
+        if (left) {
+            mirror.bytes -= ext_end - phys;
+            ext->len = phys - ext->start;
+            i++;
+        } else if (right) {
+            size_t off = end - ext->start;
+
+            memmove(ext->data, ext->data + off, ext->len - off);
+            mirror.bytes -= off;
+            ext->start = end;
+            ext->len -= off;
+            return;
+        } else {
+            mirror.bytes -= ext->len;
+            free(ext->data);
+            mirror_remove(i, 1);
+        }
+    }
+}
+
+void mirror_store(uint32_t phys, const void *buf, size_t len)
+{
+    uint64_t end = (uint64_t)phys + len;
+    uint64_t start, new_end;
+    size_t i, j, k, old = 0;
+    uint8_t *data;
+
+    if (!mirror_enabled || !len)
+        return;
+
+    pthread_mutex_lock(&mirror.lock);
+
+    i = mirror_find(phys, true);
+    for (j = i; j < mirror.count && mirror.ext[j].start <= end; j++)
+        old += mirror.ext[j].len;
+
+    start = (i < j && mirror.ext[i].start < phys) ? mirror.ext[i].start : phys;
+    new_end = (i < j && mirror_end(&mirror.ext[j - 1]) > end) ?
+                    mirror_end(&mirror.ext[j - 1]) : end;
+
+    if (mirror.bytes - old + (new_end - start) > MIRROR_MAX_BYTES) {
+        if (!mirror.full)
+            logd("Mirror reached %luMiB, no longer extending it\n",
+                 MIRROR_MAX_BYTES >> 20);
+        mirror.full = true;
+        mirror_forget(phys, end);
+        goto done;
+    }
+
+    /* Growing the first extent in place keeps appending windows cheap */
+    if (i < j && mirror.ext[i].start == start) {
+        if (!(data = realloc(mirror.ext[i].data, new_end - start)))
+            goto fail;
+        mirror.ext[i].data = data;
+        k = i + 1;
+    } else {
+        if (!(data = malloc(new_end - start)))
+            goto fail;
+        k = i;
+    }
+
+    for (; k < j; k++) {
+        memcpy(data + (mirror.ext[k].start - start), mirror.ext[k].data,
+               mirror.ext[k].len);
+        free(mirror.ext[k].data);
+    }
+
+    memcpy(data + (phys - start), buf, len);
+
+    if (i < j) {
+        mirror_remove(i + 1, j - i - 1);
+        mirror.ext[i].start = start;
+        mirror.ext[i].len = new_end - start;
+        mirror.ext[i].data = data;
+    } else if (mirror_insert(i, start, new_end - start, data) < 0) {
+        free(data);
+        goto done;
+    }
+
+    mirror.bytes += (new_end - start) - old;
+
+done:
+    pthread_mutex_unlock(&mirror.lock);
+
+    return;
+
+fail:
+    /* What the extents held is still right, just not what's new */
+    mirror_forget(phys, end);
+    goto done;
+}
+
+void mirror_note(uint32_t phys, const void *buf, size_t len)
+{
+    uint64_t end = (uint64_t)phys + len;
+    size_t i;
+
+    if (!len)
+        return;
+
+    pthread_mutex_lock(&mirror.lock);
+
+    if (!buf) {
+        mirror_forget(phys, end);
+        goto done;
+    }
+
+    for (i = mirror_find(phys, false);
+         i < mirror.count && mirror.ext[i].start < end; i++) {
+        struct mirror_extent *ext = &mirror.ext[i];
+        uint64_t lo = ext->start > phys ? ext->start : phys;
+        uint64_t hi = mirror_end(ext) < end ? mirror_end(ext) : end;
+
+        memcpy(ext->data + (lo - ext->start),
+               (const uint8_t *)buf + (lo - phys), hi - lo);
+    }
+
+done:
+    pthread_mutex_unlock(&mirror.lock);
+}
+
+size_t mirror_span(uint32_t phys, size_t len, const uint8_t **data)
+{
+    const struct mirror_extent *ext;
+    uint64_t avail;
+    size_t i;
+
+    *data = NULL;
+
+    if (!mirror_enabled)
+        return len;
+
+    pthread_mutex_lock(&mirror.lock);
+
+    i = mirror_find(phys, false);
+    if (i == mirror.count) {
+        avail = len;
+    } else if ((ext = &mirror.ext[i])->start <= phys) {
+        *data = ext->data + (phys - ext->start);
+        avail = mirror_end(ext) - phys;
+    } else {
+        avail = ext->start - phys;
+    }
+
+    pthread_mutex_unlock(&mirror.lock);
+
+    return avail < len ? avail : len;
+}
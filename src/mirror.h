@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _MIRROR_H
+#define _MIRROR_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * A copy of the DRAM culvert has written over a batch session, so writing
+ * mostly the same image again only sends what changed, without reading it
+ * back. Extents are kept sorted by physical address and neither overlap nor
+ * touch. Every bridge write that lands on one updates it, but writes the BMC
+ * makes itself can't be seen, so it's only good for memory the BMC leaves
+ * alone.
+ */
+extern bool mirror_enabled;
+
+void mirror_enable(void);
+void mirror_destroy(void);
+
+/*
+ * Drops every extent while staying enabled, for when the BMC may have written
+ * its memory itself: its CPU or coprocessor let go, or the SoC reset
+ */
+void mirror_invalidate(const char *why);
+
+/* Takes a copy of @buf as what's now at @phys, extending the mirror */
+void mirror_store(uint32_t phys, const void *buf, size_t len);
+
+/*
+ * What the bridges wrote to @phys, updating any of it the mirror holds, or
+ * with a NULL @buf dropping it because what landed isn't known
+ */
+void mirror_note(uint32_t phys, const void *buf, size_t len);
+
+/*
+ * How much of the start of @len bytes at @phys the mirror holds, pointing
+ * @data at its copy. If it doesn't hold @phys @data is NULL, and the length
+ * returned is how far it is to the next extent it does hold.
+ */
+size_t mirror_span(uint32_t phys, size_t len, const uint8_t **data);
+
+/* Called for each write the bridges make, see ahb_record() */
+static inline void mirror_written(uint32_t phys, const void *buf, size_t len)
+{
+    if (mirror_enabled)
+        mirror_note(phys, buf, len);
+}
+
+#endif
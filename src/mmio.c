@@ -5,40 +5,138 @@
 #include "mmio.h"
 
 #include <stdint.h>
+#include <string.h>
 
-volatile void *mmio_memcpy(volatile void * restrict dst, const volatile void * restrict src, size_t len)
+#if defined(__x86_64__) && defined(__SSE2__)
+#include <emmintrin.h>
+#define MMIO_HAVE_128 1
+#else
+#define MMIO_HAVE_128 0
+#endif
+
+/*
+ * The RAM side of each access goes through memcpy() so buffers at any offset
+ * take the word paths, only the device side needs to be aligned. Both copy
+ * @n bytes, a multiple of the access size, and advance the pointers.
+ */
+#define mmio_read_words(type, d, s, n)                                      \
+    do {                                                                    \
+        size_t _i = (n);                                                    \
+        for (; _i; _i -= sizeof(type)) {                                    \
+            type _v = *(const volatile type *)(s);                          \
+            memcpy((d), &_v, sizeof(type));                                 \
+            (d) += sizeof(type);                                            \
+            (s) += sizeof(type);                                            \
+        }                                                                   \
+    } while (0)
+
+#define mmio_write_words(type, d, s, n)                                     \
+    do {                                                                    \
+        size_t _i = (n);                                                    \
+        for (; _i; _i -= sizeof(type)) {                                    \
+            type _v;                                                        \
+            memcpy(&_v, (s), sizeof(type));                                 \
+            *(volatile type *)(d) = _v;                                     \
+            (d) += sizeof(type);                                            \
+            (s) += sizeof(type);                                            \
+        }                                                                   \
+    } while (0)
+
+#if MMIO_HAVE_128
+/* asm keeps the compiler from splitting or merging the device accesses */
+#define mmio_read_128(d, s, n)                                              \
+    do {                                                                    \
+        size_t _i = (n);                                                    \
+        for (; _i; _i -= 16) {                                              \
+            __m128i _v;                                                     \
+            asm volatile("movdqa %1, %0"                                    \
+                         : "=x"(_v) : "m"(*(const volatile __m128i *)(s))); \
+            _mm_storeu_si128((__m128i *)(d), _v);                           \
+            (d) += 16;                                                      \
+            (s) += 16;                                                      \
+        }                                                                   \
+    } while (0)
+
+#define mmio_write_128(d, s, n)                                             \
+    do {                                                                    \
+        size_t _i = (n);                                                    \
+        for (; _i; _i -= 16) {                                              \
+            __m128i _v = _mm_loadu_si128((const __m128i *)(s));             \
+            asm volatile("movdqa %1, %0"                                    \
+                         : "=m"(*(volatile __m128i *)(d)) : "x"(_v));       \
+            (d) += 16;                                                      \
+            (s) += 16;                                                      \
+        }                                                                   \
+    } while (0)
+#endif
+
+/*
+ * Step the device address up through 4, 8 and 16 byte alignment, as far as
+ * @width allows, then run the widest kernel and step back down for the tail.
+ */
+#define mmio_copy(words, wide, d, s, dev, len, width)                       \
+    do {                                                                    \
+        size_t _n;                                                          \
+                                                                            \
+        _n = (4 - ((uintptr_t)(dev) & 0x3)) & 0x3;                          \
+        _n = _n < (len) ? _n : (len);                                       \
+        words(uint8_t, d, s, _n);                                           \
+        (len) -= _n;                                                        \
+                                                                            \
+        if ((width) >= 8 && ((uintptr_t)(dev) & 0x7) && (len) >= 4) {       \
+            words(uint32_t, d, s, 4);                                       \
+            (len) -= 4;                                                     \
+        }                                                                   \
+                                                                            \
+        if (MMIO_HAVE_128 && (width) >= 16) {                               \
+            if (((uintptr_t)(dev) & 0xf) == 0x8 && (len) >= 8) {            \
+                words(uint64_t, d, s, 8);                                   \
+                (len) -= 8;                                                 \
+            }                                                               \
+                                                                            \
+            if (!((uintptr_t)(dev) & 0xf)) {                                \
+                _n = (len) & ~(size_t)0xf;                                  \
+                wide(d, s, _n);                                             \
+                (len) -= _n;                                                \
+            }                                                               \
+        }                                                                   \
+                                                                            \
+        if ((width) >= 8 && !((uintptr_t)(dev) & 0x7)) {                    \
+            _n = (len) & ~(size_t)0x7;                                      \
+            words(uint64_t, d, s, _n);                                      \
+            (len) -= _n;                                                    \
+        }                                                                   \
+                                                                            \
+        _n = (len) & ~(size_t)0x3;                                          \
+        words(uint32_t, d, s, _n);                                          \
+        (len) -= _n;                                                        \
+                                                                            \
+        words(uint8_t, d, s, (len));                                        \
+    } while (0)
+
+#if !MMIO_HAVE_128
+#define mmio_read_128(d, s, n) do { } while (0)
+#define mmio_write_128(d, s, n) do { } while (0)
+#endif
+
+void mmio_read(void *dst, const volatile void *src, size_t len,
+               unsigned int width)
 {
-    if (((unsigned long)src & 0x3) != ((unsigned long)dst & 0x3)) {
-        while (len) {
-            *(volatile uint8_t * restrict)dst++ = *(const volatile uint8_t * restrict)src++;
-            len--;
-        }
-
-        iob();
-
-        return dst;
-    }
-
-    while (len && ((unsigned long)src & 0x3) && ((unsigned long)dst & 0x3)) {
-        *(volatile uint8_t * restrict)dst++ = *(const volatile uint8_t * restrict)src++;
-        len--;
-    }
-
-    while (len > 3) {
-        const volatile uint32_t * restrict tsrc = src;
-        volatile uint32_t * restrict tdst = dst;
-        *tdst = *tsrc;
-        len -= sizeof(*tdst);
-        src += sizeof(*tsrc);
-        dst += sizeof(*tdst);
-    }
-
-    while (len) {
-        *(volatile uint8_t * restrict)dst++ = *(const volatile uint8_t * restrict)src++;
-        len--;
-    }
+    const volatile uint8_t *s = src;
+    uint8_t *d = dst;
+
+    mmio_copy(mmio_read_words, mmio_read_128, d, s, s, len, width);
 
     iob();
+}
+
+void mmio_write(volatile void *dst, const void *src, size_t len,
+                unsigned int width)
+{
+    volatile uint8_t *d = dst;
+    const uint8_t *s = src;
+
+    mmio_copy(mmio_write_words, mmio_write_128, d, s, d, len, width);
 
-    return dst;
+    iob();
 }
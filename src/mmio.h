@@ -6,6 +6,15 @@
 
 #include <stddef.h>
 
-volatile void *mmio_memcpy(volatile void *dst, const volatile void *src, size_t len);
+/*
+ * Copy between RAM and a device mapping. Device accesses are naturally
+ * aligned and at most @width bytes wide (4, 8 or 16), regardless of the
+ * alignment of the RAM buffer. Widths the host can't issue fall back to the
+ * widest it can.
+ */
+void mmio_read(void *dst, const volatile void *src, size_t len,
+               unsigned int width);
+void mmio_write(volatile void *dst, const void *src, size_t len,
+                unsigned int width);
 
 #endif
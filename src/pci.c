@@ -13,6 +13,11 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <dirent.h>
+#include <linux/pci_regs.h>
+#include <linux/vfio.h>
+#include <stdbool.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
 
 #include "pci.h"
 #include "shell.h"
@@ -42,17 +47,66 @@ int read_sysfs_id(int dirfd, const char *file)
 	return id;
 }
 
-int pci_open(uint16_t vid, uint16_t did, int bar)
+int pci_parse_bdf(const char *arg, char *bdf)
 {
-        char *res;
-        int rc;
-        int fd;
-	int found = 0;
+	unsigned int domain = 0, bus, dev, fn;
+	int end = 0;
+
+	if (sscanf(arg, "%x:%x:%x.%x%n", &domain, &bus, &dev, &fn, &end) != 4 ||
+	    arg[end]) {
+		domain = 0;
+		end = 0;
+		if (sscanf(arg, "%x:%x.%x%n", &bus, &dev, &fn, &end) != 3 ||
+		    arg[end])
+			return -EINVAL;
+	}
+
+	if (domain > 0xffff || bus > 0xff || dev > 0x1f || fn > 7)
+		return -EINVAL;
+
+	snprintf(bdf, PCI_BDF_LEN, "%04x:%02x:%02x.%x", domain, bus, dev, fn);
+
+	return 0;
+}
+
+/* Checks the device at @bdf is @vid:@did, for pci_find_device() */
+static int pci_check_device(const char *bdf, uint16_t vid, uint16_t did)
+{
+	char path[300];
+	int dfd;
+	int rc;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s", bdf);
+	if ((dfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0)
+		return -errno;
 
+	rc = (read_sysfs_id(dfd, "vendor") == vid &&
+	      read_sysfs_id(dfd, "device") == did) ? 0 : -ENODEV;
+
+	close(dfd);
+
+	return rc;
+}
+
+/* Copies the sysfs name of @bdf, or of @vid:@did's first function, into @name */
+static int pci_find_device(const char *bdf, uint16_t vid, uint16_t did,
+			   char *name, size_t len)
+{
 	struct dirent *de;
+	int found = 0;
 	int dfd;
 	DIR *d;
 	char path[300]; /* de->d_name has a max of 255, and add some change */
+	int rc;
+
+	if (bdf && *bdf) {
+		if ((rc = pci_check_device(bdf, vid, did)) < 0)
+			return rc;
+
+		snprintf(name, len, "%s", bdf);
+
+		return 0;
+	}
 
 	d = opendir("/sys/bus/pci/devices/");
 	if (!d)
@@ -73,33 +127,442 @@ int pci_open(uint16_t vid, uint16_t did, int bar)
 		this_did = read_sysfs_id(dfd, path);
 
 		if (this_vid == vid && this_did == did) {
+			snprintf(name, len, "%s", de->d_name);
 			found = 1;
 			break;
 		}
 	}
 
-	/* NB: dfd and de->d_name are both invalidated by closedir() */
-	if (!found) {
-		closedir(d);
+	closedir(d);
+
+	return found ? 0 : -ENOENT;
+}
+
+int pci_lookup(const char *bdf, uint16_t vid, uint16_t did, char *found)
+{
+	return pci_find_device(bdf, vid, did, found, PCI_BDF_LEN);
+}
+
+static int pci_open_resource(const char *bdf, uint16_t vid, uint16_t did,
+			     int bar, const char *suffix)
+{
+	char name[256];
+	char *res;
+	int rc;
+	int fd;
+
+	if ((rc = pci_find_device(bdf, vid, did, name, sizeof(name))) < 0)
+		return rc;
+
+	rc = asprintf(&res, "/sys/bus/pci/devices/%s/resource%d%s", name, bar,
+		      suffix);
+	if (rc == -1)
+		return -errno;
+
+	fd = open(res, O_RDWR | O_SYNC);
+	rc = -errno;
+	free(res);
+
+	return fd < 0 ? rc : fd;
+}
+
+/*
+ * With vfio the devices are claimed once and held until exit, so a session
+ * of commands pays for the container and group setup once. Each BAR opened
+ * hands out its own duplicate of the device fd, which is looked up here for
+ * the region's offset in it.
+ */
+#define PCI_VFIO_MAX_GROUPS	4
+#define PCI_VFIO_MAX_DEVICES	4
+#define PCI_VFIO_MAX_BARS	16
+/* Clear of the low memory that platforms tend to reserve for MSIs */
+#define PCI_VFIO_IOVA_BASE	0x10000000ULL
+
+struct pci_vfio_group {
+	int id;
+	int fd;
+};
+
+struct pci_vfio_device {
+	char name[256];
+	int fd;
+};
+
+struct pci_vfio_bar {
+	int fd;
+	off_t offset;
+	size_t len;
+};
+
+static struct {
+	bool enabled;
+	int container;
+	uint64_t iova;
+	size_t nr_groups;
+	struct pci_vfio_group groups[PCI_VFIO_MAX_GROUPS];
+	size_t nr_devices;
+	struct pci_vfio_device devices[PCI_VFIO_MAX_DEVICES];
+	struct pci_vfio_bar bars[PCI_VFIO_MAX_BARS];
+} pci_vfio = { .container = -1 };
+
+void pci_enable_vfio(void)
+{
+	size_t i;
+
+	pci_vfio.enabled = true;
+	pci_vfio.iova = PCI_VFIO_IOVA_BASE;
+
+	for (i = 0; i < PCI_VFIO_MAX_BARS; i++)
+		pci_vfio.bars[i].fd = -1;
+}
+
+static int pci_vfio_container(void)
+{
+	int fd;
+
+	if (pci_vfio.container >= 0)
+		return pci_vfio.container;
+
+	if ((fd = open("/dev/vfio/vfio", O_RDWR | O_CLOEXEC)) < 0)
+		return -errno;
+
+	if (ioctl(fd, VFIO_GET_API_VERSION) != VFIO_API_VERSION ||
+	    !ioctl(fd, VFIO_CHECK_EXTENSION, VFIO_TYPE1_IOMMU)) {
+		close(fd);
+		return -ENOTSUP;
+	}
+
+	pci_vfio.container = fd;
+
+	return fd;
+}
+
+static int pci_vfio_group(const char *name)
+{
+	struct vfio_group_status status = { .argsz = sizeof(status) };
+	struct pci_vfio_group *group;
+	char path[300], link[300];
+	const char *base;
+	ssize_t len;
+	int container;
+	size_t i;
+	int id;
+	int fd;
+	int rc;
+
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/iommu_group", name);
+	len = readlink(path, link, sizeof(link) - 1);
+	if (len < 0)
+		return -errno;
+	link[len] = '\0';
+
+	base = strrchr(link, '/');
+	id = atoi(base ? base + 1 : link);
+
+	for (i = 0; i < pci_vfio.nr_groups; i++) {
+		if (pci_vfio.groups[i].id == id)
+			return pci_vfio.groups[i].fd;
+	}
+
+	if (pci_vfio.nr_groups == PCI_VFIO_MAX_GROUPS)
+		return -ENOSPC;
+
+	if ((container = pci_vfio_container()) < 0)
+		return container;
+
+	snprintf(path, sizeof(path), "/dev/vfio/%d", id);
+	if ((fd = open(path, O_RDWR | O_CLOEXEC)) < 0)
+		return -errno;
+
+	if (ioctl(fd, VFIO_GROUP_GET_STATUS, &status) < 0) {
+		rc = -errno;
+		goto cleanup_fd;
+	}
+
+	/* Every device in the group has to be bound to vfio-pci */
+	if (!(status.flags & VFIO_GROUP_FLAGS_VIABLE)) {
+		rc = -EBUSY;
+		goto cleanup_fd;
+	}
+
+	if (ioctl(fd, VFIO_GROUP_SET_CONTAINER, &container) < 0) {
+		rc = -errno;
+		goto cleanup_fd;
+	}
+
+	/* The IOMMU model is set once the container has its first group */
+	if (!pci_vfio.nr_groups &&
+	    ioctl(container, VFIO_SET_IOMMU, VFIO_TYPE1_IOMMU) < 0) {
+		rc = -errno;
+		ioctl(fd, VFIO_GROUP_UNSET_CONTAINER);
+		goto cleanup_fd;
+	}
+
+	group = &pci_vfio.groups[pci_vfio.nr_groups++];
+	group->id = id;
+	group->fd = fd;
+
+	return fd;
+
+cleanup_fd:
+	close(fd);
+
+	return rc;
+}
+
+static int pci_vfio_device(const char *bdf, uint16_t vid, uint16_t did)
+{
+	struct pci_vfio_device *device;
+	char name[256];
+	size_t i;
+	int group;
+	int fd;
+	int rc;
+
+	if ((rc = pci_find_device(bdf, vid, did, name, sizeof(name))) < 0)
+		return rc;
+
+	for (i = 0; i < pci_vfio.nr_devices; i++) {
+		device = &pci_vfio.devices[i];
+		if (!strcmp(device->name, name))
+			return device->fd;
+	}
+
+	if (pci_vfio.nr_devices == PCI_VFIO_MAX_DEVICES)
+		return -ENOSPC;
+
+	if ((group = pci_vfio_group(name)) < 0)
+		return group;
+
+	if ((fd = ioctl(group, VFIO_GROUP_GET_DEVICE_FD, name)) < 0)
+		return -errno;
+
+	device = &pci_vfio.devices[pci_vfio.nr_devices++];
+	snprintf(device->name, sizeof(device->name), "%s", name);
+	device->fd = fd;
+
+	return fd;
+}
+
+static struct pci_vfio_bar *pci_vfio_bar(int fd)
+{
+	size_t i;
+
+	if (!pci_vfio.enabled)
+		return NULL;
+
+	for (i = 0; i < PCI_VFIO_MAX_BARS; i++) {
+		if (pci_vfio.bars[i].fd == fd)
+			return &pci_vfio.bars[i];
+	}
+
+	return NULL;
+}
+
+static int pci_vfio_open(const char *bdf, uint16_t vid, uint16_t did, int bar)
+{
+	struct vfio_region_info info = { .argsz = sizeof(info) };
+	struct pci_vfio_bar *entry;
+	int device;
+	int rc;
+
+	if ((device = pci_vfio_device(bdf, vid, did)) < 0)
+		return device;
+
+	info.index = VFIO_PCI_BAR0_REGION_INDEX + bar;
+	if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &info) < 0)
+		return -errno;
+
+	if (!info.size || !(info.flags & VFIO_REGION_INFO_FLAG_MMAP))
 		return -ENOENT;
+
+	if (!(entry = pci_vfio_bar(-1)))
+		return -ENOSPC;
+
+	if ((rc = fcntl(device, F_DUPFD_CLOEXEC, 0)) < 0)
+		return -errno;
+
+	entry->fd = rc;
+	entry->offset = info.offset;
+	entry->len = info.size;
+
+	return rc;
+}
+
+int pci_open(const char *bdf, uint16_t vid, uint16_t did, int bar)
+{
+	if (pci_vfio.enabled)
+		return pci_vfio_open(bdf, vid, did, bar);
+
+	return pci_open_resource(bdf, vid, did, bar, "");
+}
+
+/* vfio-pci maps every BAR uncached */
+int pci_open_wc(const char *bdf, uint16_t vid, uint16_t did, int bar)
+{
+	if (pci_vfio.enabled)
+		return -ENOTSUP;
+
+	return pci_open_resource(bdf, vid, did, bar, "_wc");
+}
+
+void *pci_mmap(int fd, size_t len, off_t off)
+{
+	struct pci_vfio_bar *bar;
+
+	if ((bar = pci_vfio_bar(fd)))
+		off += bar->offset;
+
+	return mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, off);
+}
+
+ssize_t pci_bar_len(int fd)
+{
+	struct pci_vfio_bar *bar;
+	struct stat st;
+
+	if ((bar = pci_vfio_bar(fd)))
+		return bar->len;
+
+	if (fstat(fd, &st) < 0)
+		return -errno;
+
+	return st.st_size;
+}
+
+/* DMA needs the device to master the bus, which the host driver normally sets */
+static int pci_vfio_enable_master(int device)
+{
+	struct vfio_region_info info = { .argsz = sizeof(info) };
+	uint16_t cmd;
+
+	info.index = VFIO_PCI_CONFIG_REGION_INDEX;
+	if (ioctl(device, VFIO_DEVICE_GET_REGION_INFO, &info) < 0)
+		return -errno;
+
+	if (pread(device, &cmd, sizeof(cmd), info.offset + PCI_COMMAND) != sizeof(cmd))
+		return -EIO;
+
+	if (cmd & PCI_COMMAND_MASTER)
+		return 0;
+
+	cmd |= PCI_COMMAND_MASTER;
+	if (pwrite(device, &cmd, sizeof(cmd), info.offset + PCI_COMMAND) != sizeof(cmd))
+		return -EIO;
+
+	return 0;
+}
+
+void *pci_dma_alloc(const char *bdf, uint16_t vid, uint16_t did, size_t len,
+		    uint64_t *iova)
+{
+	struct vfio_iommu_type1_dma_map map = { .argsz = sizeof(map) };
+	void *buf;
+	int device;
+	int rc;
+
+	if (!pci_vfio.enabled) {
+		errno = ENOTSUP;
+		return NULL;
 	}
 
-	rc = asprintf(&res, "%s/resource%d", de->d_name, bar);
-	if (rc == -1) {
-		closedir(d);
+	if ((device = pci_vfio_device(bdf, vid, did)) < 0) {
+		errno = -device;
+		return NULL;
+	}
+
+	if ((rc = pci_vfio_enable_master(device)) < 0) {
+		errno = -rc;
+		return NULL;
+	}
+
+	len = (len + 4095) & ~(size_t)4095;
+	buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED)
+		return NULL;
+
+	map.flags = VFIO_DMA_MAP_FLAG_READ | VFIO_DMA_MAP_FLAG_WRITE;
+	map.vaddr = (uintptr_t)buf;
+	map.iova = pci_vfio.iova;
+	map.size = len;
+	if (ioctl(pci_vfio.container, VFIO_IOMMU_MAP_DMA, &map) < 0) {
+		rc = errno;
+		munmap(buf, len);
+		errno = rc;
+		return NULL;
+	}
+
+	*iova = map.iova;
+	pci_vfio.iova += len;
+
+	return buf;
+}
+
+void pci_dma_free(void *buf, size_t len, uint64_t iova)
+{
+	struct vfio_iommu_type1_dma_unmap unmap = { .argsz = sizeof(unmap) };
+
+	len = (len + 4095) & ~(size_t)4095;
+	unmap.iova = iova;
+	unmap.size = len;
+	ioctl(pci_vfio.container, VFIO_IOMMU_UNMAP_DMA, &unmap);
+	munmap(buf, len);
+}
+
+int pci_describe(uint16_t vid, char *buf, size_t len)
+{
+	struct dirent *de;
+	size_t used = 0;
+	int dfd, rc;
+	DIR *d;
+	char path[300];
+
+	d = opendir("/sys/bus/pci/devices/");
+	if (!d)
 		return -errno;
+
+	dfd = dirfd(d);
+
+	if (len)
+		buf[0] = '\0';
+
+	while ((de = readdir(d))) {
+		int this_vid, this_did;
+
+		if (de->d_type != DT_LNK)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/vendor", de->d_name);
+		this_vid = read_sysfs_id(dfd, path);
+		if (this_vid != vid)
+			continue;
+
+		snprintf(path, sizeof(path), "%s/device", de->d_name);
+		this_did = read_sysfs_id(dfd, path);
+
+		rc = snprintf(buf + used, len - used, "%s%s:%04x",
+			      used ? "," : "", de->d_name, this_did);
+		if (rc < 0 || (size_t)rc >= len - used) {
+			closedir(d);
+			return -ENOSPC;
+		}
+		used += rc;
 	}
 
-	fd = openat(dfd, res, O_RDWR | O_SYNC);
-	free(res);
 	closedir(d);
 
-        return fd;
+	return 0;
 }
 
 int pci_close(int fd)
 {
+	struct pci_vfio_bar *bar;
+
         assert(fd >= 0);
 
+	if ((bar = pci_vfio_bar(fd)))
+		bar->fd = -1;
+
         return close(fd);
 }
@@ -4,9 +4,50 @@
 #ifndef _PCI_H
 #define _PCI_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
-int pci_open(uint16_t vid, uint16_t did, int bar);
+/* A sysfs device name, DDDD:BB:DD.F */
+#define PCI_BDF_LEN 13
+
+/* Claim devices through vfio-pci rather than their sysfs resources */
+void pci_enable_vfio(void);
+
+/*
+ * Copies @arg, BB:DD.F or DDDD:BB:DD.F, into @bdf in the form sysfs names
+ * devices by, which must have room for PCI_BDF_LEN bytes.
+ */
+int pci_parse_bdf(const char *arg, char *bdf);
+
+/*
+ * The functions taking @bdf use the device at that address, which must be
+ * @vid:@did, or with a NULL or empty @bdf the first @vid:@did found.
+ * pci_lookup() copies the address of the device they'd use into @found.
+ */
+int pci_lookup(const char *bdf, uint16_t vid, uint16_t did, char *found);
+int pci_open(const char *bdf, uint16_t vid, uint16_t did, int bar);
+/* Only prefetchable BARs have a write-combining resource */
+int pci_open_wc(const char *bdf, uint16_t vid, uint16_t did, int bar);
+
+/* Maps @len bytes from @off into the BAR opened as @fd, MAP_FAILED on error */
+void *pci_mmap(int fd, size_t len, off_t off);
+ssize_t pci_bar_len(int fd);
+
+/*
+ * Memory that @vid:@did can DMA to and from at the bus address returned in
+ * @iova, mapped through the IOMMU. Only available with vfio, sets errno and
+ * returns NULL otherwise.
+ */
+void *pci_dma_alloc(const char *bdf, uint16_t vid, uint16_t did, size_t len,
+		    uint64_t *iova);
+void pci_dma_free(void *buf, size_t len, uint64_t iova);
+
+/*
+ * Lists the addresses and device IDs of @vid's functions into @buf, in
+ * directory order, e.g. "0000:02:00.0:2000,0000:02:00.1:2402"
+ */
+int pci_describe(uint16_t vid, char *buf, size_t len);
 
 int pci_close(int fd);
 
@@ -0,0 +1,871 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "ahb.h"
+#include "bufpool.h"
+#include "compiler.h"
+#include "compress.h"
+#include "digest.h"
+#include "fill.h"
+#include "flash.h"
+#include "log.h"
+#include "pipeline.h"
+#include "search.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+static uint64_t pipeline_now_ns(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/*
+ * There are only ever PIPELINE_DEPTH buffers, so a queue can't fill and a push
+ * never waits
+ */
+static void pipeline_push(struct pipeline_queue *q, struct pipeline_buf *buf)
+{
+    size_t head = q->head;
+    uint64_t one = 1;
+
+    q->slots[head & (PIPELINE_DEPTH - 1)] = buf;
+    __atomic_store_n(&q->head, head + 1, __ATOMIC_SEQ_CST);
+
+    /* Pairs with the consumer setting @waiting, as for spsc_wake() */
+    if (__atomic_load_n(&q->waiting, __ATOMIC_SEQ_CST)) {
+        if (write(q->efd, &one, sizeof(one)) < 0) {
+            /* The count can't overflow with a consumer draining it */
+        }
+    }
+}
+
+/* NULL once the pipeline is aborted */
+static struct pipeline_buf *pipeline_pop(struct pipeline *ctx,
+                                         struct pipeline_queue *q)
+{
+    struct pipeline_buf *buf;
+    size_t tail = q->tail;
+    uint64_t count;
+
+    while (1) {
+        if (__atomic_load_n(&ctx->rc, __ATOMIC_ACQUIRE))
+            return NULL;
+
+        if (__atomic_load_n(&q->head, __ATOMIC_ACQUIRE) != tail)
+            break;
+
+        /* Look once more after saying we're asleep, see pipeline_push() */
+        __atomic_store_n(&q->waiting, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == tail &&
+                !__atomic_load_n(&ctx->rc, __ATOMIC_SEQ_CST)) {
+            if (read(q->efd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                pipeline_abort(ctx, -errno);
+                return NULL;
+            }
+        }
+        __atomic_store_n(&q->waiting, false, __ATOMIC_RELAXED);
+    }
+
+    buf = q->slots[tail & (PIPELINE_DEPTH - 1)];
+    __atomic_store_n(&q->tail, tail + 1, __ATOMIC_RELEASE);
+
+    return buf;
+}
+
+void pipeline_abort(struct pipeline *ctx, int rc)
+{
+    uint64_t one = 1;
+    int expected = 0;
+    size_t i;
+
+    if (!__atomic_compare_exchange_n(&ctx->rc, &expected, rc, false,
+                                     __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return;
+
+    /* Whatever the stages are waiting on, they look at @rc on waking */
+    for (i = 0; i < ctx->nr_stages; i++) {
+        if (write(ctx->stages[i].in.efd, &one, sizeof(one)) < 0) {
+            /* As for pipeline_push() */
+        }
+    }
+}
+
+int pipeline_init(struct pipeline *ctx, const char *label, size_t chunk,
+                  uint64_t total)
+{
+    size_t i;
+
+    memset(ctx, 0, sizeof(*ctx));
+
+    ctx->chunk = chunk ? chunk : PIPELINE_DEFAULT_CHUNK;
+    ctx->label = label;
+    ctx->total = total;
+
+    for (i = 0; i < PIPELINE_DEPTH; i++) {
+        if (!(ctx->bufs[i].data = bufpool_get(ctx->chunk))) {
+            while (i--)
+                bufpool_put(ctx->bufs[i].data, ctx->chunk);
+            return -ENOMEM;
+        }
+    }
+
+    return 0;
+}
+
+void pipeline_destroy(struct pipeline *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nr_stages; i++) {
+        struct pipeline_stage *stage = &ctx->stages[i];
+
+        if (stage->ops->destroy)
+            stage->ops->destroy(stage);
+        close(stage->in.efd);
+    }
+
+    for (i = 0; i < PIPELINE_DEPTH; i++)
+        bufpool_put(ctx->bufs[i].data, ctx->chunk);
+}
+
+void pipeline_set_base(struct pipeline *ctx, uint64_t base)
+{
+    ctx->base = base;
+    ctx->has_base = true;
+}
+
+int pipeline_add(struct pipeline *ctx, const char *name,
+                 const struct pipeline_stage_ops *ops, void *priv)
+{
+    struct pipeline_stage spare, *stage;
+    int rc;
+
+    stage = ctx->nr_stages < PIPELINE_STAGES_MAX ?
+                &ctx->stages[ctx->nr_stages] : &spare;
+    memset(stage, 0, sizeof(*stage));
+    stage->ops = ops;
+    stage->priv = priv;
+
+    if (stage == &spare) {
+        rc = -E2BIG;
+        goto cleanup_priv;
+    }
+
+    if ((stage->in.efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        rc = -errno;
+        goto cleanup_priv;
+    }
+
+    stage->name = name;
+    stage->pipeline = ctx;
+    ctx->nr_stages++;
+
+    return 0;
+
+cleanup_priv:
+    if (ops->destroy)
+        ops->destroy(stage);
+
+    return rc;
+}
+
+static int pipeline_stage_run(struct pipeline_stage *stage,
+                              struct pipeline_buf *buf, bool source)
+{
+    ssize_t rc;
+
+    if (source) {
+        buf->offset = stage->bytes;
+        buf->fill = fill_data;
+    }
+
+    if ((rc = stage->ops->run(stage, buf)) < 0)
+        return rc;
+
+    if (source)
+        buf->len = rc;
+
+    return 0;
+}
+
+/*
+ * The source takes its buffers back from the sink's end, and everything else
+ * from the stage before. The empty buffer ending the stream is passed along
+ * like any other, each stage finishing as it goes by.
+ */
+static void *pipeline_worker(void *arg)
+{
+    struct pipeline_stage *stage = arg;
+    struct pipeline *ctx = stage->pipeline;
+    size_t idx = stage - ctx->stages;
+    struct pipeline_queue *next = &ctx->stages[(idx + 1) % ctx->nr_stages].in;
+    bool source = idx == 0;
+    bool sink = idx == ctx->nr_stages - 1;
+    struct pipeline_buf *buf;
+    uint64_t start, ran;
+    int rc;
+
+    while (1) {
+        start = pipeline_now_ns();
+        buf = pipeline_pop(ctx, &stage->in);
+        ran = pipeline_now_ns();
+        stage->wait_ns += ran - start;
+
+        if (!buf)
+            break;
+
+        if (source || buf->len) {
+            if ((rc = pipeline_stage_run(stage, buf, source)) < 0) {
+                loge("Pipeline stage '%s' failed at offset %" PRIu64 ": %d\n",
+                     stage->name, buf->offset, rc);
+                pipeline_abort(ctx, rc);
+                break;
+            }
+        }
+
+        stage->busy_ns += pipeline_now_ns() - ran;
+
+        if (!buf->len) {
+            if (stage->ops->finish && (rc = stage->ops->finish(stage)) < 0) {
+                loge("Pipeline stage '%s' failed to finish: %d\n", stage->name,
+                     rc);
+                pipeline_abort(ctx, rc);
+                break;
+            }
+
+            /* The source has stopped, nothing takes the buffer back */
+            if (!sink)
+                pipeline_push(next, buf);
+            break;
+        }
+
+        stage->bytes += buf->len;
+        stage->chunks++;
+
+        if (sink && ctx->label)
+            progress_update(&ctx->progress, buf->len);
+
+        pipeline_push(next, buf);
+    }
+
+    return NULL;
+}
+
+int pipeline_run(struct pipeline *ctx)
+{
+    size_t i, started;
+    int rc;
+
+    if (ctx->nr_stages < 2)
+        return -EINVAL;
+
+    for (i = 0; i < ctx->nr_stages; i++) {
+        ctx->stages[i].in.head = 0;
+        ctx->stages[i].in.tail = 0;
+    }
+
+    for (i = 0; i < PIPELINE_DEPTH; i++)
+        pipeline_push(&ctx->stages[0].in, &ctx->bufs[i]);
+
+    if (ctx->label) {
+        progress_init(&ctx->progress, ctx->label, ctx->total);
+        if (ctx->has_base)
+            progress_set_base(&ctx->progress, ctx->base);
+    }
+
+    for (started = 0; started < ctx->nr_stages; started++) {
+        struct pipeline_stage *stage = &ctx->stages[started];
+
+        rc = pthread_create(&stage->worker, NULL, pipeline_worker, stage);
+        if (rc) {
+            loge("Failed to start pipeline stage '%s': %d\n", stage->name, -rc);
+            pipeline_abort(ctx, -rc);
+            break;
+        }
+    }
+
+    for (i = 0; i < started; i++)
+        pthread_join(ctx->stages[i].worker, NULL);
+
+    if (ctx->label)
+        progress_end(&ctx->progress);
+
+    pipeline_report(ctx);
+
+    return ctx->rc;
+}
+
+void pipeline_report(const struct pipeline *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->nr_stages; i++) {
+        const struct pipeline_stage *stage = &ctx->stages[i];
+        double busy = stage->busy_ns / 1e9;
+
+        logd("%s: %s moved %" PRIu64 " bytes in %" PRIu64
+             " chunks, %.3fs busy (%.1f MiB/s), %.3fs waiting\n",
+             ctx->label ? ctx->label : "pipeline",
+             stage->name, stage->bytes, stage->chunks, busy,
+             busy > 0 ? stage->bytes / busy / (1 << 20) : 0,
+             stage->wait_ns / 1e9);
+    }
+}
+
+static void pipeline_free_priv(struct pipeline_stage *stage)
+{
+    free(stage->priv);
+}
+
+/* Sources */
+
+struct pipeline_range {
+    union {
+        struct ahb *ahb;
+        struct flash_chip *chip;
+        const uint8_t *mem;
+    };
+    uint32_t start;
+    size_t len;
+    size_t done;
+};
+
+static size_t pipeline_range_next(struct pipeline_stage *stage)
+{
+    struct pipeline_range *range = stage->priv;
+    size_t len = range->len - range->done;
+
+    return len < stage->pipeline->chunk ? len : stage->pipeline->chunk;
+}
+
+static int pipeline_add_range(struct pipeline *ctx, const char *name,
+                              const struct pipeline_stage_ops *ops, void *dev,
+                              uint32_t start, size_t len)
+{
+    struct pipeline_range *range;
+
+    if (!(range = calloc(1, sizeof(*range))))
+        return -ENOMEM;
+
+    range->ahb = dev;
+    range->start = start;
+    range->len = len;
+
+    return pipeline_add(ctx, name, ops, range);
+}
+
+static ssize_t pipeline_bridge_source_run(struct pipeline_stage *stage,
+                                          struct pipeline_buf *buf)
+{
+    struct pipeline_range *range = stage->priv;
+    size_t len = pipeline_range_next(stage);
+    ssize_t rc;
+
+    if (!len)
+        return 0;
+
+    rc = ahb_read(range->ahb, range->start + range->done, buf->data, len);
+    if (rc < 0)
+        return rc;
+
+    if (!rc)
+        return -EIO;
+
+    range->done += rc;
+
+    return rc;
+}
+
+static const struct pipeline_stage_ops pipeline_bridge_source_ops = {
+    .run = pipeline_bridge_source_run,
+    .destroy = pipeline_free_priv,
+};
+
+int pipeline_add_bridge_source(struct pipeline *ctx, struct ahb *ahb,
+                               uint32_t phys, size_t len)
+{
+    return pipeline_add_range(ctx, "bridge", &pipeline_bridge_source_ops, ahb,
+                              phys, len);
+}
+
+static ssize_t pipeline_flash_source_run(struct pipeline_stage *stage,
+                                         struct pipeline_buf *buf)
+{
+    struct pipeline_range *range = stage->priv;
+    size_t len = pipeline_range_next(stage);
+    int rc;
+
+    if (!len)
+        return 0;
+
+    if ((rc = flash_read(range->chip, range->start + range->done, buf->data,
+                         len)) < 0)
+        return rc;
+
+    range->done += len;
+
+    return len;
+}
+
+static const struct pipeline_stage_ops pipeline_flash_source_ops = {
+    .run = pipeline_flash_source_run,
+    .destroy = pipeline_free_priv,
+};
+
+int pipeline_add_flash_source(struct pipeline *ctx, struct flash_chip *chip,
+                              uint32_t offset, size_t len)
+{
+    return pipeline_add_range(ctx, "flash", &pipeline_flash_source_ops, chip,
+                              offset, len);
+}
+
+static ssize_t pipeline_mem_source_run(struct pipeline_stage *stage,
+                                       struct pipeline_buf *buf)
+{
+    struct pipeline_range *range = stage->priv;
+    size_t len = pipeline_range_next(stage);
+
+    memcpy(buf->data, range->mem + range->done, len);
+    range->done += len;
+
+    return len;
+}
+
+static const struct pipeline_stage_ops pipeline_mem_source_ops = {
+    .run = pipeline_mem_source_run,
+    .destroy = pipeline_free_priv,
+};
+
+int pipeline_add_mem_source(struct pipeline *ctx, const void *buf, size_t len)
+{
+    return pipeline_add_range(ctx, "memory", &pipeline_mem_source_ops,
+                              (void *)buf, 0, len);
+}
+
+struct pipeline_fd {
+    int fd;
+    size_t len;
+    uint64_t done;
+};
+
+/* Whole chunks where the descriptor has them, so sinks see aligned offsets */
+static ssize_t pipeline_fd_source_run(struct pipeline_stage *stage,
+                                      struct pipeline_buf *buf)
+{
+    struct pipeline_fd *src = stage->priv;
+    size_t want = stage->pipeline->chunk;
+    size_t len = 0;
+    ssize_t ingress;
+
+    if (src->len && src->len - src->done < want)
+        want = src->len - src->done;
+
+    while (len < want) {
+        ingress = read(src->fd, (uint8_t *)buf->data + len, want - len);
+        if (ingress < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (!ingress)
+            break;
+
+        len += ingress;
+    }
+
+    /* A stream shorter than it was said to be is an error, not the end */
+    if (src->len && len < want)
+        return -EIO;
+
+    src->done += len;
+
+    return len;
+}
+
+static const struct pipeline_stage_ops pipeline_fd_source_ops = {
+    .run = pipeline_fd_source_run,
+    .destroy = pipeline_free_priv,
+};
+
+int pipeline_add_fd_source(struct pipeline *ctx, int fd, size_t len)
+{
+    struct pipeline_fd *src;
+
+    if (!(src = calloc(1, sizeof(*src))))
+        return -ENOMEM;
+
+    src->fd = fd;
+    src->len = len;
+
+    return pipeline_add(ctx, "descriptor", &pipeline_fd_source_ops, src);
+}
+
+/* Transforms */
+
+static ssize_t pipeline_digest_run(struct pipeline_stage *stage,
+                                   struct pipeline_buf *buf)
+{
+    return digest_feed(stage->priv, buf->data, buf->len);
+}
+
+static const struct pipeline_stage_ops pipeline_digest_ops = {
+    .run = pipeline_digest_run,
+};
+
+/* The digest is the caller's to finish once the pipeline has run */
+int pipeline_add_digest(struct pipeline *ctx, struct digest *digest)
+{
+    return pipeline_add(ctx, "digest", &pipeline_digest_ops, digest);
+}
+
+static ssize_t pipeline_classify_run(struct pipeline_stage *stage __unused,
+                                     struct pipeline_buf *buf)
+{
+    buf->fill = fill_classify(buf->data, buf->len, NULL);
+
+    return 0;
+}
+
+static const struct pipeline_stage_ops pipeline_classify_ops = {
+    .run = pipeline_classify_run,
+};
+
+int pipeline_add_classify(struct pipeline *ctx)
+{
+    return pipeline_add(ctx, "classify", &pipeline_classify_ops, NULL);
+}
+
+struct pipeline_search {
+    struct search *search;
+    search_match_fn fn;
+    void *priv;
+    bool stopped;
+};
+
+/* A match asking to stop ends the search, not the transfer */
+static ssize_t pipeline_search_run(struct pipeline_stage *stage,
+                                   struct pipeline_buf *buf)
+{
+    struct pipeline_search *ctx = stage->priv;
+    int rc;
+
+    if (ctx->stopped)
+        return 0;
+
+    if ((rc = search_feed(ctx->search, buf->data, buf->len, ctx->fn,
+                          ctx->priv)) < 0)
+        return rc;
+
+    ctx->stopped = rc > 0;
+
+    return 0;
+}
+
+static const struct pipeline_stage_ops pipeline_search_ops = {
+    .run = pipeline_search_run,
+    .destroy = pipeline_free_priv,
+};
+
+int pipeline_add_search(struct pipeline *ctx, struct search *search,
+                        search_match_fn fn, void *priv)
+{
+    struct pipeline_search *stage;
+
+    if (!(stage = calloc(1, sizeof(*stage))))
+        return -ENOMEM;
+
+    stage->search = search;
+    stage->fn = fn;
+    stage->priv = priv;
+
+    return pipeline_add(ctx, "search", &pipeline_search_ops, stage);
+}
+
+struct pipeline_diff {
+    int fd;
+    int (*fn)(void *priv, uint64_t offset, size_t len);
+    void *priv;
+    void *cmp;
+    size_t size;
+    /* Adjacent differing chunks are reported as the one run */
+    uint64_t start;
+    size_t len;
+};
+
+static int pipeline_diff_flush(struct pipeline_diff *ctx)
+{
+    int rc;
+
+    if (!ctx->len)
+        return 0;
+
+    rc = ctx->fn(ctx->priv, ctx->start, ctx->len);
+    ctx->len = 0;
+
+    return rc;
+}
+
+/* Bytes past the end of the reference differ */
+static ssize_t pipeline_diff_run(struct pipeline_stage *stage,
+                                 struct pipeline_buf *buf)
+{
+    struct pipeline_diff *ctx = stage->priv;
+    size_t len = 0;
+    ssize_t ingress;
+    bool same;
+    int rc;
+
+    while (len < buf->len) {
+        ingress = pread(ctx->fd, (uint8_t *)ctx->cmp + len, buf->len - len,
+                        buf->offset + len);
+        if (ingress < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (!ingress)
+            break;
+
+        len += ingress;
+    }
+
+    same = len == buf->len && !memcmp(ctx->cmp, buf->data, len);
+    if (same)
+        return pipeline_diff_flush(ctx);
+
+    if (ctx->len && ctx->start + ctx->len == buf->offset) {
+        ctx->len += buf->len;
+        return 0;
+    }
+
+    if ((rc = pipeline_diff_flush(ctx)) < 0)
+        return rc;
+
+    ctx->start = buf->offset;
+    ctx->len = buf->len;
+
+    return 0;
+}
+
+static int pipeline_diff_finish(struct pipeline_stage *stage)
+{
+    return pipeline_diff_flush(stage->priv);
+}
+
+static void pipeline_diff_destroy(struct pipeline_stage *stage)
+{
+    struct pipeline_diff *ctx = stage->priv;
+
+    bufpool_put(ctx->cmp, ctx->size);
+    free(ctx);
+}
+
+static const struct pipeline_stage_ops pipeline_diff_ops = {
+    .run = pipeline_diff_run,
+    .finish = pipeline_diff_finish,
+    .destroy = pipeline_diff_destroy,
+};
+
+int pipeline_add_diff(struct pipeline *ctx, int fd,
+                      int (*fn)(void *priv, uint64_t offset, size_t len),
+                      void *priv)
+{
+    struct pipeline_diff *stage;
+
+    if (!(stage = calloc(1, sizeof(*stage))))
+        return -ENOMEM;
+
+    if (!(stage->cmp = bufpool_get(ctx->chunk))) {
+        free(stage);
+        return -ENOMEM;
+    }
+
+    stage->fd = fd;
+    stage->fn = fn;
+    stage->priv = priv;
+    stage->size = ctx->chunk;
+
+    return pipeline_add(ctx, "diff", &pipeline_diff_ops, stage);
+}
+
+/* Sinks */
+
+struct pipeline_fd_sink {
+    int fd;
+    bool compressed;
+    struct compress compress;
+    bool sparse;
+    /* Where the stream starts in a seekable descriptor, -1 for a pipe */
+    off_t base;
+    uint64_t end;
+};
+
+static int pipeline_fd_write(int fd, const void *buf, size_t len, off_t pos)
+{
+    ssize_t egress;
+
+    while (len) {
+        egress = pos < 0 ? write(fd, buf, len) : pwrite(fd, buf, len, pos);
+        if (egress < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        buf = (const uint8_t *)buf + egress;
+        len -= egress;
+        if (pos >= 0)
+            pos += egress;
+    }
+
+    return 0;
+}
+
+static ssize_t pipeline_fd_sink_run(struct pipeline_stage *stage,
+                                    struct pipeline_buf *buf)
+{
+    struct pipeline_fd_sink *ctx = stage->priv;
+    off_t pos;
+
+    if (ctx->compressed)
+        return compress_write(&ctx->compress, ctx->fd, buf->data, buf->len);
+
+    ctx->end = buf->offset + buf->len;
+
+    if (ctx->sparse && buf->fill == fill_zero)
+        return 0;
+
+    pos = ctx->base < 0 ? -1 : ctx->base + (off_t)buf->offset;
+
+    return pipeline_fd_write(ctx->fd, buf->data, buf->len, pos);
+}
+
+/* Skipped zeros at the end still count towards the file's length */
+static int pipeline_fd_sink_finish(struct pipeline_stage *stage)
+{
+    struct pipeline_fd_sink *ctx = stage->priv;
+
+    if (ctx->compressed)
+        return compress_finish(&ctx->compress, ctx->fd);
+
+    if (ctx->base >= 0) {
+        if (ctx->sparse && ftruncate(ctx->fd, ctx->base + ctx->end) < 0)
+            return -errno;
+
+        if (lseek(ctx->fd, ctx->base + ctx->end, SEEK_SET) < 0)
+            return -errno;
+    }
+
+    return 0;
+}
+
+static void pipeline_fd_sink_destroy(struct pipeline_stage *stage)
+{
+    struct pipeline_fd_sink *ctx = stage->priv;
+
+    if (ctx->compressed)
+        compress_destroy(&ctx->compress);
+    free(ctx);
+}
+
+static const struct pipeline_stage_ops pipeline_fd_sink_ops = {
+    .run = pipeline_fd_sink_run,
+    .finish = pipeline_fd_sink_finish,
+    .destroy = pipeline_fd_sink_destroy,
+};
+
+int pipeline_add_fd_sink(struct pipeline *ctx, int fd, int level, bool sparse)
+{
+    struct pipeline_fd_sink *sink;
+    int rc;
+
+    if (!(sink = calloc(1, sizeof(*sink))))
+        return -ENOMEM;
+
+    sink->fd = fd;
+    sink->sparse = sparse;
+    sink->base = lseek(fd, 0, SEEK_CUR);
+
+    /* A hole can't be seeked over in a pipe */
+    if (sparse && (level || sink->base < 0)) {
+        free(sink);
+        return -ESPIPE;
+    }
+
+    if (level) {
+        if ((rc = compress_init(&sink->compress, level)) < 0) {
+            free(sink);
+            return rc;
+        }
+        sink->compressed = true;
+    }
+
+    return pipeline_add(ctx, "descriptor", &pipeline_fd_sink_ops, sink);
+}
+
+static ssize_t pipeline_bridge_sink_run(struct pipeline_stage *stage,
+                                        struct pipeline_buf *buf)
+{
+    struct pipeline_range *range = stage->priv;
+    size_t done = 0;
+    ssize_t rc;
+
+    while (done < buf->len) {
+        rc = ahb_write(range->ahb, range->start + buf->offset + done,
+                       (uint8_t *)buf->data + done, buf->len - done);
+        if (rc < 0)
+            return rc;
+
+        if (!rc)
+            return -EIO;
+
+        done += rc;
+    }
+
+    return 0;
+}
+
+static const struct pipeline_stage_ops pipeline_bridge_sink_ops = {
+    .run = pipeline_bridge_sink_run,
+    .destroy = pipeline_free_priv,
+};
+
+int pipeline_add_bridge_sink(struct pipeline *ctx, struct ahb *ahb,
+                             uint32_t phys)
+{
+    return pipeline_add_range(ctx, "bridge", &pipeline_bridge_sink_ops, ahb,
+                              phys, 0);
+}
+
+static ssize_t pipeline_flash_sink_run(struct pipeline_stage *stage,
+                                       struct pipeline_buf *buf)
+{
+    struct pipeline_range *range = stage->priv;
+
+    return flash_smart_write(range->chip, range->start + buf->offset, buf->data,
+                             buf->len);
+}
+
+static const struct pipeline_stage_ops pipeline_flash_sink_ops = {
+    .run = pipeline_flash_sink_run,
+    .destroy = pipeline_free_priv,
+};
+
+/* Only the blocks that differ are erased and programmed */
+int pipeline_add_flash_sink(struct pipeline *ctx, struct flash_chip *chip,
+                            uint32_t offset)
+{
+    return pipeline_add_range(ctx, "flash", &pipeline_flash_sink_ops, chip,
+                              offset, 0);
+}
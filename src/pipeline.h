@@ -0,0 +1,153 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _PIPELINE_H
+#define _PIPELINE_H
+
+#include "fill.h"
+#include "progress.h"
+#include "search.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/* Buffers in flight between the stages, a power of two */
+#define PIPELINE_DEPTH          4
+#define PIPELINE_STAGES_MAX     8
+#define PIPELINE_DEFAULT_CHUNK  (1 << 20)
+
+struct ahb;
+struct digest;
+struct flash_chip;
+
+/*
+ * A chunk of the stream on its way through the stages. @offset counts from
+ * the start of the stream, and a @len of 0 ends it.
+ */
+struct pipeline_buf {
+    void *data;
+    size_t len;
+    uint64_t offset;
+    /* What the chunk holds, if a stage has looked, fill_data otherwise */
+    enum fill fill;
+};
+
+struct pipeline_stage;
+
+/*
+ * A source's run() fills @buf->data with up to the pipeline's chunk size,
+ * returning the length, 0 at the end of the stream or a negative error. The
+ * other stages work on @buf->len bytes and return 0 or a negative error.
+ */
+struct pipeline_stage_ops {
+    ssize_t (*run)(struct pipeline_stage *stage, struct pipeline_buf *buf);
+    /* Optional, once the stream has ended without error */
+    int (*finish)(struct pipeline_stage *stage);
+    /* Optional, releases @priv */
+    void (*destroy)(struct pipeline_stage *stage);
+};
+
+/* Bounded and lock-free, between the one stage feeding it and the next */
+struct pipeline_queue {
+    struct pipeline_buf *slots[PIPELINE_DEPTH];
+    /* Written only by the producer */
+    size_t head;
+    /* Written only by the consumer */
+    size_t tail;
+    int efd;
+    bool waiting;
+};
+
+struct pipeline_stage {
+    const char *name;
+    const struct pipeline_stage_ops *ops;
+    void *priv;
+    struct pipeline *pipeline;
+    /* Fed by the stage before, or for the source the buffers coming back */
+    struct pipeline_queue in;
+    pthread_t worker;
+    bool started;
+    /* For pipeline_report(), the same for every stage */
+    uint64_t bytes;
+    uint64_t chunks;
+    uint64_t busy_ns;
+    uint64_t wait_ns;
+};
+
+/*
+ * A source, any transforms and a sink, each stage on its own thread with
+ * chunks handed along by queue and recycled from the sink back to the source,
+ * so a slow stage only holds up the others once every buffer is waiting on
+ * it. The first error of any stage stops them all.
+ */
+struct pipeline {
+    struct pipeline_stage stages[PIPELINE_STAGES_MAX];
+    size_t nr_stages;
+    struct pipeline_buf bufs[PIPELINE_DEPTH];
+    size_t chunk;
+    struct progress progress;
+    const char *label;
+    uint64_t total;
+    uint64_t base;
+    bool has_base;
+    int rc;
+};
+
+/*
+ * @total may be 0 if the length isn't known, as for progress_init(), and a
+ * NULL @label runs without reporting progress
+ */
+int pipeline_init(struct pipeline *ctx, const char *label, size_t chunk,
+                  uint64_t total);
+void pipeline_destroy(struct pipeline *ctx);
+
+/* The address the transfer starts at on the BMC, for the progress report */
+void pipeline_set_base(struct pipeline *ctx, uint64_t base);
+
+/*
+ * Add a stage after those already added, the first being the source and the
+ * last the sink. On failure @ops->destroy is called on @priv.
+ */
+int pipeline_add(struct pipeline *ctx, const char *name,
+                 const struct pipeline_stage_ops *ops, void *priv);
+
+/* Moves the stream through the stages, returning the first error of any */
+int pipeline_run(struct pipeline *ctx);
+
+/* Either side of any stage, the first error wins */
+void pipeline_abort(struct pipeline *ctx, int rc);
+
+/* Each stage's throughput and how long it spent waiting, at debug level */
+void pipeline_report(const struct pipeline *ctx);
+
+/* Sources, taking @len bytes or, for a descriptor with @len of 0, to EOF */
+int pipeline_add_bridge_source(struct pipeline *ctx, struct ahb *ahb,
+                               uint32_t phys, size_t len);
+int pipeline_add_flash_source(struct pipeline *ctx, struct flash_chip *chip,
+                              uint32_t offset, size_t len);
+int pipeline_add_fd_source(struct pipeline *ctx, int fd, size_t len);
+int pipeline_add_mem_source(struct pipeline *ctx, const void *buf, size_t len);
+
+/* Transforms, passing the chunks on as they are */
+int pipeline_add_digest(struct pipeline *ctx, struct digest *digest);
+int pipeline_add_classify(struct pipeline *ctx);
+int pipeline_add_search(struct pipeline *ctx, struct search *search,
+                        search_match_fn fn, void *priv);
+/* Calls @fn for each run of chunks differing from the same range of @fd */
+int pipeline_add_diff(struct pipeline *ctx, int fd,
+                      int (*fn)(void *priv, uint64_t offset, size_t len),
+                      void *priv);
+
+/*
+ * Sinks. To a descriptor the stream is compressed with zstd at a non-zero
+ * @level, or with @sparse seeks over chunks classified as zeros.
+ */
+int pipeline_add_fd_sink(struct pipeline *ctx, int fd, int level, bool sparse);
+int pipeline_add_bridge_sink(struct pipeline *ctx, struct ahb *ahb,
+                             uint32_t phys);
+int pipeline_add_flash_sink(struct pipeline *ctx, struct flash_chip *chip,
+                            uint32_t offset);
+
+#endif
@@ -0,0 +1,166 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "control.h"
+#include "progress.h"
+#include "timing.h"
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define PROGRESS_TTY_INTERVAL_NS    (250 * 1000 * 1000ULL)
+#define PROGRESS_LOG_INTERVAL_NS    (1000 * 1000 * 1000ULL)
+
+static enum progress_mode progress_current_mode = progress_human;
+
+void progress_set_mode(enum progress_mode mode)
+{
+    progress_current_mode = mode;
+}
+
+int progress_parse_mode(const char *name, enum progress_mode *mode)
+{
+    if (!strcmp("none", name))
+        *mode = progress_none;
+    else if (!strcmp("human", name))
+        *mode = progress_human;
+    else if (!strcmp("json", name))
+        *mode = progress_json;
+    else
+        return -1;
+
+    return 0;
+}
+
+static uint64_t progress_elapsed_ns(const struct timespec *from,
+                                    const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000000ULL +
+           to->tv_nsec - from->tv_nsec;
+}
+
+static void progress_format_bytes(char *buf, size_t len, double bytes)
+{
+    static const char *units[] = { "B", "KiB", "MiB", "GiB" };
+    unsigned int i = 0;
+
+    while (bytes >= 1024 && i < (sizeof(units) / sizeof(units[0])) - 1) {
+        bytes /= 1024;
+        i++;
+    }
+
+    snprintf(buf, len, "%.1f%s", bytes, units[i]);
+}
+
+static void progress_report(struct progress *ctx, uint64_t elapsed, bool end)
+{
+    char done[16], total[16], rate[16], avg[16];
+    double avg_rate;
+    long eta = -1;
+    bool tty;
+
+    avg_rate = elapsed ? ctx->done * 1e9 / elapsed : 0;
+    if (ctx->total && avg_rate > 0 && ctx->done <= ctx->total)
+        eta = (ctx->total - ctx->done) / avg_rate;
+
+    if (progress_current_mode == progress_json) {
+        fprintf(stderr,
+                "{\"op\":\"%s\",\"bytes\":%" PRIu64 ",\"total\":%" PRIu64
+                ",\"rate\":%.0f,\"avg\":%.0f,\"eta\":%ld,\"elapsed\":%.3f,"
+                "\"done\":%s}\n",
+                ctx->label, ctx->done, ctx->total, ctx->rate, avg_rate, eta,
+                elapsed / 1e9, end ? "true" : "false");
+        return;
+    }
+
+    tty = isatty(fileno(stderr));
+
+    progress_format_bytes(done, sizeof(done), ctx->done);
+    progress_format_bytes(total, sizeof(total), ctx->total);
+    progress_format_bytes(rate, sizeof(rate), ctx->rate);
+    progress_format_bytes(avg, sizeof(avg), avg_rate);
+
+    fprintf(stderr, "%s%s: %s", tty ? "\r\e[K" : "", ctx->label, done);
+    if (ctx->total)
+        fprintf(stderr, "/%s", total);
+    fprintf(stderr, " %s/s (avg %s/s)", end ? avg : rate, avg);
+    if (!end && eta >= 0)
+        fprintf(stderr, " ETA %ld:%02ld:%02ld", eta / 3600, (eta / 60) % 60,
+                eta % 60);
+    else if (end)
+        fprintf(stderr, " in %.1fs", elapsed / 1e9);
+
+    if (end || !tty)
+        fprintf(stderr, "\n");
+}
+
+void progress_init(struct progress *ctx, const char *label, uint64_t total)
+{
+    ctx->label = label;
+    ctx->total = total;
+    ctx->done = 0;
+    ctx->last_done = 0;
+    ctx->rate = 0;
+    ctx->timing = timing_begin("transfer", label);
+    ctx->base = 0;
+    ctx->has_base = false;
+
+    clock_gettime(CLOCK_MONOTONIC, &ctx->start);
+    ctx->last = ctx->start;
+
+    control_progress_begin(ctx);
+}
+
+void progress_set_base(struct progress *ctx, uint64_t base)
+{
+    ctx->base = base;
+    ctx->has_base = true;
+}
+
+void progress_update(struct progress *ctx, uint64_t delta)
+{
+    uint64_t interval, since;
+    struct timespec now;
+
+    ctx->done += delta;
+
+    control_progress_update(ctx);
+
+    if (progress_current_mode == progress_none)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    interval = (progress_current_mode == progress_human &&
+                isatty(fileno(stderr)))
+                    ? PROGRESS_TTY_INTERVAL_NS : PROGRESS_LOG_INTERVAL_NS;
+
+    since = progress_elapsed_ns(&ctx->last, &now);
+    if (since < interval)
+        return;
+
+    ctx->rate = (ctx->done - ctx->last_done) * 1e9 / since;
+    ctx->last_done = ctx->done;
+    ctx->last = now;
+
+    progress_report(ctx, progress_elapsed_ns(&ctx->start, &now), false);
+}
+
+void progress_end(struct progress *ctx)
+{
+    struct timespec now;
+
+    timing_end(ctx->timing);
+    ctx->timing = -1;
+
+    control_progress_end(ctx);
+
+    if (progress_current_mode == progress_none)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    progress_report(ctx, progress_elapsed_ns(&ctx->start, &now), true);
+}
@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _PROGRESS_H
+#define _PROGRESS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+enum progress_mode { progress_none, progress_human, progress_json };
+
+struct progress {
+    const char *label;
+    uint64_t total;
+    uint64_t done;
+    struct timespec start;
+    struct timespec last;
+    uint64_t last_done;
+    double rate;
+    int timing;
+    /* Where the transfer started on the BMC, for the control socket */
+    uint64_t base;
+    bool has_base;
+};
+
+void progress_set_mode(enum progress_mode mode);
+int progress_parse_mode(const char *name, enum progress_mode *mode);
+
+/* @total may be 0 if the length of the transfer isn't known up front */
+void progress_init(struct progress *ctx, const char *label, uint64_t total);
+/* Records the address the transfer starts at, where it has one */
+void progress_set_base(struct progress *ctx, uint64_t base);
+void progress_update(struct progress *ctx, uint64_t delta);
+void progress_end(struct progress *ctx);
+
+#endif
@@ -5,20 +5,161 @@
 #include "prompt.h"
 
 #include <errno.h>
+#include <poll.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-int prompt_init(struct prompt *ctx, int fd, const char *eol, bool have_echo)
+/* Longest string the matcher will look for */
+#define PROMPT_MATCH_MAX 128
+
+/*
+ * Incremental matcher for a fixed string. Knuth-Morris-Pratt, so each byte of
+ * output is examined once no matter how the string's prefixes recur.
+ */
+struct prompt_match {
+    const char *str;
+    size_t len;
+    size_t state;
+    size_t fail[PROMPT_MATCH_MAX];
+};
+
+static int prompt_match_init(struct prompt_match *m, const char *str)
+{
+    size_t i, k;
+
+    m->str = str;
+    m->len = strlen(str);
+    m->state = 0;
+
+    if (!m->len || m->len > PROMPT_MATCH_MAX)
+        return -EINVAL;
+
+    m->fail[0] = 0;
+    for (i = 1, k = 0; i < m->len; i++) {
+        while (k && str[i] != str[k])
+            k = m->fail[k - 1];
+        if (str[i] == str[k])
+            k++;
+        m->fail[i] = k;
+    }
+
+    return 0;
+}
+
+/* @return true when @c completes a match */
+static bool prompt_match_step(struct prompt_match *m, char c)
+{
+    while (m->state && c != m->str[m->state])
+        m->state = m->fail[m->state - 1];
+
+    if (c == m->str[m->state])
+        m->state++;
+
+    if (m->state < m->len)
+        return false;
+
+    /* Matches don't overlap */
+    m->state = 0;
+
+    return true;
+}
+
+static int prompt_wait(struct prompt *ctx)
+{
+    struct pollfd pfd = { .fd = ctx->fd, .events = POLLIN };
+    int rc;
+
+    if (ctx->timeout < 0)
+        return 0;
+
+    if ((rc = poll(&pfd, 1, ctx->timeout)) < 0)
+        return -errno;
+
+    return rc ? 0 : -ETIMEDOUT;
+}
+
+/* Returns a positive number of bytes received, or a negative error */
+static ssize_t prompt_recv(struct prompt *ctx, char *buf, size_t len)
 {
-    ctx->stream = fdopen(fd, "r+");
-    if (!ctx->stream)
+    ssize_t ingress;
+    int rc;
+
+    if (ctx->ops) {
+        ingress = ctx->ops->recv(ctx->priv, buf, len, ctx->timeout);
+        if (!ingress)
+            return -ETIMEDOUT;
+
+        return ingress;
+    }
+
+    if ((rc = prompt_wait(ctx)) < 0)
+        return rc;
+
+    ingress = read(ctx->fd, buf, len);
+    if (ingress < 0)
         return -errno;
+    if (!ingress)
+        return -EIO;
 
-    ctx->eol = eol;
+    return ingress;
+}
 
+static int prompt_fill(struct prompt *ctx)
+{
+    size_t tail, space;
+    ssize_t ingress;
+
+    tail = (ctx->head + ctx->len) & (PROMPT_BUF_SIZE - 1);
+    space = PROMPT_BUF_SIZE - ctx->len;
+    if (space > PROMPT_BUF_SIZE - tail)
+        space = PROMPT_BUF_SIZE - tail;
+
+    ingress = prompt_recv(ctx, &ctx->buf[tail], space);
+    if (ingress < 0)
+        return ingress;
+
+    ctx->len += ingress;
+
+    return 0;
+}
+
+static int prompt_getc(struct prompt *ctx, char *c)
+{
+    int rc;
+
+    if (!ctx->len && (rc = prompt_fill(ctx)) < 0)
+        return rc;
+
+    *c = ctx->buf[ctx->head];
+    ctx->head = (ctx->head + 1) & (PROMPT_BUF_SIZE - 1);
+    ctx->len--;
+
+    return 0;
+}
+
+int prompt_init(struct prompt *ctx, int fd, const char *eol, bool have_echo)
+{
+    ctx->fd = fd;
+    ctx->ops = NULL;
+    ctx->priv = NULL;
+    ctx->eol = eol;
     ctx->have_echo = have_echo;
+    ctx->timeout = -1;
+    ctx->head = 0;
+    ctx->len = 0;
+
+    return 0;
+}
+
+int prompt_init_ops(struct prompt *ctx, const struct prompt_ops *ops,
+                    void *priv, const char *eol, bool have_echo)
+{
+    prompt_init(ctx, -1, eol, have_echo);
+    ctx->ops = ops;
+    ctx->priv = priv;
 
     return 0;
 }
@@ -27,45 +168,68 @@ int prompt_destroy(struct prompt *ctx)
 {
     int rc;
 
-    rc = fclose(ctx->stream);
+    if (ctx->ops)
+        return 0;
+
+    rc = close(ctx->fd);
     if (rc < 0)
         return -errno;
 
     return 0;
 }
 
+void prompt_set_timeout(struct prompt *ctx, int ms)
+{
+    ctx->timeout = ms;
+}
+
+/* Lines longer than @len are truncated, the remainder is discarded */
 int prompt_gets(struct prompt *ctx, char *output, size_t len)
 {
-    char *cursor;
-    char *res;
+    size_t stored = 0;
+    char c;
+    int rc;
+
+    if (!len)
+        return -EINVAL;
 
-    cursor = output;
     do {
-        res = fgets(cursor, len, ctx->stream);
-        if (!res)
-            return -errno;
-        cursor += strlen(res);
-    } while (!strchr(output, '\n'));
+        if ((rc = prompt_getc(ctx, &c)) < 0)
+            return rc;
+
+        if (stored < len - 1)
+            output[stored++] = c;
+    } while (c != '\n');
+
+    output[stored] = '\0';
 
     return 0;
 }
 
+/*
+ * Copy output into @prior until @str is seen or @len bytes have been stored.
+ * Output following @str is left for the next caller.
+ */
 int prompt_expect_into(struct prompt *ctx, const char *str, char *prior,
                          size_t len, char **prompt)
 {
-    ssize_t ingress;
-    char *cursor;
-    char *res;
+    struct prompt_match m;
+    size_t stored = 0;
+    char *res = NULL;
+    int rc;
 
-    cursor = prior;
-    do {
-        ingress = read(fileno(ctx->stream), cursor, prior + len - cursor);
-        if (ingress < 0)
-            return -errno;
+    if ((rc = prompt_match_init(&m, str)) < 0)
+        return rc;
 
-        cursor += ingress;
-    } while(!(res = memmem(prior, cursor - prior, str, strlen(str))) &&
-            (ptrdiff_t)len > (cursor - prior));
+    while (stored < len) {
+        if ((rc = prompt_getc(ctx, &prior[stored])) < 0)
+            return rc;
+
+        if (prompt_match_step(&m, prior[stored++])) {
+            res = &prior[stored - m.len];
+            break;
+        }
+    }
 
     if (prompt)
         *prompt = res;
@@ -73,18 +237,30 @@ int prompt_expect_into(struct prompt *ctx, const char *str, char *prior,
     return res != NULL;
 }
 
-int prompt_expect(struct prompt *ctx, const char *str)
+/* Consume output until @str has been seen @count times */
+int prompt_expect_count(struct prompt *ctx, const char *str, unsigned int count)
 {
-    char buf[100];
+    struct prompt_match m;
+    char c;
     int rc;
 
-    do {
-        rc = prompt_expect_into(ctx, str, &buf[0], sizeof(buf), NULL);
-        if (rc < 0)
+    if ((rc = prompt_match_init(&m, str)) < 0)
+        return rc;
+
+    while (count) {
+        if ((rc = prompt_getc(ctx, &c)) < 0)
             return rc;
-    } while(!rc);
 
-    return rc;
+        if (prompt_match_step(&m, c))
+            count--;
+    }
+
+    return 1;
+}
+
+int prompt_expect(struct prompt *ctx, const char *str)
+{
+    return prompt_expect_count(ctx, str, 1);
 }
 
 ssize_t prompt_write(struct prompt *ctx, const char *buf, size_t len)
@@ -94,9 +270,12 @@ ssize_t prompt_write(struct prompt *ctx, const char *buf, size_t len)
 
     cursor = buf;
     do {
-        egress = write(fileno(ctx->stream), cursor, buf + len - cursor);
+        if (ctx->ops)
+            egress = ctx->ops->send(ctx->priv, cursor, buf + len - cursor);
+        else if ((egress = write(ctx->fd, cursor, buf + len - cursor)) < 0)
+            egress = -errno;
         if (egress < 0)
-            return -errno;
+            return egress;
 
         cursor += egress;
     } while(cursor < (buf + len));
@@ -104,49 +283,115 @@ ssize_t prompt_write(struct prompt *ctx, const char *buf, size_t len)
     return len;
 }
 
+/* @iov is consumed, its entries are advanced past what has been written */
+ssize_t prompt_writev(struct prompt *ctx, struct iovec *iov, int iovcnt)
+{
+    ssize_t egress, total = 0;
+
+    while (iovcnt) {
+        if (ctx->ops)
+            egress = prompt_write(ctx, iov->iov_base, iov->iov_len);
+        else if ((egress = writev(ctx->fd, iov, iovcnt)) < 0)
+            egress = -errno;
+        if (egress < 0)
+            return egress;
+
+        total += egress;
+
+        while (iovcnt && (size_t)egress >= iov->iov_len) {
+            egress -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+
+        if (iovcnt) {
+            iov->iov_base = (char *)iov->iov_base + egress;
+            iov->iov_len -= egress;
+        }
+    }
+
+    return total;
+}
+
 ssize_t prompt_read(struct prompt *ctx, char *output, size_t len)
 {
     char *cursor;
     ssize_t ingress;
 
+    /* Drain what's buffered before going to the file */
     cursor = output;
-    do {
-        ingress = read(fileno(ctx->stream), cursor, output + len - cursor);
+    while (ctx->len && cursor < output + len) {
+        size_t chunk = PROMPT_BUF_SIZE - ctx->head;
+
+        if (chunk > ctx->len)
+            chunk = ctx->len;
+        if (chunk > (size_t)(output + len - cursor))
+            chunk = output + len - cursor;
+
+        memcpy(cursor, &ctx->buf[ctx->head], chunk);
+        ctx->head = (ctx->head + chunk) & (PROMPT_BUF_SIZE - 1);
+        ctx->len -= chunk;
+        cursor += chunk;
+    }
+
+    while (cursor < (output + len)) {
+        ingress = prompt_recv(ctx, cursor, output + len - cursor);
         if (ingress < 0)
-            return -errno;
+            return ingress;
 
         cursor += ingress;
-    } while(cursor < (output + len));
+    }
 
     return len;
 }
 
-int prompt_run(struct prompt *ctx, const char *cmd)
+/* Eat the echo of @len bytes, stopping at its end of line as fgets() would */
+static int prompt_eat_echo(struct prompt *ctx, size_t len)
 {
-    size_t len = strlen(cmd);
+    char c;
     int rc;
 
-    rc = prompt_write(ctx, cmd, len);
-    if (rc < 0)
-        return rc;
+    do {
+        if ((rc = prompt_getc(ctx, &c)) < 0)
+            return rc;
+    } while (--len && c != '\n');
 
-    rc = prompt_write(ctx, ctx->eol, strlen(ctx->eol));
-    if (rc < 0)
+    return 0;
+}
+
+int prompt_run_line(struct prompt *ctx, const char *line, size_t len)
+{
+    ssize_t rc;
+    int ret;
+
+    if ((rc = prompt_write(ctx, line, len)) < 0)
         return rc;
 
-    if (ctx->have_echo) {
-        char *echo, *res;
-        size_t eol_len = len + strlen(ctx->eol) + 1;
+    if (ctx->have_echo && (ret = prompt_eat_echo(ctx, len)) < 0)
+        return ret;
 
-        echo = malloc(eol_len);
-        if (!echo)
-            return -errno;
+    return rc;
+}
 
-        res = fgets(echo, eol_len, ctx->stream);
-        free(echo);
-        if (!res)
-            return -errno;
-    }
+int prompt_run(struct prompt *ctx, const char *cmd)
+{
+    size_t len = strlen(cmd);
+    struct iovec iov[2];
+    int rc, ret;
+
+    /* One write, so a stream socket doesn't send the EOL on its own */
+    iov[0].iov_base = (char *)cmd;
+    iov[0].iov_len = len;
+    iov[1].iov_base = (char *)ctx->eol;
+    iov[1].iov_len = strlen(ctx->eol);
+
+    rc = prompt_writev(ctx, iov, 2);
+    if (rc < 0)
+        return rc;
+
+    if (ctx->have_echo &&
+            (ret = prompt_eat_echo(ctx, len + strlen(ctx->eol))) < 0)
+        return ret;
 
     return rc;
 }
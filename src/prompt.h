@@ -5,29 +5,60 @@
 #define _PROMPT_H
 
 #include <stdbool.h>
-#include <stdio.h>
+#include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+
+/* Must be a power of two */
+#define PROMPT_BUF_SIZE 4096
+
+/* For a console that isn't a file descriptor */
+struct prompt_ops {
+    /* Returns what arrives within @timeout_ms, -1 to wait, or 0 for none */
+    ssize_t (*recv)(void *priv, char *buf, size_t len, int timeout_ms);
+    /* Returns the number of bytes sent, which may be short */
+    ssize_t (*send)(void *priv, const char *buf, size_t len);
+};
 
 struct prompt {
-    FILE *stream;
+    int fd;
+    const struct prompt_ops *ops;
+    void *priv;
     const char *eol;
     bool have_echo;
+    /* Milliseconds to wait for output, negative to wait indefinitely */
+    int timeout;
+    /* Received but not yet consumed: @len bytes from @head, wrapping */
+    size_t head;
+    size_t len;
+    char buf[PROMPT_BUF_SIZE];
 };
 
 /**
- * @param fd Owned, closed on prompt_destroy(), must be mode "r+"
+ * @param fd Owned, closed on prompt_destroy(), must be open for reading and
+ *           writing
  */
 int prompt_init(struct prompt *ctx, int fd, const char *eol, bool have_echo);
+/* prompt_destroy() leaves @priv to the caller */
+int prompt_init_ops(struct prompt *ctx, const struct prompt_ops *ops,
+                    void *priv, const char *eol, bool have_echo);
 int prompt_destroy(struct prompt *ctx);
 
+/* Subsequent reads fail with -ETIMEDOUT if @ms passes without output */
+void prompt_set_timeout(struct prompt *ctx, int ms);
+
 int prompt_expect(struct prompt *ctx, const char *str);
+int prompt_expect_count(struct prompt *ctx, const char *str, unsigned int count);
 int prompt_expect_into(struct prompt *ctx, const char *str, char *prior,
 			 size_t len, char **prompt);
 ssize_t prompt_write(struct prompt *ctx, const char *cmd, size_t len);
+ssize_t prompt_writev(struct prompt *ctx, struct iovec *iov, int iovcnt);
 ssize_t prompt_read(struct prompt *ctx, char *output, size_t len);
 int prompt_gets(struct prompt *ctx, char *output, size_t len);
 
 int prompt_run(struct prompt *ctx, const char *cmd);
+/* As prompt_run(), with @len bytes of @line already ending in the EOL */
+int prompt_run_line(struct prompt *ctx, const char *line, size_t len);
 int prompt_expect_run(struct prompt *ctx, const char *prompt, const char *cmd);
 int prompt_run_expect(struct prompt *ctx, const char *cmd, const char *prompt,
 		      char **output, size_t len);
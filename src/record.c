@@ -0,0 +1,261 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include "crc32.h"
+#include "log.h"
+#include "record.h"
+
+#include <endian.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define RECORD_BUF_LEN          (64 << 10)
+#define RECORD_BRIDGES_MAX      RECORD_OP_BRIDGE
+
+struct record {
+    int fd;
+    bool data;
+    int bridges;
+    uint64_t last;
+    pthread_mutex_t lock;
+    size_t used;
+    uint8_t buf[RECORD_BUF_LEN];
+};
+
+static struct record *record;
+
+static int record_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *cursor = buf;
+    ssize_t rc;
+
+    while (len) {
+        if ((rc = write(fd, cursor, len)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        cursor += rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+static int record_flush(struct record *ctx)
+{
+    int rc;
+
+    if (!ctx->used)
+        return 0;
+
+    rc = record_write(ctx->fd, ctx->buf, ctx->used);
+    ctx->used = 0;
+
+    return rc;
+}
+
+/* A recording that can't be written is abandoned rather than failing the command */
+static void record_fail(struct record *ctx, int rc)
+{
+    loge("Failed to write the bridge recording, stopping: %d\n", rc);
+    close(ctx->fd);
+    ctx->fd = -1;
+}
+
+static void record_append(struct record *ctx, const void *buf, size_t len)
+{
+    int rc;
+
+    if (ctx->fd < 0)
+        return;
+
+    if (ctx->used + len > sizeof(ctx->buf)) {
+        if ((rc = record_flush(ctx)) < 0) {
+            record_fail(ctx, rc);
+            return;
+        }
+    }
+
+    /* Payloads bigger than the buffer bypass it */
+    if (len > sizeof(ctx->buf)) {
+        if ((rc = record_write(ctx->fd, buf, len)) < 0)
+            record_fail(ctx, rc);
+        return;
+    }
+
+    memcpy(&ctx->buf[ctx->used], buf, len);
+    ctx->used += len;
+}
+
+int record_enable(const char *spec)
+{
+    struct {
+        char magic[8];
+        uint32_t version;
+        uint32_t flags;
+    } __attribute__((packed)) header;
+    struct record *ctx;
+    const char *sep;
+    char *path;
+    int rc;
+
+    if (record)
+        return -EBUSY;
+
+    if (!(sep = strchr(spec, ',')))
+        sep = spec + strlen(spec);
+    else if (strcmp(sep, ",data"))
+        return -EINVAL;
+
+    if (sep == spec)
+        return -EINVAL;
+
+    if (!(ctx = malloc(sizeof(*ctx))))
+        return -ENOMEM;
+
+    if (!(path = strndup(spec, sep - spec))) {
+        rc = -ENOMEM;
+        goto cleanup_ctx;
+    }
+
+    ctx->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    free(path);
+    if (ctx->fd < 0) {
+        rc = -errno;
+        goto cleanup_ctx;
+    }
+
+    ctx->data = *sep;
+    ctx->bridges = 0;
+    ctx->last = 0;
+    ctx->used = 0;
+    pthread_mutex_init(&ctx->lock, NULL);
+
+    memcpy(header.magic, RECORD_MAGIC, sizeof(header.magic));
+    header.version = htole32(RECORD_VERSION);
+    header.flags = htole32(ctx->data ? RECORD_F_DATA : 0);
+    record_append(ctx, &header, sizeof(header));
+
+    record = ctx;
+
+    return 0;
+
+cleanup_ctx:
+    free(ctx);
+
+    return rc;
+}
+
+bool record_enabled(void)
+{
+    return record;
+}
+
+void record_close(void)
+{
+    int rc;
+
+    if (!record)
+        return;
+
+    if (record->fd >= 0) {
+        if ((rc = record_flush(record)) < 0)
+            loge("Failed to write the bridge recording: %d\n", rc);
+        close(record->fd);
+    }
+
+    pthread_mutex_destroy(&record->lock);
+    free(record);
+    record = NULL;
+}
+
+int record_bridge(const char *name)
+{
+    struct record_entry entry = { 0 };
+    int id;
+
+    if (!record)
+        return -ENODEV;
+
+    pthread_mutex_lock(&record->lock);
+
+    if (record->bridges == RECORD_BRIDGES_MAX) {
+        pthread_mutex_unlock(&record->lock);
+        return -ENOSPC;
+    }
+
+    id = record->bridges++;
+
+    entry.op = RECORD_OP_BRIDGE;
+    entry.bridge = id;
+    entry.len = htole32(strlen(name));
+    record_append(record, &entry, sizeof(entry));
+    record_append(record, name, strlen(name));
+
+    pthread_mutex_unlock(&record->lock);
+
+    return id;
+}
+
+static uint32_t record_saturate(uint64_t ns)
+{
+    return ns > UINT32_MAX ? UINT32_MAX : ns;
+}
+
+void record_op(int bridge, unsigned int op, uint32_t phys, const void *buf,
+               size_t len, uint32_t value, const struct timespec *start,
+               ssize_t rc)
+{
+    struct record_entry entry;
+    uint64_t begin, end;
+    struct timespec now;
+    uint16_t flags = 0;
+
+    if (!record)
+        return;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    begin = start->tv_sec * 1000000000ULL + start->tv_nsec;
+    end = now.tv_sec * 1000000000ULL + now.tv_nsec;
+
+    if (rc < 0) {
+        flags |= RECORD_E_ERROR;
+        value = -rc;
+    } else if (buf) {
+        len = rc;
+        value = crc32_update(0, buf, len);
+        if (record->data && len)
+            flags |= RECORD_E_DATA;
+    }
+
+    entry.op = op;
+    entry.bridge = bridge;
+    entry.flags = htole16(flags);
+    entry.duration = htole32(record_saturate(end - begin));
+    entry.phys = htole32(phys);
+    entry.len = htole32(len);
+    entry.value = htole32(value);
+
+    pthread_mutex_lock(&record->lock);
+
+    /* Threads sharing the recording may take the lock out of order */
+    if (record->last && begin > record->last)
+        entry.delta = htole32(record_saturate(begin - record->last));
+    else
+        entry.delta = 0;
+    if (begin > record->last)
+        record->last = begin;
+
+    record_append(record, &entry, sizeof(entry));
+    if (flags & RECORD_E_DATA)
+        record_append(record, buf, len);
+
+    pthread_mutex_unlock(&record->lock);
+}
@@ -0,0 +1,72 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _RECORD_H
+#define _RECORD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+/*
+ * A binary log of every bridge operation, cheap enough to leave on for a whole
+ * command. All fields are little-endian. The file starts with:
+ *
+ *   char[8] "CVAHBREC", le32 version, le32 flags (RECORD_F_DATA)
+ *
+ * and is followed by entries of struct record_entry. Each bridge is announced
+ * before its first operation by an entry with op RECORD_OP_BRIDGE, its id in
+ * @bridge and the @len bytes of its driver name following. Operation entries
+ * carry an enum ahb_op in @op and:
+ *
+ *   delta:    Nanoseconds since the start of the previous operation
+ *   duration: Nanoseconds the operation took
+ *   phys:     Bus address, for vectored operations that of the first region
+ *   len:      Bytes transferred, or requested if the operation failed
+ *   value:    The word for readl and writel, the CRC32 of the data for read
+ *             and write, the region count for vectored operations, or the
+ *             positive errno with RECORD_E_ERROR set in @flags
+ *
+ * With RECORD_E_DATA set in @flags, @len bytes of the data follow the entry.
+ * Durations and deltas saturate at UINT32_MAX.
+ */
+#define RECORD_MAGIC            "CVAHBREC"
+#define RECORD_VERSION          1
+
+#define RECORD_F_DATA           (1 << 0)
+
+#define RECORD_OP_BRIDGE        0xff
+
+#define RECORD_E_ERROR          (1 << 0)
+#define RECORD_E_DATA           (1 << 1)
+
+struct record_entry {
+    uint8_t op;
+    uint8_t bridge;
+    uint16_t flags;
+    uint32_t delta;
+    uint32_t duration;
+    uint32_t phys;
+    uint32_t len;
+    uint32_t value;
+} __attribute__((packed));
+
+/* @spec is "FILE" or "FILE,data" to include the data of bulk transfers */
+int record_enable(const char *spec);
+bool record_enabled(void);
+/* Flushes and closes the recording, safe to call when none is open */
+void record_close(void);
+
+/* Returns the id to tag the bridge's operations with */
+int record_bridge(const char *name);
+
+/*
+ * @buf holds @len bytes of data for bulk transfers and is NULL otherwise, in
+ * which case @value is recorded as is. @rc is the operation's result.
+ */
+void record_op(int bridge, unsigned int op, uint32_t phys, const void *buf,
+               size_t len, uint32_t value, const struct timespec *start,
+               ssize_t rc);
+
+#endif
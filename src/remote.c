@@ -0,0 +1,256 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+#include "compiler.h"
+#include "config.h"
+#include "log.h"
+#include "remote.h"
+
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+/* Smaller payloads aren't worth the round trip through zstd */
+#define REMOTE_PACK_MIN         4096
+#define REMOTE_PACK_LEVEL       1
+
+static int remote_send_flags(int fd, const void *buf, size_t len, int flags)
+{
+    ssize_t rc;
+
+    while (len) {
+        if ((rc = send(fd, buf, len, MSG_NOSIGNAL | flags)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        buf = (const char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+int remote_send(int fd, const void *buf, size_t len)
+{
+    return remote_send_flags(fd, buf, len, 0);
+}
+
+int remote_send_msg(int fd, const void *hdr, size_t hdr_len, const void *buf,
+                    size_t len)
+{
+    int rc;
+
+    /* Corked so the header doesn't go out in a segment of its own */
+    if ((rc = remote_send_flags(fd, hdr, hdr_len, len ? MSG_MORE : 0)) < 0)
+        return rc;
+
+    return remote_send_flags(fd, buf, len, 0);
+}
+
+int remote_recv(int fd, void *buf, size_t len)
+{
+    ssize_t rc;
+
+    while (len) {
+        if ((rc = recv(fd, buf, len, 0)) < 0) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        if (!rc)
+            return -ECONNRESET;
+
+        buf = (char *)buf + rc;
+        len -= rc;
+    }
+
+    return 0;
+}
+
+/* Splits "[HOST:]PORT" into @host and @port, @host is NULL if absent */
+static int remote_parse(const char *spec, char **host, const char **port)
+{
+    const char *sep;
+
+    *host = NULL;
+
+    if (*spec == '[') {
+        if (!(sep = strchr(spec, ']')) || sep[1] != ':')
+            return -EINVAL;
+        *host = strndup(spec + 1, sep - spec - 1);
+        *port = sep + 2;
+    } else if ((sep = strrchr(spec, ':'))) {
+        *host = strndup(spec, sep - spec);
+        *port = sep + 1;
+    } else {
+        *port = spec;
+    }
+
+    if (!**port)
+        return -EINVAL;
+
+    if (sep && !*host)
+        return -ENOMEM;
+
+    return 0;
+}
+
+static int remote_socket(const char *spec, bool server)
+{
+    struct addrinfo hints = {
+        .ai_family = AF_UNSPEC,
+        .ai_socktype = SOCK_STREAM,
+        .ai_flags = server ? AI_PASSIVE : 0,
+    };
+    struct addrinfo *res, *ai;
+    const char *port;
+    int one = 1;
+    char *host;
+    int fd = -1;
+    int rc;
+
+    if ((rc = remote_parse(spec, &host, &port)) < 0)
+        return rc;
+
+    /* Serving the BMC to the network has to be asked for by address */
+    if (server && !host && !(host = strdup("localhost")))
+        return -ENOMEM;
+
+    rc = getaddrinfo(host, port, &hints, &res);
+    free(host);
+    if (rc) {
+        loge("Failed to resolve '%s': %s\n", spec, gai_strerror(rc));
+        return -ENOENT;
+    }
+
+    rc = -ENOENT;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+        if (fd < 0) {
+            rc = -errno;
+            continue;
+        }
+
+        if (server) {
+            setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+            if (!bind(fd, ai->ai_addr, ai->ai_addrlen) && !listen(fd, 1))
+                break;
+        } else if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) {
+            break;
+        }
+
+        rc = -errno;
+        close(fd);
+        fd = -1;
+    }
+
+    freeaddrinfo(res);
+
+    if (fd < 0)
+        return rc;
+
+    /* Messages are written whole, don't hold them back waiting for more */
+    if (!server)
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return fd;
+}
+
+int remote_connect(const char *spec)
+{
+    return remote_socket(spec, false);
+}
+
+int remote_listen(const char *spec)
+{
+    return remote_socket(spec, true);
+}
+
+int remote_accept(int fd)
+{
+    int one = 1;
+    int cfd;
+
+    if ((cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+        return -errno;
+
+    setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    return cfd;
+}
+
+#if HAVE_ZSTD
+bool remote_have_zstd(void)
+{
+    return true;
+}
+
+size_t remote_pack_bound(size_t len)
+{
+    return ZSTD_compressBound(len);
+}
+
+size_t remote_pack(void *dst, size_t cap, const void *src, size_t len)
+{
+    size_t rc;
+
+    if (len < REMOTE_PACK_MIN)
+        return 0;
+
+    rc = ZSTD_compress(dst, cap, src, len, REMOTE_PACK_LEVEL);
+    if (ZSTD_isError(rc) || rc >= len)
+        return 0;
+
+    return rc;
+}
+
+int remote_unpack(void *dst, size_t len, const void *src, size_t payload)
+{
+    size_t rc;
+
+    rc = ZSTD_decompress(dst, len, src, payload);
+    if (ZSTD_isError(rc)) {
+        logd("Failed to decompress remote payload: %s\n",
+             ZSTD_getErrorName(rc));
+        return -EBADMSG;
+    }
+
+    return rc == len ? 0 : -EBADMSG;
+}
+#else
+bool remote_have_zstd(void)
+{
+    return false;
+}
+
+size_t remote_pack_bound(size_t len)
+{
+    return len;
+}
+
+size_t remote_pack(void *dst __unused, size_t cap __unused,
+                   const void *src __unused, size_t len __unused)
+{
+    return 0;
+}
+
+int remote_unpack(void *dst __unused, size_t len __unused,
+                  const void *src __unused, size_t payload __unused)
+{
+    return -ENOTSUP;
+}
+#endif
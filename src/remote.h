@@ -0,0 +1,143 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _REMOTE_H
+#define _REMOTE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+/*
+ * The protocol between 'serve --listen' and the remote bridge. All fields
+ * are little-endian. Both ends open with a struct remote_hello. The client
+ * offers the REMOTE_F_* features it supports and the server answers with the
+ * ones in use, along with its bridge's name and characteristics.
+ *
+ * The client then sends requests, each a struct remote_req followed by
+ * @payload bytes. It needn't wait for one response before the next request.
+ * The server executes the requests in order and answers each one with a
+ * struct remote_rsp carrying the request's @tag, followed by @payload bytes.
+ *
+ *   readl:  @phys, answered with the word in @value
+ *   writel: @phys and @value
+ *   read:   @len bytes from @phys, answered with the data
+ *   write:  @len bytes to @phys, the data following
+ *   readv:  @count regions, described by struct remote_iov in the payload,
+ *           totalling @len bytes, answered with their data back to back
+ *   writev: as readv, with the regions' data following the descriptors
+ *   poll:   @phys until the condition in the struct remote_poll payload
+ *           holds, answered with the last word read in @value, with
+ *           REMOTE_F_POLL
+ *   modifyl: @phys with the bits in the struct remote_modify payload cleared
+ *           then set, with REMOTE_F_MODIFY
+ *
+ * @rc is the bridge operation's result, a byte count or a negative errno.
+ * With REMOTE_M_ZSTD in @flags the payload is a single zstd frame of what
+ * would otherwise be sent, which the receiver sizes from the header.
+ */
+#define REMOTE_MAGIC            "CVREMOTE"
+#define REMOTE_VERSION          1
+
+#define REMOTE_F_ZSTD           (1 << 0)
+#define REMOTE_F_POLL           (1 << 1)
+#define REMOTE_F_MODIFY         (1 << 2)
+
+#define REMOTE_M_ZSTD           (1 << 0)
+
+/* Upper bounds on a single request */
+#define REMOTE_MAX_LEN          (16 << 20)
+#define REMOTE_MAX_IOV          4096
+
+enum remote_op {
+    remote_op_readl = 1,
+    remote_op_writel,
+    remote_op_read,
+    remote_op_write,
+    remote_op_readv,
+    remote_op_writev,
+    remote_op_poll,
+    remote_op_modifyl,
+};
+
+struct remote_hello {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    /* Filled in by the server */
+    char bridge[16];
+    uint32_t window;
+    uint32_t burst;
+    uint32_t subword;
+} __attribute__((packed));
+
+struct remote_req {
+    uint32_t tag;
+    uint8_t op;
+    uint8_t flags;
+    uint16_t count;
+    uint32_t phys;
+    uint32_t len;
+    uint32_t value;
+    uint32_t payload;
+} __attribute__((packed));
+
+struct remote_rsp {
+    uint32_t tag;
+    uint8_t flags;
+    uint8_t reserved[3];
+    int32_t rc;
+    uint32_t value;
+    uint32_t payload;
+} __attribute__((packed));
+
+struct remote_iov {
+    uint32_t phys;
+    uint32_t len;
+} __attribute__((packed));
+
+/* The arguments to ahb_poll(), run by the server */
+struct remote_poll {
+    uint32_t mask;
+    uint32_t value;
+    uint64_t timeout_us;
+    uint32_t holdoff_us;
+    uint32_t interval_us;
+    uint32_t max_us;
+} __attribute__((packed));
+
+/* The arguments to ahb_modifyl(), run by the server */
+struct remote_modify {
+    uint32_t clear;
+    uint32_t set;
+} __attribute__((packed));
+
+int remote_send(int fd, const void *buf, size_t len);
+/* Sends a header and its payload together */
+int remote_send_msg(int fd, const void *hdr, size_t hdr_len, const void *buf,
+                    size_t len);
+/* Returns -ECONNRESET if the peer closes the connection */
+int remote_recv(int fd, void *buf, size_t len);
+
+/*
+ * Connects to, or listens on, "[HOST:]PORT". Without a host the server only
+ * listens on the loopback interface.
+ */
+int remote_connect(const char *spec);
+int remote_listen(const char *spec);
+int remote_accept(int fd);
+
+bool remote_have_zstd(void);
+
+/*
+ * Compresses @len bytes of @src into @dst if that makes them smaller,
+ * returning the compressed length, or 0 to send them as they are.
+ */
+size_t remote_pack(void *dst, size_t cap, const void *src, size_t len);
+/* Expands a payload that must come to exactly @len bytes */
+int remote_unpack(void *dst, size_t len, const void *src, size_t payload);
+
+/* Bounds the buffer remote_pack() needs for @len bytes */
+size_t remote_pack_bound(size_t len);
+
+#endif
@@ -2,6 +2,7 @@
 // Copyright (C) 2018,2019 IBM Corp.
 
 #include "array.h"
+#include "cache.h"
 #include "log.h"
 #include "rev.h"
 
@@ -9,6 +10,7 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 struct bmc_silicon_rev {
     uint32_t rev;
@@ -27,13 +29,40 @@ static const struct bmc_silicon_rev ast_silicon_revs[] = {
     { 0x05030303, "AST2600 A3" },
 };
 
+/*
+ * A revision cached by an earlier run is confirmed with a single read of the
+ * register it was found in, rather than by fingerprinting the SCU layout.
+ */
+static bool rev_probe_hint(struct ahb *ahb, uint32_t hint)
+{
+    uint32_t reg, val;
+
+    if (!rev_is_supported(hint))
+        return false;
+
+    reg = rev_generation(hint) == ast_g6 ? 0x1e6e2014 : 0x1e6e207c;
+    if (ahb_readl(ahb, reg, &val) < 0)
+        return false;
+
+    return val == hint;
+}
+
 int64_t rev_probe(struct ahb *ahb)
 {
     uint32_t probe[2], rev;
+    const char *hint;
     bool is_g6;
     int rc;
     size_t i;
 
+    if ((hint = cache_get("rev"))) {
+        rev = strtoul(hint, NULL, 16);
+        if (rev_probe_hint(ahb, rev)) {
+            logd("Confirmed cached revision 0x%x\n", rev);
+            return rev;
+        }
+    }
+
     logd("Probing for SoC revision registers\n");
 
     /*
@@ -0,0 +1,146 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bufpool.h"
+#include "ring.h"
+#include "span.h"
+
+#include <assert.h>
+#include <errno.h>
+
+int ring_init(struct ring *ctx, size_t size)
+{
+    int i;
+
+    for (i = 0; i < RING_DEPTH; i++) {
+        ctx->slots[i].buf = bufpool_get(size);
+        if (!ctx->slots[i].buf)
+            goto cleanup_slots;
+
+        ctx->slots[i].len = 0;
+    }
+
+    pthread_mutex_init(&ctx->lock, NULL);
+    pthread_cond_init(&ctx->cond, NULL);
+
+    ctx->size = size;
+    ctx->head = 0;
+    ctx->tail = 0;
+    ctx->filled = 0;
+    ctx->finished = false;
+    ctx->rc = 0;
+
+    return 0;
+
+cleanup_slots:
+    while (i--)
+        bufpool_put(ctx->slots[i].buf, size);
+
+    return -ENOMEM;
+}
+
+void ring_destroy(struct ring *ctx)
+{
+    int i;
+
+    pthread_cond_destroy(&ctx->cond);
+    pthread_mutex_destroy(&ctx->lock);
+
+    for (i = 0; i < RING_DEPTH; i++)
+        bufpool_put(ctx->slots[i].buf, ctx->size);
+}
+
+struct ring_slot *ring_get_empty(struct ring *ctx)
+{
+    struct ring_slot *slot = NULL;
+    uint64_t span = span_begin();
+    bool waited = false;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->rc && ctx->filled == RING_DEPTH) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+        waited = true;
+    }
+
+    if (!ctx->rc)
+        slot = &ctx->slots[ctx->head];
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* The producer stalled on the consumer */
+    if (waited)
+        span_end("ring", "wait_empty", span, 0, 0);
+
+    return slot;
+}
+
+void ring_put_full(struct ring *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    assert(ctx->filled < RING_DEPTH);
+    ctx->head = (ctx->head + 1) % RING_DEPTH;
+    ctx->filled++;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void ring_finish(struct ring *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    ctx->finished = true;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+struct ring_slot *ring_get_full(struct ring *ctx)
+{
+    struct ring_slot *slot = NULL;
+    uint64_t span = span_begin();
+    bool waited = false;
+
+    pthread_mutex_lock(&ctx->lock);
+    while (!ctx->rc && !ctx->filled && !ctx->finished) {
+        pthread_cond_wait(&ctx->cond, &ctx->lock);
+        waited = true;
+    }
+
+    if (!ctx->rc && ctx->filled)
+        slot = &ctx->slots[ctx->tail];
+    pthread_mutex_unlock(&ctx->lock);
+
+    /* The consumer stalled on the producer */
+    if (waited)
+        span_end("ring", "wait_full", span, 0, 0);
+
+    return slot;
+}
+
+void ring_put_empty(struct ring *ctx)
+{
+    pthread_mutex_lock(&ctx->lock);
+    assert(ctx->filled);
+    ctx->tail = (ctx->tail + 1) % RING_DEPTH;
+    ctx->filled--;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+void ring_abort(struct ring *ctx, int rc)
+{
+    assert(rc < 0);
+
+    pthread_mutex_lock(&ctx->lock);
+    if (!ctx->rc)
+        ctx->rc = rc;
+    pthread_cond_broadcast(&ctx->cond);
+    pthread_mutex_unlock(&ctx->lock);
+}
+
+int ring_status(struct ring *ctx)
+{
+    int rc;
+
+    pthread_mutex_lock(&ctx->lock);
+    rc = ctx->rc;
+    pthread_mutex_unlock(&ctx->lock);
+
+    return rc;
+}
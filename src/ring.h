@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#define RING_DEPTH 4
+
+struct ring_slot {
+    void *buf;
+    ssize_t len;
+};
+
+/*
+ * A fixed ring of equally sized buffers handed between a single producer and
+ * a single consumer thread. Either side may abort the transfer, after which
+ * both sides see NULL from the ring.
+ */
+struct ring {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct ring_slot slots[RING_DEPTH];
+    size_t size;
+    unsigned int head;
+    unsigned int tail;
+    unsigned int filled;
+    bool finished;
+    int rc;
+};
+
+int ring_init(struct ring *ctx, size_t size);
+void ring_destroy(struct ring *ctx);
+
+/* Producer side */
+struct ring_slot *ring_get_empty(struct ring *ctx);
+void ring_put_full(struct ring *ctx);
+void ring_finish(struct ring *ctx);
+
+/* Consumer side */
+struct ring_slot *ring_get_full(struct ring *ctx);
+void ring_put_empty(struct ring *ctx);
+
+/* Either side, the first error wins */
+void ring_abort(struct ring *ctx, int rc);
+int ring_status(struct ring *ctx);
+
+#endif
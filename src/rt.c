@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "rt.h"
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+
+/* Above the kernel's threaded interrupts' default of 50 would starve them */
+#define RT_DEFAULT_PRIO 10
+
+static struct {
+    int policy;
+    int prio;
+    int cpu;
+    long slack;
+} rt_config = { .policy = SCHED_OTHER, .cpu = -1, .slack = -1 };
+
+static int rt_parse_long(const char *arg, long min, long max, long *val)
+{
+    char *endp;
+
+    errno = 0;
+    *val = strtol(arg, &endp, 0);
+    if (errno || endp == arg || *endp || *val < min || *val > max)
+        return -EINVAL;
+
+    return 0;
+}
+
+static int rt_parse_policy(const char *arg, const char *name, int policy)
+{
+    size_t len = strlen(name);
+    long prio = RT_DEFAULT_PRIO;
+
+    if (strncmp(arg, name, len) || (arg[len] && arg[len] != ':'))
+        return -ENOENT;
+
+    if (arg[len] == ':' &&
+        rt_parse_long(&arg[len + 1], sched_get_priority_min(policy),
+                      sched_get_priority_max(policy), &prio) < 0)
+        return -EINVAL;
+
+    rt_config.policy = policy;
+    rt_config.prio = prio;
+
+    return 0;
+}
+
+int rt_parse(const char *spec)
+{
+    char *copy, *tok, *save;
+    long val;
+    int rc = 0;
+
+    if (!(copy = strdup(spec)))
+        return -ENOMEM;
+
+    for (tok = strtok_r(copy, ",", &save); tok && !rc;
+         tok = strtok_r(NULL, ",", &save)) {
+        if (!strncmp(tok, "cpu=", 4)) {
+            if (!(rc = rt_parse_long(tok + 4, 0, CPU_SETSIZE - 1, &val)))
+                rt_config.cpu = val;
+        } else if (!strncmp(tok, "slack=", 6)) {
+            if (!(rc = rt_parse_long(tok + 6, 1, INT_MAX, &val)))
+                rt_config.slack = val;
+        } else if ((rc = rt_parse_policy(tok, "fifo", SCHED_FIFO)) == -ENOENT) {
+            if ((rc = rt_parse_policy(tok, "rr", SCHED_RR)) == -ENOENT)
+                rc = -EINVAL;
+        }
+    }
+
+    free(copy);
+
+    return rc;
+}
+
+void rt_enter(struct rt_state *state, const char *what)
+{
+    pthread_t self = pthread_self();
+    struct sched_param param;
+    cpu_set_t cpus;
+    int rc;
+
+    memset(state, 0, sizeof(*state));
+
+    if (rt_config.cpu >= 0) {
+        CPU_ZERO(&cpus);
+        CPU_SET(rt_config.cpu, &cpus);
+
+        if ((rc = pthread_getaffinity_np(self, sizeof(state->cpus),
+                                         &state->cpus)) ||
+            (rc = pthread_setaffinity_np(self, sizeof(cpus), &cpus)))
+            logi("Failed to pin the %s loop to CPU %d: %d\n", what,
+                 rt_config.cpu, -rc);
+        else
+            state->pinned = true;
+    }
+
+    if (rt_config.policy != SCHED_OTHER) {
+        param.sched_priority = rt_config.prio;
+
+        if ((rc = pthread_getschedparam(self, &state->policy, &state->param)) ||
+            (rc = pthread_setschedparam(self, rt_config.policy, &param)))
+            logi("Running the %s loop without real-time priority: %d\n", what,
+                 -rc);
+        else
+            state->scheduled = true;
+    }
+
+    /* Timer slack is the thread's own to set, privileged or not */
+    if (rt_config.slack > 0) {
+        state->slack = prctl(PR_GET_TIMERSLACK, 0, 0, 0, 0);
+
+        if (state->slack < 0 ||
+            prctl(PR_SET_TIMERSLACK, rt_config.slack, 0, 0, 0) < 0)
+            logi("Failed to set the %s loop's timer slack: %d\n", what, -errno);
+        else
+            state->slackened = true;
+    }
+}
+
+void rt_leave(struct rt_state *state)
+{
+    pthread_t self = pthread_self();
+
+    if (state->slackened)
+        prctl(PR_SET_TIMERSLACK, state->slack, 0, 0, 0);
+
+    if (state->scheduled)
+        pthread_setschedparam(self, state->policy, &state->param);
+
+    if (state->pinned)
+        pthread_setaffinity_np(self, sizeof(state->cpus), &state->cpus);
+}
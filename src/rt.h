@@ -0,0 +1,38 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _RT_H
+#define _RT_H
+
+/* Needs _GNU_SOURCE, for cpu_set_t */
+#include <sched.h>
+#include <stdbool.h>
+
+/*
+ * @spec is a comma-separated list of:
+ *
+ *   fifo[:PRIO], rr[:PRIO]   the real-time policy to poll under
+ *   cpu=N                    the CPU to pin polling loops to
+ *   slack=NS                 the timer slack for their sleeps
+ */
+int rt_parse(const char *spec);
+
+/* What rt_enter() changed, for rt_leave() to put back */
+struct rt_state {
+    bool pinned;
+    cpu_set_t cpus;
+    bool scheduled;
+    int policy;
+    struct sched_param param;
+    bool slackened;
+    int slack;
+};
+
+/*
+ * Applies the settings from rt_parse() to the calling thread, a loop that
+ * must keep to its polling interval. Whatever the thread isn't permitted to
+ * change is left as it was, with a note, so the loop runs regardless.
+ */
+void rt_enter(struct rt_state *state, const char *what);
+void rt_leave(struct rt_state *state);
+
+#endif
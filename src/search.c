@@ -0,0 +1,447 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+
+#include "ahb.h"
+#include "log.h"
+#include "ring.h"
+#include "search.h"
+#include "span.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Bounds the transition table, 1KiB per state */
+#define SEARCH_STATES_MAX       16384
+#define SEARCH_CHUNK            (8 << 20)
+
+void search_init(struct search *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+}
+
+void search_destroy(struct search *ctx)
+{
+    unsigned int i;
+
+    for (i = 0; i < ctx->npatterns; i++) {
+        if (ctx->patterns[i].kind == search_regex)
+            regfree(&ctx->patterns[i].re);
+        free(ctx->patterns[i].bytes);
+        free(ctx->patterns[i].desc);
+    }
+
+    free(ctx->patterns);
+    free(ctx->delta);
+    free(ctx->out);
+    free(ctx->dict);
+    free(ctx->tail);
+}
+
+static struct search_pattern *search_new_pattern(struct search *ctx)
+{
+    struct search_pattern *patterns;
+
+    patterns = realloc(ctx->patterns, (ctx->npatterns + 1) * sizeof(*patterns));
+    if (!patterns)
+        return NULL;
+
+    ctx->patterns = patterns;
+    memset(&patterns[ctx->npatterns], 0, sizeof(*patterns));
+
+    return &patterns[ctx->npatterns];
+}
+
+static int search_add_bytes(struct search *ctx, const void *bytes, size_t len,
+                            char *desc)
+{
+    struct search_pattern *pattern;
+
+    if (!len || !(pattern = search_new_pattern(ctx))) {
+        free(desc);
+        return len ? -ENOMEM : -EINVAL;
+    }
+
+    if (!(pattern->bytes = malloc(len))) {
+        free(desc);
+        return -ENOMEM;
+    }
+
+    memcpy(pattern->bytes, bytes, len);
+    pattern->kind = search_literal;
+    pattern->len = len;
+    pattern->desc = desc;
+    ctx->npatterns++;
+
+    return 0;
+}
+
+int search_add_literal(struct search *ctx, const void *bytes, size_t len)
+{
+    char *desc;
+
+    if (!(desc = strndup(bytes, len)))
+        return -ENOMEM;
+
+    return search_add_bytes(ctx, bytes, len, desc);
+}
+
+int search_add_hex(struct search *ctx, const char *hex)
+{
+    size_t len = 0, max = strlen(hex) / 2;
+    const char *spec = hex;
+    uint8_t *bytes;
+    char *desc;
+    int rc;
+
+    if (!strncmp(hex, "0x", 2))
+        hex += 2;
+
+    if (!(bytes = malloc(max ? max : 1)))
+        return -ENOMEM;
+
+    while (*hex) {
+        unsigned int val;
+
+        if (*hex == ' ' || *hex == ':') {
+            hex++;
+            continue;
+        }
+
+        if (!isxdigit((unsigned char)hex[0]) || !isxdigit((unsigned char)hex[1]) ||
+                sscanf(hex, "%2x", &val) != 1) {
+            rc = -EINVAL;
+            goto cleanup_bytes;
+        }
+
+        bytes[len++] = val;
+        hex += 2;
+    }
+
+    if (asprintf(&desc, "hex:%s", spec) < 0) {
+        rc = -ENOMEM;
+        goto cleanup_bytes;
+    }
+
+    rc = search_add_bytes(ctx, bytes, len, desc);
+
+cleanup_bytes:
+    free(bytes);
+
+    return rc;
+}
+
+int search_add_regex(struct search *ctx, const char *re)
+{
+    struct search_pattern *pattern;
+    char err[128];
+    int rc;
+
+    if (!(pattern = search_new_pattern(ctx)))
+        return -ENOMEM;
+
+    if ((rc = regcomp(&pattern->re, re, REG_EXTENDED))) {
+        regerror(rc, &pattern->re, err, sizeof(err));
+        loge("Invalid regex '%s': %s\n", re, err);
+        return -EINVAL;
+    }
+
+    if (asprintf(&pattern->desc, "regex:%s", re) < 0) {
+        regfree(&pattern->re);
+        return -ENOMEM;
+    }
+
+    pattern->kind = search_regex;
+    ctx->npatterns++;
+    ctx->nregex++;
+
+    return 0;
+}
+
+static int32_t search_new_state(struct search *ctx)
+{
+    if (ctx->nstates == SEARCH_STATES_MAX)
+        return -ENOSPC;
+
+    memset(ctx->delta[ctx->nstates], 0xff, sizeof(ctx->delta[0]));
+    ctx->out[ctx->nstates] = -1;
+    ctx->dict[ctx->nstates] = -1;
+
+    return ctx->nstates++;
+}
+
+/* Build the goto function as a trie, then complete it breadth-first */
+int search_compile(struct search *ctx)
+{
+    size_t states = 1;
+    int32_t *fail, *queue;
+    unsigned int head = 0, tail = 0;
+    unsigned int i;
+    int32_t s;
+    size_t k;
+    int c;
+
+    for (i = 0; i < ctx->npatterns; i++) {
+        if (ctx->patterns[i].kind == search_literal)
+            states += ctx->patterns[i].len;
+    }
+
+    if (states == 1)
+        return 0;
+
+    if (states > SEARCH_STATES_MAX) {
+        loge("Patterns are too long to search for together\n");
+        return -ENOSPC;
+    }
+
+    ctx->delta = malloc(states * sizeof(*ctx->delta));
+    ctx->out = malloc(states * sizeof(*ctx->out));
+    ctx->dict = malloc(states * sizeof(*ctx->dict));
+    fail = malloc(states * sizeof(*fail));
+    queue = malloc(states * sizeof(*queue));
+    if (!ctx->delta || !ctx->out || !ctx->dict || !fail || !queue) {
+        free(fail);
+        free(queue);
+        return -ENOMEM;
+    }
+
+    search_new_state(ctx);
+
+    for (i = 0; i < ctx->npatterns; i++) {
+        const struct search_pattern *pattern = &ctx->patterns[i];
+
+        if (pattern->kind != search_literal)
+            continue;
+
+        for (s = 0, k = 0; k < pattern->len; k++) {
+            if (ctx->delta[s][pattern->bytes[k]] < 0)
+                ctx->delta[s][pattern->bytes[k]] = search_new_state(ctx);
+            s = ctx->delta[s][pattern->bytes[k]];
+        }
+
+        /* The first of any duplicate patterns is the one reported */
+        if (ctx->out[s] < 0)
+            ctx->out[s] = i;
+    }
+
+    for (c = 0; c < 256; c++) {
+        if ((s = ctx->delta[0][c]) < 0) {
+            ctx->delta[0][c] = 0;
+        } else {
+            fail[s] = 0;
+            queue[tail++] = s;
+        }
+    }
+
+    while (head < tail) {
+        int32_t r = queue[head++];
+
+        for (c = 0; c < 256; c++) {
+            if ((s = ctx->delta[r][c]) < 0) {
+                ctx->delta[r][c] = ctx->delta[fail[r]][c];
+                continue;
+            }
+
+            fail[s] = ctx->delta[fail[r]][c];
+            ctx->dict[s] = ctx->out[fail[s]] >= 0 ? fail[s] : ctx->dict[fail[s]];
+            queue[tail++] = s;
+        }
+    }
+
+    free(queue);
+    free(fail);
+
+    return 0;
+}
+
+static int search_feed_literal(struct search *ctx, const uint8_t *buf,
+                               size_t len, search_match_fn fn, void *priv)
+{
+    int32_t state = ctx->state;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < len; i++) {
+        int32_t s;
+
+        state = ctx->delta[state][buf[i]];
+        if (ctx->out[state] < 0 && ctx->dict[state] < 0)
+            continue;
+
+        for (s = ctx->out[state] >= 0 ? state : ctx->dict[state]; s >= 0;
+             s = ctx->dict[s]) {
+            size_t match = ctx->patterns[ctx->out[s]].len;
+
+            rc = fn(priv, ctx->out[s], ctx->offset + i + 1 - match, match);
+            if (rc) {
+                ctx->state = state;
+                return rc;
+            }
+        }
+    }
+
+    ctx->state = state;
+
+    return 0;
+}
+
+/* Each regex is run over the kept tail of the last chunk and then @buf */
+static int search_feed_regex(struct search *ctx, const uint8_t *buf, size_t len,
+                             search_match_fn fn, void *priv)
+{
+    uint64_t base = ctx->offset - ctx->tail_len;
+    size_t wlen = ctx->tail_len + len;
+    unsigned int i;
+    char *window;
+    int rc = 0;
+
+    if (!(window = malloc(wlen)))
+        return -ENOMEM;
+
+    memcpy(window, ctx->tail, ctx->tail_len);
+    memcpy(window + ctx->tail_len, buf, len);
+
+    for (i = 0; i < ctx->npatterns && !rc; i++) {
+        struct search_pattern *pattern = &ctx->patterns[i];
+        regmatch_t match;
+        size_t pos;
+
+        if (pattern->kind != search_regex)
+            continue;
+
+        pos = pattern->reported > base ? pattern->reported - base : 0;
+        while (pos < wlen) {
+            size_t mlen;
+
+            match.rm_so = pos;
+            match.rm_eo = wlen;
+            if (regexec(&pattern->re, window, 1, &match,
+                        REG_STARTEND | (pos ? REG_NOTBOL : 0)))
+                break;
+
+            mlen = match.rm_eo - match.rm_so;
+            if ((rc = fn(priv, i, base + match.rm_so, mlen)))
+                break;
+
+            pos = match.rm_so + (mlen ? mlen : 1);
+            pattern->reported = base + pos;
+        }
+    }
+
+    /* Keep enough to find matches starting before the next chunk */
+    ctx->tail_len = wlen < SEARCH_REGEX_SPAN ? wlen : SEARCH_REGEX_SPAN;
+    if (!ctx->tail && !(ctx->tail = malloc(SEARCH_REGEX_SPAN))) {
+        free(window);
+        return -ENOMEM;
+    }
+    memcpy(ctx->tail, window + wlen - ctx->tail_len, ctx->tail_len);
+
+    free(window);
+
+    return rc;
+}
+
+int search_feed(struct search *ctx, const void *buf, size_t len,
+                search_match_fn fn, void *priv)
+{
+    int rc;
+
+    if (ctx->delta && (rc = search_feed_literal(ctx, buf, len, fn, priv)))
+        return rc;
+
+    if (ctx->nregex && (rc = search_feed_regex(ctx, buf, len, fn, priv)))
+        return rc;
+
+    ctx->offset += len;
+
+    return 0;
+}
+
+struct search_scan {
+    struct search *search;
+    struct ring ring;
+    search_match_fn fn;
+    void *priv;
+};
+
+static void *search_ahb_match(void *arg)
+{
+    struct search_scan *scan = arg;
+    struct ring_slot *slot;
+    int rc;
+
+    span_thread_name("search");
+
+    while ((slot = ring_get_full(&scan->ring))) {
+        rc = search_feed(scan->search, slot->buf, slot->len, scan->fn,
+                         scan->priv);
+        if (rc) {
+            /* Stopping early isn't a failure, tell the reader apart */
+            ring_abort(&scan->ring, rc < 0 ? rc : -ECANCELED);
+            return NULL;
+        }
+
+        ring_put_empty(&scan->ring);
+    }
+
+    return NULL;
+}
+
+int search_ahb(struct search *ctx, struct ahb *ahb, uint32_t phys, size_t len,
+               search_match_fn fn, void *priv)
+{
+    struct search_scan _scan, *scan = &_scan;
+    struct ring_slot *slot;
+    pthread_t worker;
+    size_t chunk_len;
+    ssize_t ingress;
+    int rc;
+
+    chunk_len = ahb_chunk_size(ahb, SEARCH_CHUNK);
+    if ((rc = ring_init(&scan->ring, chunk_len)) < 0)
+        return rc;
+
+    scan->search = ctx;
+    scan->fn = fn;
+    scan->priv = priv;
+
+    if ((rc = -pthread_create(&worker, NULL, search_ahb_match, scan)))
+        goto cleanup_ring;
+
+    while (len) {
+        if (!(slot = ring_get_empty(&scan->ring)))
+            break;
+
+        ingress = len > chunk_len ? chunk_len : len;
+
+        logd("Searching 0x%08" PRIx32 "-0x%08" PRIx32 "\n", phys,
+             (uint32_t)(phys + ingress - 1));
+        ingress = ahb_read(ahb, phys, slot->buf, ingress);
+        if (ingress <= 0) {
+            ring_abort(&scan->ring, ingress < 0 ? (int)ingress : -EIO);
+            break;
+        }
+
+        slot->len = ingress;
+        ring_put_full(&scan->ring);
+
+        phys += ingress;
+        len -= ingress;
+    }
+
+    ring_finish(&scan->ring);
+    pthread_join(worker, NULL);
+
+    rc = ring_status(&scan->ring);
+    if (rc == -ECANCELED)
+        rc = 0;
+
+cleanup_ring:
+    ring_destroy(&scan->ring);
+
+    return rc;
+}
@@ -0,0 +1,84 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SEARCH_H
+#define _SEARCH_H
+
+#include "ahb.h"
+
+#include <regex.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Regex matches longer than this may be missed where they span two chunks */
+#define SEARCH_REGEX_SPAN       256
+
+enum search_kind { search_literal, search_regex };
+
+struct search_pattern {
+    enum search_kind kind;
+    char *desc;
+    uint8_t *bytes;
+    size_t len;
+    regex_t re;
+    /* Stream offset below which regex matches have been reported */
+    uint64_t reported;
+};
+
+/*
+ * Finds any number of patterns in a stream of bytes fed in arbitrary chunks.
+ * Literal patterns are matched together by an Aho-Corasick automaton whose
+ * state carries from one chunk to the next, regexes are run over each chunk
+ * with the tail of the one before it.
+ */
+struct search {
+    struct search_pattern *patterns;
+    unsigned int npatterns;
+    unsigned int nregex;
+    /* The automaton, a full transition table with the matches at each state */
+    int32_t (*delta)[256];
+    int32_t *out;
+    int32_t *dict;
+    uint32_t nstates;
+    int32_t state;
+    /* Stream offset of the next byte fed */
+    uint64_t offset;
+    uint8_t *tail;
+    size_t tail_len;
+};
+
+/*
+ * Called for each match, with its offset in the stream. Return zero to carry
+ * on, positive to stop the search early, or a negative error.
+ */
+typedef int (*search_match_fn)(void *priv, unsigned int pattern, uint64_t offset,
+                               size_t len);
+
+void search_init(struct search *ctx);
+void search_destroy(struct search *ctx);
+
+int search_add_literal(struct search *ctx, const void *bytes, size_t len);
+/* @hex is pairs of hex digits, optionally separated by spaces or colons */
+int search_add_hex(struct search *ctx, const char *hex);
+int search_add_regex(struct search *ctx, const char *re);
+
+/* After the patterns are added and before the first search_feed() */
+int search_compile(struct search *ctx);
+
+int search_feed(struct search *ctx, const void *buf, size_t len,
+                search_match_fn fn, void *priv);
+
+static inline const char *search_describe(const struct search *ctx,
+                                          unsigned int pattern)
+{
+    return ctx->patterns[pattern].desc;
+}
+
+/*
+ * Search @len bytes of the bus from @phys. The bridge is read from the calling
+ * thread while a worker runs the matcher, @fn is called on the worker with
+ * offsets relative to @phys.
+ */
+int search_ahb(struct search *ctx, struct ahb *ahb, uint32_t phys, size_t len,
+               search_match_fn fn, void *priv);
+
+#endif
@@ -0,0 +1,14 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SHA256_H
+#define _SHA256_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA256_LEN 32
+
+/* FIPS 180-4 SHA-256 of @len bytes, to compare against the BMC's engine */
+void sha256(const void *buf, size_t len, uint8_t digest[SHA256_LEN]);
+
+#endif
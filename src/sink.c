@@ -0,0 +1,344 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bufpool.h"
+#include "log.h"
+#include "remote.h"
+#include "sink.h"
+#include "span.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/* A collector that's restarting gets a few seconds to come back */
+#define SINK_TCP_ATTEMPTS   5
+#define SINK_TCP_BACKOFF_MS 500
+
+static int sink_parse(struct sink *sink, const char *spec)
+{
+    sink->spec = spec;
+    sink->fd = -1;
+    sink->next = 0;
+    sink->written = 0;
+    sink->rc = 0;
+
+    if (!strcmp(spec, "-")) {
+        sink->type = sink_stdout;
+        sink->target = spec;
+    } else if (!strncmp(spec, "file:", 5)) {
+        sink->type = sink_file;
+        sink->target = spec + 5;
+    } else if (!strncmp(spec, "zstd:", 5)) {
+        sink->type = sink_zstd;
+        sink->target = spec + 5;
+    } else if (!strncmp(spec, "tcp:", 4)) {
+        sink->type = sink_tcp;
+        sink->target = spec + 4;
+    } else {
+        sink->type = sink_file;
+        sink->target = spec;
+    }
+
+    return *sink->target ? 0 : -EINVAL;
+}
+
+static int sink_tcp_connect(struct sink *sink)
+{
+    struct timespec backoff = {
+        .tv_sec = SINK_TCP_BACKOFF_MS / 1000,
+        .tv_nsec = (SINK_TCP_BACKOFF_MS % 1000) * 1000000L,
+    };
+    int attempt;
+    int fd = -ENOENT;
+
+    for (attempt = 0; attempt < SINK_TCP_ATTEMPTS; attempt++) {
+        if ((fd = remote_connect(sink->target)) >= 0)
+            return fd;
+
+        /* Resolution failures won't fix themselves */
+        if (fd == -ENOENT || fd == -EINVAL)
+            break;
+
+        logd("Failed to connect to sink %s: %d, retrying\n", sink->spec, fd);
+        nanosleep(&backoff, NULL);
+    }
+
+    return fd;
+}
+
+static int sink_open(struct sink *sink, int compress_level)
+{
+    int rc;
+
+    switch (sink->type) {
+        case sink_stdout:
+            sink->fd = STDOUT_FILENO;
+            return 0;
+        case sink_tcp:
+            rc = sink_tcp_connect(sink);
+            break;
+        case sink_zstd:
+        case sink_file:
+            rc = open(sink->target, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                      0644);
+            if (rc < 0)
+                rc = -errno;
+            break;
+        default:
+            return -EINVAL;
+    }
+
+    if (rc < 0)
+        return rc;
+
+    sink->fd = rc;
+
+    if (sink->type == sink_zstd &&
+        (rc = compress_init(&sink->compress, compress_level)) < 0) {
+        close(sink->fd);
+        sink->fd = -1;
+        return rc;
+    }
+
+    return 0;
+}
+
+static void sink_close(struct sink *sink)
+{
+    if (sink->type == sink_zstd)
+        compress_destroy(&sink->compress);
+
+    if (sink->fd >= 0 && sink->type != sink_stdout)
+        close(sink->fd);
+
+    sink->fd = -1;
+}
+
+static int sink_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t egress;
+
+    while (len) {
+        egress = write(fd, buf, len);
+        if (egress == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        buf += egress;
+        len -= egress;
+    }
+
+    return 0;
+}
+
+static int sink_write(struct sink *sink, const void *buf, size_t len)
+{
+    if (sink->type == sink_zstd)
+        return compress_write(&sink->compress, sink->fd, buf, len);
+
+    return sink_write_all(sink->fd, buf, len);
+}
+
+static void *sink_worker(void *arg)
+{
+    struct sink *sink = arg;
+    struct sink_set *set = sink->set;
+    struct sink_slot *slot;
+    uint64_t span;
+    int rc;
+
+    span_thread_name(sink->spec);
+
+    pthread_mutex_lock(&set->lock);
+    while (1) {
+        while (sink->next == set->head && !set->finished)
+            pthread_cond_wait(&set->cond, &set->lock);
+
+        if (sink->next == set->head)
+            break;
+
+        slot = &set->slots[sink->next % SINK_DEPTH];
+        pthread_mutex_unlock(&set->lock);
+
+        /* A failed sink keeps taking slots so it doesn't hold up the rest */
+        if (!sink->rc) {
+            span = span_begin();
+            if ((rc = sink_write(sink, slot->buf, slot->len)) < 0) {
+                loge("Output to %s failed: %d\n", sink->spec, rc);
+                sink->rc = rc;
+            } else {
+                sink->written += slot->len;
+            }
+            span_end("sink", "write", span, 0, slot->len);
+        }
+
+        pthread_mutex_lock(&set->lock);
+        slot->pending--;
+        sink->next++;
+        pthread_cond_broadcast(&set->cond);
+    }
+    pthread_mutex_unlock(&set->lock);
+
+    if (!sink->rc && sink->type == sink_zstd &&
+        (rc = compress_finish(&sink->compress, sink->fd)) < 0) {
+        loge("Output to %s failed: %d\n", sink->spec, rc);
+        sink->rc = rc;
+    }
+
+    return NULL;
+}
+
+static void sink_set_stop(struct sink_set *set, size_t started)
+{
+    size_t i;
+
+    pthread_mutex_lock(&set->lock);
+    set->finished = true;
+    pthread_cond_broadcast(&set->cond);
+    pthread_mutex_unlock(&set->lock);
+
+    for (i = 0; i < started; i++)
+        pthread_join(set->sinks[i].worker, NULL);
+}
+
+int sink_set_init(struct sink_set *set, const char *const *specs,
+                  size_t nr_specs, size_t size, int compress_level)
+{
+    size_t i, opened = 0, started = 0;
+    int rc;
+
+    if (!nr_specs)
+        return -EINVAL;
+
+    if (!(set->sinks = calloc(nr_specs, sizeof(*set->sinks))))
+        return -ENOMEM;
+
+    set->nr_sinks = nr_specs;
+    set->size = size;
+    set->head = 0;
+    set->finished = false;
+    pthread_mutex_init(&set->lock, NULL);
+    pthread_cond_init(&set->cond, NULL);
+
+    for (i = 0; i < SINK_DEPTH; i++) {
+        set->slots[i].pending = 0;
+        set->slots[i].len = 0;
+        if (!(set->slots[i].buf = bufpool_get(size))) {
+            rc = -ENOMEM;
+            goto cleanup_slots;
+        }
+    }
+
+    for (opened = 0; opened < nr_specs; opened++) {
+        struct sink *sink = &set->sinks[opened];
+
+        if ((rc = sink_parse(sink, specs[opened])) < 0) {
+            loge("Invalid output sink '%s'\n", specs[opened]);
+            goto cleanup_sinks;
+        }
+
+        if ((rc = sink_open(sink, compress_level)) < 0) {
+            loge("Failed to open output sink '%s': %d\n", sink->spec, rc);
+            goto cleanup_sinks;
+        }
+
+        sink->set = set;
+    }
+
+    for (started = 0; started < nr_specs; started++) {
+        struct sink *sink = &set->sinks[started];
+
+        if ((rc = -pthread_create(&sink->worker, NULL, sink_worker, sink)))
+            goto cleanup_workers;
+    }
+
+    return 0;
+
+cleanup_workers:
+    sink_set_stop(set, started);
+
+cleanup_sinks:
+    while (opened--)
+        sink_close(&set->sinks[opened]);
+
+cleanup_slots:
+    while (i--)
+        bufpool_put(set->slots[i].buf, size);
+
+    pthread_cond_destroy(&set->cond);
+    pthread_mutex_destroy(&set->lock);
+    free(set->sinks);
+
+    return rc;
+}
+
+struct sink_slot *sink_set_get(struct sink_set *set)
+{
+    struct sink_slot *slot = &set->slots[set->head % SINK_DEPTH];
+    uint64_t span = span_begin();
+    bool waited = false;
+
+    pthread_mutex_lock(&set->lock);
+    while (slot->pending) {
+        pthread_cond_wait(&set->cond, &set->lock);
+        waited = true;
+    }
+    pthread_mutex_unlock(&set->lock);
+
+    if (waited)
+        span_end("sink", "wait", span, 0, 0);
+
+    return slot;
+}
+
+void sink_set_put(struct sink_set *set, size_t len)
+{
+    struct sink_slot *slot = &set->slots[set->head % SINK_DEPTH];
+
+    pthread_mutex_lock(&set->lock);
+    slot->len = len;
+    slot->pending = set->nr_sinks;
+    set->head++;
+    pthread_cond_broadcast(&set->cond);
+    pthread_mutex_unlock(&set->lock);
+}
+
+int sink_set_finish(struct sink_set *set)
+{
+    int rc = 0;
+    size_t i;
+
+    sink_set_stop(set, set->nr_sinks);
+
+    for (i = 0; i < set->nr_sinks; i++) {
+        struct sink *sink = &set->sinks[i];
+
+        if (sink->rc < 0 && !rc)
+            rc = sink->rc;
+
+        logd("Wrote %" PRIu64 " bytes to %s\n", sink->written, sink->spec);
+    }
+
+    return rc;
+}
+
+void sink_set_destroy(struct sink_set *set)
+{
+    size_t i;
+
+    for (i = 0; i < set->nr_sinks; i++)
+        sink_close(&set->sinks[i]);
+
+    for (i = 0; i < SINK_DEPTH; i++)
+        bufpool_put(set->slots[i].buf, set->size);
+
+    pthread_cond_destroy(&set->cond);
+    pthread_mutex_destroy(&set->lock);
+    free(set->sinks);
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SINK_H
+#define _SINK_H
+
+#include "compress.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define SINK_DEPTH  8
+
+/*
+ * Where a sink writes to, from its spec:
+ *
+ *   -                  stdout
+ *   PATH, file:PATH    a file, created or truncated
+ *   zstd:PATH          a file, as a zstd stream
+ *   tcp:HOST:PORT      a TCP connection
+ */
+enum sink_type { sink_stdout, sink_file, sink_zstd, sink_tcp };
+
+struct sink {
+    const char *spec;
+    enum sink_type type;
+    const char *target;
+    int fd;
+    struct compress compress;
+    /* The next slot this sink will take, a sequence number */
+    uint64_t next;
+    uint64_t written;
+    pthread_t worker;
+    struct sink_set *set;
+    int rc;
+};
+
+struct sink_slot {
+    void *buf;
+    size_t len;
+    /* The sinks yet to finish with the slot */
+    unsigned int pending;
+};
+
+/*
+ * Fans one stream out to several sinks without copying it: each slot is
+ * filled once and each sink's worker writes it out in its own time. A slow
+ * sink only holds up the producer once it's SINK_DEPTH slots behind, and a
+ * failed sink drops out, reporting its error at the end, without stopping
+ * the others.
+ */
+struct sink_set {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    struct sink_slot slots[SINK_DEPTH];
+    size_t size;
+    uint64_t head;
+    bool finished;
+    struct sink *sinks;
+    size_t nr_sinks;
+};
+
+/* @size is the size of each slot */
+int sink_set_init(struct sink_set *set, const char *const *specs,
+                  size_t nr_specs, size_t size, int compress_level);
+
+/* Returns the next slot to fill, waiting on the slowest sink */
+struct sink_slot *sink_set_get(struct sink_set *set);
+void sink_set_put(struct sink_set *set, size_t len);
+
+/* Waits for every sink to drain, returns the first error of any sink */
+int sink_set_finish(struct sink_set *set);
+void sink_set_destroy(struct sink_set *set);
+
+#endif
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2018,2019 IBM Corp.
 
+#include "array.h"
 #include "log.h"
 #include "sio.h"
 
@@ -11,12 +12,21 @@
 #define SIO_ADDR(ctx) ((ctx)->base)
 #define SIO_DATA(ctx) ((ctx)->base + 1)
 
+#define SIO_BATCH_MAX 16
+
 int sio_init(struct sio *ctx)
 {
     ctx->base = 0x2e;
+    ctx->fixed = false;
     return lpc_init(&ctx->io, "io");
 }
 
+void sio_set_base(struct sio *ctx, uint16_t base)
+{
+    ctx->base = base;
+    ctx->fixed = true;
+}
+
 int sio_destroy(struct sio *ctx)
 {
     return lpc_destroy(&ctx->io);
@@ -29,12 +39,12 @@ int sio_lock(struct sio *ctx)
 
 int sio_unlock(struct sio *ctx)
 {
-    int rc;
-
-    rc  = lpc_writeb(&ctx->io, SIO_ADDR(ctx), 0xa5);
-    rc |= lpc_writeb(&ctx->io, SIO_ADDR(ctx), 0xa5);
+    const struct lpc_rw rw[] = {
+        { .addr = SIO_ADDR(ctx), .write = true, .data = 0xa5 },
+        { .addr = SIO_ADDR(ctx), .write = true, .data = 0xa5 },
+    };
 
-    return rc;
+    return lpc_rw_batch(&ctx->io, rw, ARRAY_SIZE(rw));
 }
 
 int sio_select(struct sio *ctx, enum sio_dev dev)
@@ -88,15 +98,30 @@ out:
     return rc;
 }
 
+static bool sio_find(struct sio *ctx)
+{
+    if (ctx->fixed)
+        return sio_present(ctx) > 0;
+
+    ctx->base = 0x2e;
+    if (sio_present(ctx) > 0)
+        return true;
+
+    ctx->base = 0x4e;
+    return sio_present(ctx) > 0;
+}
+
 int sio_probe(struct sio *ctx)
 {
     bool found;
 
-    ctx->base = 0x2e;
-    found = sio_present(ctx);
-    if (!found) {
-        ctx->base = 0x4e;
-        found = sio_present(ctx);
+    found = sio_find(ctx);
+
+    /* The readbacks in sio_present() double as a check of the settle policy */
+    if (!found && lpc_get_settle() != lpc_settle_port80) {
+        logi("SuperIO not found, retrying with port 0x80 I/O settling\n");
+        lpc_set_settle(lpc_settle_port80);
+        found = sio_find(ctx);
     }
 
     if (found) {
@@ -110,22 +135,50 @@ int sio_probe(struct sio *ctx)
 
 int sio_readb(struct sio *ctx, uint32_t addr, uint8_t *val)
 {
-    int rc;
-
-    rc = lpc_writeb(&ctx->io, SIO_ADDR(ctx), addr);
-    if (rc)
-        return rc;
+    const struct lpc_rw rw[] = {
+        { .addr = SIO_ADDR(ctx), .write = true, .data = addr },
+        { .addr = SIO_DATA(ctx), .val = val },
+    };
 
-    return lpc_readb(&ctx->io, SIO_DATA(ctx), val);
+    return lpc_rw_batch(&ctx->io, rw, ARRAY_SIZE(rw));
 }
 
 int sio_writeb(struct sio *ctx, uint32_t addr, uint8_t val)
 {
+    const struct lpc_rw rw[] = {
+        { .addr = SIO_ADDR(ctx), .write = true, .data = addr },
+        { .addr = SIO_DATA(ctx), .write = true, .data = val },
+    };
+
+    return lpc_rw_batch(&ctx->io, rw, ARRAY_SIZE(rw));
+}
+
+/* Each register access is an index write followed by the data access */
+int sio_rw_batch(struct sio *ctx, const struct sio_rw *rw, size_t count)
+{
+    struct lpc_rw batch[2 * SIO_BATCH_MAX];
+    size_t i, n;
     int rc;
 
-    rc = lpc_writeb(&ctx->io, SIO_ADDR(ctx), addr);
-    if (rc)
-        return rc;
+    while (count) {
+        n = count > SIO_BATCH_MAX ? SIO_BATCH_MAX : count;
+
+        for (i = 0; i < n; i++) {
+            batch[2 * i] = (struct lpc_rw){
+                .addr = SIO_ADDR(ctx), .write = true, .data = rw[i].reg,
+            };
+            batch[2 * i + 1] = (struct lpc_rw){
+                .addr = SIO_DATA(ctx), .write = rw[i].write,
+                .data = rw[i].data, .val = rw[i].val,
+            };
+        }
+
+        if ((rc = lpc_rw_batch(&ctx->io, batch, 2 * n)))
+            return rc;
+
+        rw += n;
+        count -= n;
+    }
 
-    return lpc_writeb(&ctx->io, SIO_DATA(ctx), val);
+    return 0;
 }
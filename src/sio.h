@@ -4,6 +4,7 @@
 #ifndef SIO_H
 #define SIO_H
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -25,9 +26,22 @@ struct sio
 {
     struct lpc io;
     uint16_t base;
+    /* Only look for the SuperIO at @base, see sio_set_base() */
+    bool fixed;
+};
+
+/* A register access for sio_rw_batch(), writes take @data and reads fill @val */
+struct sio_rw
+{
+    uint8_t reg;
+    bool write;
+    uint8_t data;
+    uint8_t *val;
 };
 
 int sio_init(struct sio *ctx);
+/* For hosts with more than one BMC, each decoding its SuperIO elsewhere */
+void sio_set_base(struct sio *ctx, uint16_t base);
 int sio_destroy(struct sio *ctx);
 int sio_lock(struct sio *ctx);
 int sio_unlock(struct sio *ctx);
@@ -35,5 +49,6 @@ int sio_select(struct sio *ctx, enum sio_dev dev);
 int sio_probe(struct sio *ctx);
 int sio_readb(struct sio *ctx, uint32_t addr, uint8_t *val);
 int sio_writeb(struct sio *ctx, uint32_t addr, uint8_t val);
+int sio_rw_batch(struct sio *ctx, const struct sio_rw *rw, size_t count);
 
 #endif
@@ -4,12 +4,16 @@
 #include "devicetree/g4.h"
 #include "devicetree/g5.h"
 #include "devicetree/g6.h"
+#include "devicetree/table.h"
 
 #include "ast.h"
+#include "cache.h"
 #include "compiler.h"
 #include "log.h"
 #include "soc.h"
+#include "soc/sdmc.h"
 #include "rev.h"
+#include "timing.h"
 
 #include "ccan/autodata/autodata.h"
 
@@ -19,44 +23,212 @@
 #include <errno.h>
 #include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 static const struct soc_fdt soc_fdts[] = {
 	[ast_g4] = {
 		.start = &_binary_src_devicetree_g4_dtb_start,
 		.end = &_binary_src_devicetree_g4_dtb_end,
+		.table = &soc_dt_g4,
 	},
 	[ast_g5] = {
 		.start = &_binary_src_devicetree_g5_dtb_start,
 		.end = &_binary_src_devicetree_g5_dtb_end,
+		.table = &soc_dt_g5,
 	},
 	[ast_g6] = {
 		.start = &_binary_src_devicetree_g6_dtb_start,
 		.end = &_binary_src_devicetree_g6_dtb_end,
+		.table = &soc_dt_g6,
 	},
 	{ }
 };
 
-/* XXX: Use a linker script? I've run out of meson though */
-static int soc_align_fdt(struct soc *ctx, const struct soc_fdt *fdt)
+/*
+ * With retention enabled the revision and shadowed registers outlive
+ * soc_destroy(), so the next soc_probe() on the same bridge skips reading them.
+ * The shadows are dropped if anything but the soc's own accessors wrote the
+ * SCU or SDMC in the meantime, as with soc_write(), and on reset.
+ */
+static bool soc_retain;
+static struct {
+	struct ahb *ahb;
+	uint32_t rev;
+	unsigned long reg_writes;
+	struct soc_shadow shadow[SOC_SHADOW_MAX];
+	unsigned int nr_shadow;
+	/* Emptied, so the next probe binds without going back to malloc() */
+	struct arena arena;
+} soc_retained;
+
+#define SOC_INDEX_MAX_DEPTH 32
+
+/* The blobs are aligned and read-only in the binary, so are used in place */
+static void soc_select_fdt(struct soc *ctx, const struct soc_fdt *fdt)
 {
-	size_t len = fdt->end - fdt->start;
+	ctx->fdt = *fdt;
 
-	ctx->fdt.start = malloc(len);
-	if (!ctx->fdt.start)
-		return -ENOMEM;
+	logd("Selected devicetree for SoC '%s'\n",
+	     fdt_getprop(ctx->fdt.start, 0, "compatible", NULL));
+}
 
-	ctx->fdt.end = ctx->fdt.start + len;
+static void soc_index_destroy(struct soc *ctx)
+{
+	free(ctx->by_offset);
+	strmap_destroy(&ctx->by_driver);
+	strmap_destroy(&ctx->by_type);
+	strmap_destroy(&ctx->by_path);
+	strmap_destroy(&ctx->by_compatible);
+}
 
-	memcpy(ctx->fdt.start, fdt->start, len);
+static int soc_index_node(struct soc *ctx, int node, int depth, const char *path,
+			  const char *compat, int len, const char *type)
+{
+	const char *end;
+	int rc;
 
-	logd("Selected devicetree for SoC '%s'\n",
-	     fdt_getprop(ctx->fdt.start, 0, "compatible", NULL));
+	if ((rc = strmap_add(&ctx->by_path, path, node)) < 0)
+		return rc;
+
+	/* Like fdt_node_offset_by_compatible(), the first node in the blob wins */
+	if (compat) {
+		for (end = compat + len; compat < end; compat += strlen(compat) + 1) {
+			rc = strmap_add(&ctx->by_compatible, compat, node);
+			if (rc < 0 && rc != -EEXIST)
+				return rc;
+		}
+	}
+
+	/* Only the root's children are searched by type */
+	if (depth == 1 && type) {
+		rc = strmap_add(&ctx->by_type, type, node);
+		if (rc < 0 && rc != -EEXIST)
+			return rc;
+	}
+
+	return 0;
+}
+
+/* The build compiled the blob into a table, so there's nothing to parse */
+static int soc_index_table(struct soc *ctx)
+{
+	const struct soc_dt *dt = ctx->fdt.table;
+	const struct soc_dt_node *n;
+	int rc;
+
+	for (n = dt->nodes; n < &dt->nodes[dt->nr_nodes]; n++) {
+		rc = soc_index_node(ctx, n->offset, n->depth, n->path,
+				    n->compatible, n->compatible_len,
+				    n->device_type);
+		if (rc < 0)
+			return rc;
+	}
+
+	return 0;
+}
+
+static int soc_index_blob(struct soc *ctx)
+{
+	size_t ends[SOC_INDEX_MAX_DEPTH];
+	char path[PATH_MAX];
+	const char *compat;
+	int depth = 0;
+	int node;
+	int rc;
+
+	for (node = 0; node >= 0 && depth >= 0;
+	     node = fdt_next_node(ctx->fdt.start, node, &depth)) {
+		const char *name;
+		size_t pos;
+		int len;
+
+		if (depth >= SOC_INDEX_MAX_DEPTH)
+			return -EUCLEAN;
+
+		if (!depth) {
+			ends[0] = 0;
+			strcpy(path, "/");
+		} else {
+			if (!(name = fdt_get_name(ctx->fdt.start, node, &len)))
+				return -EUCLEAN;
+
+			pos = ends[depth - 1];
+			if (pos + len + 2 > sizeof(path))
+				return -ENAMETOOLONG;
+
+			path[pos] = '/';
+			memcpy(&path[pos + 1], name, len);
+			ends[depth] = pos + 1 + len;
+			path[ends[depth]] = '\0';
+		}
+
+		compat = fdt_getprop(ctx->fdt.start, node, "compatible", &len);
+		rc = soc_index_node(ctx, node, depth, path, compat, len,
+				    fdt_getprop(ctx->fdt.start, node, "device_type", NULL));
+		if (rc < 0)
+			return rc;
+	}
+
+	if (node < 0 && node != -FDT_ERR_NOTFOUND)
+		return -EUCLEAN;
 
 	return 0;
 }
 
+/* Walk the devicetree once so lookups by compatible, path or type are O(1) */
+static int soc_index_fdt(struct soc *ctx)
+{
+	int rc;
+
+	if ((rc = strmap_init(&ctx->by_compatible)) < 0)
+		return rc;
+
+	if ((rc = strmap_init(&ctx->by_path)) < 0)
+		goto cleanup_compatible;
+
+	if ((rc = strmap_init(&ctx->by_type)) < 0)
+		goto cleanup_path;
+
+	if ((rc = strmap_init(&ctx->by_driver)) < 0)
+		goto cleanup_type;
+
+	/* Node offsets are tag-aligned, so a dense table stays small */
+	ctx->nr_offsets = (ctx->fdt.end - ctx->fdt.start) / FDT_TAGSIZE;
+	ctx->by_offset = calloc(ctx->nr_offsets, sizeof(*ctx->by_offset));
+	if (!ctx->by_offset) {
+		rc = -ENOMEM;
+		goto cleanup_driver;
+	}
+
+	rc = ctx->fdt.table ? soc_index_table(ctx) : soc_index_blob(ctx);
+	if (rc < 0)
+		goto cleanup_index;
+
+	return 0;
+
+cleanup_index:
+	free(ctx->by_offset);
+
+cleanup_driver:
+	strmap_destroy(&ctx->by_driver);
+
+cleanup_type:
+	strmap_destroy(&ctx->by_type);
+
+cleanup_path:
+	strmap_destroy(&ctx->by_path);
+
+cleanup_compatible:
+	strmap_destroy(&ctx->by_compatible);
+
+	return rc;
+}
+
 int soc_from_rev(struct soc *ctx, struct ahb *ahb, uint32_t rev)
 {
+	int rc;
+
 	/* TODO: Map rev to the SoC compatible and find compatible devicetree */
 	if (!(rev_is_generation(rev, ast_g4) ||
 	      rev_is_generation(rev, ast_g5) ||
@@ -67,84 +239,136 @@ int soc_from_rev(struct soc *ctx, struct ahb *ahb, uint32_t rev)
 
 	ctx->rev = rev;
 	ctx->ahb = ahb;
+	ctx->nr_shadow = 0;
+	ctx->snapshot = NULL;
+	arena_init(&ctx->arena);
 	list_head_init(&ctx->devices);
 	list_head_init(&ctx->bridges);
-	return soc_align_fdt(ctx, &soc_fdts[rev_generation(rev)]);
+
+	soc_select_fdt(ctx, &soc_fdts[rev_generation(rev)]);
+
+	if ((rc = soc_index_fdt(ctx)) < 0)
+		return rc;
+
+	return 0;
 }
 
-/* soc_bus_enumerate_devices() and soc_device_bind_driver() mutually recurse */
-static int
-soc_bus_enumerate_devices(struct soc *ctx, struct soc_device *dev, int bus, struct soc_driver **drivers, size_t n_drivers);
+/* Registered drivers indexed by the compatibles they match */
+struct soc_binder {
+	struct soc_driver **drivers;
+	struct strmap by_compatible;
+};
 
-static int
-soc_device_bind_driver(struct soc *ctx, struct soc_device *parent, int node, struct soc_driver **drivers, size_t n_drivers)
+static struct soc_device *
+soc_device_new(struct soc *ctx, struct soc_device *parent, int node, const char *name)
 {
 	struct soc_device *dev;
-	char path[PATH_MAX];
-	bool is_bus, is_mfd;
-	size_t i;
-	int rc;
 
-	dev = malloc(sizeof(*dev));
+	/* Unbound devices stay parents of bound ones, so live as long */
+	dev = soc_alloc(ctx, sizeof(*dev));
 	if (!dev) {
-		loge("malloc() failed, exiting");
-		return -ENOMEM;
+		loge("Failed to allocate device, exiting\n");
+		return NULL;
 	}
 
 	dev->parent = parent;
 	dev->node.fdt = &ctx->fdt;
 	dev->node.offset = node;
 
-	rc = fdt_get_path(ctx->fdt.start, node, path, sizeof(path));
-	if (rc < 0) {
-		loge("Failed to extract node path for offset %d\n", node);
-	} else {
-		logt("Processing devicetree node at %s\n", path);
+	logt("Processing devicetree node %s\n", name ?: "(unnamed)");
+
+	return dev;
+}
+
+/*
+ * The earliest registered driver matching any of the node's compatibles wins.
+ * Alias simple-mfd to simple-bus.
+ */
+static intptr_t
+soc_binder_match(const struct soc_binder *binder, const char *compat, int len, bool *is_bus)
+{
+	intptr_t best = -1, idx;
+	const char *end;
+
+	*is_bus = false;
+	for (end = compat ? compat + len : NULL; compat && compat < end;
+	     compat += strlen(compat) + 1) {
+		*is_bus = *is_bus || !strcmp(compat, "simple-bus") ||
+			  !strcmp(compat, "simple-mfd");
+
+		if (!strmap_get(&binder->by_compatible, compat, &idx) &&
+		    (best < 0 || idx < best))
+			best = idx;
 	}
 
-	/* Alias simple-mfd to simple-bus */
-	is_bus = !fdt_node_check_compatible(ctx->fdt.start, node, "simple-bus");
-	is_mfd = !fdt_node_check_compatible(ctx->fdt.start, node, "simple-mfd");
+	return best;
+}
 
-	if (is_bus || is_mfd) {
-		rc = soc_bus_enumerate_devices(ctx, dev, node, drivers, n_drivers);
-		if (rc < 0) {
+static int
+soc_device_bind(struct soc *ctx, struct soc_device *dev, intptr_t best,
+		const struct soc_binder *binder, const char *name)
+{
+	int node = dev->node.offset;
+	int rc;
+
+	if (best >= 0) {
+		dev->driver = binder->drivers[best];
+		dev->drvdata = NULL;
+
+		// Binding in this case means simply associating the driver with the device,
+		// but *not* initialising it. We initialise it later, lazily, when someone
+		// requests the driver instance for the device. See soc_driver_get_drvdata()
+		logd("Bound %s driver to %s\n", dev->driver->name, name ?: "(unnamed)");
+
+		list_add(&ctx->devices, &dev->entry);
+
+		/* The most recently bound device wins, as with the list order */
+		ctx->by_offset[node / FDT_TAGSIZE] = dev;
+		if ((rc = strmap_set(&ctx->by_driver, dev->driver->name, (intptr_t)dev)) < 0)
 			return rc;
-		}
 	}
 
-	for (i = 0; i < n_drivers; i++) {
-		const struct soc_device_id *entry;
+	return 0;
+}
 
-		for (entry = drivers[i]->matches; entry && entry->compatible; entry++) {
-			if (fdt_node_check_compatible(ctx->fdt.start, node, entry->compatible)) {
-				continue;
-			}
+/* soc_bus_enumerate_devices() and soc_device_bind_driver() mutually recurse */
+static int
+soc_bus_enumerate_devices(struct soc *ctx, struct soc_device *dev, int bus, const struct soc_binder *binder);
 
-			dev->driver = drivers[i];
-			dev->drvdata = NULL;
+static int
+soc_device_bind_driver(struct soc *ctx, struct soc_device *parent, int node, const struct soc_binder *binder)
+{
+	struct soc_device *dev;
+	const char *compat, *name;
+	intptr_t best;
+	bool is_bus;
+	int len;
+	int rc;
 
-			// Binding in this case means simply associating the driver with the device,
-			// but *not* initialising it. We initialise it later, lazily, when someone
-			// requests the driver instance for the device. See soc_driver_get_drvdata()
-			logd("Bound %s driver to %s\n", drivers[i]->name, path);
+	name = fdt_get_name(ctx->fdt.start, node, NULL);
+	if (!(dev = soc_device_new(ctx, parent, node, name)))
+		return -ENOMEM;
 
-			list_add(&ctx->devices, &dev->entry);
+	compat = fdt_getprop(ctx->fdt.start, node, "compatible", &len);
+	best = soc_binder_match(binder, compat, len, &is_bus);
 
-			return 0;
+	if (is_bus) {
+		rc = soc_bus_enumerate_devices(ctx, dev, node, binder);
+		if (rc < 0) {
+			return rc;
 		}
 	}
 
-	return 0;
+	return soc_device_bind(ctx, dev, best, binder, name);
 }
 
-static int soc_bus_enumerate_devices(struct soc *ctx, struct soc_device *dev, int bus, struct soc_driver **drivers, size_t n_drivers)
+static int soc_bus_enumerate_devices(struct soc *ctx, struct soc_device *dev, int bus, const struct soc_binder *binder)
 {
 	int node;
 	int rc;
 
 	fdt_for_each_subnode(node, ctx->fdt.start, bus) {
-		rc = soc_device_bind_driver(ctx, dev, node, drivers, n_drivers);
+		rc = soc_device_bind_driver(ctx, dev, node, binder);
 		if (rc < 0) {
 			return rc;
 		}
@@ -156,50 +380,173 @@ static int soc_bus_enumerate_devices(struct soc *ctx, struct soc_device *dev, in
 	return 0;
 }
 
-static void soc_bind_drivers(struct soc *ctx)
+/* As soc_device_bind_driver(), but following the compiled table's links */
+static int
+soc_table_bind_driver(struct soc *ctx, struct soc_device *parent, int idx, const struct soc_binder *binder)
 {
-	struct soc_driver **drivers;
+	const struct soc_dt_node *n = &ctx->fdt.table->nodes[idx];
+	struct soc_device *dev;
+	intptr_t best;
+	bool is_bus;
+	int child;
+	int rc;
+
+	if (!(dev = soc_device_new(ctx, parent, n->offset, n->name)))
+		return -ENOMEM;
+
+	best = soc_binder_match(binder, n->compatible, n->compatible_len, &is_bus);
+
+	if (is_bus) {
+		for (child = n->child; child >= 0;
+		     child = ctx->fdt.table->nodes[child].sibling) {
+			if ((rc = soc_table_bind_driver(ctx, dev, child, binder)) < 0)
+				return rc;
+		}
+	}
+
+	return soc_device_bind(ctx, dev, best, binder, n->name);
+}
+
+/*
+ * The registered drivers can't change once the program is running, so the
+ * binder is built on the first probe and kept for the later ones
+ */
+static struct soc_binder *soc_binder_get(void)
+{
+	static struct soc_binder binder;
+	static bool built;
 	size_t n_drivers;
+	size_t i;
+
+	if (built)
+		return &binder;
 
-	drivers = autodata_get(soc_drivers, &n_drivers);
+	binder.drivers = autodata_get(soc_drivers, &n_drivers);
 
 	logd("Found %zu registered drivers\n", n_drivers);
 
-	if (drivers && n_drivers) {
-		soc_bus_enumerate_devices(ctx, NULL, 0, drivers, n_drivers);
+	if (!binder.drivers || !n_drivers)
+		goto cleanup_drivers;
+
+	if (strmap_init(&binder.by_compatible) < 0)
+		goto cleanup_drivers;
+
+	for (i = 0; i < n_drivers; i++) {
+		const struct soc_device_id *entry;
+
+		for (entry = binder.drivers[i]->matches; entry && entry->compatible; entry++) {
+			int rc = strmap_add(&binder.by_compatible, entry->compatible, i);
+
+			if (rc < 0 && rc != -EEXIST)
+				goto cleanup_index;
+		}
 	}
 
-	autodata_free(drivers);
+	built = true;
+
+	return &binder;
+
+cleanup_index:
+	strmap_destroy(&binder.by_compatible);
+
+cleanup_drivers:
+	autodata_free(binder.drivers);
+
+	return NULL;
+}
+
+static void soc_bind_drivers(struct soc *ctx)
+{
+	struct soc_binder *binder;
+
+	if (!(binder = soc_binder_get()))
+		return;
+
+	if (ctx->fdt.table) {
+		const struct soc_dt_node *root = &ctx->fdt.table->nodes[0];
+		int child;
+
+		for (child = root->child; child >= 0;
+		     child = ctx->fdt.table->nodes[child].sibling) {
+			if (soc_table_bind_driver(ctx, NULL, child, binder) < 0)
+				break;
+		}
+	} else {
+		soc_bus_enumerate_devices(ctx, NULL, 0, binder);
+	}
 }
 
 static void soc_unbind_drivers(struct soc *ctx)
 {
 	struct soc_device *dev, *next;
+	intptr_t bound;
 
 	list_for_each_safe(&ctx->devices, dev, next, entry) {
 		if (!dev->driver) {
 			continue;
 		}
 
-		if (dev->drvdata) {
+		if (dev->drvdata && dev->driver->destroy) {
 			dev->driver->destroy(dev);
 		}
 
 		logd("Unbound instance of driver %s\n", dev->driver->name);
 
+		ctx->by_offset[dev->node.offset / FDT_TAGSIZE] = NULL;
+		if (!strmap_get(&ctx->by_driver, dev->driver->name, &bound) &&
+		    bound == (intptr_t)dev)
+			strmap_set(&ctx->by_driver, dev->driver->name, 0);
+
 		list_del(&dev->entry);
-		free(dev);
 	}
 }
 
+/* Let a bridge that can see VRAM directly serve it without remapping */
+static void soc_attach_vram(struct soc *ctx)
+{
+	struct soc_region vram;
+	struct sdmc *sdmc;
+	int rc;
+
+	if (!ahb_has_aperture(ctx->ahb))
+		return;
+
+	if (!(sdmc = sdmc_get(ctx)))
+		return;
+
+	if ((rc = sdmc_get_vram(sdmc, &vram)) < 0) {
+		logd("Failed to locate VRAM for the bridge aperture: %d\n", rc);
+		return;
+	}
+
+	if ((rc = ahb_set_aperture(ctx->ahb, vram.start, vram.length)) < 0)
+		logd("Bridge declined the VRAM aperture: %d\n", rc);
+}
+
+void soc_enable_retention(void)
+{
+	soc_retain = true;
+}
+
 int soc_probe(struct soc *ctx, struct ahb *ahb)
 {
 	int64_t rc;
+	int timing;
 
-	rc = rev_probe(ahb);
-	if (rc < 0) {
-		loge("Failed to probe SoC revision: %d\n", rc);
-		return rc;
+	if (soc_retain && soc_retained.ahb == ahb) {
+		logd("Reusing SoC revision 0x%08" PRIx32 "\n", soc_retained.rev);
+		rc = soc_retained.rev;
+	} else {
+		timing = timing_begin("rev-probe", NULL);
+		rc = rev_probe(ahb);
+		timing_end(timing);
+		if (rc < 0) {
+			loge("Failed to probe SoC revision: %d\n", rc);
+			return rc;
+		}
+
+		cache_set("rev", "%08" PRIx32, (uint32_t)rc);
+		soc_retained.ahb = NULL;
 	}
 
 	rc = soc_from_rev(ctx, ahb, (uint32_t)rc);
@@ -208,51 +555,174 @@ int soc_probe(struct soc *ctx, struct ahb *ahb)
 		return rc;
 	}
 
+	if (soc_retained.ahb == ahb &&
+	    soc_retained.reg_writes == ahb->reg_writes) {
+		memcpy(ctx->shadow, soc_retained.shadow, sizeof(ctx->shadow));
+		ctx->nr_shadow = soc_retained.nr_shadow;
+	}
+	ctx->reg_writes = ahb->reg_writes;
+
+	if (soc_retain) {
+		ctx->arena = soc_retained.arena;
+		arena_init(&soc_retained.arena);
+	}
+
+	timing = timing_begin("soc-bind", NULL);
 	soc_bind_drivers(ctx);
+	soc_attach_vram(ctx);
+	timing_end(timing);
 
 	return 0;
 }
 
 void soc_destroy(struct soc *ctx)
 {
+	int timing;
+
+	timing = timing_begin("soc-destroy", NULL);
 	soc_unbind_drivers(ctx);
+	timing_end(timing);
+
+	soc_index_destroy(ctx);
 
-	free(ctx->fdt.start);
+	if (soc_retain) {
+		if (ctx->ahb->reg_writes != ctx->reg_writes) {
+			logd("Dropping shadows of SoC registers written behind them\n");
+			ctx->nr_shadow = 0;
+		}
+
+		soc_retained.ahb = ctx->ahb;
+		soc_retained.rev = ctx->rev;
+		soc_retained.reg_writes = ctx->ahb->reg_writes;
+		memcpy(soc_retained.shadow, ctx->shadow, sizeof(ctx->shadow));
+		soc_retained.nr_shadow = ctx->nr_shadow;
+
+		arena_destroy(&soc_retained.arena);
+		arena_reset(&ctx->arena);
+		soc_retained.arena = ctx->arena;
+	} else {
+		arena_destroy(&ctx->arena);
+	}
+}
+
+int soc_readl_cached(struct soc *ctx, uint32_t phys, uint32_t *val)
+{
+	struct soc_shadow *shadow;
+	unsigned int i;
+	int rc;
+
+	for (i = 0; i < ctx->nr_shadow; i++) {
+		if (ctx->shadow[i].phys == phys) {
+			*val = ctx->shadow[i].val;
+			return 0;
+		}
+	}
+
+	if ((rc = soc_readl(ctx, phys, val)) < 0)
+		return rc;
+
+	if (ctx->nr_shadow < SOC_SHADOW_MAX) {
+		shadow = &ctx->shadow[ctx->nr_shadow++];
+		shadow->phys = phys;
+		shadow->val = *val;
+	}
+
+	return 0;
+}
+
+void soc_shadow_flush(struct soc *ctx)
+{
+	ctx->nr_shadow = 0;
+}
+
+void soc_shadow_invalidate(struct soc *ctx, uint32_t phys)
+{
+	unsigned int i;
+
+	for (i = 0; i < ctx->nr_shadow; i++) {
+		if (ctx->shadow[i].phys == phys) {
+			ctx->shadow[i] = ctx->shadow[--ctx->nr_shadow];
+			return;
+		}
+	}
+}
+
+void soc_snapshot_add(struct soc_snapshot *snap, uint32_t phys)
+{
+	uint32_t val;
+
+	if ((phys & 3) || !soc_snapshot_lookup(snap, phys, &val) ||
+	    snap->nr == SOC_SNAPSHOT_MAX)
+		return;
+
+	snap->phys[snap->nr++] = phys;
+}
+
+int soc_snapshot_lookup(const struct soc_snapshot *snap, uint32_t phys,
+			uint32_t *val)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->nr; i++) {
+		if (snap->phys[i] == phys) {
+			*val = snap->val[i];
+			return 0;
+		}
+	}
+
+	return -ENOENT;
+}
+
+void soc_snapshot_drop(struct soc_snapshot *snap, uint32_t phys)
+{
+	unsigned int i;
+
+	for (i = 0; i < snap->nr; i++) {
+		if (snap->phys[i] == phys) {
+			snap->nr--;
+			snap->phys[i] = snap->phys[snap->nr];
+			snap->val[i] = snap->val[snap->nr];
+			return;
+		}
+	}
+}
+
+/* All the registers in one vectored pass, so the bridge can batch them */
+static int soc_snapshot_take(struct soc *ctx, struct soc_snapshot *snap)
+{
+	struct ahb_iov iov[SOC_SNAPSHOT_MAX];
+	unsigned int i;
+	ssize_t rc;
+
+	for (i = 0; i < snap->nr; i++) {
+		iov[i].phys = snap->phys[i];
+		iov[i].base = &snap->val[i];
+		iov[i].len = sizeof(snap->val[i]);
+	}
+
+	if ((rc = ahb_readv(ctx->ahb, iov, snap->nr)) < 0)
+		return rc;
+
+	return 0;
 }
 
 int soc_device_match_node(struct soc *ctx,
 			  const struct soc_device_id table[],
 			  struct soc_device_node *dn)
 {
-	const char *pval;
-	int rc;
+	intptr_t offset;
 
 	/* FIXME: Only matches the first device */
 	while (table->compatible) {
 		logd("Searching devicetree for compatible '%s'\n",
 		     table->compatible);
 
-		pval = fdt_getprop(ctx->fdt.start, 0, "compatible", NULL);
-		if (pval && !strcmp(table->compatible, pval)) {
-			dn->offset = 0;
-			return 0;
-		}
-
-		rc = fdt_node_offset_by_compatible(ctx->fdt.start, 0,
-						   table->compatible);
-
 		/* Found it */
-		if (rc >= 0) {
-			dn->offset = rc;
+		if (!strmap_get(&ctx->by_compatible, table->compatible, &offset)) {
+			dn->offset = offset;
 			return 0;
 		}
 
-		/* Corrupt FDT */
-		if (rc != -FDT_ERR_NOTFOUND) {
-			loge("fdt: Failed to look up compatible: %d\n", rc);
-			return -EUCLEAN;
-		}
-
 		/* Keep looking */
 		table++;
 	}
@@ -323,6 +793,7 @@ int soc_device_from_name(struct soc *ctx, const char *name,
 			 struct soc_device_node *dn)
 {
 	const char *path;
+	intptr_t offset;
 	int rc;
 
 	logd("fdt: Looking up device name '%s'\n", name);
@@ -333,6 +804,12 @@ int soc_device_from_name(struct soc *ctx, const char *name,
 
 	logd("fdt: Locating node with device path '%s'\n", path);
 
+	if (!strmap_get(&ctx->by_path, path, &offset)) {
+		dn->offset = offset;
+		return 0;
+	}
+
+	/* Not a canonical path, let libfdt interpret it */
 	rc = fdt_path_offset(ctx->fdt.start, path);
 	if (rc < 0) {
 		if (rc == -FDT_ERR_BADPATH)
@@ -352,24 +829,36 @@ int soc_device_from_name(struct soc *ctx, const char *name,
 int soc_device_from_type(struct soc *ctx, const char *type,
 			 struct soc_device_node *dn)
 {
-	int node;
+	intptr_t offset;
 
 	logd("fdt: Searching devicetree for type '%s'\n", type);
 
-	fdt_for_each_subnode(node, ctx->fdt.start, 0) {
-		const char *found;
+	if (strmap_get(&ctx->by_type, type, &offset))
+		return -ENOENT;
 
-		found = fdt_getprop(ctx->fdt.start, node, "device_type", NULL);
-		if (found && !strcmp(type, found)) {
-			dn->offset = node;
-			return 0;
-		}
-	}
+	dn->offset = offset;
 
-	if ((node < 0) && (node != -FDT_ERR_NOTFOUND))
-		return -EUCLEAN;
+	return 0;
+}
 
-	return -ENOENT;
+static int soc_dt_node_cmp(const void *key, const void *elem)
+{
+	const struct soc_dt_node *n = elem;
+	int offset = *(const int *)key;
+
+	return (offset > n->offset) - (offset < n->offset);
+}
+
+/* The table's nodes are in blob order, so sorted by offset */
+static const struct soc_dt_node *soc_dt_node_at(struct soc *ctx, int offset)
+{
+	const struct soc_dt *dt = ctx->fdt.table;
+
+	if (!dt)
+		return NULL;
+
+	return bsearch(&offset, dt->nodes, dt->nr_nodes, sizeof(*dt->nodes),
+		       soc_dt_node_cmp);
 }
 
 static int
@@ -397,10 +886,17 @@ int soc_device_get_memory_index(struct soc *ctx,
 				struct soc_region *region)
 {
 	struct soc_device_node _dn, *dn = &_dn;
+	const struct soc_dt_node *n;
 	const uint32_t *reg;
 	int len;
 	int rc;
 
+	/* The table already resolved the reg through any simple-mfd parent */
+	if ((n = soc_dt_node_at(ctx, sdn->offset)) && index >= 0 && index < n->nr_reg) {
+		*region = n->reg[index];
+		return 0;
+	}
+
 	/* MFD transparency for resource acquisition */
 	if ((rc = soc_device_resolve_node(ctx, sdn, dn)) < 0) {
 		return rc;
@@ -439,6 +935,7 @@ int
 soc_device_get_memory_region_named(struct soc *ctx, const struct soc_device_node *dn,
 				   const char *name, struct soc_region *region)
 {
+	const struct soc_dt_node *n;
 	struct soc_device_node rdn;
 	const uint32_t *regions;
 	int phandle;
@@ -446,6 +943,15 @@ soc_device_get_memory_region_named(struct soc *ctx, const struct soc_device_node
 	int idx;
 	int len;
 
+	if ((n = soc_dt_node_at(ctx, dn->offset))) {
+		for (idx = 0; idx < n->nr_regions; idx++) {
+			if (!strcmp(n->regions[idx].name, name)) {
+				*region = n->regions[idx].region;
+				return 0;
+			}
+		}
+	}
+
 	idx = fdt_stringlist_search(ctx->fdt.start, dn->offset, "memory-region-names", name);
 	if (idx < 0) {
 		loge("fdt: No memory region named '%s' for node %d: %d\n", name, dn->offset, idx);
@@ -482,6 +988,7 @@ soc_device_get_memory_region_named(struct soc *ctx, const struct soc_device_node
 static void *soc_device_init_driver(struct soc *ctx, struct soc_device *dev)
 
 {
+	int timing;
 	int rc;
 
 	if (dev->drvdata) {
@@ -503,7 +1010,10 @@ static void *soc_device_init_driver(struct soc *ctx, struct soc_device *dev)
 		return NULL;
 	}
 
-	if ((rc = dev->driver->init(ctx, dev)) < 0) {
+	timing = timing_begin("driver-init", dev->driver->name);
+	rc = dev->driver->init(ctx, dev);
+	timing_end(timing);
+	if (rc < 0) {
 		loge("Failed to initialise driver: %d\n", rc);
 		return NULL;
 	}
@@ -513,17 +1023,22 @@ static void *soc_device_init_driver(struct soc *ctx, struct soc_device *dev)
 	return dev->drvdata;
 }
 
+static struct soc_device *soc_device_at(struct soc *soc, int offset)
+{
+	if (offset < 0 || (size_t)offset / FDT_TAGSIZE >= soc->nr_offsets)
+		return NULL;
+
+	return soc->by_offset[offset / FDT_TAGSIZE];
+}
+
 void *soc_driver_get_drvdata(struct soc *soc, const struct soc_driver *match)
 {
-	struct soc_device *dev;
+	intptr_t dev;
 
-	list_for_each(&soc->devices, dev, entry) {
-		if (dev->driver && !strcmp(dev->driver->name, match->name)) {
-			return soc_device_init_driver(soc, dev);
-		}
-	}
+	if (strmap_get(&soc->by_driver, match->name, &dev) || !dev)
+		return NULL;
 
-	return NULL;
+	return soc_device_init_driver(soc, (struct soc_device *)dev);
 }
 
 void *soc_driver_get_drvdata_by_name(struct soc *soc, const struct soc_driver *match,
@@ -539,35 +1054,25 @@ void *soc_driver_get_drvdata_by_name(struct soc *soc, const struct soc_driver *m
 		return NULL;
 	}
 
-	list_for_each(&soc->devices, dev, entry) {
-		if (!(dev->node.offset == dn.offset)) {
-			continue;
-		}
-
-		if (dev->driver != match) {
-			logi("Failed to match driver %s on device %s", match->name, name);
-			return NULL;
-		}
+	if (!(dev = soc_device_at(soc, dn.offset)))
+		return NULL;
 
-		return soc_device_init_driver(soc, dev);
+	if (dev->driver != match) {
+		logi("Failed to match driver %s on device %s", match->name, name);
+		return NULL;
 	}
 
-	return NULL;
+	return soc_device_init_driver(soc, dev);
 }
 
 void *soc_driver_get_drvdata_by_node(struct soc *soc, const struct soc_device_node *dn)
 {
 	struct soc_device *dev;
 
-	list_for_each(&soc->devices, dev, entry) {
-		if (!(dev->node.offset == dn->offset)) {
-			continue;
-		}
-
-		return soc_device_init_driver(soc, dev);
-	}
+	if (!(dev = soc_device_at(soc, dn->offset)))
+		return NULL;
 
-	return NULL;
+	return soc_device_init_driver(soc, dev);
 }
 
 int
@@ -617,16 +1122,34 @@ void soc_list_bridge_controllers(struct soc *ctx)
 int soc_probe_bridge_controllers(struct soc *ctx, enum bridge_mode *discovered, const char *name)
 {
 	enum bridge_mode current, aggregate;
+	struct soc_snapshot snap;
 	struct bridgectl *bridge;
 	int error;
+	int rc;
 
 	soc_init_bridge_controllers(ctx);
 
+	/*
+	 * Gather the registers the controllers are about to read, often the same
+	 * SCU words, and read them in one pass. Without the snapshot the reports
+	 * read through the bridge as usual.
+	 */
+	snap.nr = 0;
+	list_for_each(&ctx->bridges, bridge, entry) {
+		if (!name || !strcmp(name, bridgectl_name(bridge)))
+			bridgectl_prefetch(bridge, &snap);
+	}
+
+	if (snap.nr) {
+		if ((rc = soc_snapshot_take(ctx, &snap)) < 0)
+			logd("Failed to snapshot bridge controller registers: %d\n", rc);
+		else
+			ctx->snapshot = &snap;
+	}
+
 	aggregate = bm_disabled;
 	error = 0;
 	list_for_each(&ctx->bridges, bridge, entry) {
-		int rc;
-
 		if (name && strcmp(name, bridgectl_name(bridge))) {
 			continue;
 		}
@@ -642,7 +1165,87 @@ int soc_probe_bridge_controllers(struct soc *ctx, enum bridge_mode *discovered,
 		}
 	}
 
+	ctx->snapshot = NULL;
+
 	*discovered = aggregate;
 
 	return error;
 }
+
+struct soc_audit {
+	struct bridgectl *bridge;
+	unsigned int cost;
+};
+
+static int soc_audit_cmp(const void *a, const void *b)
+{
+	const struct soc_audit *aa = a, *ab = b;
+
+	return (aa->cost > ab->cost) - (aa->cost < ab->cost);
+}
+
+int soc_audit_bridge_controllers(struct soc *ctx, enum bridge_mode required,
+				 const char *name, struct bridgectl **violator,
+				 enum bridge_mode *mode)
+{
+	struct soc_audit *audits;
+	struct soc_snapshot snap;
+	struct bridgectl *bridge;
+	size_t nr_audits = 0;
+	size_t i;
+	int rc;
+
+	soc_init_bridge_controllers(ctx);
+
+	list_for_each(&ctx->bridges, bridge, entry)
+		nr_audits++;
+
+	if (!(audits = calloc(nr_audits ?: 1, sizeof(*audits))))
+		return -ENOMEM;
+
+	/*
+	 * The registers a controller prefetches are the cost of its status. Those
+	 * that don't say are assumed to be the most expensive.
+	 */
+	nr_audits = 0;
+	list_for_each(&ctx->bridges, bridge, entry) {
+		if (name && strcmp(name, bridgectl_name(bridge)))
+			continue;
+
+		snap.nr = 0;
+		bridgectl_prefetch(bridge, &snap);
+		audits[nr_audits].bridge = bridge;
+		audits[nr_audits].cost = snap.nr ?: SOC_SNAPSHOT_MAX + 1;
+		nr_audits++;
+	}
+
+	qsort(audits, nr_audits, sizeof(*audits), soc_audit_cmp);
+
+	*violator = NULL;
+	rc = 0;
+	for (i = 0; i < nr_audits; i++) {
+		bridge = audits[i].bridge;
+
+		snap.nr = 0;
+		bridgectl_prefetch(bridge, &snap);
+		if (snap.nr && !soc_snapshot_take(ctx, &snap))
+			ctx->snapshot = &snap;
+
+		rc = bridgectl_status(bridge, mode);
+		ctx->snapshot = NULL;
+
+		if (rc < 0) {
+			loge("Failed to read %s status: %d\n", bridgectl_name(bridge), rc);
+			break;
+		}
+
+		if (*mode < required) {
+			*violator = bridge;
+			break;
+		}
+	}
+
+	free(audits);
+
+	return rc;
+}
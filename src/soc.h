@@ -5,8 +5,10 @@
 #define _SOC_H
 
 #include "ahb.h"
+#include "arena.h"
 #include "rev.h"
 #include "soc/bridgectl.h"
+#include "strmap.h"
 
 #include "ccan/autodata/autodata.h"
 #include "ccan/list/list.h"
@@ -14,9 +16,34 @@
 #include <stddef.h>
 #include <stdint.h>
 
+struct soc_dt;
+
 struct soc_fdt {
 	void *start;
 	void *end;
+	/* Compiled from the blob at build time, NULL to parse the blob instead */
+	const struct soc_dt *table;
+};
+
+#define SOC_SHADOW_MAX 32
+
+/* A register value that can't change for the duration of the run */
+struct soc_shadow {
+	uint32_t phys;
+	uint32_t val;
+};
+
+#define SOC_SNAPSHOT_MAX 32
+
+/*
+ * Registers read together ahead of a sequence of reads of them, see
+ * soc_snapshot_add(). While one is installed in the soc, soc_readl() is served
+ * from it and writes drop the registers they touch.
+ */
+struct soc_snapshot {
+	uint32_t phys[SOC_SNAPSHOT_MAX];
+	uint32_t val[SOC_SNAPSHOT_MAX];
+	unsigned int nr;
 };
 
 struct soc {
@@ -25,12 +52,39 @@ struct soc {
 	struct ahb *ahb;
 	struct list_head devices;
 	struct list_head bridges;
+	struct soc_shadow shadow[SOC_SHADOW_MAX];
+	unsigned int nr_shadow;
+	/*
+	 * The bridge's reg_writes as it would be if the soc's own writes were
+	 * the only ones, so a difference means the shadow may be stale
+	 */
+	unsigned long reg_writes;
+	/* NULL unless a snapshot is being evaluated */
+	struct soc_snapshot *snapshot;
+	/* Devicetree node offsets, indexed once at probe time */
+	struct strmap by_compatible;
+	struct strmap by_path;
+	struct strmap by_type;
+	/* Bound devices, by driver name and by node offset */
+	struct strmap by_driver;
+	struct soc_device **by_offset;
+	size_t nr_offsets;
+	/* Devices and driver contexts, all released by soc_destroy() */
+	struct arena arena;
 };
 
 int soc_probe(struct soc *ctx, struct ahb *ahb);
+/* For commands sharing a host session, see host_session_begin() */
+void soc_enable_retention(void);
 
 void soc_destroy(struct soc *ctx);
 
+/* Zeroed memory for driver state, released wholesale by soc_destroy() */
+static inline void *soc_alloc(struct soc *ctx, size_t size)
+{
+	return arena_alloc(&ctx->arena, size);
+}
+
 static inline enum ast_generation soc_generation(struct soc *ctx)
 {
 	return rev_generation(ctx->rev);
@@ -47,28 +101,107 @@ soc_read(struct soc *ctx, uint32_t phys, void *buf, size_t len)
 	return ahb_read(ctx->ahb, phys, buf, len);
 }
 
+static inline ssize_t
+soc_readv(struct soc *ctx, const struct ahb_iov *iov, size_t iovcnt)
+{
+	return ahb_readv(ctx->ahb, iov, iovcnt);
+}
+
 static inline ssize_t
 soc_write(struct soc *ctx, uint32_t phys, const void *buf, size_t len)
 {
 	return ahb_write(ctx->ahb, phys, buf, len);
 }
 
+/* Duplicates are ignored, as are registers past SOC_SNAPSHOT_MAX */
+void soc_snapshot_add(struct soc_snapshot *snap, uint32_t phys);
+int soc_snapshot_lookup(const struct soc_snapshot *snap, uint32_t phys,
+			uint32_t *val);
+void soc_snapshot_drop(struct soc_snapshot *snap, uint32_t phys);
+
 static inline int soc_readl(struct soc *ctx, uint32_t phys, uint32_t *val)
 {
+	if (ctx->snapshot && !soc_snapshot_lookup(ctx->snapshot, phys, val))
+		return 0;
+
 	return ahb_readl(ctx->ahb, phys, val);
 }
 
+void soc_shadow_invalidate(struct soc *ctx, uint32_t phys);
+
+/* For when the SoC has been reset, and so may have different straps */
+void soc_shadow_flush(struct soc *ctx);
+
+static inline void soc_count_write(struct soc *ctx, uint32_t phys)
+{
+	if (ahb_prefetch_overlaps(phys, sizeof(uint32_t)))
+		ctx->reg_writes++;
+}
+
 static inline int soc_writel(struct soc *ctx, uint32_t phys, uint32_t val)
 {
+	if (ctx->nr_shadow)
+		soc_shadow_invalidate(ctx, phys);
+
+	soc_count_write(ctx, phys);
+
+	if (ctx->snapshot)
+		soc_snapshot_drop(ctx->snapshot, phys);
+
 	return ahb_writel(ctx->ahb, phys, val);
 }
 
+static inline int
+soc_modifyl(struct soc *ctx, uint32_t phys, uint32_t clear, uint32_t set)
+{
+	if (ctx->nr_shadow)
+		soc_shadow_invalidate(ctx, phys);
+
+	soc_count_write(ctx, phys);
+
+	if (ctx->snapshot)
+		soc_snapshot_drop(ctx->snapshot, phys);
+
+	return ahb_modifyl(ctx->ahb, phys, clear, set);
+}
+
+/*
+ * For registers whose value is invariant while culvert runs, such as straps
+ * and memory controller configuration. The first read goes to the bridge,
+ * later reads are served from the shadow until the register is written.
+ */
+int soc_readl_cached(struct soc *ctx, uint32_t phys, uint32_t *val);
+
+static inline int soc_poll(struct soc *ctx, uint32_t phys, uint32_t mask,
+			   uint32_t value, uint64_t timeout_us,
+			   const struct ahb_poll_policy *policy, uint32_t *val)
+{
+	return ahb_poll(ctx->ahb, phys, mask, value, timeout_us, policy, val);
+}
+
+static inline void soc_txn_begin(struct soc *ctx)
+{
+	ahb_txn_begin(ctx->ahb);
+}
+
+static inline int soc_txn_commit(struct soc *ctx)
+{
+	return ahb_txn_commit(ctx->ahb);
+}
+
 static inline ssize_t
 soc_siphon_out(struct soc *ctx, uint32_t phys, size_t len, int outfd)
 {
 	return ahb_siphon_out(ctx->ahb, phys, len, outfd);
 }
 
+static inline ssize_t
+soc_siphon_out_opts(struct soc *ctx, uint32_t phys, size_t len, int outfd,
+		    const struct ahb_siphon_opts *opts)
+{
+	return ahb_siphon_out_opts(ctx->ahb, phys, len, outfd, opts);
+}
+
 static inline ssize_t
 soc_siphon_in(struct soc *ctx, uint32_t phys, ssize_t length, int infd)
 {
@@ -147,6 +280,7 @@ struct soc_driver {
 	const char* name;
 	const struct soc_device_id *matches;
 	int (*init)(struct soc *soc, struct soc_device *dev);
+	/* Optional, to put the hardware back; soc_alloc() memory needs no freeing */
 	void (*destroy)(struct soc_device *dev);
 };
 
@@ -165,4 +299,11 @@ void soc_bridge_controller_unregister(struct soc *soc, struct bridgectl *bridge)
 
 void soc_list_bridge_controllers(struct soc *soc);
 int soc_probe_bridge_controllers(struct soc *soc, enum bridge_mode *discovered, const char *name);
+/*
+ * Without reports, stops at the first controller weaker than @required. Sets
+ * @violator to NULL if there's none, otherwise to it and @mode to its mode.
+ */
+int soc_audit_bridge_controllers(struct soc *soc, enum bridge_mode required,
+				 const char *name, struct bridgectl **violator,
+				 enum bridge_mode *mode);
 #endif
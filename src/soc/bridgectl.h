@@ -9,12 +9,15 @@
 enum bridge_mode { bm_permissive, bm_restricted, bm_disabled };
 
 struct bridgectl;
+struct soc_snapshot;
 
 struct bridgectl_ops {
     const char *(*name)(struct bridgectl *ctx);
     int (*enforce)(struct bridgectl *ctx, enum bridge_mode mode);
     int (*status)(struct bridgectl *ctx, enum bridge_mode *mode);
     int (*report)(struct bridgectl *ctx, int fd, enum bridge_mode *mode);
+    /* Optional, adds the registers status and report read to @snap */
+    void (*prefetch)(struct bridgectl *ctx, struct soc_snapshot *snap);
 };
 
 struct bridgectl {
@@ -42,5 +45,11 @@ static inline int bridgectl_report(struct bridgectl *ctx, int fd, enum bridge_mo
     return ctx->ops->report(ctx, fd, mode);
 }
 
+static inline void bridgectl_prefetch(struct bridgectl *ctx, struct soc_snapshot *snap)
+{
+    if (ctx->ops->prefetch)
+        ctx->ops->prefetch(ctx, snap);
+}
+
 void bridgectl_log_status(struct bridgectl *ctx, int fd, enum bridge_mode mode);
 #endif
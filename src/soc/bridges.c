@@ -81,13 +81,13 @@ int bridges_driver_init(struct soc *soc, struct soc_device *dev)
     struct bridges *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->scu)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
@@ -96,23 +96,12 @@ int bridges_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void bridges_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver bridges_driver = {
     .name = "bridge-controller",
     .matches = bridges_matches,
     .init = bridges_driver_init,
-    .destroy = bridges_driver_destroy,
 };
 REGISTER_SOC_DRIVER(bridges_driver);
 
@@ -229,7 +218,7 @@ int bridges_device_get_gate_by_name(struct soc *soc, struct soc_device *dev, con
 static int bridges_configure(struct bridges *ctx, int bridge, bool enable)
 {
     const struct bridge_gate_desc *desc;
-    uint32_t phys, val;
+    uint32_t phys;
     int rc;
 
     if (bridge < 0) {
@@ -244,20 +233,16 @@ static int bridges_configure(struct bridges *ctx, int bridge, bool enable)
 
     desc = &ctx->pdata->descs[bridge];
     phys = ctx->scu.start + desc->reg;
-    if ((rc = soc_readl(ctx->soc, phys, &val)) < 0) {
-        loge("Failed to read bridge control register 0x%"PRIx32": %d\n", phys, rc);
-        return rc;
-    }
 
     /* Bridge control registers tend to set bits to disable the bridge */
     if (enable) {
-        val &= ~desc->mask;
+        rc = soc_modifyl(ctx->soc, phys, desc->mask, 0);
     } else {
-        val |= desc->mask;
+        rc = soc_modifyl(ctx->soc, phys, 0, desc->mask);
     }
 
-    if ((rc = soc_writel(ctx->soc, phys, val)) < 0) {
-        loge("Failed to write 0x%"PRIx32" to bridge control register 0x%"PRIx32": %d\n", phys, rc);
+    if (rc < 0) {
+        loge("Failed to update bridge control register 0x%"PRIx32": %d\n", phys, rc);
         return rc;
     }
 
@@ -300,3 +285,11 @@ int bridges_status(struct bridges *ctx, int bridge)
     /* Bridge control registers tend to set bits to disable the bridge */
     return !(val & desc->mask);
 }
+
+void bridges_prefetch(struct bridges *ctx, int bridge, struct soc_snapshot *snap)
+{
+    if (bridge < 0 || (size_t)bridge >= ctx->pdata->ndescs)
+        return;
+
+    soc_snapshot_add(snap, ctx->scu.start + ctx->pdata->descs[bridge].reg);
+}
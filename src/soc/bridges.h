@@ -20,5 +20,6 @@ int bridges_device_get_gate_by_name(struct soc *soc, struct soc_device *dev, con
 int bridges_enable(struct bridges *ctx, int bridge);
 int bridges_disable(struct bridges *ctx, int bridge);
 int bridges_status(struct bridges *ctx, int bridge);
+void bridges_prefetch(struct bridges *ctx, int bridge, struct soc_snapshot *snap);
 
 #endif
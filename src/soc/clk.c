@@ -2,6 +2,7 @@
 // Copyright (C) 2018,2019 IBM Corp.
 
 #include "compiler.h"
+#include "mirror.h"
 
 #include "bits.h"
 #include "clk.h"
@@ -44,7 +45,7 @@ static int64_t clk_rate_ahb(struct clk *ctx)
     int rc;
 
     /* HW strapping gives us the CPU freq and AHB divisor */
-    if ((rc = scu_readl(ctx->scu, SCU_HW_STRAP, &strap)) < 0)
+    if ((rc = scu_readl_cached(ctx->scu, SCU_HW_STRAP, &strap)) < 0)
         return rc;
 
     if (strap & 0x00800000)
@@ -67,22 +68,11 @@ int64_t clk_get_rate(struct clk *ctx, enum clksrc src)
 
 int clk_disable(struct clk *ctx, enum clksrc src)
 {
-    uint32_t reg;
-    int rc;
-
     switch (src) {
     case clk_arm:
         return scu_writel(ctx->scu, SCU_HW_STRAP, SCU_HW_STRAP_ARM_CLK);
     case clk_uart3:
-        if ((rc = scu_readl(ctx->scu, SCU_CLK_STOP, &reg)) < 0)
-            return rc;
-
-        reg |= SCU_CLK_STOP_UART3;
-
-        if ((rc = scu_writel(ctx->scu, SCU_CLK_STOP, reg)) < 0)
-            return rc;
-
-        return 0;
+        return scu_modifyl(ctx->scu, SCU_CLK_STOP, 0, SCU_CLK_STOP_UART3);
     default:
         break;
     }
@@ -92,22 +82,13 @@ int clk_disable(struct clk *ctx, enum clksrc src)
 
 int clk_enable(struct clk *ctx, enum clksrc src)
 {
-    uint32_t reg;
-    int rc;
-
     switch (src) {
     case clk_arm:
+        /* Whatever the ARM runs next can write the memory we've mirrored */
+        mirror_invalidate("ARM released");
         return scu_writel(ctx->scu, SCU_SILICON_REVISION, SCU_HW_STRAP_ARM_CLK);
     case clk_uart3:
-        if ((rc = scu_readl(ctx->scu, SCU_CLK_STOP, &reg)) < 0)
-            return rc;
-
-        reg &= ~SCU_CLK_STOP_UART3;
-
-        if ((rc = scu_writel(ctx->scu, SCU_CLK_STOP, reg)) < 0)
-            return rc;
-
-        return 0;
+        return scu_modifyl(ctx->scu, SCU_CLK_STOP, SCU_CLK_STOP_UART3, 0);
     default:
         break;
     }
@@ -123,34 +104,26 @@ static const struct soc_device_id clk_match[] = {
 static int clk_driver_init(struct soc *soc, struct soc_device *dev)
 {
     struct clk *ctx;
-    int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     ctx->scu = scu_get(soc);
     if (!ctx->scu) {
-        rc = -ENODEV;
-        goto cleanup_ctx;
+        return -ENODEV;
     }
 
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
 }
 
 static void clk_driver_destroy(struct soc_device *dev)
 {
     struct clk *ctx = soc_device_get_drvdata(dev);
     scu_put(ctx->scu);
-    free(ctx);
 }
 
 static const struct soc_driver clk_driver = {
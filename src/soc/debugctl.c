@@ -64,6 +64,21 @@ static int debugctl_status(struct bridgectl *bridge, enum bridge_mode *mode)
     return 0;
 }
 
+static void debugctl_prefetch(struct bridgectl *bridge, struct soc_snapshot *snap)
+{
+    struct debugctl *ctx = to_debugctl(bridge);
+
+    bridges_prefetch(ctx->bridges, ctx->id, snap);
+}
+
+static void ast2500_debugctl_prefetch(struct bridgectl *bridge, struct soc_snapshot *snap)
+{
+    struct debugctl *ctx = to_debugctl(bridge);
+
+    debugctl_prefetch(bridge, snap);
+    soc_snapshot_add(snap, ctx->region.start + SCU_STRAP);
+}
+
 static int ast2500_debugctl_report(struct bridgectl *bridge, int fd, enum bridge_mode *mode)
 {
     struct debugctl *ctx = to_debugctl(bridge);
@@ -98,6 +113,7 @@ static const struct bridgectl_ops ast2500_debugctl_ops = {
     .enforce = debugctl_enforce,
     .status = debugctl_status,
     .report = ast2500_debugctl_report,
+    .prefetch = ast2500_debugctl_prefetch,
 };
 
 static int ast2600_debugctl_report(struct bridgectl *bridge, int fd, enum bridge_mode *mode)
@@ -131,6 +147,7 @@ static const struct bridgectl_ops ast2600_debugctl_ops = {
     .enforce = debugctl_enforce,
     .status = debugctl_status,
     .report = ast2600_debugctl_report,
+    .prefetch = debugctl_prefetch,
 };
 
 static const struct soc_device_id debugctl_matches[] = {
@@ -145,19 +162,19 @@ static int debugctl_driver_init(struct soc *soc, struct soc_device *dev)
     struct debugctl *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->region)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
 
     if ((rc = bridges_device_get_gate(soc, dev, &ctx->bridges, &ctx->id)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     soc_device_set_drvdata(dev, ctx);
@@ -178,9 +195,6 @@ static int debugctl_driver_init(struct soc *soc, struct soc_device *dev)
 cleanup_drvdata:
     soc_device_set_drvdata(dev, NULL);
 
-cleanup_ctx:
-    free(ctx);
-
     return rc;
 }
 
@@ -189,8 +203,6 @@ static void debugctl_driver_destroy(struct soc_device *dev)
     struct debugctl *ctx = soc_device_get_drvdata(dev);
 
     soc_bridge_controller_unregister(ctx->soc, debugctl_as_bridgectl(ctx));
-
-    free(ctx);
 }
 
 static const struct soc_driver debugctl_driver = {
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bits.h"
+#include "hace.h"
+#include "log.h"
+#include "soc.h"
+
+#include <errno.h>
+#include <stdlib.h>
+
+#define HACE_STS                0x1c
+#define   HACE_STS_HASH_ISR     BIT(9)
+#define   HACE_STS_HASH_BUSY    BIT(0)
+#define HACE_HASH_SRC           0x20
+#define HACE_HASH_DIGEST        0x24
+#define HACE_HASH_DATA_LEN      0x2c
+#define HACE_HASH_CMD           0x30
+/* Without accumulative mode the engine pads the message itself */
+#define   HACE_HASH_CMD_SHA256  (0x5 << 4)
+#define   HACE_HASH_CMD_SHA_BE  BIT(3)
+
+/*
+ * Allow for the engine crawling through slow memory, such as flash behind the
+ * SPI controller, so not finishing by then means it isn't running.
+ */
+#define HACE_TIMEOUT_NS         10000000ULL
+#define HACE_TIMEOUT_NS_PER_B   100ULL
+
+struct hace {
+    struct soc *soc;
+    struct soc_region iomem;
+};
+
+static int hace_readl(struct hace *ctx, uint32_t reg, uint32_t *val)
+{
+    return soc_readl(ctx->soc, ctx->iomem.start + reg, val);
+}
+
+static int hace_writel(struct hace *ctx, uint32_t reg, uint32_t val)
+{
+    return soc_writel(ctx->soc, ctx->iomem.start + reg, val);
+}
+
+static int hace_wait(struct hace *ctx, uint32_t len)
+{
+    uint64_t timeout = (HACE_TIMEOUT_NS + len * HACE_TIMEOUT_NS_PER_B) / 1000;
+    int rc;
+
+    rc = soc_poll(ctx->soc, ctx->iomem.start + HACE_STS, HACE_STS_HASH_ISR,
+                  HACE_STS_HASH_ISR, timeout, NULL, NULL);
+    if (rc == -ETIMEDOUT)
+        loge("Timed out waiting for the hash engine, is its clock running?\n");
+    if (rc < 0)
+        return rc;
+
+    return hace_writel(ctx, HACE_STS, HACE_STS_HASH_ISR);
+}
+
+static int hace_idle(struct hace *ctx)
+{
+    uint32_t sts;
+    int rc;
+
+    /* The BMC's own firmware may be using the engine */
+    if ((rc = hace_readl(ctx, HACE_STS, &sts)) < 0)
+        return rc;
+
+    if (sts & HACE_STS_HASH_BUSY) {
+        loge("The hash engine is busy\n");
+        return -EBUSY;
+    }
+
+    return 0;
+}
+
+static int hace_hash(struct hace *ctx, uint32_t src, uint32_t len,
+                     uint32_t digest)
+{
+    int rc;
+
+    if ((rc = hace_writel(ctx, HACE_HASH_SRC, src)) < 0)
+        return rc;
+
+    if ((rc = hace_writel(ctx, HACE_HASH_DIGEST, digest)) < 0)
+        return rc;
+
+    if ((rc = hace_writel(ctx, HACE_HASH_DATA_LEN, len)) < 0)
+        return rc;
+
+    rc = hace_writel(ctx, HACE_HASH_CMD,
+                     HACE_HASH_CMD_SHA256 | HACE_HASH_CMD_SHA_BE);
+    if (rc < 0)
+        return rc;
+
+    return hace_wait(ctx, len);
+}
+
+int hace_sha256(struct hace *ctx, uint32_t src, uint32_t len, uint32_t scratch,
+                uint8_t *digest)
+{
+    ssize_t got;
+    int rc;
+
+    if ((src & 7) || (scratch & 7) || !len)
+        return -EINVAL;
+
+    if ((rc = hace_idle(ctx)) < 0)
+        return rc;
+
+    if ((rc = hace_hash(ctx, src, len, scratch)) < 0)
+        return rc;
+
+    got = soc_read(ctx->soc, scratch, digest, HACE_SHA256_LEN);
+    if (got < 0)
+        return got;
+
+    return got == HACE_SHA256_LEN ? 0 : -EIO;
+}
+
+int hace_sha256_blocks(struct hace *ctx, uint32_t src, uint32_t len,
+                       uint32_t block, uint32_t scratch, uint8_t *digests)
+{
+    uint32_t digest = scratch;
+    size_t count = 0;
+    ssize_t got;
+    int rc;
+
+    if ((src & 7) || (scratch & 7) || !block || (block & 7))
+        return -EINVAL;
+
+    if ((rc = hace_idle(ctx)) < 0)
+        return rc;
+
+    while (len) {
+        uint32_t chunk = len > block ? block : len;
+
+        if ((rc = hace_hash(ctx, src, chunk, digest)) < 0)
+            return rc;
+
+        src += chunk;
+        len -= chunk;
+        digest += HACE_SHA256_LEN;
+        count++;
+    }
+
+    got = soc_read(ctx->soc, scratch, digests, count * HACE_SHA256_LEN);
+    if (got < 0)
+        return got;
+
+    return (size_t)got == count * HACE_SHA256_LEN ? 0 : -EIO;
+}
+
+static const struct soc_device_id hace_match[] = {
+    { .compatible = "aspeed,ast2500-hace" },
+    { .compatible = "aspeed,ast2600-hace" },
+    { },
+};
+
+static int hace_driver_init(struct soc *soc, struct soc_device *dev)
+{
+    struct hace *ctx;
+    int rc;
+
+    if (!(ctx = soc_alloc(soc, sizeof(*ctx))))
+        return -ENOMEM;
+
+    if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->iomem)) < 0)
+        return rc;
+
+    ctx->soc = soc;
+
+    soc_device_set_drvdata(dev, ctx);
+
+    return 0;
+}
+
+static const struct soc_driver hace_driver = {
+    .name = "hace",
+    .matches = hace_match,
+    .init = hace_driver_init,
+};
+REGISTER_SOC_DRIVER(hace_driver);
+
+struct hace *hace_get(struct soc *soc)
+{
+    return soc_driver_get_drvdata(soc, &hace_driver);
+}
@@ -0,0 +1,34 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _HACE_H
+#define _HACE_H
+
+#include "soc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define HACE_SHA256_LEN 32
+
+struct hace;
+
+/*
+ * SHA-256 @len bytes from @src on the BMC, which can be DRAM or a flash
+ * controller's memory-mapped window. The engine writes the digest to
+ * @scratch, 8-byte aligned free DRAM, from where it's read back.
+ */
+int hace_sha256(struct hace *ctx, uint32_t src, uint32_t len, uint32_t scratch,
+                uint8_t *digest);
+
+/*
+ * SHA-256 each @block bytes of the @len from @src on the BMC, the last block
+ * possibly short. The engine writes the digests to @scratch, 8-byte aligned
+ * free DRAM with room for one per block, and they're read back together into
+ * @digests.
+ */
+int hace_sha256_blocks(struct hace *ctx, uint32_t src, uint32_t len,
+                       uint32_t block, uint32_t scratch, uint8_t *digests);
+
+struct hace *hace_get(struct soc *soc);
+
+#endif
@@ -41,7 +41,7 @@ static const char *ilpcctl_name(struct bridgectl *bridge __unused)
 static int ast2400_ilpcctl_enforce(struct bridgectl *bridge, enum bridge_mode mode)
 {
     struct ilpcctl *ctx = to_ilpcctl(bridge);
-    uint32_t hicrb;
+    uint32_t clear = 0, set = 0;
     int rc;
 
     if (mode == bm_disabled) {
@@ -52,20 +52,15 @@ static int ast2400_ilpcctl_enforce(struct bridgectl *bridge, enum bridge_mode mo
         return rc;
     }
 
-    if ((rc = soc_readl(ctx->soc, ctx->lpc.start + LPC_HICRB, &hicrb)) < 0) {
-        loge("Failed to read LPC HICRB: %d\n", rc);
-        return rc;
-    }
-
     if (mode == bm_restricted) {
-        hicrb |= LPC_HICRB_ILPC_RO;
+        set = LPC_HICRB_ILPC_RO;
     } else {
         assert(mode == bm_permissive);
-        hicrb &= ~LPC_HICRB_ILPC_RO;
+        clear = LPC_HICRB_ILPC_RO;
     }
 
-    if ((rc = soc_writel(ctx->soc, ctx->lpc.start + LPC_HICRB, hicrb)) < 0) {
-        loge("Failed to write LPC HICRB: %d\n", rc);
+    if ((rc = soc_modifyl(ctx->soc, ctx->lpc.start + LPC_HICRB, clear, set)) < 0) {
+        loge("Failed to update LPC HICRB: %d\n", rc);
         return rc;
     }
 
@@ -104,6 +99,14 @@ static int ast2400_ilpcctl_status(struct bridgectl *bridge, enum bridge_mode *mo
     return 0;
 }
 
+static void ast2400_ilpcctl_prefetch(struct bridgectl *bridge, struct soc_snapshot *snap)
+{
+    struct ilpcctl *ctx = to_ilpcctl(bridge);
+
+    sioctl_prefetch(ctx->sioctl, snap);
+    soc_snapshot_add(snap, ctx->lpc.start + LPC_HICRB);
+}
+
 static int ilpcctl_report(struct bridgectl *bridge, int fd, enum bridge_mode *mode)
 {
     struct ilpcctl *ctx = to_ilpcctl(bridge);
@@ -138,37 +141,33 @@ static const struct bridgectl_ops ast2400_ilpcctl_ops = {
     .enforce = ast2400_ilpcctl_enforce,
     .status = ast2400_ilpcctl_status,
     .report = ilpcctl_report,
+    .prefetch = ast2400_ilpcctl_prefetch,
 };
 
 static int ast2600_ilpcctl_enforce(struct bridgectl *bridge, enum bridge_mode mode)
 {
     struct ilpcctl *ctx = to_ilpcctl(bridge);
-    uint32_t hicrb;
+    uint32_t clear = 0, set = 0;
     int rc;
 
-    if ((rc = soc_readl(ctx->soc, ctx->lpc.start + LPC_HICRB, &hicrb)) < 0) {
-        loge("Failed to read HICRB: %d\n", rc);
-        return rc;
-    }
-
     switch (mode) {
         case bm_permissive:
-            hicrb &= ~(LPC_HICRB_ILPC_DIS | LPC_HICRB_ILPC_RO);
+            clear = LPC_HICRB_ILPC_DIS | LPC_HICRB_ILPC_RO;
             break;
         case bm_restricted:
-            hicrb &= ~LPC_HICRB_ILPC_DIS;
-            hicrb |= LPC_HICRB_ILPC_RO;
+            clear = LPC_HICRB_ILPC_DIS;
+            set = LPC_HICRB_ILPC_RO;
             break;
         case bm_disabled:
-            hicrb |= LPC_HICRB_ILPC_DIS;
+            set = LPC_HICRB_ILPC_DIS;
             break;
         default:
             loge("Unrecognised value for mode: %d\n", mode);
             return -EINVAL;
     }
 
-    if ((rc = soc_writel(ctx->soc, ctx->lpc.start + LPC_HICRB, hicrb)) < 0) {
-        loge("Failed to write HICRB: %d\n", rc);
+    if ((rc = soc_modifyl(ctx->soc, ctx->lpc.start + LPC_HICRB, clear, set)) < 0) {
+        loge("Failed to update HICRB: %d\n", rc);
         return rc;
     }
 
@@ -230,11 +229,21 @@ static int ast2600_ilpcctl_status(struct bridgectl *bridge, enum bridge_mode *mo
     return 0;
 }
 
+static void ast2600_ilpcctl_prefetch(struct bridgectl *bridge, struct soc_snapshot *snap)
+{
+    struct ilpcctl *ctx = to_ilpcctl(bridge);
+
+    sioctl_prefetch(ctx->sioctl, snap);
+    bridges_prefetch(ctx->bridges, ctx->gate, snap);
+    soc_snapshot_add(snap, ctx->lpc.start + LPC_HICRB);
+}
+
 static const struct bridgectl_ops ast2600_ilpcctl_ops = {
     .name = ilpcctl_name,
     .enforce = ast2600_ilpcctl_enforce,
     .status = ast2600_ilpcctl_status,
     .report = ilpcctl_report,
+    .prefetch = ast2600_ilpcctl_prefetch,
 };
 
 static const struct soc_device_id ilpcctl_matches[] = {
@@ -250,31 +259,30 @@ static int ilpcctl_driver_init(struct soc *soc, struct soc_device *dev)
     struct ilpcctl *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->lpc)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ops = soc_device_get_match_data(soc, ilpcctl_matches, &dev->node);
     if (!ops) {
         loge("Failed to find ilpcctl ops\n");
-        rc = -EINVAL;
-        goto cleanup_ctx;
+        return -EINVAL;
     }
 
     if (!(ctx->sioctl = sioctl_get(soc))) {
         loge("Failed to acquire SuperIO controller\n");
-        goto cleanup_ctx;
+        return rc;
     }
 
     if (ops == &ast2600_ilpcctl_ops) {
         if ((rc = bridges_device_get_gate(soc, dev, &ctx->bridges, &ctx->gate)) < 0) {
             loge("Failed to fetch bridge gate for iLPC bridge: %d\n", rc);
-            goto cleanup_ctx;
+            return rc;
         }
 
         logd("iLPC bridge gate ID: %d\n", ctx->gate);
@@ -293,9 +301,6 @@ static int ilpcctl_driver_init(struct soc *soc, struct soc_device *dev)
 cleanup_drvdata:
     soc_device_set_drvdata(dev, NULL);
 
-cleanup_ctx:
-    free(ctx);
-
     return rc;
 }
 
@@ -304,8 +309,6 @@ static void ilpcctl_driver_destroy(struct soc_device *dev)
     struct ilpcctl *ctx = soc_device_get_drvdata(dev);
 
     soc_bridge_controller_unregister(ctx->soc, ilpcctl_as_bridgectl(ctx));
-
-    free(ctx);
 }
 
 static const struct soc_driver ilpcctl_driver = {
@@ -2,7 +2,9 @@
 // Copyright (C) 2024 Sarah Maedel
 
 #include <errno.h>
+#include <string.h>
 
+#include "ahb.h"
 #include "jtag.h"
 #include "scu.h"
 #include "soc.h"
@@ -20,6 +22,18 @@
 #define AST_JTAG_EC_ENG_EN              BIT(31)
 #define AST_JTAG_EC_ENG_OUT_EN          BIT(30)
 #define AST_JTAG_EC_FORCE_TMS           BIT(29)
+#define AST_JTAG_EC_INST_LEN(x)         (((x) & 0x3f) << 20)
+#define AST_JTAG_EC_LAST_INST           BIT(17)
+#define AST_JTAG_EC_INST_EN             BIT(16)
+#define AST_JTAG_EC_DATA_LEN(x)         (((x) & 0x3f) << 4)
+#define AST_JTAG_EC_LAST_DATA           BIT(1)
+#define AST_JTAG_EC_DATA_EN             BIT(0)
+
+/* AST_JTAG_ISR/JTAG0C: Interrupt status, write 1 to clear */
+#define AST_JTAG_ISR_INST_PAUSE         BIT(19)
+#define AST_JTAG_ISR_INST_COMPLETE      BIT(18)
+#define AST_JTAG_ISR_DATA_PAUSE         BIT(17)
+#define AST_JTAG_ISR_DATA_COMPLETE      BIT(16)
 
 /* AST_JTAG_SW_MODE/JTAG10: Software mode and status */
 #define AST_JTAG_SW_MODE_EN             BIT(19)
@@ -27,6 +41,14 @@
 #define AST_JTAG_SW_MODE_TMS            BIT(17)
 #define AST_JTAG_SW_MODE_TDIO           BIT(16)
 
+/* States handed to the bridge in one vectored write */
+#define JTAG_BITBANG_BATCH              64
+
+/* Bits the shift engine moves per trigger */
+#define JTAG_SHIFT_CHUNK                32
+/* A chunk takes microseconds, the bound is only against a wedged engine */
+#define JTAG_SHIFT_TIMEOUT_US           1000000
+
 #define AST2400_SCU_RESET_CTRL          0x04
 #define AST2600_SCU_RESET_CTRL          0x40
 #define   SCU_RESET_CTRL_JTAG_MASTER    BIT(22)
@@ -67,13 +89,67 @@ int jtag_route(struct jtag *ctx, uint32_t route)
         return ctx->ops->route(ctx, route);
 }
 
+const enum tap_state jtag_tap_next[16][2] = {
+        [tap_reset] = { tap_idle, tap_reset },
+        [tap_idle] = { tap_idle, tap_drselect },
+        [tap_drselect] = { tap_drcapture, tap_irselect },
+        [tap_drcapture] = { tap_drshift, tap_drexit1 },
+        [tap_drshift] = { tap_drshift, tap_drexit1 },
+        [tap_drexit1] = { tap_drpause, tap_drupdate },
+        [tap_drpause] = { tap_drpause, tap_drexit2 },
+        [tap_drexit2] = { tap_drshift, tap_drupdate },
+        [tap_drupdate] = { tap_idle, tap_drselect },
+        [tap_irselect] = { tap_ircapture, tap_reset },
+        [tap_ircapture] = { tap_irshift, tap_irexit1 },
+        [tap_irshift] = { tap_irshift, tap_irexit1 },
+        [tap_irexit1] = { tap_irpause, tap_irupdate },
+        [tap_irpause] = { tap_irpause, tap_irexit2 },
+        [tap_irexit2] = { tap_irshift, tap_irupdate },
+        [tap_irupdate] = { tap_idle, tap_drselect },
+};
+
+static uint32_t jtag_bitbang_value(uint8_t tck, uint8_t tms, uint8_t tdi)
+{
+        return AST_JTAG_SW_MODE_EN |
+               ((!!tck) * AST_JTAG_SW_MODE_TCK) |
+               ((!!tms) * AST_JTAG_SW_MODE_TMS) |
+               ((!!tdi) * AST_JTAG_SW_MODE_TDIO);
+}
+
 int jtag_bitbang_set(struct jtag *ctx, uint8_t tck, uint8_t tms, uint8_t tdi)
 {
         return jtag_writel(ctx, AST_JTAG_SW_MODE,
-                           AST_JTAG_SW_MODE_EN |
-                           ((!!tck) * AST_JTAG_SW_MODE_TCK) |
-                           ((!!tms) * AST_JTAG_SW_MODE_TMS) |
-                           ((!!tdi) * AST_JTAG_SW_MODE_TDIO));
+                           jtag_bitbang_value(tck, tms, tdi));
+}
+
+int jtag_bitbang_set_states(struct jtag *ctx, const uint8_t *states,
+                            size_t count)
+{
+        struct ahb_iov iov[JTAG_BITBANG_BATCH];
+        uint32_t vals[JTAG_BITBANG_BATCH];
+        size_t i, n;
+        ssize_t rc;
+
+        while (count) {
+                n = count < JTAG_BITBANG_BATCH ? count : JTAG_BITBANG_BATCH;
+
+                for (i = 0; i < n; i++) {
+                        vals[i] = jtag_bitbang_value(states[i] & 4,
+                                                     states[i] & 2,
+                                                     states[i] & 1);
+                        iov[i].phys = ctx->regs.start + AST_JTAG_SW_MODE;
+                        iov[i].base = &vals[i];
+                        iov[i].len = sizeof(vals[i]);
+                }
+
+                if ((rc = ahb_writev(ctx->soc->ahb, iov, n)) < 0)
+                        return rc;
+
+                states += n;
+                count -= n;
+        }
+
+        return 0;
 }
 
 int jtag_bitbang_get(struct jtag *ctx, uint8_t* tdo)
@@ -86,6 +162,148 @@ int jtag_bitbang_get(struct jtag *ctx, uint8_t* tdo)
         return rc;
 }
 
+int jtag_bitbang_scan(struct jtag *ctx, const uint8_t *tdi, uint8_t *tdo,
+                      size_t bits)
+{
+        int rc = 0, commit;
+        size_t i;
+
+        memset(tdo, 0, (bits + 7) / 8);
+
+        soc_txn_begin(ctx->soc);
+        for (i = 0; i < bits; i++) {
+                uint8_t tms = i == bits - 1;
+                uint8_t bit = (tdi[i / 8] >> (i % 8)) & 1;
+                uint8_t out;
+
+                if ((rc = jtag_bitbang_set(ctx, 0, tms, bit)) < 0)
+                        break;
+
+                if ((rc = jtag_bitbang_get(ctx, &out)) < 0)
+                        break;
+
+                if ((rc = jtag_bitbang_set(ctx, 1, tms, bit)) < 0)
+                        break;
+
+                tdo[i / 8] |= out << (i % 8);
+        }
+        commit = soc_txn_commit(ctx->soc);
+
+        return rc < 0 ? rc : commit;
+}
+
+static int jtag_shift_chunk(struct jtag *ctx, bool ir, uint32_t *word,
+                            unsigned int bits, bool last)
+{
+        uint32_t reg = ir ? AST_JTAG_INST : AST_JTAG_DATA;
+        uint32_t ctl, trigger, done, status;
+        struct ahb_iov iov[2];
+        ssize_t rc;
+
+        ctl = AST_JTAG_EC_ENG_EN | AST_JTAG_EC_ENG_OUT_EN;
+        if (ir) {
+                ctl |= AST_JTAG_EC_INST_LEN(bits);
+                ctl |= last * AST_JTAG_EC_LAST_INST;
+                trigger = AST_JTAG_EC_INST_EN;
+                done = last ? AST_JTAG_ISR_INST_COMPLETE : AST_JTAG_ISR_INST_PAUSE;
+        } else {
+                ctl |= AST_JTAG_EC_DATA_LEN(bits);
+                ctl |= last * AST_JTAG_EC_LAST_DATA;
+                trigger = AST_JTAG_EC_DATA_EN;
+                done = last ? AST_JTAG_ISR_DATA_COMPLETE : AST_JTAG_ISR_DATA_PAUSE;
+        }
+
+        if ((rc = jtag_writel(ctx, reg, *word)) < 0)
+                return rc;
+
+        if ((rc = jtag_writel(ctx, AST_JTAG_EC, ctl)) < 0)
+                return rc;
+
+        if ((rc = jtag_writel(ctx, AST_JTAG_EC, ctl | trigger)) < 0)
+                return rc;
+
+        /*
+         * A chunk takes the engine less than a bridge round trip, so the
+         * status usually shows it done in the same request as its bits
+         */
+        iov[0].phys = ctx->regs.start + AST_JTAG_ISR;
+        iov[0].base = &status;
+        iov[0].len = sizeof(status);
+        iov[1].phys = ctx->regs.start + reg;
+        iov[1].base = word;
+        iov[1].len = sizeof(*word);
+        if ((rc = soc_readv(ctx->soc, iov, 2)) < 0)
+                return rc;
+
+        if ((status & done) != done) {
+                rc = soc_poll(ctx->soc, ctx->regs.start + AST_JTAG_ISR, done,
+                              done, JTAG_SHIFT_TIMEOUT_US, NULL, NULL);
+                if (rc < 0)
+                        return rc;
+
+                if ((rc = jtag_readl(ctx, reg, word)) < 0)
+                        return rc;
+        }
+
+        /* Posted, it goes out with the next chunk */
+        if ((rc = jtag_writel(ctx, AST_JTAG_ISR, done)) < 0)
+                return rc;
+
+        /* Captured bits arrive at the top of the register */
+        if (bits < 32)
+                *word >>= 32 - bits;
+
+        return 0;
+}
+
+int jtag_shift(struct jtag *ctx, bool ir, const uint8_t *tdi, uint8_t *tdo,
+               size_t bits)
+{
+        size_t done, i;
+        int rc, cleanup, commit;
+
+        if (!bits)
+                return -EINVAL;
+
+        /* Writes are posted until the engine's status is read back */
+        soc_txn_begin(ctx->soc);
+
+        /* The engine only drives the pins with software mode off */
+        if ((rc = jtag_writel(ctx, AST_JTAG_SW_MODE, 0)) < 0)
+                goto commit;
+
+        for (done = 0; done < bits; done += JTAG_SHIFT_CHUNK) {
+                size_t n = bits - done;
+                uint32_t word = 0;
+
+                if (n > JTAG_SHIFT_CHUNK)
+                        n = JTAG_SHIFT_CHUNK;
+
+                for (i = 0; i < (n + 7) / 8; i++)
+                        word |= (uint32_t)tdi[done / 8 + i] << (8 * i);
+
+                rc = jtag_shift_chunk(ctx, ir, &word, n, done + n == bits);
+                if (rc < 0)
+                        goto restore_sw_mode;
+
+                for (i = 0; i < (n + 7) / 8; i++)
+                        tdo[done / 8 + i] = word >> (8 * i);
+        }
+
+restore_sw_mode:
+        cleanup = jtag_writel(ctx, AST_JTAG_EC,
+                              AST_JTAG_EC_ENG_EN | AST_JTAG_EC_ENG_OUT_EN);
+        if (!cleanup)
+                cleanup = jtag_writel(ctx, AST_JTAG_SW_MODE, AST_JTAG_SW_MODE_EN);
+        if (!rc)
+                rc = cleanup;
+
+commit:
+        commit = soc_txn_commit(ctx->soc);
+
+        return rc < 0 ? rc : commit;
+}
+
 static int ast2400_jtag_release(struct jtag *ctx)
 {
         uint32_t reg;
@@ -164,39 +382,37 @@ static int jtag_driver_init(struct soc *soc, struct soc_device *dev)
         struct jtag *ctx;
         int rc;
 
-        ctx = malloc(sizeof(*ctx));
+        ctx = soc_alloc(soc, sizeof(*ctx));
         if (!ctx) {
                 return -ENOMEM;
         }
 
         ctx->ops = soc_device_get_match_data(soc, jtag_match, &dev->node);
         if (!ctx->ops || !ctx->ops->release || !ctx->ops->route) {
-                rc = -EINVAL;
-                goto cleanup_ctx;
+                return -EINVAL;
         }
 
         if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->regs)) < 0) {
-                goto cleanup_ctx;
+                return rc;
         }
         ctx->refcnt = 1;
         ctx->soc = soc;
 
         ctx->scu = scu_get(soc);
         if (!ctx->scu) {
-                rc = -ENODEV;
-                goto cleanup_ctx;
+                return -ENODEV;
         }
 
         // take JTAG master out of reset 
         if ((rc = ctx->ops->release(ctx)) < 0) {
-                goto cleanup_ctx;
+                return rc;
         }
 
         // enable JTAG master controller
         if ((rc = jtag_writel(ctx, AST_JTAG_EC, 
                              AST_JTAG_EC_ENG_EN | 
                              AST_JTAG_EC_ENG_OUT_EN)) < 0) {
-                goto cleanup_ctx;
+                return rc;
         }
 
         // reset JTAG master controller (peripheral clears bit itself)
@@ -204,21 +420,17 @@ static int jtag_driver_init(struct soc *soc, struct soc_device *dev)
                              AST_JTAG_EC_ENG_EN | 
                              AST_JTAG_EC_ENG_OUT_EN | 
                              AST_JTAG_EC_FORCE_TMS)) < 0) {
-                goto cleanup_ctx;
+                return rc;
         }
 
         // enable software JTAG mode/bitbang
         if ((rc = jtag_writel(ctx, AST_JTAG_SW_MODE, AST_JTAG_SW_MODE_EN)) < 0) {
-                goto cleanup_ctx;
+                return rc;
         }
 
         soc_device_set_drvdata(dev, ctx);
 
         return 0;
-
-cleanup_ctx:
-        free(ctx);
-        return rc;
 }
 
 static void jtag_driver_destroy(struct soc_device *dev)
@@ -243,10 +455,8 @@ struct jtag *jtag_get(struct soc *soc, const char *name)
         return ctx;
 }
 
+/* The context itself goes with the SoC's arena */
 void jtag_put(struct jtag *ctx)
 {
         ctx->refcnt -= 1;
-        if (!ctx->refcnt) {
-                free(ctx);
-        }
 }
@@ -6,6 +6,10 @@
 #include "soc.h"
 #include "bits.h"
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
 #define   SCU_JTAG_NORMAL               0
 #define   SCU_JTAG_IO_TO_PCIE           BIT(14)
 #define   SCU_JTAG_MASTER_TO_PCIE       BIT(15)
@@ -13,10 +17,46 @@
 
 struct jtag;
 
+/* The TAP controller's states, numbered as XSVF has them */
+enum tap_state {
+        tap_reset, tap_idle,
+        tap_drselect, tap_drcapture, tap_drshift, tap_drexit1, tap_drpause,
+        tap_drexit2, tap_drupdate,
+        tap_irselect, tap_ircapture, tap_irshift, tap_irexit1, tap_irpause,
+        tap_irexit2, tap_irupdate,
+};
+
+/* The state reached from each state with TMS low and high */
+extern const enum tap_state jtag_tap_next[16][2];
+
 struct jtag *jtag_get(struct soc *soc, const char *name);
 void jtag_put(struct jtag *ctx);
 int jtag_bitbang_set(struct jtag *ctx, uint8_t tck, uint8_t tms, uint8_t tdi);
+/*
+ * Drive @count states in order, with as few bridge requests as it allows.
+ * States are encoded as for OpenOCD's remote_bitbang: TDI in bit 0, TMS in
+ * bit 1 and TCK in bit 2.
+ */
+int jtag_bitbang_set_states(struct jtag *ctx, const uint8_t *states,
+                            size_t count);
 int jtag_bitbang_get(struct jtag *ctx, uint8_t* tdo);
+/*
+ * Clock @bits through Shift-IR or Shift-DR by bit-bang, LSB first, raising TMS
+ * on the last bit to leave for Exit1. TDO is read before each rising edge.
+ * Each bit's writes are posted behind the read, so a bit costs two bridge
+ * requests rather than three.
+ */
+int jtag_bitbang_scan(struct jtag *ctx, const uint8_t *tdi, uint8_t *tdo,
+                      size_t bits);
 int jtag_route(struct jtag *ctx, uint32_t route);
 
+/*
+ * Scan @bits through IR if @ir is set or DR otherwise using the controller's
+ * shift engine, LSB first. The TAP must be in Run-Test/Idle, and the engine
+ * takes it through Capture, Shift with TMS raised on the last bit, Exit1 and
+ * Update back to Run-Test/Idle.
+ */
+int jtag_shift(struct jtag *ctx, bool ir, const uint8_t *tdi, uint8_t *tdo,
+               size_t bits);
+
 #endif
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "log.h"
+#include "soc/lpcctl.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define LPC_HICR5               0x080
+#define   LPC_HICR5_ENFWH       (1 << 10)
+#define   LPC_HICR5_ENL2H       (1 << 8)
+#define LPC_HICR7               0x088
+#define LPC_HICR8               0x08c
+
+#define LPC_FW_WINDOW_MIN       (1 << 16)
+
+struct lpcctl {
+    struct soc *soc;
+    struct soc_region lpc;
+};
+
+/*
+ * The top half of HICR7 holds the upper bits of the AHB address, and the
+ * bottom half those of the LPC firmware address. Ones in the top half of HICR8
+ * select the bits of a cycle's address replaced from HICR7, ones in its bottom
+ * half the bits passed through, so together they describe a naturally aligned
+ * power of two.
+ */
+int lpcctl_fw_map(struct lpcctl *ctx, uint32_t phys, uint32_t size, uint32_t lpc)
+{
+    uint32_t hicr7, hicr8;
+    int rc;
+
+    if (size < LPC_FW_WINDOW_MIN || (size & (size - 1)) ||
+            ((phys | lpc) & (size - 1)))
+        return -EINVAL;
+
+    hicr7 = phys | (lpc >> 16);
+    hicr8 = ~(size - 1) | ((size - 1) >> 16);
+
+    logd("Mapping LPC FW 0x%08" PRIx32 " to AHB 0x%08" PRIx32 " for %" PRIu32 " bytes\n",
+         lpc, phys, size);
+
+    if ((rc = soc_writel(ctx->soc, ctx->lpc.start + LPC_HICR7, hicr7)) < 0)
+        return rc;
+
+    if ((rc = soc_writel(ctx->soc, ctx->lpc.start + LPC_HICR8, hicr8)) < 0)
+        return rc;
+
+    return soc_modifyl(ctx->soc, ctx->lpc.start + LPC_HICR5, 0,
+                       LPC_HICR5_ENFWH | LPC_HICR5_ENL2H);
+}
+
+int lpcctl_fw_unmap(struct lpcctl *ctx)
+{
+    return soc_modifyl(ctx->soc, ctx->lpc.start + LPC_HICR5,
+                       LPC_HICR5_ENFWH | LPC_HICR5_ENL2H, 0);
+}
+
+int lpcctl_fw_status(struct lpcctl *ctx, struct lpcctl_fw *fw)
+{
+    uint32_t hicr5, hicr7, hicr8;
+    int rc;
+
+    if ((rc = soc_readl(ctx->soc, ctx->lpc.start + LPC_HICR5, &hicr5)) < 0)
+        return rc;
+
+    if ((rc = soc_readl(ctx->soc, ctx->lpc.start + LPC_HICR7, &hicr7)) < 0)
+        return rc;
+
+    if ((rc = soc_readl(ctx->soc, ctx->lpc.start + LPC_HICR8, &hicr8)) < 0)
+        return rc;
+
+    fw->enabled = (hicr5 & (LPC_HICR5_ENFWH | LPC_HICR5_ENL2H)) ==
+                  (LPC_HICR5_ENFWH | LPC_HICR5_ENL2H);
+    fw->ahb.start = hicr7 & 0xffff0000;
+    fw->ahb.length = ~(hicr8 & 0xffff0000) + 1;
+    fw->lpc = hicr7 << 16;
+
+    return 0;
+}
+
+static const struct soc_device_id lpcctl_matches[] = {
+    { .compatible = "aspeed,ast2400-lpc-ctrl" },
+    { .compatible = "aspeed,ast2500-lpc-ctrl" },
+    { .compatible = "aspeed,ast2600-lpc-ctrl" },
+    { },
+};
+
+static int lpcctl_driver_init(struct soc *soc, struct soc_device *dev)
+{
+    struct lpcctl *ctx;
+    int rc;
+
+    ctx = soc_alloc(soc, sizeof(*ctx));
+    if (!ctx) {
+        return -ENOMEM;
+    }
+
+    if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->lpc)) < 0) {
+        return rc;
+    }
+
+    ctx->soc = soc;
+
+    soc_device_set_drvdata(dev, ctx);
+
+    return 0;
+}
+
+static const struct soc_driver lpcctl_driver = {
+    .name = "lpcctl",
+    .matches = lpcctl_matches,
+    .init = lpcctl_driver_init,
+};
+REGISTER_SOC_DRIVER(lpcctl_driver);
+
+struct lpcctl *lpcctl_get(struct soc *soc)
+{
+    return soc_driver_get_drvdata(soc, &lpcctl_driver);
+}
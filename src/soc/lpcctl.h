@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+#ifndef _SOC_LPCCTL_H
+#define _SOC_LPCCTL_H
+
+#include "soc.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* The AHB range host LPC firmware cycles land in once the window's enabled */
+struct lpcctl_fw {
+    struct soc_region ahb;
+    uint32_t lpc;
+    bool enabled;
+};
+
+struct lpcctl;
+
+/*
+ * @size must be a power of two of at least 64KiB, and @phys and @lpc aligned
+ * to it
+ */
+int lpcctl_fw_map(struct lpcctl *ctx, uint32_t phys, uint32_t size, uint32_t lpc);
+int lpcctl_fw_unmap(struct lpcctl *ctx);
+int lpcctl_fw_status(struct lpcctl *ctx, struct lpcctl_fw *fw);
+
+struct lpcctl *lpcctl_get(struct soc *soc);
+
+#endif
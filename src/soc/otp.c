@@ -9,6 +9,7 @@
 #include "rev.h"
 #include "soc.h"
 
+#include <endian.h>
 #include <errno.h>
 #include <stdio.h>
 #include <string.h>
@@ -33,11 +34,27 @@
 #define NUM_OTP_CONF    16
 #define NUM_PROG_TRIES  16
 
+/* Reads finish in microseconds, programming takes milliseconds */
+#define OTP_POLL_MIN_NS 1000ULL
+#define OTP_POLL_MAX_NS 1000000ULL
+#define OTP_TIMEOUT_NS  500000000ULL
+
+/* Operations timed separately by otp_wait_complete() */
+enum otp_op {
+    otp_op_read,
+    otp_op_program,
+    otp_op_write_reg,
+    otp_op_max,
+};
+
 struct otp {
     struct soc *soc;
     struct soc_region iomem;
     uint32_t timings[3];
     uint32_t soak_parameters[3][3];
+    unsigned int soak;
+    /* Completion times observed for each operation at each soak setting */
+    uint64_t expect_ns[otp_op_max][3];
 };
 
 struct otpstrap_status {
@@ -75,44 +92,61 @@ static int otp_writel(struct otp *otp, uint32_t offset, uint32_t val)
     return rc;
 }
 
-static void diff_timespec(const struct timespec *start,
-                          const struct timespec *end, struct timespec *diff)
+static uint64_t otp_now_ns(void)
 {
-    diff->tv_sec = end->tv_sec - start->tv_sec;
-    diff->tv_nsec = end->tv_nsec - start->tv_nsec;
-    if (diff->tv_nsec < 0) {
-        --diff->tv_sec;
-        diff->tv_nsec += 1000000000L;
-    }
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-static int otp_wait_complete(struct otp *otp)
+/*
+ * The first status read is held off for most of the time @op took last at the
+ * current soak setting, as the soak timings stretch programming severalfold.
+ * Polling then backs off from as fast as the bridge allows.
+ *
+ * If the first read already finds the controller idle, the operation took an
+ * unknown part of the holdoff, and the time to the read says nothing but that
+ * the estimate could be shorter. Half of it is taken instead, so the estimate
+ * comes down until a read lands while the controller is still busy.
+ */
+static int otp_wait_complete(struct otp *otp, enum otp_op op)
 {
+    uint64_t *expect = &otp->expect_ns[op][otp->soak];
+    struct ahb_poll_policy policy = {
+        .interval_us = OTP_POLL_MIN_NS / 1000,
+        .max_us = OTP_POLL_MAX_NS / 1000,
+    };
+    uint64_t start, elapsed;
+    uint32_t status;
     int rc;
-    uint32_t reg = 0;
-    struct timespec diff, end, intv, start;
 
-    intv.tv_sec = 0;
-    intv.tv_nsec = 1000000L;
-    clock_gettime(CLOCK_MONOTONIC, &start);
+    start = otp_now_ns();
 
-    do {
-        rc = otp_readl(otp, OTP_STATUS, &reg);
-        if (rc)
+    if (*expect > OTP_POLL_MIN_NS) {
+        ahb_usleep(otp->soc->ahb, *expect * 3 / 4 / 1000);
+
+        if ((rc = otp_readl(otp, OTP_STATUS, &status)) < 0)
             return rc;
 
-        if ((reg & OTP_STATUS_IDLE) == OTP_STATUS_IDLE)
+        if ((status & OTP_STATUS_IDLE) == OTP_STATUS_IDLE) {
+            elapsed = otp_now_ns() - start;
+            *expect = (3 * *expect + elapsed / 2) / 4;
             return 0;
+        }
+    }
 
-        rc = clock_nanosleep(CLOCK_MONOTONIC, 0, &intv, NULL);
-        if (rc)
-            return rc;
+    rc = soc_poll(otp->soc, otp->iomem.start + OTP_STATUS, OTP_STATUS_IDLE,
+                  OTP_STATUS_IDLE, OTP_TIMEOUT_NS / 1000, &policy, NULL);
+    if (rc)
+        return rc;
+
+    elapsed = otp_now_ns() - start;
 
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        diff_timespec(&start, &end, &diff);
-    } while (!diff.tv_sec && diff.tv_nsec < 500000000L);
+    *expect = *expect ? (3 * *expect + elapsed) / 4 : elapsed;
 
-    return -ETIMEDOUT;
+    return 0;
 }
 
 static int otp_program(struct otp *otp, uint32_t addr, uint32_t val)
@@ -128,36 +162,88 @@ static int otp_program(struct otp *otp, uint32_t addr, uint32_t val)
     if ((rc = otp_writel(otp, OTP_COMMAND, OTP_TRIGGER_PROGRAM)) < 0)
         return rc;
 
-    return otp_wait_complete(otp);
+    return otp_wait_complete(otp, otp_op_program);
 }
 
-static int otp_read_reg(struct otp *otp, uint32_t addr, uint32_t *val)
+/*
+ * Unlike otp_program(), the address, mask and trigger go to the bridge in one
+ * batch ahead of the completion poll. Odd data words take the mask of bits to
+ * blow uninverted.
+ */
+static int otp_program_mask(struct otp *otp, uint32_t addr, uint32_t mask)
 {
     int rc;
 
-    if ((rc = otp_writel(otp, OTP_ADDR, addr)) < 0)
+    soc_txn_begin(otp->soc);
+    otp_writel(otp, OTP_ADDR, addr);
+    otp_writel(otp, OTP_COMPARE_1, (addr & 1) ? mask : ~mask);
+    otp_writel(otp, OTP_COMMAND, OTP_TRIGGER_PROGRAM);
+    if ((rc = soc_txn_commit(otp->soc)) < 0)
         return rc;
 
-    if ((rc = otp_writel(otp, OTP_COMMAND, OTP_TRIGGER_READ)) < 0)
-        return rc;
+    return otp_wait_complete(otp, otp_op_program);
+}
 
-    if ((rc = otp_wait_complete(otp)) < 0)
+/* A read fetches a pair of words into COMPARE_1 and COMPARE_2 */
+static int otp_read_words(struct otp *otp, uint32_t addr, uint32_t *val,
+                          unsigned int count)
+{
+    uint32_t words[2];
+    unsigned int i;
+    ssize_t len;
+    int rc;
+
+    if (count > 2)
+        return -EINVAL;
+
+    /* The address and trigger go to the bridge in one batch */
+    soc_txn_begin(otp->soc);
+    otp_writel(otp, OTP_ADDR, addr);
+    otp_writel(otp, OTP_COMMAND, OTP_TRIGGER_READ);
+    if ((rc = soc_txn_commit(otp->soc)) < 0)
         return rc;
 
-    if ((rc = otp_readl(otp, OTP_COMPARE_1, val)) < 0)
+    if ((rc = otp_wait_complete(otp, otp_op_read)) < 0)
         return rc;
 
+    if (count == 1)
+        return otp_readl(otp, OTP_COMPARE_1, val);
+
+    len = soc_read(otp->soc, otp->iomem.start + OTP_COMPARE_1, words,
+                   sizeof(words));
+    if (len < 0)
+        return len;
+    if (len != sizeof(words))
+        return -EIO;
+
+    for (i = 0; i < count; i++)
+        val[i] = le32toh(words[i]);
+
     return 0;
 }
 
+static int otp_read_reg(struct otp *otp, uint32_t addr, uint32_t *val)
+{
+    return otp_read_words(otp, addr, val, 1);
+}
+
+static uint32_t otp_config_address(unsigned int offset)
+{
+    return 0x800 | (offset / 8) * 0x200 | (offset % 8) * 2;
+}
+
 static int otp_read_config(struct otp *otp, int offset, uint32_t *val)
 {
-    uint32_t config_offset = 0x800;
+    return otp_read_reg(otp, otp_config_address(offset), val);
+}
 
-    config_offset |= (offset / 8) * 0x200;
-    config_offset |= (offset % 8) * 2;
+/* Image word @i's address, for reads and programming alike */
+static uint32_t otp_image_address(unsigned int i)
+{
+    if (i < OTP_DATA_WORDS)
+        return i;
 
-    return otp_read_reg(otp, config_offset, val);
+    return otp_config_address(i - OTP_DATA_WORDS);
 }
 
 static int otp_write_reg(struct otp *otp, uint32_t addr, uint32_t val)
@@ -173,7 +259,7 @@ static int otp_write_reg(struct otp *otp, uint32_t addr, uint32_t val)
     if ((rc = otp_writel(otp, OTP_COMMAND, OTP_TRIGGER_WRITE_REG)) < 0)
         return rc;
 
-    return otp_wait_complete(otp);
+    return otp_wait_complete(otp, otp_op_write_reg);
 }
 
 static int otp_set_soak(struct otp *otp, unsigned int soak)
@@ -195,6 +281,8 @@ static int otp_set_soak(struct otp *otp, unsigned int soak)
     if ((rc = otp_writel(otp, OTP_TIMING, otp->timings[soak])) < 0)
         return rc;
 
+    otp->soak = soak;
+
     return 0;
 }
 
@@ -325,6 +413,46 @@ done:
     return rc;
 }
 
+/* Must be called unlocked */
+static int otp_read_image(struct otp *otp, uint32_t *image)
+{
+    unsigned int i;
+    int rc;
+
+    /* Data region addresses are word indices, each read returning two */
+    for (i = 0; i < OTP_DATA_WORDS; i += 2) {
+        if ((rc = otp_read_words(otp, i, &image[i], 2)) < 0)
+            return rc;
+    }
+
+    for (i = 0; i < OTP_CONF_WORDS; i++) {
+        if ((rc = otp_read_config(otp, i, &image[OTP_DATA_WORDS + i])) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+int otp_dump(struct otp *otp, uint32_t *image)
+{
+    int rc;
+
+    if ((rc = otp_writel(otp, OTP_PROTECT_KEY, OTP_PASSWD)) < 0)
+        return rc;
+
+    if ((rc = ahb_session_begin(otp->soc->ahb)) < 0)
+        goto done;
+
+    rc = otp_read_image(otp, image);
+
+    ahb_session_end(otp->soc->ahb);
+
+done:
+    otp_writel(otp, OTP_PROTECT_KEY, 0);
+
+    return rc;
+}
+
 int otp_write_conf(struct otp *otp, unsigned int word, unsigned int bit)
 {
     int rc;
@@ -349,9 +477,7 @@ int otp_write_conf(struct otp *otp, unsigned int word, unsigned int bit)
         goto done;
     }
 
-    address = 0x800;
-    address |= (word / 8) * 0x200;
-    address |= (word % 8) * 2;
+    address = otp_config_address(word);
 
     logi("Writing configuration at OTP %04x with %08x\n", address, bitmask);
     if ((rc = otp_confirm()) < 0)
@@ -421,10 +547,7 @@ int otp_write_strap(struct otp *otp, unsigned int bit, unsigned int val)
         goto done;
     }
 
-    i = (16 + (f * 2)) + word;
-    address = 0x800;
-    address |= (i / 8) * 0x200;
-    address |= (i % 8) * 2;
+    address = otp_config_address((16 + (f * 2)) + word);
 
     logi("Writing strap at OTP %04x with %08x\n", address, bitmask);
     if ((rc = otp_confirm()) < 0)
@@ -438,6 +561,147 @@ done:
     return rc;
 }
 
+/*
+ * Any strap bit left to blow must not be protected, either in the OTP as it
+ * stands or by the plan itself, as protection bits are blown along with the
+ * rest.
+ */
+static int otp_check_plan(const uint32_t *current, const uint32_t *plan)
+{
+    const uint32_t *conf = &current[OTP_DATA_WORDS];
+    const uint32_t *blow = &plan[OTP_DATA_WORDS];
+    unsigned int i;
+
+    for (i = 16; i < 28; i++) {
+        uint32_t protect = conf[30 + (i & 1)] | blow[30 + (i & 1)];
+
+        if (blow[i] & protect) {
+            loge("Cannot program strap option %u: bits %08x are protected\n",
+                 (i - 16) / 2, blow[i] & protect);
+            return -EACCES;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Blows every bit in @plan, retrying the stragglers with the soak settings
+ * alternated per pass. Each pass programs all its words before a single
+ * read-back over the image.
+ */
+static int otp_program_plan(struct otp *otp, uint32_t *plan, unsigned int bits)
+{
+    uint32_t readback[OTP_IMAGE_WORDS];
+    unsigned int tries;
+    unsigned int i;
+    int rc;
+
+    for (tries = 0; tries < NUM_PROG_TRIES; tries++) {
+        unsigned int pending;
+
+        if ((rc = otp_set_soak(otp, (tries % 2) ? 2 : 1)) < 0)
+            return rc;
+
+        for (i = 0; i < OTP_IMAGE_WORDS; i++) {
+            if (!plan[i])
+                continue;
+
+            if ((rc = otp_program_mask(otp, otp_image_address(i), plan[i])) < 0)
+                return rc;
+        }
+
+        if ((rc = otp_read_image(otp, readback)) < 0)
+            return rc;
+
+        pending = 0;
+        for (i = 0; i < OTP_IMAGE_WORDS; i++) {
+            plan[i] &= ~readback[i];
+            pending += __builtin_popcount(plan[i]);
+        }
+
+        if (!pending) {
+            logi("Programmed and verified %u bits in %u passes\n", bits,
+                 tries + 1);
+            return 0;
+        }
+
+        logd("%u of %u bits remain after pass %u\n", pending, bits, tries + 1);
+    }
+
+    for (i = 0; i < OTP_IMAGE_WORDS; i++) {
+        if (plan[i])
+            loge("Failed to program OTP %04x with %08x\n",
+                 otp_image_address(i), plan[i]);
+    }
+
+    return -EREMOTEIO;
+}
+
+int otp_program_image(struct otp *otp, const uint32_t *image, bool exact)
+{
+    uint32_t current[OTP_IMAGE_WORDS];
+    uint32_t plan[OTP_IMAGE_WORDS];
+    unsigned int words = 0;
+    unsigned int bits = 0;
+    unsigned int i;
+    int rc;
+
+    if ((rc = otp_writel(otp, OTP_PROTECT_KEY, OTP_PASSWD)) < 0)
+        return rc;
+
+    if ((rc = ahb_session_begin(otp->soc->ahb)) < 0)
+        goto done;
+
+    if ((rc = otp_read_image(otp, current)) < 0)
+        goto end_session;
+
+    for (i = 0; i < OTP_IMAGE_WORDS; i++) {
+        if (exact && (current[i] & ~image[i])) {
+            loge("OTP %04x has bits %08x set that the image lacks\n",
+                 otp_image_address(i), current[i] & ~image[i]);
+            rc = -EPERM;
+            goto end_session;
+        }
+
+        plan[i] = image[i] & ~current[i];
+        if (plan[i]) {
+            words++;
+            bits += __builtin_popcount(plan[i]);
+        }
+    }
+
+    if (!bits) {
+        logi("OTP already matches the image\n");
+        goto end_session;
+    }
+
+    if ((rc = otp_check_plan(current, plan)) < 0)
+        goto end_session;
+
+    for (i = 0; i < OTP_IMAGE_WORDS; i++) {
+        if (plan[i])
+            logi("Programming OTP %04x with %08x\n", otp_image_address(i),
+                 plan[i]);
+    }
+
+    logi("Programming %u bits across %u words\n", bits, words);
+    if ((rc = otp_confirm()) < 0)
+        goto end_session;
+
+    rc = otp_program_plan(otp, plan, bits);
+
+    otp_set_soak(otp, 0);
+
+end_session:
+    ahb_session_end(otp->soc->ahb);
+
+done:
+    otp_writel(otp, OTP_PROTECT_KEY, 0);
+
+    return rc;
+}
+
 static const struct soc_device_id otp_match[] = {
     { .compatible = "aspeed,ast2600-secure-boot-controller" },
     { },
@@ -448,16 +712,18 @@ static int otp_driver_init(struct soc *soc, struct soc_device *dev)
     struct otp *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->iomem)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
+    ctx->soak = 0;
+    memset(ctx->expect_ns, 0, sizeof(ctx->expect_ns));
 
     if (soc_stepping(soc) >= 2) {
         logi("Detected AST2600 A2\n");
@@ -500,23 +766,12 @@ static int otp_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void otp_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver otp_driver = {
     .name = "otp",
     .matches = otp_match,
     .init = otp_driver_init,
-    .destroy = otp_driver_destroy,
 };
 REGISTER_SOC_DRIVER(otp_driver);
 
@@ -6,16 +6,37 @@
 
 #include "soc.h"
 
+#include <stdbool.h>
+#include <stdint.h>
+
 enum otp_region {
     otp_region_strap,
     otp_region_conf,
 };
 
+/*
+ * An image of the whole OTP as read by otp_dump(): the data region, then the
+ * configuration region, whose words 16 to 31 hold the straps and their
+ * protection bits.
+ */
+#define OTP_DATA_WORDS  2048
+#define OTP_CONF_WORDS  32
+#define OTP_IMAGE_WORDS (OTP_DATA_WORDS + OTP_CONF_WORDS)
+
 struct otp;
 
 int otp_read(struct otp *otp, enum otp_region reg);
+/* @image holds OTP_IMAGE_WORDS */
+int otp_dump(struct otp *otp, uint32_t *image);
 int otp_write_conf(struct otp *otp, unsigned int word, unsigned int bit);
 int otp_write_strap(struct otp *otp, unsigned int bit, unsigned int val);
+/*
+ * Blows the ones in @image, laid out as for otp_dump(), that the OTP lacks, all
+ * in one unlocked session and behind one confirmation. With @exact, @image is
+ * the whole intended OTP and must not lack any ones already blown; otherwise
+ * it's a diff of the bits to set. Everything is verified in one read-back.
+ */
+int otp_program_image(struct otp *otp, const uint32_t *image, bool exact);
 
 struct otp *otp_get(struct soc *soc);
 
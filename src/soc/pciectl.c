@@ -121,49 +121,38 @@ static uint32_t pciectl_pdata_collect_region_mask(const struct pciectl_pdata *pd
 static int
 pciectl_device_enforce(struct pciectl *ctx, const struct pciectl_endpoint *ep, enum bridge_mode mode)
 {
-    uint32_t pcie, misc;
+    uint32_t config = ctx->scu.start + ctx->pdata->config;
+    uint32_t misc = ctx->scu.start + ctx->pdata->misc;
     uint32_t mask;
     int rc;
 
-    if ((rc = soc_readl(ctx->soc, ctx->scu.start + ctx->pdata->config, &pcie)) < 0) {
-        loge("Failed to read PCIe device configuration: %d\n", rc);
-        return rc;
-    }
-
     if (mode == bm_disabled) {
-        pcie &= ~ep->function.mask;
-
-        if ((rc = soc_writel(ctx->soc, ctx->scu.start + ctx->pdata->config, pcie)) < 0) {
+        if ((rc = soc_modifyl(ctx->soc, config, ep->function.mask, 0)) < 0) {
             loge("Failed to disable PCIe MMIO regions: %d\n", rc);
         }
 
         return rc;
     }
 
-    if ((rc = soc_readl(ctx->soc, ctx->scu.start + ctx->pdata->misc, &misc)) < 0) {
-        loge("Failed to read PCIe MMIO region configuration: %d\n", rc);
-        return rc;
-    }
-
     mask = pciectl_pdata_collect_region_mask(ctx->pdata, ep);
     if (!mask) {
         return 0;
     }
 
     if (mode == bm_restricted) {
-        misc |= mask;
+        rc = soc_modifyl(ctx->soc, misc, 0, mask);
     } else {
         assert(mode == bm_permissive);
-        misc &= ~mask;
+        rc = soc_modifyl(ctx->soc, misc, mask, 0);
     }
 
-    if ((rc = soc_writel(ctx->soc, ctx->scu.start + ctx->pdata->misc, misc)) < 0) {
-        loge("Failed to write PCIe MMIO region configuration: %d\n", rc);
+    if (rc < 0) {
+        loge("Failed to update PCIe MMIO region configuration: %d\n", rc);
         return rc;
     }
 
-    pcie |= ep->device.mask | ep->function.mask;
-    if ((rc = soc_writel(ctx->soc, ctx->scu.start + ctx->pdata->config, pcie)) < 0) {
+    rc = soc_modifyl(ctx->soc, config, 0, ep->device.mask | ep->function.mask);
+    if (rc < 0) {
         loge("Failed to enable PCIe VGA device: %d\n", rc);
     }
 
@@ -358,6 +347,29 @@ static int pciectl_report(struct pciectl *ctx, int fd, enum device_function func
     return 0;
 }
 
+static void
+pciectl_prefetch(struct pciectl *ctx, struct soc_snapshot *snap, enum device_function function)
+{
+    const struct pciectl_endpoint *curr;
+    int id;
+
+    for (curr = ctx->pdata->endpoints;
+            curr->function.type != device_function_none;
+            curr++) {
+        if (curr->function.type != function) {
+            continue;
+        }
+
+        if (ctx->bridges &&
+                !bridges_device_get_gate_by_name(ctx->soc, ctx->dev, curr->gate, NULL, &id)) {
+            bridges_prefetch(ctx->bridges, id, snap);
+        }
+    }
+
+    soc_snapshot_add(snap, ctx->scu.start + ctx->pdata->config);
+    soc_snapshot_add(snap, ctx->scu.start + ctx->pdata->misc);
+}
+
 static const char *p2actl_name(struct bridgectl *bridge __unused)
 {
     return "p2a";
@@ -417,11 +429,17 @@ static int p2actl_report(struct bridgectl *bridge, int fd, enum bridge_mode *mod
     return 0;
 }
 
+static void p2actl_prefetch(struct bridgectl *bridge, struct soc_snapshot *snap)
+{
+    pciectl_prefetch(p2actl_to_pciectl(bridge), snap, device_function_mmio);
+}
+
 static const struct bridgectl_ops p2actl_ops = {
     .name = p2actl_name,
     .enforce = p2actl_enforce,
     .status = p2actl_status,
     .report = p2actl_report,
+    .prefetch = p2actl_prefetch,
 };
 
 static const char *xdmactl_name(struct bridgectl *bridge __unused)
@@ -496,11 +514,20 @@ static int xdmactl_report(struct bridgectl *bridge, int fd, enum bridge_mode *mo
 }
 
 
+static void xdmactl_prefetch(struct bridgectl *bridge, struct soc_snapshot *snap)
+{
+    struct pciectl *ctx = xdmactl_to_pciectl(bridge);
+
+    pciectl_prefetch(ctx, snap, device_function_xdma);
+    sdmc_prefetch_xdma(ctx->sdmc, snap);
+}
+
 static const struct bridgectl_ops xdmactl_ops = {
     .name = xdmactl_name,
     .enforce = xdmactl_enforce,
     .status = xdmactl_status,
     .report = xdmactl_report,
+    .prefetch = xdmactl_prefetch,
 };
 
 static const struct pciectl_p2a_region ast2400_p2a_regions[] = {
@@ -764,18 +791,18 @@ static int pciectl_driver_init(struct soc *soc, struct soc_device *dev)
     struct pciectl *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->scu)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     if (!(ctx->sdmc = sdmc_get(soc))) {
         loge("Failed to acquire SDMC controller\n");
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
@@ -785,7 +812,7 @@ static int pciectl_driver_init(struct soc *soc, struct soc_device *dev)
         ctx->bridges = bridges_get_by_device(soc, dev);
         if (!ctx->bridges) {
             loge("Failed to aquire bridge controller\n");
-            goto cleanup_ctx;
+            return rc;
         }
     }
 
@@ -804,9 +831,6 @@ static int pciectl_driver_init(struct soc *soc, struct soc_device *dev)
 cleanup_drvdata:
     soc_device_set_drvdata(dev, NULL);
 
-cleanup_ctx:
-    free(ctx);
-
     return rc;
 }
 
@@ -815,8 +839,6 @@ static void pciectl_driver_destroy(struct soc_device *dev)
     struct pciectl *ctx = soc_device_get_drvdata(dev);
 
     soc_bridge_controller_unregister(ctx->soc, p2actl_as_bridgectl(ctx));
-
-    free(ctx);
 }
 
 static const struct soc_driver pciectl_driver = {
@@ -19,11 +19,26 @@ int scu_readl(struct scu *ctx, uint32_t reg, uint32_t *value)
 	return soc_readl(ctx->soc, ctx->regs.start + reg, value);
 }
 
+int scu_readl_cached(struct scu *ctx, uint32_t reg, uint32_t *value)
+{
+	return soc_readl_cached(ctx->soc, ctx->regs.start + reg, value);
+}
+
+void scu_invalidate(struct scu *ctx, uint32_t reg)
+{
+	soc_shadow_invalidate(ctx->soc, ctx->regs.start + reg);
+}
+
 int scu_writel(struct scu *ctx, uint32_t reg, uint32_t value)
 {
 	return soc_writel(ctx->soc, ctx->regs.start + reg, value);
 }
 
+int scu_modifyl(struct scu *ctx, uint32_t reg, uint32_t clear, uint32_t set)
+{
+	return soc_modifyl(ctx->soc, ctx->regs.start + reg, clear, set);
+}
+
 static int scu_is_locked(struct scu *ctx, bool *locked)
 {
 	uint32_t value;
@@ -50,35 +65,31 @@ static int scu_driver_init(struct soc *soc, struct soc_device *dev)
 	struct scu *ctx;
 	int rc;
 
-	ctx = malloc(sizeof(*ctx));
+	ctx = soc_alloc(soc, sizeof(*ctx));
 	if (!ctx) {
 		return -ENOMEM;
 	}
 
 	if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->regs)) < 0) {
-		goto cleanup_ctx;
+		return rc;
 	}
 	ctx->refcnt = 1;
 	ctx->soc = soc;
 
 	if ((rc = scu_is_locked(ctx, &ctx->was_locked)) < 0) {
-		goto cleanup_ctx;
+		return rc;
 	}
 
 	if (ctx->was_locked) {
 		logd("Unlocking SCU\n");
 		if ((rc = scu_unlock(ctx)) < 0) {
-			goto cleanup_ctx;
+			return rc;
 		}
 	}
 
 	soc_device_set_drvdata(dev, ctx);
 
 	return 0;
-
-cleanup_ctx:
-	free(ctx);
-	return rc;
 }
 
 static void scu_driver_destroy(struct soc_device *dev)
@@ -120,6 +131,5 @@ void scu_put(struct scu *ctx)
 				loge("Failed to re-lock SCU\n");
 			}
 		}
-		free(ctx);
 	}
 }
@@ -11,6 +11,10 @@ struct scu *scu_get(struct soc *soc);
 void scu_put(struct scu *ctx);
 
 int scu_readl(struct scu *ctx, uint32_t reg, uint32_t *val);
+int scu_readl_cached(struct scu *ctx, uint32_t reg, uint32_t *val);
+/* For registers whose value is changed by a write elsewhere, e.g. W1C pairs */
+void scu_invalidate(struct scu *ctx, uint32_t reg);
 int scu_writel(struct scu *ctx, uint32_t reg, uint32_t val);
+int scu_modifyl(struct scu *ctx, uint32_t reg, uint32_t clear, uint32_t set);
 
 #endif
@@ -73,9 +73,15 @@ static int sdmc_readl(struct sdmc *ctx, uint32_t off, uint32_t *val)
     return soc_readl(ctx->soc, ctx->iomem.start + off, val);
 }
 
-static int sdmc_writel(struct sdmc *ctx, uint32_t off, uint32_t val)
+static int sdmc_readl_cached(struct sdmc *ctx, uint32_t off, uint32_t *val)
 {
-    return soc_writel(ctx->soc, ctx->iomem.start + off, val);
+    return soc_readl_cached(ctx->soc, ctx->iomem.start + off, val);
+}
+
+static int sdmc_modifyl(struct sdmc *ctx, uint32_t off, uint32_t clear,
+                        uint32_t set)
+{
+    return soc_modifyl(ctx->soc, ctx->iomem.start + off, clear, set);
 }
 
 static void sdmc_dram_region(struct sdmc *ctx, uint32_t mcr_conf,
@@ -90,7 +96,7 @@ int sdmc_get_dram(struct sdmc *ctx, struct soc_region *dram)
     uint32_t mcr_conf;
     int rc;
 
-    if ((rc = sdmc_readl(ctx, MCR_CONFIG, &mcr_conf)) < 0)
+    if ((rc = sdmc_readl_cached(ctx, MCR_CONFIG, &mcr_conf)) < 0)
         return rc;
 
     sdmc_dram_region(ctx, mcr_conf, dram);
@@ -104,7 +110,7 @@ int sdmc_get_vram(struct sdmc *ctx, struct soc_region *vram)
     uint32_t mcr_conf;
     int rc;
 
-    if ((rc = sdmc_readl(ctx, MCR_CONFIG, &mcr_conf)) < 0)
+    if ((rc = sdmc_readl_cached(ctx, MCR_CONFIG, &mcr_conf)) < 0)
         return rc;
 
     sdmc_dram_region(ctx, mcr_conf, &dram);
@@ -126,23 +132,15 @@ int sdmc_constrains_xdma(struct sdmc *ctx)
     return !!(mcr_gmp & ctx->pdata->gmp_xdma_mask);
 }
 
-int sdmc_configure_xdma(struct sdmc *ctx, bool constrain)
+void sdmc_prefetch_xdma(struct sdmc *ctx, struct soc_snapshot *snap)
 {
-    uint32_t mcr_gmp;
-    int rc;
-
-    if ((rc = sdmc_readl(ctx, MCR_GMP, &mcr_gmp)) < 0) {
-        return rc;
-    }
-
-    mcr_gmp &= ~ctx->pdata->gmp_xdma_mask;
-    mcr_gmp |= (ctx->pdata->gmp_xdma_mask * constrain);
-
-    if ((rc = sdmc_writel(ctx, MCR_GMP, mcr_gmp)) < 0) {
-        return rc;
-    }
+    soc_snapshot_add(snap, ctx->iomem.start + MCR_GMP);
+}
 
-    return 0;
+int sdmc_configure_xdma(struct sdmc *ctx, bool constrain)
+{
+    return sdmc_modifyl(ctx, MCR_GMP, ctx->pdata->gmp_xdma_mask,
+                        ctx->pdata->gmp_xdma_mask * constrain);
 }
 
 static const struct soc_device_id sdmc_match[] = {
@@ -167,26 +165,25 @@ static int sdmc_driver_init(struct soc *soc, struct soc_device *dev)
     struct sdmc *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->iomem)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     if (!(ctx->pdata = soc_device_get_match_data(soc, sdmc_match, &dev->node))) {
-        rc = -EINVAL;
-        goto cleanup_ctx;
+        return -EINVAL;
     }
 
     if ((rc = soc_device_from_type(soc, "memory", &dn))) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     if ((rc = soc_device_get_memory(soc, &dn, &ctx->dram)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
@@ -194,23 +191,12 @@ static int sdmc_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void sdmc_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver sdmc_driver = {
     .name = "sdmc",
     .matches = sdmc_match,
     .init = sdmc_driver_init,
-    .destroy = sdmc_driver_destroy,
 };
 REGISTER_SOC_DRIVER(sdmc_driver);
 
@@ -5,15 +5,22 @@
 /* Code shamelessly stolen from skiboot and then hacked to death */
 
 #define _GNU_SOURCE
+#include "ahb.h"
+#include "array.h"
 #include "ast.h"
 #include "bits.h"
+#include "cache.h"
 #include "clk.h"
 #include "log.h"
 #include "sfc.h"
+#include "sdmc.h"
+#include "span.h"
+#include "timing.h"
 
 #include "ccan/container_of/container_of.h"
 
 #include <errno.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
@@ -26,6 +33,12 @@
 #endif
 
 #define CALIBRATE_BUF_SIZE	16384
+/* Read first at each timing point, most bad settings show it up already */
+#define CALIBRATE_SCREEN_SIZE	1024
+#define CALIBRATE_PASSES	10
+#define SFC_WIP_TIMEOUT_US	5000000
+/* User mode data words read per vectored access */
+#define SFC_USER_IOV_MAX	16
 
 #define SFC_ERR(fmt, ...) loge(fmt, ##__VA_ARGS__)
 #define SFC_INF(fmt, ...) logi(fmt, ##__VA_ARGS__)
@@ -37,23 +50,55 @@
 #define	     FMC_CE_TYPE_CE1_WP		BIT(17)
 #define	     FMC_CE_TYPE_CE0_WP		BIT(16)
 #define   FMC_CE_CTRL			0x04
+#define   FMC_INT_CTRL			0x08
+#define	     FMC_INT_CTRL_DMA_STATUS	BIT(11)
 #define   FMC_CE0_CTRL			0x10
+#define   FMC_DMA_CTRL			0x80
+#define	     FMC_DMA_CTRL_CKSUM		BIT(2)
+#define	     FMC_DMA_CTRL_ENABLE	BIT(0)
+#define   FMC_DMA_FLASH			0x84
+#define   FMC_DMA_DRAM			0x88
+#define   FMC_DMA_LEN			0x8c
+#define   FMC_DMA_CKSUM			0x90
 #define   FMC_TIMING			0x94
 
+/* Bounds on a single DMA run, in bytes and time */
+#define FMC_DMA_MAX			(1 << 24)
+#define FMC_DMA_TIMEOUT_MS		5000
+
+/* Direct reads shorter than this aren't worth a round trip through DRAM */
+#define SFC_DMA_MIN			(64 << 10)
+#define SFC_DMA_PROBE			4096
+
 /* SPI (Host) Flash Memory Controller */
 #define   SMC_CONF			0x00
 #define   SMC_CE0_CTRL			0x10
 #define   SMC_TIMING			0x94
 
+/* Both controllers' segment registers, window bounds in units of 8MiB */
+#define SFC_CE_ADDR(cs)			(0x30 + 4 * (cs))
+#define SFC_SEG_START(val)		((((val) >> 16) & 0xff) << 23)
+#define SFC_SEG_END(val)		((((val) >> 24) & 0xff) << 23)
+
+#define FMC_CS_MAX			3
+#define SMC_CS_MAX			2
+
 struct sfc_data {
     struct soc *soc;
     struct soc_region iomem;
+    /* All of the controller's decode range, and the part for the current CS */
+    struct soc_region window;
     struct soc_region flash;
     struct clk *clk;
 
     /* We have 2 controllers, one for the BMC flash, one for the PNOR */
     uint8_t    type;
 
+    /* The chip-select in use, of ncs */
+    uint8_t cs;
+    uint8_t ncs;
+    uint32_t ctl_base;
+
     uint32_t type_reg;
     uint32_t type_wp_mask;
 
@@ -70,8 +115,13 @@ struct sfc_data {
     uint32_t fread_timing_reg;
     uint32_t fread_timing_val;
 
-    /* Current 4b mode */
+    /* Current 4b mode, and whether it's by the chip's 4B opcodes */
     bool mode_4b;
+    bool native_4b;
+
+    /* DMA reads are checked against direct reads once before use */
+    bool dma_probed;
+    bool dma_usable;
 
     /* Callbacks */
     struct sfc ops;
@@ -103,6 +153,28 @@ flash_write(struct sfc_data *ctx, uint32_t offset, const void *buf, size_t len)
 
 static uint32_t ast_ahb_freq;
 
+static bool sfc_fast_reads;
+
+void sfc_enable_fast_reads(void)
+{
+    sfc_fast_reads = true;
+}
+
+/* Zero length if no scratch region was given */
+static uint32_t sfc_dma_phys;
+static uint32_t sfc_dma_len;
+
+int sfc_set_dma_scratch(uint32_t phys, uint32_t len)
+{
+    if ((phys & 3) || len < SFC_DMA_PROBE + 4 || phys + len < phys)
+	return -EINVAL;
+
+    sfc_dma_phys = phys;
+    sfc_dma_len = len & ~3u;
+
+    return 0;
+}
+
 static const uint32_t ast_ct_hclk_divs[] = {
     0xf, /* HCLK */
     0x7, /* HCLK/2 */
@@ -128,13 +200,17 @@ static int fl_read_stat(struct sfc *ct, uint8_t *stat)
     return ct->cmd_rd(ct, CMD_RDSR, false, 0, stat, 1);
 }
 
-/* Synchronous write completion, probably need a yield hook */
+/*
+ * Synchronous write completion. Only used here for register writes, which
+ * take tens of milliseconds at worst, so back off from a short first wait
+ * but give up well short of what an erase could take.
+ */
 static int fl_sync_wait_idle(struct sfc *ct)
 {
+    uint32_t waited = 0, delay = 100;
     uint8_t stat;
     int rc;
 
-    /* XXX Add timeout */
     for (;;) {
 	rc = fl_read_stat(ct, &stat);
 	if (rc) return rc;
@@ -143,9 +219,15 @@ static int fl_sync_wait_idle(struct sfc *ct)
 		fl_micron_status(ct);
 	    return 0;
 	}
-	usleep(100);
+	if (waited >= SFC_WIP_TIMEOUT_US) {
+	    SFC_ERR("AST: Timed out waiting for the chip\n");
+	    return -ETIMEDOUT;
+	}
+	ahb_usleep(ct->priv, delay);
+	waited += delay;
+	if (delay < 10000)
+	    delay *= 2;
     }
-    /* return FLASH_ERR_WIP_TIMEOUT; */
 }
 
 /* Exported for internal use */
@@ -228,11 +310,56 @@ static int sfc_send_addr(struct sfc_data *ct, uint32_t addr)
     return rc == len ? 0 : rc;
 }
 
+/*
+ * Pulls whole words of user mode data. Bridges whose bulk reads are exact read
+ * the window in one go, the others read it as registers, one vectored access
+ * for up to SFC_USER_IOV_MAX words so bridges that pipeline them can.
+ */
+static int sfc_user_read_words(struct sfc_data *ct, uint8_t *buf, uint32_t len)
+{
+    struct ahb_iov iov[SFC_USER_IOV_MAX];
+    uint32_t vals[SFC_USER_IOV_MAX];
+    uint32_t i, n;
+    ssize_t rc;
+
+    if (ct->soc->ahb->drv->caps.exact_reads) {
+        if ((rc = soc_read(ct->soc, ct->flash.start, buf, len)) < 0)
+            return rc;
+
+        return (uint32_t)rc == len ? 0 : -EIO;
+    }
+
+    while (len) {
+        n = len / 4 < SFC_USER_IOV_MAX ? len / 4 : SFC_USER_IOV_MAX;
+        for (i = 0; i < n; i++) {
+            iov[i].phys = ct->flash.start;
+            iov[i].base = &vals[i];
+            iov[i].len = sizeof(vals[i]);
+        }
+
+        if ((rc = soc_readv(ct->soc, iov, n)) < 0)
+            return rc;
+
+        for (i = 0; i < n; i++) {
+            *buf++ = (vals[i] >>  0) & 0xff;
+            *buf++ = (vals[i] >>  8) & 0xff;
+            *buf++ = (vals[i] >> 16) & 0xff;
+            *buf++ = (vals[i] >> 24) & 0xff;
+        }
+
+        len -= n * 4;
+    }
+
+    return 0;
+}
+
 static int sfc_cmd_rd(struct sfc *ctrl, uint8_t cmd,
 			 bool has_addr, uint32_t addr, void *buffer,
 			 uint32_t size)
 {
     struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+    uint64_t span = span_begin();
+    uint32_t len = size;
     int rc;
 
     rc = sfc_start_cmd(ct, cmd);
@@ -256,6 +383,14 @@ static int sfc_cmd_rd(struct sfc *ctrl, uint8_t cmd,
          *
          * Writes don't have this problem, thankfully.
          */
+        if (size >= 4) {
+            i = size & ~3u;
+            rc = sfc_user_read_words(ct, buffer, i);
+            if (rc)
+                goto bail;
+            size -= i;
+        }
+
         while (size) {
             uint8_t *buf = buffer;
             uint32_t val = 0;
@@ -274,6 +409,7 @@ static int sfc_cmd_rd(struct sfc *ctrl, uint8_t cmd,
 
 bail:
     sfc_end_cmd(ct);
+    span_end("sfc", "cmd_rd", span, addr, len);
 
     return rc;
 }
@@ -283,6 +419,7 @@ static int sfc_cmd_wr(struct sfc *ctrl, uint8_t cmd,
 			 uint32_t size)
 {
     struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+    uint64_t span = span_begin();
     ssize_t rc;
 
     rc = sfc_start_cmd(ct, cmd);
@@ -298,16 +435,109 @@ static int sfc_cmd_wr(struct sfc *ctrl, uint8_t cmd,
 	rc = flash_write(ct, 0, buffer, size);
 bail:
     sfc_end_cmd(ct);
+    span_end("sfc", "cmd_wr", span, addr, size);
 
     return rc == (ssize_t)size ? 0 : rc;
 }
 
+/* The read commands sfc_setup() may settle on, and their 4B address forms */
+static const uint8_t sfc_read_cmds_4b[][2] = {
+    { CMD_READ, CMD_READ4 },
+    { CMD_FAST_READ, CMD_FAST_READ4 },
+    { 0x3b, 0x3c }, /* DREAD */
+    { 0xbb, 0xbc }, /* 2READ */
+};
+
+static int sfc_map_read_cmd(uint32_t *ctl, bool to_4b)
+{
+    uint32_t cmd = (*ctl >> 16) & 0xff;
+    unsigned int i;
+
+    /* No command means the default for the read mode */
+    if (!cmd)
+	cmd = (*ctl & 3) ? CMD_FAST_READ : CMD_READ;
+
+    for (i = 0; i < sizeof(sfc_read_cmds_4b) / sizeof(sfc_read_cmds_4b[0]); i++) {
+	if (sfc_read_cmds_4b[i][!to_4b] == cmd) {
+	    *ctl &= ~(0xffU << 16);
+	    *ctl |= (uint32_t)sfc_read_cmds_4b[i][to_4b] << 16;
+	    return 0;
+	}
+    }
+
+    return -EOPNOTSUPP;
+}
+
+static void sfc_iov(struct ahb_iov *iov, uint32_t phys, const void *base,
+		    size_t len)
+{
+    iov->phys = phys;
+    iov->base = (void *)base;
+    iov->len = len;
+}
+
+/*
+ * The sfc_start_cmd()/sfc_end_cmd() sequences for WREN and a page program as
+ * one vectored write, so the bridge sees a single request per page rather
+ * than a dozen. WEN isn't read back in between; a page the chip ignored is
+ * left for verification to find.
+ */
+static int sfc_program(struct sfc *ctrl, uint8_t cmd, uint32_t addr,
+		       const void *buf, uint32_t size)
+{
+    struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+    uint32_t reg = ct->iomem.start + ct->ctl_reg;
+    uint32_t win = ct->flash.start;
+    uint32_t vals[3] = {
+	ct->ctl_val | 7, /* user mode, CE# dropped */
+	ct->ctl_val | 3, /* user mode, CE# active */
+	ct->ctl_read_val,
+    };
+    uint8_t wren = CMD_WREN;
+    struct ahb_iov iov[10];
+    uint32_t be = htobe32(addr);
+    uint64_t span = span_begin();
+    size_t n = 0;
+    ssize_t rc;
+
+    sfc_iov(&iov[n++], reg, &vals[0], 4);
+    sfc_iov(&iov[n++], reg, &vals[1], 4);
+    sfc_iov(&iov[n++], win, &wren, 1);
+    sfc_iov(&iov[n++], reg, &vals[0], 4);
+    sfc_iov(&iov[n++], reg, &vals[1], 4);
+    sfc_iov(&iov[n++], win, &cmd, 1);
+    if (ct->mode_4b)
+	sfc_iov(&iov[n++], win, &be, 4);
+    else
+	sfc_iov(&iov[n++], win, (uint8_t *)&be + 1, 3);
+    sfc_iov(&iov[n++], win, buf, size);
+    sfc_iov(&iov[n++], reg, &vals[0], 4);
+    sfc_iov(&iov[n++], reg, &vals[2], 4);
+
+    if ((rc = ahb_writev(ct->soc->ahb, iov, n)) < 0)
+	return rc;
+
+    span_end("sfc", "program", span, addr, size);
+
+    return 0;
+}
+
 static int sfc_set_4b(struct sfc *ctrl, bool enable)
 {
     struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+    bool native = enable && (ctrl->finfo->flags & FL_4B_OPS);
+    uint32_t read_val = ct->ctl_read_val;
     uint32_t ce_ctrl = 0;
     int rc;
 
+    /*
+     * With the chip's 4B opcodes, reads must use the 4B form of the read
+     * command as well, the chip itself is never switched over
+     */
+    if (native != ct->native_4b &&
+	    (rc = sfc_map_read_cmd(&read_val, native)) < 0)
+	return rc;
+
     if (ct->type == SFC_TYPE_FMC && ct->ops.finfo->size > 0x1000000) {
 	rc = sfc_readl(ct, FMC_CE_CTRL, &ce_ctrl);
 	if (rc < 0)
@@ -320,16 +550,18 @@ static int sfc_set_4b(struct sfc *ctrl, bool enable)
      * we don't restore the mode of the flash itself so we need
      * to leave the controller in a compatible setup
      */
+    ct->ctl_read_val = read_val;
     if (enable) {
 	ct->ctl_val |= 0x2000;
 	ct->ctl_read_val |= 0x2000;
-	ce_ctrl |= 0x1;
+	ce_ctrl |= BIT(ct->cs);
     } else {
 	ct->ctl_val &= ~0x2000;
 	ct->ctl_read_val &= ~0x2000;
-	ce_ctrl &= ~0x1;
+	ce_ctrl &= ~BIT(ct->cs);
     }
     ct->mode_4b = enable;
+    ct->native_4b = native;
 
     /* Update read mode */
     rc = sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val);
@@ -342,15 +574,163 @@ static int sfc_set_4b(struct sfc *ctrl, bool enable)
     return 0;
 }
 
+/*
+ * Run the FMC DMA engine over @len bytes of flash at @pos, either copying
+ * them to @dram or, with @cksum set, only summing them. Both @pos and @len
+ * must be word aligned.
+ */
+static int sfc_dma_run(struct sfc_data *ct, uint32_t pos, uint32_t dram,
+		       uint32_t len, bool cksum, uint32_t *sum)
+{
+    uint32_t ctrl = FMC_DMA_CTRL_ENABLE | (cksum ? FMC_DMA_CTRL_CKSUM : 0);
+    int rc, cleanup;
+
+    if ((rc = sfc_writel(ct, FMC_DMA_CTRL, 0)) < 0)
+	return rc;
+
+    if ((rc = sfc_writel(ct, FMC_DMA_FLASH, ct->flash.start + pos)) < 0)
+	return rc;
+
+    if (!cksum && (rc = sfc_writel(ct, FMC_DMA_DRAM, dram)) < 0)
+	return rc;
+
+    if ((rc = sfc_writel(ct, FMC_DMA_LEN, len)) < 0)
+	return rc;
+
+    if ((rc = sfc_writel(ct, FMC_DMA_CTRL, ctrl)) < 0)
+	return rc;
+
+    /* Each poll is a bridge round trip, that's enough of a pause */
+    rc = soc_poll(ct->soc, ct->iomem.start + FMC_INT_CTRL,
+		  FMC_INT_CTRL_DMA_STATUS, FMC_INT_CTRL_DMA_STATUS,
+		  FMC_DMA_TIMEOUT_MS * 1000ULL, NULL, NULL);
+    if (rc == -ETIMEDOUT)
+	SFC_ERR("AST: Flash DMA timed out\n");
+    if (rc < 0)
+	goto disable;
+
+    if (cksum)
+	rc = sfc_readl(ct, FMC_DMA_CKSUM, sum);
+
+disable:
+    /* Disabling the engine also clears the completion status */
+    cleanup = sfc_writel(ct, FMC_DMA_CTRL, 0);
+
+    return rc < 0 ? rc : cleanup;
+}
+
+/*
+ * The scratch region is only the user's word that it's free, and the engine's
+ * behaviour is only as good as our reading of the datasheet. Check that a DMA
+ * of a known chunk lands where and as it should, and no further, before
+ * trusting it with bulk reads.
+ */
+static bool sfc_dma_probe(struct sfc_data *ct)
+{
+    struct soc_region dram;
+    uint8_t *direct, *dma;
+    bool usable = false;
+    struct sdmc *sdmc;
+    uint32_t i;
+    int rc;
+
+    if (ct->dma_probed)
+	return ct->dma_usable;
+
+    ct->dma_probed = true;
+
+    if (ct->type != SFC_TYPE_FMC || !sfc_dma_len)
+	return false;
+
+    if (!(sdmc = sdmc_get(ct->soc)) || sdmc_get_dram(sdmc, &dram) < 0 ||
+	    sfc_dma_phys < dram.start ||
+	    sfc_dma_phys + sfc_dma_len > dram.start + dram.length) {
+	SFC_ERR("AST: Flash DMA scratch region isn't in DRAM\n");
+	return false;
+    }
+
+    if (!(direct = malloc(2 * (SFC_DMA_PROBE + 4))))
+	return false;
+    dma = direct + SFC_DMA_PROBE + 4;
+
+    if ((rc = flash_read(ct, 0, direct, SFC_DMA_PROBE)) < 0)
+	goto done;
+
+    /* Seed the scratch with the complement so a short or absent copy shows */
+    for (i = 0; i < SFC_DMA_PROBE; i++)
+	dma[i] = ~direct[i];
+    memset(dma + SFC_DMA_PROBE, 0x5a, 4);
+
+    if ((rc = soc_write(ct->soc, sfc_dma_phys, dma, SFC_DMA_PROBE + 4)) < 0)
+	goto done;
+
+    if ((rc = sfc_dma_run(ct, 0, sfc_dma_phys, SFC_DMA_PROBE, false, NULL)) < 0)
+	goto done;
+
+    if ((rc = soc_read(ct->soc, sfc_dma_phys, dma, SFC_DMA_PROBE + 4)) < 0)
+	goto done;
+
+    usable = !memcmp(dma, direct, SFC_DMA_PROBE) &&
+	     dma[SFC_DMA_PROBE] == 0x5a && dma[SFC_DMA_PROBE + 3] == 0x5a;
+    rc = usable ? 0 : -EREMOTEIO;
+
+done:
+    free(direct);
+
+    if (usable)
+	SFC_INF("AST: Reading flash by DMA through 0x%08" PRIx32 "\n",
+		sfc_dma_phys);
+    else
+	SFC_ERR("AST: Flash DMA failed its check (%d), using direct reads\n", rc);
+
+    ct->dma_usable = usable;
+
+    return usable;
+}
+
+/* Copy flash into the scratch region and pull it through the bridge from there */
+static int sfc_dma_read(struct sfc_data *ct, uint32_t pos, void *buf,
+			uint32_t len)
+{
+    uint8_t *cursor = buf;
+    ssize_t rc;
+
+    while (len) {
+	uint32_t chunk = len < sfc_dma_len ? len : sfc_dma_len;
+	uint32_t span;
+
+	if (chunk > FMC_DMA_MAX)
+	    chunk = FMC_DMA_MAX;
+
+	span = (chunk + 3) & ~3u;
+
+	if ((rc = sfc_dma_run(ct, pos, sfc_dma_phys, span, false, NULL)) < 0)
+	    return rc;
+
+	if ((rc = soc_read(ct->soc, sfc_dma_phys, cursor, chunk)) < 0)
+	    return rc;
+
+	pos += chunk;
+	cursor += chunk;
+	len -= chunk;
+    }
+
+    return 0;
+}
+
 static int sfc_direct_read(struct sfc *ctrl, uint32_t pos, void *buf, uint32_t len)
 {
     ssize_t rc;
 
     struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
 
+    /* Bulk, aligned reads can go by DMA if a scratch region was given */
+    if (len >= SFC_DMA_MIN && !(pos & 3) && sfc_dma_probe(ct))
+	return sfc_dma_read(ct, pos, buf, len);
+
     /*
-     * We are in read mode by default. We don't yet support fancy
-     * things like fast read or X2 mode
+     * We are in read mode by default, using whichever command and I/O
+     * width sfc_setup() settled on for the chip
      */
     if ((rc = flash_read(ct, pos, buf, len)) < 0)
 	return rc;
@@ -358,6 +738,44 @@ static int sfc_direct_read(struct sfc *ctrl, uint32_t pos, void *buf, uint32_t l
     return (uint32_t)rc == len ? 0 : rc;
 }
 
+/*
+ * Compare flash against @buf using the DMA engine's checksum so the data
+ * never crosses the bridge. The engine is taken to sum little-endian words,
+ * which is all a match is checked against; callers should confirm a mismatch
+ * by other means before reporting it.
+ */
+static int sfc_verify(struct sfc *ctrl, uint32_t pos, const void *buf,
+		      uint32_t len)
+{
+    struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+    const uint8_t *cursor = buf;
+    uint32_t expected = 0;
+    uint32_t actual = 0;
+    uint32_t i;
+    int rc;
+
+    if ((pos & 3) || (len & 3))
+	return -EOPNOTSUPP;
+
+    for (i = 0; i < len; i += 4)
+	expected += cursor[i] | (cursor[i + 1] << 8) | (cursor[i + 2] << 16) |
+		    ((uint32_t)cursor[i + 3] << 24);
+
+    while (len) {
+	uint32_t chunk = len > FMC_DMA_MAX ? FMC_DMA_MAX : len;
+	uint32_t sum;
+
+	if ((rc = sfc_dma_run(ct, pos, 0, chunk, true, &sum)) < 0)
+	    return rc;
+
+	actual += sum;
+	pos += chunk;
+	len -= chunk;
+    }
+
+    return actual == expected ? 0 : -EREMOTEIO;
+}
+
 static void ast2500_get_ahb_freq(struct sfc_data *ct)
 {
     if (ast_ahb_freq)
@@ -366,12 +784,18 @@ static void ast2500_get_ahb_freq(struct sfc_data *ct)
     ast_ahb_freq = clk_get_rate(ct->clk, clk_ahb);
 }
 
-static int sfc_check_reads(struct sfc_data *ct,
+static int sfc_check_reads(struct sfc_data *ct, int passes,
 			      const uint8_t *golden_buf, uint8_t *test_buf)
 {
     int i, rc;
 
-    for (i = 0; i < 10; i++) {
+    rc = flash_read(ct, 0, test_buf, CALIBRATE_SCREEN_SIZE);
+    if (rc)
+	return rc;
+    if (memcmp(test_buf, golden_buf, CALIBRATE_SCREEN_SIZE) != 0)
+	return -EREMOTEIO;
+
+    for (i = 0; i < passes; i++) {
 	rc = flash_read(ct, 0, test_buf, CALIBRATE_BUF_SIZE);
 	if (rc)
 	    return rc;
@@ -381,7 +805,12 @@ static int sfc_check_reads(struct sfc_data *ct,
     return 0;
 }
 
-static int sfc_calibrate_reads(struct sfc_data *ct, uint32_t hdiv,
+/*
+ * @start is where the search begins, and is updated to the setting chosen. A
+ * faster clock needs at least as much delay as a slower one, so starting from
+ * what the last divider settled on skips points that would only fail.
+ */
+static int sfc_calibrate_reads(struct sfc_data *ct, uint32_t hdiv, int *start,
 				  const uint8_t *golden_buf, uint8_t *test_buf)
 {
     int i, rc;
@@ -394,7 +823,7 @@ static int sfc_calibrate_reads(struct sfc_data *ct, uint32_t hdiv,
     /* Try HCLK delay 0..5, each one with/without delay and look for a
      * good pair.
      */
-    for (i = 0; i < 12; i++) {
+    for (i = *start; i < 12; i++) {
 	bool pass;
 
 	ct->fread_timing_val &= mask;
@@ -403,7 +832,7 @@ static int sfc_calibrate_reads(struct sfc_data *ct, uint32_t hdiv,
 	if (rc < 0)
 	    return rc;
 
-	rc = sfc_check_reads(ct, golden_buf, test_buf);
+	rc = sfc_check_reads(ct, CALIBRATE_PASSES, golden_buf, test_buf);
 	if (rc && rc != -EREMOTEIO)
 	    return rc;
 	pass = (rc == 0);
@@ -419,10 +848,16 @@ static int sfc_calibrate_reads(struct sfc_data *ct, uint32_t hdiv,
 	    pass_count = 0;
     }
 
-    /* No good setting for this frequency */
+    /* No good setting for this frequency, unless the hint was wrong */
+    if (good_pass < 0 && *start) {
+	*start = 0;
+	return sfc_calibrate_reads(ct, hdiv, start, golden_buf, test_buf);
+    }
     if (good_pass < 0)
 	return -EREMOTEIO;
 
+    *start = good_pass;
+
     /* We have at least one pass of margin, let's use first pass */
     ct->fread_timing_val &= mask;
     ct->fread_timing_val |= FREAD_TPASS(good_pass) << shift;
@@ -453,12 +888,66 @@ static bool ast_calib_data_usable(const uint8_t *test_buf, uint32_t size)
     return cnt >= 64;
 }
 
-static int sfc_optimize_reads(struct sfc_data *ct,
-				 struct flash_info *info __unused,
-				 uint32_t max_freq)
+/*
+ * Try the control and read timing values found by a previous run against the
+ * same chip, in the same read mode, on the same SoC revision and AHB clock. A
+ * single pass against the golden buffer is enough to catch a stale entry, the
+ * values were already put through the full calibration when recorded.
+ */
+static int sfc_try_cached_reads(struct sfc_data *ct, const char *key,
+				const uint8_t *golden_buf, uint8_t *test_buf)
 {
+    uint32_t rev, freq, ctl, timing;
+    const char *hint;
+    int rc;
+
+    if (!(hint = cache_get(key)))
+	return -ENOENT;
+
+    if (sscanf(hint, "%" SCNx32 ":%" SCNu32 ":%" SCNx32 ":%" SCNx32,
+	       &rev, &freq, &ctl, &timing) != 4 ||
+	rev != ct->soc->rev || freq != ast_ahb_freq ||
+	(ctl & ~0x2f00u) != (ct->ctl_read_val & ~0x2f00u)) {
+	cache_invalidate(key);
+	return -ENOENT;
+    }
+
+    /* The 4b mode bit isn't ours to cache, follow the current setting */
+    ctl = (ctl & ~0x2000u) | (ct->ctl_read_val & 0x2000);
+
+    rc = sfc_writel(ct, ct->fread_timing_reg, timing);
+    if (rc < 0)
+	return rc;
+
+    rc = sfc_writel(ct, ct->ctl_reg, ctl);
+    if (rc < 0)
+	return rc;
+
+    rc = sfc_check_reads(ct, 1, golden_buf, test_buf);
+    if (rc) {
+	if (rc == -EREMOTEIO) {
+	    SFC_DBG("AST: Cached read timings failed verification\n");
+	    cache_invalidate(key);
+	    rc = sfc_writel(ct, ct->fread_timing_reg, ct->fread_timing_val);
+	    return rc < 0 ? rc : -ENOENT;
+	}
+	return rc;
+    }
+
+    ct->fread_timing_val = timing;
+    ct->ctl_read_val = ctl;
+
+    SFC_INF("AST: Using cached read timings, control 0x%08" PRIx32 "\n", ctl);
+
+    return 0;
+}
+
+static int sfc_search_reads(struct sfc_data *ct, struct flash_info *info,
+			    uint32_t max_freq)
+{
+    char key[sizeof("sfc-01234567-255-012345-01")];
     uint8_t *golden_buf, *test_buf;
-    int i, rc, best_div = -1;
+    int i, rc, best_div = -1, start = 0;
     uint32_t save_read_val = ct->ctl_read_val;
 
     test_buf = malloc(CALIBRATE_BUF_SIZE * 2);
@@ -492,6 +981,16 @@ static int sfc_optimize_reads(struct sfc_data *ct,
 	return rc;
     }
 
+    /* Timings found for one read command don't carry over to another */
+    snprintf(key, sizeof(key), "sfc-%08" PRIx32 "-%u-%06" PRIx32 "-%02" PRIx32,
+	     ct->iomem.start, ct->cs, info->id & 0xffffff,
+	     (ct->ctl_read_val >> 16) & 0xff);
+    rc = sfc_try_cached_reads(ct, key, golden_buf, test_buf);
+    if (rc != -ENOENT) {
+	free(test_buf);
+	return rc;
+    }
+
     /* Now we iterate the HCLK dividers until we find our breaking point */
     for (i = 5; i > 0; i--) {
 	uint32_t tv, freq;
@@ -509,7 +1008,7 @@ static int sfc_optimize_reads(struct sfc_data *ct,
 	    return rc;
 	}
 	SFC_DBG("AST: Trying HCLK/%d...\n", i);
-	rc = sfc_calibrate_reads(ct, i, golden_buf, test_buf);
+	rc = sfc_calibrate_reads(ct, i, &start, golden_buf, test_buf);
 
 	/* Some other error occurred, bail out */
 	if (rc && rc != -EREMOTEIO) {
@@ -528,9 +1027,28 @@ static int sfc_optimize_reads(struct sfc_data *ct,
 	SFC_INF("AST: Found good read timings at HCLK/%d\n", best_div);
 	ct->ctl_read_val |= (ast_ct_hclk_divs[best_div - 1] << 8);
     }
+
+    cache_set(key, "%08" PRIx32 ":%" PRIu32 ":%08" PRIx32 ":%08" PRIx32,
+	      ct->soc->rev, ast_ahb_freq, ct->ctl_read_val,
+	      ct->fread_timing_val);
+
     return sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val);
 }
 
+static int sfc_optimize_reads(struct sfc_data *ct,
+				 struct flash_info *info,
+				 uint32_t max_freq)
+{
+    int timing;
+    int rc;
+
+    timing = timing_begin("sfc-calibrate", NULL);
+    rc = sfc_search_reads(ct, info, max_freq);
+    timing_end(timing);
+
+    return rc;
+}
+
 static int sfc_get_hclk(uint32_t *ctl_val, uint32_t max_freq)
 {
     int i;
@@ -769,7 +1287,7 @@ static int sfc_setup_micron(struct sfc_data *ct, struct flash_info *info)
      * to 4T which is about 20.8ns.
      */
     ct->ctl_read_val = (ct->ctl_read_val & 0x2000) |
-	(0x03 << 28) | /* Single bit */
+	(0x03 << 28) | /* Dual IO */
 	(0x0c << 24) | /* CE# 4T */
 	(0xbb << 16) | /* 2READ command */
 	(0x00 <<  8) | /* HCLK/16 (optimize later) */
@@ -815,6 +1333,49 @@ dumb:
     return sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val);
 }
 
+static int sfc_setup_generic(struct sfc_data *ct, struct flash_info *info)
+{
+    const struct flash_sfdp *sfdp = ct->ops.sfdp;
+    uint32_t io = 0x00, cmd = CMD_FAST_READ, dummy = 1;
+    int rc;
+
+    SFC_DBG("AST: Setting up generic fast read...\n");
+
+    /* The chip's SFDP may offer a dual output read */
+    if (sfdp && sfdp->read_cmd != CMD_FAST_READ) {
+	io = 0x02;
+	cmd = sfdp->read_cmd;
+	dummy = sfdp->read_dummy / 8;
+	SFC_DBG("AST: Using SFDP read 0x%02x, %d dummy clocks\n",
+		cmd, sfdp->read_dummy);
+    }
+
+    /*
+     * FAST_READ with 8 dummy clocks is about the only read mode
+     * beyond plain READ that any SPI NOR can be expected to do,
+     * and SFDP says nothing of the chip's clock limits. Keep the CE#
+     * inactive width at its maximum and cap the clock at a
+     * conservative 50Mhz before calibrating.
+     */
+    ct->ctl_read_val = (ct->ctl_read_val & 0x2000) |
+	(io << 28) | /* Single bit, or dual bit data only */
+	(0x00 << 24) | /* CE# max */
+	(cmd << 16) | /* FAST_READ or SFDP read command */
+	(0x00 <<  8) | /* HCLK/16 (optimize later) */
+	(dummy <<  6) | /* dummy cycle bytes */
+	(0x01);	       /* fast read */
+
+    /* Configure SPI flash read timing */
+    rc = sfc_optimize_reads(ct, info, 50000000);
+    if (rc) {
+	SFC_ERR("AST: Failed to setup proper read timings, rc=%d\n", rc);
+	return rc;
+    }
+
+    /* Update chip with current read config */
+    return sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val);
+}
+
 static int sfc_setup(struct sfc *ctrl, uint32_t *tsize)
 {
     struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
@@ -822,11 +1383,18 @@ static int sfc_setup(struct sfc *ctrl, uint32_t *tsize)
 
     (void)tsize;
 
-    return 0;
+    /*
+     * Faster read modes leave the chip and controller configured
+     * differently to how the BMC firmware set them up, so they're
+     * opt-in
+     */
+    if (!sfc_fast_reads)
+	return 0;
 
     /*
      * Configure better timings and read mode for known
-     * flash chips
+     * flash chips. Only single and dual I/O are available,
+     * the AST2500 controllers have no quad mode.
      */
     switch(info->id) {
     case 0xc22018: /* MX25L12835F */
@@ -840,8 +1408,8 @@ static int sfc_setup(struct sfc *ctrl, uint32_t *tsize)
     case 0x20ba20: /* MT25Qx512xx */
 	return sfc_setup_micron(ct, info);
     }
-    /* No special tuning */
-    return 0;
+    /* No special tuning beyond what every chip supports */
+    return sfc_setup_generic(ct, info);
 }
 
 static bool sfc_init_device(struct sfc_data *ct)
@@ -895,6 +1463,67 @@ static bool sfc_init_device(struct sfc_data *ct)
     return true;
 }
 
+int sfc_read_mode_save(struct sfc *ctrl, enum sfc_read_mode mode,
+		       unsigned int hdiv, uint32_t *save)
+{
+    struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+    const struct flash_sfdp *sfdp = ctrl->sfdp;
+    uint32_t io = 0x00, cmd, dummy = 0, fast = 0x01;
+    uint32_t val;
+    int rc;
+
+    if (hdiv < 1 || hdiv > ARRAY_SIZE(ast_ct_hclk_divs))
+	return -EINVAL;
+
+    switch (mode) {
+    case sfc_read_normal:
+	cmd = CMD_READ;
+	fast = 0x00;
+	break;
+    case sfc_read_fast:
+	cmd = CMD_FAST_READ;
+	dummy = 1;
+	break;
+    case sfc_read_dual:
+	if (!sfdp || sfdp->read_cmd == CMD_FAST_READ)
+	    return -EOPNOTSUPP;
+	io = 0x02;
+	cmd = sfdp->read_cmd;
+	dummy = sfdp->read_dummy / 8;
+	break;
+    default:
+	return -EINVAL;
+    }
+
+    /* As sfc_setup_generic(), with CE# inactive at its maximum */
+    val = (ct->ctl_read_val & 0x2000) |
+	(io << 28) |
+	(cmd << 16) |
+	(ast_ct_hclk_divs[hdiv - 1] << 8) |
+	(dummy << 6) |
+	fast;
+
+    if (ct->native_4b && (rc = sfc_map_read_cmd(&val, true)) < 0)
+	return rc;
+
+    if ((rc = sfc_writel(ct, ct->ctl_reg, val)) < 0)
+	return rc;
+
+    *save = ct->ctl_read_val;
+    ct->ctl_read_val = val;
+
+    return 0;
+}
+
+int sfc_read_mode_restore(struct sfc *ctrl, uint32_t save)
+{
+    struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
+
+    ct->ctl_read_val = save;
+
+    return sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val);
+}
+
 int sfc_write_protect_save(struct sfc *ctrl, bool enable, uint32_t *save)
 {
     struct sfc_data *ct = container_of(ctrl, struct sfc_data, ops);
@@ -904,8 +1533,6 @@ int sfc_write_protect_save(struct sfc *ctrl, bool enable, uint32_t *save)
     if ((rc = sfc_readl(ct, ct->type_reg, &old_tsr)) < 0)
 	return rc;
 
-    /* TODO: Specify which CE? */
-
     if (enable) {
 	new_tsr = old_tsr | ct->type_wp_mask;
     } else {
@@ -929,7 +1556,6 @@ int sfc_write_protect_restore(struct sfc *ctrl, uint32_t save)
     if ((rc = sfc_readl(ct, ct->type_reg, &tsr)) < 0)
 	return rc;
 
-    /* TODO: Specify which CE? */
     tsr &= ~ct->type_wp_mask;
     tsr |= (save & ct->type_wp_mask);
 
@@ -945,6 +1571,44 @@ int sfc_get_flash(struct sfc *ctrl, struct soc_region *flash)
     return 0;
 }
 
+/* Switching away from a CS returns it to read mode, as on destroy */
+static int sfc_select_cs(struct sfc_data *ct, unsigned int cs)
+{
+    struct soc_region flash = ct->window;
+    uint32_t seg;
+    int rc;
+
+    if (cs >= ct->ncs)
+	return -EINVAL;
+
+    if (cs == ct->cs)
+	return 0;
+
+    /* CS0 keeps the whole range, as it always has */
+    if (cs) {
+	if ((rc = sfc_readl(ct, SFC_CE_ADDR(cs), &seg)) < 0)
+	    return rc;
+
+	flash.start = SFC_SEG_START(seg);
+	flash.length = SFC_SEG_END(seg) - flash.start;
+	if (SFC_SEG_END(seg) <= flash.start || flash.start < ct->window.start ||
+		SFC_SEG_END(seg) > ct->window.start + ct->window.length) {
+	    loge("sfc: CS%u has no decode window (0x%08" PRIx32 ")\n", cs, seg);
+	    return -ENODEV;
+	}
+    }
+
+    if ((rc = sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val)) < 0)
+	return rc;
+
+    ct->cs = cs;
+    ct->ctl_reg = ct->ctl_base + 4 * cs;
+    ct->type_wp_mask = FMC_CE_TYPE_CE0_WP << cs;
+    ct->flash = flash;
+
+    return sfc_init_device(ct) ? 0 : -EIO;
+}
+
 static const struct soc_device_id sfc_match[] = {
     { .compatible = "aspeed,ast2500-fmc", .data = (void *)SFC_TYPE_FMC },
     { .compatible = "aspeed,ast2500-spi", .data = (void *)SFC_TYPE_SMC },
@@ -956,30 +1620,28 @@ static int sfc_driver_init(struct soc *soc, struct soc_device *dev)
     struct sfc_data *ct;
     int rc;
 
-    ct = malloc(sizeof(*ct));
+    ct = soc_alloc(soc, sizeof(*ct));
     if (!ct) {
 	SFC_ERR("AST_SF: Failed to allocate\n");
 	return -ENOMEM;
     }
-    memset(ct, 0, sizeof(*ct));
-
     if ((rc = soc_device_get_memory_index(soc, &dev->node, 0, &ct->iomem)) < 0)
-	goto fail;
+	return rc;
+
+    if ((rc = soc_device_get_memory_index(soc, &dev->node, 1, &ct->window)) < 0)
+	return rc;
 
-    if ((rc = soc_device_get_memory_index(soc, &dev->node, 1, &ct->flash)) < 0)
-	goto fail;
+    ct->flash = ct->window;
 
     ct->type = (unsigned long)(soc_device_get_match_data(soc, sfc_match, &dev->node));
     if (!ct->type) {
 	loge("sfc: Failed to acquire match data\n");
-	rc = -EINVAL;
-	goto fail;
+	return -EINVAL;
     }
 
     if (!(ct->clk = clk_get(soc))) {
 	loge("Failed to acquire clock controller\n");
-	rc = -ENODEV;
-	goto fail;
+	return -ENODEV;
     }
 
     ct->soc = soc;
@@ -989,41 +1651,42 @@ static int sfc_driver_init(struct soc *soc, struct soc_device *dev)
 
     ct->ops.cmd_wr = sfc_cmd_wr;
     ct->ops.cmd_rd = sfc_cmd_rd;
+    ct->ops.program = sfc_program;
     ct->ops.set_4b = sfc_set_4b;
     ct->ops.direct_read = sfc_direct_read;
     ct->ops.setup = sfc_setup;
 
+    /* Only the FMC has a DMA engine */
+    if (ct->type == SFC_TYPE_FMC)
+	ct->ops.verify = sfc_verify;
+
     ast2500_get_ahb_freq(ct);
 
     /* TODO: Set these in the platform data, add platform data pointer to ct */
     if (ct->type == SFC_TYPE_SMC) {
 	ct->type_reg = FMC_CE_TYPE;
-	ct->type_wp_mask = (FMC_CE_TYPE_CE0_WP | FMC_CE_TYPE_CE1_WP |
-			    FMC_CE_TYPE_CE2_WP);
-	ct->ctl_reg = SMC_CE0_CTRL;
+	ct->type_wp_mask = FMC_CE_TYPE_CE0_WP;
+	ct->ctl_base = SMC_CE0_CTRL;
+	ct->ncs = SMC_CS_MAX;
 	ct->fread_timing_reg = SMC_TIMING;
     } else if (ct->type == SFC_TYPE_FMC) {
 	ct->type_reg = FMC_CE_TYPE;
-	ct->type_wp_mask = (FMC_CE_TYPE_CE0_WP | FMC_CE_TYPE_CE1_WP);
-	ct->ctl_reg = FMC_CE0_CTRL;
+	ct->type_wp_mask = FMC_CE_TYPE_CE0_WP;
+	ct->ctl_base = FMC_CE0_CTRL;
+	ct->ncs = FMC_CS_MAX;
 	ct->fread_timing_reg = FMC_TIMING;
     } else {
-	rc = -EINVAL;
-	goto fail;
+	return -EINVAL;
     }
+    ct->ctl_reg = ct->ctl_base;
 
     if (!sfc_init_device(ct)) {
-	rc = -EIO;
-	goto fail;
+	return -EIO;
     }
 
     soc_device_set_drvdata(dev, &ct->ops);
 
     return 0;
-
-fail:
-    free(ct);
-    return rc;
 }
 
 static void sfc_driver_destroy(struct soc_device *dev)
@@ -1038,7 +1701,7 @@ static void sfc_driver_destroy(struct soc_device *dev)
     /* Restore control reg to read */
     if ((rc = sfc_writel(ct, ct->ctl_reg, ct->ctl_read_val)) < 0) {
 	loge("Failed to restore control reg state: %d\n", rc);
-	goto cleanup_ct;
+	return;
     }
 
     /* Additional cleanup */
@@ -1047,20 +1710,15 @@ static void sfc_driver_destroy(struct soc_device *dev)
 
 	if ((rc = sfc_readl(ct, SMC_CONF, &reg)) < 0) {
 	    loge("Failed to read configuration register: %d\n", rc);
-	    goto cleanup_ct;
+	    return;
 	}
 
 	if (reg != 0xffffffff) {
 	    if ((rc = sfc_writel(ct, SMC_CONF, reg & ~1)) < 0) {
 		loge("Failed to write configuration register: %d\n", rc);
-		goto cleanup_ct;
 	    }
 	}
     }
-
-cleanup_ct:
-    /* Free the whole lot */
-    free(ct);
 }
 
 static const struct soc_driver sfc_driver = {
@@ -1075,3 +1733,44 @@ struct sfc *sfc_get_by_name(struct soc *soc, const char *name)
 {
     return soc_driver_get_drvdata_by_name(soc, &sfc_driver, name);
 }
+
+struct sfc *sfc_get(struct soc *soc, const char *spec)
+{
+    const char *sep = strchr(spec, ':');
+    unsigned long cs = 0;
+    struct sfc *ctrl;
+    char name[16];
+    char *end;
+    int rc;
+
+    if (sep) {
+	cs = strtoul(sep + 1, &end, 10);
+	if (end == sep + 1 || *end || cs > UINT8_MAX) {
+	    loge("sfc: Bad chip-select in '%s'\n", spec);
+	    return NULL;
+	}
+    } else {
+	sep = spec + strlen(spec);
+    }
+
+    if ((size_t)(sep - spec) >= sizeof(name)) {
+	loge("sfc: No SPI controller named '%s'\n", spec);
+	return NULL;
+    }
+
+    memcpy(name, spec, sep - spec);
+    name[sep - spec] = '\0';
+
+    if (!(ctrl = sfc_get_by_name(soc, name))) {
+	loge("sfc: No SPI controller named '%s'\n", name);
+	return NULL;
+    }
+
+    rc = sfc_select_cs(container_of(ctrl, struct sfc_data, ops), cs);
+    if (rc < 0) {
+	loge("sfc: Failed to select %s CS%lu: %d\n", name, cs, rc);
+	return NULL;
+    }
+
+    return ctrl;
+}
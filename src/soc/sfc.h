@@ -14,20 +14,27 @@
 
 /* Flash commands */
 #define CMD_BE			0xd8	/* Block (64K) Erase */
+#define CMD_BE4			0xdc	/* Block (64K) Erase, 4B address */
 #define CMD_BE32K		0x52	/* Block (32K) Erase */
 #define CMD_CE			0x60	/* Chip Erase (Macronix/Winbond) */
 #define CMD_EN4B		0xb7	/* Enable 4B addresses */
 #define CMD_EX4B		0xe9	/* Exit 4B addresses */
+#define CMD_FAST_READ		0x0b	/* FAST_READ, 8 dummy clocks */
+#define CMD_FAST_READ4		0x0c	/* FAST_READ, 4B address */
 #define CMD_MIC_BULK_ERASE	0xc7	/* Micron Bulk Erase */
 #define CMD_MIC_RDFLST		0x70	/* Micron Read Flag Status */
 #define CMD_MIC_RDVCONF		0x85	/* Micron Read Volatile Config */
 #define CMD_MIC_WRVCONF		0x81	/* Micron Write Volatile Config */
 #define CMD_PP			0x02	/* Page Program */
+#define CMD_PP4			0x12	/* Page Program, 4B address */
 #define CMD_RDCR		0x15	/* Read configuration register (Macronix) */
 #define CMD_RDID		0x9f	/* Read JEDEC ID */
+#define CMD_RDSFDP		0x5a	/* Read SFDP, 3B address, 8 dummy clocks */
 #define CMD_RDSR		0x05	/* Read Status Register */
 #define CMD_READ		0x03	/* READ */
+#define CMD_READ4		0x13	/* READ, 4B address */
 #define CMD_SE			0x20	/* Sector (4K) Erase */
+#define CMD_SE4			0x21	/* Sector (4K) Erase, 4B address */
 #define CMD_WREN		0x06	/* Write Enable */
 #define CMD_WRSR		0x01	/* Write Status Register (also config. on Macronix) */
 
@@ -48,10 +55,18 @@ struct flash_info {
 #define FL_MICRON_BUGS	0x00000020	/* Various micron bug workarounds */
 #define FL_ERASE_ALL	(FL_ERASE_4K | FL_ERASE_32K | FL_ERASE_64K | \
 			 FL_ERASE_CHIP)
-#define FL_CAN_4B	0x00000010	/* Supports 4b mode */
+#define FL_CAN_4B	0x00000040	/* Supports 4b mode */
+#define FL_4B_OPS	0x00000080	/* Has READ4/FAST_READ4/PP4/SE4/BE4 */
 	const char	*name;
 };
 
+/* What the chip's SFDP tables say, where the table above has no word on it */
+struct flash_sfdp {
+	uint32_t	page_size;
+	uint8_t		read_cmd;	/* FAST_READ or a 1-1-2 dual output read */
+	uint8_t		read_dummy;	/* read_cmd's dummy and mode clocks */
+};
+
 /* Flash controller, return negative values for errors */
 struct sfc {
 	int (*setup)(struct sfc *ctrl, uint32_t *tsize);
@@ -62,8 +77,14 @@ struct sfc {
 		    uint32_t size);
 	int (*write)(struct sfc *ctrl, uint32_t addr,
 		     const void *buf, uint32_t size);
+	/* Optional, WREN then program @cmd for one page, not waiting on the chip */
+	int (*program)(struct sfc *ctrl, uint8_t cmd, uint32_t addr,
+		       const void *buf, uint32_t size);
 	int (*erase)(struct sfc *ctrl, uint32_t addr,
 		     uint32_t size);
+	/* Optional, -EREMOTEIO if flash may not match @buf */
+	int (*verify)(struct sfc *ctrl, uint32_t addr, const void *buf,
+		      uint32_t size);
 	int (*cmd_rd)(struct sfc *ctrl, uint8_t cmd,
 		      bool has_addr, uint32_t addr, void *buffer,
 		      uint32_t size);
@@ -71,10 +92,35 @@ struct sfc {
 		      bool has_addr, uint32_t addr, const void *buffer,
 		      uint32_t size);
 	struct flash_info *finfo;
+	/* NULL if the chip has no SFDP */
+	const struct flash_sfdp *sfdp;
 
 	void *priv;
 };
 
+/* Calibrate fast, chip-specific read modes rather than using plain READ */
+void sfc_enable_fast_reads(void);
+
+/* A free region of BMC DRAM that bulk flash reads may be copied through */
+int sfc_set_dma_scratch(uint32_t phys, uint32_t len);
+
+/* Read modes sfc_read_mode_save() can switch direct reads to */
+enum sfc_read_mode {
+	sfc_read_normal,	/* READ */
+	sfc_read_fast,		/* FAST_READ, 8 dummy clocks */
+	sfc_read_dual,		/* The chip's SFDP dual output read, if any */
+	sfc_read_max,
+};
+
+/*
+ * Switch direct reads to @mode at HCLK/@hdiv, 1 to 5, until restored from
+ * @save. The read timing delays are left as calibrated, if they were, so fast
+ * settings can return bad data. -EOPNOTSUPP if the chip lacks @mode.
+ */
+int sfc_read_mode_save(struct sfc *ctrl, enum sfc_read_mode mode,
+		       unsigned int hdiv, uint32_t *save);
+int sfc_read_mode_restore(struct sfc *ctrl, uint32_t save);
+
 int sfc_write_protect_save(struct sfc *ctrl, bool enable, uint32_t *save);
 int sfc_write_protect_restore(struct sfc *ctrl, uint32_t save);
 
@@ -82,4 +128,7 @@ int sfc_get_flash(struct sfc *ctrl, struct soc_region *flash);
 
 struct sfc *sfc_get_by_name(struct soc *soc, const char *name);
 
+/* @spec is a controller name with an optional chip-select, e.g. "fmc" or "spi1:1" */
+struct sfc *sfc_get(struct soc *soc, const char *spec);
+
 #endif
@@ -75,6 +75,11 @@ int sioctl_decode_status(struct sioctl *ctx, enum sioctl_decode *status)
     return 0;
 }
 
+void sioctl_prefetch(struct sioctl *ctx, struct soc_snapshot *snap)
+{
+    soc_snapshot_add(snap, ctx->scu.start + ctx->pdata->reg);
+}
+
 static const struct sioctl_pdata ast2400_sioctl_pdata = {
     .reg = G4_SCU_HW_STRAP,
     .disable = G4_SCU_HW_STRAP_SIO_DEC,
@@ -99,7 +104,7 @@ static int sioctl_driver_init(struct soc *soc, struct soc_device *dev)
     struct sioctl *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
@@ -107,41 +112,28 @@ static int sioctl_driver_init(struct soc *soc, struct soc_device *dev)
     ctx->soc = soc;
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->scu)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     if (!(ctx->pdata = soc_device_get_match_data(soc, sioctl_matches, &dev->node))) {
         loge("Failed to find sioctl platform data\n");
-        rc = -EINVAL;
-        goto cleanup_ctx;
+        return -EINVAL;
     }
 
     if (!(ctx->strap = strap_get(soc))) {
         loge("Failed to acquire strap controller\n");
-        rc = -ENODEV;
-        goto cleanup_ctx;
+        return -ENODEV;
     }
 
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void sioctl_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 struct soc_driver sioctl_driver = {
     .name = "sioctl",
     .matches = sioctl_matches,
     .init = sioctl_driver_init,
-    .destroy = sioctl_driver_destroy,
 };
 REGISTER_SOC_DRIVER(sioctl_driver);
 
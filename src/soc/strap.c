@@ -25,12 +25,21 @@ int strap_read(struct strap *ctx, int reg, uint32_t *val)
 
 int strap_set(struct strap *ctx, int reg, uint32_t update, uint32_t mask)
 {
-    return ctx->ops->set(ctx, reg, update, mask);
+    int rc = ctx->ops->set(ctx, reg, update, mask);
+
+    /* Some strap registers are updated through W1S/W1C aliases */
+    scu_invalidate(ctx->scu, reg);
+
+    return rc;
 }
 
 int strap_clear(struct strap *ctx, int reg, uint32_t update, uint32_t mask)
 {
-    return ctx->ops->clear(ctx, reg, update, mask);
+    int rc = ctx->ops->clear(ctx, reg, update, mask);
+
+    scu_invalidate(ctx->scu, reg);
+
+    return rc;
 }
 
 static int ast2400_strap_read(struct strap *ctx, int reg, uint32_t *val)
@@ -39,14 +48,11 @@ static int ast2400_strap_read(struct strap *ctx, int reg, uint32_t *val)
         return -EINVAL;
     }
 
-    return scu_readl(ctx->scu, reg, val);
+    return scu_readl_cached(ctx->scu, reg, val);
 }
 
 static int ast2400_strap_set(struct strap *ctx, int reg, uint32_t update, uint32_t mask)
 {
-    uint32_t val;
-    int rc;
-
     if (!(reg == AST2400_SCU_HW_STRAP1 || reg == AST2400_SCU_HW_STRAP2)) {
         return -EINVAL;
     }
@@ -55,20 +61,11 @@ static int ast2400_strap_set(struct strap *ctx, int reg, uint32_t update, uint32
         return -EINVAL;
     }
 
-    if ((rc = scu_readl(ctx->scu, reg, &val)) < 0) {
-        return rc;
-    }
-
-    val |= update;
-
-    return scu_writel(ctx->scu, reg, val);
+    return scu_modifyl(ctx->scu, reg, 0, update);
 }
 
 static int ast2400_strap_clear(struct strap *ctx, int reg, uint32_t update, uint32_t mask)
 {
-    uint32_t val;
-    int rc;
-
     if (!(reg == AST2400_SCU_HW_STRAP1 || reg == AST2400_SCU_HW_STRAP2)) {
         return -EINVAL;
     }
@@ -77,13 +74,7 @@ static int ast2400_strap_clear(struct strap *ctx, int reg, uint32_t update, uint
         return -EINVAL;
     }
 
-    if ((rc = scu_readl(ctx->scu, reg, &val)) < 0) {
-        return rc;
-    }
-
-    val &= ~update;
-
-    return scu_writel(ctx->scu, reg, val);
+    return scu_modifyl(ctx->scu, reg, update, 0);
 }
 
 static const struct strap_ops ast2400_strap_ops = {
@@ -98,7 +89,7 @@ static int ast2500_strap_read(struct strap *ctx, int reg, uint32_t *val)
         return -EINVAL;
     }
 
-    return scu_readl(ctx->scu, reg, val);
+    return scu_readl_cached(ctx->scu, reg, val);
 }
 
 static int ast2500_strap_set(struct strap *ctx, int reg, uint32_t update, uint32_t mask)
@@ -134,7 +125,7 @@ static int ast2600_strap_read(struct strap *ctx, int reg, uint32_t *val)
         return -EINVAL;
     }
 
-    return scu_readl(ctx->scu, reg, val);
+    return scu_readl_cached(ctx->scu, reg, val);
 }
 
 static int ast2600_strap_is_protected(struct strap *ctx, int reg, uint32_t mask)
@@ -204,14 +195,7 @@ static int ast2600_strap_clear(struct strap *ctx, int reg, uint32_t update, uint
 
     /* RMW, because register layout is hard */
     if (reg == AST2600_SCU_HW_STRAP3) {
-        uint32_t val;
-        int rc;
-
-        if ((rc = scu_readl(ctx->scu, reg, &val)) < 0) {
-            return rc;
-        }
-
-        return scu_writel(ctx->scu, reg, val & ~(update & mask));
+        return scu_modifyl(ctx->scu, reg, update & mask, 0);
     }
 
     return -EINVAL;
@@ -233,17 +217,15 @@ static const struct soc_device_id strap_matches[] = {
 static int strap_driver_init(struct soc *soc, struct soc_device *dev)
 {
     struct strap *ctx;
-    int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     ctx->scu = scu_get(soc);
     if (!ctx->scu) {
-        rc = -ENODEV;
-        goto cleanup_ctx;
+        return -ENODEV;
     }
 
     ctx->ops = soc_device_get_match_data(soc, strap_matches, &dev->node);
@@ -251,18 +233,12 @@ static int strap_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
 }
 
 static void strap_driver_destroy(struct soc_device *dev)
 {
     struct strap *ctx = soc_device_get_drvdata(dev);
     scu_put(ctx->scu);
-    free(ctx);
 }
 
 static const struct soc_driver strap_driver = {
@@ -6,6 +6,7 @@
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdlib.h>
 
 #include "ahb.h"
 #include "ast.h"
@@ -48,10 +49,20 @@
 #define R_AHBC_BCR_ADDR                 0x48
 #define R_AHBC_BCR_FIFO_MERGE           0x5C
 
+/* Kept just behind the drained position while streaming, see trace_drain() */
+#define TRACE_CANARY                    0x5ca1ab1e
+
 struct trace {
 	struct soc *soc;
 	struct soc_region ahbc;
 	struct soc_region sram;
+	/* The capture buffer, by default as much of the SRAM as fits */
+	uint32_t base;
+	uint32_t len;
+	uint32_t len_code;
+	/* Buffer offset drained up to while streaming */
+	uint32_t rd;
+	unsigned long overruns;
 };
 
 static const size_t ahbc_bcr_buf_len[] = {
@@ -121,16 +132,51 @@ static int ahbc_writel(struct trace *ctx, uint32_t off, uint32_t val)
     return soc_writel(ctx->soc, ctx->ahbc.start + off, val);
 }
 
+static int trace_buf_code(uint32_t len)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(ahbc_bcr_buf_len) / sizeof(ahbc_bcr_buf_len[0]); i++) {
+        if (ahbc_bcr_buf_len[i] == len)
+            return i;
+    }
+
+    return -EINVAL;
+}
+
+int trace_set_buffer(struct trace *ctx, uint32_t phys, uint32_t len)
+{
+    int code;
+
+    if ((code = trace_buf_code(len)) < 0)
+        return code;
+
+    if (!phys) {
+        if (len > ctx->sram.length)
+            return -ENOSPC;
+        phys = ctx->sram.start;
+    }
+
+    /* The engine forms addresses by OR-ing the write pointer into the base */
+    if (phys & (len - 1))
+        return -EINVAL;
+
+    ctx->base = phys;
+    ctx->len = len;
+    ctx->len_code = code;
+
+    return 0;
+}
+
 int trace_start(struct trace *ctx, uint32_t addr, int width, enum trace_mode mode)
 {
     uint32_t csr, buf;
-    size_t i;
+    void *zeros;
     int rc;
 
     logd("%s: 0x%08" PRIx32 " %d %d\n", __func__, addr, width, mode);
 
-    assert(ctx->sram.length >= (32 * 1024));
-    csr = AHBC_BCR_CSR_BUF_LEN_32K << AHBC_BCR_CSR_BUF_LEN_SHIFT;
+    csr = ctx->len_code << AHBC_BCR_CSR_BUF_LEN_SHIFT;
     csr |= AHBC_BCR_CSR_POLL_MODE * mode;
 
     if ((rc = ahbc_writel(ctx, R_AHBC_BCR_CSR, csr)))
@@ -139,13 +185,21 @@ int trace_start(struct trace *ctx, uint32_t addr, int width, enum trace_mode mod
     if ((rc = ahbc_writel(ctx, R_AHBC_BCR_ADDR, addr & ~3)))
         return rc;
 
-    logi("Zeroing trace buffer [%p - %p]\n", ctx->sram.start, ctx->sram.start + ctx->sram.length);
+    logi("Zeroing trace buffer [0x%08" PRIx32 " - 0x%08" PRIx32 "]\n", ctx->base,
+         ctx->base + ctx->len - 1);
 
-    for (i = 0; i < (ctx->sram.length / 4); i++) {
-        soc_writel(ctx->soc, 4 * i + ctx->sram.start, 0);
-    }
+    /* One bulk write, as the bridges move those far faster than words */
+    if (!(zeros = calloc(1, ctx->len)))
+        return -ENOMEM;
+
+    rc = soc_write(ctx->soc, ctx->base, zeros, ctx->len);
+    free(zeros);
+    if (rc < 0)
+        return rc;
+    if ((uint32_t)rc != ctx->len)
+        return -EIO;
 
-    buf = ctx->sram.start | AHBC_BCR_BUF_WRAP;
+    buf = ctx->base | AHBC_BCR_BUF_WRAP;
     if ((rc = ahbc_writel(ctx, R_AHBC_BCR_BUF, buf)))
         return rc;
 
@@ -196,7 +250,7 @@ int trace_stop(struct trace *ctx)
 
 int trace_dump(struct trace *ctx, int outfd)
 {
-    uint32_t buf_len, write_ptr;
+    uint32_t write_ptr;
     uint32_t csr, buf;
     uint32_t merge;
     uint32_t base;
@@ -228,12 +282,16 @@ int trace_dump(struct trace *ctx, int outfd)
     wrapped = buf & AHBC_BCR_BUF_WRAP;
     buf &= ~AHBC_BCR_BUF_WRAP;
 
-    buf_len = (csr & AHBC_BCR_CSR_BUF_LEN_MASK) >> AHBC_BCR_CSR_BUF_LEN_SHIFT;
-    write_ptr = buf & GENMASK((11 + buf_len), 2);
-    base = (buf & ~(write_ptr | 3));
+    /*
+     * The buffer is aligned to its size, which splits the pointer into the
+     * base and the offset written up to. The length field skips 64K, so the
+     * mask comes from the size set up rather than from the field.
+     */
+    write_ptr = buf & (ctx->len - 1) & ~3;
+    base = buf & ~(ctx->len - 1);
 
     if (wrapped) {
-        len = (base + ahbc_bcr_buf_len[buf_len]) - write_ptr;
+        len = ctx->len - write_ptr;
 
         logd("Ring buffer has wrapped, dumping trace buffer from write pointer at 0x%" PRIx32 " for %zu\n",
              buf, len);
@@ -251,6 +309,85 @@ int trace_dump(struct trace *ctx, int outfd)
     return rc;
 }
 
+static uint32_t trace_behind(struct trace *ctx)
+{
+    return ctx->base + (ctx->rd + ctx->len - 4) % ctx->len;
+}
+
+int trace_stream_start(struct trace *ctx)
+{
+    ctx->rd = 0;
+    ctx->overruns = 0;
+
+    return soc_writel(ctx->soc, trace_behind(ctx), TRACE_CANARY);
+}
+
+static int trace_copy(struct trace *ctx, uint32_t from, uint32_t to, int outfd)
+{
+    int rc;
+
+    if (to < from) {
+        rc = soc_siphon_out(ctx->soc, ctx->base + from, ctx->len - from,
+                            outfd);
+        if (rc)
+            return rc;
+        from = 0;
+    }
+
+    if (to == from)
+        return 0;
+
+    return soc_siphon_out(ctx->soc, ctx->base + from, to - from, outfd);
+}
+
+/*
+ * The engine overwriting the canary behind the drained position means it
+ * lapped data that hadn't been drained yet. That range is skipped rather than
+ * emitted, and a lap during the copy itself is reported after the fact.
+ */
+int trace_drain(struct trace *ctx, int outfd)
+{
+    uint32_t buf, canary, wp;
+    int rc;
+
+    if ((rc = ahbc_readl(ctx, R_AHBC_BCR_BUF, &buf)))
+        return rc;
+
+    wp = ((buf & ~(uint32_t)3) - ctx->base) % ctx->len;
+
+    if ((rc = soc_readl(ctx->soc, trace_behind(ctx), &canary)))
+        return rc;
+
+    if (canary != TRACE_CANARY) {
+        ctx->overruns++;
+        loge("Trace overrun, lost at least %" PRIu32 " bytes before buffer offset 0x%" PRIx32 "\n",
+             ctx->len, wp);
+    } else if (wp != ctx->rd) {
+        if ((rc = trace_copy(ctx, ctx->rd, wp, outfd)))
+            return rc;
+
+        if ((rc = soc_readl(ctx->soc, trace_behind(ctx), &canary)))
+            return rc;
+
+        if (canary != TRACE_CANARY) {
+            ctx->overruns++;
+            loge("Trace overrun while draining, data before buffer offset 0x%" PRIx32 " may be corrupt\n",
+                 wp);
+        }
+    } else {
+        return 0;
+    }
+
+    ctx->rd = wp;
+
+    return soc_writel(ctx->soc, trace_behind(ctx), TRACE_CANARY);
+}
+
+unsigned long trace_overruns(struct trace *ctx)
+{
+    return ctx->overruns;
+}
+
 static const struct soc_device_id ahbc_match[] = {
     { .compatible = "aspeed,ast2500-ahb-controller" },
     { .compatible = "aspeed,ast2600-ahb-controller" },
@@ -260,21 +397,21 @@ static const struct soc_device_id ahbc_match[] = {
 static int trace_driver_init(struct soc *soc, struct soc_device *dev)
 {
     struct trace *ctx;
-    int rc;
+    int i, rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     rc = soc_device_get_memory(soc, &dev->node, &ctx->ahbc);
     if (rc < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     rc = soc_device_get_memory_region_named(soc, &dev->node, "trace-buffer", &ctx->sram);
     if (rc < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     logi("Found AHBC at 0x%" PRIx32 " and SRAM at 0x%" PRIx32 "\n", ctx->ahbc.start,
@@ -282,6 +419,19 @@ static int trace_driver_init(struct soc *soc, struct soc_device *dev)
 
     ctx->soc = soc;
 
+    /* The largest buffer the SRAM holds */
+    for (i = AHBC_BCR_CSR_BUF_LEN_1024K; i > 0; i--) {
+        if (ahbc_bcr_buf_len[i] <= ctx->sram.length)
+            break;
+    }
+
+    rc = trace_set_buffer(ctx, ctx->sram.start, ahbc_bcr_buf_len[i]);
+    if (rc < 0) {
+        loge("Trace SRAM at 0x%" PRIx32 " is unusable as a buffer\n",
+             ctx->sram.start);
+        return rc;
+    }
+
     soc_device_set_drvdata(dev, ctx);
 
     if ((rc = trace_stop(ctx)) < 0) {
@@ -289,23 +439,12 @@ static int trace_driver_init(struct soc *soc, struct soc_device *dev)
     }
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void trace_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver trace_driver = {
     .name = "trace",
     .matches = ahbc_match,
     .init = trace_driver_init,
-    .destroy = trace_driver_destroy
 };
 REGISTER_SOC_DRIVER(trace_driver);
 
@@ -12,11 +12,26 @@ enum trace_mode { trace_read = 0, trace_write };
 struct trace;
 
 int trace_init(struct trace *ctx, struct soc *soc);
+/*
+ * Capture into @len bytes at @phys, e.g. a free range of DRAM, or in the SRAM
+ * if @phys is 0. @len is 4, 8, 16 or 32KiB, or 128KiB to 1MiB in powers of
+ * two, and @phys must be aligned to it.
+ */
+int trace_set_buffer(struct trace *ctx, uint32_t phys, uint32_t len);
 int trace_start(struct trace *ctx, uint32_t addr, int width,
 		enum trace_mode mode);
 int trace_stop(struct trace *ctx);
 int trace_dump(struct trace *ctx, int outfd);
 
+/*
+ * Streaming, as an alternative to trace_dump(): after trace_start() and
+ * trace_stream_start(), each trace_drain() copies what was captured since the
+ * last one to @outfd. Call it again after trace_stop() for the tail.
+ */
+int trace_stream_start(struct trace *ctx);
+int trace_drain(struct trace *ctx, int outfd);
+unsigned long trace_overruns(struct trace *ctx);
+
 struct trace *trace_get(struct soc *soc);
 
 #endif
@@ -289,19 +289,19 @@ static int uart_mux_driver_init(struct soc *soc, struct soc_device *dev)
     uint32_t val;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->lpc)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
 
     if ((rc = lpc_readl(ctx, LPC_HICR9, &val)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->hicr9 = val;
@@ -315,23 +315,12 @@ static int uart_mux_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void uart_mux_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver uart_mux_driver = {
     .name = "uart-mux",
     .matches = lpc_match,
     .init = uart_mux_driver_init,
-    .destroy = uart_mux_driver_destroy,
 };
 REGISTER_SOC_DRIVER(uart_mux_driver);
 
@@ -8,6 +8,9 @@
 
 #define   VUART_GCRA                    0x20
 #define     VUART_GCRA_TX_DISCARD       (1 << 5)
+#define     VUART_GCRA_VUART_EN         (1 << 0)
+#define   VUART_ADDRL                   0x28
+#define   VUART_ADDRH                   0x2c
 
 struct vuart {
 	struct soc *soc;
@@ -41,18 +44,43 @@ int vuart_set_host_tx_discard(struct vuart *ctx, enum vuart_discard state)
     return soc_writel(ctx->soc, ctx->iomem.start + VUART_GCRA, val);
 }
 
+int vuart_get_host_port(struct vuart *ctx, uint16_t *base)
+{
+    uint32_t gcra, addrl, addrh;
+    int rc;
+
+    rc = soc_readl(ctx->soc, ctx->iomem.start + VUART_GCRA, &gcra);
+    if (rc < 0)
+        return rc;
+
+    if (!(gcra & VUART_GCRA_VUART_EN))
+        return -ENODEV;
+
+    rc = soc_readl(ctx->soc, ctx->iomem.start + VUART_ADDRL, &addrl);
+    if (rc < 0)
+        return rc;
+
+    rc = soc_readl(ctx->soc, ctx->iomem.start + VUART_ADDRH, &addrh);
+    if (rc < 0)
+        return rc;
+
+    *base = ((addrh & 0xff) << 8) | (addrl & 0xff);
+
+    return 0;
+}
+
 static int vuart_driver_init(struct soc *soc, struct soc_device *dev)
 {
     struct vuart *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->iomem)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     ctx->soc = soc;
@@ -60,23 +88,12 @@ static int vuart_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void vuart_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver vuart_driver = {
     .name = "vuart",
     .matches = vuart_match,
     .init = vuart_driver_init,
-    .destroy = vuart_driver_destroy,
 };
 REGISTER_SOC_DRIVER(vuart_driver);
 
@@ -11,6 +11,8 @@ enum vuart_discard { discard_enable, discard_disable };
 struct vuart;
 
 int vuart_set_host_tx_discard(struct vuart *ctx, enum vuart_discard state);
+/* The LPC I/O address the host reaches the VUART at, -ENODEV if it's disabled */
+int vuart_get_host_port(struct vuart *ctx, uint16_t *base);
 
 struct vuart *vuart_get_by_name(struct soc *soc, const char *name);
 
@@ -1,7 +1,10 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2018,2019 IBM Corp.
 
+#include "flash.h"
 #include "log.h"
+#include "mirror.h"
+#include "rev.h"
 #include "wdt.h"
 
 #include <assert.h>
@@ -9,6 +12,7 @@
 #include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Registers */
@@ -25,6 +29,25 @@
 #define   WDT_CTRL_ENABLE	(1 << 0)
 #define WDT_RESET_MASK		0x1c
 
+/*
+ * Bridge accesses the watchdog allows for between arming and letting go of
+ * the bridge, which gives the debug UART its five seconds
+ */
+#define WDT_RESET_OPS		1000
+#define WDT_RESET_MIN_US	100000
+#define WDT_RESET_MAX_US	5000000
+
+/*
+ * Slack past the watchdog's expiry before polling, as it's timed
+ * asynchronously and the bridge may still answer from before the reset
+ */
+#define WDT_SETTLE_MIN_US	100000
+
+/* How long the bridge has to come back once the watchdog has expired */
+#define WDT_READY_MAX_US	5000000
+#define WDT_READY_POLL_US	10000
+#define WDT_READY_POLL_MAX_US	500000
+
 struct wdt {
 	struct soc *soc;
 	struct soc_region iomem;
@@ -120,6 +143,62 @@ static int64_t wdt_usecs_to_ticks(struct wdt *ctx, uint32_t usecs)
     return usecs;
 }
 
+static uint64_t wdt_now_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000ULL + now.tv_nsec / 1000;
+}
+
+static uint32_t wdt_reset_delay_us(struct wdt *ctx)
+{
+    const struct bridge_caps *caps = ahb_bridge_caps(ctx->soc->ahb);
+    uint64_t us;
+
+    us = (uint64_t)caps->op_ns * WDT_RESET_OPS / 1000;
+    if (us < WDT_RESET_MIN_US)
+        return WDT_RESET_MIN_US;
+    if (us > WDT_RESET_MAX_US)
+        return WDT_RESET_MAX_US;
+
+    return us;
+}
+
+/*
+ * Reinitialise the bridge as soon as the SoC is back out of reset, rather
+ * than sleeping for the worst case. It's ready once the revision registers
+ * read back, backing off between attempts as each can be slow.
+ */
+static int wdt_await_bridge(struct wdt *ctx)
+{
+    struct ahb *ahb = ctx->soc->ahb;
+    uint64_t interval = WDT_READY_POLL_US;
+    uint64_t deadline;
+    int64_t rev;
+    int rc;
+
+    deadline = wdt_now_us() + WDT_READY_MAX_US;
+    while (1) {
+        if (!(rc = ahb_reinit_bridge(ahb))) {
+            if ((rev = rev_probe(ahb)) >= 0)
+                return 0;
+            rc = rev;
+        }
+
+        if (wdt_now_us() + interval > deadline)
+            return rc;
+
+        logd("Bridge not ready after reset (%d), retrying in %" PRIu64 "us\n",
+             rc, interval);
+        usleep(interval);
+
+        if (interval < WDT_READY_POLL_MAX_US)
+            interval *= 2;
+    }
+}
+
 int wdt_perform_reset(struct wdt *ctx)
 {
     uint32_t mode;
@@ -138,8 +217,8 @@ int wdt_perform_reset(struct wdt *ctx)
     if (rc < 0)
         return rc;
 
-    /* Wait enough time to cover using the debug UART for a reset */
-    wait = wdt_usecs_to_ticks(ctx, 5000000);
+    /* Wait long enough to finish up over the bridge before the reset */
+    wait = wdt_usecs_to_ticks(ctx, wdt_reset_delay_us(ctx));
     if (wait < 0)
         return wait;
 
@@ -160,18 +239,20 @@ int wdt_perform_reset(struct wdt *ctx)
     if ((rc = wdt_writel(ctx, WDT_CTRL, mode)) < 0)
         return rc;
 
+    /* SDRAM survives the reset, but whatever boots next is free to write it */
+    mirror_invalidate("SoC reset");
+    flash_drop_retained();
+    soc_shadow_flush(ctx->soc);
+
     if ((rc = ahb_release_bridge(ctx->soc->ahb)) < 0)
         return rc;
 
-    /*
-     * Allow a little extra time for reset to occur (we're timing this
-     * asynchronously after all) before we try to reinitialize the bridge
-     */
-    wait += 1000000;
+    /* The clock is 1MHz, so the ticks are microseconds */
+    wait += wait / 10 > WDT_SETTLE_MIN_US ? wait / 10 : WDT_SETTLE_MIN_US;
     logd("Waiting %"PRId64" microseconds for watchdog timer to expire\n", wait);
     usleep(wait);
 
-    if ((rc = ahb_reinit_bridge(ctx->soc->ahb)) < 0) {
+    if ((rc = wdt_await_bridge(ctx)) < 0) {
         loge("Failed to reinitialize bridge after reset: %d\n", rc);
         return rc;
     }
@@ -197,19 +278,18 @@ static int wdt_driver_init(struct soc *soc, struct soc_device *dev)
     struct wdt *ctx;
     int rc;
 
-    ctx = malloc(sizeof(*ctx));
+    ctx = soc_alloc(soc, sizeof(*ctx));
     if (!ctx) {
         return -ENOMEM;
     }
 
     if ((rc = soc_device_get_memory(soc, &dev->node, &ctx->iomem)) < 0) {
-        goto cleanup_ctx;
+        return rc;
     }
 
     if (!(ctx->clk = clk_get(soc))) {
         loge("Failed to acquire clock controller\n");
-        rc = -ENODEV;
-        goto cleanup_ctx;
+        return -ENODEV;
     }
 
     ctx->soc = soc;
@@ -217,23 +297,12 @@ static int wdt_driver_init(struct soc *soc, struct soc_device *dev)
     soc_device_set_drvdata(dev, ctx);
 
     return 0;
-
-cleanup_ctx:
-    free(ctx);
-
-    return rc;
-}
-
-static void wdt_driver_destroy(struct soc_device *dev)
-{
-    free(soc_device_get_drvdata(dev));
 }
 
 static const struct soc_driver wdt_driver = {
     .name = "wdt",
     .matches = wdt_match,
     .init = wdt_driver_init,
-    .destroy = wdt_driver_destroy,
 };
 REGISTER_SOC_DRIVER(wdt_driver);
 
@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#define _GNU_SOURCE
+
+#include "log.h"
+#include "span.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define SPAN_BUF_EVENTS     4096
+/* Stop recording at roughly 150MiB of events rather than exhaust memory */
+#define SPAN_MAX_BUFS       1024
+
+struct span_event {
+    const char *cat;
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+    uint64_t addr;
+    uint64_t len;
+};
+
+struct span_buf {
+    struct span_buf *next;
+    pid_t tid;
+    const char *thread;
+    size_t used;
+    struct span_event events[SPAN_BUF_EVENTS];
+};
+
+bool span_enabled;
+
+static const char *span_path;
+static FILE *span_stream;
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct span_buf *span_bufs;
+static unsigned int span_nr_bufs;
+static uint64_t span_dropped;
+static uint64_t span_epoch;
+
+static __thread struct span_buf *span_current;
+static __thread const char *span_current_thread;
+
+int span_enable(const char *path)
+{
+    /* Open it up front so a bad path fails before the command runs */
+    if (!(span_stream = fopen(path, "w")))
+        return -errno;
+
+    span_path = path;
+    span_enabled = true;
+    span_epoch = span_begin();
+    span_thread_name("main");
+
+    return 0;
+}
+
+/* A thread's buffers are only touched by the thread itself until the dump */
+static struct span_buf *span_buf_get(void)
+{
+    struct span_buf *buf = span_current;
+
+    if (buf && buf->used < SPAN_BUF_EVENTS)
+        return buf;
+
+    pthread_mutex_lock(&span_lock);
+    if (span_nr_bufs < SPAN_MAX_BUFS && (buf = malloc(sizeof(*buf)))) {
+        buf->next = span_bufs;
+        buf->tid = syscall(SYS_gettid);
+        buf->thread = span_current_thread;
+        buf->used = 0;
+        span_bufs = buf;
+        span_nr_bufs++;
+    } else {
+        buf = NULL;
+        span_dropped++;
+    }
+    pthread_mutex_unlock(&span_lock);
+
+    if (buf)
+        span_current = buf;
+
+    return buf;
+}
+
+void span_record(const char *cat, const char *name, uint64_t start,
+                 uint64_t addr, uint64_t len)
+{
+    struct span_event *event;
+    struct span_buf *buf;
+    uint64_t end;
+
+    end = span_begin();
+
+    if (!(buf = span_buf_get()))
+        return;
+
+    event = &buf->events[buf->used++];
+    event->cat = cat;
+    event->name = name;
+    event->start = start;
+    event->end = end;
+    event->addr = addr;
+    event->len = len;
+}
+
+void span_thread_name(const char *name)
+{
+    span_current_thread = name;
+    if (span_current)
+        span_current->thread = name;
+}
+
+static void span_dump_thread(FILE *stream, const struct span_buf *buf,
+                             pid_t pid, bool *first)
+{
+    fprintf(stream, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,"
+            "\"tid\":%d,\"args\":{\"name\":\"%s\"}}", *first ? "" : ",\n",
+            pid, buf->tid, buf->thread);
+    *first = false;
+}
+
+static void span_dump_buf(FILE *stream, const struct span_buf *buf, pid_t pid,
+                          bool *first)
+{
+    const struct span_event *event;
+    size_t i;
+
+    for (i = 0; i < buf->used; i++) {
+        event = &buf->events[i];
+
+        /* Chrome traces count in microseconds */
+        fprintf(stream, "%s{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d",
+                *first ? "" : ",\n", event->name, event->cat,
+                (event->start - span_epoch) / 1e3,
+                (event->end - event->start) / 1e3, pid, buf->tid);
+        if (event->addr || event->len)
+            fprintf(stream, ",\"args\":{\"addr\":\"0x%08" PRIx64 "\",\"len\":%"
+                    PRIu64 "}", event->addr, event->len);
+        fprintf(stream, "}");
+        *first = false;
+    }
+}
+
+int span_dump(void)
+{
+    const struct span_buf *buf, *named;
+    FILE *stream = span_stream;
+    bool first = true;
+    pid_t pid;
+    int rc;
+
+    if (!span_enabled)
+        return 0;
+
+    span_enabled = false;
+    span_stream = NULL;
+    pid = getpid();
+
+    fprintf(stream, "{\"traceEvents\":[\n");
+
+    pthread_mutex_lock(&span_lock);
+    for (buf = span_bufs; buf; buf = buf->next) {
+        /* Name each thread once, from the newest of its buffers */
+        for (named = span_bufs; named != buf; named = named->next) {
+            if (named->tid == buf->tid)
+                break;
+        }
+
+        if (named == buf && buf->thread)
+            span_dump_thread(stream, buf, pid, &first);
+
+        span_dump_buf(stream, buf, pid, &first);
+    }
+
+    if (span_dropped)
+        logi("Dropped %" PRIu64 " spans past the recording limit\n",
+             span_dropped);
+    pthread_mutex_unlock(&span_lock);
+
+    fprintf(stream, "\n],\"displayTimeUnit\":\"ns\"}\n");
+
+    rc = fclose(stream) ? -errno : 0;
+    if (rc)
+        loge("Failed to write span trace '%s': %d\n", span_path, rc);
+
+    return rc;
+}
@@ -0,0 +1,56 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SPAN_H
+#define _SPAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * Scoped spans recorded into per-thread buffers and written out as a Chrome
+ * trace, for chrome://tracing or the Perfetto UI. A span is begun by taking a
+ * timestamp with span_begin() and recorded by span_end(), so nothing is
+ * recorded for spans abandoned on an error path. @cat and @name must outlive
+ * the recording, which string literals and driver names do.
+ */
+extern bool span_enabled;
+
+/* Records spans from here on, for span_dump() to write to @path */
+int span_enable(const char *path);
+
+static inline uint64_t span_ts(const struct timespec *ts)
+{
+    return ts->tv_sec * 1000000000ULL + ts->tv_nsec;
+}
+
+static inline uint64_t span_begin(void)
+{
+    struct timespec now;
+
+    if (!span_enabled)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return span_ts(&now);
+}
+
+void span_record(const char *cat, const char *name, uint64_t start,
+                 uint64_t addr, uint64_t len);
+
+/* @addr and @len are shown as the span's arguments unless both are zero */
+static inline void span_end(const char *cat, const char *name, uint64_t start,
+                            uint64_t addr, uint64_t len)
+{
+    if (start)
+        span_record(cat, name, start, addr, len);
+}
+
+/* Labels the calling thread's track */
+void span_thread_name(const char *name);
+
+/* Writes out everything recorded so far, once the other threads are done */
+int span_dump(void);
+
+#endif
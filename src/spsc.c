@@ -0,0 +1,141 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "bufpool.h"
+#include "spsc.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+int spsc_init(struct spsc *ctx, size_t size)
+{
+    if (!size || (size & (size - 1)))
+        return -EINVAL;
+
+    if (!(ctx->buf = bufpool_get(size)))
+        return -ENOMEM;
+
+    if ((ctx->efd = eventfd(0, EFD_CLOEXEC)) < 0) {
+        int rc = -errno;
+
+        bufpool_put(ctx->buf, size);
+        return rc;
+    }
+
+    ctx->size = size;
+    ctx->head = 0;
+    ctx->tail = 0;
+    ctx->waiting = false;
+    ctx->closed = false;
+    ctx->rc = 0;
+
+    return 0;
+}
+
+void spsc_destroy(struct spsc *ctx)
+{
+    close(ctx->efd);
+    bufpool_put(ctx->buf, ctx->size);
+}
+
+static void spsc_wake(struct spsc *ctx)
+{
+    uint64_t one = 1;
+
+    /*
+     * Pairs with the consumer setting @waiting before it looks at @head for
+     * the last time, so one of the two sees the other's store
+     */
+    if (__atomic_load_n(&ctx->waiting, __ATOMIC_SEQ_CST)) {
+        if (write(ctx->efd, &one, sizeof(one)) < 0) {
+            /* The count can't overflow with a consumer draining it */
+        }
+    }
+}
+
+size_t spsc_write(struct spsc *ctx, const void *buf, size_t len)
+{
+    size_t tail = __atomic_load_n(&ctx->tail, __ATOMIC_ACQUIRE);
+    size_t head = ctx->head;
+    size_t space = ctx->size - (head - tail);
+    size_t off = head & (ctx->size - 1);
+    size_t first;
+
+    if (len > space)
+        len = space;
+
+    if (!len)
+        return 0;
+
+    first = len < ctx->size - off ? len : ctx->size - off;
+    memcpy(&ctx->buf[off], buf, first);
+    memcpy(ctx->buf, (const char *)buf + first, len - first);
+
+    __atomic_store_n(&ctx->head, head + len, __ATOMIC_SEQ_CST);
+    spsc_wake(ctx);
+
+    return len;
+}
+
+void spsc_close(struct spsc *ctx)
+{
+    __atomic_store_n(&ctx->closed, true, __ATOMIC_SEQ_CST);
+    spsc_wake(ctx);
+}
+
+size_t spsc_peek(struct spsc *ctx, const void **buf)
+{
+    size_t tail = ctx->tail;
+    size_t head, off;
+    uint64_t count;
+
+    while (1) {
+        if (__atomic_load_n(&ctx->rc, __ATOMIC_ACQUIRE))
+            return 0;
+
+        head = __atomic_load_n(&ctx->head, __ATOMIC_ACQUIRE);
+        if (head != tail)
+            break;
+
+        if (__atomic_load_n(&ctx->closed, __ATOMIC_ACQUIRE))
+            return 0;
+
+        /* Look once more after saying we're asleep, see spsc_wake() */
+        __atomic_store_n(&ctx->waiting, true, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ctx->head, __ATOMIC_SEQ_CST) == tail &&
+                !__atomic_load_n(&ctx->closed, __ATOMIC_SEQ_CST) &&
+                !__atomic_load_n(&ctx->rc, __ATOMIC_SEQ_CST)) {
+            if (read(ctx->efd, &count, sizeof(count)) < 0 && errno != EINTR) {
+                spsc_abort(ctx, -errno);
+                return 0;
+            }
+        }
+        __atomic_store_n(&ctx->waiting, false, __ATOMIC_RELAXED);
+    }
+
+    off = tail & (ctx->size - 1);
+    *buf = &ctx->buf[off];
+
+    return (head - tail) < ctx->size - off ? head - tail : ctx->size - off;
+}
+
+void spsc_consume(struct spsc *ctx, size_t len)
+{
+    __atomic_store_n(&ctx->tail, ctx->tail + len, __ATOMIC_RELEASE);
+}
+
+void spsc_abort(struct spsc *ctx, int rc)
+{
+    int none = 0;
+
+    __atomic_compare_exchange_n(&ctx->rc, &none, rc, false, __ATOMIC_SEQ_CST,
+                                __ATOMIC_SEQ_CST);
+    spsc_wake(ctx);
+}
+
+int spsc_status(struct spsc *ctx)
+{
+    return __atomic_load_n(&ctx->rc, __ATOMIC_ACQUIRE);
+}
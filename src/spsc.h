@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SPSC_H
+#define _SPSC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * A byte ring between one producer and one consumer thread that never blocks
+ * the producer: it takes what fits and leaves the caller to decide about the
+ * rest. The indices are free-running and published with acquire/release
+ * ordering, so neither side takes a lock. The consumer sleeps on an eventfd
+ * when the ring is empty, and the producer only pays for the wakeup when it
+ * finds the consumer asleep.
+ */
+struct spsc {
+    char *buf;
+    /* A power of two */
+    size_t size;
+    /* Written only by the producer */
+    size_t head;
+    /* Written only by the consumer */
+    size_t tail;
+    int efd;
+    bool waiting;
+    bool closed;
+    int rc;
+};
+
+int spsc_init(struct spsc *ctx, size_t size);
+void spsc_destroy(struct spsc *ctx);
+
+/* Producer side, returns how much of @len was taken */
+size_t spsc_write(struct spsc *ctx, const void *buf, size_t len);
+/* No more data follows, the consumer sees 0 once it has the rest */
+void spsc_close(struct spsc *ctx);
+
+/*
+ * Consumer side: waits for data and points @buf at as much of it as is
+ * contiguous, returning its length, 0 once the ring is closed and empty
+ */
+size_t spsc_peek(struct spsc *ctx, const void **buf);
+void spsc_consume(struct spsc *ctx, size_t len);
+
+/* Either side, the first error wins and the consumer stops */
+void spsc_abort(struct spsc *ctx, int rc);
+int spsc_status(struct spsc *ctx);
+
+#endif
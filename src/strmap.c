@@ -0,0 +1,149 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "strmap.h"
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRMAP_INITIAL_SIZE 64
+
+/* FNV-1a */
+static uint32_t strmap_hash(const char *key)
+{
+    uint32_t hash = 2166136261u;
+
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+int strmap_init(struct strmap *ctx)
+{
+    ctx->entries = calloc(STRMAP_INITIAL_SIZE, sizeof(*ctx->entries));
+    if (!ctx->entries)
+        return -ENOMEM;
+
+    ctx->size = STRMAP_INITIAL_SIZE;
+    ctx->used = 0;
+
+    return 0;
+}
+
+void strmap_destroy(struct strmap *ctx)
+{
+    size_t i;
+
+    for (i = 0; i < ctx->size; i++)
+        free(ctx->entries[i].key);
+
+    free(ctx->entries);
+    ctx->entries = NULL;
+    ctx->size = 0;
+    ctx->used = 0;
+}
+
+static struct strmap_entry *
+strmap_slot(struct strmap_entry *entries, size_t size, const char *key,
+            uint32_t hash)
+{
+    size_t i = hash & (size - 1);
+
+    while (entries[i].key) {
+        if (entries[i].hash == hash && !strcmp(entries[i].key, key))
+            break;
+
+        i = (i + 1) & (size - 1);
+    }
+
+    return &entries[i];
+}
+
+static int strmap_grow(struct strmap *ctx)
+{
+    struct strmap_entry *entries, *slot;
+    size_t size = ctx->size * 2;
+    size_t i;
+
+    if (!(entries = calloc(size, sizeof(*entries))))
+        return -ENOMEM;
+
+    for (i = 0; i < ctx->size; i++) {
+        if (!ctx->entries[i].key)
+            continue;
+
+        slot = strmap_slot(entries, size, ctx->entries[i].key,
+                           ctx->entries[i].hash);
+        *slot = ctx->entries[i];
+    }
+
+    free(ctx->entries);
+    ctx->entries = entries;
+    ctx->size = size;
+
+    return 0;
+}
+
+static int strmap_insert(struct strmap *ctx, const char *key, intptr_t value,
+                         bool replace)
+{
+    struct strmap_entry *slot;
+    uint32_t hash;
+    int rc;
+
+    /* Keep the load factor at or below 3/4 */
+    if ((ctx->used + 1) * 4 > ctx->size * 3) {
+        if ((rc = strmap_grow(ctx)) < 0)
+            return rc;
+    }
+
+    hash = strmap_hash(key);
+    slot = strmap_slot(ctx->entries, ctx->size, key, hash);
+    if (slot->key) {
+        if (!replace)
+            return -EEXIST;
+
+        slot->value = value;
+
+        return 0;
+    }
+
+    if (!(slot->key = strdup(key)))
+        return -ENOMEM;
+
+    slot->hash = hash;
+    slot->value = value;
+    ctx->used++;
+
+    return 0;
+}
+
+int strmap_add(struct strmap *ctx, const char *key, intptr_t value)
+{
+    return strmap_insert(ctx, key, value, false);
+}
+
+int strmap_set(struct strmap *ctx, const char *key, intptr_t value)
+{
+    return strmap_insert(ctx, key, value, true);
+}
+
+int strmap_get(const struct strmap *ctx, const char *key, intptr_t *value)
+{
+    struct strmap_entry *slot;
+
+    if (!ctx->size)
+        return -ENOENT;
+
+    slot = strmap_slot(ctx->entries, ctx->size, key, strmap_hash(key));
+    if (!slot->key)
+        return -ENOENT;
+
+    *value = slot->value;
+
+    return 0;
+}
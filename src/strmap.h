@@ -0,0 +1,31 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _STRMAP_H
+#define _STRMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct strmap_entry {
+    char *key;
+    uint32_t hash;
+    intptr_t value;
+};
+
+/* An open-addressed hash table from strings to integers, keys are copied */
+struct strmap {
+    struct strmap_entry *entries;
+    size_t size;
+    size_t used;
+};
+
+int strmap_init(struct strmap *ctx);
+void strmap_destroy(struct strmap *ctx);
+
+/* The first value added for a key is kept, later additions see -EEXIST */
+int strmap_add(struct strmap *ctx, const char *key, intptr_t value);
+/* Adds @key or replaces its value */
+int strmap_set(struct strmap *ctx, const char *key, intptr_t value);
+int strmap_get(const struct strmap *ctx, const char *key, intptr_t *value);
+
+#endif
@@ -0,0 +1,1135 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "array.h"
+#include "compiler.h"
+#include "log.h"
+#include "progress.h"
+#include "svf.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/* TCK cycles handed to the controller at once, two pin states each */
+#define SVF_CLOCK_BATCH         256
+
+/* Enough for the longest standard command, a RUNTEST with every clause */
+#define SVF_MAX_TOKENS          32
+
+/* Xilinx's reference player retries a failed XSDR this many times by default */
+#define XSVF_REPEAT_DEFAULT     32
+
+/* The TAP, and whether a scan can be left to the controller's shift engine */
+struct svf_tap {
+    struct jtag *jtag;
+    enum tap_state state;
+    bool engine;
+    unsigned long scans;
+    unsigned long engine_scans;
+};
+
+static inline bool svf_bit(const uint8_t *vec, size_t i)
+{
+    return (vec[i / 8] >> (i % 8)) & 1;
+}
+
+static inline void svf_set_bit(uint8_t *vec, size_t i, bool val)
+{
+    if (val)
+        vec[i / 8] |= 1 << (i % 8);
+    else
+        vec[i / 8] &= ~(1 << (i % 8));
+}
+
+/* Clocks @bits cycles of @tms and @tdi, or TDI low if @tdi is NULL */
+static int svf_tap_clock(struct svf_tap *tap, const uint8_t *tms,
+                         const uint8_t *tdi, size_t bits)
+{
+    uint8_t states[2 * SVF_CLOCK_BATCH];
+    size_t done, i, n;
+    int rc;
+
+    for (done = 0; done < bits; done += n) {
+        n = bits - done < SVF_CLOCK_BATCH ? bits - done : SVF_CLOCK_BATCH;
+
+        for (i = 0; i < n; i++) {
+            uint8_t m = svf_bit(tms, done + i);
+            uint8_t d = tdi ? svf_bit(tdi, done + i) : 0;
+
+            states[2 * i] = (m << 1) | d;
+            states[2 * i + 1] = 4 | (m << 1) | d;
+            tap->state = jtag_tap_next[tap->state][m];
+        }
+
+        if ((rc = jtag_bitbang_set_states(tap->jtag, states, 2 * n)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+/* Clocks @count cycles without leaving a stable state */
+static int svf_tap_hold(struct svf_tap *tap, uint64_t count)
+{
+    uint8_t tms = tap->state == tap_reset;
+    uint8_t states[2 * SVF_CLOCK_BATCH];
+    size_t i, n;
+    int rc;
+
+    for (i = 0; i < SVF_CLOCK_BATCH; i++) {
+        states[2 * i] = tms << 1;
+        states[2 * i + 1] = 4 | (tms << 1);
+    }
+
+    while (count) {
+        n = count < SVF_CLOCK_BATCH ? count : SVF_CLOCK_BATCH;
+
+        if ((rc = jtag_bitbang_set_states(tap->jtag, states, 2 * n)) < 0)
+            return rc;
+
+        count -= n;
+    }
+
+    return 0;
+}
+
+/*
+ * Moves by the shortest path, which between the stable states is the one SVF
+ * defines. Reset is always entered with five TMS highs, wherever the TAP is.
+ */
+static int svf_tap_goto(struct svf_tap *tap, enum tap_state to)
+{
+    enum tap_state queue[16], prev[16], s;
+    bool seen[16] = { false };
+    uint8_t move[16], path[2] = { 0 };
+    size_t head = 0, tail = 0, len = 0, i;
+    int m;
+
+    if (to == tap_reset) {
+        path[0] = 0x1f;
+        return svf_tap_clock(tap, path, NULL, 5);
+    }
+
+    if (tap->state == to)
+        return 0;
+
+    queue[tail++] = tap->state;
+    seen[tap->state] = true;
+    while (head < tail && !seen[to]) {
+        s = queue[head++];
+        for (m = 0; m < 2; m++) {
+            enum tap_state next = jtag_tap_next[s][m];
+
+            if (seen[next])
+                continue;
+
+            seen[next] = true;
+            prev[next] = s;
+            move[next] = m;
+            queue[tail++] = next;
+        }
+    }
+
+    for (s = to; s != tap->state; s = prev[s])
+        len++;
+
+    for (i = len, s = to; s != tap->state; s = prev[s])
+        svf_set_bit(path, --i, move[s]);
+
+    return svf_tap_clock(tap, path, NULL, len);
+}
+
+/*
+ * Shifts @bits of @tdi through IR or DR from a stable state, then moves on to
+ * @end. TDO lands in @tdo, though without @capture it's only meaningful if the
+ * engine made the scan. The engine can't stop short of Run-Test/Idle, so it
+ * only takes scans that begin and end there.
+ */
+static int svf_tap_scan(struct svf_tap *tap, bool ir, const uint8_t *tdi,
+                        uint8_t *tdo, bool capture, size_t bits,
+                        enum tap_state end)
+{
+    uint8_t *tms;
+    size_t i;
+    int rc;
+
+    tap->scans++;
+
+    if (tap->engine && end == tap_idle &&
+            (tap->state == tap_idle || tap->state == tap_reset)) {
+        if ((rc = svf_tap_goto(tap, tap_idle)) < 0)
+            return rc;
+
+        tap->engine_scans++;
+
+        return jtag_shift(tap->jtag, ir, tdi, tdo, bits);
+    }
+
+    if ((rc = svf_tap_goto(tap, ir ? tap_irshift : tap_drshift)) < 0)
+        return rc;
+
+    if (!capture) {
+        if (!(tms = calloc(1, (bits + 7) / 8)))
+            return -ENOMEM;
+
+        svf_set_bit(tms, bits - 1, true);
+        rc = svf_tap_clock(tap, tms, tdi, bits);
+        free(tms);
+    } else {
+        memset(tdo, 0, (bits + 7) / 8);
+
+        for (i = 0; i < bits; i++) {
+            uint8_t m = i == bits - 1;
+            uint8_t d = svf_bit(tdi, i);
+            uint8_t out;
+
+            if ((rc = jtag_bitbang_set(tap->jtag, 0, m, d)) < 0)
+                return rc;
+
+            if ((rc = jtag_bitbang_get(tap->jtag, &out)) < 0)
+                return rc;
+
+            if ((rc = jtag_bitbang_set(tap->jtag, 1, m, d)) < 0)
+                return rc;
+
+            svf_set_bit(tdo, i, out);
+            tap->state = jtag_tap_next[tap->state][m];
+        }
+    }
+
+    if (rc < 0)
+        return rc;
+
+    return svf_tap_goto(tap, end);
+}
+
+/* At least @clocks cycles in @state, taking at least @usec in all */
+static int svf_tap_run(struct svf_tap *tap, enum tap_state state,
+                       uint64_t clocks, uint64_t usec)
+{
+    struct timespec start, now, wait;
+    uint64_t elapsed;
+    int rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if ((rc = svf_tap_goto(tap, state)) < 0)
+        return rc;
+
+    if ((rc = svf_tap_hold(tap, clocks)) < 0)
+        return rc;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) * 1000000ULL +
+              (now.tv_nsec - start.tv_nsec) / 1000;
+
+    if (elapsed < usec) {
+        usec -= elapsed;
+        wait.tv_sec = usec / 1000000;
+        wait.tv_nsec = (usec % 1000000) * 1000;
+        while (nanosleep(&wait, &wait) < 0 && errno == EINTR)
+            ;
+    }
+
+    return 0;
+}
+
+static bool svf_matches(const uint8_t *got, const uint8_t *expect,
+                        const uint8_t *mask, size_t bits)
+{
+    size_t i;
+
+    for (i = 0; i < bits; i++) {
+        if (svf_bit(mask, i) && svf_bit(got, i) != svf_bit(expect, i))
+            return false;
+    }
+
+    return true;
+}
+
+static int svf_load(const char *path, uint8_t **data, size_t *len)
+{
+    struct stat st;
+    ssize_t ingress;
+    size_t done = 0;
+    int fd, rc;
+
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+        rc = -errno;
+        loge("Failed to open %s: %s\n", path, strerror(errno));
+        return rc;
+    }
+
+    if (fstat(fd, &st) < 0) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    *len = st.st_size;
+    if (!(*data = malloc(*len + 1))) {
+        rc = -ENOMEM;
+        goto cleanup_fd;
+    }
+
+    while (done < *len) {
+        if ((ingress = read(fd, *data + done, *len - done)) <= 0) {
+            if (ingress < 0 && errno == EINTR)
+                continue;
+            rc = ingress < 0 ? -errno : -EIO;
+            free(*data);
+            goto cleanup_fd;
+        }
+        done += ingress;
+    }
+
+    (*data)[*len] = '\0';
+    rc = 0;
+
+cleanup_fd:
+    close(fd);
+
+    return rc;
+}
+
+/* SVF */
+
+enum svf_reg_id {
+    svf_hir, svf_sir, svf_tir,
+    svf_hdr, svf_sdr, svf_tdr,
+    svf_nr_regs,
+};
+
+/* TDI, MASK and SMASK persist while the length doesn't change, TDO never does */
+struct svf_reg {
+    size_t len;
+    uint8_t *tdi;
+    uint8_t *tdo;
+    uint8_t *mask;
+    uint8_t *smask;
+    bool has_tdo;
+};
+
+struct svf {
+    struct svf_tap tap;
+    struct svf_reg regs[svf_nr_regs];
+    enum tap_state endir;
+    enum tap_state enddr;
+    enum tap_state run_state;
+    enum tap_state run_end;
+    /* The statement read last, normalised, and the line it began on */
+    char *stmt;
+    size_t stmt_size;
+    unsigned long line;
+};
+
+/* In the order of enum tap_state */
+static const char *const svf_states[] = {
+    "RESET", "IDLE",
+    "DRSELECT", "DRCAPTURE", "DRSHIFT", "DREXIT1", "DRPAUSE", "DREXIT2",
+    "DRUPDATE",
+    "IRSELECT", "IRCAPTURE", "IRSHIFT", "IREXIT1", "IRPAUSE", "IREXIT2",
+    "IRUPDATE",
+};
+
+static int svf_parse_state(const char *tok, bool stable, enum tap_state *state)
+{
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(svf_states); i++) {
+        if (strcmp(tok, svf_states[i]))
+            continue;
+
+        if (stable && i != tap_reset && i != tap_idle && i != tap_drpause &&
+                i != tap_irpause)
+            return -EINVAL;
+
+        *state = i;
+
+        return 0;
+    }
+
+    return -EINVAL;
+}
+
+static int svf_parse_real(const char *tok, double *val)
+{
+    char *endp;
+
+    errno = 0;
+    *val = strtod(tok, &endp);
+    if (errno || *endp || endp == tok || *val < 0)
+        return -EINVAL;
+
+    return 0;
+}
+
+/* Hex digits in parentheses, the last digit holding the first bits shifted */
+static int svf_parse_hex(const char *tok, uint8_t *vec, size_t bits)
+{
+    size_t ndigits = strlen(tok), i, b;
+
+    if (ndigits < 2 || tok[0] != '(' || tok[ndigits - 1] != ')')
+        return -EINVAL;
+
+    ndigits -= 2;
+    memset(vec, 0, (bits + 7) / 8);
+
+    for (i = 0; i < ndigits; i++) {
+        char c = tok[ndigits - i];
+        int val;
+
+        if (c >= '0' && c <= '9')
+            val = c - '0';
+        else if (c >= 'A' && c <= 'F')
+            val = c - 'A' + 10;
+        else
+            return -EINVAL;
+
+        for (b = 0; b < 4; b++) {
+            if (!((val >> b) & 1))
+                continue;
+
+            if (4 * i + b >= bits)
+                return -EINVAL;
+
+            svf_set_bit(vec, 4 * i + b, true);
+        }
+    }
+
+    return 0;
+}
+
+static int svf_reg_resize(struct svf_reg *reg, size_t len)
+{
+    size_t bytes = len ? (len + 7) / 8 : 1;
+    uint8_t **vecs[] = { &reg->tdi, &reg->tdo, &reg->mask, &reg->smask };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(vecs); i++) {
+        uint8_t *vec;
+
+        if (!(vec = realloc(*vecs[i], bytes)))
+            return -ENOMEM;
+
+        memset(vec, vecs[i] == &reg->mask || vecs[i] == &reg->smask ? 0xff : 0,
+               bytes);
+        *vecs[i] = vec;
+    }
+
+    reg->len = len;
+
+    return 0;
+}
+
+/*
+ * The header is shifted first and the trailer last, so with bits numbered in
+ * shift order the scan is the three laid end to end.
+ */
+static int svf_scan(struct svf *ctx, bool ir)
+{
+    const struct svf_reg *parts[3];
+    uint8_t *tdi, *tdo, *expect, *mask;
+    bool capture = false;
+    size_t total = 0, bytes, off, i, j;
+    int rc;
+
+    parts[0] = &ctx->regs[ir ? svf_hir : svf_hdr];
+    parts[1] = &ctx->regs[ir ? svf_sir : svf_sdr];
+    parts[2] = &ctx->regs[ir ? svf_tir : svf_tdr];
+
+    for (i = 0; i < 3; i++) {
+        total += parts[i]->len;
+        capture |= parts[i]->has_tdo;
+    }
+
+    if (!total)
+        return 0;
+
+    bytes = (total + 7) / 8;
+    tdi = calloc(1, bytes);
+    tdo = calloc(1, bytes);
+    expect = calloc(1, bytes);
+    mask = calloc(1, bytes);
+    if (!tdi || !tdo || !expect || !mask) {
+        rc = -ENOMEM;
+        goto done;
+    }
+
+    for (i = 0, off = 0; i < 3; i++) {
+        for (j = 0; j < parts[i]->len; j++, off++) {
+            svf_set_bit(tdi, off, svf_bit(parts[i]->tdi, j));
+            if (!parts[i]->has_tdo)
+                continue;
+            svf_set_bit(expect, off, svf_bit(parts[i]->tdo, j));
+            svf_set_bit(mask, off, svf_bit(parts[i]->mask, j));
+        }
+    }
+
+    rc = svf_tap_scan(&ctx->tap, ir, tdi, tdo, capture, total,
+                      ir ? ctx->endir : ctx->enddr);
+    if (!rc && capture && !svf_matches(tdo, expect, mask, total)) {
+        loge("TDO mismatch in the %s scan on line %lu\n", ir ? "SIR" : "SDR",
+             ctx->line);
+        rc = -EIO;
+    }
+
+done:
+    free(tdi);
+    free(tdo);
+    free(expect);
+    free(mask);
+
+    return rc;
+}
+
+static int svf_cmd_xr(struct svf *ctx, enum svf_reg_id id, char **tok,
+                      size_t ntok)
+{
+    struct svf_reg *reg = &ctx->regs[id];
+    unsigned long len;
+    char *endp;
+    size_t i;
+    int rc;
+
+    if (ntok < 2)
+        return -EINVAL;
+
+    errno = 0;
+    len = strtoul(tok[1], &endp, 10);
+    if (errno || *endp || len > (1UL << 30))
+        return -EINVAL;
+
+    if ((len != reg->len || !reg->tdi) && (rc = svf_reg_resize(reg, len)) < 0)
+        return rc;
+
+    reg->has_tdo = false;
+
+    for (i = 2; i + 1 < ntok; i += 2) {
+        uint8_t *vec;
+
+        if (!strcmp(tok[i], "TDI")) {
+            vec = reg->tdi;
+        } else if (!strcmp(tok[i], "TDO")) {
+            vec = reg->tdo;
+            reg->has_tdo = true;
+        } else if (!strcmp(tok[i], "MASK")) {
+            vec = reg->mask;
+        } else if (!strcmp(tok[i], "SMASK")) {
+            vec = reg->smask;
+        } else {
+            return -EINVAL;
+        }
+
+        if ((rc = svf_parse_hex(tok[i + 1], vec, len)) < 0)
+            return rc;
+    }
+
+    if (i != ntok)
+        return -EINVAL;
+
+    if (id == svf_sir || id == svf_sdr)
+        return svf_scan(ctx, id == svf_sir);
+
+    return 0;
+}
+
+static int svf_cmd_end(struct svf *ctx, char **tok, size_t ntok)
+{
+    if (ntok != 2)
+        return -EINVAL;
+
+    return svf_parse_state(tok[1], true,
+                           !strcmp(tok[0], "ENDIR") ? &ctx->endir : &ctx->enddr);
+}
+
+static int svf_cmd_state(struct svf *ctx, char **tok, size_t ntok)
+{
+    enum tap_state state;
+    size_t i;
+    int rc;
+
+    if (ntok < 2)
+        return -EINVAL;
+
+    for (i = 1; i < ntok; i++) {
+        if ((rc = svf_parse_state(tok[i], i == ntok - 1, &state)) < 0)
+            return rc;
+
+        if ((rc = svf_tap_goto(&ctx->tap, state)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int svf_cmd_runtest(struct svf *ctx, char **tok, size_t ntok)
+{
+    double count = 0, min_time = 0, max_time;
+    enum tap_state state;
+    size_t i = 1;
+    int rc;
+
+    if (i < ntok && !svf_parse_state(tok[i], true, &state)) {
+        ctx->run_state = state;
+        ctx->run_end = state;
+        i++;
+    }
+
+    if (i + 1 < ntok && (!strcmp(tok[i + 1], "TCK") || !strcmp(tok[i + 1], "SCK"))) {
+        if ((rc = svf_parse_real(tok[i], &count)) < 0)
+            return rc;
+        i += 2;
+    }
+
+    if (i + 1 < ntok && !strcmp(tok[i + 1], "SEC")) {
+        if ((rc = svf_parse_real(tok[i], &min_time)) < 0)
+            return rc;
+        i += 2;
+    }
+
+    /* Nothing here is slow enough to overrun a maximum */
+    if (i + 2 < ntok && !strcmp(tok[i], "MAXIMUM") && !strcmp(tok[i + 2], "SEC")) {
+        if ((rc = svf_parse_real(tok[i + 1], &max_time)) < 0)
+            return rc;
+        i += 3;
+    }
+
+    if (i + 1 < ntok && !strcmp(tok[i], "ENDSTATE")) {
+        if ((rc = svf_parse_state(tok[i + 1], true, &ctx->run_end)) < 0)
+            return rc;
+        i += 2;
+    }
+
+    if (i != ntok || count > (double)UINT32_MAX || min_time > 3600)
+        return -EINVAL;
+
+    if ((rc = svf_tap_run(&ctx->tap, ctx->run_state, count, min_time * 1e6)) < 0)
+        return rc;
+
+    return svf_tap_goto(&ctx->tap, ctx->run_end);
+}
+
+static int svf_cmd_trst(struct svf *ctx, char **tok, size_t ntok)
+{
+    if (ntok != 2)
+        return -EINVAL;
+
+    /* The controller has no TRST, so only its absence can be honoured */
+    if (!strcmp(tok[1], "ON")) {
+        loge("TRST can't be asserted, on line %lu\n", ctx->line);
+        return -ENOTSUP;
+    }
+
+    return 0;
+}
+
+static int svf_cmd_frequency(struct svf *ctx, char **tok, size_t ntok __unused)
+{
+    /* The bridge sets the pace, a bound on TCK is always met */
+    logd("Ignoring %s on line %lu\n", tok[0], ctx->line);
+
+    return 0;
+}
+
+static const struct svf_cmd {
+    const char *name;
+    int (*fn)(struct svf *ctx, char **tok, size_t ntok);
+    int reg;
+} svf_cmds[] = {
+    { "ENDDR", svf_cmd_end, -1 },
+    { "ENDIR", svf_cmd_end, -1 },
+    { "FREQUENCY", svf_cmd_frequency, -1 },
+    { "HDR", NULL, svf_hdr },
+    { "HIR", NULL, svf_hir },
+    { "RUNTEST", svf_cmd_runtest, -1 },
+    { "SDR", NULL, svf_sdr },
+    { "SIR", NULL, svf_sir },
+    { "STATE", svf_cmd_state, -1 },
+    { "TDR", NULL, svf_tdr },
+    { "TIR", NULL, svf_tir },
+    { "TRST", svf_cmd_trst, -1 },
+};
+
+static int svf_stmt_put(struct svf *ctx, size_t *len, char c)
+{
+    char *stmt;
+
+    if (*len + 1 >= ctx->stmt_size) {
+        size_t size = ctx->stmt_size ? 2 * ctx->stmt_size : 4096;
+
+        if (!(stmt = realloc(ctx->stmt, size)))
+            return -ENOMEM;
+
+        ctx->stmt = stmt;
+        ctx->stmt_size = size;
+    }
+
+    ctx->stmt[(*len)++] = c;
+
+    return 0;
+}
+
+/*
+ * Takes the next statement from @data, upper-cased with comments dropped,
+ * parenthesised data squeezed into one token and other whitespace into single
+ * spaces. Returns 1 for a statement, 0 at the end of the file.
+ */
+static int svf_next_stmt(struct svf *ctx, const char *data, size_t len,
+                         size_t *pos, unsigned long *line)
+{
+    bool paren = false, blank = true;
+    size_t out = 0;
+    int rc = 0;
+
+    ctx->line = *line;
+
+    while (*pos < len && rc >= 0) {
+        char c = data[(*pos)++];
+
+        if (c == '\n')
+            (*line)++;
+
+        if (blank && isspace((unsigned char)c))
+            ctx->line = *line;
+
+        if (c == '!' || (c == '/' && *pos < len && data[*pos] == '/')) {
+            while (*pos < len && data[*pos] != '\n')
+                (*pos)++;
+            continue;
+        }
+
+        if (c == ';' && !paren) {
+            rc = svf_stmt_put(ctx, &out, '\0');
+            return rc < 0 ? rc : 1;
+        }
+
+        if (c == '(') {
+            paren = true;
+            if (!(rc = svf_stmt_put(ctx, &out, ' ')))
+                rc = svf_stmt_put(ctx, &out, c);
+        } else if (c == ')') {
+            paren = false;
+            if (!(rc = svf_stmt_put(ctx, &out, c)))
+                rc = svf_stmt_put(ctx, &out, ' ');
+        } else if (isspace((unsigned char)c)) {
+            if (!paren)
+                rc = svf_stmt_put(ctx, &out, ' ');
+        } else {
+            blank = false;
+            rc = svf_stmt_put(ctx, &out, toupper((unsigned char)c));
+        }
+    }
+
+    if (rc < 0)
+        return rc;
+
+    if (!blank) {
+        loge("Unterminated statement from line %lu\n", ctx->line);
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+static int svf_exec(struct svf *ctx)
+{
+    char *tok[SVF_MAX_TOKENS], *save, *t;
+    size_t ntok = 0, i;
+
+    for (t = strtok_r(ctx->stmt, " ", &save); t; t = strtok_r(NULL, " ", &save)) {
+        if (ntok == SVF_MAX_TOKENS)
+            return -E2BIG;
+        tok[ntok++] = t;
+    }
+
+    if (!ntok)
+        return 0;
+
+    for (i = 0; i < ARRAY_SIZE(svf_cmds); i++) {
+        if (strcmp(tok[0], svf_cmds[i].name))
+            continue;
+
+        if (svf_cmds[i].reg >= 0)
+            return svf_cmd_xr(ctx, svf_cmds[i].reg, tok, ntok);
+
+        return svf_cmds[i].fn(ctx, tok, ntok);
+    }
+
+    loge("Unsupported SVF command %s on line %lu\n", tok[0], ctx->line);
+
+    return -ENOTSUP;
+}
+
+static int svf_play_svf(struct svf_tap *tap, const uint8_t *data, size_t len)
+{
+    struct svf ctx = {
+        .tap = *tap,
+        .endir = tap_idle,
+        .enddr = tap_idle,
+        .run_state = tap_idle,
+        .run_end = tap_idle,
+    };
+    struct progress progress;
+    unsigned long line = 1;
+    size_t pos = 0, last = 0;
+    int rc, i;
+
+    progress_init(&progress, "svf", len);
+    while ((rc = svf_next_stmt(&ctx, (const char *)data, len, &pos, &line)) > 0) {
+        if ((rc = svf_exec(&ctx)) < 0) {
+            if (rc == -EINVAL)
+                loge("Malformed SVF statement on line %lu\n", ctx.line);
+            break;
+        }
+
+        progress_update(&progress, pos - last);
+        last = pos;
+    }
+    progress_end(&progress);
+
+    *tap = ctx.tap;
+
+    for (i = 0; i < svf_nr_regs; i++) {
+        free(ctx.regs[i].tdi);
+        free(ctx.regs[i].tdo);
+        free(ctx.regs[i].mask);
+        free(ctx.regs[i].smask);
+    }
+    free(ctx.stmt);
+
+    return rc;
+}
+
+/* XSVF */
+
+enum xsvf_cmd {
+    xsvf_complete = 0x00,
+    xsvf_tdomask = 0x01,
+    xsvf_sir = 0x02,
+    xsvf_sdr = 0x03,
+    xsvf_runtest = 0x04,
+    xsvf_repeat = 0x07,
+    xsvf_sdrsize = 0x08,
+    xsvf_sdrtdo = 0x09,
+    xsvf_state = 0x12,
+    xsvf_endir = 0x13,
+    xsvf_enddr = 0x14,
+    xsvf_sir2 = 0x15,
+    xsvf_comment = 0x16,
+    xsvf_wait = 0x17,
+};
+
+struct xsvf {
+    struct svf_tap tap;
+    const uint8_t *data;
+    size_t len;
+    size_t pos;
+    uint32_t sdr_bits;
+    uint8_t *tdi;
+    uint8_t *tdo;
+    uint8_t *mask;
+    uint8_t *got;
+    uint32_t runtest_us;
+    unsigned int repeat;
+    enum tap_state endir;
+    enum tap_state enddr;
+};
+
+static int xsvf_take(struct xsvf *ctx, size_t len, const uint8_t **buf)
+{
+    if (ctx->len - ctx->pos < len) {
+        loge("XSVF file ends inside an instruction\n");
+        return -EINVAL;
+    }
+
+    *buf = &ctx->data[ctx->pos];
+    ctx->pos += len;
+
+    return 0;
+}
+
+static int xsvf_take_be(struct xsvf *ctx, size_t len, uint32_t *val)
+{
+    const uint8_t *buf;
+    size_t i;
+    int rc;
+
+    if ((rc = xsvf_take(ctx, len, &buf)) < 0)
+        return rc;
+
+    for (*val = 0, i = 0; i < len; i++)
+        *val = (*val << 8) | buf[i];
+
+    return 0;
+}
+
+/* Vectors are big-endian, so the last byte holds the first bits shifted */
+static int xsvf_take_vec(struct xsvf *ctx, uint8_t *vec, size_t bits)
+{
+    size_t bytes = (bits + 7) / 8, i;
+    const uint8_t *buf;
+    int rc;
+
+    if ((rc = xsvf_take(ctx, bytes, &buf)) < 0)
+        return rc;
+
+    for (i = 0; i < bytes; i++)
+        vec[i] = buf[bytes - 1 - i];
+
+    return 0;
+}
+
+static int xsvf_resize(struct xsvf *ctx, uint32_t bits)
+{
+    size_t bytes = bits ? (bits + 7) / 8 : 1;
+    uint8_t **vecs[] = { &ctx->tdi, &ctx->tdo, &ctx->mask, &ctx->got };
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(vecs); i++) {
+        uint8_t *vec;
+
+        if (!(vec = realloc(*vecs[i], bytes)))
+            return -ENOMEM;
+
+        memset(vec, 0, bytes);
+        *vecs[i] = vec;
+    }
+
+    ctx->sdr_bits = bits;
+
+    return 0;
+}
+
+/*
+ * With XRUNTEST set each scan ends in Run-Test/Idle, waiting there. A failed
+ * comparison is retried by scanning afresh from Run-Test/Idle with the wait
+ * stretched by a quarter, rather than by the reference player's detour through
+ * Pause-DR, as the engine can make that trip.
+ */
+static int xsvf_scan_dr(struct xsvf *ctx)
+{
+    uint64_t wait = ctx->runtest_us;
+    bool compare = false;
+    unsigned int attempt;
+    size_t i;
+    int rc;
+
+    if (!ctx->sdr_bits)
+        return -EINVAL;
+
+    for (i = 0; i < (ctx->sdr_bits + 7) / 8; i++)
+        compare |= !!ctx->mask[i];
+
+    for (attempt = 0; ; attempt++) {
+        rc = svf_tap_scan(&ctx->tap, false, ctx->tdi, ctx->got, compare,
+                          ctx->sdr_bits, wait ? tap_idle : ctx->enddr);
+        if (rc < 0)
+            return rc;
+
+        if (wait && (rc = svf_tap_run(&ctx->tap, tap_idle, wait, wait)) < 0)
+            return rc;
+
+        if (!compare || svf_matches(ctx->got, ctx->tdo, ctx->mask, ctx->sdr_bits))
+            return 0;
+
+        if (attempt == ctx->repeat) {
+            loge("TDO mismatch at offset %zu after %u retries\n", ctx->pos,
+                 ctx->repeat);
+            return -EIO;
+        }
+
+        wait += wait / 4;
+    }
+}
+
+static int xsvf_scan_ir(struct xsvf *ctx, size_t len_bytes)
+{
+    uint8_t *tdi, *tdo;
+    uint32_t bits;
+    int rc;
+
+    if ((rc = xsvf_take_be(ctx, len_bytes, &bits)) < 0)
+        return rc;
+
+    if (!bits)
+        return -EINVAL;
+
+    tdi = calloc(1, (bits + 7) / 8);
+    tdo = calloc(1, (bits + 7) / 8);
+    if (!tdi || !tdo) {
+        rc = -ENOMEM;
+        goto done;
+    }
+
+    if ((rc = xsvf_take_vec(ctx, tdi, bits)) < 0)
+        goto done;
+
+    rc = svf_tap_scan(&ctx->tap, true, tdi, tdo, false, bits,
+                      ctx->runtest_us ? tap_idle : ctx->endir);
+    if (!rc && ctx->runtest_us)
+        rc = svf_tap_run(&ctx->tap, tap_idle, ctx->runtest_us, ctx->runtest_us);
+
+done:
+    free(tdi);
+    free(tdo);
+
+    return rc;
+}
+
+static int xsvf_exec(struct xsvf *ctx, uint8_t cmd)
+{
+    uint32_t val, wait_state, end_state;
+    const uint8_t *buf;
+    int rc;
+
+    switch (cmd) {
+        case xsvf_tdomask:
+            return xsvf_take_vec(ctx, ctx->mask, ctx->sdr_bits);
+        case xsvf_sir:
+            return xsvf_scan_ir(ctx, 1);
+        case xsvf_sir2:
+            return xsvf_scan_ir(ctx, 2);
+        case xsvf_sdr:
+            if ((rc = xsvf_take_vec(ctx, ctx->tdi, ctx->sdr_bits)) < 0)
+                return rc;
+            return xsvf_scan_dr(ctx);
+        case xsvf_sdrtdo:
+            if ((rc = xsvf_take_vec(ctx, ctx->tdi, ctx->sdr_bits)) < 0 ||
+                    (rc = xsvf_take_vec(ctx, ctx->tdo, ctx->sdr_bits)) < 0)
+                return rc;
+            return xsvf_scan_dr(ctx);
+        case xsvf_runtest:
+            return xsvf_take_be(ctx, 4, &ctx->runtest_us);
+        case xsvf_repeat:
+            if ((rc = xsvf_take_be(ctx, 1, &val)) < 0)
+                return rc;
+            ctx->repeat = val;
+            return 0;
+        case xsvf_sdrsize:
+            if ((rc = xsvf_take_be(ctx, 4, &val)) < 0)
+                return rc;
+            if (val > (1u << 30))
+                return -EINVAL;
+            return xsvf_resize(ctx, val);
+        case xsvf_state:
+            if ((rc = xsvf_take_be(ctx, 1, &val)) < 0)
+                return rc;
+            if (val > tap_irupdate)
+                return -EINVAL;
+            return svf_tap_goto(&ctx->tap, val);
+        case xsvf_endir:
+        case xsvf_enddr:
+            if ((rc = xsvf_take_be(ctx, 1, &val)) < 0)
+                return rc;
+            if (val > 1)
+                return -EINVAL;
+            if (cmd == xsvf_endir)
+                ctx->endir = val ? tap_irpause : tap_idle;
+            else
+                ctx->enddr = val ? tap_drpause : tap_idle;
+            return 0;
+        case xsvf_comment:
+            do {
+                if ((rc = xsvf_take(ctx, 1, &buf)) < 0)
+                    return rc;
+            } while (*buf);
+            return 0;
+        case xsvf_wait:
+            if ((rc = xsvf_take_be(ctx, 1, &wait_state)) < 0 ||
+                    (rc = xsvf_take_be(ctx, 1, &end_state)) < 0 ||
+                    (rc = xsvf_take_be(ctx, 4, &val)) < 0)
+                return rc;
+            if (wait_state > tap_irupdate || end_state > tap_irupdate)
+                return -EINVAL;
+            if ((rc = svf_tap_run(&ctx->tap, wait_state, val, val)) < 0)
+                return rc;
+            return svf_tap_goto(&ctx->tap, end_state);
+        default:
+            loge("Unsupported XSVF instruction 0x%02x at offset %zu\n", cmd,
+                 ctx->pos - 1);
+            return -ENOTSUP;
+    }
+}
+
+static int svf_play_xsvf(struct svf_tap *tap, const uint8_t *data, size_t len)
+{
+    struct xsvf ctx = {
+        .tap = *tap,
+        .data = data,
+        .len = len,
+        .repeat = XSVF_REPEAT_DEFAULT,
+        .endir = tap_idle,
+        .enddr = tap_idle,
+    };
+    struct progress progress;
+    size_t last = 0;
+    int rc;
+
+    if ((rc = xsvf_resize(&ctx, 0)) < 0)
+        return rc;
+
+    progress_init(&progress, "xsvf", len);
+    while (ctx.pos < ctx.len) {
+        uint8_t cmd = ctx.data[ctx.pos++];
+
+        if (cmd == xsvf_complete)
+            break;
+
+        if ((rc = xsvf_exec(&ctx, cmd)) < 0) {
+            if (rc == -EINVAL)
+                loge("Malformed XSVF instruction 0x%02x before offset %zu\n",
+                     cmd, ctx.pos);
+            break;
+        }
+
+        progress_update(&progress, ctx.pos - last);
+        last = ctx.pos;
+    }
+    progress_end(&progress);
+
+    *tap = ctx.tap;
+
+    free(ctx.tdi);
+    free(ctx.tdo);
+    free(ctx.mask);
+    free(ctx.got);
+
+    return rc;
+}
+
+int svf_play(struct jtag *jtag, const char *path, bool bitbang)
+{
+    struct svf_tap tap = { .jtag = jtag, .state = tap_reset, .engine = !bitbang };
+    const char *ext = strrchr(path, '.');
+    uint8_t *data = NULL;
+    size_t len = 0;
+    int rc;
+
+    if ((rc = svf_load(path, &data, &len)) < 0)
+        return rc;
+
+    /* Nothing is known of where the TAP was left */
+    if ((rc = svf_tap_goto(&tap, tap_reset)) < 0)
+        goto cleanup_data;
+
+    if (ext && !strcasecmp(ext, ".xsvf"))
+        rc = svf_play_xsvf(&tap, data, len);
+    else
+        rc = svf_play_svf(&tap, data, len);
+
+    logi("Made %lu scans, %lu by the shift engine\n", tap.scans,
+         tap.engine_scans);
+
+cleanup_data:
+    free(data);
+
+    return rc;
+}
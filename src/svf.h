@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SVF_H
+#define _SVF_H
+
+#include "soc/jtag.h"
+
+#include <stdbool.h>
+
+/*
+ * Plays the SVF file at @path, or XSVF if it's named .xsvf, through @jtag.
+ * Scans between Run-Test/Idle states go through the controller's shift
+ * engine unless @bitbang is set. Everything else is bit-banged in batches.
+ * Returns -EIO if TDO doesn't match the file's expectations.
+ */
+int svf_play(struct jtag *jtag, const char *path, bool bitbang);
+
+#endif
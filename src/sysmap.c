@@ -0,0 +1,40 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "log.h"
+#include "sysmap.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+int sysmap_resolve(const char *path, struct sysmap_sym *syms, size_t nsyms)
+{
+    char line[256], name[128];
+    uint32_t addr;
+    char type;
+    FILE *map;
+    size_t i;
+
+    if (!(map = fopen(path, "r"))) {
+        loge("Failed to open %s: %s\n", path, strerror(errno));
+        return -errno;
+    }
+
+    for (i = 0; i < nsyms; i++)
+        syms[i].addr = 0;
+
+    while (fgets(line, sizeof(line), map)) {
+        if (sscanf(line, "%" SCNx32 " %c %127s", &addr, &type, name) != 3)
+            continue;
+
+        for (i = 0; i < nsyms; i++) {
+            if (!strcmp(name, syms[i].name))
+                syms[i].addr = addr;
+        }
+    }
+
+    fclose(map);
+
+    return 0;
+}
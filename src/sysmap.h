@@ -0,0 +1,18 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _SYSMAP_H
+#define _SYSMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct sysmap_sym {
+    const char *name;
+    /* Zero unless the symbol is in the map */
+    uint32_t addr;
+};
+
+/* Looks up each of @syms in the System.map at @path */
+int sysmap_resolve(const char *path, struct sysmap_sym *syms, size_t nsyms);
+
+#endif
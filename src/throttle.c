@@ -0,0 +1,238 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "log.h"
+#include "throttle.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define THROTTLE_MAX_SPECS      16
+
+/* How far ahead of its rate a bridge may run, and the slice bulk goes out in */
+#define THROTTLE_TOLERANCE_NS   (50 * 1000000ULL)
+#define THROTTLE_SLICE_HZ       100
+#define THROTTLE_QUANTUM_MIN    4096
+
+struct throttle_spec {
+    char bridge[THROTTLE_NAME_MAX];
+    uint64_t bytes;
+    uint64_t ops;
+};
+
+static struct throttle_spec throttle_specs[THROTTLE_MAX_SPECS];
+static size_t throttle_nr_specs;
+static bool throttle_adjust;
+
+static int throttle_parse_rate(const char **cursor, uint64_t *rate)
+{
+    char *end;
+
+    errno = 0;
+    *rate = strtoull(*cursor, &end, 0);
+    if (errno || end == *cursor)
+        return -EINVAL;
+
+    switch (*end) {
+        case 'g': case 'G':
+            *rate <<= 10;
+            /* fallthrough */
+        case 'm': case 'M':
+            *rate <<= 10;
+            /* fallthrough */
+        case 'k': case 'K':
+            *rate <<= 10;
+            end++;
+            break;
+    }
+
+    *cursor = end;
+
+    return 0;
+}
+
+int throttle_parse(const char *spec, char bridge[THROTTLE_NAME_MAX],
+                   uint64_t *bytes, uint64_t *ops)
+{
+    const char *cursor, *eq;
+    size_t len;
+    char *end;
+
+    memset(bridge, 0, THROTTLE_NAME_MAX);
+    *ops = 0;
+
+    cursor = spec;
+    if ((eq = strchr(spec, '='))) {
+        len = eq - spec;
+        if (!len || len >= THROTTLE_NAME_MAX)
+            return -EINVAL;
+
+        memcpy(bridge, spec, len);
+        cursor = eq + 1;
+    }
+
+    if (throttle_parse_rate(&cursor, bytes) < 0)
+        return -EINVAL;
+
+    if (*cursor == ',') {
+        cursor++;
+        errno = 0;
+        *ops = strtoull(cursor, &end, 0);
+        if (errno || end == cursor)
+            return -EINVAL;
+        cursor = end;
+    }
+
+    if (*cursor)
+        return -EINVAL;
+
+    return 0;
+}
+
+int throttle_add(const char *spec)
+{
+    struct throttle_spec *entry;
+    int rc;
+
+    if (throttle_nr_specs == THROTTLE_MAX_SPECS)
+        return -ENOSPC;
+
+    entry = &throttle_specs[throttle_nr_specs];
+
+    if ((rc = throttle_parse(spec, entry->bridge, &entry->bytes,
+                             &entry->ops)) < 0)
+        return rc;
+
+    throttle_nr_specs++;
+
+    return 0;
+}
+
+void throttle_enable_adjust(void)
+{
+    throttle_adjust = true;
+}
+
+static void throttle_bucket_init(struct throttle_bucket *bucket, uint64_t rate)
+{
+    bucket->cost_ps = rate ? 1000000000000ULL / rate : 0;
+    if (rate && !bucket->cost_ps)
+        bucket->cost_ps = 1;
+    bucket->tolerance_ns = THROTTLE_TOLERANCE_NS;
+    bucket->tat_ns = 0;
+}
+
+static void throttle_apply(struct throttle *ctx, uint64_t bytes, uint64_t ops)
+{
+    throttle_bucket_init(&ctx->bulk, bytes);
+    throttle_bucket_init(&ctx->reg, ops);
+    ctx->bytes = bytes;
+    ctx->ops = ops;
+
+    /* Unlimited bulk goes out whole */
+    if (!bytes) {
+        ctx->quantum = SIZE_MAX;
+        return;
+    }
+
+    ctx->quantum = bytes / THROTTLE_SLICE_HZ;
+    ctx->quantum &= ~(size_t)(THROTTLE_QUANTUM_MIN - 1);
+    if (ctx->quantum < THROTTLE_QUANTUM_MIN)
+        ctx->quantum = THROTTLE_QUANTUM_MIN;
+}
+
+struct throttle *throttle_get(const char *bridge)
+{
+    const struct throttle_spec *spec = NULL;
+    struct throttle *ctx;
+    size_t i;
+
+    /* The last spec naming the bridge wins, then the last without a name */
+    for (i = 0; i < throttle_nr_specs; i++) {
+        if (!strcmp(throttle_specs[i].bridge, bridge))
+            spec = &throttle_specs[i];
+    }
+
+    for (i = 0; !spec && i < throttle_nr_specs; i++) {
+        if (!throttle_specs[throttle_nr_specs - i - 1].bridge[0])
+            spec = &throttle_specs[throttle_nr_specs - i - 1];
+    }
+
+    if ((!spec || (!spec->bytes && !spec->ops)) && !throttle_adjust)
+        return NULL;
+
+    if (!(ctx = malloc(sizeof(*ctx))))
+        return NULL;
+
+    throttle_apply(ctx, spec ? spec->bytes : 0, spec ? spec->ops : 0);
+    ctx->waited_ns = 0;
+    ctx->pending = false;
+
+    if (ctx->bytes || ctx->ops)
+        logd("Throttling %s to %" PRIu64 " B/s and %" PRIu64 " register ops/s\n",
+             bridge, ctx->bytes, ctx->ops);
+
+    return ctx;
+}
+
+void throttle_put(struct throttle *ctx)
+{
+    free(ctx);
+}
+
+static uint64_t throttle_bucket_reserve(struct throttle_bucket *bucket,
+                                        uint64_t now, uint64_t units)
+{
+    uint64_t wait;
+
+    if (!bucket->cost_ps || !units)
+        return 0;
+
+    if (bucket->tat_ns < now)
+        bucket->tat_ns = now;
+
+    wait = bucket->tat_ns > now + bucket->tolerance_ns ?
+           bucket->tat_ns - now - bucket->tolerance_ns : 0;
+
+    bucket->tat_ns += units * bucket->cost_ps / 1000;
+
+    return wait;
+}
+
+uint64_t throttle_reserve(struct throttle *ctx, size_t bulk, unsigned int reg)
+{
+    uint64_t wait, reg_wait;
+    struct timespec ts;
+    uint64_t now;
+
+    if (__atomic_exchange_n(&ctx->pending, false, __ATOMIC_ACQUIRE)) {
+        throttle_apply(ctx, ctx->next_bytes, ctx->next_ops);
+        logi("Throttle changed to %" PRIu64 " B/s and %" PRIu64
+             " register ops/s\n", ctx->bytes, ctx->ops);
+    }
+
+    if (!ctx->bulk.cost_ps && !ctx->reg.cost_ps)
+        return 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+    wait = throttle_bucket_reserve(&ctx->bulk, now, bulk);
+    reg_wait = throttle_bucket_reserve(&ctx->reg, now, reg);
+    if (reg_wait > wait)
+        wait = reg_wait;
+
+    ctx->waited_ns += wait;
+
+    return wait;
+}
+
+void throttle_set(struct throttle *ctx, uint64_t bytes, uint64_t ops)
+{
+    ctx->next_bytes = bytes;
+    ctx->next_ops = ops;
+    __atomic_store_n(&ctx->pending, true, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,76 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _THROTTLE_H
+#define _THROTTLE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define THROTTLE_NAME_MAX       32
+
+/*
+ * A bucket in the style of GCRA: each unit pushes its theoretical arrival
+ * time out by @cost_ps, and a caller more than @tolerance_ns ahead of it
+ * waits. A zero @cost_ps doesn't limit at all.
+ */
+struct throttle_bucket {
+    uint64_t cost_ps;
+    uint64_t tolerance_ns;
+    uint64_t tat_ns;
+};
+
+/*
+ * Limits on what a bridge puts on its bus. Bulk transfers are counted in
+ * bytes and split into @quantum pieces so they don't go out as one burst,
+ * while register accesses are counted in operations against a bucket of their
+ * own, so a bulk transfer that's over its budget never holds them up.
+ *
+ * Callers serialise access, as the bridge's accessors already do.
+ */
+struct throttle {
+    struct throttle_bucket bulk;
+    struct throttle_bucket reg;
+    size_t quantum;
+    uint64_t waited_ns;
+    /* The limits in force, in bytes and ops a second */
+    uint64_t bytes;
+    uint64_t ops;
+    /* Limits posted by throttle_set() from another thread, see pending */
+    uint64_t next_bytes;
+    uint64_t next_ops;
+    bool pending;
+};
+
+/*
+ * @spec is [BRIDGE=]BYTES[,OPS] for BYTES of bulk transfers and OPS register
+ * accesses a second, BYTES taking a K, M or G suffix. Zero leaves either
+ * unlimited. Without BRIDGE the limits apply to any bridge not named in a
+ * spec of its own.
+ */
+int throttle_add(const char *spec);
+
+/* Splits @spec as for throttle_add(), @bridge is empty if it's not named */
+int throttle_parse(const char *spec, char bridge[THROTTLE_NAME_MAX],
+                   uint64_t *bytes, uint64_t *ops);
+
+/*
+ * Gives every bridge a throttle, unlimited unless a spec says otherwise, so
+ * throttle_set() can limit any of them later
+ */
+void throttle_enable_adjust(void);
+
+/* Returns the limits for @bridge, or NULL if it's not limited */
+struct throttle *throttle_get(const char *bridge);
+void throttle_put(struct throttle *ctx);
+
+/* Returns the nanoseconds to wait before passing @bulk bytes and @reg ops */
+uint64_t throttle_reserve(struct throttle *ctx, size_t bulk, unsigned int reg);
+
+/*
+ * Changes the limits from any thread. They take effect at the next reservation
+ * on the thread using the throttle, which is what serialises the buckets.
+ */
+void throttle_set(struct throttle *ctx, uint64_t bytes, uint64_t ops);
+
+#endif
@@ -0,0 +1,147 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "timing.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/* Far more than a command goes through, beyond that phases are dropped */
+#define TIMING_MAX_PHASES   256
+
+struct timing_phase {
+    const char *phase;
+    char detail[32];
+    uint64_t start;
+    uint64_t end;
+};
+
+static enum timing_mode timing_current_mode = timing_none;
+static pthread_mutex_t timing_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timing_phase timing_phases[TIMING_MAX_PHASES];
+static unsigned int timing_nr_phases;
+static unsigned int timing_nr_dropped;
+static uint64_t timing_epoch;
+
+static uint64_t timing_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void timing_set_mode(enum timing_mode mode)
+{
+    timing_current_mode = mode;
+    timing_epoch = timing_now();
+}
+
+int timing_parse_mode(const char *name, enum timing_mode *mode)
+{
+    if (!name || !strcmp("table", name))
+        *mode = timing_table;
+    else if (!strcmp("json", name))
+        *mode = timing_json;
+    else
+        return -1;
+
+    return 0;
+}
+
+int timing_begin(const char *phase, const char *detail)
+{
+    struct timing_phase *entry;
+    int id = -1;
+
+    if (timing_current_mode == timing_none)
+        return -1;
+
+    pthread_mutex_lock(&timing_lock);
+    if (timing_nr_phases < TIMING_MAX_PHASES) {
+        id = timing_nr_phases++;
+        entry = &timing_phases[id];
+        entry->phase = phase;
+        snprintf(entry->detail, sizeof(entry->detail), "%s", detail ?: "");
+        entry->start = timing_now();
+        entry->end = 0;
+    } else {
+        timing_nr_dropped++;
+    }
+    pthread_mutex_unlock(&timing_lock);
+
+    return id;
+}
+
+void timing_end(int id)
+{
+    uint64_t now;
+
+    if (id < 0)
+        return;
+
+    now = timing_now();
+
+    pthread_mutex_lock(&timing_lock);
+    timing_phases[id].end = now;
+    pthread_mutex_unlock(&timing_lock);
+}
+
+static void timing_report_table(void)
+{
+    const struct timing_phase *entry;
+    unsigned int i;
+
+    fprintf(stderr, "%-18s %-20s %12s %12s\n", "Phase", "Detail", "Start (ms)",
+            "Time (ms)");
+
+    for (i = 0; i < timing_nr_phases; i++) {
+        entry = &timing_phases[i];
+
+        fprintf(stderr, "%-18s %-20s %12.3f ", entry->phase, entry->detail,
+                (entry->start - timing_epoch) / 1e6);
+        if (entry->end)
+            fprintf(stderr, "%12.3f\n", (entry->end - entry->start) / 1e6);
+        else
+            fprintf(stderr, "%12s\n", "-");
+    }
+
+    if (timing_nr_dropped)
+        fprintf(stderr, "(%u more phases not recorded)\n", timing_nr_dropped);
+}
+
+static void timing_report_json(void)
+{
+    const struct timing_phase *entry;
+    unsigned int i;
+
+    fprintf(stderr, "{\"timings\":[");
+
+    for (i = 0; i < timing_nr_phases; i++) {
+        entry = &timing_phases[i];
+
+        fprintf(stderr, "%s{\"phase\":\"%s\",\"detail\":\"%s\",\"start\":%.6f,"
+                "\"elapsed\":", i ? "," : "", entry->phase, entry->detail,
+                (entry->start - timing_epoch) / 1e9);
+        if (entry->end)
+            fprintf(stderr, "%.6f}", (entry->end - entry->start) / 1e9);
+        else
+            fprintf(stderr, "null}");
+    }
+
+    fprintf(stderr, "],\"dropped\":%u}\n", timing_nr_dropped);
+}
+
+void timing_report(void)
+{
+    pthread_mutex_lock(&timing_lock);
+    if (timing_current_mode == timing_table)
+        timing_report_table();
+    else if (timing_current_mode == timing_json)
+        timing_report_json();
+    pthread_mutex_unlock(&timing_lock);
+}
@@ -0,0 +1,22 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _TIMING_H
+#define _TIMING_H
+
+enum timing_mode { timing_none, timing_table, timing_json };
+
+void timing_set_mode(enum timing_mode mode);
+int timing_parse_mode(const char *name, enum timing_mode *mode);
+
+/*
+ * Phases may nest and may run concurrently on other threads. Returns a handle
+ * for timing_end(), which ignores the negative handles given out while timing
+ * is disabled. @detail may be NULL.
+ */
+int timing_begin(const char *phase, const char *detail);
+void timing_end(int id);
+
+/* Writes the phases to stderr in the order they began */
+void timing_report(void);
+
+#endif
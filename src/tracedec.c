@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "array.h"
+#include "log.h"
+#include "tracedec.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Twice the distinct values kept, so probe sequences stay short */
+#define TRACEDEC_HIST_SLOTS     (2 * TRACEDEC_HIST_MAX)
+
+static const struct {
+    const char *name;
+    enum tracedec_format format;
+} tracedec_formats[] = {
+    { "none", tracedec_none },
+    { "csv", tracedec_csv },
+    { "binary", tracedec_binary },
+};
+
+int tracedec_parse_format(const char *name, enum tracedec_format *format)
+{
+    unsigned int i;
+
+    for (i = 0; i < ARRAY_SIZE(tracedec_formats); i++) {
+        if (!strcmp(tracedec_formats[i].name, name)) {
+            *format = tracedec_formats[i].format;
+            return 0;
+        }
+    }
+
+    return -EINVAL;
+}
+
+int tracedec_init(struct tracedec *ctx, unsigned int width,
+                  enum tracedec_format format, unsigned int flags, FILE *out)
+{
+    if (width != 1 && width != 2 && width != 4)
+        return -EINVAL;
+
+    memset(ctx, 0, sizeof(*ctx));
+    ctx->width = width;
+    ctx->format = format;
+    ctx->flags = flags;
+    ctx->out = out;
+
+    if (flags & TRACEDEC_HISTOGRAM) {
+        ctx->hist.slots = calloc(TRACEDEC_HIST_SLOTS, sizeof(*ctx->hist.slots));
+        if (!ctx->hist.slots)
+            return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void tracedec_destroy(struct tracedec *ctx)
+{
+    free(ctx->hist.slots);
+    ctx->hist.slots = NULL;
+}
+
+static void tracedec_hist_add(struct tracedec_hist *hist, uint32_t value)
+{
+    uint32_t slot = (value * 2654435761U) & (TRACEDEC_HIST_SLOTS - 1);
+
+    while (hist->slots[slot].count) {
+        if (hist->slots[slot].value == value) {
+            hist->slots[slot].count++;
+            return;
+        }
+        slot = (slot + 1) & (TRACEDEC_HIST_SLOTS - 1);
+    }
+
+    if (hist->used == TRACEDEC_HIST_MAX) {
+        hist->other++;
+        return;
+    }
+
+    hist->slots[slot].value = value;
+    hist->slots[slot].count = 1;
+    hist->used++;
+}
+
+static void tracedec_runs_end(struct tracedec_runs *runs)
+{
+    if (runs->len > runs->longest_len) {
+        runs->longest_value = runs->value;
+        runs->longest_start = runs->start;
+        runs->longest_len = runs->len;
+    }
+}
+
+static void tracedec_runs_add(struct tracedec_runs *runs, uint64_t index,
+                              uint32_t value)
+{
+    if (runs->len && runs->value == value) {
+        runs->len++;
+        return;
+    }
+
+    if (runs->len)
+        tracedec_runs_end(runs);
+
+    runs->value = value;
+    runs->start = index;
+    runs->len = 1;
+    runs->count++;
+}
+
+static void tracedec_put_le32(uint8_t *p, uint32_t val)
+{
+    p[0] = val;
+    p[1] = val >> 8;
+    p[2] = val >> 16;
+    p[3] = val >> 24;
+}
+
+static int tracedec_emit(struct tracedec *ctx, uint32_t value, bool merge)
+{
+    uint8_t rec[8];
+    int rc = 0;
+
+    if (ctx->flags & TRACEDEC_HISTOGRAM)
+        tracedec_hist_add(&ctx->hist, value);
+
+    if (ctx->flags & TRACEDEC_RUNS)
+        tracedec_runs_add(&ctx->runs, ctx->index, value);
+
+    switch (ctx->format) {
+        case tracedec_none:
+            break;
+        case tracedec_csv:
+            if (fprintf(ctx->out, "%" PRIu64 ",0x%0*" PRIx32 ",%s\n",
+                        ctx->index, ctx->width * 2, value,
+                        merge ? "merge" : "buffer") < 0)
+                rc = -EIO;
+            break;
+        case tracedec_binary:
+            tracedec_put_le32(&rec[0], ctx->index | (merge ? TRACEDEC_MERGE : 0));
+            tracedec_put_le32(&rec[4], value);
+            if (fwrite(rec, sizeof(rec), 1, ctx->out) != 1)
+                rc = -EIO;
+            break;
+    }
+
+    ctx->index++;
+
+    return rc;
+}
+
+static uint32_t tracedec_get_le(const uint8_t *p, unsigned int width)
+{
+    uint32_t val = 0;
+
+    while (width--)
+        val = (val << 8) | p[width];
+
+    return val;
+}
+
+int tracedec_feed(struct tracedec *ctx, const void *buf, size_t len)
+{
+    const uint8_t *cursor = buf;
+    int rc;
+
+    /* Complete the sample split across the previous call */
+    while (ctx->npartial && len) {
+        ctx->partial[ctx->npartial++] = *cursor++;
+        len--;
+
+        if (ctx->npartial == ctx->width) {
+            ctx->npartial = 0;
+            rc = tracedec_emit(ctx, tracedec_get_le(ctx->partial, ctx->width),
+                               false);
+            if (rc < 0)
+                return rc;
+        }
+    }
+
+    while (len >= ctx->width) {
+        rc = tracedec_emit(ctx, tracedec_get_le(cursor, ctx->width), false);
+        if (rc < 0)
+            return rc;
+
+        cursor += ctx->width;
+        len -= ctx->width;
+    }
+
+    memcpy(&ctx->partial[ctx->npartial], cursor, len);
+    ctx->npartial += len;
+
+    return 0;
+}
+
+int tracedec_merge(struct tracedec *ctx, uint32_t merge)
+{
+    uint32_t mask = 0xffffffffU >> (32 - 8 * ctx->width);
+    unsigned int i;
+    int rc;
+
+    for (i = 0; i < 4; i += ctx->width) {
+        rc = tracedec_emit(ctx, (merge >> (8 * i)) & mask, true);
+        if (rc < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int tracedec_bucket_cmp(const void *a, const void *b)
+{
+    const struct tracedec_bucket *l = a, *r = b;
+
+    return (l->value > r->value) - (l->value < r->value);
+}
+
+static int tracedec_report_hist(struct tracedec *ctx, FILE *report)
+{
+    struct tracedec_hist *hist = &ctx->hist;
+    unsigned int i, n = 0;
+
+    /* Pack the occupied slots to the front, the table isn't needed after */
+    for (i = 0; i < TRACEDEC_HIST_SLOTS; i++) {
+        if (hist->slots[i].count)
+            hist->slots[n++] = hist->slots[i];
+    }
+
+    qsort(hist->slots, n, sizeof(*hist->slots), tracedec_bucket_cmp);
+
+    fprintf(report, "histogram: %u distinct values\n", n);
+    for (i = 0; i < n; i++)
+        fprintf(report, "  0x%0*" PRIx32 " %" PRIu64 "\n", ctx->width * 2,
+                hist->slots[i].value, hist->slots[i].count);
+
+    if (hist->other)
+        fprintf(report, "  other %" PRIu64 "\n", hist->other);
+
+    return ferror(report) ? -EIO : 0;
+}
+
+static int tracedec_report_runs(struct tracedec *ctx, FILE *report)
+{
+    struct tracedec_runs *runs = &ctx->runs;
+
+    if (runs->len)
+        tracedec_runs_end(runs);
+
+    fprintf(report, "runs: %" PRIu64 " over %" PRIu64 " samples", runs->count,
+            ctx->index);
+    if (runs->count)
+        fprintf(report, ", mean length %.2f, longest %" PRIu64
+                " of 0x%0*" PRIx32 " from sample %" PRIu64,
+                (double)ctx->index / runs->count, runs->longest_len,
+                ctx->width * 2, runs->longest_value, runs->longest_start);
+    fprintf(report, "\n");
+
+    return ferror(report) ? -EIO : 0;
+}
+
+int tracedec_finish(struct tracedec *ctx, FILE *report)
+{
+    int rc;
+
+    if (ctx->npartial)
+        logi("Ignoring %u trailing bytes, short of a %u byte sample\n",
+             ctx->npartial, ctx->width);
+
+    if (ctx->out && fflush(ctx->out))
+        return -EIO;
+
+    if ((ctx->flags & TRACEDEC_HISTOGRAM) &&
+            (rc = tracedec_report_hist(ctx, report)) < 0)
+        return rc;
+
+    if ((ctx->flags & TRACEDEC_RUNS) &&
+            (rc = tracedec_report_runs(ctx, report)) < 0)
+        return rc;
+
+    return 0;
+}
@@ -0,0 +1,83 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _TRACEDEC_H
+#define _TRACEDEC_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/*
+ * Decodes the AHB controller's poll data captures, as written by trace_dump()
+ * or trace_drain(): back-to-back little-endian samples of the traced width,
+ * without timestamps. Records are numbered by their position in the capture.
+ *
+ *   csv:     "INDEX,VALUE,SOURCE" lines, SOURCE being "buffer" or "merge"
+ *   binary:  le32 INDEX then le32 VALUE per sample, with TRACEDEC_MERGE set
+ *            in INDEX for samples taken from the merge FIFO
+ */
+enum tracedec_format { tracedec_none, tracedec_csv, tracedec_binary };
+
+#define TRACEDEC_MERGE          (1U << 31)
+
+#define TRACEDEC_HISTOGRAM      (1 << 0)
+#define TRACEDEC_RUNS           (1 << 1)
+
+/* Distinct values counted before the rest are lumped together */
+#define TRACEDEC_HIST_MAX       65536
+
+struct tracedec_bucket {
+    uint32_t value;
+    uint64_t count;
+};
+
+struct tracedec_hist {
+    struct tracedec_bucket *slots;
+    unsigned int used;
+    uint64_t other;
+};
+
+/* A run is a sequence of identical consecutive samples */
+struct tracedec_runs {
+    uint32_t value;
+    uint64_t start;
+    uint64_t len;
+    uint64_t count;
+    uint32_t longest_value;
+    uint64_t longest_start;
+    uint64_t longest_len;
+};
+
+struct tracedec {
+    unsigned int width;
+    enum tracedec_format format;
+    unsigned int flags;
+    FILE *out;
+    uint8_t partial[4];
+    unsigned int npartial;
+    uint64_t index;
+    struct tracedec_hist hist;
+    struct tracedec_runs runs;
+};
+
+int tracedec_parse_format(const char *name, enum tracedec_format *format);
+
+/* @width is the traced access size, 1, 2 or 4 bytes */
+int tracedec_init(struct tracedec *ctx, unsigned int width,
+                  enum tracedec_format format, unsigned int flags, FILE *out);
+void tracedec_destroy(struct tracedec *ctx);
+
+/* @buf may end part way through a sample, the rest is taken from the next */
+int tracedec_feed(struct tracedec *ctx, const void *buf, size_t len);
+
+/*
+ * Decode the merge FIFO word that trace_dump() logs. The FIFO doesn't say how
+ * much of it is valid, so every sample it holds is emitted, marked as such.
+ */
+int tracedec_merge(struct tracedec *ctx, uint32_t merge);
+
+/* Report the histogram and run statistics requested at init to @report */
+int tracedec_finish(struct tracedec *ctx, FILE *report);
+
+#endif
@@ -0,0 +1,184 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "array.h"
+#include "log.h"
+#include "soc/sdmc.h"
+#include "sysmap.h"
+#include "triage.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TRIAGE_PAGE             4096
+
+/* Comfortably more than a BMC kernel's text, data and bss */
+#define TRIAGE_KERNEL_DEFAULT   (16 << 20)
+
+struct triage_bounds {
+    uint64_t start;
+    uint64_t end;
+};
+
+/* Appends the parts of @start to @end not yet planned, in address order */
+static int triage_claim(struct triage *ctx, const struct triage_bounds *b,
+                        uint64_t start, uint64_t end)
+{
+    struct elfcore_segment *last;
+    size_t i;
+    int rc;
+
+    start = start & ~(uint64_t)(TRIAGE_PAGE - 1);
+    end = (end + TRIAGE_PAGE - 1) & ~(uint64_t)(TRIAGE_PAGE - 1);
+
+    if (start < b->start)
+        start = b->start;
+    if (end > b->end)
+        end = b->end;
+    if (start >= end)
+        return 0;
+
+    for (i = 0; i < ctx->nsegs; i++) {
+        uint64_t seg_start = ctx->segs[i].phys;
+        uint64_t seg_end = seg_start + ctx->segs[i].len;
+
+        if (seg_start >= end || seg_end <= start)
+            continue;
+
+        if ((rc = triage_claim(ctx, b, start, seg_start)) < 0)
+            return rc;
+
+        return triage_claim(ctx, b, seg_end, end);
+    }
+
+    last = ctx->nsegs ? &ctx->segs[ctx->nsegs - 1] : NULL;
+    if (last && (uint64_t)last->phys + last->len == start &&
+            (uint64_t)last->len + (end - start) <= UINT32_MAX) {
+        last->len += end - start;
+        return 0;
+    }
+
+    if (ctx->nsegs == ARRAY_SIZE(ctx->segs)) {
+        loge("The dump priorities fragment memory into too many segments\n");
+        return -E2BIG;
+    }
+
+    ctx->segs[ctx->nsegs].phys = start;
+    ctx->segs[ctx->nsegs].len = end - start;
+    ctx->nsegs++;
+
+    return 0;
+}
+
+/* swapper_pg_dir sits just below the image, so one range covers both */
+static int triage_kernel(struct triage *ctx, const struct triage_bounds *b,
+                         const struct klog_opts *klog, uint32_t ram_start)
+{
+    struct sysmap_sym end = { .name = "_end" };
+    uint64_t len = TRIAGE_KERNEL_DEFAULT;
+    int rc;
+
+    if (klog->system_map) {
+        if ((rc = sysmap_resolve(klog->system_map, &end, 1)) < 0)
+            return rc;
+
+        if (end.addr > klog->page_offset)
+            len = end.addr - klog->page_offset;
+        else
+            logi("No _end in %s, taking %dMiB for the kernel\n",
+                 klog->system_map, TRIAGE_KERNEL_DEFAULT >> 20);
+    }
+
+    return triage_claim(ctx, b, ram_start, (uint64_t)ram_start + len);
+}
+
+static int triage_klog(struct triage *ctx, const struct triage_bounds *b,
+                       struct soc *soc, const struct klog_opts *klog)
+{
+    struct soc_region regions[KLOG_REGIONS_MAX];
+    size_t nregions, i;
+    int rc;
+
+    if ((rc = klog_locate(soc, klog, regions, &nregions)) < 0) {
+        /* A static ring is in the kernel's bss in any case */
+        if (rc == -ENOENT && !klog->system_map) {
+            logi("Locating the printk ring needs --system-map, leaving it to the kernel image\n");
+            return 0;
+        }
+
+        loge("Failed to locate the printk ring: %d\n", rc);
+        return rc;
+    }
+
+    for (i = 0; i < nregions; i++) {
+        if ((rc = triage_claim(ctx, b, regions[i].start,
+                               (uint64_t)regions[i].start + regions[i].length)) < 0)
+            return rc;
+    }
+
+    return 0;
+}
+
+static int triage_range(struct triage *ctx, const struct triage_bounds *b,
+                        const char *entry)
+{
+    unsigned long start, len;
+    char *endp;
+
+    errno = 0;
+    start = strtoul(entry, &endp, 0);
+    if (errno || *endp != ':' || start > UINT32_MAX)
+        return -EINVAL;
+
+    entry = endp + 1;
+    errno = 0;
+    len = strtoul(entry, &endp, 0);
+    if (errno || *endp || endp == entry || len > UINT32_MAX)
+        return -EINVAL;
+
+    return triage_claim(ctx, b, start, (uint64_t)start + len);
+}
+
+int triage_plan(struct triage *ctx, struct soc *soc, const char *spec,
+                const struct klog_opts *klog, uint32_t start, uint32_t len)
+{
+    const struct triage_bounds b = { start, (uint64_t)start + len };
+    struct soc_region dram;
+    struct sdmc *sdmc;
+    char *entries, *entry, *save;
+    int rc = 0;
+
+    if (!(sdmc = sdmc_get(soc)))
+        return -ENODEV;
+
+    if ((rc = sdmc_get_dram(sdmc, &dram)) < 0)
+        return rc;
+
+    if (!(entries = strdup(spec)))
+        return -ENOMEM;
+
+    ctx->nsegs = 0;
+
+    for (entry = strtok_r(entries, ",", &save); entry;
+            entry = strtok_r(NULL, ",", &save)) {
+        if (!strcmp(entry, "kernel"))
+            rc = triage_kernel(ctx, &b, klog, dram.start);
+        else if (!strcmp(entry, "klog"))
+            rc = triage_klog(ctx, &b, soc, klog);
+        else if ((rc = triage_range(ctx, &b, entry)) == -EINVAL)
+            loge("Invalid dump priority '%s', expected kernel, klog or ADDRESS:LENGTH\n",
+                 entry);
+
+        if (rc < 0)
+            goto done;
+    }
+
+    rc = triage_claim(ctx, &b, b.start, b.end);
+
+done:
+    free(entries);
+
+    return rc;
+}
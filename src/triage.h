@@ -0,0 +1,32 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _TRIAGE_H
+#define _TRIAGE_H
+
+#include "elfcore.h"
+#include "klog.h"
+#include "soc.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* What's dumped first unless told otherwise */
+#define TRIAGE_DEFAULT_SPEC "kernel,klog"
+
+/* The order in which to dump a region of DRAM, most useful first */
+struct triage {
+    struct elfcore_segment segs[ELFCORE_MAX_SEGMENTS];
+    size_t nsegs;
+};
+
+/*
+ * Orders the pages of @start to @start + @len by the comma-separated @spec,
+ * whose entries are "kernel" for the kernel image with its page tables from
+ * the base of DRAM, "klog" for the printk ring, or ADDRESS:LENGTH. Whatever
+ * the entries don't cover follows in address order. @klog gives the System.map
+ * and page offset for locating the kernel's parts.
+ */
+int triage_plan(struct triage *ctx, struct soc *soc, const char *spec,
+                const struct klog_opts *klog, uint32_t start, uint32_t len);
+
+#endif
@@ -8,11 +8,15 @@
 #include "ts16.h"
 
 #include "ccan/container_of/container_of.h"
+#include "ccan/list/list.h"
 
 #include <arpa/inet.h>
 #include <errno.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,14 +25,69 @@
 
 #define to_ts16(console) container_of(console, struct ts16, console)
 
-static int ts16_control_init(struct ts16 *ctx, const char *ip,
-                             int port __unused, const char *username,
-                             const char *password)
+/* Bounds on waiting for a port to come back from a reset */
+#define TS16_CONNECT_DELAY_US 10000
+#define TS16_CONNECT_MAX_US 2000000
+
+/* Zero leaves the kernel's socket buffer sizing alone */
+static int ts16_sockbuf;
+
+void ts16_set_sockbuf(int bytes)
+{
+    ts16_sockbuf = bytes;
+}
+
+/*
+ * Every command is a handful of bytes followed by a wait for the reply, which is
+ * the worst case for Nagle and delayed ACKs. Failing to tune isn't fatal.
+ */
+static void ts16_tune_socket(int fd)
+{
+    int one = 1;
+
+    if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0)
+        logd("Failed to set TCP_NODELAY: %d\n", -errno);
+
+#ifdef TCP_QUICKACK
+    /* Not sticky on Linux, but covers the exchanges made while connecting */
+    if (setsockopt(fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one)) < 0)
+        logd("Failed to set TCP_QUICKACK: %d\n", -errno);
+#endif
+
+    if (!ts16_sockbuf)
+        return;
+
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &ts16_sockbuf,
+                   sizeof(ts16_sockbuf)) < 0 ||
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &ts16_sockbuf,
+                   sizeof(ts16_sockbuf)) < 0)
+        logd("Failed to size socket buffers to %d: %d\n", ts16_sockbuf,
+             -errno);
+}
+
+/*
+ * One logged-in control session per concentrator and user, shared by every
+ * console in the process that goes through it. Commands on the session are
+ * serialised by @lock so consoles may be driven from separate threads.
+ */
+struct ts16_control {
+    struct list_node entry;
+    char *ip;
+    char *username;
+    struct prompt prompt;
+    pthread_mutex_t lock;
+    unsigned int refs;
+};
+
+static LIST_HEAD(ts16_controls);
+static pthread_mutex_t ts16_controls_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int ts16_control_connect(struct ts16_control *ctl, const char *ip,
+                                const char *username, const char *password)
 {
     struct sockaddr_in concentrator_addr;
     int concentrator;
     int rc, cleanup;
-    char *cmd;
 
     logi("Connecting to Digi Portserver TS 16 at %s:%d\n", ip, 23);
     concentrator_addr.sin_family = AF_INET;
@@ -39,103 +98,185 @@ static int ts16_control_init(struct ts16 *ctx, const char *ip,
     concentrator = socket(AF_INET, SOCK_STREAM, 0);
     if (concentrator < 0) { return -errno; }
 
+    ts16_tune_socket(concentrator);
+
     rc = connect(concentrator, (struct sockaddr *)&concentrator_addr,
                  sizeof(concentrator_addr));
     if (rc < 0) { rc = -errno; goto cleanup_concentrator; }
 
-    rc = prompt_init(&ctx->concentrator, concentrator, "\r\n", false);
+    rc = prompt_init(&ctl->prompt, concentrator, "\r\n", false);
     if (rc < 0) { goto cleanup_concentrator; };
 
     logi("Logging into Digi Portserver TS\n");
-    rc = prompt_expect_run(&ctx->concentrator, "login: ", username);
+    rc = prompt_expect_run(&ctl->prompt, "login: ", username);
     if (rc < 0) { rc = -errno; goto cleanup_concentrator_prompt; }
 
-    rc = prompt_expect_run(&ctx->concentrator, "password: ", password);
+    rc = prompt_expect_run(&ctl->prompt, "password: ", password);
     if (rc < 0) { rc = -errno; goto cleanup_concentrator_prompt; }
 
-    logi("Configuring binary mode on port %d\n", ctx->port);
-    rc = asprintf(&cmd, "set port range=%d bin=on", ctx->port);
-    if (rc < 0) { goto cleanup_concentrator_prompt; }
+    return 0;
 
-    rc = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
-    free(cmd);
-    if (rc < 0) { goto cleanup_concentrator_prompt; }
+cleanup_concentrator_prompt:
+    /* Closes the socket */
+    cleanup = prompt_destroy(&ctl->prompt);
+    if (cleanup < 0 && !rc) { rc = cleanup; }
 
-    logi("Resetting port %d\n", ctx->port);
-    rc = asprintf(&cmd, "kill tty=%d", ctx->port);
-    if (rc < 0) { goto cleanup_port; }
+    return rc;
 
-    rc = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
-    free(cmd);
-    if (rc < 0) { goto cleanup_port; }
+cleanup_concentrator:
+    close(concentrator);
+
+    return rc;
+}
 
-    sleep(1);
+static struct ts16_control *ts16_control_get(const char *ip,
+                                             const char *username,
+                                             const char *password)
+{
+    struct ts16_control *ctl;
+    int rc;
 
-    return 0;
+    pthread_mutex_lock(&ts16_controls_lock);
 
-cleanup_port:
-    logi("Disabling binary mode on port %d\n", ctx->port);
-    cleanup = asprintf(&cmd, "set port range=%d bin=off", ctx->port);
-    if (cleanup < 0 && !rc) { rc = cleanup; };
+    list_for_each(&ts16_controls, ctl, entry) {
+        if (!strcmp(ctl->ip, ip) && !strcmp(ctl->username, username)) {
+            logd("Reusing control session to %s\n", ip);
+            ctl->refs++;
+            goto done;
+        }
+    }
 
-    cleanup = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
-    free(cmd);
-    if (cleanup < 0 && !rc) { rc = cleanup; };
+    if (!(ctl = malloc(sizeof(*ctl))))
+        goto done;
 
-    logi("Resetting port %d\n", ctx->port);
-    cleanup = asprintf(&cmd, "kill tty=%d", ctx->port);
-    if (cleanup < 0 && !rc) { rc = cleanup; };
+    ctl->ip = strdup(ip);
+    ctl->username = strdup(username);
+    if (!ctl->ip || !ctl->username)
+        goto cleanup_ctl;
 
-    cleanup = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
-    free(cmd);
-    if (cleanup < 0 && !rc) { rc = cleanup; };
+    if ((rc = ts16_control_connect(ctl, ip, username, password)) < 0) {
+        loge("Failed to log into Digi Portserver TS at %s: %d\n", ip, rc);
+        goto cleanup_ctl;
+    }
 
-    sleep(1);
+    pthread_mutex_init(&ctl->lock, NULL);
+    ctl->refs = 1;
+    list_add(&ts16_controls, &ctl->entry);
 
-cleanup_concentrator_prompt:
-    cleanup = prompt_destroy(&ctx->concentrator);
-    if (cleanup < 0 && !rc) { rc = cleanup; }
+done:
+    pthread_mutex_unlock(&ts16_controls_lock);
 
-cleanup_concentrator:
-    close(concentrator);
+    return ctl;
+
+cleanup_ctl:
+    free(ctl->username);
+    free(ctl->ip);
+    free(ctl);
+    ctl = NULL;
+
+    goto done;
+}
+
+static int ts16_control_put(struct ts16_control *ctl)
+{
+    int rc = 0;
+
+    pthread_mutex_lock(&ts16_controls_lock);
+
+    if (!--ctl->refs) {
+        list_del(&ctl->entry);
+        rc = prompt_destroy(&ctl->prompt);
+        pthread_mutex_destroy(&ctl->lock);
+        free(ctl->username);
+        free(ctl->ip);
+        free(ctl);
+    }
+
+    pthread_mutex_unlock(&ts16_controls_lock);
 
     return rc;
 }
 
-static int ts16_control_destroy(struct ts16 *ctx)
+static int ts16_control_run(struct ts16 *ctx, const char *fmt, ...)
 {
+    va_list args;
     char *cmd;
     int rc;
 
-    logi("Disabling binary mode on port %d\n", ctx->port);
-    rc = asprintf(&cmd, "set port range=%d bin=off", ctx->port);
+    va_start(args, fmt);
+    rc = vasprintf(&cmd, fmt, args);
+    va_end(args);
     if (rc < 0)
         return -errno;
 
-    rc = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
+    pthread_mutex_lock(&ctx->control->lock);
+    rc = prompt_expect_run(&ctx->control->prompt, "#> ", cmd);
+    pthread_mutex_unlock(&ctx->control->lock);
+
     free(cmd);
-    if (rc < 0)
-        return rc;
+
+    return rc < 0 ? rc : 0;
+}
+
+static int ts16_port_release(struct ts16 *ctx)
+{
+    int rc, cleanup;
+
+    logi("Disabling binary mode on port %d\n", ctx->port);
+    rc = ts16_control_run(ctx, "set port range=%d bin=off", ctx->port);
 
     logi("Resetting port %d\n", ctx->port);
-    rc = asprintf(&cmd, "kill tty=%d", ctx->port);
-    if (rc < 0)
-        return rc;
+    cleanup = ts16_control_run(ctx, "kill tty=%d", ctx->port);
+    if (cleanup < 0 && !rc) { rc = cleanup; }
 
-    rc = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
-    free(cmd);
-    if (rc < 0)
-        return rc;
+    return rc;
+}
+
+static int ts16_control_init(struct ts16 *ctx, const char *ip,
+                             const char *username, const char *password)
+{
+    int rc, cleanup;
+
+    if (!(ctx->control = ts16_control_get(ip, username, password)))
+        return -ECONNREFUSED;
+
+    logi("Configuring binary mode on port %d\n", ctx->port);
+    rc = ts16_control_run(ctx, "set port range=%d bin=on", ctx->port);
+    if (rc < 0) { goto cleanup_control; }
+
+    logi("Resetting port %d\n", ctx->port);
+    rc = ts16_control_run(ctx, "kill tty=%d", ctx->port);
+    if (rc < 0) { goto cleanup_port; }
+
+    return 0;
 
-    sleep(1);
+cleanup_port:
+    ts16_port_release(ctx);
+
+cleanup_control:
+    cleanup = ts16_control_put(ctx->control);
+    if (cleanup < 0 && !rc) { rc = cleanup; }
+
+    return rc;
+}
+
+static int ts16_control_destroy(struct ts16 *ctx)
+{
+    int rc, cleanup;
+
+    rc = ts16_port_release(ctx);
 
-    return prompt_destroy(&ctx->concentrator);
+    cleanup = ts16_control_put(ctx->control);
+    if (cleanup < 0 && !rc) { rc = cleanup; }
+
+    return rc;
 }
 
 static int ts16_console_init(struct ts16 *ctx __unused, const char *ip,
                              int port)
 {
     struct sockaddr_in console_addr;
+    long delay, waited = 0;
     int console;
     int rc;
 
@@ -146,39 +287,39 @@ static int ts16_console_init(struct ts16 *ctx __unused, const char *ip,
     if (inet_aton(ip, &console_addr.sin_addr) == 0)
         return -errno;
 
-    console = socket(AF_INET, SOCK_STREAM, 0);
-    if (console < 0) { return console; }
+    /*
+     * The raw port refuses connections until the reset from kill has
+     * completed, so rather than wait out the worst case keep trying
+     */
+    for (delay = TS16_CONNECT_DELAY_US; ; delay *= 2) {
+        console = socket(AF_INET, SOCK_STREAM, 0);
+        if (console < 0) { return -errno; }
 
-    rc = connect(console, (struct sockaddr *)&console_addr,
-                 sizeof(console_addr));
-    if (rc < 0) { rc = -errno; goto cleanup_console; }
+        ts16_tune_socket(console);
 
-    return console;
+        rc = connect(console, (struct sockaddr *)&console_addr,
+                     sizeof(console_addr));
+        if (!rc)
+            return console;
 
-cleanup_console:
-    close(console);
+        rc = -errno;
+        close(console);
 
-    return rc;
+        if (rc != -ECONNREFUSED || waited >= TS16_CONNECT_MAX_US)
+            return rc;
+
+        logd("Port %d isn't ready, retrying in %ldus\n", port, delay);
+        usleep(delay);
+        waited += delay;
+    }
 }
 
 static int ts16_set_baud(struct console *console, int baud)
 {
     struct ts16 *ctx = to_ts16(console);
-    char *cmd;
-    int rc;
-
-    rc = asprintf(&cmd, "set line range=%d baud=%d", ctx->port, baud);
-    if (rc < 0)
-        return -errno;
 
-    rc = prompt_expect_run(&ctx->concentrator, "#> ", cmd);
-    free(cmd);
-    if (rc < 0)
-        return rc;
-
-    sleep(1);
-
-    return 0;
+    /* The line is reconfigured by the time the prompt is back */
+    return ts16_control_run(ctx, "set line range=%d baud=%d", ctx->port, baud);
 }
 
 static int ts16_destroy(struct console *console)
@@ -205,7 +346,7 @@ int ts16_init(struct ts16 *ctx, const char *ip, int port, const char *username,
     ctx->port = port;
     ctx->console.ops = &ts16_ops;
 
-    rc = ts16_control_init(ctx, ip, port, username, password);
+    rc = ts16_control_init(ctx, ip, username, password);
     if (rc < 0)
         return rc;
 
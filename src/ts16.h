@@ -5,14 +5,19 @@
 #define _TS16_H
 
 #include "console.h"
-#include "prompt.h"
+
+struct ts16_control;
 
 struct ts16 {
     struct console console;
-    struct prompt concentrator;
+    /* Shared with any other port open on the same concentrator */
+    struct ts16_control *control;
     int port;
 };
 
+/* Socket buffer size for concentrator connections, 0 for the default */
+void ts16_set_sockbuf(int bytes);
+
 int ts16_init(struct ts16 *ctx, const char *ip, int port, const char *username,
               const char *password);
 
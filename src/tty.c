@@ -26,6 +26,7 @@ struct baud_map {
 static const struct baud_map tty_baud_map[] = {
     { 1200, B1200 },
     { 115200, B115200 },
+    { 1500000, B1500000 },
     { 0, B0 }, /* Sentinel */
 };
 
@@ -0,0 +1,142 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "log.h"
+#include "tune.h"
+
+#include <stdint.h>
+#include <time.h>
+
+/*
+ * An epoch is long enough to average out scheduling noise, but ends after a
+ * second regardless, as one chunk over a UART can take that long.
+ */
+#define TUNE_EPOCH_SAMPLES      4
+#define TUNE_EPOCH_NS           (50 * 1000000ULL)
+#define TUNE_EPOCH_MAX_NS       (1000 * 1000000ULL)
+/* Epochs to stay put after a probe that didn't pay off */
+#define TUNE_HOLD_EPOCHS        8
+/* Differences in throughput below this are taken as noise */
+#define TUNE_MARGIN             0.05
+
+uint64_t tune_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static size_t tune_clamp(const struct tune *ctx, size_t size)
+{
+    size -= size % ctx->granule;
+
+    if (size < ctx->min)
+        return ctx->min;
+
+    if (size > ctx->max)
+        return ctx->max;
+
+    return size;
+}
+
+static void tune_set(struct tune *ctx, size_t size)
+{
+    if (size == ctx->size)
+        return;
+
+    logd("Tuned %s chunks from %zu to %zu bytes\n", ctx->name, ctx->size, size);
+    ctx->size = size;
+}
+
+static void tune_reset(struct tune *ctx)
+{
+    ctx->bytes = 0;
+    ctx->ns = 0;
+    ctx->samples = 0;
+}
+
+void tune_init(struct tune *ctx, const char *name, size_t size, size_t min,
+               size_t max, size_t granule)
+{
+    ctx->name = name;
+    ctx->granule = granule ? granule : 1;
+    ctx->min = min - min % ctx->granule;
+    if (ctx->min < ctx->granule)
+        ctx->min = ctx->granule;
+    ctx->max = max - max % ctx->granule;
+    if (ctx->max < ctx->min)
+        ctx->max = ctx->min;
+    ctx->size = tune_clamp(ctx, size);
+    ctx->prev = 0;
+    ctx->prev_rate = 0;
+    ctx->dir = 1;
+    ctx->hold = 0;
+    tune_reset(ctx);
+}
+
+/* Moves one step in the current direction, turning around at the bounds */
+static void tune_step(struct tune *ctx)
+{
+    size_t next;
+
+    next = tune_clamp(ctx, ctx->dir > 0 ? 2 * ctx->size : ctx->size / 2);
+    if (next == ctx->size) {
+        ctx->dir = -ctx->dir;
+        ctx->hold = TUNE_HOLD_EPOCHS;
+        return;
+    }
+
+    ctx->prev = ctx->size;
+    tune_set(ctx, next);
+}
+
+static void tune_epoch(struct tune *ctx, double rate)
+{
+    if (ctx->hold) {
+        if (--ctx->hold)
+            return;
+
+        /* Out of the hold, this epoch is the baseline to probe from */
+        ctx->prev_rate = 0;
+    }
+
+    /* A baseline, or a step that paid off: take another */
+    if (!ctx->prev_rate || rate >= ctx->prev_rate * (1 + TUNE_MARGIN)) {
+        ctx->prev_rate = rate;
+        tune_step(ctx);
+        return;
+    }
+
+    /* Go back unless it did as well, and look the other way next time */
+    if (rate < ctx->prev_rate * (1 - TUNE_MARGIN))
+        tune_set(ctx, ctx->prev);
+
+    ctx->dir = -ctx->dir;
+    ctx->hold = TUNE_HOLD_EPOCHS;
+}
+
+void tune_sample(struct tune *ctx, size_t bytes, uint64_t ns)
+{
+    ctx->bytes += bytes;
+    ctx->ns += ns;
+    ctx->samples++;
+
+    if (ctx->ns < TUNE_EPOCH_MAX_NS &&
+            (ctx->samples < TUNE_EPOCH_SAMPLES || ctx->ns < TUNE_EPOCH_NS))
+        return;
+
+    if (ctx->ns)
+        tune_epoch(ctx, ctx->bytes * 1e9 / ctx->ns);
+
+    tune_reset(ctx);
+}
+
+void tune_error(struct tune *ctx)
+{
+    tune_set(ctx, tune_clamp(ctx, ctx->size / 2));
+    ctx->prev_rate = 0;
+    ctx->dir = -1;
+    ctx->hold = 0;
+    tune_reset(ctx);
+}
@@ -0,0 +1,54 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _TUNE_H
+#define _TUNE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Picks a transfer's chunk size as it goes, by hill climbing on measured
+ * throughput. Each epoch of a few samples runs at one size. A better epoch
+ * doubles or halves the size again in the same direction, a worse one goes back
+ * and probes the other way after holding for a while. A failure halves the size
+ * at once, so a noisy link costs less per retry, and what that does to
+ * throughput decides whether it grows back.
+ *
+ * Sizes stay multiples of @granule within [@min, @max]. Callers serialise
+ * access, one tuner per transfer or per bridge.
+ */
+struct tune {
+    const char *name;
+    size_t min;
+    size_t max;
+    size_t granule;
+    size_t size;
+    /* The size before the last step and its throughput, in bytes/s */
+    size_t prev;
+    double prev_rate;
+    int dir;
+    unsigned int hold;
+    /* The epoch under way */
+    uint64_t bytes;
+    uint64_t ns;
+    unsigned int samples;
+};
+
+void tune_init(struct tune *ctx, const char *name, size_t size, size_t min,
+               size_t max, size_t granule);
+
+static inline size_t tune_size(const struct tune *ctx)
+{
+    return ctx->size;
+}
+
+/* Monotonic nanoseconds, for timing samples */
+uint64_t tune_now(void);
+
+/* @bytes went through at the current size in @ns, waits on the sink included */
+void tune_sample(struct tune *ctx, size_t bytes, uint64_t ns);
+
+/* A chunk at the current size failed and is to be retried */
+void tune_error(struct tune *ctx);
+
+#endif
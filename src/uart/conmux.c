@@ -0,0 +1,173 @@
+// SPDX-License-Identifier: Apache-2.0
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "conmux.h"
+#include "log.h"
+#include "rt.h"
+
+/* Where conmux_run() backs off to while every console is quiet */
+#define CONMUX_POLL_IDLE_US 50000
+
+static int conmux_write_all(int fd, const char *buf, size_t len)
+{
+    ssize_t wrote;
+
+    while (len > 0) {
+        wrote = write(fd, buf, len);
+        if (wrote == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+
+        len -= wrote;
+        buf += wrote;
+    }
+
+    return 0;
+}
+
+/* Takes input for the ports with none pending, waiting up to @interval_us */
+static int conmux_wait_input(struct conmux_port *ports, size_t count,
+                             long interval_us)
+{
+    struct pollfd pfds[SUART_BATCH_MAX];
+    size_t idx[SUART_BATCH_MAX];
+    struct timespec ts;
+    size_t i, npfds = 0;
+    ssize_t got;
+    int rc;
+
+    ts.tv_sec = interval_us / 1000000;
+    ts.tv_nsec = (interval_us % 1000000) * 1000;
+
+    for (i = 0; i < count; i++) {
+        if (ports[i].in < 0 || ports[i].remaining)
+            continue;
+
+        pfds[npfds] = (struct pollfd){ .fd = ports[i].in, .events = POLLIN };
+        idx[npfds++] = i;
+    }
+
+    /* Don't take more input until the last of it is in the XMIT FIFO */
+    if (!npfds) {
+        nanosleep(&ts, NULL);
+        return 0;
+    }
+
+    rc = ppoll(pfds, npfds, &ts, NULL);
+    if (rc == -1)
+        return errno == EINTR ? 0 : -errno;
+
+    for (i = 0; rc && i < npfds; i++) {
+        struct conmux_port *port = &ports[idx[i]];
+
+        if (!pfds[i].revents)
+            continue;
+
+        got = read(port->in, port->in_buf, port->uart->fifo_len);
+        if (got == -1)
+            return errno == EINTR ? 0 : -errno;
+
+        if (!got) {
+            logd("Input for %s ended\n", port->name);
+            return 1;
+        }
+
+        port->pending = port->in_buf;
+        port->remaining = got;
+    }
+
+    return 0;
+}
+
+static int conmux_poll(struct conmux_port *ports, size_t count)
+{
+    struct suart *uarts[SUART_BATCH_MAX];
+    uint8_t lsr[SUART_BATCH_MAX];
+    long busy_us = LONG_MAX;
+    char out_buf[1024];
+    long interval;
+    size_t i;
+    int rc;
+
+    if (!count || count > SUART_BATCH_MAX)
+        return -EINVAL;
+
+    /* Poll as often as the fastest of them needs */
+    for (i = 0; i < count; i++) {
+        long us = suart_busy_us(ports[i].uart);
+
+        if (us < busy_us)
+            busy_us = us;
+
+        uarts[i] = ports[i].uart;
+        ports[i].pending = NULL;
+        ports[i].remaining = 0;
+    }
+
+    interval = busy_us;
+
+    while (1) {
+        bool active = false;
+
+        if ((rc = conmux_wait_input(ports, count, interval)))
+            return rc < 0 ? rc : 0;
+
+        if ((rc = suart_status_batch(uarts, lsr, count)) < 0)
+            return rc;
+
+        for (i = 0; i < count; i++) {
+            struct conmux_port *port = &ports[i];
+            ssize_t got;
+
+            if (port->remaining) {
+                ssize_t left = suart_write_lsr(port->uart, lsr[i],
+                                               port->pending, port->remaining);
+
+                if (left < 0)
+                    return left;
+
+                port->pending += port->remaining - left;
+                port->remaining = left;
+                active = true;
+            }
+
+            got = suart_read_lsr(port->uart, lsr[i], out_buf, sizeof(out_buf));
+            if (got < 0)
+                return got;
+
+            if (!got)
+                continue;
+
+            if ((rc = conmux_write_all(port->out, out_buf, got)) < 0)
+                return rc;
+
+            active = true;
+        }
+
+        if (active)
+            interval = busy_us;
+        else if ((interval *= 2) > CONMUX_POLL_IDLE_US)
+            interval = CONMUX_POLL_IDLE_US;
+    }
+}
+
+int conmux_run(struct conmux_port *ports, size_t count)
+{
+    struct rt_state rt;
+    int rc;
+
+    rt_enter(&rt, "console mux");
+    rc = conmux_poll(ports, count);
+    rt_leave(&rt);
+
+    return rc;
+}
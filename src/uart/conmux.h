@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef CONMUX_H
+#define CONMUX_H
+
+#include <stddef.h>
+
+#include "suart.h"
+
+/* A UART serviced by conmux_run(), with where its traffic comes and goes */
+struct conmux_port
+{
+    const char *name;
+    struct suart *uart;
+    /* Sent to the UART, or -1 if nothing is */
+    int in;
+    /* Receives everything the UART does */
+    int out;
+
+    /* Input read but not yet in the XMIT FIFO */
+    char in_buf[SUART_FIFO_MAX];
+    const char *pending;
+    size_t remaining;
+};
+
+/*
+ * Polls up to SUART_BATCH_MAX UARTs from the one loop, reading all their line
+ * status in a single LPC batch each time around. Returns 0 once the input of
+ * any port ends.
+ */
+int conmux_run(struct conmux_port *ports, size_t count);
+
+#endif
@@ -1,24 +1,38 @@
 // SPDX-License-Identifier: Apache-2.0
 // Copyright (C) 2018,2019 IBM Corp.
+#define _GNU_SOURCE
 
-#include <assert.h>
 #include <errno.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdio.h>
-#include <sys/epoll.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "suart.h"
 #include "log.h"
+#include "rt.h"
+#include "span.h"
+#include "spsc.h"
 
 #define UART_RBR 0x00
 #define UART_THR 0x00
 #define UART_DLL 0x00
 #define UART_IER 0x01
+#define   UART_IER_ERBFI    (1 << 0)
 #define UART_DLH 0x01
 #define UART_IIR 0x02
+#define   UART_IIR_ID_MASK  0x0f
+#define   UART_IIR_RDA      0x04
+#define   UART_IIR_FIFO_MASK 0xc0
+#define   UART_IIR_FIFO64   (1 << 5)
 #define UART_FCR 0x02
+#define   UART_FCR_RCVR_TRIG_8 (2 << 6)
+#define   UART_FCR_FIFO64   (1 << 5)
 #define   UART_FCR_XMIT_RST (1 << 2)
 #define   UART_FCR_RCVR_RST (1 << 1)
 #define   UART_FCR_FIFO_EN  (1 << 0)
@@ -50,20 +64,51 @@
 
 #define UART_DEFAULT_BAUD 115200
 
+/* IIR reports received data once the RX FIFO holds at least this much */
+#define SUART_RX_TRIGGER    8
+#define SUART_FCR           (UART_FCR_RCVR_TRIG_8 | UART_FCR_FIFO_EN)
+
+/* Where suart_run() backs off to while the console is quiet */
+#define SUART_POLL_IDLE_US  50000
+
 static inline uint16_t baud_to_divisor(int baud)
 {
     /* Divide by 13 can get in the bin. So much debugging */
     return ((24000000 / 13) / (16 * baud));
 }
 
-static int __suart_init(struct suart *ctx, enum sio_dev dev, bool defaults,
-                        uint16_t base, int sirq)
+/*
+ * IIR's top bits read back set while the FIFOs are enabled, and a 16750 also
+ * sets bit 5 if it granted the 64-byte FIFO asked for under DLAB. Without them
+ * there's just the one holding register.
+ */
+static int suart_probe_fifo(struct suart *ctx)
+{
+    uint8_t iir;
+    int rc;
+
+    rc = lpc_readb(&ctx->io, ctx->base + UART_IIR, &iir);
+    if (rc)
+        return rc;
+
+    if ((iir & UART_IIR_FIFO_MASK) != UART_IIR_FIFO_MASK)
+        ctx->fifo_len = 1;
+    else if (iir & UART_IIR_FIFO64)
+        ctx->fifo_len = SUART_FIFO_MAX;
+    else
+        ctx->fifo_len = 16;
+
+    logd("SUART FIFO depth: %u\n", ctx->fifo_len);
+
+    return 0;
+}
+
+/* Points the SUART at its LPC I/O base and SIRQ and enables it, under @sio */
+static int suart_configure_sio(struct suart *ctx, struct sio *sio,
+                               enum sio_dev dev, bool defaults, uint16_t base,
+                               int sirq)
 {
-    struct sio _sio, *sio = &_sio;
-    struct lpc *io = &ctx->io;
-    uint16_t divisor;
     uint8_t data;
-    int cleanup;
     int rc;
 
     switch (dev) {
@@ -76,52 +121,45 @@ static int __suart_init(struct suart *ctx, enum sio_dev dev, bool defaults,
             return -EINVAL;
     }
 
-
-    rc = sio_init(sio);
-    if (rc)
-        return rc;
-
-    rc = sio_unlock(sio);
-    if (rc)
-        return rc;
+    ctx->dev = dev;
 
     rc = sio_select(sio, dev);
     if (rc)
-        goto sio_err;
+        return rc;
 
     if (defaults) {
         /* Grab the SUART's LPC base address, 16 bits in two byte-size registers */
         rc = sio_readb(sio, 0x60, &data);
         if (rc)
-            goto sio_err;
+            return rc;
 
         ctx->base = data << 8;
 
         rc = sio_readb(sio, 0x61, &data);
         if (rc)
-            goto sio_err;
+            return rc;
 
         ctx->base |= data;
 
         rc = sio_readb(sio, 0x70, &data);
         if (rc)
-            goto sio_err;
+            return rc;
 
         ctx->sirq = data;
     } else {
         rc = sio_writeb(sio, 0x60, base >> 8);
         if (rc)
-            goto sio_err;
+            return rc;
 
         rc = sio_writeb(sio, 0x61, base & 0xff);
         if (rc)
-            goto sio_err;
+            return rc;
 
         ctx->base = base;
 
         rc = sio_writeb(sio, 0x70, sirq);
         if (rc)
-            goto sio_err;
+            return rc;
 
         ctx->sirq = sirq;
     }
@@ -130,33 +168,33 @@ static int __suart_init(struct suart *ctx, enum sio_dev dev, bool defaults,
     logd("SUART SIRQ: %d\n", ctx->sirq);
 
     /* Enable the SUART */
-    rc = sio_writeb(sio, 0x30, 1);
-    if (rc)
-        goto sio_err;
-
-    rc = sio_lock(sio);
-    if (rc) {
-        errno = -rc;
-        perror("sio_lock");
-    }
+    return sio_writeb(sio, 0x30, 1);
+}
 
-    rc = sio_destroy(sio);
-    if (rc)
-        return rc;
+/* Sets up the 16550 at ctx->base for polled 115200 8N1 */
+static int suart_init_uart(struct suart *ctx)
+{
+    struct lpc *io = &ctx->io;
+    uint16_t divisor;
+    int cleanup;
+    int rc;
 
     /* Init LPC */
     rc = lpc_init(io, "io");
     if (rc)
         return rc;
 
-    /* Disable interrupts, will be polling */
-    rc = lpc_writeb(io, ctx->base + UART_IER, 0);
+    /*
+     * We poll, but enable the received data interrupt so IIR tells us when the
+     * RX FIFO reaches its trigger level. OUT2 stays clear to keep the
+     * interrupt off SIRQ, as it gates the UART's IRQ on PC-style SuperIOs.
+     */
+    rc = lpc_writeb(io, ctx->base + UART_IER, UART_IER_ERBFI);
     if (rc)
         goto cleanup_lpc;
 
     /* Setup Loop/DTR/RTS signal control */
-    rc = lpc_writeb(io, ctx->base + UART_MCR,
-                    (UART_MCR_OUT2 | UART_MCR_NRTS | UART_MCR_NDTR));
+    rc = lpc_writeb(io, ctx->base + UART_MCR, (UART_MCR_NRTS | UART_MCR_NDTR));
     if (rc)
         goto cleanup_lpc;
 
@@ -175,13 +213,24 @@ static int __suart_init(struct suart *ctx, enum sio_dev dev, bool defaults,
     if (rc)
         goto cleanup_lpc;
 
+    /* Polled FIFO Mode, the 64-byte FIFO can only be enabled under DLAB */
+    rc = lpc_writeb(io, ctx->base + UART_FCR,
+                    (SUART_FCR | UART_FCR_FIFO64 | UART_FCR_XMIT_RST |
+                     UART_FCR_RCVR_RST));
+    if (rc)
+        goto cleanup_lpc;
+
     rc = lpc_writeb(io, ctx->base + UART_LCR, (UART_LCR_EPS | UART_LCR_CLS_8));
     if (rc)
         goto cleanup_lpc;
 
-    /* Polled FIFO Mode */
-    return lpc_writeb(io, ctx->base + UART_FCR,
-                      (UART_FCR_XMIT_RST | UART_FCR_RCVR_RST | UART_FCR_FIFO_EN));
+    ctx->baud = UART_DEFAULT_BAUD;
+
+    rc = suart_probe_fifo(ctx);
+    if (rc)
+        goto cleanup_lpc;
+
+    return 0;
 
 cleanup_lpc:
     cleanup = lpc_destroy(io);
@@ -191,8 +240,41 @@ cleanup_lpc:
     }
 
     return rc;
+}
+
+/* Runs @count SUARTs' SuperIO configuration in the one unlocked session */
+static int suart_sio_session(struct suart *ctxs, const enum sio_dev *devs,
+                             size_t count, bool enable, bool defaults,
+                             uint16_t base, int sirq)
+{
+    struct sio _sio, *sio = &_sio;
+    int cleanup;
+    size_t i;
+    int rc;
+
+    rc = sio_init(sio);
+    if (rc)
+        return rc;
+
+    rc = sio_unlock(sio);
+    if (rc)
+        return rc;
+
+    for (i = 0; i < count; i++) {
+        if (enable) {
+            rc = suart_configure_sio(&ctxs[i], sio, devs[i], defaults, base,
+                                     sirq);
+        } else if (ctxs[i].dev) {
+            rc = sio_select(sio, ctxs[i].dev);
+            /* Disable the SUART */
+            if (!rc)
+                rc = sio_writeb(sio, 0x30, 0);
+        }
+
+        if (rc)
+            break;
+    }
 
-sio_err:
     cleanup = sio_lock(sio);
     if (cleanup) {
         errno = -cleanup;
@@ -203,11 +285,24 @@ sio_err:
     if (cleanup) {
         errno = -cleanup;
         perror("sio_destroy");
+        rc = rc ? rc : cleanup;
     }
 
     return rc;
 }
 
+static int __suart_init(struct suart *ctx, enum sio_dev dev, bool defaults,
+                        uint16_t base, int sirq)
+{
+    int rc;
+
+    rc = suart_sio_session(ctx, &dev, 1, true, defaults, base, sirq);
+    if (rc)
+        return rc;
+
+    return suart_init_uart(ctx);
+}
+
 int suart_init_defaults(struct suart *ctx, enum sio_dev dev)
 {
     return __suart_init(ctx, dev, true, 0, 0);
@@ -218,45 +313,61 @@ int suart_init(struct suart *ctx, enum sio_dev dev, uint16_t base, int sirq)
     return __suart_init(ctx, dev, false, base, sirq);
 }
 
-int suart_destroy(struct suart *ctx)
+int suart_init_many(struct suart *ctxs, const enum sio_dev *devs, size_t count)
 {
-    struct sio _sio, *sio = &_sio;
-    int cleanup;
+    size_t i;
     int rc;
 
-    rc = sio_init(sio);
-    if (rc)
-        return rc;
-
-    rc = sio_unlock(sio);
-    if (rc)
-        return rc;
-
-    rc = sio_select(sio, ctx->dev);
-    if (rc)
-        goto sio_err;
+    /* So a failure part way through only disables those that were enabled */
+    for (i = 0; i < count; i++)
+        ctxs[i].dev = 0;
 
-    /* Disable the SUART */
-    rc = sio_writeb(sio, 0x30, 0);
+    rc = suart_sio_session(ctxs, devs, count, true, true, 0, 0);
     if (rc)
-        goto sio_err;
+        goto disable;
 
-sio_err:
-    cleanup = sio_lock(sio);
-    if (cleanup) {
-        errno = -cleanup;
-        perror("sio_lock");
+    for (i = 0; i < count; i++) {
+        rc = suart_init_uart(&ctxs[i]);
+        if (rc) {
+            while (i--)
+                lpc_destroy(&ctxs[i].io);
+            goto disable;
+        }
     }
 
-    cleanup = sio_destroy(sio);
-    if (cleanup) {
-        errno = -cleanup;
-        perror("sio_destroy");
-    }
+    return 0;
+
+disable:
+    suart_destroy_many(ctxs, count);
 
     return rc;
 }
 
+int suart_init_port(struct suart *ctx, uint16_t base)
+{
+    ctx->dev = 0;
+    ctx->base = base;
+    ctx->sirq = 0;
+
+    logd("UART base address: 0x%x\n", ctx->base);
+
+    return suart_init_uart(ctx);
+}
+
+int suart_destroy(struct suart *ctx)
+{
+    /* Nothing to disable if SuperIO didn't enable it */
+    if (!ctx->dev)
+        return 0;
+
+    return suart_sio_session(ctx, NULL, 1, false, false, 0, 0);
+}
+
+int suart_destroy_many(struct suart *ctxs, size_t count)
+{
+    return suart_sio_session(ctxs, NULL, count, false, false, 0, 0);
+}
+
 int suart_set_baud(struct suart *ctx, int rate)
 {
     struct lpc *io = &ctx->io;
@@ -287,7 +398,7 @@ int suart_set_baud(struct suart *ctx, int rate)
 
     /* Reset the FIFOs to ensure any baud rate weirdness is gone */
     rc = lpc_writeb(&ctx->io, ctx->base + UART_FCR,
-                    (UART_FCR_RCVR_RST | UART_FCR_XMIT_RST | UART_FCR_FIFO_EN));
+                    (SUART_FCR | UART_FCR_RCVR_RST | UART_FCR_XMIT_RST));
     if (rc)
         return rc;
 
@@ -303,20 +414,9 @@ int suart_set_baud(struct suart *ctx, int rate)
     return 0;
 }
 
-ssize_t suart_write(struct suart *ctx, const char *buf, size_t len)
+/* Errors are attached to bytes in the RX FIFO, report them and carry on */
+static void suart_check_lsr(uint8_t lsr)
 {
-    struct lpc *io = &ctx->io;
-    size_t slots = 16;
-    uint8_t lsr;
-    int rc;
-
-    if (!len)
-        return len;
-
-    rc = lpc_readb(io, ctx->base + UART_LSR, &lsr);
-    if (rc)
-        return rc;
-
     if (lsr & UART_LSR_ERROR) {
         loge("Error condition asserted: 0x%x\n", lsr);
         if (lsr & UART_LSR_BI)
@@ -325,161 +425,304 @@ ssize_t suart_write(struct suart *ctx, const char *buf, size_t len)
             loge("Framing error condition asserted\n");
         if (lsr & UART_LSR_PE)
             loge("Parity error condition asserted\n");
-        return -EIO;
     }
 
     if (lsr & UART_LSR_OE)
         loge("Overrun condition asserted\n");
+}
+
+int suart_status_batch(struct suart *const *ctxs, uint8_t *lsr, size_t count)
+{
+    struct lpc_rw rw[SUART_BATCH_MAX];
+    size_t i;
+    int rc;
+
+    if (!count)
+        return 0;
+
+    if (count > SUART_BATCH_MAX)
+        return -EINVAL;
+
+    for (i = 0; i < count; i++)
+        rw[i] = (struct lpc_rw){ .addr = ctxs[i]->base + UART_LSR,
+                                 .val = &lsr[i] };
+
+    /* The addresses are absolute, so any one of them can issue the lot */
+    rc = lpc_rw_batch(&ctxs[0]->io, rw, count);
+    if (rc)
+        return rc;
+
+    for (i = 0; i < count; i++)
+        suart_check_lsr(lsr[i]);
+
+    return 0;
+}
+
+ssize_t suart_write_lsr(struct suart *ctx, uint8_t lsr, const char *buf,
+                        size_t len)
+{
+    size_t burst;
+    int rc;
 
-    if (lsr & UART_LSR_DR) {
-        /* We want to go read RBR ASAP */
+    /* THRE in FIFO mode means the whole XMIT FIFO is free */
+    if (!len || !(lsr & UART_LSR_THRE))
         return len;
-    }
 
-    if (!(lsr & UART_LSR_THRE))
+    /* So fill it in one go, without pacing each byte */
+    burst = len < ctx->fifo_len ? len : ctx->fifo_len;
+    rc = lpc_writesb(&ctx->io, ctx->base + UART_THR, buf, burst);
+    if (rc)
+        return rc;
+
+    return len - burst;
+}
+
+ssize_t suart_write(struct suart *ctx, const char *buf, size_t len)
+{
+    uint8_t lsr;
+    int rc;
+
+    if (!len)
         return len;
 
-    while (len && slots) {
-        rc = lpc_writeb(io, ctx->base + UART_THR, *buf++);
-        if (rc)
-            return rc;
+    rc = lpc_readb(&ctx->io, ctx->base + UART_LSR, &lsr);
+    if (rc)
+        return rc;
 
-        len--;
-        slots--;
-    }
+    suart_check_lsr(lsr);
 
-    return len;
+    return suart_write_lsr(ctx, lsr, buf, len);
 }
 
 ssize_t suart_read(struct suart *ctx, char *buf, size_t len)
 {
+    struct lpc_rw rw[SUART_RX_TRIGGER];
     struct lpc *io = &ctx->io;
-    char *end = buf + len;
-    uint8_t lsr;
-    int retry;
+    uint8_t iir, lsr;
+    size_t got = 0;
+    size_t i;
     int rc;
 
-    rc = lpc_readb(io, ctx->base + UART_LSR, &lsr);
-    if (rc)
-        return rc;
+    /* Take bursts of the trigger level without asking LSR about each byte */
+    while (len - got >= SUART_RX_TRIGGER) {
+        rc = lpc_readb(io, ctx->base + UART_IIR, &iir);
+        if (rc)
+            return rc;
 
-    if (lsr & UART_LSR_ERROR) {
-        loge("Error condition asserted: 0x%x\n", lsr);
-        if (lsr & UART_LSR_BI)
-            loge("Break condition asserted\n");
-        if (lsr & UART_LSR_FE)
-            loge("Framing error condition asserted\n");
-        if (lsr & UART_LSR_PE)
-            loge("Parity error condition asserted\n");
-        return -EIO;
+        if ((iir & UART_IIR_ID_MASK) != UART_IIR_RDA)
+            break;
+
+        for (i = 0; i < SUART_RX_TRIGGER; i++)
+            rw[i] = (struct lpc_rw){ .addr = ctx->base + UART_RBR,
+                                     .val = (uint8_t *)&buf[got + i] };
+
+        rc = lpc_rw_batch(io, rw, SUART_RX_TRIGGER);
+        if (rc)
+            return rc;
+
+        got += SUART_RX_TRIGGER;
     }
 
-    if (lsr & UART_LSR_OE)
-        loge("Overrun condition asserted\n");
+    /* Then whatever's left below it */
+    while (got < len) {
+        rc = lpc_readb(io, ctx->base + UART_LSR, &lsr);
+        if (rc)
+            return rc;
+
+        suart_check_lsr(lsr);
+
+        if (!(lsr & UART_LSR_DR))
+            break;
+
+        rc = lpc_readb(io, ctx->base + UART_RBR, (uint8_t *)&buf[got++]);
+        if (rc)
+            return rc;
+    }
+
+    return got;
+}
 
+ssize_t suart_read_lsr(struct suart *ctx, uint8_t lsr, char *buf, size_t len)
+{
     if (!(lsr & UART_LSR_DR))
         return 0;
 
-    retry = 100;
-    do {
-        while (!(rc = lpc_readb(io, ctx->base + UART_LSR, &lsr)) &&
-                 (lsr & UART_LSR_DR) && buf < end) {
-            rc = lpc_readb(io, ctx->base + UART_RBR, (uint8_t *)buf++);
-            if (rc)
-                return rc;
+    return suart_read(ctx, buf, len);
+}
+
+static int suart_write_all(int fd, const char *buf, ssize_t len)
+{
+    ssize_t wrote;
+
+    while (len > 0) {
+        wrote = write(fd, buf, len);
+        if (wrote == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
         }
-    } while (--retry);
 
+        len -= wrote;
+        buf += wrote;
+    }
 
-    if (rc)
-        return rc;
+    return 0;
+}
+
+/* Half the time the RX FIFO takes to fill at the current rate, 10 bits a byte */
+long suart_busy_us(struct suart *ctx)
+{
+    long us = (ctx->fifo_len * 10 * 1000000L) / (2 * ctx->baud);
 
-    return buf - (end - len);
+    return us ? us : 1;
 }
 
-/*
- * uin: UART input from the host side to send to the BMC
- * uout: UART output from the BMC to send to the Host
- */
-int suart_run(struct suart *ctx, int uin, int uout)
+/* Enough to ride out a terminal that stops reading for a few seconds */
+#define SUART_OUT_RING      (1 << 20)
+
+struct suart_out {
+    struct spsc ring;
+    int fd;
+};
+
+/* Drains the ring to uout, so a slow reader only ever stalls this thread */
+static void *suart_out_thread(void *arg)
 {
-    char _uout_buf[1024], *uout_buf;
-    char _uin_buf[16], *uin_buf;
-    struct epoll_event epevent;
-    int epfd;
+    struct suart_out *out = arg;
+    const void *buf;
+    size_t len;
     int rc;
 
-    epevent.events = EPOLLIN | EPOLLERR;
-    epevent.data.fd = uin;
+    span_thread_name("console-out");
 
-    epfd = epoll_create1(0);
-    rc = epoll_ctl(epfd, EPOLL_CTL_ADD, uin, &epevent);
-    if (rc == -1)
-        return -errno;
+    while ((len = spsc_peek(&out->ring, &buf))) {
+        if ((rc = suart_write_all(out->fd, buf, len)) < 0) {
+            spsc_abort(&out->ring, rc);
+            break;
+        }
 
-    while ((rc = epoll_wait(epfd, &epevent, 1, 50)) != -1) {
-        if (rc) {
-            const char *uin_end;
-            ssize_t uin_write;
-            ssize_t uin_read;
+        spsc_consume(&out->ring, len);
+    }
 
-            uin_buf = &_uin_buf[0];
-            assert(rc == 1);
+    return NULL;
+}
 
-            uin_read = read(uin, uin_buf, sizeof(_uin_buf));
-            if (uin_read == -1)
-                return -errno;
+static int suart_poll(struct suart *ctx, int uin, struct spsc *ring,
+                      struct conlog *capture, uint64_t *dropped)
+{
+    struct pollfd pfd = { .fd = uin, .events = POLLIN };
+    char uout_buf[1024], uin_buf[SUART_FIFO_MAX];
+    const char *pending = NULL;
+    long busy_us, interval;
+    struct timespec ts;
+    ssize_t remaining = 0;
+    ssize_t got;
+    int rc;
 
-            uin_end = uin_buf + uin_read;
-            uin_write = uin_read;
-            while (uin_read > 0) {
-                ssize_t uout_wrote;
-                ssize_t uout_read;
+    busy_us = suart_busy_us(ctx);
+    interval = busy_us;
+
+    while (1) {
+        if ((rc = spsc_status(ring)) < 0)
+            return rc;
 
-                uin_write = suart_write(ctx, uin_end - uin_write, uin_write);
-                if (uin_write < 0)
-                    return uin_write;
+        ts.tv_sec = interval / 1000000;
+        ts.tv_nsec = (interval % 1000000) * 1000;
 
-                uout_buf = &_uout_buf[0];
-                uout_read = suart_read(ctx, uout_buf, sizeof(_uout_buf));
-                if (uout_read < 0)
-                    return uout_read;
+        /* Don't take more input until the last of it is in the XMIT FIFO */
+        if (remaining) {
+            nanosleep(&ts, NULL);
+        } else {
+            rc = ppoll(&pfd, 1, &ts, NULL);
+            if (rc == -1) {
+                if (errno == EINTR)
+                    continue;
+                return -errno;
+            }
 
-                while (uout_read > 0) {
-                    uout_wrote = write(uout, uout_buf, uout_read);
-                    if (uout_wrote == -1)
-                        return -errno;
+            if (rc) {
+                remaining = read(uin, uin_buf, ctx->fifo_len);
+                if (remaining == -1)
+                    return -errno;
 
-                    uout_read -= uout_wrote;
-                    uout_buf += uout_wrote;
-                }
+                if (!remaining)
+                    return 0;
 
-                uin_read = uin_write;
+                pending = uin_buf;
             }
-        } else {
-            ssize_t uout_wrote;
-            ssize_t uout_read;
+        }
 
-            uout_buf = &_uout_buf[0];
-            uout_read = suart_read(ctx, uout_buf, sizeof(_uout_buf));
-            if (uout_read < 0)
-                return uout_read;
+        if (remaining) {
+            ssize_t left = suart_write(ctx, pending, remaining);
 
-            while (uout_read > 0) {
-                uout_wrote = write(uout, uout_buf, uout_read);
-                if (uout_wrote == -1)
-                    return -errno;
+            if (left < 0)
+                return left;
 
-                uout_read -= uout_wrote;
-                uout_buf += uout_wrote;
-            }
+            pending += remaining - left;
+            remaining = left;
         }
+
+        got = suart_read(ctx, uout_buf, sizeof(uout_buf));
+        if (got < 0)
+            return got;
+
+        /* Losing output beats letting the SUART's RX FIFO overrun */
+        *dropped += got - spsc_write(ring, uout_buf, got);
+
+        if (capture && got && (rc = conlog_append(capture, uout_buf, got)) < 0)
+            return rc;
+
+        if (got || remaining)
+            interval = busy_us;
+        else if ((interval *= 2) > SUART_POLL_IDLE_US)
+            interval = SUART_POLL_IDLE_US;
     }
+}
 
-    if (rc == -1)
-        return -errno;
+/*
+ * uin: UART input from the host side to send to the BMC
+ * uout: UART output from the BMC to send to the Host
+ *
+ * LPC has no way to deliver the SUART's interrupts to us, so poll. While data
+ * is moving we look again before the RX FIFO can fill, and back off towards
+ * SUART_POLL_IDLE_US once the console goes quiet. Writing uout is left to a
+ * second thread so that a stalled terminal can't hold up the polling.
+ */
+int suart_run(struct suart *ctx, int uin, int uout, struct conlog *capture)
+{
+    struct suart_out out = { .fd = uout };
+    uint64_t dropped = 0;
+    struct rt_state rt;
+    pthread_t thread;
+    int rc, status;
 
-    return 0;
+    if ((rc = spsc_init(&out.ring, SUART_OUT_RING)) < 0)
+        return rc;
+
+    if ((rc = pthread_create(&thread, NULL, suart_out_thread, &out))) {
+        rc = -rc;
+        goto cleanup_ring;
+    }
+
+    /* After starting the output thread, which shouldn't inherit it */
+    rt_enter(&rt, "console");
+    rc = suart_poll(ctx, uin, &out.ring, capture, &dropped);
+    rt_leave(&rt);
+
+    /* Let the thread finish what's queued unless it's why we stopped */
+    spsc_close(&out.ring);
+    pthread_join(thread, NULL);
+
+    if ((status = spsc_status(&out.ring)) < 0 && !rc)
+        rc = status;
+
+    if (dropped)
+        logi("Dropped %" PRIu64 " bytes of console output\n", dropped);
+
+cleanup_ring:
+    spsc_destroy(&out.ring);
+
+    return rc;
 }
 
 ssize_t suart_flush(struct suart *ctx, const char *buf, size_t len)
@@ -491,7 +734,7 @@ ssize_t suart_flush(struct suart *ctx, const char *buf, size_t len)
     while (remaining > 0) {
         /* Force a reset of the RCVR FIFO, we're flushing XMIT */
         rc = lpc_writeb(&ctx->io, ctx->base + UART_FCR,
-                        (UART_FCR_RCVR_RST | UART_FCR_FIFO_EN));
+                        (SUART_FCR | UART_FCR_RCVR_RST));
         if (rc)
             return rc;
 
@@ -501,44 +744,119 @@ ssize_t suart_flush(struct suart *ctx, const char *buf, size_t len)
     return remaining;
 }
 
-ssize_t suart_fill(struct suart *ctx, char *buf, size_t len)
+static int64_t suart_now_us(void)
 {
-    ssize_t remaining = len;
-    ssize_t consumed = 0;
+    struct timespec now;
 
-    while (remaining) {
-        consumed = suart_read(ctx, buf, remaining);
-        if (consumed < 0)
-            return consumed;
+    clock_gettime(CLOCK_MONOTONIC, &now);
 
-        remaining -= consumed;
-        buf += consumed;
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+/* Sleeps until more could have arrived, or returns false if past @deadline */
+static bool suart_idle(struct suart *ctx, int64_t deadline)
+{
+    struct timespec ts;
+    int64_t now;
+    long wait;
 
-        sleep(1);
+    wait = suart_busy_us(ctx);
+    if (deadline >= 0) {
+        if ((now = suart_now_us()) >= deadline)
+            return false;
+
+        if (deadline - now < wait)
+            wait = deadline - now;
     }
 
-    return len - remaining;
+    ts.tv_sec = wait / 1000000;
+    ts.tv_nsec = (wait % 1000000) * 1000;
+    nanosleep(&ts, NULL);
+
+    return true;
 }
 
-ssize_t suart_fill_until(struct suart *ctx, char *buf, size_t len, char term)
+static int64_t suart_deadline(int timeout_ms)
 {
-    ssize_t remaining = len;
-    ssize_t consumed = 0;
+    return timeout_ms >= 0 ? suart_now_us() + timeout_ms * 1000LL : -1;
+}
+
+ssize_t suart_recv(struct suart *ctx, char *buf, size_t len, int term,
+                   int timeout_ms)
+{
+    int64_t deadline;
+    size_t got = 0;
+    ssize_t rc;
 
     if (len > SSIZE_MAX)
         return -EINVAL;
 
-    /* Condition is broken when reading bursts of multiple characters */
-    while ((remaining < (ssize_t)len && *(buf - 1) != term) || remaining) {
-        consumed = suart_read(ctx, buf, remaining);
-        if (consumed < 0)
-            return consumed;
+    deadline = suart_deadline(timeout_ms);
+
+    while (got < len) {
+        rc = suart_read(ctx, buf + got, len - got);
+        if (rc < 0)
+            return rc;
+
+        /* Only look at what just arrived, the terminator may be mid-burst */
+        if (term >= 0 && memchr(buf + got, term, rc))
+            return got + rc;
 
-        remaining -= consumed;
-        buf += consumed;
+        got += rc;
+        if (rc)
+            continue;
 
-        sleep(1);
+        if (!suart_idle(ctx, deadline))
+            break;
     }
 
-    return len - remaining;
+    return got;
+}
+
+ssize_t suart_recv_any(struct suart *ctx, char *buf, size_t len,
+                       int timeout_ms)
+{
+    int64_t deadline;
+    ssize_t rc;
+
+    if (len > SSIZE_MAX)
+        return -EINVAL;
+
+    deadline = suart_deadline(timeout_ms);
+
+    do {
+        if ((rc = suart_read(ctx, buf, len)))
+            return rc;
+    } while (suart_idle(ctx, deadline));
+
+    return 0;
+}
+
+int suart_drain(struct suart *ctx, int timeout_ms)
+{
+    int64_t deadline;
+    uint8_t lsr;
+    int rc;
+
+    deadline = suart_deadline(timeout_ms);
+
+    do {
+        if ((rc = lpc_readb(&ctx->io, ctx->base + UART_LSR, &lsr)))
+            return rc;
+
+        if (lsr & UART_LSR_TEMT)
+            return 0;
+    } while (suart_idle(ctx, deadline));
+
+    return -ETIMEDOUT;
+}
+
+ssize_t suart_fill(struct suart *ctx, char *buf, size_t len)
+{
+    return suart_recv(ctx, buf, len, -1, -1);
+}
+
+ssize_t suart_fill_until(struct suart *ctx, char *buf, size_t len, char term)
+{
+    return suart_recv(ctx, buf, len, (unsigned char)term, -1);
 }
@@ -7,32 +7,72 @@
 #include <stdint.h>
 #include <sys/types.h>
 
+#include "../conlog.h"
 #include "../lpc.h"
 #include "../sio.h"
 
+/* The deepest FIFO suart_init() recognises, that of a 16750 */
+#define SUART_FIFO_MAX 64
+/* The most UARTs suart_status_batch() takes at once */
+#define SUART_BATCH_MAX 8
+
 struct suart
 {
     enum sio_dev dev;
     struct lpc io;
     uint8_t sirq;
     uint16_t base;
-    uint16_t baud;
+    uint32_t baud;
+    /* XMIT FIFO slots, as found by suart_init() */
+    unsigned int fifo_len;
 };
 
 /* If base is 0 the hardware default is selected */
 int suart_init_defaults(struct suart *ctx, enum sio_dev dev);
 int suart_init(struct suart *ctx, enum sio_dev dev, uint16_t base, int sirq);
+/* Configures each at its hardware default under the one SuperIO unlock */
+int suart_init_many(struct suart *ctxs, const enum sio_dev *devs, size_t count);
+/* A 16550 the host already decodes at @base, such as a VUART, without SuperIO */
+int suart_init_port(struct suart *ctx, uint16_t base);
 int suart_destroy(struct suart *ctx);
+int suart_destroy_many(struct suart *ctxs, size_t count);
 int suart_set_baud(struct suart *ctx, int rate);
 
 /* Non-blocking */
 ssize_t suart_write(struct suart *ctx, const char *buf, size_t len);
 ssize_t suart_read(struct suart *ctx, char *buf, size_t len);
 
-int suart_run(struct suart *ctx, int uin, int uout);
+/*
+ * Reads the LSR of each of @count UARTs in one LPC batch, for the _lsr()
+ * variants of suart_write() and suart_read() to act on without reading it again
+ */
+int suart_status_batch(struct suart *const *ctxs, uint8_t *lsr, size_t count);
+ssize_t suart_write_lsr(struct suart *ctx, uint8_t lsr, const char *buf,
+                        size_t len);
+ssize_t suart_read_lsr(struct suart *ctx, uint8_t lsr, char *buf, size_t len);
+
+/* How often to poll a busy UART so its RX FIFO doesn't overrun */
+long suart_busy_us(struct suart *ctx);
+
+/* BMC output is also recorded to @capture if it isn't NULL */
+int suart_run(struct suart *ctx, int uin, int uout, struct conlog *capture);
 
 /* Blocking */
 ssize_t suart_flush(struct suart *ctx, const char *buf, size_t len);
+
+/* Waits for the transmitter to empty, so the UART can be rerouted */
+int suart_drain(struct suart *ctx, int timeout_ms);
+
+/*
+ * Receive until @len bytes arrive, the burst holding @term arrives if @term
+ * isn't -1, or @timeout_ms passes if it isn't -1. Bytes that came in with
+ * @term are returned with it. Returns the number of bytes received.
+ */
+ssize_t suart_recv(struct suart *ctx, char *buf, size_t len, int term,
+                   int timeout_ms);
+/* Returns whatever arrives first, or 0 if nothing does within @timeout_ms */
+ssize_t suart_recv_any(struct suart *ctx, char *buf, size_t len,
+                       int timeout_ms);
 ssize_t suart_fill(struct suart *ctx, char *buf, size_t len);
 ssize_t suart_fill_until(struct suart *ctx, char *buf, size_t len, char term);
 
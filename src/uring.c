@@ -0,0 +1,195 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "config.h"
+#include "log.h"
+#include "uring.h"
+
+#include <errno.h>
+#include <string.h>
+
+#if HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static int uring_enter(struct uring *ctx, unsigned int submit,
+                       unsigned int wait)
+{
+    long rc;
+
+    do {
+        rc = syscall(__NR_io_uring_enter, ctx->fd, submit, wait,
+                     wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while (rc < 0 && errno == EINTR);
+
+    return rc < 0 ? -errno : 0;
+}
+
+int uring_init(struct uring *ctx, unsigned int entries)
+{
+    struct io_uring_params params;
+    int rc;
+
+    memset(ctx, 0, sizeof(*ctx));
+    memset(&params, 0, sizeof(params));
+
+    if ((ctx->fd = syscall(__NR_io_uring_setup, entries, &params)) < 0) {
+        logd("Failed to set up io_uring: %d\n", -errno);
+        return -ENOTSUP;
+    }
+
+    ctx->sq_map_len = params.sq_off.array +
+                      params.sq_entries * sizeof(unsigned int);
+    ctx->sq_map = mmap(NULL, ctx->sq_map_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_SQ_RING);
+    if (ctx->sq_map == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_fd;
+    }
+
+    ctx->cq_map_len = params.cq_off.cqes +
+                      params.cq_entries * sizeof(struct io_uring_cqe);
+    ctx->cq_map = mmap(NULL, ctx->cq_map_len, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_CQ_RING);
+    if (ctx->cq_map == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_sq;
+    }
+
+    ctx->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ctx->sqes = mmap(NULL, ctx->sqes_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ctx->fd, IORING_OFF_SQES);
+    if (ctx->sqes == MAP_FAILED) {
+        rc = -errno;
+        goto cleanup_cq;
+    }
+
+    ctx->sq_head = (unsigned int *)((char *)ctx->sq_map + params.sq_off.head);
+    ctx->sq_tail = (unsigned int *)((char *)ctx->sq_map + params.sq_off.tail);
+    ctx->sq_mask = (unsigned int *)((char *)ctx->sq_map +
+                                    params.sq_off.ring_mask);
+    ctx->sq_array = (unsigned int *)((char *)ctx->sq_map + params.sq_off.array);
+    ctx->cq_head = (unsigned int *)((char *)ctx->cq_map + params.cq_off.head);
+    ctx->cq_tail = (unsigned int *)((char *)ctx->cq_map + params.cq_off.tail);
+    ctx->cq_mask = (unsigned int *)((char *)ctx->cq_map +
+                                    params.cq_off.ring_mask);
+    ctx->cqes = (char *)ctx->cq_map + params.cq_off.cqes;
+
+    return 0;
+
+cleanup_cq:
+    munmap(ctx->cq_map, ctx->cq_map_len);
+
+cleanup_sq:
+    munmap(ctx->sq_map, ctx->sq_map_len);
+
+cleanup_fd:
+    close(ctx->fd);
+
+    logd("Failed to map io_uring: %d\n", rc);
+
+    return -ENOTSUP;
+}
+
+void uring_destroy(struct uring *ctx)
+{
+    munmap(ctx->sqes, ctx->sqes_len);
+    munmap(ctx->cq_map, ctx->cq_map_len);
+    munmap(ctx->sq_map, ctx->sq_map_len);
+    close(ctx->fd);
+}
+
+int uring_register_buffers(struct uring *ctx, const struct iovec *iov,
+                           unsigned int nr)
+{
+    if (syscall(__NR_io_uring_register, ctx->fd, IORING_REGISTER_BUFFERS, iov,
+                nr) < 0)
+        return -errno;
+
+    return 0;
+}
+
+int uring_write(struct uring *ctx, int fd, int index, const void *buf,
+                size_t len, off_t offset, uint64_t tag)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int tail, slot;
+
+    tail = *ctx->sq_tail;
+    if (tail - __atomic_load_n(ctx->sq_head, __ATOMIC_ACQUIRE) >
+            *ctx->sq_mask)
+        return -EBUSY;
+
+    slot = tail & *ctx->sq_mask;
+    sqe = (struct io_uring_sqe *)ctx->sqes + slot;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = index < 0 ? IORING_OP_WRITE : IORING_OP_WRITE_FIXED;
+    sqe->fd = fd;
+    sqe->off = offset;
+    sqe->addr = (uintptr_t)buf;
+    sqe->len = len;
+    sqe->buf_index = index < 0 ? 0 : index;
+    sqe->user_data = tag;
+
+    ctx->sq_array[slot] = slot;
+    __atomic_store_n(ctx->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    return uring_enter(ctx, 1, 0);
+}
+
+int uring_wait(struct uring *ctx, uint64_t *tag, int *res)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head;
+    int rc;
+
+    head = *ctx->cq_head;
+    while (head == __atomic_load_n(ctx->cq_tail, __ATOMIC_ACQUIRE)) {
+        if ((rc = uring_enter(ctx, 0, 1)) < 0)
+            return rc;
+    }
+
+    cqe = (struct io_uring_cqe *)ctx->cqes + (head & *ctx->cq_mask);
+    *tag = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(ctx->cq_head, head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+#else
+int uring_init(struct uring *ctx __attribute__((unused)),
+               unsigned int entries __attribute__((unused)))
+{
+    return -ENOTSUP;
+}
+
+void uring_destroy(struct uring *ctx __attribute__((unused)))
+{
+}
+
+int uring_register_buffers(struct uring *ctx __attribute__((unused)),
+                           const struct iovec *iov __attribute__((unused)),
+                           unsigned int nr __attribute__((unused)))
+{
+    return -ENOTSUP;
+}
+
+int uring_write(struct uring *ctx __attribute__((unused)),
+                int fd __attribute__((unused)),
+                int index __attribute__((unused)),
+                const void *buf __attribute__((unused)),
+                size_t len __attribute__((unused)),
+                off_t offset __attribute__((unused)),
+                uint64_t tag __attribute__((unused)))
+{
+    return -ENOTSUP;
+}
+
+int uring_wait(struct uring *ctx __attribute__((unused)),
+               uint64_t *tag __attribute__((unused)),
+               int *res __attribute__((unused)))
+{
+    return -ENOTSUP;
+}
+#endif
@@ -0,0 +1,52 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _URING_H
+#define _URING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/*
+ * Just enough of io_uring to keep several file writes in flight from one
+ * thread, through the system calls directly. One thread submits and reaps.
+ */
+struct uring {
+    int fd;
+    unsigned int *sq_head;
+    unsigned int *sq_tail;
+    unsigned int *sq_mask;
+    unsigned int *sq_array;
+    void *sqes;
+    unsigned int *cq_head;
+    unsigned int *cq_tail;
+    unsigned int *cq_mask;
+    void *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+};
+
+/* Returns -ENOTSUP if io_uring isn't built in or the kernel refuses it */
+int uring_init(struct uring *ctx, unsigned int entries);
+void uring_destroy(struct uring *ctx);
+
+/* Pins buffers for uring_write() to refer to by index */
+int uring_register_buffers(struct uring *ctx, const struct iovec *iov,
+                           unsigned int nr);
+
+/*
+ * Writes @len bytes of @buf at @offset of @fd, from the registered buffer
+ * @index or, if it's negative, an unregistered one. @tag comes back with the
+ * completion.
+ */
+int uring_write(struct uring *ctx, int fd, int index, const void *buf,
+                size_t len, off_t offset, uint64_t tag);
+
+/* Waits for a completion, whose result is a byte count or a negative errno */
+int uring_wait(struct uring *ctx, uint64_t *tag, int *res);
+
+#endif
@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: Apache-2.0
+
+#include "array.h"
+#include "log.h"
+#include "rev.h"
+#include "soc/sdmc.h"
+#include "sysmap.h"
+#include "vmem.h"
+
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * ARM kernels place swapper_pg_dir just below the image at TEXT_OFFSET 0x8000,
+ * taking 16KiB for a short-descriptor table and 20KiB for LPAE's four entries
+ * and the page of second-level entries behind each.
+ */
+#define VMEM_SWAPPER_SHORT      0x4000
+#define VMEM_SWAPPER_LPAE       0x3000
+#define VMEM_LPAE_PGD_ENTRIES   4
+
+#define VMEM_PAGE_SIZE          4096
+
+/* Descriptors are fetched a line at a time, as a walk of adjacent pages reuses them */
+#define VMEM_CACHE_LINE         64
+#define VMEM_CACHE_LINES        32
+
+/* Bounds the copy through a large section, and a walk of a corrupt task list */
+#define VMEM_CHUNK              (64 << 10)
+#define VMEM_TASKS_MAX          65536
+
+/* Short descriptors */
+#define VMEM_L1_TYPE_MASK       3
+#define VMEM_L1_COARSE          1
+#define VMEM_L1_SECTION         2
+#define VMEM_L1_SUPERSECTION    (1 << 18)
+#define VMEM_L1_SUPER_EXT       0x00f001e0
+#define VMEM_L2_TYPE_MASK       3
+#define VMEM_L2_LARGE           1
+
+/* Long descriptors */
+#define VMEM_LPAE_TYPE_MASK     3
+#define VMEM_LPAE_BLOCK         1
+#define VMEM_LPAE_TABLE         3
+#define VMEM_LPAE_ADDR_MASK     0x000000fffffff000ULL
+
+struct vmem_line {
+    bool valid;
+    uint32_t phys;
+    uint8_t data[VMEM_CACHE_LINE];
+};
+
+struct vmem {
+    struct soc *soc;
+    uint32_t page_offset;
+    uint32_t ram_start;
+    uint32_t ram_len;
+    bool lpae;
+    uint32_t pgd;
+    struct vmem_line cache[VMEM_CACHE_LINES];
+    unsigned long lookups;
+    unsigned long fetches;
+};
+
+int vmem_parse_task_layout(const char *arg, struct vmem_task_layout *layout)
+{
+    unsigned long val[4];
+    const char *cur = arg;
+    char *endp;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(val); i++) {
+        errno = 0;
+        val[i] = strtoul(cur, &endp, 0);
+        if (errno || endp == cur || val[i] > UINT16_MAX)
+            return -EINVAL;
+
+        if (*endp != (i == ARRAY_SIZE(val) - 1 ? '\0' : ','))
+            return -EINVAL;
+
+        cur = endp + 1;
+    }
+
+    layout->tasks = val[0];
+    layout->pid = val[1];
+    layout->mm = val[2];
+    layout->pgd = val[3];
+    layout->known = true;
+
+    return 0;
+}
+
+static int vmem_read_phys(struct vmem *ctx, uint32_t phys, void *buf,
+                          size_t len)
+{
+    ssize_t rc;
+
+    if (phys < ctx->ram_start ||
+            (uint64_t)phys + len > (uint64_t)ctx->ram_start + ctx->ram_len)
+        return -ERANGE;
+
+    if ((rc = soc_read(ctx->soc, phys, buf, len)) < 0)
+        return rc;
+
+    return (size_t)rc == len ? 0 : -EIO;
+}
+
+static int vmem_linear(struct vmem *ctx, uint32_t virt, uint32_t *phys)
+{
+    if (virt < ctx->page_offset || virt - ctx->page_offset >= ctx->ram_len) {
+        loge("Kernel address 0x%08" PRIx32 " is outside the linear map\n", virt);
+        return -ERANGE;
+    }
+
+    *phys = ctx->ram_start + (virt - ctx->page_offset);
+
+    return 0;
+}
+
+static int vmem_read_word(struct vmem *ctx, uint32_t virt, uint32_t *val)
+{
+    uint32_t phys;
+    uint8_t buf[4];
+    int rc;
+
+    if ((rc = vmem_linear(ctx, virt, &phys)) < 0)
+        return rc;
+
+    if ((rc = vmem_read_phys(ctx, phys, buf, sizeof(buf))) < 0)
+        return rc;
+
+    *val = buf[0] | buf[1] << 8 | buf[2] << 16 | (uint32_t)buf[3] << 24;
+
+    return 0;
+}
+
+/*
+ * Only this command's reads go through the cache, so a BMC remapping pages
+ * under a long copy can leave it stale. That's no worse than the copy itself
+ * racing the BMC.
+ */
+static int vmem_desc(struct vmem *ctx, uint32_t phys, size_t len,
+                     uint64_t *desc)
+{
+    uint32_t base = phys & ~(VMEM_CACHE_LINE - 1);
+    struct vmem_line *line;
+    size_t off, i;
+    int rc;
+
+    line = &ctx->cache[(base / VMEM_CACHE_LINE) % VMEM_CACHE_LINES];
+    ctx->lookups++;
+
+    if (!line->valid || line->phys != base) {
+        line->valid = false;
+        if ((rc = vmem_read_phys(ctx, base, line->data, sizeof(line->data))) < 0) {
+            loge("Failed to fetch page table entries at 0x%08" PRIx32 ": %d\n",
+                 base, rc);
+            return rc;
+        }
+        line->phys = base;
+        line->valid = true;
+        ctx->fetches++;
+    }
+
+    off = phys - base;
+    *desc = 0;
+    for (i = 0; i < len; i++)
+        *desc |= (uint64_t)line->data[off + i] << (8 * i);
+
+    return 0;
+}
+
+/* Sections, supersections, and coarse tables of large and small pages */
+static int vmem_walk_short(struct vmem *ctx, uint32_t virt, uint32_t *phys,
+                           uint32_t *size)
+{
+    uint64_t l1, l2;
+    uint32_t table;
+    int rc;
+
+    if ((rc = vmem_desc(ctx, ctx->pgd + (virt >> 20) * 4, 4, &l1)) < 0)
+        return rc;
+
+    switch (l1 & VMEM_L1_TYPE_MASK) {
+        case VMEM_L1_SECTION:
+            if (l1 & VMEM_L1_SUPERSECTION) {
+                /* Beyond the AHB's reach */
+                if (l1 & VMEM_L1_SUPER_EXT)
+                    return -ERANGE;
+                *size = 1 << 24;
+            } else {
+                *size = 1 << 20;
+            }
+            *phys = (l1 & ~(*size - 1)) | (virt & (*size - 1));
+            return 0;
+        case VMEM_L1_COARSE:
+            table = l1 & 0xfffffc00;
+            if ((rc = vmem_desc(ctx, table + ((virt >> 12) & 0xff) * 4, 4, &l2)) < 0)
+                return rc;
+
+            if (!(l2 & VMEM_L2_TYPE_MASK))
+                return -EFAULT;
+
+            *size = (l2 & VMEM_L2_TYPE_MASK) == VMEM_L2_LARGE ? 1 << 16 : 1 << 12;
+            *phys = (l2 & ~(*size - 1)) | (virt & (*size - 1));
+            return 0;
+        default:
+            /* Faults, and the fine tables Linux doesn't use */
+            return -EFAULT;
+    }
+}
+
+/* Three levels from a four-entry table, with 1GiB and 2MiB blocks */
+static int vmem_walk_lpae(struct vmem *ctx, uint32_t virt, uint32_t *phys,
+                          uint32_t *size)
+{
+    static const struct {
+        unsigned int shift;
+        uint32_t mask;
+    } levels[] = { { 30, 0x3 }, { 21, 0x1ff }, { 12, 0x1ff } };
+    uint64_t table = ctx->pgd;
+    uint64_t desc, out;
+    size_t i;
+    int rc;
+
+    for (i = 0; i < ARRAY_SIZE(levels); i++) {
+        uint32_t idx = (virt >> levels[i].shift) & levels[i].mask;
+        bool last = i == ARRAY_SIZE(levels) - 1;
+
+        if (table > UINT32_MAX)
+            return -ERANGE;
+
+        if ((rc = vmem_desc(ctx, table + idx * 8, 8, &desc)) < 0)
+            return rc;
+
+        if ((desc & VMEM_LPAE_TYPE_MASK) == VMEM_LPAE_TABLE && !last) {
+            table = desc & VMEM_LPAE_ADDR_MASK;
+            continue;
+        }
+
+        /* A level 3 page has the table encoding, levels 1 and 2 blocks not */
+        if ((desc & VMEM_LPAE_TYPE_MASK) != (last ? VMEM_LPAE_TABLE : VMEM_LPAE_BLOCK))
+            return -EFAULT;
+
+        *size = 1u << levels[i].shift;
+        out = (desc & VMEM_LPAE_ADDR_MASK & ~(uint64_t)(*size - 1)) |
+              (virt & (*size - 1));
+        if (out > UINT32_MAX)
+            return -ERANGE;
+
+        *phys = out;
+
+        return 0;
+    }
+
+    return -EFAULT;
+}
+
+/* Where @virt lands, and how much of the mapping is left from there */
+static int vmem_translate(struct vmem *ctx, uint32_t virt, uint32_t *phys,
+                          uint32_t *span)
+{
+    uint32_t size;
+    int rc;
+
+    rc = ctx->lpae ? vmem_walk_lpae(ctx, virt, phys, &size) :
+                     vmem_walk_short(ctx, virt, phys, &size);
+    if (rc < 0)
+        return rc;
+
+    *span = size - (virt & (size - 1));
+
+    return 0;
+}
+
+/*
+ * Only the AST2600's Cortex-A7 can run an LPAE kernel. Its swapper_pg_dir is
+ * then four table entries pointing at the pages immediately following.
+ */
+static int vmem_detect_lpae(struct vmem *ctx)
+{
+    uint32_t pgd = ctx->ram_start + VMEM_SWAPPER_LPAE;
+    uint64_t desc;
+    int i, rc;
+
+    if (!rev_is_generation(ctx->soc->rev, ast_g6))
+        return 0;
+
+    for (i = 0; i < VMEM_LPAE_PGD_ENTRIES; i++) {
+        if ((rc = vmem_desc(ctx, pgd + i * 8, 8, &desc)) < 0)
+            return rc;
+
+        if ((desc & VMEM_LPAE_TYPE_MASK) != VMEM_LPAE_TABLE ||
+                (desc & VMEM_LPAE_ADDR_MASK) != pgd + (i + 1) * VMEM_PAGE_SIZE)
+            return 0;
+    }
+
+    return 1;
+}
+
+static int vmem_find_task(struct vmem *ctx, const struct vmem_task_layout *l,
+                          uint32_t init_task, long pid, uint32_t *pgd)
+{
+    uint32_t head = init_task + l->tasks;
+    uint32_t cur, task, val, mm;
+    unsigned int i;
+    int rc;
+
+    if ((rc = vmem_read_word(ctx, head, &cur)) < 0)
+        return rc;
+
+    for (i = 0; cur != head; i++) {
+        if (i == VMEM_TASKS_MAX) {
+            loge("The task list doesn't return to init_task\n");
+            return -ELOOP;
+        }
+
+        task = cur - l->tasks;
+        if ((rc = vmem_read_word(ctx, task + l->pid, &val)) < 0)
+            return rc;
+
+        if ((long)(int32_t)val == pid) {
+            if ((rc = vmem_read_word(ctx, task + l->mm, &mm)) < 0)
+                return rc;
+
+            if (!mm) {
+                loge("PID %ld is a kernel thread, read from 'kernel' instead\n", pid);
+                return -EINVAL;
+            }
+
+            return vmem_read_word(ctx, mm + l->pgd, pgd);
+        }
+
+        if ((rc = vmem_read_word(ctx, cur, &cur)) < 0)
+            return rc;
+    }
+
+    loge("No process with PID %ld\n", pid);
+
+    return -ESRCH;
+}
+
+static int vmem_find_pgd(struct vmem *ctx, const struct vmem_opts *opts,
+                         long pid)
+{
+    struct sysmap_sym syms[] = {
+        { .name = "swapper_pg_dir" },
+        { .name = "init_task" },
+    };
+    uint32_t pgd;
+    int rc;
+
+    if (opts->system_map &&
+            (rc = sysmap_resolve(opts->system_map, syms, ARRAY_SIZE(syms))) < 0)
+        return rc;
+
+    if (pid == VMEM_KERNEL) {
+        if (syms[0].addr)
+            return vmem_linear(ctx, syms[0].addr, &ctx->pgd);
+
+        ctx->pgd = ctx->ram_start +
+                   (ctx->lpae ? VMEM_SWAPPER_LPAE : VMEM_SWAPPER_SHORT);
+
+        return 0;
+    }
+
+    if (!syms[1].addr || !opts->task.known) {
+        loge("Finding a process's page tables needs --system-map with init_task, and --task-layout\n");
+        return -EINVAL;
+    }
+
+    if ((rc = vmem_find_task(ctx, &opts->task, syms[1].addr, pid, &pgd)) < 0)
+        return rc;
+
+    return vmem_linear(ctx, pgd, &ctx->pgd);
+}
+
+int vmem_read(struct soc *soc, const struct vmem_opts *opts, long pid,
+              uint32_t virt, uint32_t len, FILE *out)
+{
+    struct soc_region dram, vram;
+    struct vmem *ctx;
+    uint32_t phys, span, chunk;
+    struct sdmc *sdmc;
+    uint8_t *buf;
+    int rc;
+
+    if ((uint64_t)virt + len > (uint64_t)UINT32_MAX + 1)
+        return -EINVAL;
+
+    if (!(sdmc = sdmc_get(soc))) {
+        loge("Failed to acquire SDRAM memory controller\n");
+        return -ENODEV;
+    }
+
+    if ((rc = sdmc_get_dram(sdmc, &dram)) < 0 ||
+            (rc = sdmc_get_vram(sdmc, &vram)) < 0) {
+        loge("Failed to locate DRAM: %d\n", rc);
+        return rc;
+    }
+
+    if (!(ctx = calloc(1, sizeof(*ctx))))
+        return -ENOMEM;
+
+    if (!(buf = malloc(VMEM_CHUNK))) {
+        rc = -ENOMEM;
+        goto cleanup_ctx;
+    }
+
+    ctx->soc = soc;
+    ctx->page_offset = opts->page_offset;
+    ctx->ram_start = dram.start;
+    ctx->ram_len = dram.length - vram.length;
+
+    if ((rc = vmem_detect_lpae(ctx)) < 0)
+        goto cleanup_buf;
+
+    ctx->lpae = rc;
+
+    if ((rc = vmem_find_pgd(ctx, opts, pid)) < 0)
+        goto cleanup_buf;
+
+    logd("Walking %s page tables at 0x%08" PRIx32 "\n",
+         ctx->lpae ? "LPAE" : "short-descriptor", ctx->pgd);
+
+    while (len) {
+        if ((rc = vmem_translate(ctx, virt, &phys, &span)) < 0) {
+            loge("Failed to translate 0x%08" PRIx32 ": %d\n", virt, rc);
+            goto cleanup_buf;
+        }
+
+        chunk = len < span ? len : span;
+        if (chunk > VMEM_CHUNK)
+            chunk = VMEM_CHUNK;
+
+        if ((rc = vmem_read_phys(ctx, phys, buf, chunk)) < 0) {
+            loge("Failed to read 0x%08" PRIx32 " at 0x%08" PRIx32 ": %d\n",
+                 virt, phys, rc);
+            goto cleanup_buf;
+        }
+
+        if (fwrite(buf, 1, chunk, out) != chunk) {
+            rc = -EIO;
+            goto cleanup_buf;
+        }
+
+        virt += chunk;
+        len -= chunk;
+    }
+
+    logd("Fetched %lu page table lines for %lu descriptors\n",
+         ctx->fetches, ctx->lookups);
+
+    rc = fflush(out) ? -errno : 0;
+
+cleanup_buf:
+    free(buf);
+
+cleanup_ctx:
+    free(ctx);
+
+    return rc;
+}
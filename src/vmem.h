@@ -0,0 +1,49 @@
+/* SPDX-License-Identifier: Apache-2.0 */
+
+#ifndef _VMEM_H
+#define _VMEM_H
+
+#include "soc.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/* Selects the kernel's own page tables rather than a process's */
+#define VMEM_KERNEL             (-1L)
+
+/* Where a process's page tables hang off its task_struct, build-specific */
+struct vmem_task_layout {
+    bool known;
+    /* offsetof(struct task_struct, tasks) */
+    uint32_t tasks;
+    /* offsetof(struct task_struct, pid) */
+    uint32_t pid;
+    /* offsetof(struct task_struct, mm) */
+    uint32_t mm;
+    /* offsetof(struct mm_struct, pgd) */
+    uint32_t pgd;
+};
+
+struct vmem_opts {
+    /* The kernel's System.map, for swapper_pg_dir and init_task */
+    const char *system_map;
+    /* Virtual address of the start of DRAM in the kernel's linear map */
+    uint32_t page_offset;
+    struct vmem_task_layout task;
+};
+
+/* Parses TASKS,PID,MM,PGD offsets as given to --task-layout */
+int vmem_parse_task_layout(const char *arg, struct vmem_task_layout *layout);
+
+/*
+ * Copies @len bytes from @virt in the address space of @pid, or of the kernel
+ * for VMEM_KERNEL, to @out. The BMC's page tables are walked as they're
+ * needed, short-descriptor or LPAE as the kernel has them, so only the pages
+ * touched are fetched. Finding a process's tables needs a System.map and the
+ * task layout.
+ */
+int vmem_read(struct soc *soc, const struct vmem_opts *opts, long pid,
+              uint32_t virt, uint32_t len, FILE *out);
+
+#endif